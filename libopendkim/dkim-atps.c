@@ -24,6 +24,7 @@
 #include "dkim-internal.h"
 #include "dkim-types.h"
 #include "dkim-tables.h"
+#include "dkim-mdpool.h"
 #include "util.h"
 
 #ifdef USE_GNUTLS
@@ -175,37 +176,39 @@ dkim_atps_check(DKIM *dkim, DKIM_SIGINFO *sig, struct timeval *timeout,
 		gnutls_hash_deinit(ctx, digest);
 # else /* USE_GNUTLS */
             {
-                EVP_MD_CTX *md_ctx = EVP_MD_CTX_new();
+                EVP_MD_CTX *md_ctx;
+                struct dkim_mdpool *pool;
                 const EVP_MD *md_type;
                 unsigned int digest_len;
 
-                if (md_ctx == NULL)
-                {
-                    /* handle allocation failure */
-                    return DKIM_STAT_INTERNAL;
-                }
+                pool = dkim->dkim_libhandle->dkiml_mdpool;
 
                 switch (hash)
                 {
                   case DKIM_HASHTYPE_SHA256:
-                        md_type = EVP_sha256();
+                        md_type = dkim_mdpool_sha256(pool);
                         break;
 
                   default:
-                        EVP_MD_CTX_free(md_ctx);
                         assert(0);
                         return DKIM_STAT_INTERNAL;
                 }
 
-                if (EVP_DigestInit_ex(md_ctx, md_type, NULL) != 1 ||
-                    EVP_DigestUpdate(md_ctx, sdomain, strlen(sdomain)) != 1 ||
+                md_ctx = dkim_mdpool_get(pool, md_type);
+                if (md_ctx == NULL)
+                {
+                    /* handle allocation failure */
+                    return DKIM_STAT_INTERNAL;
+                }
+
+                if (EVP_DigestUpdate(md_ctx, sdomain, strlen(sdomain)) != 1 ||
                     EVP_DigestFinal_ex(md_ctx, digest, &digest_len) != 1)
                 {
-                    EVP_MD_CTX_free(md_ctx);
+                    dkim_mdpool_put(pool, md_ctx);
                     return DKIM_STAT_INTERNAL;
                 }
 
-                EVP_MD_CTX_free(md_ctx);
+                dkim_mdpool_put(pool, md_ctx);
             }
 # endif /* USE_GNUTLS */
 
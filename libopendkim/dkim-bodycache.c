@@ -0,0 +1,635 @@
+/*
+**  Copyright 2025 OpenDKIM contributors.
+*/
+
+#include "build-config.h"
+
+/* system includes */
+#include <sys/types.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef USE_GNUTLS
+/* GnuTLS includes */
+# include <gnutls/gnutls.h>
+# include <gnutls/crypto.h>
+#else /* USE_GNUTLS */
+/* OpenSSL includes */
+# include <openssl/rand.h>
+#endif /* USE_GNUTLS */
+
+/* libopendkim includes */
+#include "dkim-internal.h"
+#include "dkim-bodycache.h"
+
+/*
+**  The fingerprint is two independently seeded 64-bit xxHash-style digests
+**  computed in one pass.  The first picks the bucket and the second is the
+**  secondary check; both, the body length, and the parameters that affect
+**  the body hash have to match before a cached digest is used.  The seeds
+**  are random per cache so colliding bodies can't be prepared in advance.
+*/
+
+#define	BC_P1		0x9E3779B185EBCA87ULL
+#define	BC_P2		0xC2B2AE3D27D4EB4FULL
+#define	BC_P3		0x165667B19E3779F9ULL
+#define	BC_P4		0x85EBCA77C2B2AE63ULL
+#define	BC_P5		0x27D4EB2F165667C5ULL
+
+#define	BC_ROTL(x, r)	(((x) << (r)) | ((x) >> (64 - (r))))
+
+#define	BC_MINBUCKETS	16
+
+/* struct dkim_bodycache_entry -- a cached body hash */
+struct dkim_bodycache_entry
+{
+	struct dkim_bodykey	bce_key;
+	ssize_t			bce_wrote;
+	size_t			bce_digestlen;
+	u_char			bce_digest[DKIM_BODYCACHE_MAXDIGEST];
+	struct dkim_bodycache_entry * bce_hnext;
+	struct dkim_bodycache_entry * bce_prev;
+	struct dkim_bodycache_entry * bce_next;
+};
+
+/* struct dkim_bodycache -- body hash cache */
+struct dkim_bodycache
+{
+	u_int			bc_max;
+	u_int			bc_count;
+	u_int			bc_nbuckets;
+	u_int			bc_lookups;
+	u_int			bc_hits;
+	uint64_t		bc_seed[2];
+	pthread_mutex_t		bc_lock;
+	struct dkim_bodycache_entry ** bc_buckets;
+	struct dkim_bodycache_entry * bc_head;	/* most recently used */
+	struct dkim_bodycache_entry * bc_tail;	/* least recently used */
+};
+
+/*
+**  BC_READ64 -- read eight bytes as a 64-bit word
+**
+**  Parameters:
+**  	p -- data
+**
+**  Return value:
+**  	The word; byte order doesn't matter as fingerprints never leave
+**  	the process.
+*/
+
+static inline uint64_t
+bc_read64(const u_char *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof v);
+	return v;
+}
+
+/*
+**  BC_READ32 -- read four bytes as a 32-bit word
+**
+**  Parameters:
+**  	p -- data
+**
+**  Return value:
+**  	The word.
+*/
+
+static inline uint32_t
+bc_read32(const u_char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof v);
+	return v;
+}
+
+/*
+**  BC_ROUND -- fold a word into an accumulator
+**
+**  Parameters:
+**  	acc -- accumulator
+**  	in -- word
+**
+**  Return value:
+**  	New accumulator.
+*/
+
+static inline uint64_t
+bc_round(uint64_t acc, uint64_t in)
+{
+	acc += in * BC_P2;
+	acc = BC_ROTL(acc, 31);
+	return acc * BC_P1;
+}
+
+/*
+**  BC_MERGE -- merge a lane into the digest
+**
+**  Parameters:
+**  	acc -- digest so far
+**  	lane -- lane accumulator
+**
+**  Return value:
+**  	New digest.
+*/
+
+static inline uint64_t
+bc_merge(uint64_t acc, uint64_t lane)
+{
+	acc ^= bc_round(0, lane);
+	return acc * BC_P1 + BC_P4;
+}
+
+/*
+**  BC_FINISH -- finish one fingerprint
+**
+**  Parameters:
+**  	v -- lane accumulators (only used if "len" is 32 or more)
+**  	seed -- seed
+**  	p -- bytes left over after the last full stripe
+**  	rem -- number of bytes at "p"
+**  	len -- total length
+**
+**  Return value:
+**  	The fingerprint.
+*/
+
+static uint64_t
+bc_finish(uint64_t *v, uint64_t seed, const u_char *p, size_t rem,
+          size_t len)
+{
+	uint64_t h;
+
+	if (len >= 32)
+	{
+		h = BC_ROTL(v[0], 1) + BC_ROTL(v[1], 7) +
+		    BC_ROTL(v[2], 12) + BC_ROTL(v[3], 18);
+		h = bc_merge(h, v[0]);
+		h = bc_merge(h, v[1]);
+		h = bc_merge(h, v[2]);
+		h = bc_merge(h, v[3]);
+	}
+	else
+	{
+		h = seed + BC_P5;
+	}
+
+	h += (uint64_t) len;
+
+	for (; rem >= 8; p += 8, rem -= 8)
+	{
+		h ^= bc_round(0, bc_read64(p));
+		h = BC_ROTL(h, 27) * BC_P1 + BC_P4;
+	}
+
+	if (rem >= 4)
+	{
+		h ^= (uint64_t) bc_read32(p) * BC_P1;
+		h = BC_ROTL(h, 23) * BC_P2 + BC_P3;
+		p += 4;
+		rem -= 4;
+	}
+
+	for (; rem > 0; p++, rem--)
+	{
+		h ^= (uint64_t) *p * BC_P5;
+		h = BC_ROTL(h, 11) * BC_P1;
+	}
+
+	h ^= h >> 33;
+	h *= BC_P2;
+	h ^= h >> 29;
+	h *= BC_P3;
+	h ^= h >> 32;
+
+	return h;
+}
+
+/*
+**  DKIM_BODYCACHE_FINGERPRINT -- fingerprint a raw body
+**
+**  Parameters:
+**  	bc -- body cache
+**  	buf -- body
+**  	len -- bytes at "buf"
+**  	fp -- array of two fingerprints (returned)
+**
+**  Return value:
+**  	None.
+*/
+
+void
+dkim_bodycache_fingerprint(struct dkim_bodycache *bc, const u_char *buf,
+                           size_t len, uint64_t *fp)
+{
+	int c;
+	uint64_t a[4];
+	uint64_t b[4];
+	const u_char *p;
+	const u_char *end;
+
+	assert(bc != NULL);
+	assert(buf != NULL || len == 0);
+	assert(fp != NULL);
+
+	a[0] = bc->bc_seed[0] + BC_P1 + BC_P2;
+	a[1] = bc->bc_seed[0] + BC_P2;
+	a[2] = bc->bc_seed[0];
+	a[3] = bc->bc_seed[0] - BC_P1;
+
+	b[0] = bc->bc_seed[1] + BC_P1 + BC_P2;
+	b[1] = bc->bc_seed[1] + BC_P2;
+	b[2] = bc->bc_seed[1];
+	b[3] = bc->bc_seed[1] - BC_P1;
+
+	p = buf;
+	end = buf + (len & ~((size_t) 31));
+
+	for (; p < end; p += 32)
+	{
+		for (c = 0; c < 4; c++)
+		{
+			uint64_t w;
+
+			w = bc_read64(p + c * 8);
+			a[c] = bc_round(a[c], w);
+			b[c] = bc_round(b[c], w);
+		}
+	}
+
+	fp[0] = bc_finish(a, bc->bc_seed[0], p, len & 31, len);
+	fp[1] = bc_finish(b, bc->bc_seed[1], p, len & 31, len);
+}
+
+/*
+**  BC_MATCH -- see if a key matches a cache entry
+**
+**  Parameters:
+**  	key -- key
+**  	bce -- entry
+**
+**  Return value:
+**  	TRUE iff every field matches.
+*/
+
+static _Bool
+bc_match(struct dkim_bodykey *key, struct dkim_bodycache_entry *bce)
+{
+	struct dkim_bodykey *k2;
+
+	k2 = &bce->bce_key;
+
+	return (key->bk_fp[0] == k2->bk_fp[0] &&
+	        key->bk_fp[1] == k2->bk_fp[1] &&
+	        key->bk_bodylen == k2->bk_bodylen &&
+	        key->bk_length == k2->bk_length &&
+	        key->bk_canon == k2->bk_canon &&
+	        key->bk_hashtype == k2->bk_hashtype &&
+	        key->bk_fixcrlf == k2->bk_fixcrlf);
+}
+
+/*
+**  BC_UNLINK -- remove an entry from the LRU list
+**
+**  Parameters:
+**  	bc -- body cache
+**  	bce -- entry
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+bc_unlink(struct dkim_bodycache *bc, struct dkim_bodycache_entry *bce)
+{
+	if (bce->bce_prev != NULL)
+		bce->bce_prev->bce_next = bce->bce_next;
+	else
+		bc->bc_head = bce->bce_next;
+
+	if (bce->bce_next != NULL)
+		bce->bce_next->bce_prev = bce->bce_prev;
+	else
+		bc->bc_tail = bce->bce_prev;
+
+	bce->bce_prev = NULL;
+	bce->bce_next = NULL;
+}
+
+/*
+**  BC_PUSH -- make an entry the most recently used one
+**
+**  Parameters:
+**  	bc -- body cache
+**  	bce -- entry (not on the LRU list)
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+bc_push(struct dkim_bodycache *bc, struct dkim_bodycache_entry *bce)
+{
+	bce->bce_prev = NULL;
+	bce->bce_next = bc->bc_head;
+	if (bc->bc_head != NULL)
+		bc->bc_head->bce_prev = bce;
+	bc->bc_head = bce;
+	if (bc->bc_tail == NULL)
+		bc->bc_tail = bce;
+}
+
+/*
+**  BC_FIND -- find an entry; caller holds the lock
+**
+**  Parameters:
+**  	bc -- body cache
+**  	key -- key
+**
+**  Return value:
+**  	The matching entry, or NULL.
+*/
+
+static struct dkim_bodycache_entry *
+bc_find(struct dkim_bodycache *bc, struct dkim_bodykey *key)
+{
+	struct dkim_bodycache_entry *bce;
+
+	for (bce = bc->bc_buckets[key->bk_fp[0] & (bc->bc_nbuckets - 1)];
+	     bce != NULL;
+	     bce = bce->bce_hnext)
+	{
+		if (bc_match(key, bce))
+			return bce;
+	}
+
+	return NULL;
+}
+
+/*
+**  DKIM_BODYCACHE_NEW -- create a body hash cache
+**
+**  Parameters:
+**  	max -- most entries to keep
+**
+**  Return value:
+**  	A new cache, or NULL on error.
+*/
+
+struct dkim_bodycache *
+dkim_bodycache_new(u_int max)
+{
+	struct dkim_bodycache *bc;
+
+	assert(max > 0);
+
+	bc = (struct dkim_bodycache *) malloc(sizeof *bc);
+	if (bc == NULL)
+		return NULL;
+
+	memset(bc, '\0', sizeof *bc);
+
+	bc->bc_max = max;
+	for (bc->bc_nbuckets = BC_MINBUCKETS;
+	     bc->bc_nbuckets < max && bc->bc_nbuckets < (1U << 30);
+	     bc->bc_nbuckets <<= 1)
+		continue;
+
+	bc->bc_buckets = calloc(bc->bc_nbuckets,
+	                        sizeof(struct dkim_bodycache_entry *));
+	if (bc->bc_buckets == NULL)
+	{
+		free(bc);
+		return NULL;
+	}
+
+#ifdef USE_GNUTLS
+	if (gnutls_rnd(GNUTLS_RND_NONCE, bc->bc_seed,
+	               sizeof bc->bc_seed) != 0)
+#else /* USE_GNUTLS */
+	if (RAND_bytes((u_char *) bc->bc_seed, sizeof bc->bc_seed) != 1)
+#endif /* USE_GNUTLS */
+	{
+		bc->bc_seed[0] = (uint64_t) time(NULL) * BC_P1;
+		bc->bc_seed[1] = ((uint64_t) getpid() << 32) ^
+		                 (uint64_t) (uintptr_t) bc;
+		bc->bc_seed[1] *= BC_P2;
+	}
+
+	if (pthread_mutex_init(&bc->bc_lock, NULL) != 0)
+	{
+		free(bc->bc_buckets);
+		free(bc);
+		return NULL;
+	}
+
+	return bc;
+}
+
+/*
+**  DKIM_BODYCACHE_FREE -- destroy a body hash cache
+**
+**  Parameters:
+**  	bc -- body cache
+**
+**  Return value:
+**  	None.
+*/
+
+void
+dkim_bodycache_free(struct dkim_bodycache *bc)
+{
+	struct dkim_bodycache_entry *bce;
+	struct dkim_bodycache_entry *next;
+
+	assert(bc != NULL);
+
+	for (bce = bc->bc_head; bce != NULL; bce = next)
+	{
+		next = bce->bce_next;
+		free(bce);
+	}
+
+	(void) pthread_mutex_destroy(&bc->bc_lock);
+	free(bc->bc_buckets);
+	free(bc);
+}
+
+/*
+**  DKIM_BODYCACHE_GET -- look up a body hash
+**
+**  Parameters:
+**  	bc -- body cache
+**  	key -- key
+**  	digest -- buffer of at least DKIM_BODYCACHE_MAXDIGEST bytes to
+**  	          receive the digest
+**  	dlen -- digest length (returned)
+**  	wrote -- canonicalized body length (returned)
+**
+**  Return value:
+**  	TRUE iff the body hash was found.
+*/
+
+_Bool
+dkim_bodycache_get(struct dkim_bodycache *bc, struct dkim_bodykey *key,
+                   u_char *digest, size_t *dlen, ssize_t *wrote)
+{
+	struct dkim_bodycache_entry *bce;
+
+	assert(bc != NULL);
+	assert(key != NULL);
+	assert(digest != NULL);
+	assert(dlen != NULL);
+	assert(wrote != NULL);
+
+	pthread_mutex_lock(&bc->bc_lock);
+
+	bc->bc_lookups++;
+
+	bce = bc_find(bc, key);
+	if (bce == NULL)
+	{
+		pthread_mutex_unlock(&bc->bc_lock);
+		return FALSE;
+	}
+
+	bc->bc_hits++;
+
+	bc_unlink(bc, bce);
+	bc_push(bc, bce);
+
+	memcpy(digest, bce->bce_digest, bce->bce_digestlen);
+	*dlen = bce->bce_digestlen;
+	*wrote = bce->bce_wrote;
+
+	pthread_mutex_unlock(&bc->bc_lock);
+
+	return TRUE;
+}
+
+/*
+**  DKIM_BODYCACHE_PUT -- store a body hash
+**
+**  Parameters:
+**  	bc -- body cache
+**  	key -- key
+**  	digest -- digest
+**  	dlen -- bytes at "digest"
+**  	wrote -- canonicalized body length
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	When the cache is full, the least recently used entry is replaced.
+*/
+
+void
+dkim_bodycache_put(struct dkim_bodycache *bc, struct dkim_bodykey *key,
+                   u_char *digest, size_t dlen, ssize_t wrote)
+{
+	u_int idx;
+	struct dkim_bodycache_entry *bce;
+	struct dkim_bodycache_entry **pp;
+
+	assert(bc != NULL);
+	assert(key != NULL);
+	assert(digest != NULL);
+
+	if (dlen > DKIM_BODYCACHE_MAXDIGEST)
+		return;
+
+	pthread_mutex_lock(&bc->bc_lock);
+
+	bce = bc_find(bc, key);
+	if (bce != NULL)
+	{
+		bc_unlink(bc, bce);
+	}
+	else if (bc->bc_count >= bc->bc_max)
+	{
+		/* recycle the least recently used entry */
+		bce = bc->bc_tail;
+		bc_unlink(bc, bce);
+
+		idx = bce->bce_key.bk_fp[0] & (bc->bc_nbuckets - 1);
+		for (pp = &bc->bc_buckets[idx];
+		     *pp != bce;
+		     pp = &(*pp)->bce_hnext)
+			continue;
+		*pp = bce->bce_hnext;
+
+		bce->bce_key = *key;
+		idx = key->bk_fp[0] & (bc->bc_nbuckets - 1);
+		bce->bce_hnext = bc->bc_buckets[idx];
+		bc->bc_buckets[idx] = bce;
+	}
+	else
+	{
+		bce = (struct dkim_bodycache_entry *) malloc(sizeof *bce);
+		if (bce == NULL)
+		{
+			pthread_mutex_unlock(&bc->bc_lock);
+			return;
+		}
+
+		bce->bce_key = *key;
+		idx = key->bk_fp[0] & (bc->bc_nbuckets - 1);
+		bce->bce_hnext = bc->bc_buckets[idx];
+		bc->bc_buckets[idx] = bce;
+		bc->bc_count++;
+	}
+
+	memcpy(bce->bce_digest, digest, dlen);
+	bce->bce_digestlen = dlen;
+	bce->bce_wrote = wrote;
+
+	bc_push(bc, bce);
+
+	pthread_mutex_unlock(&bc->bc_lock);
+}
+
+/*
+**  DKIM_BODYCACHE_STATS -- report body hash cache statistics
+**
+**  Parameters:
+**  	bc -- body cache
+**  	lookups -- lookups done (returned)
+**  	hits -- lookups that found a body hash (returned)
+**  	entries -- body hashes currently cached (returned)
+**  	reset -- reset the lookup and hit counters?
+**
+**  Return value:
+**  	None.
+*/
+
+void
+dkim_bodycache_stats(struct dkim_bodycache *bc, u_int *lookups, u_int *hits,
+                     u_int *entries, _Bool reset)
+{
+	assert(bc != NULL);
+
+	pthread_mutex_lock(&bc->bc_lock);
+
+	if (lookups != NULL)
+		*lookups = bc->bc_lookups;
+	if (hits != NULL)
+		*hits = bc->bc_hits;
+	if (entries != NULL)
+		*entries = bc->bc_count;
+
+	if (reset)
+	{
+		bc->bc_lookups = 0;
+		bc->bc_hits = 0;
+	}
+
+	pthread_mutex_unlock(&bc->bc_lock);
+}
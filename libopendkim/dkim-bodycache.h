@@ -0,0 +1,50 @@
+/*
+**  Copyright 2025 OpenDKIM contributors.
+*/
+
+#ifndef _DKIM_BODYCACHE_H_
+#define _DKIM_BODYCACHE_H_
+
+#include "build-config.h"
+
+/* system includes */
+#include <sys/types.h>
+#ifdef HAVE_STDBOOL_H
+# include <stdbool.h>
+#endif /* HAVE_STDBOOL_H */
+
+/* libopendkim includes */
+#include "dkim.h"
+
+/* limits, macros, etc. */
+#define	DKIM_BODYCACHE_DEFMAXBODY	(1024 * 1024)	/* largest body kept */
+#define	DKIM_BODYCACHE_MAXDIGEST	64		/* largest digest */
+
+/* struct dkim_bodykey -- what identifies a cached body hash */
+struct dkim_bodykey
+{
+	_Bool			bk_fixcrlf;
+	int			bk_hashtype;
+	dkim_canon_t		bk_canon;
+	ssize_t			bk_length;
+	size_t			bk_bodylen;
+	uint64_t		bk_fp[2];
+};
+
+struct dkim_bodycache;
+
+/* prototypes */
+extern void dkim_bodycache_fingerprint(struct dkim_bodycache *,
+                                       const u_char *, size_t, uint64_t *);
+extern void dkim_bodycache_free(struct dkim_bodycache *);
+extern _Bool dkim_bodycache_get(struct dkim_bodycache *,
+                                struct dkim_bodykey *, u_char *, size_t *,
+                                ssize_t *);
+extern struct dkim_bodycache *dkim_bodycache_new(u_int);
+extern void dkim_bodycache_put(struct dkim_bodycache *,
+                               struct dkim_bodykey *, u_char *, size_t,
+                               ssize_t);
+extern void dkim_bodycache_stats(struct dkim_bodycache *, u_int *, u_int *,
+                                 u_int *, _Bool);
+
+#endif /* ! _DKIM_BODYCACHE_H_ */
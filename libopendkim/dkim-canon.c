@@ -41,6 +41,8 @@
 /* libopendkim includes */
 #include "dkim-internal.h"
 #include "dkim-types.h"
+#include "dkim-bodycache.h"
+#include "dkim-mdpool.h"
 #include "dkim-canon.h"
 #include "dkim-util.h"
 #include "util.h"
@@ -127,9 +129,8 @@ dkim_canon_free(DKIM *dkim, DKIM_CANON *canon)
 				hash->hash_tmpbio = NULL;
 			}
 
-			/* Add EVP context cleanup */
-			if (hash->hash_ctx != NULL)
-				EVP_MD_CTX_free(hash->hash_ctx);
+			dkim_mdpool_put(dkim->dkim_libhandle->dkiml_mdpool,
+			                hash->hash_ctx);
 
 			break;
 		  }
@@ -444,6 +445,13 @@ dkim_canon_header_string(struct dkim_dstring *dstr, dkim_canon_t canon,
 **
 **  Return value:
 **  	A DKIM_STAT constant.
+**
+**  Notes:
+**  	"crlf" is only set for header fields of the message itself.  For
+**  	those, the simple form is passed along without copying, and the
+**  	relaxed form is built once and cached in the header handle for the
+**  	other canonicalizations (and, when re-signing with bound headers,
+**  	handles) that sign the same field.
 */
 
 static DKIM_STAT
@@ -456,6 +464,22 @@ dkim_canon_header(DKIM *dkim, DKIM_CANON *canon, struct dkim_header *hdr,
 	assert(canon != NULL);
 	assert(hdr != NULL);
 
+	dkim_canon_buffer(canon, NULL, 0);
+
+	if (crlf && canon->canon_canon == DKIM_CANON_SIMPLE)
+	{
+		dkim_canon_buffer(canon, hdr->hdr_text, hdr->hdr_textlen);
+		dkim_canon_buffer(canon, CRLF, 2);
+		return DKIM_STAT_OK;
+	}
+
+	if (crlf && hdr->hdr_relaxed != NULL)
+	{
+		dkim_canon_buffer(canon, hdr->hdr_relaxed,
+		                  hdr->hdr_relaxedlen);
+		return DKIM_STAT_OK;
+	}
+
 	if (dkim->dkim_canonbuf == NULL)
 	{
 		dkim->dkim_canonbuf = dkim_dstring_new(dkim, hdr->hdr_textlen,
@@ -468,8 +492,6 @@ dkim_canon_header(DKIM *dkim, DKIM_CANON *canon, struct dkim_header *hdr,
 		dkim_dstring_blank(dkim->dkim_canonbuf);
 	}
 
-	dkim_canon_buffer(canon, NULL, 0);
-
 	status = dkim_canon_header_string(dkim->dkim_canonbuf,
 	                                  canon->canon_canon,
 	                                  hdr->hdr_text, hdr->hdr_textlen,
@@ -480,6 +502,28 @@ dkim_canon_header(DKIM *dkim, DKIM_CANON *canon, struct dkim_header *hdr,
 	dkim_canon_buffer(canon, dkim_dstring_get(dkim->dkim_canonbuf),
 	                  dkim_dstring_len(dkim->dkim_canonbuf));
 
+	if (crlf)
+	{
+		DKIM *owner;
+
+		/* the header list's owner will free the cached copy */
+		owner = dkim;
+#ifdef _FFR_RESIGN
+		if (dkim->dkim_resign != NULL && dkim->dkim_hdrbind)
+			owner = dkim->dkim_resign;
+#endif /* _FFR_RESIGN */
+
+		/* failing to cache isn't fatal; it'll just be redone */
+		hdr->hdr_relaxedlen = dkim_dstring_len(dkim->dkim_canonbuf);
+		hdr->hdr_relaxed = DKIM_MALLOC(owner, hdr->hdr_relaxedlen);
+		if (hdr->hdr_relaxed != NULL)
+		{
+			memcpy(hdr->hdr_relaxed,
+			       dkim_dstring_get(dkim->dkim_canonbuf),
+			       hdr->hdr_relaxedlen);
+		}
+	}
+
 	return DKIM_STAT_OK;
 }
 
@@ -505,32 +549,99 @@ dkim_canon_flushblanks(DKIM_CANON *canon)
 	canon->canon_blanks = 0;
 }
 
+/*
+**  DKIM_CANON_CRLFOK -- see if a body chunk's line endings are all CRLF
+**
+**  Parameters:
+**  	buf -- buffer to check
+**  	buflen -- number of bytes at "buf"
+**  	prev -- byte that preceded "buf" in the body
+**
+**  Return value:
+**  	TRUE iff dkim_canon_fixcrlf() would not change anything.
+**
+**  Notes:
+**  	Well-formed text is skipped with memchr(), which the C library
+**  	typically implements with word or vector compares, rather than
+**  	being examined a byte at a time.  A CR at the very end is allowed
+**  	since its LF may begin the next chunk.
+*/
+
+static _Bool
+dkim_canon_crlfok(u_char *buf, size_t buflen, int prev)
+{
+	u_char *p;
+	u_char *lf;
+	u_char *eob;
+
+	eob = buf + buflen;
+
+	for (p = buf;
+	     (lf = (u_char *) memchr(p, '\n', eob - p)) != NULL;
+	     p = lf + 1)
+	{
+		/* each LF must follow a CR... */
+		if ((lf == buf ? prev : *(lf - 1)) != '\r')
+			return FALSE;
+
+		/* ...and that must be the only CR on the line */
+		if (lf - p > 1 && memchr(p, '\r', lf - p - 1) != NULL)
+			return FALSE;
+	}
+
+	if (eob - p > 1 && memchr(p, '\r', eob - p - 1) != NULL)
+		return FALSE;
+
+	return TRUE;
+}
+
 /*
 **  DKIM_CANON_FIXCRLF -- rebuffer a body chunk, fixing "naked" CRs and LFs
 **
 **  Parameters:
 **  	dkim -- DKIM handle
-**  	canon -- canonicalization being handled
 **  	buf -- buffer to be fixed
 **  	buflen -- number of bytes at "buf"
+**  	out -- repaired chunk (returned)
+**  	outlen -- number of bytes at "out" (returned)
 **
 **  Return value:
 **  	A DKIM_STAT_* constant.
 **
 **  Side effects:
-**  	dkim->dkim_canonbuf will be initialized and used.
+**  	If the chunk needs repair, dkim->dkim_canonbuf will be initialized
+**  	and used; otherwise "out" is simply "buf".
+**
+**  Notes:
+**  	This is done once per chunk, and the result shared by all of the
+**  	body canonicalizations.
 */
 
 static DKIM_STAT
-dkim_canon_fixcrlf(DKIM *dkim, DKIM_CANON *canon, u_char *buf, size_t buflen)
+dkim_canon_fixcrlf(DKIM *dkim, u_char *buf, size_t buflen,
+                   u_char **out, size_t *outlen)
 {
-	u_char prev;
+	int prev;
 	u_char *p;
+	u_char *q;
 	u_char *eob;
 
 	assert(dkim != NULL);
-	assert(canon != NULL);
 	assert(buf != NULL);
+	assert(out != NULL);
+	assert(outlen != NULL);
+
+	*out = buf;
+	*outlen = buflen;
+
+	if (buflen == 0)
+		return DKIM_STAT_OK;
+
+	prev = dkim->dkim_lastchar;
+	dkim->dkim_lastchar = buf[buflen - 1];
+
+	if (dkim_canon_crlfok(buf, buflen, prev))
+		return DKIM_STAT_OK;
 
 	if (dkim->dkim_canonbuf == NULL)
 	{
@@ -543,35 +654,43 @@ dkim_canon_fixcrlf(DKIM *dkim, DKIM_CANON *canon, u_char *buf, size_t buflen)
 		dkim_dstring_blank(dkim->dkim_canonbuf);
 	}
 
-	eob = buf + buflen - 1;
+	eob = buf + buflen;
 
-	prev = canon->canon_lastchar;
-
-	for (p = buf; p <= eob; p++)
+	for (p = buf; p < eob; p = q + 1)
 	{
-		if (*p == '\n' && prev != '\r')
-		{
-			/* fix a solitary LF */
-			dkim_dstring_catn(dkim->dkim_canonbuf, CRLF, 2);
-		}
-		else if (*p == '\r')
+		/* copy everything up to the next CR or LF as is */
+		for (q = p; q < eob && *q != '\r' && *q != '\n'; q++)
+			continue;
+
+		if (q > p)
+			dkim_dstring_catn(dkim->dkim_canonbuf, p, q - p);
+
+		if (q == eob)
+			break;
+
+		if (*q == '\n')
 		{
-			if (p < eob && *(p + 1) != '\n')
-				/* fix a solitary CR */
+			if ((q == buf ? prev : *(q - 1)) != '\r')
+				/* fix a solitary LF */
 				dkim_dstring_catn(dkim->dkim_canonbuf, CRLF, 2);
 			else
-				/* CR at EOL, or CR followed by a LF */
-				dkim_dstring_cat1(dkim->dkim_canonbuf, *p);
+				dkim_dstring_cat1(dkim->dkim_canonbuf, *q);
+		}
+		else if (q < eob - 1 && *(q + 1) != '\n')
+		{
+			/* fix a solitary CR */
+			dkim_dstring_catn(dkim->dkim_canonbuf, CRLF, 2);
 		}
 		else
 		{
-			/* something else */
-			dkim_dstring_cat1(dkim->dkim_canonbuf, *p);
+			/* CR at EOL, or CR followed by a LF */
+			dkim_dstring_cat1(dkim->dkim_canonbuf, *q);
 		}
-
-		prev = *p;
 	}
 
+	*out = dkim_dstring_get(dkim->dkim_canonbuf);
+	*outlen = dkim_dstring_len(dkim->dkim_canonbuf);
+
 	return DKIM_STAT_OK;
 }
 
@@ -663,7 +782,11 @@ dkim_canon_init(DKIM *dkim, _Bool tmp, _Bool keep)
 		  case DKIM_HASHTYPE_SHA256:
 		  {
 			struct dkim_hash *hash;
-			const EVP_MD *md = EVP_sha256();
+			struct dkim_mdpool *pool;
+			const EVP_MD *md;
+
+			pool = dkim->dkim_libhandle->dkiml_mdpool;
+			md = dkim_mdpool_sha256(pool);
 
 			hash = (struct dkim_hash *) DKIM_MALLOC(dkim,
 			                                            sizeof(struct dkim_hash));
@@ -678,12 +801,9 @@ dkim_canon_init(DKIM *dkim, _Bool tmp, _Bool keep)
 			memset(hash, '\0', sizeof(struct dkim_hash));
 			hash->hash_tmpfd = -1;  // Initialize temp file descriptor
 
-			hash->hash_ctx = EVP_MD_CTX_new();
-			if (hash->hash_ctx == NULL ||
-				EVP_DigestInit_ex(hash->hash_ctx, md, NULL) != 1)
+			hash->hash_ctx = dkim_mdpool_get(pool, md);
+			if (hash->hash_ctx == NULL)
 			{
-				if (hash->hash_ctx != NULL)
-					EVP_MD_CTX_free(hash->hash_ctx);
 				DKIM_FREE(dkim, hash);
 				return DKIM_STAT_NORESOURCE;
 			}
@@ -695,7 +815,7 @@ dkim_canon_init(DKIM *dkim, _Bool tmp, _Bool keep)
 				status = dkim_tmpfile(dkim, &fd, keep);
 				if (status != DKIM_STAT_OK)
 				{
-					EVP_MD_CTX_free(hash->hash_ctx);
+					dkim_mdpool_put(pool, hash->hash_ctx);
 					DKIM_FREE(dkim, hash);
 					return status;
 				}
@@ -1526,8 +1646,8 @@ dkim_canon_minbody(DKIM *dkim)
 }
 
 /*
-**  DKIM_CANON_BODYCHUNK -- run a body chunk through all body
-**                          canonicalizations
+**  DKIM_CANON_RUNBODY -- run body bytes through all unfinished body
+**                        canonicalizations
 **
 **  Parameters:
 **  	dkim -- DKIM handle
@@ -1538,8 +1658,8 @@ dkim_canon_minbody(DKIM *dkim)
 **  	A DKIM_STAT_* constant.
 */
 
-DKIM_STAT
-dkim_canon_bodychunk(DKIM *dkim, u_char *buf, size_t buflen)
+static DKIM_STAT
+dkim_canon_runbody(DKIM *dkim, u_char *buf, size_t buflen)
 {
 	_Bool fixcrlf;
 	DKIM_STAT status;
@@ -1553,30 +1673,26 @@ dkim_canon_bodychunk(DKIM *dkim, u_char *buf, size_t buflen)
 
 	assert(dkim != NULL);
 
-	dkim->dkim_bodylen += buflen;
-
 	fixcrlf = (dkim->dkim_libhandle->dkiml_flags & DKIM_LIBFLAGS_FIXCRLF);
 
+	start = buf;
+	plen = buflen;
+
+	if (fixcrlf)
+	{
+		status = dkim_canon_fixcrlf(dkim, buf, buflen, &start, &plen);
+		if (status != DKIM_STAT_OK)
+			return status;
+	}
+
+	eob = start + plen - 1;
+
 	for (cur = dkim->dkim_canonhead; cur != NULL; cur = cur->canon_next)
 	{
 		/* skip done hashes and those which are of the wrong type */
 		if (cur->canon_done || cur->canon_hdr)
 			continue;
 
-		start = buf;
-		plen = buflen;
-
-		if (fixcrlf)
-		{
-			status = dkim_canon_fixcrlf(dkim, cur, buf, buflen);
-			if (status != DKIM_STAT_OK)
-				return status;
-
-			start = dkim_dstring_get(dkim->dkim_canonbuf);
-			plen = dkim_dstring_len(dkim->dkim_canonbuf);
-		}
-
-		eob = start + plen - 1;
 		wrote = start;
 		wlen = 0;
 
@@ -1801,6 +1917,145 @@ dkim_canon_bodychunk(DKIM *dkim, u_char *buf, size_t buflen)
 	return DKIM_STAT_OK;
 }
 
+/*
+**  DKIM_CANON_UNMEMO -- stop holding the body for the body hash cache
+**
+**  Parameters:
+**  	dkim -- DKIM handle
+**  	run -- canonicalize what was held?
+**
+**  Return value:
+**  	A DKIM_STAT_* constant.
+**
+**  Notes:
+**  	Once this is done, the rest of the body is canonicalized as it
+**  	arrives.
+*/
+
+static DKIM_STAT
+dkim_canon_unmemo(DKIM *dkim, _Bool run)
+{
+	DKIM_STAT status = DKIM_STAT_OK;
+
+	dkim->dkim_bodymemo = FALSE;
+
+	if (dkim->dkim_bodybuf != NULL)
+	{
+		if (run && dkim_dstring_len(dkim->dkim_bodybuf) > 0)
+		{
+			status = dkim_canon_runbody(dkim,
+			                            dkim_dstring_get(dkim->dkim_bodybuf),
+			                            dkim_dstring_len(dkim->dkim_bodybuf));
+		}
+
+		dkim_dstring_free(dkim->dkim_bodybuf);
+		dkim->dkim_bodybuf = NULL;
+	}
+
+	return status;
+}
+
+/*
+**  DKIM_CANON_BODYCHUNK -- run a body chunk through all body
+**                          canonicalizations
+**
+**  Parameters:
+**  	dkim -- DKIM handle
+**  	buf -- pointer to bytes to canonicalize
+**  	buflen -- number of bytes to canonicalize
+**
+**  Return value:
+**  	A DKIM_STAT_* constant.
+**
+**  Notes:
+**  	When signing with a body hash cache, the body is only collected
+**  	here; dkim_canon_closebody() looks it up and canonicalizes it only
+**  	if its hash isn't already known.  A body that grows past the
+**  	library's limit is canonicalized as usual.
+*/
+
+DKIM_STAT
+dkim_canon_bodychunk(DKIM *dkim, u_char *buf, size_t buflen)
+{
+	DKIM_STAT status;
+
+	assert(dkim != NULL);
+
+	dkim->dkim_bodylen += buflen;
+
+	if (dkim->dkim_bodymemo)
+	{
+		size_t held = 0;
+
+		if (dkim->dkim_bodybuf != NULL)
+			held = dkim_dstring_len(dkim->dkim_bodybuf);
+
+		if (held + buflen <= dkim->dkim_libhandle->dkiml_bodycachemax)
+		{
+			if (dkim->dkim_bodybuf == NULL)
+			{
+				dkim->dkim_bodybuf = dkim_dstring_new(dkim,
+				                                      MAX(buflen,
+				                                          BUFRSZ),
+				                                      0);
+				if (dkim->dkim_bodybuf == NULL)
+					return DKIM_STAT_NORESOURCE;
+			}
+
+			if (!dkim_dstring_catn(dkim->dkim_bodybuf, buf, buflen))
+				return DKIM_STAT_NORESOURCE;
+
+			return DKIM_STAT_OK;
+		}
+
+		/* too big to remember; carry on without the cache */
+		status = dkim_canon_unmemo(dkim, TRUE);
+		if (status != DKIM_STAT_OK)
+			return status;
+	}
+
+	return dkim_canon_runbody(dkim, buf, buflen);
+}
+
+/*
+**  DKIM_CANON_SETFINAL -- install a known digest in a canonicalization
+**
+**  Parameters:
+**  	dkim -- DKIM handle
+**  	canon -- DKIM_CANON handle
+**  	digest -- digest
+**  	dlen -- bytes at "digest"
+**
+**  Return value:
+**  	A DKIM_STAT_* constant.
+*/
+
+static DKIM_STAT
+dkim_canon_setfinal(DKIM *dkim, DKIM_CANON *canon, u_char *digest,
+                    size_t dlen)
+{
+	struct dkim_hash *hash;
+
+	hash = (struct dkim_hash *) canon->canon_hash;
+
+#ifdef USE_GNUTLS
+	hash->hash_out = DKIM_MALLOC(dkim, dlen);
+	if (hash->hash_out == NULL)
+	{
+		dkim_error(dkim, "unable to allocate %u bytes", dlen);
+		return DKIM_STAT_NORESOURCE;
+	}
+#else /* USE_GNUTLS */
+	if (dlen > sizeof hash->hash_out)
+		return DKIM_STAT_INTERNAL;
+#endif /* USE_GNUTLS */
+
+	memcpy(hash->hash_out, digest, dlen);
+	hash->hash_outlen = dlen;
+
+	return DKIM_STAT_OK;
+}
+
 /*
 **  DKIM_CANON_CLOSEBODY -- close all body canonicalizations
 **
@@ -1814,10 +2069,69 @@ dkim_canon_bodychunk(DKIM *dkim, u_char *buf, size_t buflen)
 DKIM_STAT
 dkim_canon_closebody(DKIM *dkim)
 {
+	_Bool memo;
+	_Bool miss = FALSE;
+	DKIM_STAT status;
 	DKIM_CANON *cur;
+	struct dkim_bodycache *bc;
+	struct dkim_bodykey key;
 
 	assert(dkim != NULL);
 
+	bc = dkim->dkim_libhandle->dkiml_bodycache;
+	memo = dkim->dkim_bodymemo;
+
+	if (memo)
+	{
+		u_char *body;
+
+		body = (u_char *) "";
+		memset(&key, '\0', sizeof key);
+		key.bk_fixcrlf = ((dkim->dkim_libhandle->dkiml_flags & DKIM_LIBFLAGS_FIXCRLF) != 0);
+		if (dkim->dkim_bodybuf != NULL)
+		{
+			body = dkim_dstring_get(dkim->dkim_bodybuf);
+			key.bk_bodylen = dkim_dstring_len(dkim->dkim_bodybuf);
+		}
+
+		dkim_bodycache_fingerprint(bc, body, key.bk_bodylen, key.bk_fp);
+
+		for (cur = dkim->dkim_canonhead;
+		     cur != NULL;
+		     cur = cur->canon_next)
+		{
+			size_t dlen;
+			u_char digest[DKIM_BODYCACHE_MAXDIGEST];
+
+			if (cur->canon_done || cur->canon_hdr)
+				continue;
+
+			key.bk_canon = cur->canon_canon;
+			key.bk_hashtype = cur->canon_hashtype;
+			key.bk_length = cur->canon_length;
+
+			if (!dkim_bodycache_get(bc, &key, digest, &dlen,
+			                        &cur->canon_wrote))
+			{
+				miss = TRUE;
+				continue;
+			}
+
+			status = dkim_canon_setfinal(dkim, cur, digest, dlen);
+			if (status != DKIM_STAT_OK)
+				return status;
+
+			cur->canon_done = TRUE;
+		}
+
+		/* whatever wasn't found has to be done the long way */
+		status = dkim_canon_unmemo(dkim, miss);
+		if (status != DKIM_STAT_OK)
+			return status;
+
+		memo = miss;
+	}
+
 	for (cur = dkim->dkim_canonhead; cur != NULL; cur = cur->canon_next)
 	{
 		/* skip done hashes or header canonicalizations */
@@ -1898,6 +2212,23 @@ dkim_canon_closebody(DKIM *dkim)
 		}
 
 		cur->canon_done = TRUE;
+
+		if (memo)
+		{
+			u_char *digest;
+			size_t dlen;
+
+			key.bk_canon = cur->canon_canon;
+			key.bk_hashtype = cur->canon_hashtype;
+			key.bk_length = cur->canon_length;
+
+			if (dkim_canon_getfinal(cur, &digest,
+			                        &dlen) == DKIM_STAT_OK)
+			{
+				dkim_bodycache_put(bc, &key, digest, dlen,
+				                   cur->canon_wrote);
+			}
+		}
 	}
 
 	return DKIM_STAT_OK;
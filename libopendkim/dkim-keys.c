@@ -301,6 +301,7 @@ dkim_get_key_dns(DKIM *dkim, DKIM_SIGINFO *sig, u_char *buf, size_t buflen)
 		if (status == DKIM_DNS_EXPIRED)
 		{
 			(void) lib->dkiml_dns_cancel(lib->dkiml_dns_service, q);
+			dkim->dkim_keyto_count++;
 			dkim_error(dkim, "'%s' query timed out", qname);
 			return DKIM_STAT_KEYFAIL;
 		}
@@ -0,0 +1,395 @@
+/*
+**  Copyright 2025 OpenDKIM contributors.
+*/
+
+#include "build-config.h"
+
+#ifndef USE_GNUTLS
+
+/* system includes */
+#include <sys/types.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* OpenSSL includes */
+#include <openssl/evp.h>
+#include <openssl/opensslv.h>
+
+/* libopendkim includes */
+#include "dkim-internal.h"
+#include "dkim-mdpool.h"
+
+/*
+**  Under OpenSSL 3, EVP_sha256() and friends are resolved through the
+**  provider machinery every time a context is initialized with them, and
+**  that lookup takes locks shared by every thread.  The pool fetches the
+**  digest once per library handle and keeps a few reset digest contexts
+**  per thread so a message's hashes don't each allocate a new one.  The
+**  per-thread lists are also linked into the pool so their contexts can
+**  all be released when the library handle is closed.
+**
+**  A thread's list is only ever freed by that thread's exit destructor,
+**  which can already be running (and waiting for the lock) when the pool
+**  is closed; pthread_key_delete() doesn't wait for it.  Each list
+**  therefore holds a reference to the pool, as does the library handle,
+**  and whichever drops the last one deletes the key and frees the pool.
+*/
+
+/* struct dkim_mdpool_cache -- one thread's idle digest contexts */
+struct dkim_mdpool_cache
+{
+	u_int			mc_nfree;
+	struct dkim_mdpool *	mc_pool;
+	struct dkim_mdpool_cache * mc_prev;
+	struct dkim_mdpool_cache * mc_next;
+	EVP_MD_CTX *		mc_free[DKIM_MDPOOL_MAXFREE];
+};
+
+/* struct dkim_mdpool -- digest algorithms and contexts for a library */
+struct dkim_mdpool
+{
+	_Bool			mp_fetched;
+	u_int			mp_refs;
+	pthread_key_t		mp_key;
+	pthread_mutex_t		mp_lock;
+	EVP_MD *		mp_sha256;
+	struct dkim_mdpool_cache * mp_caches;
+};
+
+/*
+**  DKIM_MDPOOL_CACHE_FREE -- release one thread's idle contexts
+**
+**  Parameters:
+**  	mc -- thread's cache
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkim_mdpool_cache_free(struct dkim_mdpool_cache *mc)
+{
+	u_int c;
+
+	for (c = 0; c < mc->mc_nfree; c++)
+		EVP_MD_CTX_free(mc->mc_free[c]);
+
+	free(mc);
+}
+
+/*
+**  DKIM_MDPOOL_DESTROY -- release a pool nothing refers to any more
+**
+**  Parameters:
+**  	mp -- pool
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkim_mdpool_destroy(struct dkim_mdpool *mp)
+{
+	assert(mp->mp_refs == 0);
+	assert(mp->mp_caches == NULL);
+
+	(void) pthread_key_delete(mp->mp_key);
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	if (mp->mp_fetched)
+		EVP_MD_free(mp->mp_sha256);
+#endif /* OPENSSL_VERSION_NUMBER >= 0x30000000L */
+
+	(void) pthread_mutex_destroy(&mp->mp_lock);
+
+	free(mp);
+}
+
+/*
+**  DKIM_MDPOOL_THREAD_DONE -- thread exit destructor
+**
+**  Parameters:
+**  	arg -- the exiting thread's cache
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	The cache's reference keeps "mp" alive until this drops it, even
+**  	if the pool has been closed in the meantime.
+*/
+
+static void
+dkim_mdpool_thread_done(void *arg)
+{
+	_Bool last;
+	struct dkim_mdpool *mp;
+	struct dkim_mdpool_cache *mc;
+
+	mc = (struct dkim_mdpool_cache *) arg;
+	mp = mc->mc_pool;
+
+	pthread_mutex_lock(&mp->mp_lock);
+
+	if (mc->mc_prev == NULL)
+		mp->mp_caches = mc->mc_next;
+	else
+		mc->mc_prev->mc_next = mc->mc_next;
+	if (mc->mc_next != NULL)
+		mc->mc_next->mc_prev = mc->mc_prev;
+
+	assert(mp->mp_refs > 0);
+	mp->mp_refs--;
+	last = (mp->mp_refs == 0);
+
+	pthread_mutex_unlock(&mp->mp_lock);
+
+	dkim_mdpool_cache_free(mc);
+
+	if (last)
+		dkim_mdpool_destroy(mp);
+}
+
+/*
+**  DKIM_MDPOOL_CACHE -- find or create the calling thread's cache
+**
+**  Parameters:
+**  	mp -- pool
+**  	create -- create one if the thread has none yet
+**
+**  Return value:
+**  	The thread's cache, or NULL if it has none and one could not
+**  	(or was not to) be created.
+*/
+
+static struct dkim_mdpool_cache *
+dkim_mdpool_cache(struct dkim_mdpool *mp, _Bool create)
+{
+	struct dkim_mdpool_cache *mc;
+
+	mc = (struct dkim_mdpool_cache *) pthread_getspecific(mp->mp_key);
+	if (mc != NULL || !create)
+		return mc;
+
+	mc = (struct dkim_mdpool_cache *) malloc(sizeof *mc);
+	if (mc == NULL)
+		return NULL;
+
+	memset(mc, '\0', sizeof *mc);
+	mc->mc_pool = mp;
+
+	if (pthread_setspecific(mp->mp_key, mc) != 0)
+	{
+		free(mc);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&mp->mp_lock);
+
+	mc->mc_next = mp->mp_caches;
+	if (mp->mp_caches != NULL)
+		mp->mp_caches->mc_prev = mc;
+	mp->mp_caches = mc;
+	mp->mp_refs++;
+
+	pthread_mutex_unlock(&mp->mp_lock);
+
+	return mc;
+}
+
+/*
+**  DKIM_MDPOOL_NEW -- create a digest pool
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	A new pool, or NULL on failure.
+*/
+
+struct dkim_mdpool *
+dkim_mdpool_new(void)
+{
+	struct dkim_mdpool *mp;
+
+	mp = (struct dkim_mdpool *) malloc(sizeof *mp);
+	if (mp == NULL)
+		return NULL;
+
+	memset(mp, '\0', sizeof *mp);
+	mp->mp_refs = 1;
+
+	if (pthread_key_create(&mp->mp_key, dkim_mdpool_thread_done) != 0)
+	{
+		free(mp);
+		return NULL;
+	}
+
+	if (pthread_mutex_init(&mp->mp_lock, NULL) != 0)
+	{
+		(void) pthread_key_delete(mp->mp_key);
+		free(mp);
+		return NULL;
+	}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	mp->mp_sha256 = EVP_MD_fetch(NULL, "SHA256", NULL);
+	if (mp->mp_sha256 != NULL)
+		mp->mp_fetched = TRUE;
+#endif /* OPENSSL_VERSION_NUMBER >= 0x30000000L */
+
+	if (mp->mp_sha256 == NULL)
+		mp->mp_sha256 = (EVP_MD *) EVP_sha256();
+
+	return mp;
+}
+
+/*
+**  DKIM_MDPOOL_FREE -- close a digest pool
+**
+**  Parameters:
+**  	mp -- pool to close
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Releases every thread's idle contexts.  Contexts still checked out
+**  	must not be returned afterward.  The per-thread lists themselves,
+**  	and with them the pool, are freed as their threads exit; if none
+**  	is left the pool is freed now.
+*/
+
+void
+dkim_mdpool_free(struct dkim_mdpool *mp)
+{
+	_Bool last;
+	u_int c;
+	struct dkim_mdpool_cache *mc;
+
+	assert(mp != NULL);
+
+	pthread_mutex_lock(&mp->mp_lock);
+
+	for (mc = mp->mp_caches; mc != NULL; mc = mc->mc_next)
+	{
+		for (c = 0; c < mc->mc_nfree; c++)
+			EVP_MD_CTX_free(mc->mc_free[c]);
+		mc->mc_nfree = 0;
+	}
+
+	assert(mp->mp_refs > 0);
+	mp->mp_refs--;
+	last = (mp->mp_refs == 0);
+
+	pthread_mutex_unlock(&mp->mp_lock);
+
+	if (last)
+		dkim_mdpool_destroy(mp);
+}
+
+/*
+**  DKIM_MDPOOL_SHA256 -- return the pool's SHA-256 implementation
+**
+**  Parameters:
+**  	mp -- pool, or NULL
+**
+**  Return value:
+**  	The pre-fetched SHA-256 digest, or EVP_sha256() if there's no pool.
+*/
+
+const EVP_MD *
+dkim_mdpool_sha256(struct dkim_mdpool *mp)
+{
+	if (mp == NULL)
+		return EVP_sha256();
+
+	return mp->mp_sha256;
+}
+
+/*
+**  DKIM_MDPOOL_GET -- check out a digest context
+**
+**  Parameters:
+**  	mp -- pool, or NULL
+**  	md -- digest with which to initialize the context, or NULL to
+**  	      return it uninitialized (e.g. for EVP_DigestSignInit())
+**
+**  Return value:
+**  	A digest context, or NULL on failure.  Give it back with
+**  	dkim_mdpool_put().
+*/
+
+EVP_MD_CTX *
+dkim_mdpool_get(struct dkim_mdpool *mp, const EVP_MD *md)
+{
+	EVP_MD_CTX *ctx = NULL;
+	struct dkim_mdpool_cache *mc;
+
+	if (mp != NULL)
+	{
+		mc = dkim_mdpool_cache(mp, TRUE);
+		if (mc != NULL && mc->mc_nfree > 0)
+		{
+			mc->mc_nfree--;
+			ctx = mc->mc_free[mc->mc_nfree];
+		}
+	}
+
+	if (ctx == NULL)
+	{
+		ctx = EVP_MD_CTX_new();
+		if (ctx == NULL)
+			return NULL;
+	}
+
+	if (md != NULL && EVP_DigestInit_ex(ctx, md, NULL) != 1)
+	{
+		EVP_MD_CTX_free(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+/*
+**  DKIM_MDPOOL_PUT -- return a digest context
+**
+**  Parameters:
+**  	mp -- pool, or NULL
+**  	ctx -- context to return
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	The context is reset and kept by the calling thread, which need
+**  	not be the one that checked it out.
+*/
+
+void
+dkim_mdpool_put(struct dkim_mdpool *mp, EVP_MD_CTX *ctx)
+{
+	struct dkim_mdpool_cache *mc;
+
+	if (ctx == NULL)
+		return;
+
+	mc = NULL;
+	if (mp != NULL)
+		mc = dkim_mdpool_cache(mp, FALSE);
+
+	if (mc == NULL || mc->mc_nfree >= DKIM_MDPOOL_MAXFREE ||
+	    EVP_MD_CTX_reset(ctx) != 1)
+	{
+		EVP_MD_CTX_free(ctx);
+		return;
+	}
+
+	mc->mc_free[mc->mc_nfree] = ctx;
+	mc->mc_nfree++;
+}
+
+#endif /* ! USE_GNUTLS */
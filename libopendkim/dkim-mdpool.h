@@ -0,0 +1,29 @@
+/*
+**  Copyright 2025 OpenDKIM contributors.
+*/
+
+#ifndef _DKIM_MDPOOL_H_
+#define _DKIM_MDPOOL_H_
+
+#include "build-config.h"
+
+#ifndef USE_GNUTLS
+
+/* OpenSSL includes */
+# include <openssl/evp.h>
+
+/* limits, macros, etc. */
+# define DKIM_MDPOOL_MAXFREE	8	/* idle contexts kept per thread */
+
+struct dkim_mdpool;
+
+/* prototypes */
+extern void dkim_mdpool_free(struct dkim_mdpool *);
+extern EVP_MD_CTX *dkim_mdpool_get(struct dkim_mdpool *, const EVP_MD *);
+extern struct dkim_mdpool *dkim_mdpool_new(void);
+extern void dkim_mdpool_put(struct dkim_mdpool *, EVP_MD_CTX *);
+extern const EVP_MD *dkim_mdpool_sha256(struct dkim_mdpool *);
+
+#endif /* ! USE_GNUTLS */
+
+#endif /* ! _DKIM_MDPOOL_H_ */
@@ -13,6 +13,7 @@
 
 /* system includes */
 #include <sys/types.h>
+#include <pthread.h>
 #ifdef HAVE_STDBOOL_H
 # include <stdbool.h>
 #endif /* HAVE_STDBOOL_H */
@@ -64,6 +65,13 @@ struct dkim_xtag
 	struct dkim_xtag *	xt_next;
 };
 
+/* struct dkim_olderr -- error buffer outgrown but possibly still in use */
+struct dkim_olderr
+{
+	u_char *		oe_buf;
+	struct dkim_olderr *	oe_next;
+};
+
 /* struct dkim_queryinfo -- DNS query information */
 struct dkim_queryinfo
 {
@@ -87,8 +95,10 @@ struct dkim_header
 	int			hdr_flags;
 	size_t			hdr_textlen;
 	size_t			hdr_namelen;
+	size_t			hdr_relaxedlen;
 	u_char *		hdr_text;
 	u_char *		hdr_colon;
+	u_char *		hdr_relaxed;	/* cached relaxed form */
 	struct dkim_header *	hdr_next;
 };
 
@@ -257,11 +267,13 @@ struct dkim
 	_Bool			dkim_hdrbind;
 #endif /* _FFR_RESIGN */
 	_Bool			dkim_eoh_reentry;
+	_Bool			dkim_bodymemo;
 	int			dkim_mode;
 	int			dkim_state;
 	int			dkim_chunkstate;
 	int			dkim_chunksm;
 	int			dkim_chunkcrlf;
+	int			dkim_lastchar;
 	int			dkim_timeout;
 	int			dkim_presult;
 	int			dkim_hdrcnt;
@@ -283,6 +295,12 @@ struct dkim
 	size_t			dkim_keylen;
 	size_t			dkim_errlen;
 	uint64_t		dkim_timestamp;
+	uint64_t		dkim_keyq_usec;
+	uint64_t		dkim_crypto_usec;
+	uint64_t		dkim_keyto_usec;
+	u_int			dkim_keyq_count;
+	u_int			dkim_crypto_count;
+	u_int			dkim_keyto_count;
   	struct dkim_qmethod *	dkim_querymethods;
 	dkim_canon_t		dkim_hdrcanonalg;
 	dkim_canon_t		dkim_bodycanonalg;
@@ -306,6 +324,8 @@ struct dkim
 	u_char *		dkim_conditional;
 #endif /* _FFR_CONDITIONAL */
 	u_char *		dkim_error;
+	pthread_mutex_t		dkim_errlock;
+	struct dkim_olderr *	dkim_olderr;
 	u_char *		dkim_hdrlist;
 	u_char *		dkim_zdecode;
 	u_char *		dkim_tmpdir;
@@ -328,6 +348,7 @@ struct dkim
 	struct dkim_canon *	dkim_canontail;
 	struct dkim_dstring *	dkim_hdrbuf;
 	struct dkim_dstring *	dkim_canonbuf;
+	struct dkim_dstring *	dkim_bodybuf;
 	struct dkim_dstring *	dkim_sslerrbuf;
 	struct dkim_test_dns_data * dkim_dnstesth;
 	struct dkim_test_dns_data * dkim_dnstestt;
@@ -341,15 +362,18 @@ struct dkim_lib
 	_Bool			dkiml_signre;
 	_Bool			dkiml_skipre;
 	_Bool			dkiml_dnsinit_done;
+	_Bool			dkiml_inuse;
 	u_int			dkiml_timeout;
 	u_int			dkiml_version;
 	u_int			dkiml_callback_int;
 	u_int			dkiml_flsize;
 	u_int			dkiml_minkeybits;
+	u_int			dkiml_bodycachesize;
 	uint32_t		dkiml_flags;
 	uint64_t		dkiml_fixedtime;
 	uint64_t		dkiml_sigttl;
 	uint64_t		dkiml_clockdrift;
+	size_t			dkiml_bodycachemax;
 	dkim_query_t		dkiml_querymethod;
 	u_int *			dkiml_flist;
 	void *			(*dkiml_malloc) (void *closure, size_t nbytes);
@@ -360,6 +384,10 @@ struct dkim_lib
 #ifdef QUERY_CACHE
 	DB *			dkiml_cache;
 #endif /* QUERY_CACHE */
+	struct dkim_bodycache *	dkiml_bodycache;
+#ifndef USE_GNUTLS
+	struct dkim_mdpool *	dkiml_mdpool;
+#endif /* ! USE_GNUTLS */
 	regex_t			dkiml_hdrre;
 	regex_t			dkiml_skiphdrre;
 	DKIM_CBSTAT		(*dkiml_key_lookup) (DKIM *dkim,
@@ -23,6 +23,7 @@
 #include <string.h>
 #include <errno.h>
 #include <stdio.h>
+#include <time.h>
 
 /* libopendkim includes */
 #include "dkim-internal.h"
@@ -608,3 +609,24 @@ dkim_dstring_printf(struct dkim_dstring *dstr, char *fmt, ...)
 
 	return dstr->ds_len;
 }
+
+/*
+**  DKIM_CLOCK_USEC -- read the monotonic clock
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	Microseconds since an arbitrary fixed point, suitable only for
+**  	measuring intervals.
+*/
+
+uint64_t
+dkim_clock_usec(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
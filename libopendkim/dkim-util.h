@@ -26,6 +26,7 @@
 #define	DKIM_FREE(x,y)		dkim_mfree((x)->dkim_libhandle, \
 				           (x)->dkim_closure, y)
 
+extern uint64_t dkim_clock_usec(void);
 extern void *dkim_malloc(DKIM_LIB *, void *, size_t);
 extern void dkim_mfree(DKIM_LIB *, void *, void *);
 extern unsigned char *dkim_strdup(DKIM *, const unsigned char *, size_t);
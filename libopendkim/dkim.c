@@ -32,9 +32,7 @@
 #include <string.h>
 #include <limits.h>
 #include <unistd.h>
-#ifndef USE_GNUTLS
-# include <pthread.h>
-#endif /* ! USE_GNUTLS */
+#include <pthread.h>
 #include <resolv.h>
 #ifdef USE_TRE
 # ifdef TRE_PRE_080
@@ -86,8 +84,10 @@
 #include "dkim-keys.h"
 #include "dkim-report.h"
 #include "dkim-util.h"
+#include "dkim-bodycache.h"
 #include "dkim-canon.h"
 #include "dkim-dns.h"
+#include "dkim-mdpool.h"
 #ifdef QUERY_CACHE
 # include "dkim-cache.h"
 #endif /* QUERY_CACHE */
@@ -127,6 +127,8 @@ void dkim_error(DKIM *, const char *, ...);
 #define	DKIM_CRLF_CRLF		1
 
 #define	DKIM_PHASH(x)		((x) - 32)
+#define	DKIM_TIMING(x)		(((x)->dkim_libhandle->dkiml_flags & \
+				  DKIM_LIBFLAGS_TIMING) != 0)
 
 #ifdef _FFR_DIFFHEADERS
 # define COST_INSERT		1
@@ -327,7 +329,8 @@ static int verify_dkim_rsa_sha256(DKIM *dkim, EVP_PKEY *pkey,
     }
 
     // Set the signature hash algorithm
-    if (EVP_PKEY_CTX_set_signature_md(pkey_ctx, EVP_sha256()) <= 0)
+    if (EVP_PKEY_CTX_set_signature_md(pkey_ctx,
+                                      dkim_mdpool_sha256(dkim->dkim_libhandle->dkiml_mdpool)) <= 0)
     {
         dkim_load_ssl_errors(dkim, 0);
         dkim_error(dkim, "s=%s d=%s: EVP_PKEY_CTX_set_signature_md failed",
@@ -3112,26 +3115,38 @@ dkim_get_key(DKIM *dkim, DKIM_SIGINFO *sig, _Bool test)
 	/* if no local function or it returned no result, make the query */
 	if (!gotreply)
 	{
+		u_int timeouts;
+		uint64_t start;
+		uint64_t elapsed;
+
+		timeouts = dkim->dkim_keyto_count;
+		start = (DKIM_TIMING(dkim) ? dkim_clock_usec() : 0);
+
 		/* use appropriate get method */
 		switch (sig->sig_query)
 		{
 		  case DKIM_QUERY_DNS:
 			status = (int) dkim_get_key_dns(dkim, sig, buf,
 			                                sizeof buf);
-			if (status != (int) DKIM_STAT_OK)
-				return (DKIM_STAT) status;
 			break;
 
 		  case DKIM_QUERY_FILE:
 			status = (int) dkim_get_key_file(dkim, sig, buf,
 			                                 sizeof buf);
-			if (status != (int) DKIM_STAT_OK)
-				return (DKIM_STAT) status;
 			break;
 
 		  default:
 			assert(0);
 		}
+
+		elapsed = (DKIM_TIMING(dkim) ? dkim_clock_usec() - start : 0);
+		dkim->dkim_keyq_usec += elapsed;
+		dkim->dkim_keyq_count++;
+		if (dkim->dkim_keyto_count != timeouts)
+			dkim->dkim_keyto_usec += elapsed;
+
+		if (status != (int) DKIM_STAT_OK)
+			return (DKIM_STAT) status;
 	}
 
 	/* decode the payload */
@@ -3569,6 +3584,14 @@ dkim_eoh_sign(DKIM *dkim)
 	if (status != DKIM_STAT_OK)
 		return status;
 
+	/* hold the body for the body hash cache if there is one */
+	if (lib->dkiml_bodycache != NULL && !tmp
+#ifdef _FFR_RESIGN
+	    && dkim->dkim_resign == NULL
+#endif /* _FFR_RESIGN */
+	   )
+		dkim->dkim_bodymemo = TRUE;
+
 	return DKIM_STAT_OK;
 }
 
@@ -4103,7 +4126,8 @@ dkim_eom_sign(DKIM *dkim)
 		}
 
 		/* Tell the EVP layer that the input is a SHA256 digest and should be wrapped */
-		if (EVP_PKEY_CTX_set_signature_md(pctx, EVP_sha256()) <= 0)
+		if (EVP_PKEY_CTX_set_signature_md(pctx,
+		                                  dkim_mdpool_sha256(dkim->dkim_libhandle->dkiml_mdpool)) <= 0)
 		{
 			dkim_load_ssl_errors(dkim, 0);
 			dkim_error(dkim, "EVP_PKEY_CTX_set_signature_md() failed");
@@ -4153,11 +4177,11 @@ dkim_eom_sign(DKIM *dkim)
 			return DKIM_STAT_INTERNAL;
 		}
 
-		md_ctx = EVP_MD_CTX_new();
+		md_ctx = dkim_mdpool_get(dkim->dkim_libhandle->dkiml_mdpool, NULL);
 		if (md_ctx == NULL)
 		{
 			dkim_load_ssl_errors(dkim, 0);
-			dkim_error(dkim, "EVP_MD_CTX_new() failed");
+			dkim_error(dkim, "failed to initialize digest context");
 			return DKIM_STAT_INTERNAL;
 		}
 
@@ -4166,7 +4190,7 @@ dkim_eom_sign(DKIM *dkim)
 		{
 			dkim_load_ssl_errors(dkim, 0);
 			dkim_error(dkim, "EVP_DigestSignInit() failed for Ed25519");
-			EVP_MD_CTX_free(md_ctx);
+			dkim_mdpool_put(dkim->dkim_libhandle->dkiml_mdpool, md_ctx);
 			return DKIM_STAT_INTERNAL;
 		}
 
@@ -4176,11 +4200,11 @@ dkim_eom_sign(DKIM *dkim)
 		{
 			dkim_load_ssl_errors(dkim, 0);
 			dkim_error(dkim, "EVP_DigestSign() failed for Ed25519");
-			EVP_MD_CTX_free(md_ctx);
+			dkim_mdpool_put(dkim->dkim_libhandle->dkiml_mdpool, md_ctx);
 			return DKIM_STAT_INTERNAL;
 		}
 
-		EVP_MD_CTX_free(md_ctx);
+		dkim_mdpool_put(dkim->dkim_libhandle->dkiml_mdpool, md_ctx);
 
 		l = (unsigned int) siglen_tmp;
 		crypto->crypto_outlen = l;
@@ -4524,6 +4548,10 @@ dkim_new(DKIM_LIB *libhandle, const unsigned char *id, void *memclosure,
 		return NULL;
 	}
 
+	/* options that can't change under live handles are now fixed */
+	if (!libhandle->dkiml_inuse)
+		libhandle->dkiml_inuse = TRUE;
+
 	/* populate defaults */
 	memset(new, '\0', sizeof(struct dkim));
 	new->dkim_id = id;
@@ -4542,6 +4570,7 @@ dkim_new(DKIM_LIB *libhandle, const unsigned char *id, void *memclosure,
 	new->dkim_libhandle = libhandle;
 	new->dkim_tmpdir = libhandle->dkiml_tmpdir;
 	new->dkim_timeout = libhandle->dkiml_timeout;
+	pthread_mutex_init(&new->dkim_errlock, NULL);
 
 	*statp = DKIM_STAT_OK;
 
@@ -4665,6 +4694,12 @@ dkim_init(void *(*caller_mallocf)(void *closure, size_t nbytes),
 #ifdef QUERY_CACHE
 	libhandle->dkiml_cache = NULL;
 #endif /* QUERY_CACHE */
+	libhandle->dkiml_bodycache = NULL;
+	libhandle->dkiml_bodycachesize = 0;
+	libhandle->dkiml_bodycachemax = DKIM_BODYCACHE_DEFMAXBODY;
+#ifndef USE_GNUTLS
+	libhandle->dkiml_mdpool = NULL;
+#endif /* ! USE_GNUTLS */
 	libhandle->dkiml_fixedtime = 0;
 	libhandle->dkiml_sigttl = 0;
 	libhandle->dkiml_clockdrift = DEFCLOCKDRIFT;
@@ -4679,11 +4714,15 @@ dkim_init(void *(*caller_mallocf)(void *closure, size_t nbytes),
 	libhandle->dkiml_dns_callback = NULL;
 	libhandle->dkiml_dns_service = NULL;
 	libhandle->dkiml_dnsinit_done = FALSE;
+	libhandle->dkiml_inuse = FALSE;
 	libhandle->dkiml_dns_init = dkim_res_init;
 	libhandle->dkiml_dns_close = dkim_res_close;
 	libhandle->dkiml_dns_start = dkim_res_query;
 	libhandle->dkiml_dns_cancel = dkim_res_cancel;
 	libhandle->dkiml_dns_waitreply = dkim_res_waitreply;
+	libhandle->dkiml_dns_setns = dkim_res_nslist;
+	libhandle->dkiml_dns_config = NULL;
+	libhandle->dkiml_dns_trustanchor = NULL;
 
 #define FEATURE_INDEX(x)	((x) / (8 * sizeof(u_int)))
 #define FEATURE_OFFSET(x)	((x) % (8 * sizeof(u_int)))
@@ -4699,6 +4738,16 @@ dkim_init(void *(*caller_mallocf)(void *closure, size_t nbytes),
 	memset(libhandle->dkiml_flist, '\0',
 	       sizeof(u_int) * libhandle->dkiml_flsize);
 
+#ifndef USE_GNUTLS
+	/*
+	**  Without a pool (e.g. if thread-specific keys have run out
+	**  because long-lived threads still hold closed pools), digest
+	**  contexts are simply allocated as needed.
+	*/
+
+	libhandle->dkiml_mdpool = dkim_mdpool_new();
+#endif /* ! USE_GNUTLS */
+
 #ifdef _FFR_DIFFHEADERS
 	FEATURE_ADD(libhandle, DKIM_FEATURE_DIFFHEADERS);
 #endif /* _FFR_DIFFHEADERS */
@@ -4750,6 +4799,9 @@ dkim_close(DKIM_LIB *lib)
 		(void) dkim_cache_close(lib->dkiml_cache);
 #endif /* QUERY_CACHE */
 
+	if (lib->dkiml_bodycache != NULL)
+		dkim_bodycache_free(lib->dkiml_bodycache);
+
 	if (lib->dkiml_skipre)
 		(void) regfree(&lib->dkiml_skiphdrre);
 
@@ -4770,6 +4822,11 @@ dkim_close(DKIM_LIB *lib)
 	if (lib->dkiml_dns_close != NULL && lib->dkiml_dns_service != NULL)
 		lib->dkiml_dns_close(lib->dkiml_dns_service);
 
+#ifndef USE_GNUTLS
+	if (lib->dkiml_mdpool != NULL)
+		dkim_mdpool_free(lib->dkiml_mdpool);
+#endif /* ! USE_GNUTLS */
+
 	free((void *) lib);
 
 #ifndef USE_GNUTLS
@@ -4787,6 +4844,11 @@ dkim_close(DKIM_LIB *lib)
 **
 **  Return value:
 **  	None.
+**
+**  Notes:
+**  	Serialized per handle, so that lookups made for different
+**  	signatures of one handle at the same time (e.g. dkim_atps_check())
+**  	can report errors.
 */
 
 void
@@ -4802,11 +4864,14 @@ dkim_error(DKIM *dkim, const char *format, ...)
 
 	saverr = errno;
 
+	pthread_mutex_lock(&dkim->dkim_errlock);
+
 	if (dkim->dkim_error == NULL)
 	{
 		dkim->dkim_error = DKIM_MALLOC(dkim, DEFERRLEN);
 		if (dkim->dkim_error == NULL)
 		{
+			pthread_mutex_unlock(&dkim->dkim_errlock);
 			errno = saverr;
 			return;
 		}
@@ -4826,14 +4891,28 @@ dkim_error(DKIM *dkim, const char *format, ...)
 
 		if (flen >= dkim->dkim_errlen)
 		{
+			struct dkim_olderr *oe;
+
 			new = DKIM_MALLOC(dkim, flen + 1);
 			if (new == NULL)
+				break;
+
+			/*
+			**  A pointer from dkim_geterror() may still refer to
+			**  the old buffer, so it is kept until dkim_free().
+			*/
+
+			oe = DKIM_MALLOC(dkim, sizeof *oe);
+			if (oe == NULL)
 			{
-				errno = saverr;
-				return;
+				DKIM_FREE(dkim, new);
+				break;
 			}
 
-			DKIM_FREE(dkim, dkim->dkim_error);
+			oe->oe_buf = dkim->dkim_error;
+			oe->oe_next = dkim->dkim_olderr;
+			dkim->dkim_olderr = oe;
+
 			dkim->dkim_error = new;
 			dkim->dkim_errlen = flen + 1;
 		}
@@ -4843,6 +4922,8 @@ dkim_error(DKIM *dkim, const char *format, ...)
 		}
 	}
 
+	pthread_mutex_unlock(&dkim->dkim_errlock);
+
 	errno = saverr;
 }
 
@@ -4900,6 +4981,58 @@ dkim_options(DKIM_LIB *lib, int op, dkim_opts_t opt, void *ptr, size_t len)
 
 		return DKIM_STAT_OK;
 
+	  case DKIM_OPTS_BODYCACHE:
+		if (ptr == NULL)
+			return DKIM_STAT_INVALID;
+
+		if (len != sizeof lib->dkiml_bodycachesize)
+			return DKIM_STAT_INVALID;
+
+		if (op == DKIM_OP_GETOPT)
+		{
+			memcpy(ptr, &lib->dkiml_bodycachesize, len);
+		}
+		else
+		{
+			u_int size;
+			struct dkim_bodycache *bc = NULL;
+
+			/* handles may be using the current cache */
+			if (lib->dkiml_inuse)
+				return DKIM_STAT_INVALID;
+
+			memcpy(&size, ptr, len);
+
+			if (size > 0)
+			{
+				bc = dkim_bodycache_new(size);
+				if (bc == NULL)
+					return DKIM_STAT_NORESOURCE;
+			}
+
+			if (lib->dkiml_bodycache != NULL)
+				dkim_bodycache_free(lib->dkiml_bodycache);
+
+			lib->dkiml_bodycache = bc;
+			lib->dkiml_bodycachesize = size;
+		}
+
+		return DKIM_STAT_OK;
+
+	  case DKIM_OPTS_BODYCACHEMAX:
+		if (ptr == NULL)
+			return DKIM_STAT_INVALID;
+
+		if (len != sizeof lib->dkiml_bodycachemax)
+			return DKIM_STAT_INVALID;
+
+		if (op == DKIM_OP_GETOPT)
+			memcpy(ptr, &lib->dkiml_bodycachemax, len);
+		else
+			memcpy(&lib->dkiml_bodycachemax, ptr, len);
+
+		return DKIM_STAT_OK;
+
 	  case DKIM_OPTS_MINKEYBITS:
 		if (ptr == NULL)
 			return DKIM_STAT_INVALID;
@@ -5237,6 +5370,7 @@ dkim_free(DKIM *dkim)
 			next = hdr->hdr_next;
 
 			CLOBBER(hdr->hdr_text);
+			CLOBBER(hdr->hdr_relaxed);
 			CLOBBER(hdr);
 
 			hdr = next;
@@ -5358,11 +5492,22 @@ dkim_free(DKIM *dkim)
 	CLOBBER(dkim->dkim_sender);
 	CLOBBER(dkim->dkim_signer);
 	CLOBBER(dkim->dkim_error);
+	while (dkim->dkim_olderr != NULL)
+	{
+		struct dkim_olderr *oe;
+
+		oe = dkim->dkim_olderr;
+		dkim->dkim_olderr = oe->oe_next;
+		DKIM_FREE(dkim, oe->oe_buf);
+		DKIM_FREE(dkim, oe);
+	}
+	pthread_mutex_destroy(&dkim->dkim_errlock);
 	CLOBBER(dkim->dkim_zdecode);
 	CLOBBER(dkim->dkim_hdrlist);
 
 	DSTRING_CLOBBER(dkim->dkim_hdrbuf);
 	DSTRING_CLOBBER(dkim->dkim_canonbuf);
+	DSTRING_CLOBBER(dkim->dkim_bodybuf);
 	DSTRING_CLOBBER(dkim->dkim_sslerrbuf);
 
 	dkim_mfree(dkim->dkim_libhandle, dkim->dkim_closure, dkim);
@@ -5705,7 +5850,7 @@ dkim_resign(DKIM *new, DKIM *old, _Bool hdrbind)
 }
 
 /*
-**  DKIM_SIG_PROCESS -- process a signature
+**  DKIM_SIG_PROCESS_INT -- process a signature (internal version)
 **
 **  Parameters:
 **  	dkim -- DKIM handle
@@ -5715,8 +5860,8 @@ dkim_resign(DKIM *new, DKIM *old, _Bool hdrbind)
 **  	A DKIM_STAT_* constant.
 */
 
-DKIM_STAT
-dkim_sig_process(DKIM *dkim, DKIM_SIGINFO *sig)
+static DKIM_STAT
+dkim_sig_process_int(DKIM *dkim, DKIM_SIGINFO *sig)
 {
 	DKIM_STAT status;
 	int nid;
@@ -5964,7 +6109,7 @@ dkim_sig_process(DKIM *dkim, DKIM_SIGINFO *sig)
 			crypto->crypto_in = sig->sig_sig;
 			crypto->crypto_inlen = sig->sig_siglen;
 
-			md_ctx = EVP_MD_CTX_new();
+			md_ctx = dkim_mdpool_get(dkim->dkim_libhandle->dkiml_mdpool, NULL);
 			if (md_ctx == NULL)
 			{
 				dkim_load_ssl_errors(dkim, 0);
@@ -5987,7 +6132,7 @@ dkim_sig_process(DKIM *dkim, DKIM_SIGINFO *sig)
 				           "failed to initialize digest context");
 
 				BIO_CLOBBER(key);
-				EVP_MD_CTX_free(md_ctx);
+				dkim_mdpool_put(dkim->dkim_libhandle->dkiml_mdpool, md_ctx);
 
 				sig->sig_error = DKIM_SIGERROR_KEYDECODE;
 
@@ -5999,7 +6144,7 @@ dkim_sig_process(DKIM *dkim, DKIM_SIGINFO *sig)
 			                         crypto->crypto_inlen,
 			                         digest, diglen);
 
-			EVP_MD_CTX_free(md_ctx);
+			dkim_mdpool_put(dkim->dkim_libhandle->dkiml_mdpool, md_ctx);
 
 			crypto->crypto_keysize = EVP_PKEY_size(crypto->crypto_pkey);
 		}
@@ -6175,6 +6320,51 @@ dkim_sig_process(DKIM *dkim, DKIM_SIGINFO *sig)
 	return DKIM_STAT_OK;
 }
 
+/*
+**  DKIM_SIG_PROCESS -- process a signature
+**
+**  Parameters:
+**  	dkim -- DKIM handle
+**  	sig -- DKIM_SIGINFO handle
+**
+**  Return value:
+**  	A DKIM_STAT_* constant.
+**
+**  Notes:
+**  	Time spent here, less any time spent retrieving the key, is
+**  	charged to the handle's crypto counter if the library has
+**  	DKIM_LIBFLAGS_TIMING set; see dkim_gettiming().
+*/
+
+DKIM_STAT
+dkim_sig_process(DKIM *dkim, DKIM_SIGINFO *sig)
+{
+	uint64_t start;
+	uint64_t keyq;
+	DKIM_STAT status;
+
+	assert(dkim != NULL);
+	assert(sig != NULL);
+
+	if (!DKIM_TIMING(dkim))
+	{
+		status = dkim_sig_process_int(dkim, sig);
+		dkim->dkim_crypto_count++;
+		return status;
+	}
+
+	start = dkim_clock_usec();
+	keyq = dkim->dkim_keyq_usec;
+
+	status = dkim_sig_process_int(dkim, sig);
+
+	dkim->dkim_crypto_usec += (dkim_clock_usec() - start) -
+	                          (dkim->dkim_keyq_usec - keyq);
+	dkim->dkim_crypto_count++;
+
+	return status;
+}
+
 /*
 **  DKIM_OHDRS -- extract and decode original headers
 **
@@ -6739,6 +6929,8 @@ dkim_header(DKIM *dkim, u_char *hdr, size_t len)
 	else
 		h->hdr_colon = h->hdr_text + (colon - hdr);
 	h->hdr_flags = 0;
+	h->hdr_relaxed = NULL;
+	h->hdr_relaxedlen = 0;
 	h->hdr_next = NULL;
 
 	if (dkim->dkim_hhead == NULL)
@@ -6849,9 +7041,24 @@ dkim_eom(DKIM *dkim, _Bool *testkey)
 	assert(dkim != NULL);
 
 	if (dkim->dkim_mode == DKIM_MODE_SIGN)
-		return dkim_eom_sign(dkim);
+	{
+		uint64_t start;
+		DKIM_STAT status;
+
+		start = (DKIM_TIMING(dkim) ? dkim_clock_usec() : 0);
+
+		status = dkim_eom_sign(dkim);
+
+		if (DKIM_TIMING(dkim))
+			dkim->dkim_crypto_usec += dkim_clock_usec() - start;
+		dkim->dkim_crypto_count++;
+
+		return status;
+	}
 	else
+	{
 		return dkim_eom_verify(dkim, testkey);
+	}
 }
 
 /*
@@ -8185,14 +8392,24 @@ dkim_set_signer(DKIM *dkim, const unsigned char *signer)
 **
 **  Return value:
 **  	A pointer to the stored string, or NULL if none was stored.
+**
+**  Notes:
+**  	The string stays allocated until the handle is freed, though a
+**  	later error may overwrite it.
 */
 
 const char *
 dkim_geterror(DKIM *dkim)
 {
+	const char *err;
+
 	assert(dkim != NULL);
 
-	return (const char *) dkim->dkim_error;
+	pthread_mutex_lock(&dkim->dkim_errlock);
+	err = (const char *) dkim->dkim_error;
+	pthread_mutex_unlock(&dkim->dkim_errlock);
+
+	return err;
 }
 
 /*
@@ -8786,6 +9003,91 @@ dkim_getcachestats(DKIM_LIB *lib, u_int *queries, u_int *hits, u_int *expired,
 #endif /* QUERY_CACHE */
 }
 
+/*
+**  DKIM_GETBODYCACHESTATS -- retrieve body hash cache statistics
+**
+**  Parameters:
+**  	lib -- DKIM library handle, returned by dkim_init()
+**  	lookups -- number of body hash lookups (returned)
+**  	hits -- number of lookups satisfied from the cache (returned)
+**  	entries -- number of body hashes cached (returned)
+**  	reset -- if TRUE, resets the lookups and hits counters
+**
+**  Return value:
+**  	DKIM_STAT_OK -- request completed
+**  	DKIM_STAT_INVALID -- body hash caching is not enabled
+**
+**  Notes:
+**  	Any of the parameters may be NULL if the corresponding datum
+**  	is not of interest.
+*/
+
+DKIM_STAT
+dkim_getbodycachestats(DKIM_LIB *lib, u_int *lookups, u_int *hits,
+                       u_int *entries, _Bool reset)
+{
+	assert(lib != NULL);
+
+	if (lib->dkiml_bodycache == NULL)
+		return DKIM_STAT_INVALID;
+
+	dkim_bodycache_stats(lib->dkiml_bodycache, lookups, hits, entries,
+	                     reset);
+
+	return DKIM_STAT_OK;
+}
+
+/*
+**  DKIM_GETTIMING -- retrieve time spent on a handle's expensive operations
+**
+**  Parameters:
+**  	dkim -- DKIM handle
+**  	which -- DKIM_TIMING_* category
+**  	usec -- microseconds spent (returned)
+**  	count -- number of operations timed (returned)
+**
+**  Return value:
+**  	DKIM_STAT_OK -- request completed
+**  	DKIM_STAT_INVALID -- unknown category
+**
+**  Notes:
+**  	Either of "usec" or "count" may be NULL if the corresponding datum
+**  	is not of interest.
+*/
+
+DKIM_STAT
+dkim_gettiming(DKIM *dkim, int which, uint64_t *usec, u_int *count)
+{
+	assert(dkim != NULL);
+
+	switch (which)
+	{
+	  case DKIM_TIMING_KEYQUERY:
+		if (usec != NULL)
+			*usec = dkim->dkim_keyq_usec;
+		if (count != NULL)
+			*count = dkim->dkim_keyq_count;
+		return DKIM_STAT_OK;
+
+	  case DKIM_TIMING_CRYPTO:
+		if (usec != NULL)
+			*usec = dkim->dkim_crypto_usec;
+		if (count != NULL)
+			*count = dkim->dkim_crypto_count;
+		return DKIM_STAT_OK;
+
+	  case DKIM_TIMING_KEYTIMEOUT:
+		if (usec != NULL)
+			*usec = dkim->dkim_keyto_usec;
+		if (count != NULL)
+			*count = dkim->dkim_keyto_count;
+		return DKIM_STAT_OK;
+
+	  default:
+		return DKIM_STAT_INVALID;
+	}
+}
+
 /*
 **  DKIM_CONDITIONAL -- set conditional domain on a signature
 **
@@ -0,0 +1,1411 @@
+/*
+**  Copyright 2025 OpenDKIM contributors.
+*/
+
+#include "build-config.h"
+
+/* system includes */
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/time.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sysexits.h>
+
+/* OpenSSL includes */
+#include <openssl/bio.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+/* libopendkim includes */
+#include "../dkim.h"
+#include "t-testdata.h"
+
+/* libbsd if found */
+#ifdef USE_BSD_H
+# include <bsd/string.h>
+#endif /* USE_BSD_H */
+
+/* libstrl if needed */
+#ifdef USE_STRL_H
+# include <strl.h>
+#endif /* USE_STRL_H */
+
+#define	BENCH_MAXLIST	16
+#define	BENCH_MAXSIGS	8
+#define	BENCH_POOL	16
+#define	BENCH_CHUNK	65535
+#define	BENCH_LINE	76
+
+#define	DEFALGS		"rsa2048,ed25519"
+#define	DEFCANONS	"relaxed/relaxed,simple/simple"
+#define	DEFHDRS		"10"
+#define	DEFSIGS		"1"
+#define	DEFSIZES	"1k,16k,256k"
+#define	DEFTESTINT	2
+
+#define	STAGE_HEADER	0
+#define	STAGE_EOH	1
+#define	STAGE_BODY	2
+#define	STAGE_EOM	3
+#define	NSTAGES		4
+
+#define	MODE_SIGN	0x01
+#define	MODE_VERIFY	0x02
+#define	MODE_SETUP	0x04
+
+#ifndef FALSE
+# define FALSE		0
+#endif /* ! FALSE */
+#ifndef TRUE
+# define TRUE		1
+#endif /* ! TRUE */
+
+#ifndef MIN
+# define MIN(x,y)	((x) < (y) ? (x) : (y))
+#endif /* ! MIN */
+
+/* data types */
+struct benchkey
+{
+	const char *	bk_name;		/* name, e.g. "rsa2048" */
+	int		bk_type;		/* EVP_PKEY_* */
+	int		bk_bits;		/* RSA modulus size */
+	char *		bk_private;		/* private key (PEM) */
+	char *		bk_public;		/* key record "p=" value */
+};
+
+struct benchmsg
+{
+	int		bm_nhdrs;		/* header field count */
+	char **		bm_hdrs;		/* header fields */
+	int		bm_nsigs;		/* signature count */
+	char *		bm_sigs[BENCH_MAXSIGS];	/* signatures (for verify) */
+	char *		bm_body;		/* body */
+	size_t		bm_bodylen;		/* body length */
+	size_t		bm_len;			/* total message length */
+};
+
+struct benchcase
+{
+	int		bc_mode;		/* MODE_* */
+	struct benchkey * bc_key;		/* key */
+	dkim_canon_t	bc_hcanon;		/* header canonicalization */
+	dkim_canon_t	bc_bcanon;		/* body canonicalization */
+	const char *	bc_canon;		/* canonicalization name */
+	int		bc_nhdrs;		/* header fields per message */
+	const char *	bc_size;		/* size specification */
+	int		bc_nsigs;		/* signatures per message */
+	int		bc_threads;		/* threads */
+	struct timeval	bc_deadline;		/* end of run */
+	struct benchmsg	bc_msgs[BENCH_POOL];	/* message pool */
+};
+
+struct benchworker
+{
+	pthread_t	bw_tid;			/* thread */
+	int		bw_id;			/* worker number */
+	struct benchcase * bw_case;		/* case being run */
+	unsigned long	bw_msgs;		/* messages processed */
+	unsigned long	bw_errors;		/* failures */
+	unsigned long	bw_allocs;		/* library allocations */
+	unsigned long	bw_allocbytes;		/* bytes allocated */
+	uint64_t	bw_bytes;		/* message bytes processed */
+	uint64_t	bw_ns[NSTAGES];		/* time per stage */
+};
+
+/* globals */
+_Bool lfonly = FALSE;
+u_int bodycache = 0;
+char *progname;
+DKIM_LIB *lib;
+
+struct benchkey keys[] =
+{
+	{ "rsa1024",	EVP_PKEY_RSA,		1024,	NULL,	NULL },
+	{ "rsa2048",	EVP_PKEY_RSA,		2048,	NULL,	NULL },
+	{ "rsa4096",	EVP_PKEY_RSA,		4096,	NULL,	NULL },
+	{ "ed25519",	EVP_PKEY_ED25519,	0,	NULL,	NULL },
+	{ NULL,		0,			0,	NULL,	NULL }
+};
+
+const char *stages[NSTAGES] = { "header", "eoh", "body", "eom" };
+
+/*
+**  CANON_CODE -- convert a canonicalization name to its code
+**
+**  Parameters:
+**  	name -- name to convert
+**
+**  Return value:
+**  	dkim_canon_t
+*/
+
+dkim_canon_t
+canon_code(char *name)
+{
+	if (name == NULL)
+		return (dkim_canon_t) DKIM_CANON_UNKNOWN;
+	else if (strcasecmp(name, "simple") == 0)
+		return (dkim_canon_t) DKIM_CANON_SIMPLE;
+	else if (strcasecmp(name, "relaxed") == 0)
+		return (dkim_canon_t) DKIM_CANON_RELAXED;
+	else
+		return (dkim_canon_t) DKIM_CANON_UNKNOWN;
+}
+
+/*
+**  BENCH_MALLOC -- counting allocator handed to dkim_init()
+**
+**  Parameters:
+**  	closure -- worker whose counters are to be updated, or NULL
+**  	nbytes -- bytes requested
+**
+**  Return value:
+**  	Pointer to allocated memory, or NULL.
+**
+**  Notes:
+**  	The library passes the memory closure given to dkim_sign() or
+**  	dkim_verify(), so each worker counts its own allocations without
+**  	locking.  Library-wide allocations arrive with a NULL closure and
+**  	aren't counted.
+*/
+
+void *
+bench_malloc(void *closure, size_t nbytes)
+{
+	struct benchworker *bw = closure;
+
+	if (bw != NULL)
+	{
+		bw->bw_allocs++;
+		bw->bw_allocbytes += nbytes;
+	}
+
+	return malloc(nbytes);
+}
+
+/*
+**  BENCH_FREE -- release memory allocated by bench_malloc()
+**
+**  Parameters:
+**  	closure -- unused
+**  	p -- memory to release
+**
+**  Return value:
+**  	None.
+*/
+
+void
+bench_free(void *closure, void *p)
+{
+	free(p);
+}
+
+/*
+**  BENCH_NOW -- monotonic time in nanoseconds
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	Current monotonic time in nanoseconds.
+*/
+
+uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+**  BENCH_SPLIT -- split a comma-separated list
+**
+**  Parameters:
+**  	str -- string to split (modified)
+**  	list -- array to fill
+**  	max -- capacity of "list"
+**
+**  Return value:
+**  	Number of entries found, or -1 if there were too many.
+*/
+
+int
+bench_split(char *str, char **list, int max)
+{
+	int n = 0;
+	char *p;
+	char *last;
+
+	for (p = strtok_r(str, ",", &last);
+	     p != NULL;
+	     p = strtok_r(NULL, ",", &last))
+	{
+		if (n == max)
+			return -1;
+		list[n++] = p;
+	}
+
+	return n;
+}
+
+/*
+**  BENCH_SIZE -- parse a size with an optional k or m suffix
+**
+**  Parameters:
+**  	str -- string to parse
+**  	end -- end of the parsed text (returned)
+**
+**  Return value:
+**  	The size, in bytes.
+*/
+
+size_t
+bench_size(const char *str, char **end)
+{
+	size_t sz;
+
+	sz = strtoul(str, end, 10);
+	if (**end == 'k' || **end == 'K')
+	{
+		sz *= 1024;
+		(*end)++;
+	}
+	else if (**end == 'm' || **end == 'M')
+	{
+		sz *= 1024 * 1024;
+		(*end)++;
+	}
+
+	return sz;
+}
+
+/*
+**  BENCH_KEYGEN -- generate a key pair and its key record
+**
+**  Parameters:
+**  	bk -- key to generate
+**
+**  Return value:
+**  	0 on success, -1 on failure.
+*/
+
+int
+bench_keygen(struct benchkey *bk)
+{
+	int len;
+	unsigned char *der = NULL;
+	char *pem;
+	BIO *bio;
+	EVP_PKEY *pkey = NULL;
+	EVP_PKEY_CTX *pctx;
+
+	pctx = EVP_PKEY_CTX_new_id(bk->bk_type, NULL);
+	if (pctx == NULL || EVP_PKEY_keygen_init(pctx) <= 0 ||
+	    (bk->bk_bits != 0 &&
+	     EVP_PKEY_CTX_set_rsa_keygen_bits(pctx, bk->bk_bits) <= 0) ||
+	    EVP_PKEY_keygen(pctx, &pkey) <= 0)
+	{
+		fprintf(stderr, "%s: %s: key generation failed\n", progname,
+		        bk->bk_name);
+		EVP_PKEY_CTX_free(pctx);
+		return -1;
+	}
+	EVP_PKEY_CTX_free(pctx);
+
+	bio = BIO_new(BIO_s_mem());
+	if (bio == NULL ||
+	    PEM_write_bio_PrivateKey(bio, pkey, NULL, NULL, 0, NULL,
+	                             NULL) != 1)
+	{
+		BIO_free(bio);
+		EVP_PKEY_free(pkey);
+		return -1;
+	}
+	len = BIO_get_mem_data(bio, &pem);
+	bk->bk_private = malloc(len + 1);
+	if (bk->bk_private == NULL)
+	{
+		BIO_free(bio);
+		EVP_PKEY_free(pkey);
+		return -1;
+	}
+	memcpy(bk->bk_private, pem, len);
+	bk->bk_private[len] = '\0';
+	BIO_free(bio);
+
+	/* RFC8463 publishes the raw Ed25519 key, RFC6376 the SPKI */
+	if (bk->bk_type == EVP_PKEY_ED25519)
+	{
+		size_t rawlen = 32;
+
+		der = malloc(rawlen);
+		if (der == NULL ||
+		    EVP_PKEY_get_raw_public_key(pkey, der, &rawlen) != 1)
+		{
+			free(der);
+			EVP_PKEY_free(pkey);
+			return -1;
+		}
+		len = rawlen;
+	}
+	else
+	{
+		len = i2d_PUBKEY(pkey, &der);
+		if (len <= 0)
+		{
+			EVP_PKEY_free(pkey);
+			return -1;
+		}
+	}
+
+	bk->bk_public = malloc(((len + 2) / 3) * 4 + 1);
+	if (bk->bk_public == NULL)
+	{
+		OPENSSL_free(der);
+		EVP_PKEY_free(pkey);
+		return -1;
+	}
+	(void) EVP_EncodeBlock((unsigned char *) bk->bk_public, der, len);
+
+	if (bk->bk_type == EVP_PKEY_ED25519)
+		free(der);
+	else
+		OPENSSL_free(der);
+	EVP_PKEY_free(pkey);
+
+	return 0;
+}
+
+/*
+**  BENCH_KEYFILE -- write the key records for the file query method
+**
+**  Parameters:
+**  	path -- file to write
+**
+**  Return value:
+**  	0 on success, -1 on failure.
+**
+**  Notes:
+**  	Selector "<key>-<n>" is published for each key and each n below
+**  	BENCH_MAXSIGS, so multi-signature messages carry distinct
+**  	signatures that each need their own key lookup.
+*/
+
+int
+bench_keyfile(const char *path)
+{
+	int c;
+	FILE *f;
+	struct benchkey *bk;
+
+	f = fopen(path, "w");
+	if (f == NULL)
+	{
+		fprintf(stderr, "%s: %s: fopen(): %s\n", progname, path,
+		        strerror(errno));
+		return -1;
+	}
+
+	for (bk = keys; bk->bk_name != NULL; bk++)
+	{
+		if (bk->bk_public == NULL)
+			continue;
+
+		for (c = 0; c < BENCH_MAXSIGS; c++)
+		{
+			fprintf(f, "%s-%d.%s.%s v=DKIM1; k=%s; p=%s\n",
+			        bk->bk_name, c, DKIM_DNSKEYNAME, DOMAIN,
+			        bk->bk_type == EVP_PKEY_ED25519 ? "ed25519"
+			                                        : "rsa",
+			        bk->bk_public);
+		}
+	}
+
+	fclose(f);
+
+	return 0;
+}
+
+/*
+**  BENCH_MKMSG -- build a synthetic message
+**
+**  Parameters:
+**  	bm -- message to fill in
+**  	nhdrs -- number of header fields
+**  	bodylen -- body size
+**
+**  Return value:
+**  	0 on success, -1 on failure.
+*/
+
+int
+bench_mkmsg(struct benchmsg *bm, int nhdrs, size_t bodylen)
+{
+	int c;
+	size_t w;
+	size_t n;
+	char hdr[BUFSIZ];
+	static const char *base[] =
+	{
+		HEADER05, HEADER06, HEADER07, HEADER08, HEADER09, HEADER10
+	};
+
+	memset(bm, '\0', sizeof *bm);
+
+	bm->bm_hdrs = (char **) calloc(nhdrs, sizeof(char *));
+	bm->bm_body = (char *) malloc(bodylen + 2);
+	if (bm->bm_hdrs == NULL || bm->bm_body == NULL)
+		return -1;
+
+	/* the usual suspects first, then trace fields */
+	for (c = 0; c < nhdrs; c++)
+	{
+		if (c < sizeof base / sizeof base[0])
+		{
+			bm->bm_hdrs[c] = strdup(base[c]);
+		}
+		else
+		{
+			snprintf(hdr, sizeof hdr,
+			         "Received: from relay%d.example.net (relay%d.example.net [192.0.2.%d])\r\n\tby mx.example.com with ESMTPS id %08lx;\r\n\t%s",
+			         c, c, c % 254 + 1, random(),
+			         "Thu, 05 May 2005 11:59:09 -0700");
+			bm->bm_hdrs[c] = strdup(hdr);
+		}
+
+		if (bm->bm_hdrs[c] == NULL)
+			return -1;
+
+		bm->bm_len += strlen(bm->bm_hdrs[c]) + 2;
+		bm->bm_nhdrs++;
+	}
+	bm->bm_len += 2;
+
+	/*
+	**  Printable text in CRLF-terminated lines, or LF-terminated ones
+	**  as handed over by a submission path that leaves the repair to
+	**  the library.
+	*/
+
+	for (n = 0, w = 0; n < bodylen; n++)
+	{
+		if (lfonly && (w >= BENCH_LINE || n == bodylen - 1))
+		{
+			bm->bm_body[n] = '\n';
+			w = 0;
+			continue;
+		}
+		else if (!lfonly &&
+		         (w >= BENCH_LINE || n == bodylen - 2) &&
+		         n < bodylen - 1)
+		{
+			bm->bm_body[n++] = '\r';
+			bm->bm_body[n] = '\n';
+			w = 0;
+			continue;
+		}
+
+		bm->bm_body[n] = (random() % 95) + 32;
+		w++;
+	}
+	bm->bm_bodylen = bodylen;
+	bm->bm_len += bodylen;
+
+	return 0;
+}
+
+/*
+**  BENCH_FREEMSG -- release a synthetic message
+**
+**  Parameters:
+**  	bm -- message to release
+**
+**  Return value:
+**  	None.
+*/
+
+void
+bench_freemsg(struct benchmsg *bm)
+{
+	int c;
+
+	for (c = 0; c < bm->bm_nhdrs; c++)
+		free(bm->bm_hdrs[c]);
+	for (c = 0; c < bm->bm_nsigs; c++)
+		free(bm->bm_sigs[c]);
+	free(bm->bm_hdrs);
+	free(bm->bm_body);
+	memset(bm, '\0', sizeof *bm);
+}
+
+/*
+**  BENCH_FEED -- pass a message through a handle, timing each stage
+**
+**  Parameters:
+**  	dkim -- DKIM handle
+**  	bm -- message
+**  	sigs -- TRUE iff the message's signatures are to be fed first
+**  	ns -- per-stage times to update
+**
+**  Return value:
+**  	Status of the last library call, DKIM_STAT_OK if all succeeded.
+**
+**  Notes:
+**  	Handle creation is charged to the header stage by the callers, and
+**  	dkim_eom() (plus dkim_getsighdr_d() when signing) to the eom stage.
+*/
+
+DKIM_STAT
+bench_feed(DKIM *dkim, struct benchmsg *bm, _Bool sigs, uint64_t *ns)
+{
+	int c;
+	size_t off;
+	size_t len;
+	uint64_t t0;
+	uint64_t t1;
+	DKIM_STAT status = DKIM_STAT_OK;
+
+	t0 = bench_now();
+	for (c = 0; sigs && c < bm->bm_nsigs && status == DKIM_STAT_OK; c++)
+		status = dkim_header(dkim, bm->bm_sigs[c], strlen(bm->bm_sigs[c]));
+	for (c = 0; c < bm->bm_nhdrs && status == DKIM_STAT_OK; c++)
+		status = dkim_header(dkim, bm->bm_hdrs[c], strlen(bm->bm_hdrs[c]));
+	t1 = bench_now();
+	ns[STAGE_HEADER] += t1 - t0;
+	if (status != DKIM_STAT_OK)
+		return status;
+
+	status = dkim_eoh(dkim);
+	t0 = bench_now();
+	ns[STAGE_EOH] += t0 - t1;
+	if (status != DKIM_STAT_OK)
+		return status;
+
+	/* body in milter-sized chunks */
+	for (off = 0; off < bm->bm_bodylen; off += len)
+	{
+		len = MIN(bm->bm_bodylen - off, BENCH_CHUNK);
+		status = dkim_body(dkim, bm->bm_body + off, len);
+		if (status != DKIM_STAT_OK)
+			break;
+	}
+	t1 = bench_now();
+	ns[STAGE_BODY] += t1 - t0;
+
+	return status;
+}
+
+/*
+**  BENCH_SIGN -- sign a message
+**
+**  Parameters:
+**  	bc -- case being run
+**  	bm -- message
+**  	closure -- memory closure
+**  	ns -- per-stage times to update
+**  	store -- TRUE iff the signatures are to be kept in the message
+**
+**  Return value:
+**  	0 on success, -1 on failure.
+*/
+
+int
+bench_sign(struct benchcase *bc, struct benchmsg *bm, void *closure,
+           uint64_t *ns, _Bool store)
+{
+	int c;
+	size_t len;
+	uint64_t t0;
+	DKIM_STAT status;
+	DKIM *dkim;
+	unsigned char *sig;
+	char sel[BUFSIZ];
+
+	for (c = 0; c < bc->bc_nsigs; c++)
+	{
+		snprintf(sel, sizeof sel, "%s-%d", bc->bc_key->bk_name, c);
+
+		t0 = bench_now();
+		dkim = dkim_sign(lib, JOBID, closure,
+		                 (dkim_sigkey_t) bc->bc_key->bk_private,
+		                 sel, DOMAIN, bc->bc_hcanon, bc->bc_bcanon,
+		                 bc->bc_key->bk_type == EVP_PKEY_ED25519
+		                 ? DKIM_SIGN_ED25519SHA256
+		                 : DKIM_SIGN_RSASHA256,
+		                 -1L, &status);
+		ns[STAGE_HEADER] += bench_now() - t0;
+		if (dkim == NULL)
+			return -1;
+
+		status = bench_feed(dkim, bm, FALSE, ns);
+
+		t0 = bench_now();
+		if (status == DKIM_STAT_OK)
+			status = dkim_eom(dkim, NULL);
+		if (status == DKIM_STAT_OK)
+		{
+			status = dkim_getsighdr_d(dkim,
+			                          strlen(DKIM_SIGNHEADER) + 2,
+			                          &sig, &len);
+		}
+		ns[STAGE_EOM] += bench_now() - t0;
+
+		if (status == DKIM_STAT_OK && store)
+		{
+			char *hdr;
+
+			hdr = malloc(strlen(DKIM_SIGNHEADER) + len + 3);
+			if (hdr == NULL)
+			{
+				(void) dkim_free(dkim);
+				return -1;
+			}
+			sprintf(hdr, "%s: %s", DKIM_SIGNHEADER, sig);
+			bm->bm_sigs[bm->bm_nsigs++] = hdr;
+		}
+
+		(void) dkim_free(dkim);
+
+		if (status != DKIM_STAT_OK)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+**  BENCH_VERIFY -- verify a message
+**
+**  Parameters:
+**  	bc -- case being run
+**  	bm -- message
+**  	closure -- memory closure
+**  	ns -- per-stage times to update
+**
+**  Return value:
+**  	0 if every signature verified, -1 otherwise.
+*/
+
+int
+bench_verify(struct benchcase *bc, struct benchmsg *bm, void *closure,
+             uint64_t *ns)
+{
+	int c;
+	int nsigs = 0;
+	uint64_t t0;
+	DKIM_STAT status;
+	DKIM *dkim;
+	DKIM_SIGINFO **sigs;
+
+	t0 = bench_now();
+	dkim = dkim_verify(lib, JOBID, closure, &status);
+	ns[STAGE_HEADER] += bench_now() - t0;
+	if (dkim == NULL)
+		return -1;
+
+	status = bench_feed(dkim, bm, TRUE, ns);
+
+	t0 = bench_now();
+	if (status == DKIM_STAT_OK)
+		status = dkim_eom(dkim, NULL);
+	ns[STAGE_EOM] += bench_now() - t0;
+
+	if (status == DKIM_STAT_OK &&
+	    dkim_getsiglist(dkim, &sigs, &nsigs) == DKIM_STAT_OK)
+	{
+		for (c = 0; c < nsigs; c++)
+		{
+			if (!DKIM_SIG_CHECK(sigs[c]))
+				status = DKIM_STAT_BADSIG;
+		}
+	}
+
+	(void) dkim_free(dkim);
+
+	return (status == DKIM_STAT_OK && nsigs == bc->bc_nsigs ? 0 : -1);
+}
+
+/*
+**  BENCH_SETUP -- set up signing handles for a message and discard them
+**
+**  Parameters:
+**  	bc -- case being run
+**  	bm -- message
+**  	closure -- memory closure
+**  	ns -- per-stage times to update
+**
+**  Return value:
+**  	0 on success, -1 on failure.
+**
+**  Notes:
+**  	This measures the per-message setup cost (handle creation and the
+**  	digest contexts created at end of header) without any body hashing
+**  	or private key operations.  Releasing the handle is charged to the
+**  	eom stage.
+*/
+
+int
+bench_setup(struct benchcase *bc, struct benchmsg *bm, void *closure,
+            uint64_t *ns)
+{
+	int c;
+	int h;
+	uint64_t t0;
+	uint64_t t1;
+	DKIM_STAT status;
+	DKIM *dkim;
+	char sel[BUFSIZ];
+
+	for (c = 0; c < bc->bc_nsigs; c++)
+	{
+		snprintf(sel, sizeof sel, "%s-%d", bc->bc_key->bk_name, c);
+
+		t0 = bench_now();
+		dkim = dkim_sign(lib, JOBID, closure,
+		                 (dkim_sigkey_t) bc->bc_key->bk_private,
+		                 sel, DOMAIN, bc->bc_hcanon, bc->bc_bcanon,
+		                 bc->bc_key->bk_type == EVP_PKEY_ED25519
+		                 ? DKIM_SIGN_ED25519SHA256
+		                 : DKIM_SIGN_RSASHA256,
+		                 -1L, &status);
+		if (dkim == NULL)
+			return -1;
+
+		for (h = 0; h < bm->bm_nhdrs && status == DKIM_STAT_OK; h++)
+		{
+			status = dkim_header(dkim, bm->bm_hdrs[h],
+			                     strlen(bm->bm_hdrs[h]));
+		}
+		t1 = bench_now();
+		ns[STAGE_HEADER] += t1 - t0;
+
+		if (status == DKIM_STAT_OK)
+			status = dkim_eoh(dkim);
+		t0 = bench_now();
+		ns[STAGE_EOH] += t0 - t1;
+
+		(void) dkim_free(dkim);
+		ns[STAGE_EOM] += bench_now() - t0;
+
+		if (status != DKIM_STAT_OK)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+**  MODE_NAME -- name of a benchmark mode
+**
+**  Parameters:
+**  	mode -- MODE_* value
+**
+**  Return value:
+**  	Its name.
+*/
+
+const char *
+mode_name(int mode)
+{
+	switch (mode)
+	{
+	  case MODE_SIGN:
+		return "sign";
+
+	  case MODE_VERIFY:
+		return "verify";
+
+	  case MODE_SETUP:
+		return "setup";
+
+	  default:
+		return "unknown";
+	}
+}
+
+/*
+**  BENCH_WORKER -- benchmark thread
+**
+**  Parameters:
+**  	arg -- worker (struct benchworker *)
+**
+**  Return value:
+**  	NULL.
+*/
+
+void *
+bench_worker(void *arg)
+{
+	int n;
+	struct benchworker *bw = arg;
+	struct benchcase *bc = bw->bw_case;
+	struct benchmsg *bm;
+	struct timeval now;
+
+	for (n = bw->bw_id; ; n++)
+	{
+		(void) gettimeofday(&now, NULL);
+		if (!timercmp(&now, &bc->bc_deadline, <))
+			break;
+
+		bm = &bc->bc_msgs[n % BENCH_POOL];
+
+		if (bc->bc_mode == MODE_SIGN)
+		{
+			if (bench_sign(bc, bm, bw, bw->bw_ns, FALSE) != 0)
+				bw->bw_errors++;
+		}
+		else if (bc->bc_mode == MODE_SETUP)
+		{
+			if (bench_setup(bc, bm, bw, bw->bw_ns) != 0)
+				bw->bw_errors++;
+		}
+		else
+		{
+			if (bench_verify(bc, bm, bw, bw->bw_ns) != 0)
+				bw->bw_errors++;
+		}
+
+		bw->bw_msgs++;
+		bw->bw_bytes += bm->bm_len * (bc->bc_mode == MODE_VERIFY
+		                              ? 1 : bc->bc_nsigs);
+	}
+
+	return NULL;
+}
+
+/*
+**  BENCH_RUN -- run one case and print its JSON result
+**
+**  Parameters:
+**  	bc -- case to run, message pool prepared
+**  	testint -- seconds to run
+**  	out -- output stream
+**  	first -- TRUE iff this is the first result printed
+**
+**  Return value:
+**  	Number of failures seen.
+*/
+
+unsigned long
+bench_run(struct benchcase *bc, time_t testint, FILE *out, _Bool first)
+{
+	int c;
+	int s;
+	int nthreads = 0;
+	double secs;
+	unsigned long msgs = 0;
+	unsigned long errors = 0;
+	unsigned long allocs = 0;
+	unsigned long allocbytes = 0;
+	uint64_t bytes = 0;
+	uint64_t start;
+	uint64_t ns[NSTAGES];
+	struct benchworker *bw;
+
+	bw = (struct benchworker *) calloc(bc->bc_threads, sizeof *bw);
+	if (bw == NULL)
+	{
+		fprintf(stderr, "%s: calloc(): %s\n", progname,
+		        strerror(errno));
+		return 1;
+	}
+
+	(void) gettimeofday(&bc->bc_deadline, NULL);
+	bc->bc_deadline.tv_sec += testint;
+	start = bench_now();
+
+	for (c = 0; c < bc->bc_threads; c++)
+	{
+		bw[c].bw_id = c;
+		bw[c].bw_case = bc;
+
+		s = pthread_create(&bw[c].bw_tid, NULL, bench_worker, &bw[c]);
+		if (s != 0)
+		{
+			fprintf(stderr, "%s: pthread_create(): %s\n",
+			        progname, strerror(s));
+			break;
+		}
+
+		nthreads++;
+	}
+
+	for (c = 0; c < nthreads; c++)
+		(void) pthread_join(bw[c].bw_tid, NULL);
+
+	secs = (double) (bench_now() - start) / 1000000000.;
+
+	memset(ns, '\0', sizeof ns);
+	for (c = 0; c < nthreads; c++)
+	{
+		msgs += bw[c].bw_msgs;
+		errors += bw[c].bw_errors;
+		allocs += bw[c].bw_allocs;
+		allocbytes += bw[c].bw_allocbytes;
+		bytes += bw[c].bw_bytes;
+		for (s = 0; s < NSTAGES; s++)
+			ns[s] += bw[c].bw_ns[s];
+	}
+
+	free(bw);
+
+	fprintf(stderr,
+	        "*** %s %s %s hdrs=%d size=%s%s%s sigs=%d threads=%d: %.1f msgs/sec%s\n",
+	        mode_name(bc->bc_mode),
+	        bc->bc_key->bk_name, bc->bc_canon, bc->bc_nhdrs, bc->bc_size,
+	        lfonly ? " (LF)" : "", bodycache > 0 ? " (cached)" : "",
+	        bc->bc_nsigs, nthreads,
+	        secs > 0. ? msgs / secs : 0., errors == 0 ? "" : " (ERRORS)");
+
+	fprintf(out, "%s\n    {\"mode\": \"%s\", \"alg\": \"%s\", "
+	        "\"canon\": \"%s\", \"headers\": %d, \"size\": \"%s\", "
+	        "\"eol\": \"%s\", \"bodycache\": %u, "
+	        "\"signatures\": %d, \"threads\": %d,\n",
+	        first ? "" : ",",
+	        mode_name(bc->bc_mode),
+	        bc->bc_key->bk_name, bc->bc_canon, bc->bc_nhdrs, bc->bc_size,
+	        lfonly ? "lf" : "crlf", bodycache, bc->bc_nsigs, nthreads);
+	fprintf(out, "     \"messages\": %lu, \"errors\": %lu, "
+	        "\"seconds\": %.3f, \"msgs_per_sec\": %.1f, "
+	        "\"bytes\": %llu,\n",
+	        msgs, errors, secs, secs > 0. ? msgs / secs : 0.,
+	        (unsigned long long) bytes);
+	fprintf(out, "     \"ns_per_byte\": {");
+	for (s = 0; s < NSTAGES; s++)
+	{
+		fprintf(out, "%s\"%s\": %.3f", s == 0 ? "" : ", ", stages[s],
+		        bytes == 0 ? 0. : (double) ns[s] / bytes);
+	}
+	fprintf(out, "},\n");
+	fprintf(out, "     \"ns_per_msg\": %.0f, ",
+	        msgs == 0 ? 0. : (double) (ns[STAGE_HEADER] + ns[STAGE_EOH] +
+	                                   ns[STAGE_BODY] + ns[STAGE_EOM]) / msgs);
+	fprintf(out, "\"allocs_per_msg\": %.1f, "
+	        "\"alloc_bytes_per_msg\": %.0f}",
+	        msgs == 0 ? 0. : (double) allocs / msgs,
+	        msgs == 0 ? 0. : (double) allocbytes / msgs);
+
+	return errors;
+}
+
+/*
+**  BENCH_MKPOOL -- build a case's message pool
+**
+**  Parameters:
+**  	bc -- case
+**
+**  Return value:
+**  	0 on success, -1 on failure.
+**
+**  Notes:
+**  	A size specification is either a single size or a "min-max" range
+**  	from which message sizes are drawn uniformly.  For verification,
+**  	messages are signed here, outside the timed run.
+*/
+
+int
+bench_mkpool(struct benchcase *bc)
+{
+	int c;
+	size_t lo;
+	size_t hi;
+	char *p;
+	uint64_t ns[NSTAGES];
+
+	lo = bench_size(bc->bc_size, &p);
+	hi = lo;
+	if (*p == '-')
+		hi = bench_size(p + 1, &p);
+	if (*p != '\0' || lo < 2 || hi < lo)
+	{
+		fprintf(stderr, "%s: invalid size '%s'\n", progname,
+		        bc->bc_size);
+		return -1;
+	}
+
+	for (c = 0; c < BENCH_POOL; c++)
+	{
+		size_t sz;
+
+		sz = lo + (hi == lo ? 0 : random() % (hi - lo + 1));
+
+		if (bench_mkmsg(&bc->bc_msgs[c], bc->bc_nhdrs, sz) != 0)
+		{
+			fprintf(stderr, "%s: unable to build message\n",
+			        progname);
+			return -1;
+		}
+
+		if (bc->bc_mode == MODE_VERIFY &&
+		    bench_sign(bc, &bc->bc_msgs[c], NULL, ns, TRUE) != 0)
+		{
+			fprintf(stderr, "%s: unable to sign message\n",
+			        progname);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+**  USAGE -- print usage message
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	EX_USAGE
+*/
+
+int
+usage(void)
+{
+	fprintf(stderr, "%s: usage: %s [options]\n"
+	        "\t-a algs     \tkey types (rsa1024,rsa2048,rsa4096,ed25519;"
+	        " default %s)\n"
+	        "\t-B entries  \tbody hash cache size for signing (default off)\n"
+	        "\t-c canons   \theader/body canonicalizations (default %s)\n"
+	        "\t-H counts   \theader fields per message (default %s)\n"
+	        "\t-j threads  \tthread counts (default 1 and one per CPU)\n"
+	        "\t-k counts   \tsignatures per message (default %s)\n"
+	        "\t-L          \tLF-only bodies, repaired with FIXCRLF\n"
+	        "\t-m sizes    \tbody sizes or min-max ranges (default %s)\n"
+	        "\t-M mode     \tsign, verify, both, or setup (handle and\n"
+	        "\t            \tdigest setup only) (default both)\n"
+	        "\t-o file     \twrite JSON results to file (default stdout)\n"
+	        "\t-t seconds  \ttest time per case (default %d)\n",
+	        progname, progname, DEFALGS, DEFCANONS, DEFHDRS, DEFSIGS,
+	        DEFSIZES, DEFTESTINT);
+
+	return EX_USAGE;
+}
+
+/*
+**  MAIN -- program mainline
+**
+**  Parameters:
+**  	The usual.
+**
+**  Return value:
+**  	Exit status.
+*/
+
+int
+main(int argc, char **argv)
+{
+	_Bool first = TRUE;
+	int c;
+	int mode;
+	int nalgs, ncanons, nhdrs, nthreads, nsigs, nsizes;
+	int a, cn, h, t, k, z;
+	unsigned long errors = 0;
+	time_t testint = DEFTESTINT;
+	char *p;
+	char *outfile = NULL;
+	char *tmpdir;
+	FILE *out = stdout;
+	char *algs[BENCH_MAXLIST];
+	char *canons[BENCH_MAXLIST];
+	char *hdrs[BENCH_MAXLIST];
+	char *threads[BENCH_MAXLIST];
+	char *sigs[BENCH_MAXLIST];
+	char *sizes[BENCH_MAXLIST];
+	char algstr[BUFSIZ];
+	char canonstr[BUFSIZ];
+	char hdrstr[BUFSIZ];
+	char threadstr[BUFSIZ];
+	char sigstr[BUFSIZ];
+	char sizestr[BUFSIZ];
+	char keyfile[MAXPATHLEN + 1];
+	struct benchcase bc;
+
+	progname = (p = strrchr(argv[0], '/')) == NULL ? argv[0] : p + 1;
+
+	strlcpy(algstr, DEFALGS, sizeof algstr);
+	strlcpy(canonstr, DEFCANONS, sizeof canonstr);
+	strlcpy(hdrstr, DEFHDRS, sizeof hdrstr);
+	strlcpy(sigstr, DEFSIGS, sizeof sigstr);
+	strlcpy(sizestr, DEFSIZES, sizeof sizestr);
+	c = sysconf(_SC_NPROCESSORS_ONLN);
+	if (c > 1)
+		snprintf(threadstr, sizeof threadstr, "1,%d", c);
+	else
+		strlcpy(threadstr, "1", sizeof threadstr);
+	mode = MODE_SIGN|MODE_VERIFY;
+
+	while ((c = getopt(argc, argv, "a:B:c:H:j:k:Lm:M:o:t:")) != -1)
+	{
+		switch (c)
+		{
+		  case 'a':
+			strlcpy(algstr, optarg, sizeof algstr);
+			break;
+
+		  case 'B':
+			bodycache = strtoul(optarg, &p, 10);
+			if (*p != '\0')
+				return usage();
+			break;
+
+		  case 'c':
+			strlcpy(canonstr, optarg, sizeof canonstr);
+			break;
+
+		  case 'H':
+			strlcpy(hdrstr, optarg, sizeof hdrstr);
+			break;
+
+		  case 'j':
+			strlcpy(threadstr, optarg, sizeof threadstr);
+			break;
+
+		  case 'k':
+			strlcpy(sigstr, optarg, sizeof sigstr);
+			break;
+
+		  case 'L':
+			lfonly = TRUE;
+			break;
+
+		  case 'm':
+			strlcpy(sizestr, optarg, sizeof sizestr);
+			break;
+
+		  case 'M':
+			if (strcasecmp(optarg, "sign") == 0)
+				mode = MODE_SIGN;
+			else if (strcasecmp(optarg, "verify") == 0)
+				mode = MODE_VERIFY;
+			else if (strcasecmp(optarg, "both") == 0)
+				mode = MODE_SIGN|MODE_VERIFY;
+			else if (strcasecmp(optarg, "setup") == 0)
+				mode = MODE_SETUP;
+			else
+				return usage();
+			break;
+
+		  case 'o':
+			outfile = optarg;
+			break;
+
+		  case 't':
+			testint = strtoul(optarg, &p, 10);
+			if (*p != '\0' || testint == 0)
+				return usage();
+			break;
+
+		  default:
+			return usage();
+		}
+	}
+
+	nalgs = bench_split(algstr, algs, BENCH_MAXLIST);
+	ncanons = bench_split(canonstr, canons, BENCH_MAXLIST);
+	nhdrs = bench_split(hdrstr, hdrs, BENCH_MAXLIST);
+	nthreads = bench_split(threadstr, threads, BENCH_MAXLIST);
+	nsigs = bench_split(sigstr, sigs, BENCH_MAXLIST);
+	nsizes = bench_split(sizestr, sizes, BENCH_MAXLIST);
+	if (nalgs <= 0 || ncanons <= 0 || nhdrs <= 0 || nthreads <= 0 ||
+	    nsigs <= 0 || nsizes <= 0)
+		return usage();
+
+	/* validate the lists before spending time on keys */
+	for (a = 0; a < nalgs; a++)
+	{
+		struct benchkey *bk;
+
+		for (bk = keys; bk->bk_name != NULL; bk++)
+		{
+			if (strcasecmp(algs[a], bk->bk_name) == 0)
+				break;
+		}
+
+		if (bk->bk_name == NULL)
+		{
+			fprintf(stderr, "%s: unknown key type '%s'\n",
+			        progname, algs[a]);
+			return EX_USAGE;
+		}
+	}
+
+	for (cn = 0; cn < ncanons; cn++)
+	{
+		char *slash;
+
+		slash = strchr(canons[cn], '/');
+		if (slash == NULL)
+			return usage();
+		*slash = '\0';
+		c = (canon_code(canons[cn]) != DKIM_CANON_UNKNOWN &&
+		     canon_code(slash + 1) != DKIM_CANON_UNKNOWN);
+		*slash = '/';
+		if (!c)
+		{
+			fprintf(stderr, "%s: unknown canonicalization '%s'\n",
+			        progname, canons[cn]);
+			return EX_USAGE;
+		}
+	}
+
+	for (k = 0; k < nsigs; k++)
+	{
+		c = strtol(sigs[k], &p, 10);
+		if (*p != '\0' || c < 1 || c > BENCH_MAXSIGS)
+			return usage();
+	}
+
+	for (h = 0; h < nhdrs; h++)
+	{
+		c = strtol(hdrs[h], &p, 10);
+		if (*p != '\0' || c < 1)
+			return usage();
+	}
+
+	for (t = 0; t < nthreads; t++)
+	{
+		c = strtol(threads[t], &p, 10);
+		if (*p != '\0' || c < 1)
+			return usage();
+	}
+
+	if (outfile != NULL)
+	{
+		out = fopen(outfile, "w");
+		if (out == NULL)
+		{
+			fprintf(stderr, "%s: %s: fopen(): %s\n", progname,
+			        outfile, strerror(errno));
+			return EX_CANTCREAT;
+		}
+	}
+
+	srandom(time(NULL));
+
+	/* keys, and the file the query method reads them back from */
+	for (a = 0; a < nalgs; a++)
+	{
+		struct benchkey *bk;
+
+		for (bk = keys; bk->bk_name != NULL; bk++)
+		{
+			if (strcasecmp(algs[a], bk->bk_name) == 0 &&
+			    bk->bk_private == NULL &&
+			    bench_keygen(bk) != 0)
+				return EX_SOFTWARE;
+		}
+	}
+
+	tmpdir = getenv("TMPDIR");
+	snprintf(keyfile, sizeof keyfile, "%s/t-bench.keys.%ld",
+	         tmpdir == NULL ? "/var/tmp" : tmpdir, (long) getpid());
+	if (bench_keyfile(keyfile) != 0)
+		return EX_CANTCREAT;
+
+	lib = dkim_init(bench_malloc, bench_free);
+	if (lib == NULL)
+	{
+		fprintf(stderr, "%s: dkim_init() failed\n", progname);
+		unlink(keyfile);
+		return EX_SOFTWARE;
+	}
+
+	if (lfonly)
+	{
+		u_int flags = DKIM_LIBFLAGS_FIXCRLF;
+
+		(void) dkim_options(lib, DKIM_OP_SETOPT, DKIM_OPTS_FLAGS,
+		                    &flags, sizeof flags);
+	}
+
+	if (bodycache > 0)
+	{
+		(void) dkim_options(lib, DKIM_OP_SETOPT, DKIM_OPTS_BODYCACHE,
+		                    &bodycache, sizeof bodycache);
+	}
+
+	c = DKIM_QUERY_FILE;
+	(void) dkim_options(lib, DKIM_OP_SETOPT, DKIM_OPTS_QUERYMETHOD,
+	                    &c, sizeof c);
+	(void) dkim_options(lib, DKIM_OP_SETOPT, DKIM_OPTS_QUERYINFO,
+	                    keyfile, strlen(keyfile));
+
+	fprintf(out, "{\"benchmark\": \"libopendkim\", "
+	        "\"libversion\": \"0x%08x\", \"seconds_per_case\": %ld,\n"
+	        "  \"results\": [",
+	        (unsigned int) dkim_libversion(), (long) testint);
+
+	memset(&bc, '\0', sizeof bc);
+
+	for (bc.bc_mode = MODE_SIGN; bc.bc_mode <= MODE_SETUP; bc.bc_mode <<= 1)
+	{
+		if ((mode & bc.bc_mode) == 0)
+			continue;
+
+		for (a = 0; a < nalgs; a++)
+		for (cn = 0; cn < ncanons; cn++)
+		for (h = 0; h < nhdrs; h++)
+		for (z = 0; z < nsizes; z++)
+		for (k = 0; k < nsigs; k++)
+		{
+			char *slash;
+
+			for (bc.bc_key = keys;
+			     strcasecmp(bc.bc_key->bk_name, algs[a]) != 0;
+			     bc.bc_key++)
+				continue;
+
+			slash = strchr(canons[cn], '/');
+			*slash = '\0';
+			bc.bc_hcanon = canon_code(canons[cn]);
+			bc.bc_bcanon = canon_code(slash + 1);
+			*slash = '/';
+			bc.bc_canon = canons[cn];
+			bc.bc_nhdrs = atoi(hdrs[h]);
+			bc.bc_size = sizes[z];
+			bc.bc_nsigs = atoi(sigs[k]);
+
+			if (bench_mkpool(&bc) != 0)
+			{
+				errors++;
+			}
+			else
+			{
+				for (t = 0; t < nthreads; t++)
+				{
+					bc.bc_threads = atoi(threads[t]);
+					errors += bench_run(&bc, testint, out,
+					                    first);
+					first = FALSE;
+				}
+			}
+
+			for (c = 0; c < BENCH_POOL; c++)
+				bench_freemsg(&bc.bc_msgs[c]);
+		}
+	}
+
+	fprintf(out, "\n  ]\n}\n");
+	if (out != stdout)
+		fclose(out);
+
+	dkim_close(lib);
+	unlink(keyfile);
+
+	return (errors == 0 ? 0 : 1);
+}
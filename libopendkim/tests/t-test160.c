@@ -0,0 +1,174 @@
+/*
+**  Copyright 2025 OpenDKIM contributors.
+*/
+
+#include "build-config.h"
+
+/* system includes */
+#include <sys/types.h>
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+
+#ifdef USE_GNUTLS
+# include <gnutls/gnutls.h>
+#endif /* USE_GNUTLS */
+
+/* libopendkim includes */
+#include "../dkim.h"
+#include "t-testdata.h"
+
+/* libbsd if found */
+#ifdef USE_BSD_H
+# include <bsd/string.h>
+#endif /* USE_BSD_H */
+
+/* libstrl if needed */
+#ifdef USE_STRL_H
+# include <strl.h>
+#endif /* USE_STRL_H */
+
+#define	MAXHEADER	4096
+
+/* the same body with proper and with mixed line endings */
+#define	CRLFBODY	"Hi,\r\n\r\nThis is a  test.\t\r\n\r\nOne\r\nTwo \r\n" \
+			"Three\r\n\r\n\r\n"
+#define	MIXEDBODY	"Hi,\n\nThis is a  test.\t\r\n\nOne\rTwo \n" \
+			"Three\n\r\n\n"
+
+/*
+**  SIGN -- sign a message, feeding the body in chunks of a given size
+**
+**  Parameters:
+**  	lib -- library handle
+**  	bcanon -- body canonicalization
+**  	body -- body
+**  	chunk -- chunk size (0 means all at once)
+**  	sig -- signature (returned)
+**  	siglen -- bytes available at "sig"
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+sign(DKIM_LIB *lib, dkim_canon_t bcanon, char *body, size_t chunk,
+     unsigned char *sig, size_t siglen)
+{
+	size_t off;
+	size_t len;
+	size_t bodylen;
+	DKIM_STAT status;
+	DKIM *dkim;
+	dkim_sigkey_t key;
+
+	key = KEY;
+
+	dkim = dkim_sign(lib, JOBID, NULL, key, SELECTOR, DOMAIN,
+	                 DKIM_CANON_RELAXED, bcanon, DKIM_SIGN_RSASHA256,
+	                 -1L, &status);
+	assert(dkim != NULL);
+
+	status = dkim_header(dkim, HEADER05, strlen(HEADER05));
+	assert(status == DKIM_STAT_OK);
+
+	status = dkim_header(dkim, HEADER06, strlen(HEADER06));
+	assert(status == DKIM_STAT_OK);
+
+	status = dkim_eoh(dkim);
+	assert(status == DKIM_STAT_OK);
+
+	bodylen = strlen(body);
+	if (chunk == 0)
+		chunk = bodylen;
+
+	for (off = 0; off < bodylen; off += len)
+	{
+		len = bodylen - off < chunk ? bodylen - off : chunk;
+		status = dkim_body(dkim, body + off, len);
+		assert(status == DKIM_STAT_OK);
+	}
+
+	status = dkim_eom(dkim, NULL);
+	assert(status == DKIM_STAT_OK);
+
+	memset(sig, '\0', siglen);
+	status = dkim_getsighdr(dkim, sig, siglen,
+	                        strlen(DKIM_SIGNHEADER) + 2);
+	assert(status == DKIM_STAT_OK);
+
+	status = dkim_free(dkim);
+	assert(status == DKIM_STAT_OK);
+}
+
+/*
+**  MAIN -- program mainline
+**
+**  Parameters:
+**  	The usual.
+**
+**  Return value:
+**  	Exit status.
+*/
+
+int
+main(int argc, char **argv)
+{
+	int c;
+	u_int flags;
+	uint64_t fixed_time;
+	size_t chunk;
+	DKIM_LIB *lib;
+	DKIM_LIB *fixlib;
+	dkim_canon_t canons[] = { DKIM_CANON_SIMPLE, DKIM_CANON_RELAXED };
+	unsigned char ref[MAXHEADER + 1];
+	unsigned char hdr[MAXHEADER + 1];
+
+	printf("*** relaxed/simple and relaxed/relaxed rsa-sha256 signing of mixed line endings with FIXCRLF, various chunk sizes\n");
+
+#ifdef USE_GNUTLS
+	(void) gnutls_global_init();
+#endif /* USE_GNUTLS */
+
+	/* instantiate the libraries */
+	lib = dkim_init(NULL, NULL);
+	assert(lib != NULL);
+
+	fixlib = dkim_init(NULL, NULL);
+	assert(fixlib != NULL);
+
+	/* set flags */
+	flags = DKIM_LIBFLAGS_FIXCRLF;
+	(void) dkim_options(fixlib, DKIM_OP_SETOPT, DKIM_OPTS_FLAGS, &flags,
+	                    sizeof flags);
+
+	/* fix signing time */
+	fixed_time = 1172620939;
+	(void) dkim_options(lib, DKIM_OP_SETOPT, DKIM_OPTS_FIXEDTIME,
+	                    &fixed_time, sizeof fixed_time);
+	(void) dkim_options(fixlib, DKIM_OP_SETOPT, DKIM_OPTS_FIXEDTIME,
+	                    &fixed_time, sizeof fixed_time);
+
+	for (c = 0; c < sizeof canons / sizeof canons[0]; c++)
+	{
+		/* what the repaired body is supposed to look like */
+		sign(lib, canons[c], CRLFBODY, 0, ref, sizeof ref);
+
+		/* already well-formed input must come through unchanged */
+		sign(fixlib, canons[c], CRLFBODY, 0, hdr, sizeof hdr);
+		assert(strcmp(ref, hdr) == 0);
+
+		/* chunk boundaries anywhere, including between CR and LF */
+		for (chunk = 0; chunk <= 8; chunk++)
+		{
+			sign(fixlib, canons[c], MIXEDBODY, chunk,
+			     hdr, sizeof hdr);
+			assert(strcmp(ref, hdr) == 0);
+		}
+	}
+
+	dkim_close(fixlib);
+	dkim_close(lib);
+
+	return 0;
+}
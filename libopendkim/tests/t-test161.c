@@ -0,0 +1,330 @@
+/*
+**  Copyright 2025 OpenDKIM contributors.
+*/
+
+#include "build-config.h"
+
+/* system includes */
+#include <sys/types.h>
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+
+#ifdef USE_GNUTLS
+# include <gnutls/gnutls.h>
+#endif /* USE_GNUTLS */
+
+/* libopendkim includes */
+#include "../dkim.h"
+#include "t-testdata.h"
+
+/* libbsd if found */
+#ifdef USE_BSD_H
+# include <bsd/string.h>
+#endif /* USE_BSD_H */
+
+/* libstrl if needed */
+#ifdef USE_STRL_H
+# include <strl.h>
+#endif /* USE_STRL_H */
+
+#define	MAXHEADER	4096
+
+#define JOBID1		"testing1"
+#define JOBID2		"testing2"
+#define JOBID3		"testing3"
+#define JOBID4		"testing4"
+
+#ifndef TRUE
+# define TRUE		1
+#endif /* ! TRUE */
+
+/*
+**  HEADERS -- feed the test message's header fields to a handle
+**
+**  Parameters:
+**  	dkim -- DKIM handle
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+headers(DKIM *dkim)
+{
+	DKIM_STAT status;
+
+	status = dkim_header(dkim, HEADER01, strlen(HEADER01));
+	assert(status == DKIM_STAT_OK);
+
+	status = dkim_header(dkim, HEADER02, strlen(HEADER02));
+	assert(status == DKIM_STAT_OK);
+
+	status = dkim_header(dkim, HEADER03, strlen(HEADER03));
+	assert(status == DKIM_STAT_OK);
+
+	status = dkim_header(dkim, HEADER04, strlen(HEADER04));
+	assert(status == DKIM_STAT_OK);
+
+	status = dkim_header(dkim, HEADER05, strlen(HEADER05));
+	assert(status == DKIM_STAT_OK);
+
+	status = dkim_header(dkim, HEADER06, strlen(HEADER06));
+	assert(status == DKIM_STAT_OK);
+
+	status = dkim_header(dkim, HEADER07, strlen(HEADER07));
+	assert(status == DKIM_STAT_OK);
+
+	status = dkim_header(dkim, HEADER08, strlen(HEADER08));
+	assert(status == DKIM_STAT_OK);
+
+	status = dkim_header(dkim, HEADER09, strlen(HEADER09));
+	assert(status == DKIM_STAT_OK);
+}
+
+/*
+**  BODY -- feed the test message's body to a handle
+**
+**  Parameters:
+**  	dkim -- DKIM handle
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+body(DKIM *dkim)
+{
+	DKIM_STAT status;
+
+	status = dkim_body(dkim, BODY00, strlen(BODY00));
+	assert(status == DKIM_STAT_OK);
+
+	status = dkim_body(dkim, BODY01, strlen(BODY01));
+	assert(status == DKIM_STAT_OK);
+
+	status = dkim_body(dkim, BODY02, strlen(BODY02));
+	assert(status == DKIM_STAT_OK);
+
+	status = dkim_body(dkim, BODY03, strlen(BODY03));
+	assert(status == DKIM_STAT_OK);
+
+	status = dkim_body(dkim, BODY04, strlen(BODY04));
+	assert(status == DKIM_STAT_OK);
+
+	status = dkim_body(dkim, BODY05, strlen(BODY05));
+	assert(status == DKIM_STAT_OK);
+}
+
+/*
+**  MAIN -- program mainline
+**
+**  Parameters:
+**  	The usual.
+**
+**  Return value:
+**  	Exit status.
+*/
+
+/*
+**  SIGN -- sign the test message
+**
+**  Parameters:
+**  	lib -- library handle
+**  	jobid -- job ID
+**  	bodycanon -- body canonicalization
+**  	sig -- signature header field (returned)
+**  	siglen -- bytes available at "sig"
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+sign(DKIM_LIB *lib, char *jobid, dkim_canon_t bodycanon, unsigned char *sig,
+     size_t siglen)
+{
+	DKIM_STAT status;
+	DKIM *dkim;
+
+	dkim = dkim_sign(lib, jobid, NULL, KEY, SELECTOR, DOMAIN,
+	                 DKIM_CANON_RELAXED, bodycanon,
+	                 DKIM_SIGN_RSASHA256, -1L, &status);
+	assert(dkim != NULL);
+
+	headers(dkim);
+
+	status = dkim_eoh(dkim);
+	assert(status == DKIM_STAT_OK);
+
+	body(dkim);
+
+	status = dkim_eom(dkim, NULL);
+	assert(status == DKIM_STAT_OK);
+
+	memset(sig, '\0', siglen);
+	status = dkim_getsighdr(dkim, sig, siglen,
+	                        strlen(DKIM_SIGNHEADER) + 2);
+	assert(status == DKIM_STAT_OK);
+
+	status = dkim_free(dkim);
+	assert(status == DKIM_STAT_OK);
+}
+
+/*
+**  MAIN -- program mainline
+**
+**  Parameters:
+**  	The usual.
+**
+**  Return value:
+**  	Exit status.
+*/
+
+int
+main(int argc, char **argv)
+{
+	int c;
+	int nsigs;
+	_Bool resigning;
+	DKIM_STAT status;
+	uint64_t fixed_time;
+	DKIM *dkim;
+	DKIM *resign;
+	DKIM_LIB *lib;
+	DKIM_SIGINFO **sigs;
+	dkim_query_t qtype = DKIM_QUERY_FILE;
+	unsigned char sig1[MAXHEADER + 1];
+	unsigned char sig2[MAXHEADER + 1];
+	unsigned char hdr[sizeof DKIM_SIGNHEADER + 2 + MAXHEADER + 1];
+
+#ifdef USE_GNUTLS
+	(void) gnutls_global_init();
+#endif /* USE_GNUTLS */
+
+	/* instantiate the library */
+	lib = dkim_init(NULL, NULL);
+	assert(lib != NULL);
+
+	resigning = dkim_libfeature(lib, DKIM_FEATURE_RESIGN);
+
+	if (resigning)
+		printf("*** relaxed header canonicalization shared by signatures and re-signing handles\n");
+	else
+		printf("*** relaxed header canonicalization shared by signatures\n");
+
+	/* test mode */
+	(void) dkim_options(lib, DKIM_OP_SETOPT, DKIM_OPTS_QUERYMETHOD,
+	                    &qtype, sizeof qtype);
+	(void) dkim_options(lib, DKIM_OP_SETOPT, DKIM_OPTS_QUERYINFO,
+	                    KEYFILE, strlen(KEYFILE));
+
+	/* restrict signed headers */
+	(void) dkim_options(lib, DKIM_OP_SETOPT, DKIM_OPTS_SIGNHDRS,
+	                    dkim_should_signhdrs, sizeof(u_char **));
+
+	/* fix signing time */
+	fixed_time = 1172620939;
+	(void) dkim_options(lib, DKIM_OP_SETOPT, DKIM_OPTS_FIXEDTIME,
+	                    &fixed_time, sizeof fixed_time);
+
+	/* an original relaxed/relaxed signature */
+	sign(lib, JOBID1, DKIM_CANON_RELAXED, sig1, sizeof sig1);
+
+	if (!resigning)
+	{
+		/* a second, relaxed/simple signature */
+		sign(lib, JOBID3, DKIM_CANON_SIMPLE, sig2, sizeof sig2);
+	}
+	else
+	{
+		/*
+		**  Verify the first one while re-signing relaxed/simple from
+		**  the same header fields; the relaxed forms the verifier
+		**  builds are reused by the signer.
+		*/
+
+		dkim = dkim_verify(lib, JOBID2, NULL, &status);
+		assert(dkim != NULL);
+
+		snprintf(hdr, sizeof hdr, "%s: %s", DKIM_SIGNHEADER, sig1);
+		status = dkim_header(dkim, hdr, strlen(hdr));
+		assert(status == DKIM_STAT_OK);
+
+		headers(dkim);
+
+		resign = dkim_sign(lib, JOBID3, NULL, KEY, SELECTOR, DOMAIN,
+		                   DKIM_CANON_RELAXED, DKIM_CANON_SIMPLE,
+		                   DKIM_SIGN_RSASHA256, -1L, &status);
+		assert(resign != NULL);
+
+		status = dkim_resign(resign, dkim, TRUE);
+		assert(status == DKIM_STAT_OK);
+
+		status = dkim_eoh(dkim);
+		assert(status == DKIM_STAT_OK);
+
+		body(dkim);
+
+		status = dkim_eom(dkim, NULL);
+		assert(status == DKIM_STAT_OK);
+
+		status = dkim_eom(resign, NULL);
+		assert(status == DKIM_STAT_OK);
+
+		memset(sig2, '\0', sizeof sig2);
+		status = dkim_getsighdr(resign, sig2, sizeof sig2,
+		                        strlen(DKIM_SIGNHEADER) + 2);
+		assert(status == DKIM_STAT_OK);
+
+		status = dkim_free(resign);
+		assert(status == DKIM_STAT_OK);
+
+		status = dkim_free(dkim);
+		assert(status == DKIM_STAT_OK);
+	}
+
+	/*
+	**  Both signatures have to verify on one handle, which builds the
+	**  relaxed header fields once for the two of them.
+	*/
+
+	dkim = dkim_verify(lib, JOBID4, NULL, &status);
+	assert(dkim != NULL);
+
+	snprintf(hdr, sizeof hdr, "%s: %s", DKIM_SIGNHEADER, sig2);
+	status = dkim_header(dkim, hdr, strlen(hdr));
+	assert(status == DKIM_STAT_OK);
+
+	snprintf(hdr, sizeof hdr, "%s: %s", DKIM_SIGNHEADER, sig1);
+	status = dkim_header(dkim, hdr, strlen(hdr));
+	assert(status == DKIM_STAT_OK);
+
+	headers(dkim);
+
+	status = dkim_eoh(dkim);
+	assert(status == DKIM_STAT_OK);
+
+	body(dkim);
+
+	status = dkim_eom(dkim, NULL);
+	assert(status == DKIM_STAT_OK);
+
+	status = dkim_getsiglist(dkim, &sigs, &nsigs);
+	assert(status == DKIM_STAT_OK);
+	assert(nsigs == 2);
+
+	for (c = 0; c < nsigs; c++)
+	{
+		assert(dkim_sig_geterror(sigs[c]) == DKIM_SIGERROR_OK);
+		assert((dkim_sig_getflags(sigs[c]) & DKIM_SIGFLAG_PASSED) != 0);
+		assert(dkim_sig_getbh(sigs[c]) == DKIM_SIGBH_MATCH);
+	}
+
+	status = dkim_free(dkim);
+	assert(status == DKIM_STAT_OK);
+
+	dkim_close(lib);
+
+	return 0;
+}
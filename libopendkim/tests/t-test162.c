@@ -0,0 +1,245 @@
+/*
+**  Copyright 2025 OpenDKIM contributors.
+*/
+
+#include "build-config.h"
+
+/* system includes */
+#include <sys/types.h>
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+
+#ifdef USE_GNUTLS
+# include <gnutls/gnutls.h>
+#endif /* USE_GNUTLS */
+
+/* libopendkim includes */
+#include "../dkim.h"
+#include "t-testdata.h"
+
+/* libbsd if found */
+#ifdef USE_BSD_H
+# include <bsd/string.h>
+#endif /* USE_BSD_H */
+
+/* libstrl if needed */
+#ifdef USE_STRL_H
+# include <strl.h>
+#endif /* USE_STRL_H */
+
+#define	MAXHEADER	4096
+
+#ifndef FALSE
+# define FALSE		0
+#endif /* ! FALSE */
+#ifndef TRUE
+# define TRUE		1
+#endif /* ! TRUE */
+
+#define	BODYA		"Hi,\r\n\r\nThis is a  test.\t\r\n\r\nOne\r\nTwo \r\n" \
+			"Three\r\n\r\n\r\n"
+#define	BODYB		"Hi,\r\n\r\nThis is a  test.\t\r\n\r\nOne\r\nTwo \r\n" \
+			"There\r\n\r\n\r\n"
+
+#define	TO1		"To: One Recipient <one@example.net>"
+#define	TO2		"To: Another Recipient <two@example.net>"
+
+/*
+**  SIGN -- sign a message, feeding the body in small chunks
+**
+**  Parameters:
+**  	lib -- library handle
+**  	bcanon -- body canonicalization
+**  	length -- body length limit, or -1
+**  	to -- recipient header field
+**  	body -- body
+**  	sig -- signature (returned)
+**  	siglen -- bytes available at "sig"
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+sign(DKIM_LIB *lib, dkim_canon_t bcanon, ssize_t length, char *to,
+     char *body, unsigned char *sig, size_t siglen)
+{
+	size_t off;
+	size_t len;
+	size_t bodylen;
+	DKIM_STAT status;
+	DKIM *dkim;
+	dkim_sigkey_t key;
+
+	key = KEY;
+
+	dkim = dkim_sign(lib, JOBID, NULL, key, SELECTOR, DOMAIN,
+	                 DKIM_CANON_RELAXED, bcanon, DKIM_SIGN_RSASHA256,
+	                 length, &status);
+	assert(dkim != NULL);
+
+	status = dkim_header(dkim, HEADER05, strlen(HEADER05));
+	assert(status == DKIM_STAT_OK);
+
+	status = dkim_header(dkim, to, strlen(to));
+	assert(status == DKIM_STAT_OK);
+
+	status = dkim_eoh(dkim);
+	assert(status == DKIM_STAT_OK);
+
+	bodylen = strlen(body);
+	for (off = 0; off < bodylen; off += len)
+	{
+		len = bodylen - off < 7 ? bodylen - off : 7;
+		status = dkim_body(dkim, body + off, len);
+		assert(status == DKIM_STAT_OK);
+	}
+
+	status = dkim_eom(dkim, NULL);
+	assert(status == DKIM_STAT_OK);
+
+	memset(sig, '\0', siglen);
+	status = dkim_getsighdr(dkim, sig, siglen,
+	                        strlen(DKIM_SIGNHEADER) + 2);
+	assert(status == DKIM_STAT_OK);
+
+	status = dkim_free(dkim);
+	assert(status == DKIM_STAT_OK);
+}
+
+/*
+**  CHECK -- sign with and without the cache and compare
+**
+**  Parameters:
+**  	lib -- library handle without a body hash cache
+**  	clib -- library handle with a body hash cache
+**  	bcanon -- body canonicalization
+**  	length -- body length limit, or -1
+**  	to -- recipient header field
+**  	body -- body
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+check(DKIM_LIB *lib, DKIM_LIB *clib, dkim_canon_t bcanon, ssize_t length,
+      char *to, char *body)
+{
+	unsigned char ref[MAXHEADER + 1];
+	unsigned char hdr[MAXHEADER + 1];
+
+	sign(lib, bcanon, length, to, body, ref, sizeof ref);
+	sign(clib, bcanon, length, to, body, hdr, sizeof hdr);
+
+	assert(strcmp((char *) ref, (char *) hdr) == 0);
+}
+
+/*
+**  MAIN -- program mainline
+**
+**  Parameters:
+**  	The usual.
+**
+**  Return value:
+**  	Exit status.
+*/
+
+int
+main(int argc, char **argv)
+{
+	u_int size;
+	u_int lookups;
+	u_int hits;
+	u_int entries;
+	size_t max;
+	DKIM_STAT status;
+	uint64_t fixed_time;
+	DKIM_LIB *lib;
+	DKIM_LIB *clib;
+
+	printf("*** relaxed/simple and relaxed/relaxed rsa-sha256 signing with a body hash cache\n");
+
+#ifdef USE_GNUTLS
+	(void) gnutls_global_init();
+#endif /* USE_GNUTLS */
+
+	/* instantiate the libraries */
+	lib = dkim_init(NULL, NULL);
+	assert(lib != NULL);
+
+	clib = dkim_init(NULL, NULL);
+	assert(clib != NULL);
+
+	status = dkim_getbodycachestats(clib, NULL, NULL, NULL, FALSE);
+	assert(status == DKIM_STAT_INVALID);
+
+	size = 2;
+	status = dkim_options(clib, DKIM_OP_SETOPT, DKIM_OPTS_BODYCACHE,
+	                      &size, sizeof size);
+	assert(status == DKIM_STAT_OK);
+
+	/* fix signing time */
+	fixed_time = 1172620939;
+	(void) dkim_options(lib, DKIM_OP_SETOPT, DKIM_OPTS_FIXEDTIME,
+	                    &fixed_time, sizeof fixed_time);
+	(void) dkim_options(clib, DKIM_OP_SETOPT, DKIM_OPTS_FIXEDTIME,
+	                    &fixed_time, sizeof fixed_time);
+
+	/* first sight of a body is a miss, later ones are hits */
+	check(lib, clib, DKIM_CANON_RELAXED, -1, TO1, BODYA);
+	check(lib, clib, DKIM_CANON_RELAXED, -1, TO2, BODYA);
+	check(lib, clib, DKIM_CANON_RELAXED, -1, TO1, BODYA);
+
+	status = dkim_getbodycachestats(clib, &lookups, &hits, &entries,
+	                                FALSE);
+	assert(status == DKIM_STAT_OK);
+	assert(lookups == 3);
+	assert(hits == 2);
+	assert(entries == 1);
+
+	/* the cache can't be replaced once handles exist */
+	size = 4;
+	status = dkim_options(clib, DKIM_OP_SETOPT, DKIM_OPTS_BODYCACHE,
+	                      &size, sizeof size);
+	assert(status == DKIM_STAT_INVALID);
+
+	/* same length, different content */
+	check(lib, clib, DKIM_CANON_RELAXED, -1, TO1, BODYB);
+
+	/* different canonicalization and length limit */
+	check(lib, clib, DKIM_CANON_SIMPLE, -1, TO1, BODYA);
+	check(lib, clib, DKIM_CANON_RELAXED, 10, TO1, BODYA);
+	check(lib, clib, DKIM_CANON_RELAXED, 10, TO2, BODYA);
+
+	/* empty body */
+	check(lib, clib, DKIM_CANON_SIMPLE, -1, TO1, "");
+	check(lib, clib, DKIM_CANON_SIMPLE, -1, TO2, "");
+
+	status = dkim_getbodycachestats(clib, &lookups, &hits, &entries,
+	                                TRUE);
+	assert(status == DKIM_STAT_OK);
+	assert(lookups == 9);
+	assert(hits == 4);
+	assert(entries == 2);
+
+	/* bodies bigger than the limit bypass the cache */
+	max = 16;
+	status = dkim_options(clib, DKIM_OP_SETOPT, DKIM_OPTS_BODYCACHEMAX,
+	                      &max, sizeof max);
+	assert(status == DKIM_STAT_OK);
+
+	check(lib, clib, DKIM_CANON_RELAXED, -1, TO1, BODYA);
+	check(lib, clib, DKIM_CANON_RELAXED, -1, TO2, BODYA);
+
+	status = dkim_getbodycachestats(clib, &lookups, &hits, NULL, FALSE);
+	assert(status == DKIM_STAT_OK);
+	assert(lookups == 0);
+	assert(hits == 0);
+
+	dkim_close(clib);
+	dkim_close(lib);
+
+	return 0;
+}
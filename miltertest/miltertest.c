@@ -33,6 +33,8 @@
 #include <unistd.h>
 #include <netdb.h>
 #include <time.h>
+#include <dirent.h>
+#include <pthread.h>
 
 /* libmilter includes */
 #include <libmilter/mfapi.h>
@@ -89,15 +91,20 @@ typedef unsigned int useconds_t;
 # define SMFIP_NR_UNKN		0
 #endif /* SMFIP_NR_CONN */
 
+#ifndef MILTER_CHUNK_SIZE
+# define MILTER_CHUNK_SIZE	65535
+#endif /* ! MILTER_CHUNK_SIZE */
+
 #define	MT_PRODUCT		"OpenDKIM milter test facility"
 #define	MT_VERSION		"1.6.0"
 
 #define	BUFRSZ			1024
 #define	CHUNKSZ			65536
 
-#define	CMDLINEOPTS		"D:s:uvVw"
+#define	CMDLINEOPTS		"c:d:D:f:l:m:n:r:s:uvVw"
 
 #define	DEFBODY			"Dummy message body.\r\n"
+#define	DEFLOADCONNS		1
 #define	DEFCLIENTPORT		12345
 #define DEFCLIENTHOST		"test.example.com"
 #define DEFCLIENTIP		"12.34.56.78"
@@ -120,6 +127,13 @@ typedef unsigned int useconds_t;
 #define	STATE_EOM		10
 #define	STATE_DEAD		99
 
+#define	MT_LOAD_CONNECT		0
+#define	MT_LOAD_EOH		1
+#define	MT_LOAD_BODY		2
+#define	MT_LOAD_EOM		3
+#define	MT_LOAD_TOTAL		4
+#define	MT_LOAD_STAGES		5
+
 #define MT_HDRADD		1
 #define MT_HDRINSERT		2
 #define MT_HDRCHANGE		3
@@ -180,6 +194,58 @@ struct mt_context
 	struct mt_eom_request * ctx_eomreqs;	/* EOM requests */
 };
 
+struct mt_loadmsg
+{
+	char *		lm_path;		/* file it came from */
+	size_t		lm_nhdrs;		/* header field count */
+	char **		lm_hdrs;		/* name/value pointer pairs */
+	char *		lm_text;		/* header and body text */
+	char *		lm_body;		/* body (CRLF), in lm_text */
+	size_t		lm_bodylen;		/* body length */
+};
+
+struct mt_samples
+{
+	size_t		ms_n;			/* samples stored */
+	size_t		ms_alloc;		/* samples allocated */
+	unsigned long *	ms_usec;		/* latencies (usec) */
+};
+
+struct mt_loadjob
+{
+	int		lj_nconns;		/* concurrent connections */
+	unsigned int	lj_perconn;		/* messages per connection */
+	unsigned long	lj_limit;		/* messages to send (0 = none) */
+	time_t		lj_duration;		/* seconds to run (0 = none) */
+	double		lj_rate;		/* msgs/sec (0 = closed loop) */
+	char *		lj_sockinfo;		/* filter socket */
+	char *		lj_filter;		/* filter command line */
+	unsigned long	lj_next;		/* next message number */
+	struct timeval	lj_start;		/* start of run */
+	size_t		lj_nmsgs;		/* corpus size */
+	size_t		lj_amsgs;		/* corpus slots allocated */
+	struct mt_loadmsg * lj_msgs;		/* corpus */
+	pthread_mutex_t	lj_lock;		/* lock for lj_next */
+};
+
+struct mt_loadworker
+{
+	int		lw_id;			/* worker number */
+	pthread_t	lw_tid;			/* thread */
+	struct mt_loadjob * lw_job;		/* job */
+	unsigned long	lw_done;		/* messages completed */
+	unsigned long	lw_errors;		/* connection/I/O errors */
+	unsigned long	lw_accept;		/* accept/continue replies */
+	unsigned long	lw_reject;		/* reject replies */
+	unsigned long	lw_tempfail;		/* tempfail replies */
+	unsigned long	lw_discard;		/* discard replies */
+	unsigned long	lw_other;		/* other replies */
+	size_t		lw_hbufsz;		/* header buffer size */
+	char *		lw_hbuf;		/* header buffer */
+	struct mt_samples lw_samples[MT_LOAD_STAGES]; /* latencies */
+	char		lw_rbuf[CHUNKSZ];	/* EOM reply buffer */
+};
+
 struct mt_lua_io
 {
 	_Bool		lua_io_done;
@@ -469,6 +535,15 @@ mt_milter_read(int fd, char *cmd, const char *buf, size_t *len)
 	(void) memcpy(&i, data, MILTER_LEN_BYTES);
 	expl = ntohl(i) - 1;
 
+	if (expl > 0 && (size_t) expl > *len)
+	{
+		fprintf(stderr,
+		        "%s: read(%d): reply of %ld byte(s) exceeds buffer\n",
+		        progname, fd, (long) expl);
+
+		return FALSE;
+	}
+
 	rlen = 0;
 
 	if (expl > 0)
@@ -1125,6 +1200,96 @@ mt_set_timeout(lua_State *l)
 	return 0;
 }
 
+/*
+**  MT_SPAWN -- start a filter process
+**
+**  Parameters:
+**  	argv -- argument vector, argv[0] being the path to the filter
+**  	err -- error buffer
+**  	errlen -- bytes available at "err"
+**
+**  Return value:
+**  	Process ID of the child, or -1 on error (with "err" updated).
+*/
+
+pid_t
+mt_spawn(const char **argv, char *err, size_t errlen)
+{
+	int c;
+	int dummy;
+	int status;
+	int fds[2];
+	pid_t child;
+
+	assert(argv != NULL);
+	assert(argv[0] != NULL);
+	assert(err != NULL);
+
+	if (pipe(fds) != 0)
+	{
+		snprintf(err, errlen, "pipe(): %s", strerror(errno));
+		return -1;
+	}
+
+	if (fcntl(fds[1], F_SETFD, FD_CLOEXEC) != 0)
+	{
+		snprintf(err, errlen, "fcntl(): %s", strerror(errno));
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+
+	child = fork();
+	switch (child)
+	{
+	  case -1:
+		snprintf(err, errlen, "fork(): %s", strerror(errno));
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+
+	  case 0:
+		close(fds[0]);
+		execv(argv[0], (char * const *) argv);
+		exit(1);
+
+	  default:
+		close(fds[1]);
+
+		c = read(fds[0], &dummy, sizeof(dummy));
+		close(fds[0]);
+		if (c == -1)
+		{
+			snprintf(err, errlen, "read(): %s", strerror(errno));
+			return -1;
+		}
+		else if (c != 0)
+		{
+			snprintf(err, errlen, "read(): got %d, expecting 0",
+			         c);
+			return -1;
+		}
+
+		if (wait4(child, &status, WNOHANG, NULL) != 0)
+		{
+			snprintf(err, errlen,
+			         "wait4(): child %d exited prematurely, status %d",
+			         child, status);
+			return -1;
+		}
+
+		if (verbose > 0)
+		{
+			fprintf(stderr, "%s: '%s' started in process %d\n",
+			        progname, argv[0], child);
+		}
+
+		break;
+	}
+
+	return child;
+}
+
 /*
 **  MT_STARTFILTER -- start a filter
 **
@@ -1140,10 +1305,9 @@ mt_startfilter(lua_State *l)
 {
 	const char **argv;
 	int c;
-	int status;
 	int args;
-	int fds[2];
 	pid_t child;
+	char err[BUFRSZ];
 
 	assert(l != NULL);
 
@@ -1182,77 +1346,20 @@ mt_startfilter(lua_State *l)
 		}
 	}
 	argv[c - 1] = NULL;
-	lua_pop(l, c);
 
-	if (pipe(fds) != 0)
-	{
-		lua_pushfstring(l, "mt.startfilter(): pipe(): %s",
-		                strerror(errno));
-		lua_error(l);
-	}
+	child = mt_spawn(argv, err, sizeof err);
 
-	if (fcntl(fds[1], F_SETFD, FD_CLOEXEC) != 0)
-	{
-		lua_pushfstring(l, "mt.startfilter(): fcntl(): %s",
-		                strerror(errno));
-		lua_error(l);
-	}
+	free((void *) argv);
+	lua_pop(l, args);
 
-	child = fork();
-	switch (child)
+	if (child == -1)
 	{
-	  case -1:
-		lua_pushfstring(l, "mt.startfilter(): fork(): %s",
-		                strerror(errno));
+		lua_pushfstring(l, "mt.startfilter(): %s", err);
 		lua_error(l);
-
-	  case 0:
-		close(fds[0]);
-		execv(argv[0], (char * const *) argv);
-		exit(1);
-
-	  default:
-		close(fds[1]);
-
-		c = read(fds[0], &args, sizeof(args));
-		if (c == -1)
-		{
-			lua_pushfstring(l, "mt.startfilter(): read(): %s",
-			                strerror(errno));
-			lua_error(l);
-		}
-		else if (c != 0)
-		{
-			lua_pushfstring(l,
-			                "mt.startfilter(): read(): got %d, expecting 0",
-			                c);
-			lua_error(l);
-		}
-
-		close(fds[0]);
-
-		filterpid = child;
-
-		child = wait4(filterpid, &status, WNOHANG, NULL);
-		if (child != 0)
-		{
-			lua_pushfstring(l,
-			                "mt.startfilter(): wait4(): child %d exited prematurely, status %d",
-			                child, status);
-			lua_error(l);
-		}
-
-		if (verbose > 0)
-		{
-			fprintf(stderr, "%s: '%s' started in process %d\n",
-			        progname, argv[0], filterpid);
-		}
-
-		free((void *) argv);
-
-		break;
 	}
 
+	filterpid = child;
+
 	lua_pushnil(l);
 
 	return 1;
@@ -1305,63 +1412,45 @@ mt_signal(lua_State *l)
 }
 
 /*
-**  MT_CONNECT -- connect to a filter, returning a handle
+**  MT_SOCKOPEN -- open a connection to a filter socket
 **
 **  Parameters:
-**  	l -- Lua state
+**  	sockinfo -- socket specification ([inet:|unix:|local:]...)
+**  	count -- number of connection attempts
+**  	interval -- delay between attempts (microseconds)
+**  	err -- error buffer
+**  	errlen -- bytes available at "err"
 **
 **  Return value:
-**   	A new connection handle (on the Lua stack).
+**  	Connected descriptor, or -1 on error (with "err" updated).
 */
 
 int
-mt_connect(lua_State *l)
+mt_sockopen(const char *sockinfo, u_int count, useconds_t interval,
+            char *err, size_t errlen)
 {
-	int top;
 	int af;
 	int fd = -1;
 	int saverr = 0;
-	u_int count = 1;
-	useconds_t interval = 0;
 	char *at;
 	char *p;
-	const char *sockinfo;
-	struct mt_context *new;
-
-	assert(l != NULL);
-
-	top = lua_gettop(l);
+	char spec[BUFRSZ];
+	struct sockaddr_un sun;
+	struct sockaddr_in sin;
+	struct sockaddr *sa;
+	socklen_t salen;
 
-	if (!(top == 1 && lua_isstring(l, 1)) &&
-	    !(top == 3 && lua_isstring(l, 1) && lua_isnumber(l, 2) &&
-	                  lua_isnumber(l, 3)))
-	{
-		lua_pushstring(l, "mt.connect(): Invalid argument");
-		lua_error(l);
-	}
+	assert(sockinfo != NULL);
+	assert(err != NULL);
 
-	sockinfo = lua_tostring(l, 1);
-	if (top == 3)
+	if (strlcpy(spec, sockinfo, sizeof spec) >= sizeof spec)
 	{
-		char *f;
-
-		count = (u_int) lua_tonumber(l, 2);
-		interval = (useconds_t) (1000000. * lua_tonumber(l, 3));
-
-		f = getenv("MILTERTEST_RETRY_SPEED_FACTOR");
-		if (f != NULL)
-		{
-			unsigned int factor;
-
-			factor = strtoul(f, &p, 10);
-			if (*p == '\0')
-				interval *= factor;
-		}
+		snprintf(err, errlen, "Invalid argument");
+		return -1;
 	}
-	lua_pop(l, top);
 
 	af = AF_UNSPEC;
-	p = strchr(sockinfo, ':');
+	p = strchr(spec, ':');
 	if (p == NULL)
 	{
 		af = AF_UNIX;
@@ -1369,93 +1458,44 @@ mt_connect(lua_State *l)
 	else
 	{
 		*p = '\0';
-		if (strcasecmp(sockinfo, "inet") == 0)
+		if (strcasecmp(spec, "inet") == 0)
 			af = AF_INET;
-		else if (strcasecmp(sockinfo, "unix") == 0 ||
-		         strcasecmp(sockinfo, "local") == 0)
+		else if (strcasecmp(spec, "unix") == 0 ||
+		         strcasecmp(spec, "local") == 0)
 			af = AF_UNIX;
 		*p = ':';
 	}
 
-	if (af == AF_UNSPEC)
-	{
-		lua_pushstring(l, "mt.connect(): Invalid argument");
-		lua_error(l);
-	}
-
 	switch (af)
 	{
 	  case AF_UNIX:
-	  {
-		struct sockaddr_un sa;
-
-		memset(&sa, '\0', sizeof sa);
-		sa.sun_family = AF_UNIX;
+		memset(&sun, '\0', sizeof sun);
+		sun.sun_family = AF_UNIX;
 #ifdef HAVE_SUN_LEN
-		sa.sun_len = sizeof sa;
+		sun.sun_len = sizeof sun;
 #endif /* HAVE_SUN_LEN */
 		if (p == NULL)
-			strlcpy(sa.sun_path, sockinfo, sizeof sa.sun_path);
+			strlcpy(sun.sun_path, spec, sizeof sun.sun_path);
 		else
-			strlcpy(sa.sun_path, p + 1, sizeof sa.sun_path);
-
-		while (count > 0)
-		{
-			fd = socket(PF_UNIX, SOCK_STREAM, 0);
-			if (fd < 0)
-			{
-				lua_pushfstring(l, "mt.connect(): socket(): %s",
-				                strerror(errno));
-				lua_error(l);
-			}
-
-			saverr = 0;
-
-			if (connect(fd, (struct sockaddr *) &sa,
-			            sizeof sa) == 0)
-				break;
-
-			saverr = errno;
-
-			if (verbose > 1)
-			{
-				fprintf(stdout,
-				        "%s: connect(): %s; %u tr%s left\n",
-				        progname, strerror(errno), count - 1,
-				        count == 2 ? "y" : "ies");
-			}
-
-			close(fd);
-
-			usleep(interval);
-
-			count--;
-		}
-
-		if (saverr != 0)
-		{
-			lua_pushfstring(l, "mt.connect(): %s: connect(): %s",
-			                sockinfo, strerror(errno));
-			lua_error(l);
-		}
+			strlcpy(sun.sun_path, p + 1, sizeof sun.sun_path);
 
+		sa = (struct sockaddr *) &sun;
+		salen = sizeof sun;
 		break;
-	  }
 
 	  case AF_INET:
 	  {
 		struct servent *srv;
-		struct sockaddr_in sa;
 
-		memset(&sa, '\0', sizeof sa);
-		sa.sin_family = AF_INET;
+		memset(&sin, '\0', sizeof sin);
+		sin.sin_family = AF_INET;
 
 		p++;
 
 		at = strchr(p, '@');
 		if (at == NULL)
 		{
-			sa.sin_addr.s_addr = INADDR_ANY;
+			sin.sin_addr.s_addr = INADDR_ANY;
 		}
 		else
 		{
@@ -1466,19 +1506,19 @@ mt_connect(lua_State *l)
 			h = gethostbyname(at + 1);
 			if (h != NULL)
 			{
-				memcpy(&sa.sin_addr.s_addr, h->h_addr,
-				       sizeof sa.sin_addr.s_addr);
+				memcpy(&sin.sin_addr.s_addr, h->h_addr,
+				       sizeof sin.sin_addr.s_addr);
 			}
 			else
 			{
-				sa.sin_addr.s_addr = inet_addr(at + 1);
+				sin.sin_addr.s_addr = inet_addr(at + 1);
 			}
 		}
 
 		srv = getservbyname(p, "tcp");
 		if (srv != NULL)
 		{
-			sa.sin_port = srv->s_port;
+			sin.sin_port = srv->s_port;
 		}
 		else
 		{
@@ -1488,104 +1528,168 @@ mt_connect(lua_State *l)
 			port = strtoul(p, &q, 10);
 			if (*q != '\0')
 			{
-				lua_pushstring(l,
-				               "mt.connect(): Invalid argument");
-				lua_error(l);
+				snprintf(err, errlen, "Invalid argument");
+				return -1;
 			}
 
-			sa.sin_port = htons(port);
+			sin.sin_port = htons(port);
 		}
 
-		if (at != NULL)
-			*at = '@';
-
-		while (count > 0)
-		{
-			fd = socket(PF_INET, SOCK_STREAM, 0);
-			if (fd < 0)
-			{
-				lua_pushfstring(l, "mt.connect(): socket(): %s",
-				                strerror(errno));
-				lua_error(l);
-			}
-
-			saverr = 0;
-
-			if (connect(fd, (struct sockaddr *) &sa,
-			            sizeof sa) == 0)
-				break;
+		sa = (struct sockaddr *) &sin;
+		salen = sizeof sin;
+		break;
+	  }
 
-			saverr = errno;
+	  default:
+		snprintf(err, errlen, "Invalid argument");
+		return -1;
+	}
 
-			if (verbose > 1)
-			{
-				fprintf(stdout,
-				        "%s: connect(): %s; %u tr%s left\n",
-				        progname, strerror(errno), count - 1,
-				        count == 2 ? "y" : "ies");
-			}
+	while (count > 0)
+	{
+		fd = socket(af == AF_INET ? PF_INET : PF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0)
+		{
+			snprintf(err, errlen, "socket(): %s", strerror(errno));
+			return -1;
+		}
 
-			close(fd);
+		saverr = 0;
 
-			usleep(interval);
+		if (connect(fd, sa, salen) == 0)
+			break;
 
-			count--;
-		}
+		saverr = errno;
 
-		if (saverr != 0)
+		if (verbose > 1)
 		{
-			lua_pushfstring(l, "mt.connect(): %s: connect(): %s",
-			                sockinfo, strerror(errno));
-			lua_error(l);
+			fprintf(stdout,
+			        "%s: connect(): %s; %u tr%s left\n",
+			        progname, strerror(errno), count - 1,
+			        count == 2 ? "y" : "ies");
 		}
 
-		break;
-	  }
+		close(fd);
+		fd = -1;
 
-	  default:
-		assert(0);
-	}
+		usleep(interval);
 
-	new = (struct mt_context *) malloc(sizeof *new);
-	if (new == NULL)
-	{
-		lua_pushfstring(l, "mt.connect(): malloc(): %s",
-		                strerror(errno));
-		lua_error(l);
+		count--;
 	}
 
-	new->ctx_state = STATE_INIT;
-	new->ctx_fd = fd;
-	new->ctx_response = '\0';
-	new->ctx_eomreqs = NULL;
-	new->ctx_mactions = 0;
-	new->ctx_mpopts = 0;
-
-	lua_pushlightuserdata(l, new);
-
-	if (verbose > 0)
+	if (saverr != 0)
 	{
-		fprintf(stdout, "%s: connected to '%s', fd %d\n",
-		        progname, sockinfo, fd);
+		snprintf(err, errlen, "%s: connect(): %s", sockinfo,
+		         strerror(saverr));
+		return -1;
 	}
 
-	return 1;
+	return fd;
 }
 
 /*
-**  MT_SLEEP -- sleep
+**  MT_CONNECT -- connect to a filter, returning a handle
 **
 **  Parameters:
 **  	l -- Lua state
 **
 **  Return value:
-**   	nil (on the Lua stack)
+**   	A new connection handle (on the Lua stack).
 */
 
 int
-mt_sleep(lua_State *l)
+mt_connect(lua_State *l)
 {
-	double p;
+	int top;
+	int fd;
+	u_int count = 1;
+	useconds_t interval = 0;
+	char *p;
+	const char *sockinfo;
+	struct mt_context *new;
+	char err[BUFRSZ];
+
+	assert(l != NULL);
+
+	top = lua_gettop(l);
+
+	if (!(top == 1 && lua_isstring(l, 1)) &&
+	    !(top == 3 && lua_isstring(l, 1) && lua_isnumber(l, 2) &&
+	                  lua_isnumber(l, 3)))
+	{
+		lua_pushstring(l, "mt.connect(): Invalid argument");
+		lua_error(l);
+	}
+
+	sockinfo = lua_tostring(l, 1);
+	if (top == 3)
+	{
+		char *f;
+
+		count = (u_int) lua_tonumber(l, 2);
+		interval = (useconds_t) (1000000. * lua_tonumber(l, 3));
+
+		f = getenv("MILTERTEST_RETRY_SPEED_FACTOR");
+		if (f != NULL)
+		{
+			unsigned int factor;
+
+			factor = strtoul(f, &p, 10);
+			if (*p == '\0')
+				interval *= factor;
+		}
+	}
+
+	fd = mt_sockopen(sockinfo, count, interval, err, sizeof err);
+	if (fd == -1)
+	{
+		lua_pushfstring(l, "mt.connect(): %s", err);
+		lua_error(l);
+	}
+
+	new = (struct mt_context *) malloc(sizeof *new);
+	if (new == NULL)
+	{
+		close(fd);
+		lua_pushfstring(l, "mt.connect(): malloc(): %s",
+		                strerror(errno));
+		lua_error(l);
+	}
+
+	new->ctx_state = STATE_INIT;
+	new->ctx_fd = fd;
+	new->ctx_response = '\0';
+	new->ctx_eomreqs = NULL;
+	new->ctx_mactions = 0;
+	new->ctx_mpopts = 0;
+
+	if (verbose > 0)
+	{
+		fprintf(stdout, "%s: connected to '%s', fd %d\n",
+		        progname, sockinfo, fd);
+	}
+
+	lua_pop(l, top);
+
+	lua_pushlightuserdata(l, new);
+
+	return 1;
+}
+
+/*
+**  MT_SLEEP -- sleep
+**
+**  Parameters:
+**  	l -- Lua state
+**
+**  Return value:
+**   	nil (on the Lua stack)
+*/
+
+int
+mt_sleep(lua_State *l)
+{
+	double p;
 	useconds_t usecs;
 
 	assert(l != NULL);
@@ -2142,6 +2246,8 @@ mt_conninfo(lua_State *l)
 
 	if (!CHECK_MPOPTS(ctx, SMFIP_NR_CONN))
 	{
+		buflen = sizeof buf;
+
 		if (!mt_milter_read(ctx->ctx_fd, &rcmd, buf, &buflen))
 		{
 			lua_pushstring(l, "mt.milter_read() failed");
@@ -3833,132 +3939,1388 @@ mt_getheader(lua_State *l)
 }
 
 /*
-**  USAGE -- print usage message
-** 
+**  MT_STOPFILTER -- terminate a filter started by mt_startfilter()
+**
 **  Parameters:
-**  	Not now.  Maybe later.
+**  	None.
 **
 **  Return value:
-**  	EX_USAGE
+**  	0 if the filter shut down cleanly (or wasn't waited for), 1 otherwise.
 */
 
 int
-usage(void)
+mt_stopfilter(void)
 {
-	fprintf(stderr, "%s: usage: %s [options]\n"
-	                "\t-D name[=value]\tdefine global variable\n"
-	                "\t-s script      \tscript to run (default = stdin)\n"
-	                "\t-u             \treport usage statistics\n"
-	                "\t-v             \tverbose mode\n"
-	                "\t-V             \tprint version number and exit\n"
-	                "\t-w             \tdon't wait for child at shutdown\n",
-	                progname, progname);
+	int status;
+	int retval = 0;
 
-	return EX_USAGE;
+	if (filterpid == 0)
+		return 0;
+
+	if (kill(filterpid, SIGTERM) != 0)
+	{
+		fprintf(stderr, "%s: %d: kill() %s\n", progname,
+		        filterpid, strerror(errno));
+	}
+	else if (!nowait)
+	{
+		if (verbose > 1)
+		{
+			fprintf(stdout,
+			        "%s: waiting for process %d\n",
+			        progname, filterpid);
+		}
+
+		(void) wait(&status);
+
+		if (WIFEXITED(status) && WEXITSTATUS(status) != 0)
+		{
+			fprintf(stderr,
+			        "%s: filter process exited with status %d\n",
+			        progname, WEXITSTATUS(status));
+
+			retval = 1;
+		}
+		else if (WIFSIGNALED(status) &&
+		         WTERMSIG(status) != SIGTERM)
+		{
+			fprintf(stderr,
+			        "%s: filter process died with signal %d\n",
+			        progname, WTERMSIG(status));
+
+			retval = 1;
+		}
+	}
+
+	filterpid = 0;
+
+	return retval;
 }
 
 /*
-**  MAIN -- program mainline
+**  MT_USECS -- microseconds elapsed between two times
 **
 **  Parameters:
-**  	argc, argv -- the usual
+**  	start -- start time
+**  	end -- end time
 **
 **  Return value:
-**  	Exit status.
+**  	Microseconds from "start" to "end", or 0 if "end" precedes "start".
+*/
+
+unsigned long
+mt_usecs(struct timeval *start, struct timeval *end)
+{
+	long usec;
+
+	usec = (end->tv_sec - start->tv_sec) * 1000000L +
+	       (end->tv_usec - start->tv_usec);
+
+	return (usec < 0 ? 0 : (unsigned long) usec);
+}
+
+/*
+**  MT_LOAD_SAMPLE -- record a latency sample
+**
+**  Parameters:
+**  	ms -- sample set
+**  	usec -- latency (microseconds)
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	A sample that can't be stored is dropped; the report will show a
+**  	smaller count for that stage.
+*/
+
+void
+mt_load_sample(struct mt_samples *ms, unsigned long usec)
+{
+	assert(ms != NULL);
+
+	if (ms->ms_n == ms->ms_alloc)
+	{
+		size_t nalloc;
+		unsigned long *new;
+
+		nalloc = (ms->ms_alloc == 0 ? 1024 : ms->ms_alloc * 2);
+		new = (unsigned long *) realloc(ms->ms_usec,
+		                                nalloc * sizeof *new);
+		if (new == NULL)
+			return;
+
+		ms->ms_usec = new;
+		ms->ms_alloc = nalloc;
+	}
+
+	ms->ms_usec[ms->ms_n++] = usec;
+}
+
+/*
+**  MT_LOAD_ADDMSG -- parse a message file into the load corpus
+**
+**  Parameters:
+**  	lj -- load job
+**  	path -- file to read
+**
+**  Return value:
+**  	0 on success, -1 on failure.
+**
+**  Notes:
+**  	Header fields keep their folding (as LF-separated lines, the way
+**  	an MTA passes them) and their leading whitespace, which is stripped
+**  	at send time unless the filter negotiates SMFIP_HDR_LEADSPC.  The
+**  	body is converted to CRLF line endings once, here.
 */
 
 int
-main(int argc, char **argv)
+mt_load_addmsg(struct mt_loadjob *lj, const char *path)
 {
-	int c;
-	int status;
 	int fd;
-	int retval = 0;
+	size_t c;
 	ssize_t rlen;
+	char *raw;
 	char *p;
-	char *script = NULL;
-	lua_State *l;
-	struct mt_lua_io io;
+	char *end;
+	char *q;
+	struct mt_loadmsg *lm;
 	struct stat s;
 
-	progname = (p = strrchr(argv[0], '/')) == NULL ? argv[0] : p + 1;
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		fprintf(stderr, "%s: %s: open(): %s\n", progname, path,
+		        strerror(errno));
+		return -1;
+	}
 
-	verbose = 0;
-	filterpid = 0;
-	tmo = DEFTIMEOUT;
-	rusage = FALSE;
-	nowait = FALSE;
+	if (fstat(fd, &s) != 0)
+	{
+		fprintf(stderr, "%s: %s: fstat(): %s\n", progname, path,
+		        strerror(errno));
+		close(fd);
+		return -1;
+	}
 
-	l = lua_newstate(mt_lua_alloc, NULL);
-	if (l == NULL)
+	raw = (char *) malloc(s.st_size + 1);
+	if (raw == NULL)
 	{
-		fprintf(stderr, "%s: unable to allocate new Lua state\n",
-		        progname);
-		return 1;
+		fprintf(stderr, "%s: malloc(): %s\n", progname,
+		        strerror(errno));
+		close(fd);
+		return -1;
 	}
 
-	luaL_openlibs(l);
+	rlen = read(fd, raw, s.st_size);
+	close(fd);
+	if (rlen != s.st_size)
+	{
+		fprintf(stderr, "%s: %s: read() returned %zd (expecting %ld)\n",
+		        progname, path, rlen, (long) s.st_size);
+		free(raw);
+		return -1;
+	}
+	raw[rlen] = '\0';
+	end = raw + rlen;
 
-	while ((c = getopt(argc, argv, CMDLINEOPTS)) != -1)
+	if (lj->lj_nmsgs == lj->lj_amsgs)
 	{
-		switch (c)
+		size_t namsgs;
+		struct mt_loadmsg *new;
+
+		namsgs = (lj->lj_amsgs == 0 ? 16 : lj->lj_amsgs * 2);
+		new = (struct mt_loadmsg *) realloc(lj->lj_msgs,
+		                                    namsgs * sizeof *new);
+		if (new == NULL)
 		{
-		  case 'D':
-			p = strchr(optarg, '=');
-			if (p != NULL)
-			{
-				*p = '\0';
-				lua_pushstring(l, p + 1);
-			}
-			else
-			{
-				lua_pushnumber(l, 1);
-			}
+			fprintf(stderr, "%s: realloc(): %s\n", progname,
+			        strerror(errno));
+			free(raw);
+			return -1;
+		}
 
-			lua_setglobal(l, optarg);
+		lj->lj_msgs = new;
+		lj->lj_amsgs = namsgs;
+	}
 
-			break;
+	lm = &lj->lj_msgs[lj->lj_nmsgs];
+	memset(lm, '\0', sizeof *lm);
 
-		  case 's':
-			if (script != NULL)
-			{
-				fprintf(stderr,
-				        "%s: multiple use of '-%c' not permitted\n",
-				        progname, c);
-				lua_close(l);
-				return EX_USAGE;
-			}
+	/* count header fields to size the arrays */
+	c = 0;
+	for (p = raw; p < end && *p != '\n' && *p != '\r'; )
+	{
+		if (*p != ' ' && *p != '\t')
+			c++;
+		q = memchr(p, '\n', end - p);
+		p = (q == NULL ? end : q + 1);
+	}
 
-			script = optarg;
-			break;
+	lm->lm_path = strdup(path);
+	lm->lm_hdrs = (char **) malloc((c + 1) * sizeof(char *) * 2);
+	lm->lm_text = (char *) malloc(rlen * 2 + 1);
+	if (lm->lm_path == NULL || lm->lm_hdrs == NULL || lm->lm_text == NULL)
+	{
+		fprintf(stderr, "%s: malloc(): %s\n", progname,
+		        strerror(errno));
+		free(lm->lm_path);
+		free(lm->lm_hdrs);
+		free(lm->lm_text);
+		free(raw);
+		return -1;
+	}
 
-		  case 'u':
-			rusage = TRUE;
-			break;
+	/*
+	**  Copy each field into lm_text as "name\0value\0", dropping CRs and
+	**  the final line break; lm_hdrs holds name/value pointer pairs.
+	*/
 
-		  case 'v':
-			verbose++;
-			break;
+	q = lm->lm_text;
+	for (p = raw; p < end && *p != '\n' && *p != '\r'; )
+	{
+		char *colon;
+		char *eol;
 
-		  case 'V':
-			fprintf(stdout, "%s: %s v%s\n", progname, MT_PRODUCT,
-			        MT_VERSION);
-			return 0;
+		eol = memchr(p, '\n', end - p);
+		if (eol == NULL)
+			eol = end;
 
-		  case 'w':
-			nowait = TRUE;
-			break;
+		if (*p == ' ' || *p == '\t')
+		{
+			/* continuation of a field; glue it onto the last value */
+			if (lm->lm_nhdrs > 0)
+			{
+				q--;
+				*q++ = '\n';
+				for (; p < eol; p++)
+				{
+					if (*p != '\r')
+						*q++ = *p;
+				}
+				*q++ = '\0';
+			}
 
-		  default:
-			lua_close(l);
-			return usage();
+			p = (eol == end ? end : eol + 1);
+			continue;
 		}
-	}
 
-	if (optind != argc)
-	{
-		lua_close(l);
-		return usage();
+		colon = memchr(p, ':', eol - p);
+		if (colon == NULL)
+		{
+			fprintf(stderr, "%s: %s: malformed header field\n",
+			        progname, path);
+			free(lm->lm_path);
+			free(lm->lm_hdrs);
+			free(lm->lm_text);
+			free(raw);
+			return -1;
+		}
+
+		lm->lm_hdrs[lm->lm_nhdrs * 2] = q;
+		memcpy(q, p, colon - p);
+		q += colon - p;
+		*q++ = '\0';
+
+		lm->lm_hdrs[lm->lm_nhdrs * 2 + 1] = q;
+		for (p = colon + 1; p < eol; p++)
+		{
+			if (*p != '\r')
+				*q++ = *p;
+		}
+		*q++ = '\0';
+
+		lm->lm_nhdrs++;
+
+		p = (eol == end ? end : eol + 1);
+	}
+
+	/* skip the separator line */
+	if (p < end && *p == '\r')
+		p++;
+	if (p < end && *p == '\n')
+		p++;
+
+	/* body, with line endings converted to CRLF */
+	lm->lm_body = q;
+	for (; p < end; p++)
+	{
+		if (*p == '\n' && (p == raw || *(p - 1) != '\r'))
+			*q++ = '\r';
+		*q++ = *p;
+	}
+	lm->lm_bodylen = q - lm->lm_body;
+
+	free(raw);
+
+	if (lm->lm_nhdrs == 0)
+	{
+		fprintf(stderr, "%s: %s: no header fields found\n", progname,
+		        path);
+		free(lm->lm_path);
+		free(lm->lm_hdrs);
+		free(lm->lm_text);
+		return -1;
+	}
+
+	if (verbose > 1)
+	{
+		fprintf(stdout,
+		        "%s: %s: %lu header field(s), %lu body byte(s)\n",
+		        progname, path, (unsigned long) lm->lm_nhdrs,
+		        (unsigned long) lm->lm_bodylen);
+	}
+
+	lj->lj_nmsgs++;
+
+	return 0;
+}
+
+/*
+**  MT_LOAD_CORPUS -- load messages named on the command line
+**
+**  Parameters:
+**  	lj -- load job
+**  	nfiles -- number of entries at "files"
+**  	files -- files or directories of files
+**
+**  Return value:
+**  	0 on success, -1 on failure.
+*/
+
+int
+mt_load_corpus(struct mt_loadjob *lj, int nfiles, char **files)
+{
+	int c;
+	DIR *dir;
+	struct dirent *de;
+	struct stat s;
+
+	for (c = 0; c < nfiles; c++)
+	{
+		if (stat(files[c], &s) != 0)
+		{
+			fprintf(stderr, "%s: %s: stat(): %s\n", progname,
+			        files[c], strerror(errno));
+			return -1;
+		}
+
+		if (!S_ISDIR(s.st_mode))
+		{
+			if (mt_load_addmsg(lj, files[c]) != 0)
+				return -1;
+			continue;
+		}
+
+		dir = opendir(files[c]);
+		if (dir == NULL)
+		{
+			fprintf(stderr, "%s: %s: opendir(): %s\n", progname,
+			        files[c], strerror(errno));
+			return -1;
+		}
+
+		while ((de = readdir(dir)) != NULL)
+		{
+			char *fn;
+			size_t len;
+
+			if (de->d_name[0] == '.')
+				continue;
+
+			len = strlen(files[c]) + strlen(de->d_name) + 2;
+			fn = (char *) malloc(len);
+			if (fn == NULL)
+			{
+				fprintf(stderr, "%s: malloc(): %s\n",
+				        progname, strerror(errno));
+				closedir(dir);
+				return -1;
+			}
+			snprintf(fn, len, "%s/%s", files[c], de->d_name);
+
+			if (stat(fn, &s) == 0 && S_ISREG(s.st_mode) &&
+			    mt_load_addmsg(lj, fn) != 0)
+			{
+				free(fn);
+				closedir(dir);
+				return -1;
+			}
+
+			free(fn);
+		}
+
+		closedir(dir);
+	}
+
+	if (lj->lj_nmsgs == 0)
+	{
+		fprintf(stderr, "%s: no messages to send\n", progname);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+**  MT_LOAD_FREE -- release the load corpus
+**
+**  Parameters:
+**  	lj -- load job
+**
+**  Return value:
+**  	None.
+*/
+
+void
+mt_load_free(struct mt_loadjob *lj)
+{
+	size_t c;
+
+	for (c = 0; c < lj->lj_nmsgs; c++)
+	{
+		free(lj->lj_msgs[c].lm_path);
+		free(lj->lj_msgs[c].lm_hdrs);
+		free(lj->lj_msgs[c].lm_text);
+	}
+
+	free(lj->lj_msgs);
+	lj->lj_msgs = NULL;
+	lj->lj_nmsgs = 0;
+	lj->lj_amsgs = 0;
+}
+
+/*
+**  MT_LOAD_CLAIM -- claim the next message to send
+**
+**  Parameters:
+**  	lw -- load worker
+**  	sched -- scheduled start time (returned)
+**
+**  Return value:
+**  	The corpus entry to send, or NULL if the run is over.
+**
+**  Notes:
+**  	With a target rate, the n-th message is due at start + n / rate
+**  	no matter when a connection becomes free to send it, so queueing
+**  	delay shows up in the "total" latency instead of being hidden
+**  	(coordinated omission).  Without one, connections send back to back.
+*/
+
+struct mt_loadmsg *
+mt_load_claim(struct mt_loadworker *lw, struct timeval *sched)
+{
+	unsigned long n;
+	struct mt_loadjob *lj;
+	struct timeval now;
+
+	lj = lw->lw_job;
+
+	pthread_mutex_lock(&lj->lj_lock);
+
+	(void) gettimeofday(&now, NULL);
+
+	if ((lj->lj_limit != 0 && lj->lj_next >= lj->lj_limit) ||
+	    (lj->lj_duration != 0 &&
+	     mt_usecs(&lj->lj_start, &now) >= lj->lj_duration * 1000000UL))
+	{
+		pthread_mutex_unlock(&lj->lj_lock);
+		return NULL;
+	}
+
+	n = lj->lj_next++;
+
+	pthread_mutex_unlock(&lj->lj_lock);
+
+	if (lj->lj_rate > 0.)
+	{
+		unsigned long offset;
+
+		offset = (unsigned long) ((double) n * 1000000. / lj->lj_rate);
+		sched->tv_sec = lj->lj_start.tv_sec + offset / 1000000;
+		sched->tv_usec = lj->lj_start.tv_usec + offset % 1000000;
+		if (sched->tv_usec >= 1000000)
+		{
+			sched->tv_sec++;
+			sched->tv_usec -= 1000000;
+		}
+
+		if (timercmp(&now, sched, <))
+		{
+			unsigned long usec;
+			struct timespec ts;
+
+			usec = mt_usecs(&now, sched);
+			ts.tv_sec = usec / 1000000;
+			ts.tv_nsec = (usec % 1000000) * 1000;
+			(void) nanosleep(&ts, NULL);
+		}
+	}
+	else
+	{
+		*sched = now;
+	}
+
+	return &lj->lj_msgs[n % lj->lj_nmsgs];
+}
+
+/*
+**  MT_LOAD_REPLY -- send a command and collect the filter's reply
+**
+**  Parameters:
+**  	ctx -- connection
+**  	cmd -- command to send
+**  	buf -- command data
+**  	len -- bytes at "buf"
+**  	noreply -- TRUE iff the filter negotiated no reply to "cmd"
+**
+**  Return value:
+**  	The reply code (SMFIR_CONTINUE if none is expected), or '\0'
+**  	on an I/O error.
+*/
+
+char
+mt_load_reply(struct mt_context *ctx, int cmd, const char *buf, size_t len,
+              _Bool noreply)
+{
+	char rcmd;
+	size_t buflen;
+	char rbuf[BUFRSZ];
+
+	if (!mt_milter_write(ctx->ctx_fd, cmd, buf, len))
+		return '\0';
+
+	if (noreply)
+		return SMFIR_CONTINUE;
+
+	for (;;)
+	{
+		buflen = sizeof rbuf;
+		if (!mt_milter_read(ctx->ctx_fd, &rcmd, rbuf, &buflen))
+			return '\0';
+#ifdef SMFIR_PROGRESS
+		if (rcmd == SMFIR_PROGRESS)
+			continue;
+#endif /* SMFIR_PROGRESS */
+		return rcmd;
+	}
+}
+
+/*
+**  MT_LOAD_OPEN -- negotiate and send connection information
+**
+**  Parameters:
+**  	ctx -- newly connected context
+**
+**  Return value:
+**  	The filter's reply to CONNECT or HELO (SMFIR_CONTINUE if it
+**  	accepted both), or '\0' on an I/O error.
+*/
+
+char
+mt_load_open(struct mt_context *ctx)
+{
+	char rcmd;
+	size_t len;
+	uint16_t port;
+	char buf[BUFRSZ];
+
+	if (!mt_assert_state(ctx, STATE_NEGOTIATED))
+		return '\0';
+
+	if (!CHECK_MPOPTS(ctx, SMFIP_NOCONNECT))
+	{
+		port = htons(DEFCLIENTPORT);
+		len = strlcpy(buf, DEFCLIENTHOST, sizeof buf) + 1;
+		buf[len++] = '4';
+		memcpy(&buf[len], &port, sizeof port);
+		len += sizeof port;
+		memcpy(&buf[len], DEFCLIENTIP, sizeof DEFCLIENTIP);
+		len += sizeof DEFCLIENTIP;
+
+		rcmd = mt_load_reply(ctx, SMFIC_CONNECT, buf, len,
+		                     CHECK_MPOPTS(ctx, SMFIP_NR_CONN));
+		if (rcmd != SMFIR_CONTINUE)
+			return rcmd;
+	}
+
+	if (!CHECK_MPOPTS(ctx, SMFIP_NOHELO))
+	{
+		rcmd = mt_load_reply(ctx, SMFIC_HELO, DEFCLIENTHOST,
+		                     sizeof DEFCLIENTHOST,
+		                     CHECK_MPOPTS(ctx, SMFIP_NR_HELO));
+		if (rcmd != SMFIR_CONTINUE)
+			return rcmd;
+	}
+
+	ctx->ctx_state = STATE_HELO;
+
+	return SMFIR_CONTINUE;
+}
+
+/*
+**  MT_LOAD_MESSAGE -- run one message through the filter
+**
+**  Parameters:
+**  	lw -- load worker
+**  	ctx -- connection, already at STATE_HELO
+**  	lm -- message to send
+**
+**  Return value:
+**  	The final reply code, or '\0' on an I/O error (in which case the
+**  	connection is no longer usable).
+*/
+
+char
+mt_load_message(struct mt_loadworker *lw, struct mt_context *ctx,
+                struct mt_loadmsg *lm)
+{
+	char rcmd;
+	size_t c;
+	size_t len;
+	size_t off;
+	size_t need;
+	struct timeval t0;
+	struct timeval t1;
+	char buf[BUFRSZ];
+
+	/* queue ID, for the filter's logging */
+	len = strlcpy(buf, "Mi", sizeof buf) + 1;
+	len += snprintf(buf + len, sizeof buf - len, "mt%lu.%lu",
+	                (unsigned long) lw->lw_id, lw->lw_done + lw->lw_errors);
+	len++;
+	if (!mt_milter_write(ctx->ctx_fd, SMFIC_MACRO, buf, len))
+		return '\0';
+
+	if (!CHECK_MPOPTS(ctx, SMFIP_NOMAIL))
+	{
+		rcmd = mt_load_reply(ctx, SMFIC_MAIL, DEFSENDER,
+		                     sizeof DEFSENDER,
+		                     CHECK_MPOPTS(ctx, SMFIP_NR_MAIL));
+		if (rcmd != SMFIR_CONTINUE)
+			return rcmd;
+	}
+	ctx->ctx_state = STATE_ENVFROM;
+
+	if (!CHECK_MPOPTS(ctx, SMFIP_NORCPT))
+	{
+		rcmd = mt_load_reply(ctx, SMFIC_RCPT, DEFRECIPIENT,
+		                     sizeof DEFRECIPIENT,
+		                     CHECK_MPOPTS(ctx, SMFIP_NR_RCPT));
+		if (rcmd != SMFIR_CONTINUE)
+			return rcmd;
+	}
+	ctx->ctx_state = STATE_ENVRCPT;
+
+#ifdef SMFIC_DATA
+	if (!CHECK_MPOPTS(ctx, SMFIP_NODATA))
+	{
+		rcmd = mt_load_reply(ctx, SMFIC_DATA, NULL, 0,
+		                     CHECK_MPOPTS(ctx, SMFIP_NR_DATA));
+		if (rcmd != SMFIR_CONTINUE)
+			return rcmd;
+	}
+#endif /* SMFIC_DATA */
+	ctx->ctx_state = STATE_DATA;
+
+	if (!CHECK_MPOPTS(ctx, SMFIP_NOHDRS))
+	{
+		for (c = 0; c < lm->lm_nhdrs; c++)
+		{
+			const char *name;
+			const char *value;
+
+			name = lm->lm_hdrs[c * 2];
+			value = lm->lm_hdrs[c * 2 + 1];
+#ifdef SMFIP_HDR_LEADSPC
+			if (!CHECK_MPOPTS(ctx, SMFIP_HDR_LEADSPC))
+#endif /* SMFIP_HDR_LEADSPC */
+			{
+				while (*value == ' ' || *value == '\t')
+					value++;
+			}
+
+			need = strlen(name) + strlen(value) + 2;
+			if (need > lw->lw_hbufsz)
+			{
+				char *new;
+
+				new = (char *) realloc(lw->lw_hbuf, need);
+				if (new == NULL)
+					return '\0';
+				lw->lw_hbuf = new;
+				lw->lw_hbufsz = need;
+			}
+
+			off = strlen(name) + 1;
+			memcpy(lw->lw_hbuf, name, off);
+			memcpy(lw->lw_hbuf + off, value, need - off);
+
+			rcmd = mt_load_reply(ctx, SMFIC_HEADER, lw->lw_hbuf,
+			                     need,
+			                     CHECK_MPOPTS(ctx, SMFIP_NR_HDR));
+			if (rcmd != SMFIR_CONTINUE)
+				return rcmd;
+		}
+	}
+
+	(void) gettimeofday(&t0, NULL);
+	if (!CHECK_MPOPTS(ctx, SMFIP_NOEOH))
+	{
+		rcmd = mt_load_reply(ctx, SMFIC_EOH, NULL, 0,
+		                     CHECK_MPOPTS(ctx, SMFIP_NR_EOH));
+		if (rcmd != SMFIR_CONTINUE)
+			return rcmd;
+	}
+	(void) gettimeofday(&t1, NULL);
+	mt_load_sample(&lw->lw_samples[MT_LOAD_EOH], mt_usecs(&t0, &t1));
+
+	t0 = t1;
+	if (!CHECK_MPOPTS(ctx, SMFIP_NOBODY))
+	{
+		for (off = 0; off < lm->lm_bodylen; off += len)
+		{
+			len = MIN(lm->lm_bodylen - off, MILTER_CHUNK_SIZE);
+
+			rcmd = mt_load_reply(ctx, SMFIC_BODY,
+			                     lm->lm_body + off, len,
+			                     CHECK_MPOPTS(ctx, SMFIP_NR_BODY));
+#ifdef SMFIR_SKIP
+			if (rcmd == SMFIR_SKIP)
+				break;
+#endif /* SMFIR_SKIP */
+			if (rcmd != SMFIR_CONTINUE)
+				return rcmd;
+		}
+	}
+	(void) gettimeofday(&t1, NULL);
+	mt_load_sample(&lw->lw_samples[MT_LOAD_BODY], mt_usecs(&t0, &t1));
+
+	t0 = t1;
+	if (!mt_milter_write(ctx->ctx_fd, SMFIC_BODYEOB, NULL, 0))
+		return '\0';
+
+	for (;;)
+	{
+		len = sizeof lw->lw_rbuf;
+		if (!mt_milter_read(ctx->ctx_fd, &rcmd, lw->lw_rbuf, &len))
+			return '\0';
+
+		if (rcmd == SMFIR_CONTINUE ||
+		    rcmd == SMFIR_ACCEPT ||
+		    rcmd == SMFIR_REJECT ||
+		    rcmd == SMFIR_TEMPFAIL ||
+		    rcmd == SMFIR_DISCARD ||
+		    rcmd == SMFIR_REPLYCODE)
+			break;
+	}
+	(void) gettimeofday(&t1, NULL);
+	mt_load_sample(&lw->lw_samples[MT_LOAD_EOM], mt_usecs(&t0, &t1));
+
+	ctx->ctx_state = STATE_EOM;
+
+	return rcmd;
+}
+
+/*
+**  MT_LOAD_WORKER -- load generation thread
+**
+**  Parameters:
+**  	arg -- load worker (struct mt_loadworker *)
+**
+**  Return value:
+**  	NULL.
+**
+**  Notes:
+**  	Each worker owns one connection to the filter at a time, reopening
+**  	it after every lj_perconn messages and after any I/O error.
+*/
+
+void *
+mt_load_worker(void *arg)
+{
+	char rcmd;
+	unsigned int sent = 0;
+	struct mt_loadworker *lw;
+	struct mt_loadjob *lj;
+	struct mt_loadmsg *lm;
+	struct mt_context ctx;
+	struct timeval sched;
+	struct timeval t0;
+	struct timeval t1;
+	char err[BUFRSZ];
+
+	lw = (struct mt_loadworker *) arg;
+	lj = lw->lw_job;
+
+	memset(&ctx, '\0', sizeof ctx);
+	ctx.ctx_fd = -1;
+
+	while ((lm = mt_load_claim(lw, &sched)) != NULL)
+	{
+		(void) gettimeofday(&t0, NULL);
+
+		if (ctx.ctx_fd == -1)
+		{
+			ctx.ctx_fd = mt_sockopen(lj->lj_sockinfo, 1, 0,
+			                         err, sizeof err);
+			if (ctx.ctx_fd == -1)
+			{
+				fprintf(stderr, "%s: %s\n", progname, err);
+				lw->lw_errors++;
+				continue;
+			}
+
+			ctx.ctx_state = STATE_INIT;
+			sent = 0;
+
+			if (mt_load_open(&ctx) != SMFIR_CONTINUE)
+			{
+				close(ctx.ctx_fd);
+				ctx.ctx_fd = -1;
+				lw->lw_errors++;
+				continue;
+			}
+
+			(void) gettimeofday(&t1, NULL);
+			mt_load_sample(&lw->lw_samples[MT_LOAD_CONNECT],
+			               mt_usecs(&t0, &t1));
+		}
+
+		rcmd = mt_load_message(lw, &ctx, lm);
+		(void) gettimeofday(&t1, NULL);
+
+		switch (rcmd)
+		{
+		  case '\0':
+			if (verbose > 0)
+			{
+				fprintf(stderr, "%s: %s: I/O error on fd %d\n",
+				        progname, lm->lm_path, ctx.ctx_fd);
+			}
+			close(ctx.ctx_fd);
+			ctx.ctx_fd = -1;
+			lw->lw_errors++;
+			continue;
+
+		  case SMFIR_CONTINUE:
+		  case SMFIR_ACCEPT:
+			lw->lw_accept++;
+			break;
+
+		  case SMFIR_REJECT:
+			lw->lw_reject++;
+			break;
+
+		  case SMFIR_TEMPFAIL:
+			lw->lw_tempfail++;
+			break;
+
+		  case SMFIR_DISCARD:
+			lw->lw_discard++;
+			break;
+
+		  default:
+			lw->lw_other++;
+			break;
+		}
+
+		lw->lw_done++;
+		mt_load_sample(&lw->lw_samples[MT_LOAD_TOTAL],
+		               mt_usecs(&sched, &t1));
+
+		if (verbose > 0)
+		{
+			fprintf(stdout, "%s: %s: reply '%c' on fd %d\n",
+			        progname, lm->lm_path, rcmd, ctx.ctx_fd);
+		}
+
+		/* a message cut short before EOM needs an abort */
+		if (ctx.ctx_state < STATE_EOM)
+			(void) mt_milter_write(ctx.ctx_fd, SMFIC_ABORT, NULL, 0);
+		ctx.ctx_state = STATE_HELO;
+
+		if (++sent >= lj->lj_perconn)
+		{
+			(void) mt_milter_write(ctx.ctx_fd, SMFIC_QUIT, NULL, 0);
+			close(ctx.ctx_fd);
+			ctx.ctx_fd = -1;
+		}
+	}
+
+	if (ctx.ctx_fd != -1)
+	{
+		(void) mt_milter_write(ctx.ctx_fd, SMFIC_QUIT, NULL, 0);
+		close(ctx.ctx_fd);
+	}
+
+	return NULL;
+}
+
+/*
+**  MT_LOAD_CMP -- compare two latency samples, for qsort()
+**
+**  Parameters:
+**  	a, b -- samples
+**
+**  Return value:
+**  	<0, 0 or >0 as "a" is less than, equal to or greater than "b".
+*/
+
+int
+mt_load_cmp(const void *a, const void *b)
+{
+	unsigned long ua = *(const unsigned long *) a;
+	unsigned long ub = *(const unsigned long *) b;
+
+	return (ua < ub ? -1 : (ua > ub ? 1 : 0));
+}
+
+/*
+**  MT_LOAD_PCT -- percentile of a sorted sample set
+**
+**  Parameters:
+**  	ms -- sample set (sorted)
+**  	pct -- percentile
+**
+**  Return value:
+**  	The nearest-rank "pct"th percentile, in milliseconds.
+*/
+
+double
+mt_load_pct(struct mt_samples *ms, double pct)
+{
+	size_t rank;
+
+	if (ms->ms_n == 0)
+		return 0.;
+
+	rank = (size_t) ((pct / 100.) * ms->ms_n + 0.999999);
+	if (rank < 1)
+		rank = 1;
+	if (rank > ms->ms_n)
+		rank = ms->ms_n;
+
+	return (double) ms->ms_usec[rank - 1] / 1000.;
+}
+
+/*
+**  MT_LOAD -- load generation mode
+**
+**  Parameters:
+**  	lj -- load job, options filled in
+**  	nfiles -- number of message files/directories at "files"
+**  	files -- message files and/or directories of them
+**
+**  Return value:
+**  	Exit status.
+*/
+
+int
+mt_load(struct mt_loadjob *lj, int nfiles, char **files)
+{
+	int c;
+	int s;
+	int fd;
+	int status = 0;
+	int nthreads = 0;
+	double secs;
+	unsigned long done = 0;
+	unsigned long errors = 0;
+	unsigned long accept = 0;
+	unsigned long reject = 0;
+	unsigned long tempfail = 0;
+	unsigned long discard = 0;
+	unsigned long other = 0;
+	struct mt_loadworker *lw;
+	struct mt_samples all[MT_LOAD_STAGES];
+	struct timeval end;
+	char err[BUFRSZ];
+	static const char *stages[MT_LOAD_STAGES] =
+	{
+		"connect", "eoh", "body", "eom", "total"
+	};
+
+	if (mt_load_corpus(lj, nfiles, files) != 0)
+	{
+		mt_load_free(lj);
+		return EX_DATAERR;
+	}
+
+	if (lj->lj_limit == 0 && lj->lj_duration == 0)
+		lj->lj_limit = lj->lj_nmsgs;
+
+	if (lj->lj_filter != NULL)
+	{
+		char *p;
+		char *last;
+		const char **argv;
+
+		argv = (const char **) malloc(sizeof(char *) *
+		                              (strlen(lj->lj_filter) / 2 + 2));
+		if (argv == NULL)
+		{
+			fprintf(stderr, "%s: malloc(): %s\n", progname,
+			        strerror(errno));
+			mt_load_free(lj);
+			return EX_OSERR;
+		}
+
+		c = 0;
+		for (p = strtok_r(lj->lj_filter, " \t", &last);
+		     p != NULL;
+		     p = strtok_r(NULL, " \t", &last))
+			argv[c++] = p;
+		argv[c] = NULL;
+
+		if (c == 0)
+		{
+			fprintf(stderr, "%s: empty filter command\n",
+			        progname);
+			free((void *) argv);
+			mt_load_free(lj);
+			return EX_USAGE;
+		}
+
+		filterpid = mt_spawn(argv, err, sizeof err);
+		free((void *) argv);
+		if (filterpid == -1)
+		{
+			filterpid = 0;
+			fprintf(stderr, "%s: %s\n", progname, err);
+			mt_load_free(lj);
+			return EX_OSERR;
+		}
+
+		/* wait for the filter to start listening */
+		fd = mt_sockopen(lj->lj_sockinfo, 40, 250000, err, sizeof err);
+		if (fd == -1)
+		{
+			fprintf(stderr, "%s: %s\n", progname, err);
+			(void) mt_stopfilter();
+			mt_load_free(lj);
+			return EX_UNAVAILABLE;
+		}
+		close(fd);
+	}
+
+	lw = (struct mt_loadworker *) calloc(lj->lj_nconns, sizeof *lw);
+	if (lw == NULL)
+	{
+		fprintf(stderr, "%s: calloc(): %s\n", progname,
+		        strerror(errno));
+		(void) mt_stopfilter();
+		mt_load_free(lj);
+		return EX_OSERR;
+	}
+
+	(void) pthread_mutex_init(&lj->lj_lock, NULL);
+	(void) gettimeofday(&lj->lj_start, NULL);
+
+	for (c = 0; c < lj->lj_nconns; c++)
+	{
+		lw[c].lw_job = lj;
+		lw[c].lw_id = c;
+
+		s = pthread_create(&lw[c].lw_tid, NULL, mt_load_worker,
+		                   &lw[c]);
+		if (s != 0)
+		{
+			fprintf(stderr, "%s: pthread_create(): %s\n", progname,
+			        strerror(s));
+			break;
+		}
+
+		nthreads++;
+	}
+
+	/* couldn't start any threads; do the work here */
+	if (nthreads == 0 && lj->lj_nconns > 0)
+	{
+		(void) mt_load_worker(&lw[0]);
+		nthreads = 1;
+	}
+	else
+	{
+		for (c = 0; c < nthreads; c++)
+			(void) pthread_join(lw[c].lw_tid, NULL);
+	}
+
+	(void) gettimeofday(&end, NULL);
+	secs = (double) mt_usecs(&lj->lj_start, &end) / 1000000.;
+
+	/* merge per-connection results */
+	memset(all, '\0', sizeof all);
+	for (c = 0; c < nthreads; c++)
+	{
+		done += lw[c].lw_done;
+		errors += lw[c].lw_errors;
+		accept += lw[c].lw_accept;
+		reject += lw[c].lw_reject;
+		tempfail += lw[c].lw_tempfail;
+		discard += lw[c].lw_discard;
+		other += lw[c].lw_other;
+
+		for (s = 0; s < MT_LOAD_STAGES; s++)
+		{
+			struct mt_samples *ms = &lw[c].lw_samples[s];
+			size_t n;
+
+			for (n = 0; n < ms->ms_n; n++)
+				mt_load_sample(&all[s], ms->ms_usec[n]);
+
+			free(ms->ms_usec);
+		}
+
+		free(lw[c].lw_hbuf);
+	}
+
+	fprintf(stdout,
+	        "%s: %lu message(s) in %.3fs over %d connection(s), %.1f msgs/sec\n",
+	        progname, done, secs, nthreads,
+	        secs > 0. ? (double) done / secs : 0.);
+	fprintf(stdout,
+	        "%s: replies: %lu accept/continue, %lu reject, %lu tempfail, %lu discard, %lu other; %lu error(s)\n",
+	        progname, accept, reject, tempfail, discard, other, errors);
+	fprintf(stdout, "%-8s %8s %9s %9s %9s %9s %9s (msec)\n",
+	        "stage", "count", "mean", "p50", "p90", "p99", "max");
+
+	for (s = 0; s < MT_LOAD_STAGES; s++)
+	{
+		size_t n;
+		double sum = 0.;
+
+		qsort(all[s].ms_usec, all[s].ms_n, sizeof(unsigned long),
+		      mt_load_cmp);
+
+		for (n = 0; n < all[s].ms_n; n++)
+			sum += all[s].ms_usec[n];
+
+		fprintf(stdout, "%-8s %8lu %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+		        stages[s], (unsigned long) all[s].ms_n,
+		        all[s].ms_n == 0 ? 0. : sum / all[s].ms_n / 1000.,
+		        mt_load_pct(&all[s], 50.), mt_load_pct(&all[s], 90.),
+		        mt_load_pct(&all[s], 99.), mt_load_pct(&all[s], 100.));
+
+		free(all[s].ms_usec);
+	}
+
+	free(lw);
+	mt_load_free(lj);
+
+	if (errors > 0)
+		status = 1;
+
+	if (mt_stopfilter() != 0)
+		status = 1;
+
+	return status;
+}
+
+/*
+**  USAGE -- print usage message
+** 
+**  Parameters:
+**  	Not now.  Maybe later.
+**
+**  Return value:
+**  	EX_USAGE
+*/
+
+int
+usage(void)
+{
+	fprintf(stderr, "%s: usage: %s [options]\n"
+	                "       %s -l sockinfo [load options] file|dir [...]\n"
+	                "\t-D name[=value]\tdefine global variable\n"
+	                "\t-s script      \tscript to run (default = stdin)\n"
+	                "\t-u             \treport usage statistics\n"
+	                "\t-v             \tverbose mode\n"
+	                "\t-V             \tprint version number and exit\n"
+	                "\t-w             \tdon't wait for child at shutdown\n"
+	                "load options:\n"
+	                "\t-c conns       \tconcurrent connections (default %d)\n"
+	                "\t-d secs        \trun for this many seconds\n"
+	                "\t-f command     \tstart this filter first\n"
+	                "\t-l sockinfo    \tfilter socket; enables load mode\n"
+	                "\t-m count       \tmessages per connection (default 1)\n"
+	                "\t-n count       \tmessages to send (default = corpus size)\n"
+	                "\t-r rate        \ttarget messages/sec (default closed loop)\n",
+	                progname, progname, progname, DEFLOADCONNS);
+
+	return EX_USAGE;
+}
+
+/*
+**  MAIN -- program mainline
+**
+**  Parameters:
+**  	argc, argv -- the usual
+**
+**  Return value:
+**  	Exit status.
+*/
+
+int
+main(int argc, char **argv)
+{
+	int c;
+	int status;
+	int fd;
+	int retval = 0;
+	ssize_t rlen;
+	char *p;
+	char *script = NULL;
+	lua_State *l;
+	struct mt_lua_io io;
+	struct mt_loadjob lj;
+	struct stat s;
+
+	progname = (p = strrchr(argv[0], '/')) == NULL ? argv[0] : p + 1;
+
+	verbose = 0;
+	filterpid = 0;
+	tmo = DEFTIMEOUT;
+	rusage = FALSE;
+	nowait = FALSE;
+
+	memset(&lj, '\0', sizeof lj);
+	lj.lj_nconns = DEFLOADCONNS;
+	lj.lj_perconn = 1;
+
+	l = lua_newstate(mt_lua_alloc, NULL);
+	if (l == NULL)
+	{
+		fprintf(stderr, "%s: unable to allocate new Lua state\n",
+		        progname);
+		return 1;
+	}
+
+	luaL_openlibs(l);
+
+	while ((c = getopt(argc, argv, CMDLINEOPTS)) != -1)
+	{
+		switch (c)
+		{
+		  case 'c':
+			lj.lj_nconns = (int) strtol(optarg, &p, 10);
+			if (*p != '\0' || lj.lj_nconns < 1)
+			{
+				lua_close(l);
+				return usage();
+			}
+			break;
+
+		  case 'd':
+			lj.lj_duration = (time_t) strtoul(optarg, &p, 10);
+			if (*p != '\0')
+			{
+				lua_close(l);
+				return usage();
+			}
+			break;
+
+		  case 'D':
+			p = strchr(optarg, '=');
+			if (p != NULL)
+			{
+				*p = '\0';
+				lua_pushstring(l, p + 1);
+			}
+			else
+			{
+				lua_pushnumber(l, 1);
+			}
+
+			lua_setglobal(l, optarg);
+
+			break;
+
+		  case 'f':
+			lj.lj_filter = optarg;
+			break;
+
+		  case 'l':
+			lj.lj_sockinfo = optarg;
+			break;
+
+		  case 'm':
+			lj.lj_perconn = (unsigned int) strtoul(optarg, &p, 10);
+			if (*p != '\0' || lj.lj_perconn < 1)
+			{
+				lua_close(l);
+				return usage();
+			}
+			break;
+
+		  case 'n':
+			lj.lj_limit = strtoul(optarg, &p, 10);
+			if (*p != '\0')
+			{
+				lua_close(l);
+				return usage();
+			}
+			break;
+
+		  case 'r':
+			lj.lj_rate = strtod(optarg, &p);
+			if (*p != '\0' || lj.lj_rate < 0.)
+			{
+				lua_close(l);
+				return usage();
+			}
+			break;
+
+		  case 's':
+			if (script != NULL)
+			{
+				fprintf(stderr,
+				        "%s: multiple use of '-%c' not permitted\n",
+				        progname, c);
+				lua_close(l);
+				return EX_USAGE;
+			}
+
+			script = optarg;
+			break;
+
+		  case 'u':
+			rusage = TRUE;
+			break;
+
+		  case 'v':
+			verbose++;
+			break;
+
+		  case 'V':
+			fprintf(stdout, "%s: %s v%s\n", progname, MT_PRODUCT,
+			        MT_VERSION);
+			return 0;
+
+		  case 'w':
+			nowait = TRUE;
+			break;
+
+		  default:
+			lua_close(l);
+			return usage();
+		}
+	}
+
+	if (lj.lj_sockinfo != NULL)
+	{
+		lua_close(l);
+
+		if (optind == argc || script != NULL)
+			return usage();
+
+		return mt_load(&lj, argc - optind, argv + optind);
+	}
+
+	if (optind != argc)
+	{
+		lua_close(l);
+		return usage();
 	}
 
 	io.lua_io_done = FALSE;
@@ -4238,43 +5600,8 @@ main(int argc, char **argv)
 	if (io.lua_io_script != NULL)
 		free((void *) io.lua_io_script);
 
-	if (filterpid != 0)
-	{
-		if (kill(filterpid, SIGTERM) != 0)
-		{
-			fprintf(stderr, "%s: %d: kill() %s\n", progname,
-			        filterpid, strerror(errno));
-		}
-		else if (!nowait)
-		{
-			if (verbose > 1)
-			{
-				fprintf(stdout,
-				        "%s: waiting for process %d\n",
-				        progname, filterpid);
-			}
-
-			(void) wait(&status);
-
-			if (WIFEXITED(status) && WEXITSTATUS(status) != 0)
-			{
-				fprintf(stderr,
-				        "%s: filter process exited with status %d\n",
-				        progname, WEXITSTATUS(status));
-
-				retval = 1;
-			}
-			else if (WIFSIGNALED(status) &&
-			         WTERMSIG(status) != SIGTERM)
-			{
-				fprintf(stderr,
-				        "%s: filter process died with signal %d\n",
-				        progname, WTERMSIG(status));
-
-				retval = 1;
-			}
-		}
-	}
+	if (mt_stopfilter() != 0)
+		retval = 1;
 
 	if (rusage && !nowait)
 	{
@@ -0,0 +1,797 @@
+/*
+**  Copyright 2025 OpenDKIM contributors.
+*/
+
+#include "build-config.h"
+
+#ifdef _FFR_ASYNC_LOG
+
+/* system includes */
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+/* opendkim includes */
+#define	DKIMF_ASYNCLOG_INTERNAL
+#include "asynclog.h"
+#include "opendkim.h"
+
+/* macros */
+#define	DKIMF_ALOG_MSGSZ	BUFRSZ		/* longest message kept */
+#define	DKIMF_ALOG_NCLASS	512		/* rate-limited message classes */
+#define	DKIMF_ALOG_PROBE	8		/* class slots tried per format */
+#define	DKIMF_ALOG_REPORT	60		/* loss report interval (s) */
+
+#define	DKIMF_ALOG_LOAD(x)	__atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define	DKIMF_ALOG_STORE(x,v)	__atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#define	DKIMF_ALOG_ADD(x,n)	__atomic_add_fetch(&(x), (n), __ATOMIC_RELAXED)
+#define	DKIMF_ALOG_SUB(x,n)	__atomic_sub_fetch(&(x), (n), __ATOMIC_RELAXED)
+#define	DKIMF_ALOG_TAKE(x)	__atomic_exchange_n(&(x), 0, __ATOMIC_RELAXED)
+#define	DKIMF_ALOG_FENCE()	__atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/* DATA TYPES */
+struct alogrec
+{
+	int		ar_pri;			/* syslog priority */
+	time_t		ar_when;		/* time logged */
+	char		ar_msg[DKIMF_ALOG_MSGSZ]; /* formatted message */
+};
+
+/*
+**  ALOGCLASS -- rate limit state for one kind of message
+**
+**  Messages are of the same kind when they are logged with the same
+**  format string, i.e. from the same place in the code.  A slot is
+**  claimed by the first format hashed to it and kept from then on.
+*/
+
+struct alogclass
+{
+	const char *	ac_fmt;			/* format, NULL if unclaimed */
+	uint64_t	ac_rate;		/* second << 32 | count */
+	uint64_t	ac_suppressed;		/* over the rate */
+};
+
+/*
+**  ALOGBUF -- one thread's log buffer
+**
+**  A ring with a single producer, the owning thread, which alone
+**  advances ab_head, and a single consumer, the writer thread, which
+**  alone advances ab_tail.  Neither side takes a lock.  Buffers are
+**  never freed; when a thread exits its buffer is handed to the next
+**  new thread, like the metrics shards.
+*/
+
+struct alogbuf
+{
+	_Bool		ab_inuse;		/* owned by a live thread */
+	uint32_t	ab_head;		/* next slot to fill */
+	uint32_t	ab_tail;		/* next slot to write out */
+	struct alogrec * ab_rec;		/* the ring */
+	struct alogbuf * ab_next;		/* list of all buffers */
+};
+
+/* GLOBALS */
+static _Bool alog_die;				/* writer shutdown */
+static _Bool alog_running;			/* buffering active */
+static _Bool alog_sleeping;			/* writer waiting for work */
+static unsigned int alog_waiters;		/* threads waiting for room */
+static int alog_policy;				/* what to do when full */
+static unsigned int alog_size;			/* records per buffer */
+static unsigned int alog_limit;			/* per-class rate */
+static struct alogclass alog_class[DKIMF_ALOG_NCLASS]; /* rate limits */
+static struct alogclass alog_other;		/* formats with no slot */
+static uint64_t alog_dropped;			/* lost to full buffers */
+static FILE *alog_file;				/* log file, or NULL */
+static char alog_path[MAXPATHLEN + 1];		/* log file path */
+static char alog_ident[BUFRSZ + 1];		/* log file tag */
+static char alog_host[MAXHOSTNAMELEN + 1];	/* log file host name */
+static pthread_t alog_thread;			/* writer thread */
+static pthread_key_t alog_key;			/* per-thread buffer */
+static pthread_mutex_t alog_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t alog_wlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t alog_wcond = PTHREAD_COND_INITIALIZER; /* work */
+static pthread_cond_t alog_space = PTHREAD_COND_INITIALIZER; /* room */
+static struct alogbuf *alog_bufs;		/* all buffers */
+
+/*
+**  DKIMF_ASYNCLOG_RELEASE -- give up a thread's buffer at thread exit
+**
+**  Parameters:
+**  	arg -- the buffer
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_asynclog_release(void *arg)
+{
+	struct alogbuf *ab;
+
+	ab = (struct alogbuf *) arg;
+
+	pthread_mutex_lock(&alog_lock);
+	ab->ab_inuse = FALSE;
+	pthread_mutex_unlock(&alog_lock);
+}
+
+/*
+**  DKIMF_ASYNCLOG_BUF -- find the calling thread's buffer
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	The calling thread's buffer, or NULL if one could not be allocated.
+*/
+
+static struct alogbuf *
+dkimf_asynclog_buf(void)
+{
+	struct alogbuf *ab;
+
+	ab = (struct alogbuf *) pthread_getspecific(alog_key);
+	if (ab != NULL)
+		return ab;
+
+	pthread_mutex_lock(&alog_lock);
+
+	for (ab = alog_bufs; ab != NULL; ab = ab->ab_next)
+	{
+		if (!ab->ab_inuse)
+			break;
+	}
+
+	if (ab == NULL)
+	{
+		ab = (struct alogbuf *) malloc(sizeof *ab);
+		if (ab == NULL)
+		{
+			pthread_mutex_unlock(&alog_lock);
+			return NULL;
+		}
+
+		memset(ab, '\0', sizeof *ab);
+
+		ab->ab_rec = (struct alogrec *) malloc(sizeof(struct alogrec) *
+		                                       alog_size);
+		if (ab->ab_rec == NULL)
+		{
+			free(ab);
+			pthread_mutex_unlock(&alog_lock);
+			return NULL;
+		}
+
+		ab->ab_next = alog_bufs;
+		DKIMF_ALOG_STORE(alog_bufs, ab);
+	}
+
+	ab->ab_inuse = TRUE;
+
+	pthread_mutex_unlock(&alog_lock);
+
+	(void) pthread_setspecific(alog_key, ab);
+
+	return ab;
+}
+
+/*
+**  DKIMF_ASYNCLOG_CLASS -- find the rate limit state for a message
+**
+**  Parameters:
+**  	fmt -- format the message was logged with
+**
+**  Return value:
+**  	The class "fmt" belongs to.
+**
+**  Notes:
+**  	Formats that find no free slot share alog_other.
+*/
+
+static struct alogclass *
+dkimf_asynclog_class(const char *fmt)
+{
+	unsigned int c;
+	unsigned int slot;
+	const char *cur;
+	struct alogclass *ac;
+
+	slot = (unsigned int) (((uintptr_t) fmt >> 3) % DKIMF_ALOG_NCLASS);
+
+	for (c = 0; c < DKIMF_ALOG_PROBE; c++)
+	{
+		ac = &alog_class[(slot + c) % DKIMF_ALOG_NCLASS];
+
+		cur = DKIMF_ALOG_LOAD(ac->ac_fmt);
+		if (cur == NULL &&
+		    __atomic_compare_exchange_n(&ac->ac_fmt, &cur, fmt, FALSE,
+		                                __ATOMIC_ACQ_REL,
+		                                __ATOMIC_ACQUIRE))
+			return ac;
+
+		if (cur == fmt)
+			return ac;
+	}
+
+	return &alog_other;
+}
+
+/*
+**  DKIMF_ASYNCLOG_ADMIT -- apply the rate limit for one kind of message
+**
+**  Parameters:
+**  	ac -- class of the message
+**
+**  Return value:
+**  	TRUE iff the message may be logged.
+*/
+
+static _Bool
+dkimf_asynclog_admit(struct alogclass *ac)
+{
+	uint64_t old;
+	uint64_t new;
+	uint64_t now;
+
+	now = (uint64_t) time(NULL) & 0xffffffff;
+
+	old = __atomic_load_n(&ac->ac_rate, __ATOMIC_RELAXED);
+
+	do
+	{
+		if ((old >> 32) != now)
+			new = (now << 32) | 1;
+		else if ((old & 0xffffffff) >= alog_limit)
+			return FALSE;
+		else
+			new = old + 1;
+	} while (!__atomic_compare_exchange_n(&ac->ac_rate, &old, new,
+	                                      FALSE, __ATOMIC_RELAXED,
+	                                      __ATOMIC_RELAXED));
+
+	return TRUE;
+}
+
+/*
+**  DKIMF_ASYNCLOG_EMIT -- write one message out
+**
+**  Parameters:
+**  	pri -- syslog priority
+**  	when -- time the message was logged
+**  	msg -- the message
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Only called from the writer thread.  Output to a file is left in
+**  	the stdio buffer and flushed once per pass.
+*/
+
+static void
+dkimf_asynclog_emit(int pri, time_t when, const char *msg)
+{
+	struct tm tm;
+	char stamp[BUFRSZ];
+
+	if (alog_file == NULL)
+	{
+		syslog(pri, "%s", msg);
+		return;
+	}
+
+	(void) localtime_r(&when, &tm);
+	(void) strftime(stamp, sizeof stamp, "%b %e %H:%M:%S", &tm);
+
+	fprintf(alog_file, "%s %s %s[%ld]: %s\n", stamp, alog_host,
+	        alog_ident, (long) getpid(), msg);
+}
+
+/*
+**  DKIMF_ASYNCLOG_REPORT -- log how many messages were lost
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_asynclog_report(void)
+{
+	int c;
+	uint64_t n;
+	time_t now;
+	const char *fmt;
+	struct alogclass *ac;
+	char msg[BUFRSZ];
+
+	(void) time(&now);
+
+	n = DKIMF_ALOG_TAKE(alog_dropped);
+	if (n > 0)
+	{
+		snprintf(msg, sizeof msg,
+		         "%" PRIu64 " log message(s) dropped, buffer full", n);
+		dkimf_asynclog_emit(LOG_WARNING, now, msg);
+	}
+
+	for (c = 0; c <= DKIMF_ALOG_NCLASS; c++)
+	{
+		ac = (c == DKIMF_ALOG_NCLASS ? &alog_other : &alog_class[c]);
+
+		n = DKIMF_ALOG_TAKE(ac->ac_suppressed);
+		if (n == 0)
+			continue;
+
+		fmt = DKIMF_ALOG_LOAD(ac->ac_fmt);
+		if (fmt == NULL)
+		{
+			snprintf(msg, sizeof msg,
+			         "%" PRIu64 " other log message(s) suppressed by rate limit",
+			         n);
+		}
+		else
+		{
+			snprintf(msg, sizeof msg,
+			         "%" PRIu64 " log message(s) like \"%.80s\" suppressed by rate limit",
+			         n, fmt);
+		}
+		dkimf_asynclog_emit(LOG_WARNING, now, msg);
+	}
+}
+
+/*
+**  DKIMF_ASYNCLOG_REOPEN -- reopen the log file if it was rotated
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_asynclog_reopen(void)
+{
+	FILE *f;
+	struct stat cur;
+	struct stat now;
+
+	if (alog_file == NULL)
+		return;
+
+	if (fstat(fileno(alog_file), &cur) == 0 &&
+	    stat(alog_path, &now) == 0 &&
+	    cur.st_dev == now.st_dev && cur.st_ino == now.st_ino)
+		return;
+
+	f = fopen(alog_path, "a");
+	if (f == NULL)
+		return;
+
+	(void) fclose(alog_file);
+	alog_file = f;
+}
+
+/*
+**  DKIMF_ASYNCLOG_DRAIN -- write out everything buffered so far
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	Count of messages written.
+*/
+
+static unsigned int
+dkimf_asynclog_drain(void)
+{
+	unsigned int n = 0;
+	uint32_t h;
+	uint32_t t;
+	struct alogbuf *ab;
+	struct alogrec *ar;
+
+	for (ab = DKIMF_ALOG_LOAD(alog_bufs); ab != NULL; ab = ab->ab_next)
+	{
+		t = ab->ab_tail;
+		h = DKIMF_ALOG_LOAD(ab->ab_head);
+
+		while (t != h)
+		{
+			ar = &ab->ab_rec[t % alog_size];
+			dkimf_asynclog_emit(ar->ar_pri, ar->ar_when,
+			                    ar->ar_msg);
+			t++;
+			n++;
+		}
+
+		DKIMF_ALOG_STORE(ab->ab_tail, t);
+	}
+
+	if (n > 0 && alog_file != NULL)
+		(void) fflush(alog_file);
+
+	return n;
+}
+
+/*
+**  DKIMF_ASYNCLOG_PENDING -- see if anything is waiting to be written
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	TRUE iff some thread's buffer is not empty.
+*/
+
+static _Bool
+dkimf_asynclog_pending(void)
+{
+	struct alogbuf *ab;
+
+	for (ab = DKIMF_ALOG_LOAD(alog_bufs); ab != NULL; ab = ab->ab_next)
+	{
+		if (DKIMF_ALOG_LOAD(ab->ab_head) != ab->ab_tail)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/*
+**  DKIMF_ASYNCLOG_WAKE -- wake the writer after adding a message
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	The fence pairs with the one in dkimf_asynclog_writer(): either
+**  	the writer sees the new message before it sleeps or this sees
+**  	alog_sleeping and signals it.  When the writer is busy, which is
+**  	when messages are arriving quickly, this takes no lock.
+*/
+
+static void
+dkimf_asynclog_wake(void)
+{
+	DKIMF_ALOG_FENCE();
+
+	if (DKIMF_ALOG_LOAD(alog_sleeping))
+	{
+		pthread_mutex_lock(&alog_wlock);
+		pthread_cond_signal(&alog_wcond);
+		pthread_mutex_unlock(&alog_wlock);
+	}
+}
+
+/*
+**  DKIMF_ASYNCLOG_WRITER -- writer thread
+**
+**  Parameters:
+**  	arg -- unused
+**
+**  Return value:
+**  	Always NULL.
+*/
+
+static void *
+dkimf_asynclog_writer(void *arg)
+{
+	_Bool die;
+	unsigned int n;
+	time_t now;
+	time_t lastcheck;
+	time_t lastreport;
+	struct timespec until;
+
+	(void) time(&lastcheck);
+	lastreport = lastcheck;
+
+	for (;;)
+	{
+		/* read the flag first so the last pass sees everything */
+		die = DKIMF_ALOG_LOAD(alog_die);
+
+		n = dkimf_asynclog_drain();
+
+		if (n > 0)
+		{
+			/* let blocked threads see the room just made */
+			DKIMF_ALOG_FENCE();
+			if (DKIMF_ALOG_LOAD(alog_waiters) > 0)
+			{
+				pthread_mutex_lock(&alog_wlock);
+				pthread_cond_broadcast(&alog_space);
+				pthread_mutex_unlock(&alog_wlock);
+			}
+		}
+
+		if (die)
+			break;
+
+		if (n == 0)
+		{
+			/*
+			**  Sleep until a message arrives, waking once a second
+			**  for the rotation check and loss reports below.
+			*/
+
+			pthread_mutex_lock(&alog_wlock);
+
+			DKIMF_ALOG_STORE(alog_sleeping, TRUE);
+			DKIMF_ALOG_FENCE();
+
+			if (!dkimf_asynclog_pending() &&
+			    !DKIMF_ALOG_LOAD(alog_die))
+			{
+				until.tv_sec = time(NULL) + 1;
+				until.tv_nsec = 0;
+
+				(void) pthread_cond_timedwait(&alog_wcond,
+				                              &alog_wlock,
+				                              &until);
+			}
+
+			DKIMF_ALOG_STORE(alog_sleeping, FALSE);
+
+			pthread_mutex_unlock(&alog_wlock);
+		}
+
+		(void) time(&now);
+
+		if (now != lastcheck)
+		{
+			dkimf_asynclog_reopen();
+			lastcheck = now;
+		}
+
+		if (now - lastreport >= DKIMF_ALOG_REPORT)
+		{
+			dkimf_asynclog_report();
+			if (alog_file != NULL)
+				(void) fflush(alog_file);
+			lastreport = now;
+		}
+	}
+
+	dkimf_asynclog_report();
+
+	return NULL;
+}
+
+/*
+**  DKIMF_ASYNCLOG -- log a message without waiting for syslog
+**
+**  Parameters:
+**  	pri -- syslog priority
+**  	fmt -- printf()-style format
+**  	... -- arguments
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Formats the message into the calling thread's buffer for the
+**  	writer thread to pass on.  Until the logger is started, messages
+**  	go to syslog() directly.  With a rate limit set, "fmt" decides
+**  	which limit applies, so it should be a literal rather than a
+**  	message built beforehand.  "%m" is not supported.
+*/
+
+void
+dkimf_asynclog(int pri, const char *fmt, ...)
+{
+	uint32_t h;
+	struct alogclass *ac;
+	struct alogbuf *ab;
+	struct alogrec *ar;
+	va_list ap;
+
+	if (!DKIMF_ALOG_LOAD(alog_running) ||
+	    (ab = dkimf_asynclog_buf()) == NULL)
+	{
+		va_start(ap, fmt);
+		vsyslog(pri, fmt, ap);
+		va_end(ap);
+		return;
+	}
+
+	if (alog_limit > 0 && LOG_PRI(pri) > LOG_CRIT)
+	{
+		ac = dkimf_asynclog_class(fmt);
+		if (!dkimf_asynclog_admit(ac))
+		{
+			DKIMF_ALOG_ADD(ac->ac_suppressed, 1);
+			return;
+		}
+	}
+
+	h = ab->ab_head;
+
+	while (h - DKIMF_ALOG_LOAD(ab->ab_tail) >= alog_size)
+	{
+		struct timespec until;
+
+		if (alog_policy == DKIMF_ALOG_DROP ||
+		    DKIMF_ALOG_LOAD(alog_die))
+		{
+			DKIMF_ALOG_ADD(alog_dropped, 1);
+			return;
+		}
+
+		/* wait for the writer; see the fence there */
+		pthread_mutex_lock(&alog_wlock);
+
+		DKIMF_ALOG_ADD(alog_waiters, 1);
+		DKIMF_ALOG_FENCE();
+
+		if (h - DKIMF_ALOG_LOAD(ab->ab_tail) >= alog_size &&
+		    !DKIMF_ALOG_LOAD(alog_die))
+		{
+			pthread_cond_signal(&alog_wcond);
+
+			until.tv_sec = time(NULL) + 1;
+			until.tv_nsec = 0;
+			(void) pthread_cond_timedwait(&alog_space, &alog_wlock,
+			                              &until);
+		}
+
+		DKIMF_ALOG_SUB(alog_waiters, 1);
+
+		pthread_mutex_unlock(&alog_wlock);
+	}
+
+	ar = &ab->ab_rec[h % alog_size];
+	ar->ar_pri = pri;
+	ar->ar_when = time(NULL);
+
+	va_start(ap, fmt);
+	(void) vsnprintf(ar->ar_msg, sizeof ar->ar_msg, fmt, ap);
+	va_end(ap);
+
+	DKIMF_ALOG_STORE(ab->ab_head, h + 1);
+
+	dkimf_asynclog_wake();
+}
+
+/*
+**  DKIMF_ASYNCLOG_INIT -- start buffered logging
+**
+**  Parameters:
+**  	ident -- tag for log file lines
+**  	size -- messages each thread may have waiting
+**  	policy -- what to do when a thread's buffer is full
+**  	          (DKIMF_ALOG_DROP or DKIMF_ALOG_BLOCK)
+**  	limit -- most messages per second of each kind, 0 for no limit
+**  	path -- file to write to instead of syslog, or NULL
+**  	err -- error buffer
+**  	errlen -- bytes available at "err"
+**
+**  Return value:
+**  	0 on success, -1 on failure with "err" updated.
+*/
+
+int
+dkimf_asynclog_init(const char *ident, unsigned int size, int policy,
+                    unsigned int limit, const char *path,
+                    char *err, size_t errlen)
+{
+	int status;
+
+	assert(ident != NULL);
+	assert(size > 0);
+	assert(err != NULL);
+
+	if (alog_running)
+		return 0;
+
+	if (path != NULL)
+	{
+		alog_file = fopen(path, "a");
+		if (alog_file == NULL)
+		{
+			snprintf(err, errlen, "%s: fopen(): %s", path,
+			         strerror(errno));
+			return -1;
+		}
+
+		snprintf(alog_path, sizeof alog_path, "%s", path);
+	}
+
+	snprintf(alog_ident, sizeof alog_ident, "%s", ident);
+	if (gethostname(alog_host, sizeof alog_host - 1) != 0)
+		snprintf(alog_host, sizeof alog_host, "localhost");
+
+	status = pthread_key_create(&alog_key, dkimf_asynclog_release);
+	if (status != 0)
+	{
+		snprintf(err, errlen, "pthread_key_create(): %s",
+		         strerror(status));
+		if (alog_file != NULL)
+		{
+			(void) fclose(alog_file);
+			alog_file = NULL;
+		}
+		return -1;
+	}
+
+	alog_size = size;
+	alog_policy = policy;
+	alog_limit = limit;
+	alog_die = FALSE;
+
+	status = pthread_create(&alog_thread, NULL, dkimf_asynclog_writer,
+	                        NULL);
+	if (status != 0)
+	{
+		snprintf(err, errlen, "pthread_create(): %s",
+		         strerror(status));
+		(void) pthread_key_delete(alog_key);
+		if (alog_file != NULL)
+		{
+			(void) fclose(alog_file);
+			alog_file = NULL;
+		}
+		return -1;
+	}
+
+	DKIMF_ALOG_STORE(alog_running, TRUE);
+
+	return 0;
+}
+
+/*
+**  DKIMF_ASYNCLOG_SHUTDOWN -- stop buffered logging
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Everything already buffered is written out before this returns;
+**  	later messages go to syslog() directly.
+*/
+
+void
+dkimf_asynclog_shutdown(void)
+{
+	if (!alog_running)
+		return;
+
+	DKIMF_ALOG_STORE(alog_running, FALSE);
+	DKIMF_ALOG_STORE(alog_die, TRUE);
+
+	pthread_mutex_lock(&alog_wlock);
+	pthread_cond_signal(&alog_wcond);
+	pthread_cond_broadcast(&alog_space);
+	pthread_mutex_unlock(&alog_wlock);
+
+	(void) pthread_join(alog_thread, NULL);
+
+	if (alog_file != NULL)
+	{
+		(void) fclose(alog_file);
+		alog_file = NULL;
+	}
+}
+
+#endif /* _FFR_ASYNC_LOG */
@@ -0,0 +1,39 @@
+/*
+**  Copyright 2025 OpenDKIM contributors.
+*/
+
+#ifndef _ASYNCLOG_H_
+#define _ASYNCLOG_H_
+
+#include "build-config.h"
+
+/* system includes */
+#include <sys/types.h>
+#include <syslog.h>
+
+/* macros */
+#define	DKIMF_ALOG_DROP		0		/* discard when buffer full */
+#define	DKIMF_ALOG_BLOCK	1		/* wait when buffer full */
+
+/* prototypes */
+extern void dkimf_asynclog(int, const char *, ...)
+#ifdef __GNUC__
+	__attribute__ ((format (printf, 2, 3)))
+#endif /* __GNUC__ */
+	;
+extern int dkimf_asynclog_init(const char *, unsigned int, int,
+                               unsigned int, const char *, char *, size_t);
+extern void dkimf_asynclog_shutdown(void);
+
+/*
+**  Sources that include this header have their syslog() calls routed
+**  through the buffered logger.  Until dkimf_asynclog_init() succeeds,
+**  and again after dkimf_asynclog_shutdown(), those calls go straight to
+**  syslog().
+*/
+
+#ifndef DKIMF_ASYNCLOG_INTERNAL
+# define syslog		dkimf_asynclog
+#endif /* ! DKIMF_ASYNCLOG_INTERNAL */
+
+#endif /* _ASYNCLOG_H_ */
@@ -0,0 +1,1825 @@
+/*
+**  Copyright 2025 OpenDKIM contributors.
+*/
+
+#include "build-config.h"
+
+#ifdef _FFR_EVENT_ENGINE
+
+/* system includes */
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <signal.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <poll.h>
+#include <errno.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+/* libbsd if found */
+#ifdef USE_BSD_H
+# include <bsd/string.h>
+#endif /* USE_BSD_H */
+
+/* libstrl if needed */
+#ifdef USE_STRL_H
+# include <strl.h>
+#endif /* USE_STRL_H */
+
+/* opendkim includes */
+#include "engine.h"
+#include "opendkim.h"
+#include "util.h"
+#ifdef _FFR_ASYNC_LOG
+# include "asynclog.h"
+#endif /* _FFR_ASYNC_LOG */
+
+/* macros */
+#define	DKIMF_ENG_EVENTS	64		/* events per epoll_wait() */
+#define	DKIMF_ENG_IOTIMEOUT	10000		/* write timeout (ms) */
+#define	DKIMF_ENG_READSZ	16384		/* minimum read size */
+#define	DKIMF_ENG_MAXPKT	(1024 * 1024 + 1024) /* largest command */
+#define	DKIMF_ENG_STAGES	(SMFIM_LAST + 1) /* macro stages */
+
+#define	DKIMF_ENG_VERSION	6		/* protocol version spoken */
+
+#ifndef SMFIA_UNKNOWN
+# define SMFIA_UNKNOWN		'U'
+# define SMFIA_UNIX		'L'
+# define SMFIA_INET		'4'
+# define SMFIA_INET6		'6'
+#endif /* ! SMFIA_UNKNOWN */
+
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL		0
+#endif /* ! MSG_NOSIGNAL */
+
+/* DATA TYPES */
+/*
+**  ENGCONN -- one MTA connection
+**
+**  A connection is owned by at most one thread at a time: epoll reports
+**  it once (EPOLLONESHOT) and it is then handed to a worker, which re-arms
+**  it when it has consumed everything available.  Nothing here other
+**  than the list pointers and ec_queued therefore needs a lock.
+*/
+
+struct engconn
+{
+	_Bool		ec_queued;		/* handed to a worker */
+	_Bool		ec_open;		/* negotiated; needs xxfi_close */
+	_Bool		ec_inmsg;		/* between MAIL and EOM/abort */
+	_Bool		ec_ineom;		/* in xxfi_eom() */
+	_Bool		ec_innegotiate;		/* in xxfi_negotiate() */
+	int		ec_fd;			/* descriptor */
+	time_t		ec_last;		/* last activity */
+	unsigned long	ec_actions;		/* negotiated actions */
+	unsigned long	ec_proto;		/* negotiated protocol flags */
+	size_t		ec_inlen;		/* bytes buffered */
+	size_t		ec_insize;		/* size of buffer */
+	void *		ec_priv;		/* filter's private pointer */
+	char *		ec_reply;		/* pending SMTP reply */
+	u_char *	ec_in;			/* input buffer */
+	char *		ec_symlist[DKIMF_ENG_STAGES];
+	char *		ec_macros[DKIMF_ENG_STAGES];
+	size_t		ec_maclen[DKIMF_ENG_STAGES];
+	struct engconn * ec_next;		/* all connections */
+	struct engconn * ec_prev;
+	struct engconn * ec_qnext;		/* work queue */
+};
+
+/* GLOBALS */
+static _Bool eng_die;				/* shutdown requested */
+static _Bool eng_shared;			/* listener shared with others */
+static int eng_lfd = -1;			/* listening socket */
+static int eng_epfd = -1;			/* epoll descriptor */
+static int eng_nworkers;			/* worker threads */
+static int eng_timeout;				/* idle timeout (s) */
+static char eng_path[MAXPATHLEN + 1];		/* UNIX socket path */
+static struct smfiDesc *eng_desc;		/* filter description */
+static pthread_t *eng_workers;			/* worker threads */
+static struct engconn *eng_conns;		/* all connections */
+static struct engconn *eng_qhead;		/* work queue */
+static struct engconn *eng_qtail;
+static pthread_mutex_t eng_clock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t eng_qlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t eng_qcond = PTHREAD_COND_INITIALIZER;
+
+/*
+**  Where to look for macros: the most recently sent stage first.
+*/
+
+static int eng_macorder[] =
+{
+	SMFIM_EOM, SMFIM_EOH, SMFIM_DATA, SMFIM_ENVRCPT, SMFIM_ENVFROM,
+	SMFIM_HELO, SMFIM_CONNECT
+};
+
+/*
+**  DKIMF_ENGINE_CONN -- recover a connection from a milter context
+**
+**  Parameters:
+**  	ctx -- milter context
+**
+**  Return value:
+**  	The connection.
+*/
+
+static struct engconn *
+dkimf_engine_conn(SMFICTX *ctx)
+{
+	assert(ctx != NULL);
+
+	return (struct engconn *) ctx;
+}
+
+/*
+**  DKIMF_ENGINE_SEND -- send one packet to the MTA
+**
+**  Parameters:
+**  	ec -- connection
+**  	cmd -- reply or action code (an SMFIR_* constant)
+**  	data -- payload (may be NULL)
+**  	len -- bytes at "data"
+**
+**  Return value:
+**  	TRUE iff the whole packet was written.
+*/
+
+static _Bool
+dkimf_engine_send(struct engconn *ec, int cmd, void *data, size_t len)
+{
+	ssize_t n;
+	uint32_t nlen;
+	struct msghdr msg;
+	struct pollfd pfd;
+	struct iovec iov[2];
+	u_char hdr[5];
+
+	nlen = htonl((uint32_t) (len + 1));
+	memcpy(hdr, &nlen, sizeof nlen);
+	hdr[4] = (u_char) cmd;
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof hdr;
+	iov[1].iov_base = data;
+	iov[1].iov_len = len;
+
+	memset(&msg, '\0', sizeof msg);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = (len > 0 ? 2 : 1);
+
+	while (msg.msg_iovlen > 0)
+	{
+		n = sendmsg(ec->ec_fd, &msg, MSG_NOSIGNAL);
+		if (n == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return FALSE;
+
+			pfd.fd = ec->ec_fd;
+			pfd.events = POLLOUT;
+			if (poll(&pfd, 1, DKIMF_ENG_IOTIMEOUT) <= 0)
+				return FALSE;
+			continue;
+		}
+
+		/* skip past what was written */
+		while (msg.msg_iovlen > 0 && (size_t) n >= msg.msg_iov->iov_len)
+		{
+			n -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+
+		if (msg.msg_iovlen > 0)
+		{
+			msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + n;
+			msg.msg_iov->iov_len -= n;
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+**  DKIMF_ENGINE_SENDSTR -- send a packet made of NUL-terminated strings
+**
+**  Parameters:
+**  	ec -- connection
+**  	cmd -- action code (an SMFIR_* constant)
+**  	idx -- header index to prepend, or -1 for none
+**  	s1 -- first string
+**  	s2 -- second string (or NULL)
+**
+**  Return value:
+**  	MI_SUCCESS or MI_FAILURE.
+*/
+
+static int
+dkimf_engine_sendstr(struct engconn *ec, int cmd, int idx, char *s1, char *s2)
+{
+	_Bool ok;
+	size_t len;
+	size_t l1;
+	size_t l2;
+	uint32_t nidx;
+	u_char *buf;
+
+	l1 = strlen(s1) + 1;
+	l2 = (s2 == NULL ? 0 : strlen(s2) + 1);
+	len = (idx >= 0 ? sizeof nidx : 0) + l1 + l2;
+
+	buf = malloc(len);
+	if (buf == NULL)
+		return MI_FAILURE;
+
+	len = 0;
+	if (idx >= 0)
+	{
+		nidx = htonl((uint32_t) idx);
+		memcpy(buf, &nidx, sizeof nidx);
+		len = sizeof nidx;
+	}
+	memcpy(buf + len, s1, l1);
+	len += l1;
+	if (s2 != NULL)
+	{
+		memcpy(buf + len, s2, l2);
+		len += l2;
+	}
+
+	ok = dkimf_engine_send(ec, cmd, buf, len);
+
+	free(buf);
+
+	return ok ? MI_SUCCESS : MI_FAILURE;
+}
+
+/*
+**  DKIMF_ENGINE_REPLY -- send the reply for a callback's return value
+**
+**  Parameters:
+**  	ec -- connection
+**  	r -- what the callback returned
+**  	noreply -- SMFIP_NR_* flag for this stage (or 0)
+**
+**  Return value:
+**  	TRUE unless writing failed.
+*/
+
+static _Bool
+dkimf_engine_reply(struct engconn *ec, sfsistat r, unsigned long noreply)
+{
+	_Bool ok;
+	int cmd;
+	char *reply;
+
+	reply = ec->ec_reply;
+	ec->ec_reply = NULL;
+
+	if (r == SMFIS_NOREPLY || (ec->ec_proto & noreply) != 0)
+	{
+		free(reply);
+		return TRUE;
+	}
+
+	switch (r)
+	{
+	  case SMFIS_CONTINUE:
+		cmd = SMFIR_CONTINUE;
+		break;
+
+#ifdef SMFIS_SKIP
+	  case SMFIS_SKIP:
+		if ((ec->ec_proto & SMFIP_SKIP) != 0)
+			cmd = SMFIR_SKIP;
+		else
+			cmd = SMFIR_CONTINUE;
+		break;
+#endif /* SMFIS_SKIP */
+
+	  case SMFIS_ACCEPT:
+		cmd = SMFIR_ACCEPT;
+		break;
+
+	  case SMFIS_DISCARD:
+		cmd = SMFIR_DISCARD;
+		break;
+
+	  case SMFIS_REJECT:
+		if (reply != NULL && reply[0] == '5')
+			cmd = SMFIR_REPLYCODE;
+		else
+			cmd = SMFIR_REJECT;
+		break;
+
+	  case SMFIS_TEMPFAIL:
+	  default:
+		if (reply != NULL && reply[0] == '4')
+			cmd = SMFIR_REPLYCODE;
+		else
+			cmd = SMFIR_TEMPFAIL;
+		break;
+	}
+
+	if (cmd == SMFIR_REPLYCODE)
+		ok = dkimf_engine_send(ec, cmd, reply, strlen(reply) + 1);
+	else
+		ok = dkimf_engine_send(ec, cmd, NULL, 0);
+
+	free(reply);
+
+	return ok;
+}
+
+/*
+**  DKIMF_ENGINE_CLEARMACROS -- forget macros from some stages
+**
+**  Parameters:
+**  	ec -- connection
+**  	first -- first stage to clear (SMFIM_CONNECT clears everything)
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Clearing from SMFIM_ENVFROM clears everything sent for a message.
+*/
+
+static void
+dkimf_engine_clearmacros(struct engconn *ec, int first)
+{
+	int c;
+
+	for (c = first; c < DKIMF_ENG_STAGES; c++)
+	{
+		free(ec->ec_macros[c]);
+		ec->ec_macros[c] = NULL;
+		ec->ec_maclen[c] = 0;
+	}
+}
+
+/*
+**  DKIMF_ENGINE_ARGV -- split a packet into NUL-terminated strings
+**
+**  Parameters:
+**  	data -- payload
+**  	len -- bytes at "data"
+**
+**  Return value:
+**  	A NULL-terminated array of pointers into "data", or NULL on error.
+**  	The caller must free() the array.
+*/
+
+static char **
+dkimf_engine_argv(char *data, size_t len)
+{
+	int n = 0;
+	size_t c;
+	char **argv;
+
+	if (len == 0 || data[len - 1] != '\0')
+		return NULL;
+
+	for (c = 0; c < len; c++)
+	{
+		if (data[c] == '\0')
+			n++;
+	}
+
+	argv = (char **) malloc((n + 1) * sizeof(char *));
+	if (argv == NULL)
+		return NULL;
+
+	n = 0;
+	for (c = 0; c < len; c += strlen(&data[c]) + 1)
+		argv[n++] = &data[c];
+	argv[n] = NULL;
+
+	return argv;
+}
+
+/*
+**  DKIMF_ENGINE_NEGOTIATE -- handle SMFIC_OPTNEG
+**
+**  Parameters:
+**  	ec -- connection
+**  	data -- payload
+**  	len -- bytes at "data"
+**
+**  Return value:
+**  	TRUE to keep the connection, FALSE to close it.
+*/
+
+static _Bool
+dkimf_engine_negotiate(struct engconn *ec, u_char *data, size_t len)
+{
+	_Bool ok;
+	int c;
+	sfsistat r;
+	size_t rlen;
+	uint32_t v[3];
+	unsigned long nosteps = 0;
+	unsigned long f0, f1;
+	unsigned long pf0 = 0, pf1 = 0, pf2 = 0, pf3 = 0;
+	u_char *rbuf;
+
+	if (len < sizeof v)
+		return FALSE;
+
+	memcpy(v, data, sizeof v);
+	f0 = ntohl(v[1]);
+	f1 = ntohl(v[2]);
+
+	/* steps for which there's no callback needn't be sent */
+	if (eng_desc->xxfi_connect == NULL)
+		nosteps |= SMFIP_NOCONNECT;
+	if (eng_desc->xxfi_helo == NULL)
+		nosteps |= SMFIP_NOHELO;
+	if (eng_desc->xxfi_envfrom == NULL)
+		nosteps |= SMFIP_NOMAIL;
+	if (eng_desc->xxfi_envrcpt == NULL)
+		nosteps |= SMFIP_NORCPT;
+	if (eng_desc->xxfi_header == NULL)
+		nosteps |= SMFIP_NOHDRS;
+	if (eng_desc->xxfi_eoh == NULL)
+		nosteps |= SMFIP_NOEOH;
+	if (eng_desc->xxfi_body == NULL)
+		nosteps |= SMFIP_NOBODY;
+	if (eng_desc->xxfi_unknown == NULL)
+		nosteps |= SMFIP_NOUNKNOWN;
+	if (eng_desc->xxfi_data == NULL)
+		nosteps |= SMFIP_NODATA;
+
+	ec->ec_innegotiate = TRUE;
+	if (eng_desc->xxfi_negotiate != NULL)
+	{
+		r = eng_desc->xxfi_negotiate((SMFICTX *) ec, f0, f1, 0, 0,
+		                             &pf0, &pf1, &pf2, &pf3);
+	}
+	else
+	{
+		r = SMFIS_ALL_OPTS;
+	}
+	ec->ec_innegotiate = FALSE;
+
+	if (r == SMFIS_ALL_OPTS)
+	{
+		ec->ec_actions = eng_desc->xxfi_flags & f0;
+		ec->ec_proto = nosteps & f1;
+	}
+	else if (r == SMFIS_CONTINUE)
+	{
+		ec->ec_actions = pf0;
+		ec->ec_proto = pf1;
+	}
+	else
+	{
+		return FALSE;
+	}
+
+	if ((ec->ec_actions & ~f0) != 0 || (ec->ec_proto & ~f1) != 0)
+	{
+		syslog(LOG_ERR,
+		       "event engine: filter requested unavailable options (actions 0x%lx of 0x%lx, protocol 0x%lx of 0x%lx)",
+		       ec->ec_actions, f0, ec->ec_proto, f1);
+		return FALSE;
+	}
+
+	ec->ec_open = TRUE;
+
+	/* version, actions, protocol, then any requested macro lists */
+	rlen = sizeof v;
+	for (c = 0; c < DKIMF_ENG_STAGES; c++)
+	{
+		if (ec->ec_symlist[c] != NULL)
+			rlen += sizeof(uint32_t) + strlen(ec->ec_symlist[c]) + 1;
+	}
+
+	rbuf = malloc(rlen);
+	if (rbuf == NULL)
+		return FALSE;
+
+	v[0] = htonl(MIN(ntohl(v[0]), DKIMF_ENG_VERSION));
+	v[1] = htonl((uint32_t) ec->ec_actions);
+	v[2] = htonl((uint32_t) ec->ec_proto);
+	memcpy(rbuf, v, sizeof v);
+
+	rlen = sizeof v;
+	for (c = 0; c < DKIMF_ENG_STAGES; c++)
+	{
+		uint32_t stage;
+
+		if (ec->ec_symlist[c] == NULL)
+			continue;
+
+		stage = htonl((uint32_t) c);
+		memcpy(rbuf + rlen, &stage, sizeof stage);
+		rlen += sizeof stage;
+		memcpy(rbuf + rlen, ec->ec_symlist[c],
+		       strlen(ec->ec_symlist[c]) + 1);
+		rlen += strlen(ec->ec_symlist[c]) + 1;
+	}
+
+	ok = dkimf_engine_send(ec, SMFIC_OPTNEG, rbuf, rlen);
+
+	free(rbuf);
+
+	return ok;
+}
+
+/*
+**  DKIMF_ENGINE_CONNECT -- handle SMFIC_CONNECT
+**
+**  Parameters:
+**  	ec -- connection
+**  	data -- payload
+**  	len -- bytes at "data"
+**
+**  Return value:
+**  	TRUE to keep the connection, FALSE to close it.
+*/
+
+static _Bool
+dkimf_engine_connect(struct engconn *ec, char *data, size_t len)
+{
+	size_t hlen;
+	uint16_t port;
+	char *host;
+	char *addr;
+	struct sockaddr *sa = NULL;
+	union
+	{
+		struct sockaddr		sa;
+		struct sockaddr_in	sin;
+		struct sockaddr_in6	sin6;
+		struct sockaddr_un	sun;
+	} ss;
+
+	if (len == 0 || memchr(data, '\0', len) == NULL)
+		return FALSE;
+
+	host = data;
+	hlen = strlen(host) + 1;
+
+	memset(&ss, '\0', sizeof ss);
+
+	if (hlen + 1 + sizeof port < len && data[len - 1] == '\0')
+	{
+		memcpy(&port, data + hlen + 1, sizeof port);
+		addr = data + hlen + 1 + sizeof port;
+
+		switch (data[hlen])
+		{
+		  case SMFIA_INET:
+			ss.sin.sin_family = AF_INET;
+			ss.sin.sin_port = port;
+			if (inet_pton(AF_INET, addr, &ss.sin.sin_addr) == 1)
+				sa = &ss.sa;
+			break;
+
+		  case SMFIA_INET6:
+			if (strncasecmp(addr, "IPv6:", 5) == 0)
+				addr += 5;
+			ss.sin6.sin6_family = AF_INET6;
+			ss.sin6.sin6_port = port;
+			if (inet_pton(AF_INET6, addr, &ss.sin6.sin6_addr) == 1)
+				sa = &ss.sa;
+			break;
+
+		  case SMFIA_UNIX:
+			ss.sun.sun_family = AF_UNIX;
+			strlcpy(ss.sun.sun_path, addr, sizeof ss.sun.sun_path);
+			sa = &ss.sa;
+			break;
+
+		  default:
+			break;
+		}
+	}
+
+	if (eng_desc->xxfi_connect == NULL)
+		return dkimf_engine_reply(ec, SMFIS_CONTINUE, SMFIP_NR_CONN);
+
+	return dkimf_engine_reply(ec,
+	                          eng_desc->xxfi_connect((SMFICTX *) ec,
+	                                                 host, sa),
+	                          SMFIP_NR_CONN);
+}
+
+/*
+**  DKIMF_ENGINE_COMMAND -- handle one command from the MTA
+**
+**  Parameters:
+**  	ec -- connection
+**  	cmd -- command (an SMFIC_* constant)
+**  	data -- payload
+**  	len -- bytes at "data"
+**
+**  Return value:
+**  	TRUE to keep the connection, FALSE to close it.
+*/
+
+static _Bool
+dkimf_engine_command(struct engconn *ec, int cmd, u_char *data, size_t len)
+{
+	sfsistat r = SMFIS_CONTINUE;
+	char **argv;
+	SMFICTX *ctx;
+
+	ctx = (SMFICTX *) ec;
+
+	if (cmd != SMFIC_OPTNEG && !ec->ec_open)
+		return FALSE;
+
+	switch (cmd)
+	{
+	  case SMFIC_OPTNEG:
+		return dkimf_engine_negotiate(ec, data, len);
+
+	  case SMFIC_MACRO:
+	  {
+		int stage;
+
+		if (len == 0)
+			return TRUE;
+
+		switch (data[0])
+		{
+		  case SMFIC_CONNECT:
+			stage = SMFIM_CONNECT;
+			break;
+
+		  case SMFIC_HELO:
+			stage = SMFIM_HELO;
+			break;
+
+		  case SMFIC_MAIL:
+			stage = SMFIM_ENVFROM;
+			break;
+
+		  case SMFIC_RCPT:
+			stage = SMFIM_ENVRCPT;
+			break;
+
+		  case SMFIC_DATA:
+			stage = SMFIM_DATA;
+			break;
+
+		  case SMFIC_EOH:
+			stage = SMFIM_EOH;
+			break;
+
+		  case SMFIC_BODYEOB:
+			stage = SMFIM_EOM;
+			break;
+
+		  default:
+			return TRUE;
+		}
+
+		free(ec->ec_macros[stage]);
+		ec->ec_macros[stage] = NULL;
+		ec->ec_maclen[stage] = 0;
+
+		if (len > 1 && data[len - 1] == '\0')
+		{
+			ec->ec_macros[stage] = malloc(len - 1);
+			if (ec->ec_macros[stage] == NULL)
+				return FALSE;
+			memcpy(ec->ec_macros[stage], data + 1, len - 1);
+			ec->ec_maclen[stage] = len - 1;
+		}
+
+		return TRUE;
+	  }
+
+	  case SMFIC_CONNECT:
+		return dkimf_engine_connect(ec, (char *) data, len);
+
+	  case SMFIC_HELO:
+		if (eng_desc->xxfi_helo != NULL && len > 0 &&
+		    data[len - 1] == '\0')
+			r = eng_desc->xxfi_helo(ctx, (char *) data);
+		return dkimf_engine_reply(ec, r, SMFIP_NR_HELO);
+
+	  case SMFIC_MAIL:
+	  case SMFIC_RCPT:
+		argv = dkimf_engine_argv((char *) data, len);
+		if (argv == NULL)
+			return FALSE;
+
+		if (cmd == SMFIC_MAIL)
+		{
+			ec->ec_inmsg = TRUE;
+			if (eng_desc->xxfi_envfrom != NULL)
+				r = eng_desc->xxfi_envfrom(ctx, argv);
+		}
+		else if (eng_desc->xxfi_envrcpt != NULL)
+		{
+			r = eng_desc->xxfi_envrcpt(ctx, argv);
+		}
+
+		free(argv);
+
+		return dkimf_engine_reply(ec, r,
+		                          cmd == SMFIC_MAIL ? SMFIP_NR_MAIL
+		                                            : SMFIP_NR_RCPT);
+
+	  case SMFIC_DATA:
+		if (eng_desc->xxfi_data != NULL)
+			r = eng_desc->xxfi_data(ctx);
+		return dkimf_engine_reply(ec, r, SMFIP_NR_DATA);
+
+	  case SMFIC_HEADER:
+		argv = dkimf_engine_argv((char *) data, len);
+		if (argv == NULL || argv[0] == NULL || argv[1] == NULL)
+		{
+			free(argv);
+			return FALSE;
+		}
+
+		if (eng_desc->xxfi_header != NULL)
+			r = eng_desc->xxfi_header(ctx, argv[0], argv[1]);
+
+		free(argv);
+
+		return dkimf_engine_reply(ec, r, SMFIP_NR_HDR);
+
+	  case SMFIC_EOH:
+		if (eng_desc->xxfi_eoh != NULL)
+			r = eng_desc->xxfi_eoh(ctx);
+		return dkimf_engine_reply(ec, r, SMFIP_NR_EOH);
+
+	  case SMFIC_BODY:
+		if (eng_desc->xxfi_body != NULL)
+			r = eng_desc->xxfi_body(ctx, data, len);
+		return dkimf_engine_reply(ec, r, SMFIP_NR_BODY);
+
+	  case SMFIC_BODYEOB:
+		if (len > 0 && eng_desc->xxfi_body != NULL)
+		{
+			r = eng_desc->xxfi_body(ctx, data, len);
+			if (r != SMFIS_CONTINUE)
+			{
+				ec->ec_inmsg = FALSE;
+				dkimf_engine_clearmacros(ec, SMFIM_ENVFROM);
+				return dkimf_engine_reply(ec, r, 0);
+			}
+		}
+
+		ec->ec_ineom = TRUE;
+		if (eng_desc->xxfi_eom != NULL)
+			r = eng_desc->xxfi_eom(ctx);
+		ec->ec_ineom = FALSE;
+
+		ec->ec_inmsg = FALSE;
+		dkimf_engine_clearmacros(ec, SMFIM_ENVFROM);
+
+		return dkimf_engine_reply(ec, r, 0);
+
+	  case SMFIC_ABORT:
+		if (eng_desc->xxfi_abort != NULL)
+			(void) eng_desc->xxfi_abort(ctx);
+		ec->ec_inmsg = FALSE;
+		dkimf_engine_clearmacros(ec, SMFIM_ENVFROM);
+		return TRUE;
+
+	  case SMFIC_UNKNOWN:
+		if (eng_desc->xxfi_unknown != NULL && len > 0 &&
+		    data[len - 1] == '\0')
+			r = eng_desc->xxfi_unknown(ctx, (char *) data);
+		return dkimf_engine_reply(ec, r, SMFIP_NR_UNKN);
+
+	  case SMFIC_QUIT_NC:
+		/* the MTA will reuse this channel for a new connection */
+		if (ec->ec_inmsg && eng_desc->xxfi_abort != NULL)
+			(void) eng_desc->xxfi_abort(ctx);
+		if (eng_desc->xxfi_close != NULL)
+			(void) eng_desc->xxfi_close(ctx);
+		ec->ec_inmsg = FALSE;
+		dkimf_engine_clearmacros(ec, SMFIM_CONNECT);
+		return TRUE;
+
+	  case SMFIC_QUIT:
+		return FALSE;
+
+	  default:
+		return dkimf_engine_reply(ec, SMFIS_TEMPFAIL, 0);
+	}
+}
+
+/*
+**  DKIMF_ENGINE_SERVE -- process whatever a connection has sent
+**
+**  Parameters:
+**  	ec -- connection
+**
+**  Return value:
+**  	TRUE if the connection should be kept, FALSE if it's finished.
+*/
+
+static _Bool
+dkimf_engine_serve(struct engconn *ec)
+{
+	ssize_t n;
+	size_t off;
+	uint32_t plen;
+
+	ec->ec_last = time(NULL);
+
+	for (;;)
+	{
+		/* make room */
+		if (ec->ec_insize - ec->ec_inlen < DKIMF_ENG_READSZ)
+		{
+			size_t newsize;
+			u_char *newbuf;
+
+			newsize = MAX(ec->ec_insize * 2,
+			              ec->ec_inlen + DKIMF_ENG_READSZ);
+			newbuf = realloc(ec->ec_in, newsize);
+			if (newbuf == NULL)
+				return FALSE;
+
+			ec->ec_in = newbuf;
+			ec->ec_insize = newsize;
+		}
+
+		n = read(ec->ec_fd, ec->ec_in + ec->ec_inlen,
+		         ec->ec_insize - ec->ec_inlen);
+		if (n == -1 && errno == EINTR)
+			continue;
+		else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return TRUE;
+		else if (n <= 0)
+			return FALSE;
+
+		ec->ec_inlen += n;
+
+		/* dispatch every complete command */
+		off = 0;
+		while (ec->ec_inlen - off >= sizeof plen)
+		{
+			memcpy(&plen, ec->ec_in + off, sizeof plen);
+			plen = ntohl(plen);
+
+			if (plen == 0 || plen > DKIMF_ENG_MAXPKT)
+			{
+				syslog(LOG_ERR,
+				       "event engine: invalid command length %lu",
+				       (u_long) plen);
+				return FALSE;
+			}
+
+			if (ec->ec_inlen - off < sizeof plen + plen)
+				break;
+
+			if (!dkimf_engine_command(ec,
+			                          ec->ec_in[off + sizeof plen],
+			                          ec->ec_in + off + sizeof plen + 1,
+			                          plen - 1))
+				return FALSE;
+
+			off += sizeof plen + plen;
+		}
+
+		if (off > 0)
+		{
+			memmove(ec->ec_in, ec->ec_in + off, ec->ec_inlen - off);
+			ec->ec_inlen -= off;
+		}
+	}
+}
+
+/*
+**  DKIMF_ENGINE_FREE -- release a connection
+**
+**  Parameters:
+**  	ec -- connection
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	The filter's abort and close callbacks are called as needed.
+*/
+
+static void
+dkimf_engine_free(struct engconn *ec)
+{
+	int c;
+
+	if (ec->ec_open)
+	{
+		if (ec->ec_inmsg && eng_desc->xxfi_abort != NULL)
+			(void) eng_desc->xxfi_abort((SMFICTX *) ec);
+		if (eng_desc->xxfi_close != NULL)
+			(void) eng_desc->xxfi_close((SMFICTX *) ec);
+	}
+
+	(void) epoll_ctl(eng_epfd, EPOLL_CTL_DEL, ec->ec_fd, NULL);
+
+	pthread_mutex_lock(&eng_clock);
+	if (ec->ec_prev == NULL)
+		eng_conns = ec->ec_next;
+	else
+		ec->ec_prev->ec_next = ec->ec_next;
+	if (ec->ec_next != NULL)
+		ec->ec_next->ec_prev = ec->ec_prev;
+	pthread_mutex_unlock(&eng_clock);
+
+	(void) close(ec->ec_fd);
+
+	for (c = 0; c < DKIMF_ENG_STAGES; c++)
+		free(ec->ec_symlist[c]);
+	dkimf_engine_clearmacros(ec, SMFIM_CONNECT);
+	free(ec->ec_reply);
+	free(ec->ec_in);
+	free(ec);
+}
+
+/*
+**  DKIMF_ENGINE_ARM -- (re-)enable notification of input on a connection
+**
+**  Parameters:
+**  	ec -- connection
+**  	op -- EPOLL_CTL_ADD or EPOLL_CTL_MOD
+**
+**  Return value:
+**  	TRUE on success.
+*/
+
+static _Bool
+dkimf_engine_arm(struct engconn *ec, int op)
+{
+	struct epoll_event ev;
+
+	memset(&ev, '\0', sizeof ev);
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.ptr = ec;
+
+	return (epoll_ctl(eng_epfd, op, ec->ec_fd, &ev) == 0);
+}
+
+/*
+**  DKIMF_ENGINE_WORKER -- worker thread
+**
+**  Parameters:
+**  	arg -- unused
+**
+**  Return value:
+**  	Always NULL.
+*/
+
+static void *
+dkimf_engine_worker(void *arg)
+{
+	struct engconn *ec;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&eng_qlock);
+
+		while (eng_qhead == NULL && !eng_die)
+			pthread_cond_wait(&eng_qcond, &eng_qlock);
+
+		if (eng_die)
+		{
+			pthread_mutex_unlock(&eng_qlock);
+			break;
+		}
+
+		ec = eng_qhead;
+		eng_qhead = ec->ec_qnext;
+		if (eng_qhead == NULL)
+			eng_qtail = NULL;
+		ec->ec_qnext = NULL;
+
+		pthread_mutex_unlock(&eng_qlock);
+
+		if (!dkimf_engine_serve(ec))
+		{
+			dkimf_engine_free(ec);
+			continue;
+		}
+
+		pthread_mutex_lock(&eng_qlock);
+		ec->ec_queued = FALSE;
+		pthread_mutex_unlock(&eng_qlock);
+
+		if (!dkimf_engine_arm(ec, EPOLL_CTL_MOD))
+			dkimf_engine_free(ec);
+	}
+
+	return NULL;
+}
+
+/*
+**  DKIMF_ENGINE_ENQUEUE -- hand a connection to the workers
+**
+**  Parameters:
+**  	ec -- connection
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_engine_enqueue(struct engconn *ec)
+{
+	pthread_mutex_lock(&eng_qlock);
+
+	if (!ec->ec_queued)
+	{
+		ec->ec_queued = TRUE;
+		if (eng_qtail == NULL)
+			eng_qhead = ec;
+		else
+			eng_qtail->ec_qnext = ec;
+		eng_qtail = ec;
+
+		pthread_cond_signal(&eng_qcond);
+	}
+
+	pthread_mutex_unlock(&eng_qlock);
+}
+
+/*
+**  DKIMF_ENGINE_ACCEPT -- accept new connections
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_engine_accept(void)
+{
+	int fd;
+	int flags;
+	struct engconn *ec;
+
+	for (;;)
+	{
+		fd = accept(eng_lfd, NULL, NULL);
+		if (fd == -1)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK &&
+			    errno != EINTR && errno != ECONNABORTED)
+			{
+				syslog(LOG_ERR, "event engine: accept(): %s",
+				       strerror(errno));
+			}
+
+			return;
+		}
+
+		flags = fcntl(fd, F_GETFL, 0);
+		if (flags == -1 ||
+		    fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		{
+			(void) close(fd);
+			continue;
+		}
+
+		ec = (struct engconn *) calloc(1, sizeof *ec);
+		if (ec == NULL)
+		{
+			syslog(LOG_ERR, "event engine: calloc(): %s",
+			       strerror(errno));
+			(void) close(fd);
+			continue;
+		}
+
+		ec->ec_fd = fd;
+		ec->ec_last = time(NULL);
+
+		pthread_mutex_lock(&eng_clock);
+		ec->ec_next = eng_conns;
+		if (eng_conns != NULL)
+			eng_conns->ec_prev = ec;
+		eng_conns = ec;
+		pthread_mutex_unlock(&eng_clock);
+
+		if (!dkimf_engine_arm(ec, EPOLL_CTL_ADD))
+		{
+			syslog(LOG_ERR, "event engine: epoll_ctl(): %s",
+			       strerror(errno));
+			dkimf_engine_free(ec);
+		}
+	}
+}
+
+/*
+**  DKIMF_ENGINE_EXPIRE -- close connections that have been idle too long
+**
+**  Parameters:
+**  	now -- current time
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	The connection is only shut down here; its owner, if any, sees EOF
+**  	and releases it, so nothing is freed out from under a worker.
+*/
+
+static void
+dkimf_engine_expire(time_t now)
+{
+	struct engconn *ec;
+
+	pthread_mutex_lock(&eng_clock);
+
+	for (ec = eng_conns; ec != NULL; ec = ec->ec_next)
+	{
+		if (ec->ec_last + eng_timeout < now)
+			(void) shutdown(ec->ec_fd, SHUT_RDWR);
+	}
+
+	pthread_mutex_unlock(&eng_clock);
+}
+
+/*
+**  DKIMF_ENGINE_SIGNALS -- signal handling thread
+**
+**  Parameters:
+**  	arg -- unused
+**
+**  Return value:
+**  	Always NULL.
+**
+**  Notes:
+**  	This takes over from libmilter's signal thread: SIGHUP, SIGINT and
+**  	SIGTERM stop the engine.
+*/
+
+static void *
+dkimf_engine_signals(void *arg)
+{
+	int sig;
+	sigset_t mask;
+
+	(void) pthread_detach(pthread_self());
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+
+	if (sigwait(&mask, &sig) == 0)
+		dkimf_engine_stop();
+
+	return NULL;
+}
+
+/*
+**  DKIMF_ENGINE_INIT -- prepare the event engine
+**
+**  Parameters:
+**  	desc -- filter description, as for smfi_register()
+**  	sockspec -- socket on which to listen, as for smfi_setconn()
+**  	workers -- number of worker threads
+**  	timeout -- idle connection timeout (seconds)
+**  	err -- error buffer
+**  	errlen -- bytes available at "err"
+**
+**  Return value:
+**  	MI_SUCCESS or MI_FAILURE (with "err" updated).
+*/
+
+int
+dkimf_engine_init(struct smfiDesc *desc, char *sockspec, int workers,
+                  int timeout, char *err, size_t errlen)
+{
+	int flags;
+	struct epoll_event ev;
+
+	assert(desc != NULL);
+	assert(sockspec != NULL);
+	assert(err != NULL);
+
+	eng_desc = desc;
+	eng_nworkers = (workers > 0 ? workers : DKIMF_ENG_DEFWORKERS);
+	eng_timeout = (timeout > 0 ? timeout : DKIMF_ENG_DEFTIMEOUT);
+
+	if (eng_lfd == -1)
+	{
+		eng_lfd = dkimf_socket_listen(sockspec, DKIMF_ENG_BACKLOG,
+		                              FALSE, FALSE, eng_path,
+		                              sizeof eng_path, err, errlen);
+		if (eng_lfd == -1)
+			return MI_FAILURE;
+	}
+
+	flags = fcntl(eng_lfd, F_GETFL, 0);
+	if (flags == -1 || fcntl(eng_lfd, F_SETFL, flags | O_NONBLOCK) == -1)
+	{
+		snprintf(err, errlen, "fcntl(): %s", strerror(errno));
+		(void) close(eng_lfd);
+		eng_lfd = -1;
+		return MI_FAILURE;
+	}
+
+	eng_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (eng_epfd == -1)
+	{
+		snprintf(err, errlen, "epoll_create1(): %s", strerror(errno));
+		(void) close(eng_lfd);
+		eng_lfd = -1;
+		return MI_FAILURE;
+	}
+
+	memset(&ev, '\0', sizeof ev);
+	ev.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+	/* don't wake every process sharing the listener for each connection */
+	if (eng_shared)
+		ev.events |= EPOLLEXCLUSIVE;
+#endif /* EPOLLEXCLUSIVE */
+	ev.data.ptr = NULL;
+	if (epoll_ctl(eng_epfd, EPOLL_CTL_ADD, eng_lfd, &ev) != 0)
+	{
+		snprintf(err, errlen, "epoll_ctl(): %s", strerror(errno));
+		(void) close(eng_epfd);
+		(void) close(eng_lfd);
+		eng_epfd = -1;
+		eng_lfd = -1;
+		return MI_FAILURE;
+	}
+
+	return MI_SUCCESS;
+}
+
+/*
+**  DKIMF_ENGINE_SETLISTENER -- supply an already-open listening socket
+**
+**  Parameters:
+**  	fd -- listening socket
+**  	shared -- TRUE iff other processes accept on the same socket
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Called before dkimf_engine_init(), which then uses "fd" rather than
+**  	opening the socket it is given.  The caller remains responsible for
+**  	removing a UNIX socket's path.
+*/
+
+void
+dkimf_engine_setlistener(int fd, _Bool shared)
+{
+	assert(fd >= 0);
+
+	eng_lfd = fd;
+	eng_shared = shared;
+	eng_path[0] = '\0';
+}
+
+/*
+**  DKIMF_ENGINE_MAIN -- run the event engine
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	MI_SUCCESS or MI_FAILURE.
+**
+**  Notes:
+**  	Like smfi_main(), this returns only once the filter is told to
+**  	stop.  The calling thread waits for input on every connection; when
+**  	a connection has something to say it is handed to a worker, which
+**  	runs the filter's callbacks and returns it when it goes quiet.  Idle
+**  	connections thus cost a descriptor and some memory, not a thread.
+*/
+
+int
+dkimf_engine_main(void)
+{
+	int c;
+	int n;
+	int status;
+	time_t now;
+	time_t lastexpire;
+	pthread_t sigthread;
+	struct engconn *ec;
+	struct epoll_event events[DKIMF_ENG_EVENTS];
+
+	assert(eng_epfd != -1);
+
+	status = pthread_create(&sigthread, NULL, dkimf_engine_signals, NULL);
+	if (status != 0)
+	{
+		syslog(LOG_ERR, "event engine: pthread_create(): %s",
+		       strerror(status));
+		return MI_FAILURE;
+	}
+
+	eng_workers = (pthread_t *) calloc(eng_nworkers, sizeof(pthread_t));
+	if (eng_workers == NULL)
+	{
+		syslog(LOG_ERR, "event engine: calloc(): %s", strerror(errno));
+		return MI_FAILURE;
+	}
+
+	for (c = 0; c < eng_nworkers; c++)
+	{
+		status = pthread_create(&eng_workers[c], NULL,
+		                        dkimf_engine_worker, NULL);
+		if (status != 0)
+		{
+			syslog(LOG_ERR, "event engine: pthread_create(): %s",
+			       strerror(status));
+			eng_nworkers = c;
+			dkimf_engine_stop();
+			break;
+		}
+	}
+
+	lastexpire = time(NULL);
+
+	while (!eng_die)
+	{
+		n = epoll_wait(eng_epfd, events, DKIMF_ENG_EVENTS, 1000);
+		if (n == -1 && errno != EINTR)
+		{
+			syslog(LOG_ERR, "event engine: epoll_wait(): %s",
+			       strerror(errno));
+			dkimf_engine_stop();
+			break;
+		}
+
+		for (c = 0; c < n; c++)
+		{
+			if (events[c].data.ptr == NULL)
+				dkimf_engine_accept();
+			else
+				dkimf_engine_enqueue((struct engconn *) events[c].data.ptr);
+		}
+
+		now = time(NULL);
+		if (now != lastexpire)
+		{
+			dkimf_engine_expire(now);
+			lastexpire = now;
+		}
+	}
+
+	/* stop listening, let the workers finish, then drop the rest */
+	(void) close(eng_lfd);
+	eng_lfd = -1;
+	if (eng_path[0] != '\0')
+		(void) unlink(eng_path);
+
+	pthread_mutex_lock(&eng_qlock);
+	pthread_cond_broadcast(&eng_qcond);
+	pthread_mutex_unlock(&eng_qlock);
+
+	for (c = 0; c < eng_nworkers; c++)
+		(void) pthread_join(eng_workers[c], NULL);
+	free(eng_workers);
+	eng_workers = NULL;
+
+	while ((ec = eng_conns) != NULL)
+		dkimf_engine_free(ec);
+
+	(void) close(eng_epfd);
+	eng_epfd = -1;
+
+	return MI_SUCCESS;
+}
+
+/*
+**  DKIMF_ENGINE_STOP -- ask dkimf_engine_main() to return
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	None.
+*/
+
+void
+dkimf_engine_stop(void)
+{
+	pthread_mutex_lock(&eng_qlock);
+	eng_die = TRUE;
+	pthread_cond_broadcast(&eng_qcond);
+	pthread_mutex_unlock(&eng_qlock);
+}
+
+/*
+**  DKIMF_ENGINE_GETPRIV -- equivalent of smfi_getpriv()
+**
+**  Parameters:
+**  	ctx -- milter context
+**
+**  Return value:
+**  	The private pointer stored by dkimf_engine_setpriv().
+*/
+
+void *
+dkimf_engine_getpriv(SMFICTX *ctx)
+{
+	return dkimf_engine_conn(ctx)->ec_priv;
+}
+
+/*
+**  DKIMF_ENGINE_SETPRIV -- equivalent of smfi_setpriv()
+**
+**  Parameters:
+**  	ctx -- milter context
+**  	ptr -- pointer to store
+**
+**  Return value:
+**  	MI_SUCCESS.
+*/
+
+int
+dkimf_engine_setpriv(SMFICTX *ctx, void *ptr)
+{
+	dkimf_engine_conn(ctx)->ec_priv = ptr;
+
+	return MI_SUCCESS;
+}
+
+/*
+**  DKIMF_ENGINE_MACRONAME -- compare macro names, ignoring braces
+**
+**  Parameters:
+**  	a, b -- names to compare
+**
+**  Return value:
+**  	TRUE iff they name the same macro ("i" and "{i}" do).
+*/
+
+static _Bool
+dkimf_engine_macroname(const char *a, const char *b)
+{
+	size_t alen;
+	size_t blen;
+
+	alen = strlen(a);
+	blen = strlen(b);
+
+	if (alen > 2 && a[0] == '{' && a[alen - 1] == '}')
+	{
+		a++;
+		alen -= 2;
+	}
+
+	if (blen > 2 && b[0] == '{' && b[blen - 1] == '}')
+	{
+		b++;
+		blen -= 2;
+	}
+
+	return (alen == blen && strncmp(a, b, alen) == 0);
+}
+
+/*
+**  DKIMF_ENGINE_GETSYMVAL -- equivalent of smfi_getsymval()
+**
+**  Parameters:
+**  	ctx -- milter context
+**  	sym -- macro name
+**
+**  Return value:
+**  	The macro's most recently received value, or NULL.
+*/
+
+char *
+dkimf_engine_getsymval(SMFICTX *ctx, char *sym)
+{
+	int c;
+	size_t off;
+	char *mac;
+	char *val;
+	struct engconn *ec;
+
+	assert(sym != NULL);
+
+	ec = dkimf_engine_conn(ctx);
+
+	for (c = 0; c < sizeof eng_macorder / sizeof eng_macorder[0]; c++)
+	{
+		mac = ec->ec_macros[eng_macorder[c]];
+		if (mac == NULL)
+			continue;
+
+		for (off = 0; off < ec->ec_maclen[eng_macorder[c]]; )
+		{
+			val = mac + off + strlen(mac + off) + 1;
+			if (val >= mac + ec->ec_maclen[eng_macorder[c]])
+				break;
+
+			if (dkimf_engine_macroname(mac + off, sym))
+				return val;
+
+			off = (val - mac) + strlen(val) + 1;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+**  DKIMF_ENGINE_SETSYMLIST -- equivalent of smfi_setsymlist()
+**
+**  Parameters:
+**  	ctx -- milter context
+**  	where -- protocol stage (an SMFIM_* constant)
+**  	macros -- space-separated macro names
+**
+**  Return value:
+**  	MI_SUCCESS or MI_FAILURE.
+**
+**  Notes:
+**  	Only valid during negotiation.
+*/
+
+int
+dkimf_engine_setsymlist(SMFICTX *ctx, int where, char *macros)
+{
+	struct engconn *ec;
+
+	ec = dkimf_engine_conn(ctx);
+
+	if (!ec->ec_innegotiate || macros == NULL ||
+	    where < SMFIM_FIRST || where > SMFIM_LAST ||
+	    ec->ec_symlist[where] != NULL)
+		return MI_FAILURE;
+
+	ec->ec_symlist[where] = strdup(macros);
+
+	return (ec->ec_symlist[where] == NULL ? MI_FAILURE : MI_SUCCESS);
+}
+
+/*
+**  DKIMF_ENGINE_SETREPLY -- equivalent of smfi_setreply()
+**
+**  Parameters:
+**  	ctx -- milter context
+**  	rcode -- SMTP reply code
+**  	xcode -- enhanced status code (or NULL)
+**  	replytxt -- reply text (or NULL)
+**
+**  Return value:
+**  	MI_SUCCESS or MI_FAILURE.
+*/
+
+int
+dkimf_engine_setreply(SMFICTX *ctx, char *rcode, char *xcode, char *replytxt)
+{
+	size_t len;
+	struct engconn *ec;
+
+	ec = dkimf_engine_conn(ctx);
+
+	if (rcode == NULL || strlen(rcode) != 3 ||
+	    (rcode[0] != '4' && rcode[0] != '5') ||
+	    !isdigit((u_char) rcode[1]) || !isdigit((u_char) rcode[2]))
+		return MI_FAILURE;
+
+	len = strlen(rcode) + 1;
+	if (xcode != NULL)
+		len += strlen(xcode) + 1;
+	if (replytxt != NULL)
+		len += strlen(replytxt) + 1;
+
+	free(ec->ec_reply);
+	ec->ec_reply = malloc(len);
+	if (ec->ec_reply == NULL)
+		return MI_FAILURE;
+
+	strlcpy(ec->ec_reply, rcode, len);
+	if (xcode != NULL)
+	{
+		strlcat(ec->ec_reply, " ", len);
+		strlcat(ec->ec_reply, xcode, len);
+	}
+	if (replytxt != NULL)
+	{
+		strlcat(ec->ec_reply, " ", len);
+		strlcat(ec->ec_reply, replytxt, len);
+	}
+
+	return MI_SUCCESS;
+}
+
+/*
+**  DKIMF_ENGINE_MODIFY -- check that a modification is allowed
+**
+**  Parameters:
+**  	ec -- connection
+**  	action -- SMFIF_* flag the modification needs
+**
+**  Return value:
+**  	TRUE iff it was negotiated and we're in end-of-message.
+*/
+
+static _Bool
+dkimf_engine_modify(struct engconn *ec, unsigned long action)
+{
+	return (ec->ec_ineom && (ec->ec_actions & action) == action);
+}
+
+/*
+**  DKIMF_ENGINE_ADDHEADER -- equivalent of smfi_addheader()
+**
+**  Parameters:
+**  	ctx -- milter context
+**  	hname -- header field name
+**  	hvalue -- header field value
+**
+**  Return value:
+**  	MI_SUCCESS or MI_FAILURE.
+*/
+
+int
+dkimf_engine_addheader(SMFICTX *ctx, char *hname, char *hvalue)
+{
+	struct engconn *ec;
+
+	ec = dkimf_engine_conn(ctx);
+
+	if (hname == NULL || hvalue == NULL ||
+	    !dkimf_engine_modify(ec, SMFIF_ADDHDRS))
+		return MI_FAILURE;
+
+	return dkimf_engine_sendstr(ec, SMFIR_ADDHEADER, -1, hname, hvalue);
+}
+
+/*
+**  DKIMF_ENGINE_INSHEADER -- equivalent of smfi_insheader()
+**
+**  Parameters:
+**  	ctx -- milter context
+**  	idx -- index at which to insert
+**  	hname -- header field name
+**  	hvalue -- header field value
+**
+**  Return value:
+**  	MI_SUCCESS or MI_FAILURE.
+*/
+
+int
+dkimf_engine_insheader(SMFICTX *ctx, int idx, char *hname, char *hvalue)
+{
+	struct engconn *ec;
+
+	ec = dkimf_engine_conn(ctx);
+
+	if (hname == NULL || hvalue == NULL || idx < 0 ||
+	    !dkimf_engine_modify(ec, SMFIF_ADDHDRS))
+		return MI_FAILURE;
+
+	return dkimf_engine_sendstr(ec, SMFIR_INSHEADER, idx, hname, hvalue);
+}
+
+/*
+**  DKIMF_ENGINE_CHGHEADER -- equivalent of smfi_chgheader()
+**
+**  Parameters:
+**  	ctx -- milter context
+**  	hname -- header field name
+**  	idx -- which instance of the field to change (from 1)
+**  	hvalue -- new value, or NULL to delete the field
+**
+**  Return value:
+**  	MI_SUCCESS or MI_FAILURE.
+*/
+
+int
+dkimf_engine_chgheader(SMFICTX *ctx, char *hname, int idx, char *hvalue)
+{
+	struct engconn *ec;
+
+	ec = dkimf_engine_conn(ctx);
+
+	if (hname == NULL || idx < 0 ||
+	    !dkimf_engine_modify(ec, SMFIF_CHGHDRS))
+		return MI_FAILURE;
+
+	return dkimf_engine_sendstr(ec, SMFIR_CHGHEADER, idx, hname,
+	                            hvalue == NULL ? "" : hvalue);
+}
+
+/*
+**  DKIMF_ENGINE_ADDRCPT -- equivalent of smfi_addrcpt()
+**
+**  Parameters:
+**  	ctx -- milter context
+**  	addr -- recipient to add
+**
+**  Return value:
+**  	MI_SUCCESS or MI_FAILURE.
+*/
+
+int
+dkimf_engine_addrcpt(SMFICTX *ctx, char *addr)
+{
+	struct engconn *ec;
+
+	ec = dkimf_engine_conn(ctx);
+
+	if (addr == NULL || !dkimf_engine_modify(ec, SMFIF_ADDRCPT))
+		return MI_FAILURE;
+
+	return dkimf_engine_sendstr(ec, SMFIR_ADDRCPT, -1, addr, NULL);
+}
+
+/*
+**  DKIMF_ENGINE_DELRCPT -- equivalent of smfi_delrcpt()
+**
+**  Parameters:
+**  	ctx -- milter context
+**  	addr -- recipient to remove
+**
+**  Return value:
+**  	MI_SUCCESS or MI_FAILURE.
+*/
+
+int
+dkimf_engine_delrcpt(SMFICTX *ctx, char *addr)
+{
+	struct engconn *ec;
+
+	ec = dkimf_engine_conn(ctx);
+
+	if (addr == NULL || !dkimf_engine_modify(ec, SMFIF_DELRCPT))
+		return MI_FAILURE;
+
+	return dkimf_engine_sendstr(ec, SMFIR_DELRCPT, -1, addr, NULL);
+}
+
+/*
+**  DKIMF_ENGINE_QUARANTINE -- equivalent of smfi_quarantine()
+**
+**  Parameters:
+**  	ctx -- milter context
+**  	reason -- quarantine reason
+**
+**  Return value:
+**  	MI_SUCCESS or MI_FAILURE.
+*/
+
+int
+dkimf_engine_quarantine(SMFICTX *ctx, char *reason)
+{
+	struct engconn *ec;
+
+	ec = dkimf_engine_conn(ctx);
+
+	if (reason == NULL || reason[0] == '\0' ||
+	    !dkimf_engine_modify(ec, SMFIF_QUARANTINE))
+		return MI_FAILURE;
+
+	return dkimf_engine_sendstr(ec, SMFIR_QUARANTINE, -1, reason, NULL);
+}
+
+/*
+**  DKIMF_ENGINE_PROGRESS -- equivalent of smfi_progress()
+**
+**  Parameters:
+**  	ctx -- milter context
+**
+**  Return value:
+**  	MI_SUCCESS or MI_FAILURE.
+*/
+
+int
+dkimf_engine_progress(SMFICTX *ctx)
+{
+	struct engconn *ec;
+
+	ec = dkimf_engine_conn(ctx);
+
+	if (!ec->ec_ineom)
+		return MI_FAILURE;
+
+	return dkimf_engine_send(ec, SMFIR_PROGRESS, NULL, 0) ? MI_SUCCESS
+	                                                      : MI_FAILURE;
+}
+
+#endif /* _FFR_EVENT_ENGINE */
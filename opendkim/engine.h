@@ -0,0 +1,40 @@
+/*
+**  Copyright 2025 OpenDKIM contributors.
+*/
+
+#ifndef _ENGINE_H_
+#define _ENGINE_H_
+
+#include "build-config.h"
+
+/* system includes */
+#include <sys/types.h>
+
+/* libmilter includes */
+#include <libmilter/mfapi.h>
+
+/* macros */
+#define	DKIMF_ENG_BACKLOG	256		/* listen() backlog */
+#define	DKIMF_ENG_DEFWORKERS	16		/* default worker threads */
+#define	DKIMF_ENG_DEFTIMEOUT	7210		/* default idle timeout (s) */
+
+/* prototypes */
+extern int dkimf_engine_addheader(SMFICTX *, char *, char *);
+extern int dkimf_engine_addrcpt(SMFICTX *, char *);
+extern int dkimf_engine_chgheader(SMFICTX *, char *, int, char *);
+extern int dkimf_engine_delrcpt(SMFICTX *, char *);
+extern void *dkimf_engine_getpriv(SMFICTX *);
+extern char *dkimf_engine_getsymval(SMFICTX *, char *);
+extern int dkimf_engine_init(struct smfiDesc *, char *, int, int,
+                             char *, size_t);
+extern int dkimf_engine_insheader(SMFICTX *, int, char *, char *);
+extern int dkimf_engine_main(void);
+extern int dkimf_engine_progress(SMFICTX *);
+extern int dkimf_engine_quarantine(SMFICTX *, char *);
+extern void dkimf_engine_setlistener(int, _Bool);
+extern int dkimf_engine_setpriv(SMFICTX *, void *);
+extern int dkimf_engine_setreply(SMFICTX *, char *, char *, char *);
+extern int dkimf_engine_setsymlist(SMFICTX *, int, char *);
+extern void dkimf_engine_stop(void);
+
+#endif /* _ENGINE_H_ */
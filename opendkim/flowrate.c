@@ -15,6 +15,8 @@
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <ctype.h>
 
 /* libbsd if found */
 #ifdef USE_BSD_H
@@ -30,6 +32,20 @@
 #include "flowrate.h"
 #include "opendkim.h"
 #include "opendkim-db.h"
+#include "util.h"
+
+/* macros */
+#define	DKIMF_RATE_SHARDS	64
+#define	DKIMF_RATE_BUCKETS	256
+#define	DKIMF_RATE_NOLIMIT	UINT_MAX
+
+#define	DKIMF_RATE_ATOMIC_INC(x)	__sync_add_and_fetch(&(x), 1)
+#define	DKIMF_RATE_ATOMIC_DEC(x)	__sync_sub_and_fetch(&(x), 1)
+#define	DKIMF_RATE_ATOMIC_GET(x)	__sync_add_and_fetch(&(x), 0)
+#define	DKIMF_RATE_ATOMIC_LOAD(x)	__atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define	DKIMF_RATE_ATOMIC_STORE(x,v)	__atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#define	DKIMF_RATE_ATOMIC_SET(x,v)	(void) __sync_lock_test_and_set(&(x), (v))
+#define	DKIMF_RATE_ATOMIC_CAS(x,o,n)	__sync_bool_compare_and_swap(&(x), (o), (n))
 
 /* DATA TYPES */
 struct flowdata
@@ -39,110 +55,746 @@ struct flowdata
 	unsigned int	fd_count;
 };
 
+/*
+**  FLOWENTRY -- in-memory flow counter for one domain
+**
+**  Entries are only ever added at the head of a bucket chain (under the
+**  shard lock) so readers can walk the chains without locking.  Counts,
+**  window starts, limits and the dirty flag are updated with atomic
+**  operations.  A domain with no limit caches DKIMF_RATE_NOLIMIT, so
+**  the limit is always read and written as a single word.
+*/
+
+struct flowentry
+{
+	unsigned int		fe_dirty;	/* changed since checkpoint */
+	unsigned int		fe_limit;	/* cached limit */
+	unsigned int		fe_count;	/* messages in this window */
+	unsigned int		fe_hash;	/* hash of fe_domain */
+	unsigned int		fe_retired;	/* epoch in which unlinked */
+	int			fe_ttl;		/* window length */
+	time_t			fe_since;	/* window start */
+	DKIMF_DB		fe_ratedb;	/* where fe_limit came from */
+	struct flowentry *	fe_next;	/* bucket chain */
+	char *			fe_domain;	/* domain (lowercase) */
+};
+
+/*
+**  FLOWSHARD -- one stripe of the flow counter table
+**
+**  Lock-free readers register against the shard's current epoch.  The
+**  checkpoint thread advances the epoch once nobody is left from the
+**  one before it, so an entry unlinked in epoch N can't be seen by
+**  anyone once the epoch reaches N + 2 and is freed then.  This doesn't
+**  depend on the shard ever being idle.
+*/
+
+struct flowshard
+{
+	unsigned int		fs_epoch;	/* current epoch */
+	unsigned int		fs_readers[2];	/* walkers, by epoch parity */
+	pthread_mutex_t		fs_lock;	/* insertion/unlink lock */
+	struct flowentry *	fs_retired;	/* unlinked, newest first */
+	struct flowentry *	fs_buckets[DKIMF_RATE_BUCKETS];
+};
+
 /* GLOBALS */
-pthread_mutex_t ratelock;
+pthread_mutex_t ratelock;			/* checkpoint state */
+
+static pthread_once_t rate_once = PTHREAD_ONCE_INIT;
+static _Bool rate_die;				/* checkpointer shutdown */
+static _Bool rate_running;			/* checkpointer started */
+static unsigned int rate_interval;		/* checkpoint interval */
+static pthread_t rate_thread;			/* checkpointer thread */
+static pthread_cond_t rate_cond;		/* checkpointer wakeup */
+static DKIMF_DB rate_flowdb;			/* checkpoint target */
+static struct flowshard rate_shards[DKIMF_RATE_SHARDS];
 
 /*
-**  DKIMF_RATE_CHECK -- conduct a rate limit check, expire data, increment
+**  DKIMF_RATE_SETUP -- one-time initialization of the flow counter table
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_rate_setup(void)
+{
+	int c;
+
+	for (c = 0; c < DKIMF_RATE_SHARDS; c++)
+		(void) pthread_mutex_init(&rate_shards[c].fs_lock, NULL);
+
+	(void) pthread_mutex_init(&ratelock, NULL);
+	(void) pthread_cond_init(&rate_cond, NULL);
+}
+
+/*
+**  DKIMF_RATE_HASH -- hash a domain name, case-insensitively
+**
+**  Parameters:
+**  	domain -- domain name to hash
+**
+**  Return value:
+**  	Hash value.
+*/
+
+static unsigned int
+dkimf_rate_hash(const char *domain)
+{
+	unsigned int h = 2166136261U;
+	const unsigned char *p;
+
+	for (p = (const unsigned char *) domain; *p != '\0'; p++)
+	{
+		h ^= tolower(*p);
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+/*
+**  DKIMF_RATE_ENTER -- register as a lock-free reader of a shard
+**
+**  Parameters:
+**  	fs -- shard about to be searched
+**
+**  Return value:
+**  	The epoch registered in, to be passed to dkimf_rate_leave().
+*/
+
+static unsigned int
+dkimf_rate_enter(struct flowshard *fs)
+{
+	unsigned int epoch;
+
+	for (;;)
+	{
+		epoch = DKIMF_RATE_ATOMIC_LOAD(fs->fs_epoch);
+		DKIMF_RATE_ATOMIC_INC(fs->fs_readers[epoch & 1]);
+
+		/* if it moved on meanwhile, we were counted in the wrong one */
+		if (DKIMF_RATE_ATOMIC_LOAD(fs->fs_epoch) == epoch)
+			return epoch;
+
+		DKIMF_RATE_ATOMIC_DEC(fs->fs_readers[epoch & 1]);
+	}
+}
+
+/*
+**  DKIMF_RATE_LEAVE -- unregister a lock-free reader of a shard
+**
+**  Parameters:
+**  	fs -- shard
+**  	epoch -- value returned by dkimf_rate_enter()
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_rate_leave(struct flowshard *fs, unsigned int epoch)
+{
+	DKIMF_RATE_ATOMIC_DEC(fs->fs_readers[epoch & 1]);
+}
+
+/*
+**  DKIMF_RATE_FIND -- find a flow entry without locking
+**
+**  Parameters:
+**  	fs -- shard to search
+**  	domain -- domain to find
+**  	hash -- hash of "domain"
+**
+**  Return value:
+**  	Pointer to the entry, or NULL if not found.
+**
+**  Notes:
+**  	The caller must be registered as a reader of the shard (or hold
+**  	its lock) for as long as the returned pointer is in use.
+*/
+
+static struct flowentry *
+dkimf_rate_find(struct flowshard *fs, const char *domain, unsigned int hash)
+{
+	unsigned int b;
+	struct flowentry *fe;
+
+	b = (hash / DKIMF_RATE_SHARDS) % DKIMF_RATE_BUCKETS;
+	fe = DKIMF_RATE_ATOMIC_LOAD(fs->fs_buckets[b]);
+
+	for (; fe != NULL; fe = DKIMF_RATE_ATOMIC_LOAD(fe->fe_next))
+	{
+		if (fe->fe_hash == hash && strcasecmp(fe->fe_domain, domain) == 0)
+			return fe;
+	}
+
+	return NULL;
+}
+
+/*
+**  DKIMF_RATE_GETLIMIT -- retrieve a domain's limit from the rate data set
 **
 **  Parameters:
-**  	domain -- domain name being queried (or NULL for unsigned mail)
 **  	ratedb -- data set containing per-domain rate limits
-**  	flowdb -- data set containing per-domain flow data (updated)
+**  	domain -- domain to query
 **  	factor -- divisor
-**  	ttl -- TTL to apply (i.e. data expiration)
-**  	limit -- limit for this domain (returned)
+**  	limit -- limit (returned)
 **
 **  Return value:
 **  	-1 -- error
-**  	0 -- success
-**  	1 -- success, and the domain is at or past its limit
+**  	0 -- no limit for this domain ("limit" is DKIMF_RATE_NOLIMIT)
+**  	1 -- limit found
 */
 
-int
-dkimf_rate_check(const char *domain, DKIMF_DB ratedb, DKIMF_DB flowdb,
-                 int factor, int ttl, unsigned int *limit)
+static int
+dkimf_rate_getlimit(DKIMF_DB ratedb, const char *domain, int factor,
+                    unsigned int *limit)
 {
 	_Bool found = FALSE;
 	int status;
+	char *p;
+	struct dkimf_db_data dbd;
+	char limbuf[BUFRSZ];
+
+	memset(limbuf, '\0', sizeof limbuf);
+
+	dbd.dbdata_buffer = limbuf;
+	dbd.dbdata_buflen = sizeof limbuf;
+	dbd.dbdata_flags = 0;
+	status = dkimf_db_get(ratedb, (void *) domain, 0, &dbd, 1, &found);
+	if (status != 0)
+		return -1;
+
+	if (!found)
+	{
+		*limit = DKIMF_RATE_NOLIMIT;
+		return 0;
+	}
+
+	*limit = (unsigned int) strtoul(limbuf, &p, 10) / factor;
+	if (*p != '\0')
+		return -1;
+
+	/* that one is taken */
+	if (*limit == DKIMF_RATE_NOLIMIT)
+		(*limit)--;
+
+	return 1;
+}
+
+/*
+**  DKIMF_RATE_ADD -- create the flow entry for a domain
+**
+**  Parameters:
+**  	fs -- shard to which to add
+**  	domain -- domain being added
+**  	hash -- hash of "domain"
+**  	ratedb -- data set containing per-domain rate limits
+**  	flowdb -- data set containing per-domain flow data
+**  	factor -- divisor
+**  	ttl -- TTL to apply (i.e. data expiration)
+**
+**  Return value:
+**  	Pointer to the (new or existing) entry, or NULL on error.
+**
+**  Notes:
+**  	Previously checkpointed flow data is picked up from "flowdb" so
+**  	counts survive a restart.
+*/
+
+static struct flowentry *
+dkimf_rate_add(struct flowshard *fs, const char *domain, unsigned int hash,
+               DKIMF_DB ratedb, DKIMF_DB flowdb, int factor, int ttl)
+{
+	_Bool found = FALSE;
+	int status;
+	unsigned int b;
 	time_t now;
+	struct flowentry *fe;
 	struct dkimf_db_data dbd;
 	struct flowdata f;
-	char limbuf[BUFRSZ];
 
-	assert(ratedb != NULL);
-	assert(flowdb != NULL);
+	pthread_mutex_lock(&fs->fs_lock);
 
-	if (domain == NULL)
-		domain = ".";
+	/* somebody else might have beaten us to it */
+	fe = dkimf_rate_find(fs, domain, hash);
+	if (fe != NULL)
+	{
+		pthread_mutex_unlock(&fs->fs_lock);
+		return fe;
+	}
 
-	memset(&f, '\0', sizeof f);
+	fe = malloc(sizeof *fe);
+	if (fe == NULL)
+	{
+		pthread_mutex_unlock(&fs->fs_lock);
+		return NULL;
+	}
 
-	pthread_mutex_lock(&ratelock);
+	memset(fe, '\0', sizeof *fe);
+	fe->fe_domain = strdup(domain);
+	if (fe->fe_domain == NULL)
+	{
+		free(fe);
+		pthread_mutex_unlock(&fs->fs_lock);
+		return NULL;
+	}
+	dkimf_lowercase((u_char *) fe->fe_domain);
+	fe->fe_hash = hash;
+	fe->fe_ttl = ttl;
+	fe->fe_ratedb = ratedb;
 
-	/* get the current flow data, if any */
+	/* get the checkpointed flow data, if any */
+	memset(&f, '\0', sizeof f);
 	dbd.dbdata_buffer = (void *) &f;
 	dbd.dbdata_buflen = sizeof f;
 	dbd.dbdata_flags = DKIMF_DB_DATA_BINARY;
 	status = dkimf_db_get(flowdb, (void *) domain, 0, &dbd, 1, &found);
 	if (status != 0)
 	{
-		pthread_mutex_unlock(&ratelock);
-		return -1;
+		free(fe->fe_domain);
+		free(fe);
+		pthread_mutex_unlock(&fs->fs_lock);
+		return NULL;
 	}
 
 	(void) time(&now);
 
-	/* if none or if it expired, retrieve the limit */
-	if (!found || f.fd_since + ttl <= now)
+	if (found && f.fd_since + ttl > now)
+	{
+		fe->fe_since = f.fd_since;
+		fe->fe_limit = f.fd_limit;
+		fe->fe_count = f.fd_count;
+	}
+	else
+	{
+		status = dkimf_rate_getlimit(ratedb, domain, factor,
+		                             &fe->fe_limit);
+		if (status == -1)
+		{
+			free(fe->fe_domain);
+			free(fe);
+			pthread_mutex_unlock(&fs->fs_lock);
+			return NULL;
+		}
+
+		fe->fe_since = now;
+	}
+
+	/* publish it */
+	b = (hash / DKIMF_RATE_SHARDS) % DKIMF_RATE_BUCKETS;
+	fe->fe_next = fs->fs_buckets[b];
+	DKIMF_RATE_ATOMIC_STORE(fs->fs_buckets[b], fe);
+
+	pthread_mutex_unlock(&fs->fs_lock);
+
+	return fe;
+}
+
+/*
+**  DKIMF_RATE_FLUSH -- write dirty flow entries to the flow data set
+**
+**  Parameters:
+**  	flowdb -- data set to update (may be NULL)
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	The caller must hold "ratelock".  Entries whose window expired a
+**  	full TTL ago and which have nothing left to write are unlinked and
+**  	freed two epochs later, when no reader can still be looking at
+**  	them.
+*/
+
+static void
+dkimf_rate_flush(DKIMF_DB flowdb)
+{
+	int c;
+	int b;
+	unsigned int epoch;
+	time_t now;
+	struct flowentry *fe;
+	struct flowentry *next;
+	struct flowentry **prev;
+	struct flowshard *fs;
+	struct flowdata f;
+
+	(void) time(&now);
+
+	for (c = 0; c < DKIMF_RATE_SHARDS; c++)
 	{
-		char *p;
+		fs = &rate_shards[c];
 
-		dbd.dbdata_buffer = limbuf;
-		dbd.dbdata_buflen = sizeof limbuf;
-		dbd.dbdata_flags = 0;
-		status = dkimf_db_get(ratedb, (void *) domain, 0, &dbd, 1,
-		                      &found);
-		if (status != 0)
+		pthread_mutex_lock(&fs->fs_lock);
+
+		/* move on once the previous epoch has drained */
+		epoch = fs->fs_epoch;
+		if (DKIMF_RATE_ATOMIC_GET(fs->fs_readers[(epoch - 1) & 1]) == 0)
 		{
-			pthread_mutex_unlock(&ratelock);
-			return -1;
+			epoch++;
+			DKIMF_RATE_ATOMIC_SET(fs->fs_epoch, epoch);
 		}
-		else if (!found)
+
+		/* release anything nobody can see any more */
+		prev = &fs->fs_retired;
+		while (*prev != NULL && epoch - (*prev)->fe_retired < 2)
+			prev = &(*prev)->fe_next;
+
+		for (fe = *prev; fe != NULL; fe = next)
 		{
-			pthread_mutex_unlock(&ratelock);
-			return 0;
+			next = fe->fe_next;
+			free(fe->fe_domain);
+			free(fe);
 		}
 
-		f.fd_count = 0;
-		f.fd_limit = (unsigned int) strtoul(limbuf, &p, 10) / factor;
-		(void) time(&f.fd_since);
-		if (*p != '\0')
+		*prev = NULL;
+
+		for (b = 0; b < DKIMF_RATE_BUCKETS; b++)
 		{
-			pthread_mutex_unlock(&ratelock);
-			return -1;
+			prev = &fs->fs_buckets[b];
+
+			for (fe = *prev; fe != NULL; fe = next)
+			{
+				next = fe->fe_next;
+
+				if (DKIMF_RATE_ATOMIC_CAS(fe->fe_dirty, 1, 0))
+				{
+					if (flowdb != NULL)
+					{
+						f.fd_since = DKIMF_RATE_ATOMIC_LOAD(fe->fe_since);
+						f.fd_limit = DKIMF_RATE_ATOMIC_LOAD(fe->fe_limit);
+						f.fd_count = DKIMF_RATE_ATOMIC_GET(fe->fe_count);
+
+						(void) dkimf_db_put(flowdb,
+						                    fe->fe_domain,
+						                    strlen(fe->fe_domain),
+						                    &f, sizeof f);
+					}
+
+					prev = &fe->fe_next;
+				}
+				else if (DKIMF_RATE_ATOMIC_LOAD(fe->fe_since) +
+				         2 * DKIMF_RATE_ATOMIC_LOAD(fe->fe_ttl) <= now)
+				{
+					DKIMF_RATE_ATOMIC_STORE(*prev, next);
+					fe->fe_retired = epoch;
+					fe->fe_next = fs->fs_retired;
+					fs->fs_retired = fe;
+				}
+				else
+				{
+					prev = &fe->fe_next;
+				}
+			}
 		}
+
+		pthread_mutex_unlock(&fs->fs_lock);
 	}
+}
 
-	/* increment the count */
-	f.fd_count++;
+/*
+**  DKIMF_RATE_CHECKPOINTER -- flow data checkpoint thread
+**
+**  Parameters:
+**  	vp -- void pointer required by thread API but not used
+**
+**  Return value:
+**  	NULL.
+*/
+
+static void *
+dkimf_rate_checkpointer(/* UNUSED */ void *vp)
+{
+	struct timespec until;
+
+	pthread_mutex_lock(&ratelock);
+
+	while (!rate_die)
+	{
+		(void) clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += rate_interval;
+
+		while (!rate_die &&
+		       pthread_cond_timedwait(&rate_cond, &ratelock,
+		                              &until) != ETIMEDOUT)
+			continue;
+
+		dkimf_rate_flush(rate_flowdb);
+	}
+
+	pthread_mutex_unlock(&ratelock);
+
+	return NULL;
+}
+
+/*
+**  DKIMF_RATE_INIT -- initialize rate limiting
+**
+**  Parameters:
+**  	interval -- seconds between flow data checkpoints
+**
+**  Return value:
+**  	0 on success, an error code on failure.
+**
+**  Notes:
+**  	Called again on each reload that has FlowData, which starts the
+**  	thread if it isn't already running and otherwise just takes the
+**  	new interval.
+*/
+
+int
+dkimf_rate_init(unsigned int interval)
+{
+	int status;
+
+	(void) pthread_once(&rate_once, dkimf_rate_setup);
 
-	/* write it back out */
-	status = dkimf_db_put(flowdb, (void *) domain, strlen(domain),
-	                      &f, sizeof f);
+	if (interval == 0)
+		interval = DEFFLOWCHECKPOINT;
+
+	if (rate_running)
+	{
+		pthread_mutex_lock(&ratelock);
+		rate_interval = interval;
+		pthread_mutex_unlock(&ratelock);
+		return 0;
+	}
+
+	rate_interval = interval;
+	rate_die = FALSE;
+
+	status = pthread_create(&rate_thread, NULL, dkimf_rate_checkpointer,
+	                        NULL);
 	if (status != 0)
+		return status;
+
+	rate_running = TRUE;
+
+	return 0;
+}
+
+/*
+**  DKIMF_RATE_RELEASE -- forget about data sets that are being closed
+**
+**  Parameters:
+**  	ratedb -- rate limit data set that is about to be closed (or NULL)
+**  	flowdb -- flow data set that is about to be closed (or NULL)
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Must be called before data sets that were passed to
+**  	dkimf_rate_check() are closed.  Pending counts are checkpointed
+**  	to "flowdb", and limits taken from "ratedb" are re-read from
+**  	whichever rate data set is used next for the same domain, so a
+**  	reload applies new limits (or their absence) at once.
+*/
+
+void
+dkimf_rate_release(DKIMF_DB ratedb, DKIMF_DB flowdb)
+{
+	int c;
+	int b;
+	struct flowentry *fe;
+	struct flowshard *fs;
+
+	(void) pthread_once(&rate_once, dkimf_rate_setup);
+
+	if (flowdb != NULL && rate_running)
 	{
+		pthread_mutex_lock(&ratelock);
+
+		if (rate_flowdb == flowdb)
+		{
+			dkimf_rate_flush(flowdb);
+			rate_flowdb = NULL;
+		}
+
 		pthread_mutex_unlock(&ratelock);
-		return -1;
 	}
 
+	if (ratedb == NULL)
+		return;
+
+	for (c = 0; c < DKIMF_RATE_SHARDS; c++)
+	{
+		fs = &rate_shards[c];
+
+		pthread_mutex_lock(&fs->fs_lock);
+
+		for (b = 0; b < DKIMF_RATE_BUCKETS; b++)
+		{
+			for (fe = fs->fs_buckets[b];
+			     fe != NULL;
+			     fe = fe->fe_next)
+			{
+				(void) DKIMF_RATE_ATOMIC_CAS(fe->fe_ratedb,
+				                             ratedb, NULL);
+			}
+		}
+
+		pthread_mutex_unlock(&fs->fs_lock);
+	}
+}
+
+/*
+**  DKIMF_RATE_SHUTDOWN -- stop the checkpoint thread
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	None.
+*/
+
+void
+dkimf_rate_shutdown(void)
+{
+	if (!rate_running)
+		return;
+
+	pthread_mutex_lock(&ratelock);
+	rate_die = TRUE;
+	pthread_cond_signal(&rate_cond);
 	pthread_mutex_unlock(&ratelock);
 
+	(void) pthread_join(rate_thread, NULL);
+
+	rate_running = FALSE;
+}
+
+/*
+**  DKIMF_RATE_CHECK -- conduct a rate limit check, expire data, increment
+**
+**  Parameters:
+**  	domain -- domain name being queried (or NULL for unsigned mail)
+**  	ratedb -- data set containing per-domain rate limits
+**  	flowdb -- data set containing per-domain flow data (checkpointed)
+**  	factor -- divisor
+**  	ttl -- TTL to apply (i.e. data expiration)
+**  	limit -- limit for this domain (returned)
+**
+**  Return value:
+**  	-1 -- error
+**  	0 -- success
+**  	1 -- success, and the domain is at or past its limit
+**
+**  Notes:
+**  	Counts are kept in memory and written to "flowdb" by the
+**  	checkpoint thread; limits are re-read from "ratedb" when a
+**  	domain's window expires or when "ratedb" isn't the data set they
+**  	came from (i.e. after a reload).  Once a domain has been seen, no
+**  	lock is taken here.
+*/
+
+int
+dkimf_rate_check(const char *domain, DKIMF_DB ratedb, DKIMF_DB flowdb,
+                 int factor, int ttl, unsigned int *limit)
+{
+	_Bool refresh = FALSE;
+	int ret;
+	unsigned int count;
+	unsigned int epoch;
+	unsigned int hash;
+	unsigned int lim;
+	time_t now;
+	time_t since;
+	DKIMF_DB from;
+	struct flowentry *fe;
+	struct flowshard *fs;
+
+	assert(ratedb != NULL);
+	assert(flowdb != NULL);
+
+	if (domain == NULL)
+		domain = ".";
+
+	(void) pthread_once(&rate_once, dkimf_rate_setup);
+
+	/* make sure the checkpointer knows where to write */
+	if (rate_running && rate_flowdb != flowdb)
+	{
+		pthread_mutex_lock(&ratelock);
+		rate_flowdb = flowdb;
+		pthread_mutex_unlock(&ratelock);
+	}
+
+	hash = dkimf_rate_hash(domain);
+	fs = &rate_shards[hash % DKIMF_RATE_SHARDS];
+
+	epoch = dkimf_rate_enter(fs);
+
+	fe = dkimf_rate_find(fs, domain, hash);
+	if (fe == NULL)
+	{
+		fe = dkimf_rate_add(fs, domain, hash, ratedb, flowdb,
+		                    factor, ttl);
+		if (fe == NULL)
+		{
+			dkimf_rate_leave(fs, epoch);
+			return -1;
+		}
+	}
+
+	/* if the window expired, start a new one with a fresh limit */
+	(void) time(&now);
+	since = DKIMF_RATE_ATOMIC_LOAD(fe->fe_since);
+	if (since + ttl <= now &&
+	    DKIMF_RATE_ATOMIC_CAS(fe->fe_since, since, now))
+	{
+		DKIMF_RATE_ATOMIC_SET(fe->fe_count, 0);
+		DKIMF_RATE_ATOMIC_SET(fe->fe_ttl, ttl);
+		refresh = TRUE;
+	}
+
+	/* if the limit came from another configuration, it's stale */
+	from = DKIMF_RATE_ATOMIC_LOAD(fe->fe_ratedb);
+	if (from != ratedb &&
+	    DKIMF_RATE_ATOMIC_CAS(fe->fe_ratedb, from, ratedb))
+		refresh = TRUE;
+
+	if (refresh)
+	{
+		ret = dkimf_rate_getlimit(ratedb, domain, factor, &lim);
+		if (ret == -1)
+		{
+			/* make the next caller try again */
+			(void) DKIMF_RATE_ATOMIC_CAS(fe->fe_ratedb, ratedb, NULL);
+			dkimf_rate_leave(fs, epoch);
+			return -1;
+		}
+
+		DKIMF_RATE_ATOMIC_SET(fe->fe_limit, lim);
+		if (ret == 1)
+			DKIMF_RATE_ATOMIC_SET(fe->fe_dirty, 1);
+	}
+
+	lim = DKIMF_RATE_ATOMIC_LOAD(fe->fe_limit);
+	if (lim == DKIMF_RATE_NOLIMIT)
+	{
+		dkimf_rate_leave(fs, epoch);
+		return 0;
+	}
+
+	/* increment the count */
+	count = DKIMF_RATE_ATOMIC_INC(fe->fe_count);
+	if (!DKIMF_RATE_ATOMIC_LOAD(fe->fe_dirty))
+		DKIMF_RATE_ATOMIC_SET(fe->fe_dirty, 1);
+
+	dkimf_rate_leave(fs, epoch);
+
 	/* copy the limit out */
 	if (limit != NULL)
-		*limit = f.fd_limit;
+		*limit = lim;
 
-	return (f.fd_count >= f.fd_limit ? 1 : 0);
+	return (count >= lim ? 1 : 0);
 }
 
 #endif /* _FFR_RATE_LIMIT */
@@ -17,5 +17,8 @@
 /* prototypes */
 extern int dkimf_rate_check(const char *, DKIMF_DB, DKIMF_DB, int, int,
                                  unsigned int *);
+extern int dkimf_rate_init(unsigned int);
+extern void dkimf_rate_release(DKIMF_DB, DKIMF_DB);
+extern void dkimf_rate_shutdown(void);
 
 #endif /* _FLOWRATE_H_ */
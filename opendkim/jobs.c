@@ -0,0 +1,317 @@
+/*
+**  Copyright 2025 OpenDKIM contributors.
+*/
+
+#include "build-config.h"
+
+/* system includes */
+#include <sys/param.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+
+/* opendkim includes */
+#include "jobs.h"
+#include "opendkim.h"
+
+/* GLOBALS */
+static _Bool jobs_die;				/* pool shutdown */
+static unsigned int jobs_nthreads;		/* pool threads running */
+static struct dkimf_job *jobs_head;		/* queue head */
+static struct dkimf_job *jobs_tail;		/* queue tail */
+static pthread_t jobs_threads[DKIMF_JOBS_MAX];	/* pool threads */
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+**  DKIMF_JOBS_TAKE -- remove a job from the queue
+**
+**  Parameters:
+**  	set -- take only a job from this set; NULL means any job
+**
+**  Return value:
+**  	The job, or NULL if there was none.
+**
+**  Notes:
+**  	Caller must hold jobs_lock.
+*/
+
+static struct dkimf_job *
+dkimf_jobs_take(struct dkimf_jobset *set)
+{
+	struct dkimf_job *job;
+	struct dkimf_job *prev = NULL;
+
+	for (job = jobs_head; job != NULL; job = job->job_next)
+	{
+		if (set == NULL || job->job_set == set)
+			break;
+		prev = job;
+	}
+
+	if (job == NULL)
+		return NULL;
+
+	if (prev == NULL)
+		jobs_head = job->job_next;
+	else
+		prev->job_next = job->job_next;
+	if (jobs_tail == job)
+		jobs_tail = prev;
+
+	job->job_next = NULL;
+
+	return job;
+}
+
+/*
+**  DKIMF_JOBS_RUN -- run a job and account for it in its set
+**
+**  Parameters:
+**  	job -- job to run
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Called and returns with jobs_lock held; drops it while the job
+**  	runs.  The set can go away as soon as the lock is released after
+**  	its last job is counted, so it isn't touched after that.
+*/
+
+static void
+dkimf_jobs_run(struct dkimf_job *job)
+{
+	struct dkimf_jobset *set;
+
+	set = job->job_set;
+
+	pthread_mutex_unlock(&jobs_lock);
+
+	job->job_func(job->job_arg);
+
+	pthread_mutex_lock(&jobs_lock);
+
+	assert(set->js_pending > 0);
+	set->js_pending--;
+	if (set->js_pending == 0)
+		pthread_cond_signal(&set->js_cond);
+}
+
+/*
+**  DKIMF_JOBS_WORKER -- pool thread
+**
+**  Parameters:
+**  	arg -- unused
+**
+**  Return value:
+**  	NULL.
+*/
+
+static void *
+dkimf_jobs_worker(void *arg)
+{
+	struct dkimf_job *job;
+
+	pthread_mutex_lock(&jobs_lock);
+
+	for (;;)
+	{
+		while (!jobs_die && jobs_head == NULL)
+			pthread_cond_wait(&jobs_cond, &jobs_lock);
+
+		if (jobs_die)
+			break;
+
+		job = dkimf_jobs_take(NULL);
+		if (job != NULL)
+			dkimf_jobs_run(job);
+	}
+
+	pthread_mutex_unlock(&jobs_lock);
+
+	return NULL;
+}
+
+/*
+**  DKIMF_JOBS_NEWSET -- prepare a set of jobs
+**
+**  Parameters:
+**  	set -- set to prepare
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Every set that is prepared must be passed to dkimf_jobs_wait(),
+**  	even if no jobs were added to it.
+*/
+
+void
+dkimf_jobs_newset(struct dkimf_jobset *set)
+{
+	assert(set != NULL);
+
+	set->js_pending = 0;
+	pthread_cond_init(&set->js_cond, NULL);
+}
+
+/*
+**  DKIMF_JOBS_ADD -- add a job to a set and queue it for the pool
+**
+**  Parameters:
+**  	set -- set to add it to
+**  	job -- storage for the job
+**  	func -- work to do
+**  	arg -- argument to pass to "func"
+**
+**  Return value:
+**  	None.
+*/
+
+void
+dkimf_jobs_add(struct dkimf_jobset *set, struct dkimf_job *job,
+               void (*func)(void *), void *arg)
+{
+	assert(set != NULL);
+	assert(job != NULL);
+	assert(func != NULL);
+
+	job->job_func = func;
+	job->job_arg = arg;
+	job->job_set = set;
+	job->job_next = NULL;
+
+	pthread_mutex_lock(&jobs_lock);
+
+	set->js_pending++;
+
+	if (jobs_tail == NULL)
+		jobs_head = job;
+	else
+		jobs_tail->job_next = job;
+	jobs_tail = job;
+
+	if (jobs_nthreads > 0)
+		pthread_cond_signal(&jobs_cond);
+
+	pthread_mutex_unlock(&jobs_lock);
+}
+
+/*
+**  DKIMF_JOBS_WAIT -- wait for every job in a set to finish
+**
+**  Parameters:
+**  	set -- set to wait for
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	The caller runs any of the set's jobs that no pool thread has
+**  	picked up yet rather than sitting idle, so a busy (or absent)
+**  	pool costs some overlap but never stalls a message.  The set is
+**  	finished with on return.
+*/
+
+void
+dkimf_jobs_wait(struct dkimf_jobset *set)
+{
+	struct dkimf_job *job;
+
+	assert(set != NULL);
+
+	pthread_mutex_lock(&jobs_lock);
+
+	while ((job = dkimf_jobs_take(set)) != NULL)
+		dkimf_jobs_run(job);
+
+	while (set->js_pending > 0)
+		pthread_cond_wait(&set->js_cond, &jobs_lock);
+
+	pthread_mutex_unlock(&jobs_lock);
+
+	pthread_cond_destroy(&set->js_cond);
+}
+
+/*
+**  DKIMF_JOBS_INIT -- start the pool
+**
+**  Parameters:
+**  	nthreads -- number of pool threads
+**  	err -- error buffer
+**  	errlen -- bytes available at "err"
+**
+**  Return value:
+**  	0 on success, -1 on failure (with "err" updated).
+*/
+
+int
+dkimf_jobs_init(unsigned int nthreads, char *err, size_t errlen)
+{
+	int status;
+	unsigned int c;
+
+	assert(err != NULL);
+
+	if (nthreads > DKIMF_JOBS_MAX)
+	{
+		snprintf(err, errlen, "at most %d threads allowed",
+		         DKIMF_JOBS_MAX);
+		return -1;
+	}
+
+	jobs_die = FALSE;
+
+	for (c = 0; c < nthreads; c++)
+	{
+		status = pthread_create(&jobs_threads[c], NULL,
+		                        dkimf_jobs_worker, NULL);
+		if (status != 0)
+		{
+			snprintf(err, errlen, "pthread_create(): %s",
+			         strerror(status));
+			dkimf_jobs_shutdown();
+			return -1;
+		}
+
+		pthread_mutex_lock(&jobs_lock);
+		jobs_nthreads++;
+		pthread_mutex_unlock(&jobs_lock);
+	}
+
+	return 0;
+}
+
+/*
+**  DKIMF_JOBS_SHUTDOWN -- stop the pool
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Jobs still queued are left for their callers, which run them from
+**  	dkimf_jobs_wait().
+*/
+
+void
+dkimf_jobs_shutdown(void)
+{
+	unsigned int c;
+	unsigned int n;
+
+	pthread_mutex_lock(&jobs_lock);
+	jobs_die = TRUE;
+	n = jobs_nthreads;
+	jobs_nthreads = 0;
+	pthread_cond_broadcast(&jobs_cond);
+	pthread_mutex_unlock(&jobs_lock);
+
+	for (c = 0; c < n; c++)
+		(void) pthread_join(jobs_threads[c], NULL);
+}
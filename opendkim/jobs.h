@@ -0,0 +1,53 @@
+/*
+**  Copyright 2025 OpenDKIM contributors.
+*/
+
+#ifndef _JOBS_H_
+#define _JOBS_H_
+
+#include "build-config.h"
+
+/* system includes */
+#include <sys/types.h>
+#include <pthread.h>
+
+/* macros */
+#define	DKIMF_JOBS_MAX		256		/* most pool threads */
+
+/* data types */
+struct dkimf_jobset;
+
+/*
+**  DKIMF_JOB -- one unit of work handed to the pool
+**
+**  The caller owns the storage; it must stay put until the set it was
+**  added to has been waited on.
+*/
+
+struct dkimf_job
+{
+	void		(*job_func) (void *);	/* work to do */
+	void *		job_arg;		/* its argument */
+	struct dkimf_jobset * job_set;		/* set it belongs to */
+	struct dkimf_job * job_next;		/* queue link */
+};
+
+/*
+**  DKIMF_JOBSET -- jobs a caller waits for together
+*/
+
+struct dkimf_jobset
+{
+	unsigned int	js_pending;		/* jobs not yet finished */
+	pthread_cond_t	js_cond;		/* js_pending reached zero */
+};
+
+/* prototypes */
+extern void dkimf_jobs_add(struct dkimf_jobset *, struct dkimf_job *,
+                           void (*)(void *), void *);
+extern int dkimf_jobs_init(unsigned int, char *, size_t);
+extern void dkimf_jobs_newset(struct dkimf_jobset *);
+extern void dkimf_jobs_shutdown(void);
+extern void dkimf_jobs_wait(struct dkimf_jobset *);
+
+#endif /* _JOBS_H_ */
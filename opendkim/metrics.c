@@ -0,0 +1,947 @@
+/*
+**  Copyright 2025 OpenDKIM contributors.
+*/
+
+#include "build-config.h"
+
+#ifdef _FFR_METRICS
+
+/* system includes */
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <pthread.h>
+#include <errno.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+/* opendkim includes */
+#include "metrics.h"
+#include "opendkim.h"
+#include "util.h"
+
+/* macros */
+#define	DKIMF_MET_BUCKETS	47		/* 16us to ~134s */
+#define	DKIMF_MET_BACKLOG	16		/* listen() backlog */
+#define	DKIMF_MET_IOTIMEOUT	1000		/* client I/O timeout (ms) */
+
+/*
+**  Each thread only ever writes its own shard, so updates need no lock
+**  or atomic read-modify-write; relaxed stores and loads just keep the
+**  scraper from seeing a torn value.
+*/
+
+#define	DKIMF_MET_ADD(x,n)	__atomic_store_n(&(x), (x) + (n), __ATOMIC_RELAXED)
+#define	DKIMF_MET_GET(x)	__atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define	DKIMF_MET_PUT(x,v)	__atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+#ifndef MAP_ANONYMOUS
+# define MAP_ANONYMOUS		MAP_ANON
+#endif /* ! MAP_ANONYMOUS */
+
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL		0
+#endif /* ! MSG_NOSIGNAL */
+
+/* DATA TYPES */
+struct methist
+{
+	uint64_t	mh_count;
+	uint64_t	mh_sum;			/* microseconds */
+	uint64_t	mh_bucket[DKIMF_MET_BUCKETS];
+};
+
+/*
+**  METSLOT -- one worker process's totals
+**
+**  With several worker processes, each one periodically publishes the
+**  sum of its own shards to its slot in memory shared by all of them, and
+**  the one serving scrapes adds the slots up.  A replacement worker
+**  carries on from the totals its predecessor last published.  Every
+**  member is a uint64_t, so a slot can be walked as an array of them.
+*/
+
+struct metslot
+{
+	uint64_t	msl_count[DKIMF_MET_MAX];
+	struct methist	msl_hist[DKIMF_MET_H_MAX];
+};
+
+#define	DKIMF_MET_WORDS		(sizeof(struct metslot) / sizeof(uint64_t))
+
+/*
+**  METSHARD -- one thread's counters
+**
+**  Shards are never freed.  When a thread exits its shard is marked
+**  unused and handed to the next new thread, which carries on adding to
+**  the same totals.
+*/
+
+struct metshard
+{
+	_Bool		ms_inuse;		/* owned by a live thread */
+	struct metshard * ms_next;		/* list of all shards */
+	struct metslot	ms_data;		/* counters and histograms */
+};
+
+/* GLOBALS */
+static _Bool met_die;				/* server shutdown */
+static _Bool met_running;			/* metrics collected */
+static int met_fd = -1;				/* listening socket */
+static char met_path[MAXPATHLEN + 1];		/* UNIX socket path */
+static pthread_t met_thread;			/* server thread */
+static pthread_key_t met_key;			/* per-thread shard */
+static pthread_mutex_t met_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct metshard *met_shards;		/* all shards */
+static int met_worker = -1;			/* this worker's slot */
+static int met_nslots;				/* worker slots */
+static struct metslot *met_slots;		/* shared by all workers */
+static struct metslot met_base;			/* slot's totals at start */
+static void (*met_extra) (struct dkimf_dstring *);
+						/* caller's own metrics */
+
+static char *met_dbtypes[DKIMF_MET_DBTYPES] =
+{
+	"file", "refile", "csl", "db", "dsn", "ldap", "lua", "memcache",
+	"repute", "socket", "mdb", "erlang"
+};
+
+static struct
+{
+	int		mr_counter;
+	char *		mr_mode;
+	char *		mr_result;
+} met_results[] =
+{
+	{ DKIMF_MET_SIGNED,	"sign",		"signed" },
+	{ DKIMF_MET_PASS,	"verify",	"pass" },
+	{ DKIMF_MET_FAIL,	"verify",	"fail" },
+	{ DKIMF_MET_NOKEY,	"verify",	"nokey" },
+	{ DKIMF_MET_REVOKED,	"verify",	"revoked" },
+	{ DKIMF_MET_NOSIG,	"verify",	"none" },
+	{ DKIMF_MET_BADFORMAT,	"verify",	"badformat" },
+	{ DKIMF_MET_OTHER,	"verify",	"other" }
+};
+
+static struct
+{
+	char *		mh_name;
+	char *		mh_help;
+} met_hists[DKIMF_MET_H_MAX] =
+{
+	{ "opendkim_sign_crypto_seconds",
+	  "Time spent generating signatures, per message." },
+	{ "opendkim_verify_crypto_seconds",
+	  "Time spent verifying signatures, per message." },
+	{ "opendkim_key_query_seconds",
+	  "Time spent retrieving keys, per message that needed any." },
+	{ "opendkim_db_lookup_seconds",
+	  "Time spent in each data set lookup." },
+	{ "opendkim_eom_seconds",
+	  "Time spent in the end-of-message callback." }
+};
+
+/*
+**  DKIMF_METRICS_RELEASE -- give up a shard when its thread exits
+**
+**  Parameters:
+**  	arg -- the shard
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_metrics_release(void *arg)
+{
+	struct metshard *ms;
+
+	ms = (struct metshard *) arg;
+
+	pthread_mutex_lock(&met_lock);
+	ms->ms_inuse = FALSE;
+	pthread_mutex_unlock(&met_lock);
+}
+
+/*
+**  DKIMF_METRICS_SHARD -- find the calling thread's shard
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	The calling thread's shard, or NULL if one couldn't be allocated.
+*/
+
+static struct metshard *
+dkimf_metrics_shard(void)
+{
+	struct metshard *ms;
+
+	ms = pthread_getspecific(met_key);
+	if (ms != NULL)
+		return ms;
+
+	pthread_mutex_lock(&met_lock);
+
+	for (ms = met_shards; ms != NULL; ms = ms->ms_next)
+	{
+		if (!ms->ms_inuse)
+			break;
+	}
+
+	if (ms == NULL)
+	{
+		ms = (struct metshard *) calloc(1, sizeof *ms);
+		if (ms != NULL)
+		{
+			ms->ms_next = met_shards;
+			met_shards = ms;
+		}
+	}
+
+	if (ms != NULL)
+		ms->ms_inuse = TRUE;
+
+	pthread_mutex_unlock(&met_lock);
+
+	if (ms != NULL)
+		(void) pthread_setspecific(met_key, ms);
+
+	return ms;
+}
+
+/*
+**  DKIMF_METRICS_BUCKET -- find the histogram bucket for a duration
+**
+**  Parameters:
+**  	usec -- duration, in microseconds
+**
+**  Return value:
+**  	Bucket index, or DKIMF_MET_BUCKETS if it's beyond the last one.
+**
+**  Notes:
+**  	Bucket 0 holds everything under 16us.  Above that, each power of
+**  	two is split into two buckets, [2^k, 1.5 * 2^k) and [1.5 * 2^k,
+**  	2^(k+1)), so the relative error is bounded at every scale.
+*/
+
+static int
+dkimf_metrics_bucket(uint64_t usec)
+{
+	int k;
+
+	if (usec < 16)
+		return 0;
+
+	for (k = 4; (usec >> (k + 1)) != 0; k++)
+		continue;
+
+	return 1 + (k - 4) * 2 + (int) ((usec >> (k - 1)) & 1);
+}
+
+/*
+**  DKIMF_METRICS_UPPER -- upper bound of a histogram bucket
+**
+**  Parameters:
+**  	bucket -- bucket index
+**
+**  Return value:
+**  	The bucket's exclusive upper bound, in microseconds.
+*/
+
+static uint64_t
+dkimf_metrics_upper(int bucket)
+{
+	int k;
+
+	if (bucket == 0)
+		return 16;
+
+	k = 4 + (bucket - 1) / 2;
+
+	return (uint64_t) (3 + (bucket - 1) % 2) << (k - 1);
+}
+
+/*
+**  DKIMF_METRICS_ENABLED -- report whether metrics are being collected
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	TRUE iff dkimf_metrics_init() has succeeded.
+*/
+
+_Bool
+dkimf_metrics_enabled(void)
+{
+	return met_running;
+}
+
+/*
+**  DKIMF_METRICS_COUNT -- bump a counter
+**
+**  Parameters:
+**  	which -- DKIMF_MET_* counter
+**  	n -- amount to add
+**
+**  Return value:
+**  	None.
+*/
+
+void
+dkimf_metrics_count(int which, uint64_t n)
+{
+	struct metshard *ms;
+
+	assert(which >= 0 && which < DKIMF_MET_MAX);
+
+	if (!met_running)
+		return;
+
+	ms = dkimf_metrics_shard();
+	if (ms == NULL)
+		return;
+
+	DKIMF_MET_ADD(ms->ms_data.msl_count[which], n);
+}
+
+/*
+**  DKIMF_METRICS_OBSERVE -- record a duration in a histogram
+**
+**  Parameters:
+**  	which -- DKIMF_MET_H_* histogram
+**  	usec -- duration, in microseconds
+**
+**  Return value:
+**  	None.
+*/
+
+void
+dkimf_metrics_observe(int which, uint64_t usec)
+{
+	int b;
+	struct metshard *ms;
+	struct methist *mh;
+
+	assert(which >= 0 && which < DKIMF_MET_H_MAX);
+
+	if (!met_running)
+		return;
+
+	ms = dkimf_metrics_shard();
+	if (ms == NULL)
+		return;
+
+	mh = &ms->ms_data.msl_hist[which];
+
+	DKIMF_MET_ADD(mh->mh_count, 1);
+	DKIMF_MET_ADD(mh->mh_sum, usec);
+
+	b = dkimf_metrics_bucket(usec);
+	if (b < DKIMF_MET_BUCKETS)
+		DKIMF_MET_ADD(mh->mh_bucket[b], 1);
+}
+
+/*
+**  DKIMF_METRICS_DB -- record a data set lookup
+**
+**  Parameters:
+**  	type -- DKIMF_DB_TYPE_* of the data set
+**  	usec -- duration of the lookup, in microseconds
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Suitable for passing to dkimf_db_observe().
+*/
+
+void
+dkimf_metrics_db(int type, uint64_t usec)
+{
+	if (type >= 0 && type < DKIMF_MET_DBTYPES)
+		dkimf_metrics_count(DKIMF_MET_DB + type, 1);
+
+	dkimf_metrics_observe(DKIMF_MET_H_DB, usec);
+}
+
+/*
+**  DKIMF_METRICS_SECONDS -- format microseconds as seconds
+**
+**  Parameters:
+**  	usec -- microseconds
+**  	buf -- output buffer
+**  	buflen -- bytes available at "buf"
+**
+**  Return value:
+**  	"buf".
+*/
+
+static char *
+dkimf_metrics_seconds(uint64_t usec, char *buf, size_t buflen)
+{
+	snprintf(buf, buflen, "%lu.%06lu", (u_long) (usec / 1000000),
+	         (u_long) (usec % 1000000));
+
+	return buf;
+}
+
+/*
+**  DKIMF_METRICS_ADD -- add one set of totals to another
+**
+**  Parameters:
+**  	to -- totals to which to add
+**  	from -- totals to add
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_metrics_add(struct metslot *to, struct metslot *from)
+{
+	int w;
+	uint64_t *t;
+	uint64_t *f;
+
+	t = (uint64_t *) to;
+	f = (uint64_t *) from;
+
+	for (w = 0; w < DKIMF_MET_WORDS; w++)
+		t[w] += DKIMF_MET_GET(f[w]);
+}
+
+/*
+**  DKIMF_METRICS_COLLECT -- add up this process's shards
+**
+**  Parameters:
+**  	tot -- totals (returned)
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_metrics_collect(struct metslot *tot)
+{
+	struct metshard *ms;
+
+	memset(tot, '\0', sizeof *tot);
+
+	pthread_mutex_lock(&met_lock);
+
+	for (ms = met_shards; ms != NULL; ms = ms->ms_next)
+	{
+		dkimf_metrics_add(tot, &ms->ms_data);
+	}
+
+	pthread_mutex_unlock(&met_lock);
+}
+
+/*
+**  DKIMF_METRICS_PUBLISH -- update this worker's shared slot
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_metrics_publish(void)
+{
+	int w;
+	uint64_t *slot;
+	uint64_t *t;
+	struct metslot tot;
+
+	if (met_slots == NULL || met_worker < 0)
+		return;
+
+	dkimf_metrics_collect(&tot);
+	dkimf_metrics_add(&tot, &met_base);
+
+	slot = (uint64_t *) &met_slots[met_worker];
+	t = (uint64_t *) &tot;
+
+	for (w = 0; w < DKIMF_MET_WORDS; w++)
+		DKIMF_MET_PUT(slot[w], t[w]);
+}
+
+/*
+**  DKIMF_METRICS_RENDER -- produce the Prometheus text exposition
+**
+**  Parameters:
+**  	out -- string to which to write
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_metrics_render(struct dkimf_dstring *out)
+{
+	int c;
+	int b;
+	uint64_t cum;
+	uint64_t *count;
+	struct methist *hist;
+	struct metslot tot;
+	char le[BUFRSZ];
+
+	if (met_slots != NULL)
+	{
+		dkimf_metrics_publish();
+
+		memset(&tot, '\0', sizeof tot);
+		for (c = 0; c < met_nslots; c++)
+			dkimf_metrics_add(&tot, &met_slots[c]);
+	}
+	else
+	{
+		dkimf_metrics_collect(&tot);
+	}
+
+	count = tot.msl_count;
+	hist = tot.msl_hist;
+
+	dkimf_dstring_printf(out,
+	                     "# HELP opendkim_messages_total Messages completed, by mode and result.\n"
+	                     "# TYPE opendkim_messages_total counter\n");
+	for (c = 0; c < sizeof met_results / sizeof met_results[0]; c++)
+	{
+		dkimf_dstring_printf(out,
+		                     "opendkim_messages_total{mode=\"%s\",result=\"%s\"} %lu\n",
+		                     met_results[c].mr_mode,
+		                     met_results[c].mr_result,
+		                     (u_long) count[met_results[c].mr_counter]);
+	}
+
+	dkimf_dstring_printf(out,
+	                     "# HELP opendkim_key_queries_total Key retrievals attempted.\n"
+	                     "# TYPE opendkim_key_queries_total counter\n"
+	                     "opendkim_key_queries_total %lu\n"
+	                     "# HELP opendkim_key_query_timeouts_total DNS key queries that timed out.\n"
+	                     "# TYPE opendkim_key_query_timeouts_total counter\n"
+	                     "opendkim_key_query_timeouts_total %lu\n"
+	                     "# HELP opendkim_canon_body_bytes_total Message body bytes canonicalized.\n"
+	                     "# TYPE opendkim_canon_body_bytes_total counter\n"
+	                     "opendkim_canon_body_bytes_total %lu\n",
+	                     (u_long) count[DKIMF_MET_KEYQUERIES],
+	                     (u_long) count[DKIMF_MET_KEYTIMEOUTS],
+	                     (u_long) count[DKIMF_MET_BODYBYTES]);
+
+	dkimf_dstring_printf(out,
+	                     "# HELP opendkim_db_lookups_total Data set lookups, by data set type.\n"
+	                     "# TYPE opendkim_db_lookups_total counter\n");
+	for (c = 0; c < DKIMF_MET_DBTYPES; c++)
+	{
+		if (count[DKIMF_MET_DB + c] == 0)
+			continue;
+
+		dkimf_dstring_printf(out,
+		                     "opendkim_db_lookups_total{type=\"%s\"} %lu\n",
+		                     met_dbtypes[c],
+		                     (u_long) count[DKIMF_MET_DB + c]);
+	}
+
+	for (c = 0; c < DKIMF_MET_H_MAX; c++)
+	{
+		dkimf_dstring_printf(out, "# HELP %s %s\n# TYPE %s histogram\n",
+		                     met_hists[c].mh_name,
+		                     met_hists[c].mh_help,
+		                     met_hists[c].mh_name);
+
+		cum = 0;
+		for (b = 0; b < DKIMF_MET_BUCKETS; b++)
+		{
+			cum += hist[c].mh_bucket[b];
+			dkimf_dstring_printf(out, "%s_bucket{le=\"%s\"} %lu\n",
+			                     met_hists[c].mh_name,
+			                     dkimf_metrics_seconds(dkimf_metrics_upper(b),
+			                                           le, sizeof le),
+			                     (u_long) cum);
+		}
+
+		dkimf_dstring_printf(out,
+		                     "%s_bucket{le=\"+Inf\"} %lu\n%s_sum %s\n%s_count %lu\n",
+		                     met_hists[c].mh_name,
+		                     (u_long) hist[c].mh_count,
+		                     met_hists[c].mh_name,
+		                     dkimf_metrics_seconds(hist[c].mh_sum,
+		                                           le, sizeof le),
+		                     met_hists[c].mh_name,
+		                     (u_long) hist[c].mh_count);
+	}
+
+	if (met_extra != NULL)
+		met_extra(out);
+}
+
+/*
+**  DKIMF_METRICS_SEND -- write all of a buffer to a client
+**
+**  Parameters:
+**  	fd -- client socket
+**  	buf -- data to send
+**  	len -- bytes to send
+**
+**  Return value:
+**  	TRUE iff everything was written.
+*/
+
+static _Bool
+dkimf_metrics_send(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+	struct pollfd pfd;
+
+	while (len > 0)
+	{
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+		if (poll(&pfd, 1, DKIMF_MET_IOTIMEOUT) <= 0)
+			return FALSE;
+
+		n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n == -1 && errno == EINTR)
+			continue;
+		else if (n <= 0)
+			return FALSE;
+
+		buf += n;
+		len -= n;
+	}
+
+	return TRUE;
+}
+
+/*
+**  DKIMF_METRICS_SERVE -- answer one client
+**
+**  Parameters:
+**  	fd -- client socket
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	A client that sends an HTTP GET gets an HTTP response, so
+**  	Prometheus can scrape the socket directly; "/" and "/metrics" are
+**  	served.  Anything else (including nothing at all, once the I/O
+**  	timeout passes) just gets the exposition text.
+*/
+
+static void
+dkimf_metrics_serve(int fd)
+{
+	_Bool http = FALSE;
+	size_t len = 0;
+	ssize_t n;
+	struct dkimf_dstring *body;
+	struct pollfd pfd;
+	char req[BUFRSZ + 1];
+	char hdr[BUFRSZ + 1];
+
+	/* read until the end of the request headers, EOF or timeout */
+	while (len < sizeof req - 1)
+	{
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, DKIMF_MET_IOTIMEOUT) <= 0)
+			break;
+
+		n = read(fd, req + len, sizeof req - 1 - len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		else if (n <= 0)
+			break;
+
+		len += n;
+		req[len] = '\0';
+
+		if (strstr(req, "\r\n\r\n") != NULL ||
+		    strstr(req, "\n\n") != NULL)
+			break;
+	}
+	req[len] = '\0';
+
+	if (strncmp(req, "GET ", 4) == 0)
+	{
+		char *path;
+		size_t plen;
+
+		http = TRUE;
+		path = req + 4;
+		plen = strcspn(path, " ?\r\n");
+
+		if (!(plen == 1 && path[0] == '/') &&
+		    !(plen == 8 && strncmp(path, "/metrics", 8) == 0))
+		{
+			snprintf(hdr, sizeof hdr,
+			         "HTTP/1.0 404 Not Found\r\n"
+			         "Content-Type: text/plain\r\n"
+			         "Content-Length: 10\r\n"
+			         "Connection: close\r\n\r\n"
+			         "not found\n");
+			(void) dkimf_metrics_send(fd, hdr, strlen(hdr));
+			return;
+		}
+	}
+
+	body = dkimf_dstring_new(BUFRSZ, 0);
+	if (body == NULL)
+		return;
+
+	dkimf_metrics_render(body);
+
+	if (http)
+	{
+		snprintf(hdr, sizeof hdr,
+		         "HTTP/1.0 200 OK\r\n"
+		         "Content-Type: text/plain; version=0.0.4\r\n"
+		         "Content-Length: %d\r\n"
+		         "Connection: close\r\n\r\n",
+		         dkimf_dstring_len(body));
+
+		if (!dkimf_metrics_send(fd, hdr, strlen(hdr)))
+		{
+			dkimf_dstring_free(body);
+			return;
+		}
+	}
+
+	(void) dkimf_metrics_send(fd, (char *) dkimf_dstring_get(body),
+	                          dkimf_dstring_len(body));
+
+	dkimf_dstring_free(body);
+}
+
+/*
+**  DKIMF_METRICS_SERVER -- thread accepting and answering scrapes
+**
+**  Parameters:
+**  	arg -- unused
+**
+**  Return value:
+**  	Always NULL.
+**
+**  Notes:
+**  	A worker that isn't the one serving scrapes runs this too, only to
+**  	publish its totals.
+*/
+
+static void *
+dkimf_metrics_server(void *arg)
+{
+	int fd;
+	struct pollfd pfd;
+
+	while (!met_die)
+	{
+		dkimf_metrics_publish();
+
+		if (met_fd == -1)
+		{
+			(void) poll(NULL, 0, DKIMF_MET_IOTIMEOUT);
+			continue;
+		}
+
+		pfd.fd = met_fd;
+		pfd.events = POLLIN;
+
+		if (poll(&pfd, 1, DKIMF_MET_IOTIMEOUT) <= 0)
+			continue;
+
+		fd = accept(met_fd, NULL, NULL);
+		if (fd == -1)
+			continue;
+
+		dkimf_metrics_serve(fd);
+
+		(void) close(fd);
+	}
+
+	return NULL;
+}
+
+/*
+**  DKIMF_METRICS_SHARE -- prepare to aggregate across worker processes
+**
+**  Parameters:
+**  	nworkers -- number of worker processes
+**  	err -- error buffer
+**  	errlen -- bytes available at "err"
+**
+**  Return value:
+**  	0 on success, -1 on failure (with "err" updated).
+**
+**  Notes:
+**  	Called by the supervisor before it starts any workers, each of
+**  	which then calls dkimf_metrics_worker() before dkimf_metrics_init().
+*/
+
+int
+dkimf_metrics_share(int nworkers, char *err, size_t errlen)
+{
+	void *slots;
+
+	assert(nworkers > 0);
+	assert(err != NULL);
+
+	slots = mmap(NULL, nworkers * sizeof(struct metslot),
+	             PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (slots == MAP_FAILED)
+	{
+		snprintf(err, errlen, "mmap(): %s", strerror(errno));
+		return -1;
+	}
+
+	met_slots = (struct metslot *) slots;
+	met_nslots = nworkers;
+
+	return 0;
+}
+
+/*
+**  DKIMF_METRICS_WORKER -- identify the calling worker process
+**
+**  Parameters:
+**  	worker -- worker number, from zero
+**
+**  Return value:
+**  	None.
+*/
+
+void
+dkimf_metrics_worker(int worker)
+{
+	assert(worker >= 0 && worker < met_nslots);
+
+	met_worker = worker;
+}
+
+/*
+**  DKIMF_METRICS_INIT -- start collecting and serving metrics
+**
+**  Parameters:
+**  	spec -- socket on which to serve them
+**  	extra -- function to append further metrics to each scrape (or NULL)
+**  	err -- error buffer
+**  	errlen -- bytes available at "err"
+**
+**  Return value:
+**  	0 on success, -1 on failure (with "err" updated).
+**
+**  Notes:
+**  	"spec" uses the same syntax as the milter socket, except that an
+**  	"inet" or "inet6" socket with no host listens on the loopback
+**  	address.  Among worker processes, only the first listens on it.
+*/
+
+int
+dkimf_metrics_init(const char *spec, void (*extra)(struct dkimf_dstring *),
+                   char *err, size_t errlen)
+{
+	int status;
+
+	assert(spec != NULL);
+	assert(err != NULL);
+
+	if (met_running)
+		return 0;
+
+	status = pthread_key_create(&met_key, dkimf_metrics_release);
+	if (status != 0)
+	{
+		snprintf(err, errlen, "pthread_key_create(): %s",
+		         strerror(status));
+		return -1;
+	}
+
+	if (met_slots != NULL && met_worker >= 0)
+	{
+		int w;
+		uint64_t *slot;
+		uint64_t *base;
+
+		slot = (uint64_t *) &met_slots[met_worker];
+		base = (uint64_t *) &met_base;
+
+		for (w = 0; w < DKIMF_MET_WORDS; w++)
+			base[w] = DKIMF_MET_GET(slot[w]);
+	}
+
+	if (met_worker <= 0)
+	{
+		met_fd = dkimf_socket_listen((char *) spec, DKIMF_MET_BACKLOG,
+		                             TRUE, FALSE, met_path,
+		                             sizeof met_path, err, errlen);
+		if (met_fd == -1)
+		{
+			(void) pthread_key_delete(met_key);
+			return -1;
+		}
+	}
+
+	met_extra = extra;
+	met_die = FALSE;
+	met_running = TRUE;
+
+	status = pthread_create(&met_thread, NULL, dkimf_metrics_server, NULL);
+	if (status != 0)
+	{
+		snprintf(err, errlen, "pthread_create(): %s",
+		         strerror(status));
+		met_running = FALSE;
+		if (met_fd != -1)
+			(void) close(met_fd);
+		met_fd = -1;
+		if (met_path[0] != '\0')
+			(void) unlink(met_path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+**  DKIMF_METRICS_SHUTDOWN -- stop serving metrics
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	None.
+*/
+
+void
+dkimf_metrics_shutdown(void)
+{
+	if (!met_running)
+		return;
+
+	met_running = FALSE;
+	met_die = TRUE;
+
+	(void) pthread_join(met_thread, NULL);
+
+	dkimf_metrics_publish();
+
+	if (met_fd != -1)
+		(void) close(met_fd);
+	met_fd = -1;
+
+	if (met_path[0] != '\0')
+		(void) unlink(met_path);
+}
+
+#endif /* _FFR_METRICS */
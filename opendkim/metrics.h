@@ -0,0 +1,51 @@
+/*
+**  Copyright 2025 OpenDKIM contributors.
+*/
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include "build-config.h"
+
+/* system includes */
+#include <sys/types.h>
+#include <inttypes.h>
+
+/* counters */
+#define	DKIMF_MET_SIGNED	0	/* messages signed */
+#define	DKIMF_MET_PASS		1	/* verified, good signature */
+#define	DKIMF_MET_FAIL		2	/* verified, bad signature */
+#define	DKIMF_MET_NOKEY		3	/* verified, no key */
+#define	DKIMF_MET_REVOKED	4	/* verified, key revoked */
+#define	DKIMF_MET_NOSIG		5	/* verified, not signed */
+#define	DKIMF_MET_BADFORMAT	6	/* verified, unusable signature */
+#define	DKIMF_MET_OTHER		7	/* verified, anything else */
+#define	DKIMF_MET_KEYQUERIES	8	/* key queries */
+#define	DKIMF_MET_KEYTIMEOUTS	9	/* key queries timed out */
+#define	DKIMF_MET_BODYBYTES	10	/* body bytes canonicalized */
+#define	DKIMF_MET_DB		11	/* data set lookups, by type */
+#define	DKIMF_MET_DBTYPES	12	/* types counted */
+#define	DKIMF_MET_MAX		(DKIMF_MET_DB + DKIMF_MET_DBTYPES)
+
+/* histograms */
+#define	DKIMF_MET_H_SIGN	0	/* signing crypto time */
+#define	DKIMF_MET_H_VERIFY	1	/* verifying crypto time */
+#define	DKIMF_MET_H_KEYQUERY	2	/* key retrieval time */
+#define	DKIMF_MET_H_DB		3	/* data set lookup time */
+#define	DKIMF_MET_H_EOM		4	/* end-of-message callback time */
+#define	DKIMF_MET_H_MAX		5
+
+struct dkimf_dstring;
+
+/* prototypes */
+extern void dkimf_metrics_count(int, uint64_t);
+extern void dkimf_metrics_db(int, uint64_t);
+extern _Bool dkimf_metrics_enabled(void);
+extern int dkimf_metrics_init(const char *, void (*)(struct dkimf_dstring *),
+                              char *, size_t);
+extern void dkimf_metrics_observe(int, uint64_t);
+extern int dkimf_metrics_share(int, char *, size_t);
+extern void dkimf_metrics_shutdown(void);
+extern void dkimf_metrics_worker(int);
+
+#endif /* _METRICS_H_ */
@@ -36,6 +36,8 @@ struct configdef dkimf_config[] =
 	{ "AutoRestartRate",		CONFIG_TYPE_STRING,	FALSE },
 	{ "Background",			CONFIG_TYPE_BOOLEAN,	FALSE },
 	{ "BaseDirectory",		CONFIG_TYPE_STRING,	FALSE },
+	{ "BodyHashCache",		CONFIG_TYPE_INTEGER,	FALSE },
+	{ "BodyHashCacheMaxSize",	CONFIG_TYPE_INTEGER,	FALSE },
 	{ "BodyLengthDB",		CONFIG_TYPE_STRING,	FALSE },
 #ifdef USE_UNBOUND
 	{ "BogusKey",			CONFIG_TYPE_STRING,	FALSE },
@@ -59,6 +61,10 @@ struct configdef dkimf_config[] =
 	{ "DomainKeysCompat",		CONFIG_TYPE_BOOLEAN,	FALSE },
 	{ "DontSignMailTo",		CONFIG_TYPE_STRING,	FALSE },
 	{ "EnableCoredumps",		CONFIG_TYPE_BOOLEAN,	FALSE },
+#ifdef _FFR_EVENT_ENGINE
+	{ "EventEngine",		CONFIG_TYPE_BOOLEAN,	FALSE },
+	{ "EventEngineWorkers",		CONFIG_TYPE_INTEGER,	FALSE },
+#endif /* _FFR_EVENT_ENGINE */
 	{ "ExemptDomains",		CONFIG_TYPE_STRING,	FALSE },
 	{ "ExternalIgnoreList",		CONFIG_TYPE_STRING,	FALSE },
 #ifdef USE_LUA
@@ -67,6 +73,7 @@ struct configdef dkimf_config[] =
 	{ "FixCRLF",			CONFIG_TYPE_BOOLEAN,	FALSE },
 #ifdef _FFR_RATE_LIMIT
 	{ "FlowData",			CONFIG_TYPE_STRING,	FALSE },
+	{ "FlowDataCheckpoint",		CONFIG_TYPE_INTEGER,	FALSE },
 	{ "FlowDataFactor",		CONFIG_TYPE_INTEGER,	FALSE },
 	{ "FlowDataTTL",		CONFIG_TYPE_INTEGER,	FALSE },
 #endif /* _FFR_RATE_LIMIT */
@@ -97,8 +104,15 @@ struct configdef dkimf_config[] =
 	{ "LDAPTimeout",		CONFIG_TYPE_STRING,	FALSE },
 	{ "LDAPUseTLS",			CONFIG_TYPE_BOOLEAN,	FALSE },
 #endif /* USE_LDAP */
+#ifdef _FFR_ASYNC_LOG
+	{ "LogBufferOverflow",		CONFIG_TYPE_STRING,	FALSE },
+	{ "LogBufferSize",		CONFIG_TYPE_INTEGER,	FALSE },
+	{ "LogFile",			CONFIG_TYPE_STRING,	FALSE },
+	{ "LogRateLimit",		CONFIG_TYPE_INTEGER,	FALSE },
+#endif /* _FFR_ASYNC_LOG */
 	{ "LogResults",			CONFIG_TYPE_BOOLEAN,	FALSE },
 	{ "LogWhy",			CONFIG_TYPE_BOOLEAN,	FALSE },
+	{ "LookupThreads",		CONFIG_TYPE_INTEGER,	FALSE },
 #ifdef _FFR_LUA_ONLY_SIGNING
 	{ "LuaOnlySigning",		CONFIG_TYPE_BOOLEAN,	FALSE },
 #endif /* _FFR_LUA_ONLY_SIGNING */
@@ -106,6 +120,9 @@ struct configdef dkimf_config[] =
 	{ "MaximumSignedBytes",		CONFIG_TYPE_INTEGER,	FALSE },
 	{ "MaximumSignaturesToVerify",	CONFIG_TYPE_INTEGER,	FALSE },
 	{ "MacroList",			CONFIG_TYPE_STRING,	FALSE },
+#ifdef _FFR_METRICS
+	{ "MetricsSocket",		CONFIG_TYPE_STRING,	FALSE },
+#endif /* _FFR_METRICS */
 	{ "MilterDebug",		CONFIG_TYPE_INTEGER,	FALSE },
 	{ "Minimum",			CONFIG_TYPE_STRING,	FALSE },
 	{ "MinimumKeyBits",		CONFIG_TYPE_INTEGER,	FALSE },
@@ -150,6 +167,11 @@ struct configdef dkimf_config[] =
 #endif /* _FFR_REPLACE_RULES */
 	{ "ReportAddress",		CONFIG_TYPE_STRING,	FALSE },
 	{ "ReportBccAddress",		CONFIG_TYPE_STRING,	FALSE },
+#ifdef _FFR_REPORT_QUEUE
+	{ "ReportQueueBatch",		CONFIG_TYPE_INTEGER,	FALSE },
+	{ "ReportQueueRate",		CONFIG_TYPE_INTEGER,	FALSE },
+	{ "ReportQueueSize",		CONFIG_TYPE_INTEGER,	FALSE },
+#endif /* _FFR_REPORT_QUEUE */
 #ifdef _FFR_REPUTATION
 	{ "ReputationCache",		CONFIG_TYPE_STRING,	FALSE },
 	{ "ReputationCacheTTL",		CONFIG_TYPE_INTEGER,	FALSE },
@@ -224,9 +246,11 @@ struct configdef dkimf_config[] =
 	{ "SyslogFacility",		CONFIG_TYPE_STRING,	FALSE },
 	{ "SyslogName",			CONFIG_TYPE_STRING,	FALSE },
 	{ "SyslogSuccess",		CONFIG_TYPE_BOOLEAN,	FALSE },
+	{ "TableLoadThreads",		CONFIG_TYPE_INTEGER,	FALSE },
 	{ "TemporaryDirectory",		CONFIG_TYPE_STRING,	FALSE },
 	{ "TestDNSData",		CONFIG_TYPE_STRING,	FALSE },
 	{ "TestPublicKeys",		CONFIG_TYPE_STRING,	FALSE },
+	{ "TraceThreshold",		CONFIG_TYPE_INTEGER,	FALSE },
 	{ "TrustAnchorFile",		CONFIG_TYPE_STRING,	FALSE },
 	{ "TrustSignaturesFrom",	CONFIG_TYPE_STRING,	FALSE },
 	{ "UMask",			CONFIG_TYPE_INTEGER,	FALSE },
@@ -242,6 +266,10 @@ struct configdef dkimf_config[] =
 	{ "VBR-Type",			CONFIG_TYPE_STRING,	FALSE },
 #endif /* _FFR_VBR */
 	{ "WeakSyntaxChecks",		CONFIG_TYPE_BOOLEAN,	FALSE },
+#ifdef _FFR_WORKERS
+	{ "WorkerCPUs",			CONFIG_TYPE_STRING,	FALSE },
+	{ "Workers",			CONFIG_TYPE_INTEGER,	FALSE },
+#endif /* _FFR_WORKERS */
 	{ "X-Header",			CONFIG_TYPE_BOOLEAN,	FALSE },
 	{ NULL,				(u_int) -1,		FALSE }
 };
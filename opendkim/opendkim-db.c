@@ -31,6 +31,7 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <regex.h>
+#include <time.h>
 #include <netdb.h>
 
 /* libopendkim includes */
@@ -103,9 +104,14 @@
 /* macros */
 #define	BUFRSZ			1024
 #define	DEFARRAYSZ		16
-#ifdef _FFR_DB_HANDLE_POOLS
-# define DEFPOOLMAX		10
-#endif /* _FFR_DB_HANDLE_POOLS */
+#ifdef USE_ODBX
+# define DKIMF_DB_POOLMIN	1		/* default SQL pool minimum */
+# define DKIMF_DB_POOLMAX	10		/* default SQL pool maximum */
+# define DKIMF_DB_POOLLIMIT	1024		/* largest poolmax allowed */
+# define DKIMF_DB_POOLIDLE	30		/* idle secs before probe/trim */
+# define DKIMF_DB_POOLBACKOFF	60		/* max reconnect delay, secs */
+# define DKIMF_DB_QUERYSZ	(BUFRSZ * 2)
+#endif /* USE_ODBX */
 #define DKIMF_DB_DEFASIZE	8
 #define DKIMF_DB_MODE		0644
 #define DKIMF_LDAP_MAXURIS	8
@@ -159,6 +165,13 @@
 # else /* DB_VERSION_MAJOR < 2 */
 #  define DKIMF_DBCLOSE(db)	(db)->close((db), 0)
 # endif /* DB_VERSION_MAJOR < 2 */
+
+/* read-only files get a free-threaded handle in a private environment */
+# if DB_VERSION_CHECK(4,1,25)
+#  define DKIMF_DB_BDB_SHARED
+#  define DKIMF_DB_BDB_CACHESZ	(1024 * 1024)	/* mpool size */
+#  define DKIMF_DB_BDB_CHECKINT	1		/* change check (s) */
+# endif /* DB_VERSION_CHECK(4,1,25) */
 #endif /* USE_DB */
 
 /* macros */
@@ -214,7 +227,14 @@ struct dkimf_db_dsn
 	char			dsn_port[BUFRSZ];
 	char			dsn_table[BUFRSZ];
 	char			dsn_user[BUFRSZ];
+	u_int			dsn_poolmin;
+	u_int			dsn_poolmax;
+	size_t			dsn_qlen;
+	size_t			dsn_qtlen;
 	const char *		dsn_filter;
+	char *			dsn_query;
+	char *			dsn_qtail;
+	odbx_t *		dsn_walk;
 };
 #endif /* USE_ODBX */
 
@@ -269,6 +289,32 @@ struct dkimf_db_socket
 };
 #endif /* _FFR_SOCKETDB */
 
+#ifdef DKIMF_DB_BDB_SHARED
+/*
+**  DKIMF_DB_BDB -- state for a shared read-only Berkeley DB
+**
+**  Lookups hold bdb_rwlock for reading only, so they run concurrently;
+**  it is taken for writing just long enough to swap in a new handle
+**  when the file has been replaced.  A walk holds it for reading from
+**  the time its cursor is opened until the cursor is closed, and sets
+**  bdb_walking for that time so the swap is put off rather than waiting.
+*/
+
+struct dkimf_db_bdb
+{
+	time_t			bdb_checked;	/* last change check */
+	dev_t			bdb_dev;	/* file device */
+	ino_t			bdb_ino;	/* file inode */
+	time_t			bdb_mtime;	/* file modification time */
+	off_t			bdb_size;	/* file size */
+	_Bool			bdb_walking;	/* walk holds bdb_rwlock */
+	DB_ENV *		bdb_env;	/* private environment */
+	char *			bdb_path;	/* file path */
+	pthread_mutex_t		bdb_checklock;	/* one checker at a time */
+	pthread_rwlock_t	bdb_rwlock;	/* lookups vs. reopen */
+};
+#endif /* DKIMF_DB_BDB_SHARED */
+
 #ifdef USE_MDB
 struct dkimf_db_mdb
 {
@@ -328,314 +374,147 @@ struct dkimf_db_table dbtypes[] =
 
 static char *dkimf_db_ldap_param[DKIMF_LDAP_PARAM_MAX + 1];
 
-#ifdef _FFR_DB_HANDLE_POOLS
+#ifdef USE_ODBX
+struct handle_entry
+{
+	time_t		he_used;
+	void *		he_handle;
+};
+
 struct handle_pool
 {
+	int		hp_lasterr;
 	u_int		hp_dbtype;
+	u_int		hp_min;
 	u_int		hp_max;
 	u_int		hp_alloc;
-	u_int		hp_asize;
 	u_int		hp_count;
+	u_int		hp_fails;
+	time_t		hp_retry;
 	void *		hp_hdata;
-	void **		hp_handles;
+	struct handle_entry * hp_handles;
 	pthread_mutex_t	hp_lock;
 	pthread_cond_t	hp_signal;
+	char		hp_errstr[BUFRSZ];
 };
-#endif /* _FFR_DB_HANDLE_POOLS */
-
-/* globals */
-static unsigned int gflags = 0;
+#endif /* USE_ODBX */
 
-#ifdef _FFR_DB_HANDLE_POOLS
 /*
-**  DKIMF_DB_HP_NEW -- create a handle pool
-**
-**  Parameters:
-**  	type -- DB type
-**  	max -- maximum pool size
-**  	hdata -- data needed to make new handles
+**  DKIMF_DB_BATCH -- a set of data sets being opened together
 **
-**  Return value:
-**  	Pointer to a newly-allocated handle pool, or NULL on error.
+**  Entries are kept in the order in which they were added so results are
+**  reported the same way no matter which thread opened what, or when.
+**  Those of a type that is opened by reading a local file are also put on
+**  a queue drained by the batch's worker threads; anything else is opened
+**  in the caller's thread as it's added, just as dkimf_db_open() would.
 */
 
-static struct handle_pool *
-dkimf_db_hp_new(u_int type, u_int max, void *hdata)
+struct dkimf_db_batchent
 {
-	struct handle_pool *new;
+	u_int			dbe_flags;
+	DKIMF_DB *		dbe_db;
+	pthread_mutex_t *	dbe_lock;
+	struct dkimf_db_batchent * dbe_next;
+	struct dkimf_db_opened	dbe_opened;
+};
 
-	new = (struct handle_pool *) malloc(sizeof *new);
-	if (new != NULL)
-	{
-		new->hp_alloc = 0;
-		new->hp_asize = 0;
-		new->hp_count = 0;
-		new->hp_dbtype = type;
-		new->hp_handles = NULL;
-		new->hp_hdata = hdata;
-		new->hp_max = max;
-		pthread_mutex_init(&new->hp_lock, NULL);
-		pthread_cond_init(&new->hp_signal, NULL);
-	}
+struct dkimf_db_batch
+{
+	_Bool			dbb_closed;
+	u_int			dbb_maxthreads;
+	u_int			dbb_nthreads;
+	u_int			dbb_nents;
+	u_int			dbb_nqueued;
+	u_int			dbb_alloc;
+	pthread_t *		dbb_threads;
+	struct dkimf_db_batchent ** dbb_ents;
+	struct dkimf_db_batchent * dbb_head;
+	struct dkimf_db_batchent * dbb_tail;
+	pthread_mutex_t		dbb_lock;
+	pthread_cond_t		dbb_cond;
+};
 
-	return new;
-}
+/* globals */
+static unsigned int gflags = 0;
+static _Bool trace_keyok = FALSE;
+static pthread_key_t trace_key;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static void (*db_observer) (int, uint64_t) = NULL;
 
 /*
-**  DKIMF_DB_HP_FREE -- free a handle pool
+**  DKIMF_DB_FLAGS -- set global flags
 **
 **  Parameters:
-**  	pool -- bool to free up
+**  	flags -- new global flag mask
 **
 **  Return value:
 **  	None.
 */
 
-static void
-dkimf_db_hp_free(struct handle_pool *pool)
+void
+dkimf_db_flags(unsigned int flags)
 {
-	u_int c;
-
-	assert(pool != NULL);
-
-	for (c = 0; c < pool->hp_count; c++)
-	{
-		switch (pool->hp_dbtype)
-		{
-#ifdef USE_ODBX
-		  case DKIMF_DB_TYPE_DSN:
-		  {
-			odbx_t *odbx;
-
-			odbx = (odbx_t *) pool->hp_handles[c];
-
-			(void) odbx_unbind(odbx);
-			(void) odbx_finish(odbx);
-			free(odbx);
-
-			break;
-		  }
-#endif /* USE_ODBX */
-
-		  default:
-			break;
-		}
-	}
-
-	pthread_mutex_destroy(&pool->hp_lock);
-	pthread_cond_destroy(&pool->hp_signal);
-	free(pool->hp_handles);
-	free(pool);
+	gflags = flags;
 }
 
 /*
-**  DKIMF_DB_HP_GET -- get a handle from a handle pool
+**  DKIMF_DB_TRACE_INIT -- create the key used by dkimf_db_trace()
 **
 **  Parameters:
-**  	pool -- pool from which to get a handle
-**  	err -- error code (returned)
+**  	None.
 **
 **  Return value:
-**  	A handle appropriate to the associated DB type that is not currently
-**  	in use by another thread, or NULL on error.
+**  	None.
 */
 
-static void *
-dkimf_db_hp_get(struct handle_pool *pool, int *err)
+static void
+dkimf_db_trace_init(void)
 {
-	void *ret;
-
-	assert(pool != NULL);
-
-	pthread_mutex_lock(&pool->hp_lock);
-
-	for (;;)
-	{
-		/* if one is available, return it */
-		if (pool->hp_count > 0)
-		{
-			ret = pool->hp_handles[0];
-
-			if (pool->hp_count > 1)
-			{
-				memmove(&pool->hp_handles[0],
-				        &pool->hp_handles[1],
-				        sizeof(void *) * (pool->hp_count - 1));
-			}
-
-			pool->hp_count--;
-
-			pthread_mutex_unlock(&pool->hp_lock);
-
-			return ret;
-		}
-
-		/* if we can allocate one, do so */
-		if (pool->hp_alloc <= pool->hp_max)
-		{
-			switch (pool->hp_dbtype)
-			{
-#ifdef USE_ODBX
-			  case DKIMF_DB_TYPE_DSN:
-			  {
-				int dberr;
-				odbx_t *odbx;
-				struct dkimf_db_dsn *dsn;
-
-				dsn = (struct dkimf_db_dsn *) pool->hp_hdata;
-
-				dberr = odbx_init(&odbx,
-				                  STRORNULL(dsn->dsn_backend),
-				                  STRORNULL(dsn->dsn_host),
-				                  STRORNULL(dsn->dsn_port));
-
-				if (dberr < 0)
-				{
-					if (err != NULL)
-						*err = dberr;
-
-					(void) odbx_finish(odbx);
-					pthread_mutex_unlock(&pool->hp_lock);
-
-					return NULL;
-				}
-
-				dberr = odbx_bind(odbx,
-				                        STRORNULL(dsn->dsn_dbase),
-				                        STRORNULL(dsn->dsn_user),
-				                        STRORNULL(dsn->dsn_password),
-				                        ODBX_BIND_SIMPLE);
-				if (dberr < 0)
-				{
-					if (err != NULL)
-						*err = dberr;
-
-					(void) odbx_finish(odbx);
-					pthread_mutex_unlock(&pool->hp_lock);
-
-					return NULL;
-				}
-
-				ret = odbx;
-
-				break;
-			  }
-#endif /* USE_ODBX */
-
-			  default:
-				assert(0);
-				break;
-			}
-
-			pool->hp_alloc++;
-
-			pthread_mutex_unlock(&pool->hp_lock);
-
-			return ret;
-		}
-
-		/* already full; wait for one */
-		pthread_cond_wait(&pool->hp_signal, &pool->hp_lock);
-	}
+	if (pthread_key_create(&trace_key, NULL) == 0)
+		trace_keyok = TRUE;
 }
 
 /*
-**  DKIMF_DB_HP_DEAD -- report that a handle found in the pool was dead
+**  DKIMF_DB_TRACE -- charge this thread's lookups to an accumulator
 **
 **  Parameters:
-**  	pool -- handle pool to be updated
+**  	dbt -- accumulator to update on each dkimf_db_get(), or NULL to stop
 **
 **  Return value:
 **  	None.
 **
 **  Notes:
-**  	The caller is expected to identify a dead handle and deallocate it.
+**  	Only the outermost dkimf_db_get() is timed; lookups it makes on
+**  	other databases (e.g. an LDAP cache) are part of its own time.
 */
 
-static void
-dkimf_db_hp_dead(struct handle_pool *pool)
+void
+dkimf_db_trace(struct dkimf_db_timing *dbt)
 {
-	assert(pool != NULL);
+	(void) pthread_once(&trace_once, dkimf_db_trace_init);
 
-	pthread_mutex_lock(&pool->hp_lock);
-	pool->hp_alloc--;
-	pthread_cond_signal(&pool->hp_signal);
-	pthread_mutex_unlock(&pool->hp_lock);
+	if (trace_keyok)
+		(void) pthread_setspecific(trace_key, dbt);
 }
 
 /*
-**  DKIMF_DB_HP_PUT -- put a handle back into a handle pool after use
+**  DKIMF_DB_OBSERVE -- register a function to be told about every lookup
 **
 **  Parameters:
-**  	pool -- pool from which to get a handle
-**  	handle -- handle being returned
+**  	func -- function to call with the data set type and the duration
+**  	        of each dkimf_db_get() in microseconds, or NULL to stop
 **
 **  Return value:
 **  	None.
-*/
-
-static void
-dkimf_db_hp_put(struct handle_pool *pool, void *handle)
-{
-	assert(pool != NULL);
-	assert(handle != NULL);
-
-	pthread_mutex_lock(&pool->hp_lock);
-
-	/* need to grow the array? */
-	if (pool->hp_asize == pool->hp_count)
-	{
-		u_int newasz;
-
-		if (pool->hp_asize == 0)
-		{
-			newasz = DKIMF_DB_DEFASIZE;
-			pool->hp_handles = (void **) malloc(newasz * sizeof(void *));
-			assert(pool->hp_handles != NULL);
-		}
-		else
-		{
-			void **newa;
-
-			newasz = pool->hp_asize * 2;
-			newa = (void **) realloc(pool->hp_handles,
-			                         newasz * sizeof(void *));
-			assert(newa != NULL);
-			pool->hp_handles = newa;
-		}
-
-		pool->hp_asize = newasz;
-	}
-
-	/* append it */
-	pool->hp_handles[pool->hp_count] = handle;
-
-	/* increment the count */
-	pool->hp_count++;
-
-	/* signal any waiters */
-	pthread_cond_signal(&pool->hp_signal);
-
-	/* all done */
-	pthread_mutex_unlock(&pool->hp_lock);
-}
-
-#endif /* _FFR_DB_HANDLE_POOLS */
-
-/*
-**  DKIMF_DB_FLAGS -- set global flags
-**
-**  Parameters:
-**  	flags -- new global flag mask
 **
-**  Return value:
-**  	None.
+**  Notes:
+**  	Should be called before any worker threads are started.
 */
 
 void
-dkimf_db_flags(unsigned int flags)
+dkimf_db_observe(void (*func)(int, uint64_t))
 {
-	gflags = flags;
+	db_observer = func;
 }
 
 #if (USE_SASL && USE_LDAP)
@@ -1309,71 +1188,631 @@ dkimf_db_open_sql(struct dkimf_db_dsn *dsn, odbx_t **odbx, char **err)
 
 	return 0;
 }
-#endif /* USE_ODBX */
 
 /*
-**  DKIMF_DB_TYPE -- return database type
+**  DKIMF_DB_SQL_ERRTYPE -- classify an SQL error
 **
 **  Parameters:
-**  	db -- DKIMF_DB handle
-** 
+**  	odbx -- ODBX handle on which the error occurred
+**  	err -- error code
+**
 **  Return value:
-**  	A DKIMF_DB_TYPE_* constant.
+**  	As for odbx_error_type(); negative means the connection is unusable.
 */
 
-int
-dkimf_db_type(DKIMF_DB db)
+static int
+dkimf_db_sql_errtype(odbx_t *odbx, int err)
 {
-	assert(db != NULL);
+	int status;
 
-	return db->db_type;
+	status = odbx_error_type(odbx, err);
+
+#ifdef _FFR_POSTGRESQL_RECONNECT_HACK
+	if (status >= 0)
+	{
+		const char *estr;
+
+		estr = odbx_error(odbx, err);
+
+		if (estr != NULL && strncmp(estr, "FATAL:", 6) == 0)
+			status = -1;
+	}
+#endif /* _FFR_POSTGRESQL_RECONNECT_HACK */
+
+	return status;
 }
 
-#ifdef USE_ERLANG
 /*
-**  DKIMF_DB_ERL_CONNECT -- connect to a distributed Erlang node
+**  DKIMF_DB_SQL_PROBE -- confirm an SQL connection is still usable
 **
 **  Parameters:
-**	db -- DKIMF_DB handle
-**	ecp -- Pointer to ei_cnode
+**  	dsn -- connection description
+**  	odbx -- ODBX handle to test
 **
 **  Return value:
-**	File descriptor or -1 on error.
+**  	TRUE iff the lookup statement could be run to completion.
+**
+**  Notes:
+**  	The probe runs the data set's own lookup for an empty key rather
+**  	than something like "SELECT 1", which not every backend accepts.
 */
 
-static int
-dkimf_db_erl_connect(DKIMF_DB db, ei_cnode *ecp)
+static _Bool
+dkimf_db_sql_probe(struct dkimf_db_dsn *dsn, odbx_t *odbx)
 {
-	int fd;
-	int ret;
-	int instance;
-	unsigned int seed;
-	char node_name[12];
-	struct timeval tv;
-	char *q;
-	char *last;
-	struct dkimf_db_erlang *e;
-
-	gettimeofday(&tv, NULL);
-	seed = tv.tv_sec * tv.tv_usec;
-	instance = rand_r(&seed) % 999;
+	int err;
+	odbx_result_t *result;
+	char query[DKIMF_DB_QUERYSZ];
 
-	e = (struct dkimf_db_erlang *) db->db_data;
+	assert(dsn != NULL);
+	assert(odbx != NULL);
 
-	snprintf(node_name, sizeof node_name, "opendkim%d", instance);
+	snprintf(query, sizeof query, "%s%s", dsn->dsn_query, dsn->dsn_qtail);
 
-	ret = ei_connect_init(ecp, node_name, e->erlang_cookie, instance);
-	if (ret != 0)
-		return -1;
+	if (odbx_query(odbx, query, 0) < 0)
+		return FALSE;
 
-	fd = -1;
-	for (q = strtok_r(e->erlang_nodes, ",", &last);
-	     q != NULL;
-	     q = strtok_r(NULL, ",", &last))
+	for (;;)
 	{
-		fd = ei_connect(ecp, q);
-		if (fd >= 0)
-			break;
+		result = NULL;
+		err = odbx_result(odbx, &result, NULL, 0);
+		if (err < 0)
+		{
+			if (result != NULL)
+				(void) odbx_result_finish(result);
+			return FALSE;
+		}
+		else if (err == ODBX_RES_DONE)
+		{
+			(void) odbx_result_finish(result);
+			return TRUE;
+		}
+
+		do
+		{
+			err = odbx_row_fetch(result);
+		} while (err > 0);
+
+		(void) odbx_result_finish(result);
+
+		if (err < 0)
+			return FALSE;
+	}
+}
+
+/*
+**  DKIMF_DB_HP_CONNECT -- make a new handle for a handle pool
+**
+**  Parameters:
+**  	pool -- pool for which a handle is needed
+**  	handle -- new handle (returned)
+**  	err -- error string (returned)
+**
+**  Return value:
+**  	0 on success, a DB-specific error code otherwise.
+*/
+
+static int
+dkimf_db_hp_connect(struct handle_pool *pool, void **handle, char **err)
+{
+	assert(pool != NULL);
+	assert(handle != NULL);
+
+	switch (pool->hp_dbtype)
+	{
+	  case DKIMF_DB_TYPE_DSN:
+	  {
+		int dberr;
+		odbx_t *odbx = NULL;
+
+		dberr = dkimf_db_open_sql((struct dkimf_db_dsn *) pool->hp_hdata,
+		                          &odbx, err);
+		if (dberr < 0)
+			return dberr;
+
+		*handle = odbx;
+		return 0;
+	  }
+
+	  default:
+		assert(0);
+		return -1;
+	}
+}
+
+/*
+**  DKIMF_DB_HP_DISCONNECT -- destroy a handle that belonged to a pool
+**
+**  Parameters:
+**  	pool -- pool that owned the handle
+**  	handle -- handle to destroy
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_db_hp_disconnect(struct handle_pool *pool, void *handle)
+{
+	assert(pool != NULL);
+	assert(handle != NULL);
+
+	switch (pool->hp_dbtype)
+	{
+	  case DKIMF_DB_TYPE_DSN:
+		(void) odbx_unbind((odbx_t *) handle);
+		(void) odbx_finish((odbx_t *) handle);
+		break;
+
+	  default:
+		break;
+	}
+}
+
+/*
+**  DKIMF_DB_HP_CHECK -- health check on a handle that has been idle
+**
+**  Parameters:
+**  	pool -- pool that owns the handle
+**  	handle -- handle to check
+**
+**  Return value:
+**  	TRUE iff the handle appears to be usable.
+*/
+
+static _Bool
+dkimf_db_hp_check(struct handle_pool *pool, void *handle)
+{
+	assert(pool != NULL);
+	assert(handle != NULL);
+
+	switch (pool->hp_dbtype)
+	{
+	  case DKIMF_DB_TYPE_DSN:
+		return dkimf_db_sql_probe((struct dkimf_db_dsn *) pool->hp_hdata,
+		                          (odbx_t *) handle);
+
+	  default:
+		return TRUE;
+	}
+}
+
+/*
+**  DKIMF_DB_HP_NEW -- create a handle pool
+**
+**  Parameters:
+**  	type -- DB type
+**  	min -- number of handles to keep open even when idle
+**  	max -- maximum pool size
+**  	hdata -- data needed to make new handles
+**
+**  Return value:
+**  	Pointer to a newly-allocated handle pool, or NULL on error.
+*/
+
+static struct handle_pool *
+dkimf_db_hp_new(u_int type, u_int min, u_int max, void *hdata)
+{
+	struct handle_pool *new;
+
+	assert(max > 0);
+	assert(min <= max);
+
+	new = (struct handle_pool *) malloc(sizeof *new);
+	if (new == NULL)
+		return NULL;
+
+	new->hp_handles = (struct handle_entry *) malloc(max * sizeof(struct handle_entry));
+	if (new->hp_handles == NULL)
+	{
+		free(new);
+		return NULL;
+	}
+
+	memset(new->hp_errstr, '\0', sizeof new->hp_errstr);
+	new->hp_alloc = 0;
+	new->hp_count = 0;
+	new->hp_dbtype = type;
+	new->hp_fails = 0;
+	new->hp_hdata = hdata;
+	new->hp_lasterr = 0;
+	new->hp_max = max;
+	new->hp_min = min;
+	new->hp_retry = 0;
+	pthread_mutex_init(&new->hp_lock, NULL);
+	pthread_cond_init(&new->hp_signal, NULL);
+
+	return new;
+}
+
+/*
+**  DKIMF_DB_HP_FILL -- open a pool's minimum number of handles
+**
+**  Parameters:
+**  	pool -- pool to fill
+**  	err -- error string (returned)
+**
+**  Return value:
+**  	0 on success, a DB-specific error code otherwise.
+**
+**  Notes:
+**  	Meant to be called before the pool is shared with other threads.
+*/
+
+static int
+dkimf_db_hp_fill(struct handle_pool *pool, char **err)
+{
+	int dberr;
+	void *handle;
+
+	assert(pool != NULL);
+
+	while (pool->hp_alloc < pool->hp_min)
+	{
+		dberr = dkimf_db_hp_connect(pool, &handle, err);
+		if (dberr != 0)
+		{
+			pool->hp_lasterr = dberr;
+			if (err != NULL && *err != NULL)
+			{
+				strlcpy(pool->hp_errstr, *err,
+				        sizeof pool->hp_errstr);
+			}
+			return dberr;
+		}
+
+		pool->hp_handles[pool->hp_count].he_handle = handle;
+		(void) time(&pool->hp_handles[pool->hp_count].he_used);
+		pool->hp_count++;
+		pool->hp_alloc++;
+	}
+
+	return 0;
+}
+
+/*
+**  DKIMF_DB_HP_FREE -- free a handle pool
+**
+**  Parameters:
+**  	pool -- bool to free up
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_db_hp_free(struct handle_pool *pool)
+{
+	u_int c;
+
+	assert(pool != NULL);
+
+	for (c = 0; c < pool->hp_count; c++)
+		dkimf_db_hp_disconnect(pool, pool->hp_handles[c].he_handle);
+
+	pthread_mutex_destroy(&pool->hp_lock);
+	pthread_cond_destroy(&pool->hp_signal);
+	free(pool->hp_handles);
+	free(pool);
+}
+
+/*
+**  DKIMF_DB_HP_GET -- get a handle from a handle pool
+**
+**  Parameters:
+**  	pool -- pool from which to get a handle
+**  	err -- error code (returned)
+**  	fresh -- set to TRUE iff the handle was just created (returned)
+**
+**  Return value:
+**  	A handle appropriate to the associated DB type that is not currently
+**  	in use by another thread, or NULL on error.
+**
+**  Notes:
+**  	The most recently used handle is handed out first so that, under
+**  	light load, the rest go idle and can be trimmed by dkimf_db_hp_put().
+**  	A handle that has sat unused for DKIMF_DB_POOLIDLE seconds is probed
+**  	before it is returned.  After a failed connection attempt, new ones
+**  	are not tried again until an exponentially growing delay has passed;
+**  	until then callers wait for a busy handle, or fail at once if there
+**  	are none.
+*/
+
+static void *
+dkimf_db_hp_get(struct handle_pool *pool, int *err, _Bool *fresh)
+{
+	int dberr;
+	time_t now;
+	void *ret;
+	char *estr;
+
+	assert(pool != NULL);
+	assert(err != NULL);
+	assert(fresh != NULL);
+
+	pthread_mutex_lock(&pool->hp_lock);
+
+	for (;;)
+	{
+		/* if one is available, return it */
+		if (pool->hp_count > 0)
+		{
+			struct handle_entry *he;
+
+			pool->hp_count--;
+			he = &pool->hp_handles[pool->hp_count];
+			ret = he->he_handle;
+
+			(void) time(&now);
+			if (now - he->he_used < DKIMF_DB_POOLIDLE)
+			{
+				pthread_mutex_unlock(&pool->hp_lock);
+				*fresh = FALSE;
+				return ret;
+			}
+
+			/* been idle a while; make sure it's still alive */
+			pthread_mutex_unlock(&pool->hp_lock);
+
+			if (dkimf_db_hp_check(pool, ret))
+			{
+				*fresh = FALSE;
+				return ret;
+			}
+
+			dkimf_db_hp_disconnect(pool, ret);
+
+			pthread_mutex_lock(&pool->hp_lock);
+			pool->hp_alloc--;
+			continue;
+		}
+
+		/* if we can allocate one, do so */
+		if (pool->hp_alloc < pool->hp_max)
+		{
+			(void) time(&now);
+
+			if (now < pool->hp_retry)
+			{
+				if (pool->hp_alloc > 0)
+				{
+					pthread_cond_wait(&pool->hp_signal,
+					                  &pool->hp_lock);
+					continue;
+				}
+
+				*err = pool->hp_lasterr;
+				pthread_mutex_unlock(&pool->hp_lock);
+				return NULL;
+			}
+
+			/* reserve the slot, then connect without the lock */
+			pool->hp_alloc++;
+			pthread_mutex_unlock(&pool->hp_lock);
+
+			ret = NULL;
+			estr = NULL;
+			dberr = dkimf_db_hp_connect(pool, &ret, &estr);
+
+			pthread_mutex_lock(&pool->hp_lock);
+
+			if (dberr != 0)
+			{
+				u_int c;
+				time_t backoff = 1;
+
+				pool->hp_alloc--;
+				pool->hp_fails++;
+				pool->hp_lasterr = dberr;
+				strlcpy(pool->hp_errstr,
+				        estr == NULL ? "" : estr,
+				        sizeof pool->hp_errstr);
+
+				for (c = 1;
+				     c < pool->hp_fails &&
+				     backoff < DKIMF_DB_POOLBACKOFF;
+				     c++)
+					backoff *= 2;
+
+				pool->hp_retry = now + MIN(backoff,
+				                           DKIMF_DB_POOLBACKOFF);
+
+				pthread_cond_signal(&pool->hp_signal);
+				pthread_mutex_unlock(&pool->hp_lock);
+
+				*err = dberr;
+				return NULL;
+			}
+
+			pool->hp_fails = 0;
+			pool->hp_retry = 0;
+
+			pthread_mutex_unlock(&pool->hp_lock);
+
+			*fresh = TRUE;
+			return ret;
+		}
+
+		/* already full; wait for one */
+		pthread_cond_wait(&pool->hp_signal, &pool->hp_lock);
+	}
+}
+
+/*
+**  DKIMF_DB_HP_DEAD -- report that a handle found in the pool was dead
+**
+**  Parameters:
+**  	pool -- handle pool to be updated
+**  	handle -- the dead handle
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	The handle is destroyed; its slot becomes available for a new one.
+*/
+
+static void
+dkimf_db_hp_dead(struct handle_pool *pool, void *handle)
+{
+	assert(pool != NULL);
+	assert(handle != NULL);
+
+	dkimf_db_hp_disconnect(pool, handle);
+
+	pthread_mutex_lock(&pool->hp_lock);
+	pool->hp_alloc--;
+	pthread_cond_signal(&pool->hp_signal);
+	pthread_mutex_unlock(&pool->hp_lock);
+}
+
+/*
+**  DKIMF_DB_HP_PUT -- put a handle back into a handle pool after use
+**
+**  Parameters:
+**  	pool -- pool from which to get a handle
+**  	handle -- handle being returned
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	If the pool holds more than its minimum and its least recently
+**  	used handle has been idle for DKIMF_DB_POOLIDLE seconds, that
+**  	handle is closed.
+*/
+
+static void
+dkimf_db_hp_put(struct handle_pool *pool, void *handle)
+{
+	time_t now;
+	void *idle = NULL;
+
+	assert(pool != NULL);
+	assert(handle != NULL);
+
+	(void) time(&now);
+
+	pthread_mutex_lock(&pool->hp_lock);
+
+	assert(pool->hp_count < pool->hp_alloc);
+
+	/* append it */
+	pool->hp_handles[pool->hp_count].he_handle = handle;
+	pool->hp_handles[pool->hp_count].he_used = now;
+	pool->hp_count++;
+
+	/* trim the oldest one if it's surplus */
+	if (pool->hp_alloc > pool->hp_min && pool->hp_count > 1 &&
+	    now - pool->hp_handles[0].he_used >= DKIMF_DB_POOLIDLE)
+	{
+		idle = pool->hp_handles[0].he_handle;
+		pool->hp_count--;
+		pool->hp_alloc--;
+		memmove(&pool->hp_handles[0], &pool->hp_handles[1],
+		        sizeof(struct handle_entry) * pool->hp_count);
+	}
+
+	/* signal any waiters */
+	pthread_cond_signal(&pool->hp_signal);
+
+	/* all done */
+	pthread_mutex_unlock(&pool->hp_lock);
+
+	if (idle != NULL)
+		dkimf_db_hp_disconnect(pool, idle);
+}
+
+/*
+**  DKIMF_DB_SQL_ERROR -- record an SQL error against a data set
+**
+**  Parameters:
+**  	db -- DKIMF_DB handle
+**  	odbx -- ODBX handle on which the error occurred
+**  	err -- error code
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_db_sql_error(DKIMF_DB db, odbx_t *odbx, int err)
+{
+	struct handle_pool *pool;
+
+	pool = (struct handle_pool *) db->db_handle;
+
+	pthread_mutex_lock(&pool->hp_lock);
+	db->db_status = err;
+	strlcpy(pool->hp_errstr, odbx_error(odbx, err),
+	        sizeof pool->hp_errstr);
+	pthread_mutex_unlock(&pool->hp_lock);
+}
+#endif /* USE_ODBX */
+
+/*
+**  DKIMF_DB_TYPE -- return database type
+**
+**  Parameters:
+**  	db -- DKIMF_DB handle
+** 
+**  Return value:
+**  	A DKIMF_DB_TYPE_* constant.
+*/
+
+int
+dkimf_db_type(DKIMF_DB db)
+{
+	assert(db != NULL);
+
+	return db->db_type;
+}
+
+#ifdef USE_ERLANG
+/*
+**  DKIMF_DB_ERL_CONNECT -- connect to a distributed Erlang node
+**
+**  Parameters:
+**	db -- DKIMF_DB handle
+**	ecp -- Pointer to ei_cnode
+**
+**  Return value:
+**	File descriptor or -1 on error.
+*/
+
+static int
+dkimf_db_erl_connect(DKIMF_DB db, ei_cnode *ecp)
+{
+	int fd;
+	int ret;
+	int instance;
+	unsigned int seed;
+	char node_name[12];
+	struct timeval tv;
+	char *q;
+	char *last;
+	struct dkimf_db_erlang *e;
+
+	gettimeofday(&tv, NULL);
+	seed = tv.tv_sec * tv.tv_usec;
+	instance = rand_r(&seed) % 999;
+
+	e = (struct dkimf_db_erlang *) db->db_data;
+
+	snprintf(node_name, sizeof node_name, "opendkim%d", instance);
+
+	ret = ei_connect_init(ecp, node_name, e->erlang_cookie, instance);
+	if (ret != 0)
+		return -1;
+
+	fd = -1;
+	for (q = strtok_r(e->erlang_nodes, ",", &last);
+	     q != NULL;
+	     q = strtok_r(NULL, ",", &last))
+	{
+		fd = ei_connect(ecp, q);
+		if (fd >= 0)
+			break;
 	}
 	if (fd < 0)
 		return -1;
@@ -1783,69 +2222,307 @@ dkimf_db_erl_decode_response(ei_x_buff *resp, const char *notfound,
 }
 #endif /* USE_ERLANG */
 
+#ifdef DKIMF_DB_BDB_SHARED
 /*
-**  DKIMF_DB_OPEN -- open a database
+**  DKIMF_DB_BDB_OPEN -- open a read-only Berkeley DB for shared use
 **
 **  Parameters:
-**  	db -- DKIMF_DB handle (returned)
-**  	name -- name of DB to open
-**  	flags -- operational flags
-**  	lock -- lock to use during operations
-**  	err -- error string from underlying library (returned; may be NULL)
+**  	path -- file to open
+**  	envp -- environment (returned)
+**  	dbp -- database handle (returned)
+**  	sb -- status of the file opened (returned)
 **
 **  Return value:
-**  	3 -- other open error
-**  	2 -- illegal request (e.g. writable flat file)
-**  	1 -- unknown database type
-**  	0 -- success
-**   	-1 -- failure; check errno
+**  	0 on success, a Berkeley DB or errno value otherwise.
 **
 **  Notes:
-**  	The type of the database is implied by a leading "type:" string
-**  	as part of "name".  The list of valid types is listed in the
-**  	"dbtypes" table above.  Without such a prefix, a name that starts
-**  	with "/" implies "file", otherwise "csl" is used.
+**  	Each file gets its own private, memory-only environment with a
+**  	buffer pool, and a free-threaded (DB_THREAD) handle, so any number
+**  	of threads can read from it at once without further locking.
+*/
+
+static int
+dkimf_db_bdb_open(char *path, DB_ENV **envp, DB **dbp, struct stat *sb)
+{
+	int status;
+	DB_ENV *env;
+	DB *bdb;
+
+	assert(path != NULL);
+	assert(envp != NULL);
+	assert(dbp != NULL);
+	assert(sb != NULL);
+
+	if (stat(path, sb) != 0)
+		return errno;
+
+	status = db_env_create(&env, 0);
+	if (status != 0)
+		return status;
+
+	status = env->set_cachesize(env, 0, DKIMF_DB_BDB_CACHESZ, 1);
+	if (status == 0)
+	{
+		status = env->open(env, NULL,
+		                   DB_CREATE | DB_PRIVATE | DB_INIT_MPOOL |
+		                   DB_THREAD, 0);
+	}
+
+	if (status != 0)
+	{
+		(void) env->close(env, 0);
+		return status;
+	}
+
+	status = db_create(&bdb, env, 0);
+	if (status != 0)
+	{
+		(void) env->close(env, 0);
+		return status;
+	}
+
+	status = bdb->open(bdb, NULL, path, NULL, DB_UNKNOWN,
+	                   DB_RDONLY | DB_THREAD, 0);
+	if (status != 0)
+	{
+		(void) DKIMF_DBCLOSE(bdb);
+		(void) env->close(env, 0);
+		return status;
+	}
+
+	*envp = env;
+	*dbp = bdb;
+
+	return 0;
+}
+
+/*
+**  DKIMF_DB_BDB_CHECK -- reopen a shared Berkeley DB if it was replaced
 **
-**  	Currently defined types:
-**  	csl -- "name" contains a comma-separated list
-**  	file -- a flat file; may be simply a list of names if only a
-**  	        memership test is needed, or it can be "key value" lines
-**  	        in which case dkimf_db_get() can be used to extract the
-**  	        value of a named key
-**  	refile -- a flat file containing patterns (i.e. strings with the
-**  	          wildcard "*"); only membership tests are allowed
-**  	db -- a Sleepycat hash or b-tree database file, which can be used
-**  	      for membership tests or key-value pairs
-**  	dsn -- a data store name, meaning SQL or ODBC in the backend,
-**  	       with interface provided by OpenDBX
-**  	ldap -- an LDAP server, interace provide by OpenLDAP
-**  	lua -- a Lua script; the returned value is the result
-**  	erlang -- an erlang function to be called in a distributed erlang node
+**  Parameters:
+**  	db -- DKIMF_DB handle
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	At most one thread per DKIMF_DB_BDB_CHECKINT seconds looks at the
+**  	file; the others carry on with the handle they have.  A file
+**  	that is renamed into place is picked up this way.  Rewriting
+**  	the file in place is not supported: lookups take no file lock,
+**  	so they may see it while it is inconsistent.
+**
+**  	While a walk is in progress the swap is put off to a later check,
+**  	so neither the walking thread nor any other waits on it.
 */
 
-int
-dkimf_db_open(DKIMF_DB *db, char *name, u_int flags, pthread_mutex_t *lock,
-              char **err)
+static void
+dkimf_db_bdb_check(DKIMF_DB db)
 {
-	DKIMF_DB new;
-	char *comma;
-	char *p;
+	int status;
+	time_t now;
+	struct dkimf_db_bdb *bdbs;
+	DB_ENV *env;
+	DB_ENV *oldenv;
+	DB *bdb;
+	DB *olddb;
+	struct stat sb;
 
-	assert(db != NULL);
-	assert(name != NULL);
+	bdbs = (struct dkimf_db_bdb *) db->db_data;
 
-	new = (DKIMF_DB) malloc(sizeof(struct dkimf_db));
-	if (new == NULL)
+	(void) time(&now);
+
+	if (now - __atomic_load_n(&bdbs->bdb_checked, __ATOMIC_RELAXED) <
+	    DKIMF_DB_BDB_CHECKINT ||
+	    pthread_mutex_trylock(&bdbs->bdb_checklock) != 0)
+		return;
+
+	if (now - bdbs->bdb_checked < DKIMF_DB_BDB_CHECKINT)
 	{
-		if (err != NULL)
-			*err = strerror(errno);
-		return -1;
+		pthread_mutex_unlock(&bdbs->bdb_checklock);
+		return;
 	}
 
-	memset(new, '\0', sizeof(struct dkimf_db));
+	__atomic_store_n(&bdbs->bdb_checked, now, __ATOMIC_RELAXED);
 
-	new->db_flags = (flags | gflags);
-	new->db_type = DKIMF_DB_TYPE_UNKNOWN;
+	if (stat(bdbs->bdb_path, &sb) != 0 ||
+	    (sb.st_dev == bdbs->bdb_dev && sb.st_ino == bdbs->bdb_ino &&
+	     sb.st_mtime == bdbs->bdb_mtime && sb.st_size == bdbs->bdb_size))
+	{
+		pthread_mutex_unlock(&bdbs->bdb_checklock);
+		return;
+	}
+
+	/* don't pull the handle out from under a walk; try again later */
+	if (__atomic_load_n(&bdbs->bdb_walking, __ATOMIC_ACQUIRE))
+	{
+		pthread_mutex_unlock(&bdbs->bdb_checklock);
+		return;
+	}
+
+	/* changed; open the new one before taking anything away */
+	status = dkimf_db_bdb_open(bdbs->bdb_path, &env, &bdb, &sb);
+	if (status != 0)
+	{
+		db->db_status = status;
+		pthread_mutex_unlock(&bdbs->bdb_checklock);
+		return;
+	}
+
+	pthread_rwlock_wrlock(&bdbs->bdb_rwlock);
+
+	if (bdbs->bdb_walking)
+	{
+		pthread_rwlock_unlock(&bdbs->bdb_rwlock);
+		(void) DKIMF_DBCLOSE(bdb);
+		(void) env->close(env, 0);
+		pthread_mutex_unlock(&bdbs->bdb_checklock);
+		return;
+	}
+
+	olddb = (DB *) db->db_handle;
+	oldenv = bdbs->bdb_env;
+
+	db->db_handle = bdb;
+	bdbs->bdb_env = env;
+	bdbs->bdb_dev = sb.st_dev;
+	bdbs->bdb_ino = sb.st_ino;
+	bdbs->bdb_mtime = sb.st_mtime;
+	bdbs->bdb_size = sb.st_size;
+
+	pthread_rwlock_unlock(&bdbs->bdb_rwlock);
+
+	(void) DKIMF_DBCLOSE(olddb);
+	(void) oldenv->close(oldenv, 0);
+
+	pthread_mutex_unlock(&bdbs->bdb_checklock);
+}
+
+/*
+**  DKIMF_DB_BDB_WALKEND -- end a walk of a shared Berkeley DB
+**
+**  Parameters:
+**  	db -- DKIMF_DB handle
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Closes the walk's cursor, if any, and releases the read lock the
+**  	walk has held since it began.  This has to be done by the thread
+**  	that started the walk; dkimf_db_walk() does it when a walk ends,
+**  	fails or is restarted, and dkimf_db_close() when it is abandoned.
+*/
+
+static void
+dkimf_db_bdb_walkend(DKIMF_DB db)
+{
+	DBC *dbc;
+	struct dkimf_db_bdb *bdbs;
+
+	bdbs = (struct dkimf_db_bdb *) db->db_data;
+
+	if (!bdbs->bdb_walking)
+		return;
+
+	dbc = (DBC *) db->db_cursor;
+	if (dbc != NULL)
+		(void) dbc->c_close(dbc);
+	db->db_cursor = NULL;
+
+	pthread_rwlock_unlock(&bdbs->bdb_rwlock);
+	__atomic_store_n(&bdbs->bdb_walking, FALSE, __ATOMIC_RELEASE);
+}
+
+/*
+**  DKIMF_DB_BDB_GET -- look up a key in a shared Berkeley DB
+**
+**  Parameters:
+**  	As for dkimf_db_get().
+**
+**  Return value:
+**  	As for dkimf_db_get().
+*/
+
+static int
+dkimf_db_bdb_get(DKIMF_DB db, void *buf, size_t buflen,
+                 DKIMF_DBDATA req, unsigned int reqnum, _Bool *exists)
+{
+	int ret = 0;
+	int status;
+	struct dkimf_db_bdb *bdbs;
+	DB *bdb;
+	DBT d;
+	DBT q;
+	char databuf[BUFRSZ + 1];
+
+	bdbs = (struct dkimf_db_bdb *) db->db_data;
+
+	dkimf_db_bdb_check(db);
+
+	memset(&d, 0, sizeof d);
+	memset(&q, 0, sizeof q);
+	q.data = (char *) buf;
+	q.size = (buflen == 0 ? strlen(q.data) : buflen);
+
+	d.flags = DB_DBT_USERMEM;
+	d.ulen = BUFRSZ;
+	d.data = databuf;
+	d.size = BUFRSZ;
+
+	memset(databuf, '\0', sizeof databuf);
+
+	pthread_rwlock_rdlock(&bdbs->bdb_rwlock);
+
+	bdb = (DB *) db->db_handle;
+	status = bdb->get(bdb, NULL, &q, &d, 0);
+
+	pthread_rwlock_unlock(&bdbs->bdb_rwlock);
+
+	if (status == 0)
+	{
+		if (exists != NULL)
+			*exists = TRUE;
+
+		if (reqnum != 0)
+			ret = dkimf_db_datasplit(databuf, d.size, req, reqnum);
+	}
+	else if (status == DB_NOTFOUND)
+	{
+		if (exists != NULL)
+			*exists = FALSE;
+	}
+	else
+	{
+		db->db_status = status;
+		ret = status;
+	}
+
+	return ret;
+}
+#endif /* DKIMF_DB_BDB_SHARED */
+
+/*
+**  DKIMF_DB_NAMETYPE -- determine the type of data set a name describes
+**
+**  Parameters:
+**  	name -- data set name, possibly with a "type:" prefix
+**  	rest -- where to return the part of "name" after any prefix
+**  	        (may be NULL)
+**
+**  Return value:
+**  	A DKIMF_DB_TYPE_* constant, or DKIMF_DB_TYPE_UNKNOWN if the prefix
+**  	names no supported type.
+*/
+
+static int
+dkimf_db_nametype(char *name, char **rest)
+{
+	int type = DKIMF_DB_TYPE_UNKNOWN;
+	char *comma;
+	char *p;
+
+	assert(name != NULL);
 
 	p = strchr(name, ':');
 	comma = strchr(name, ',');
@@ -1865,13 +2542,13 @@ dkimf_db_open(DKIMF_DB *db, char *name, u_int flags, pthread_mutex_t *lock,
 		     p = strstr(p + 1, ".db"))
 			q = p;
 		if (q != NULL && *(q + 3) == '\0')
-			new->db_type = DKIMF_DB_TYPE_BDB;
+			type = DKIMF_DB_TYPE_BDB;
 		else
 # endif /* USE_DB */
 		if (name[0] == '/')
-			new->db_type = DKIMF_DB_TYPE_FILE;
+			type = DKIMF_DB_TYPE_FILE;
 		else
-			new->db_type = DKIMF_DB_TYPE_CSL;
+			type = DKIMF_DB_TYPE_CSL;
 		p = name;
 	}
 	else
@@ -1880,28 +2557,97 @@ dkimf_db_open(DKIMF_DB *db, char *name, u_int flags, pthread_mutex_t *lock,
 		size_t clen;
 		char dbtype[BUFRSZ + 1];
 
-		memset(dbtype, '\0', sizeof dbtype);
-		clen = MIN(sizeof(dbtype) - 1, p - name);
-		strncpy(dbtype, name, clen);
+		memset(dbtype, '\0', sizeof dbtype);
+		clen = MIN(sizeof(dbtype) - 1, p - name);
+		strncpy(dbtype, name, clen);
+
+		for (c = 0; ; c++)
+		{
+			if (dbtypes[c].name == NULL)
+				break;
+
+			if (strcasecmp(dbtypes[c].name, dbtype) == 0)
+				type = dbtypes[c].code;
+		}
+
+		p++;
+	}
+
+	if (rest != NULL)
+		*rest = p;
+
+	return type;
+}
+
+/*
+**  DKIMF_DB_OPEN -- open a database
+**
+**  Parameters:
+**  	db -- DKIMF_DB handle (returned)
+**  	name -- name of DB to open
+**  	flags -- operational flags
+**  	lock -- lock to use during operations
+**  	err -- error string from underlying library (returned; may be NULL)
+**
+**  Return value:
+**  	3 -- other open error
+**  	2 -- illegal request (e.g. writable flat file)
+**  	1 -- unknown database type
+**  	0 -- success
+**   	-1 -- failure; check errno
+**
+**  Notes:
+**  	The type of the database is implied by a leading "type:" string
+**  	as part of "name".  The list of valid types is listed in the
+**  	"dbtypes" table above.  Without such a prefix, a name that starts
+**  	with "/" implies "file", otherwise "csl" is used.
+**
+**  	Currently defined types:
+**  	csl -- "name" contains a comma-separated list
+**  	file -- a flat file; may be simply a list of names if only a
+**  	        memership test is needed, or it can be "key value" lines
+**  	        in which case dkimf_db_get() can be used to extract the
+**  	        value of a named key
+**  	refile -- a flat file containing patterns (i.e. strings with the
+**  	          wildcard "*"); only membership tests are allowed
+**  	db -- a Sleepycat hash or b-tree database file, which can be used
+**  	      for membership tests or key-value pairs
+**  	dsn -- a data store name, meaning SQL or ODBC in the backend,
+**  	       with interface provided by OpenDBX
+**  	ldap -- an LDAP server, interace provide by OpenLDAP
+**  	lua -- a Lua script; the returned value is the result
+**  	erlang -- an erlang function to be called in a distributed erlang node
+*/
+
+int
+dkimf_db_open(DKIMF_DB *db, char *name, u_int flags, pthread_mutex_t *lock,
+              char **err)
+{
+	DKIMF_DB new;
+	char *p;
 
-		for (c = 0; ; c++)
-		{
-			if (dbtypes[c].name == NULL)
-				break;
+	assert(db != NULL);
+	assert(name != NULL);
 
-			if (strcasecmp(dbtypes[c].name, dbtype) == 0)
-				new->db_type = dbtypes[c].code;
-		}
+	new = (DKIMF_DB) malloc(sizeof(struct dkimf_db));
+	if (new == NULL)
+	{
+		if (err != NULL)
+			*err = strerror(errno);
+		return -1;
+	}
 
-		if (new->db_type == DKIMF_DB_TYPE_UNKNOWN)
-		{
-			free(new);
-			if (err != NULL)
-				*err = "Unknown database type";
-			return 1;
-		}
+	memset(new, '\0', sizeof(struct dkimf_db));
 
-		p++;
+	new->db_flags = (flags | gflags);
+	new->db_type = dkimf_db_nametype(name, &p);
+
+	if (new->db_type == DKIMF_DB_TYPE_UNKNOWN)
+	{
+		free(new);
+		if (err != NULL)
+			*err = "Unknown database type";
+		return 1;
 	}
 
 	/* force DB accesses to be mutex-protected */
@@ -2476,6 +3222,63 @@ dkimf_db_open(DKIMF_DB *db, char *name, u_int flags, pthread_mutex_t *lock,
 			p = NULL;
 		}
 
+# ifdef DKIMF_DB_BDB_SHARED
+		if (p != NULL &&
+		    (new->db_flags & DKIMF_DB_FLAG_READONLY) != 0)
+		{
+			struct dkimf_db_bdb *bdbs;
+			struct stat sb;
+
+			bdbs = (struct dkimf_db_bdb *) malloc(sizeof *bdbs);
+			if (bdbs == NULL)
+			{
+				if (err != NULL)
+					*err = strerror(errno);
+				free(new);
+				return -1;
+			}
+
+			memset(bdbs, '\0', sizeof *bdbs);
+
+			bdbs->bdb_path = strdup(p);
+			if (bdbs->bdb_path == NULL)
+			{
+				if (err != NULL)
+					*err = strerror(errno);
+				free(bdbs);
+				free(new);
+				return -1;
+			}
+
+			status = dkimf_db_bdb_open(p, &bdbs->bdb_env, &newdb,
+			                           &sb);
+			if (status != 0)
+			{
+				if (err != NULL)
+					*err = DB_STRERROR(status);
+				free(bdbs->bdb_path);
+				free(bdbs);
+				free(new);
+				return 3;
+			}
+
+			bdbs->bdb_dev = sb.st_dev;
+			bdbs->bdb_ino = sb.st_ino;
+			bdbs->bdb_mtime = sb.st_mtime;
+			bdbs->bdb_size = sb.st_size;
+			(void) time(&bdbs->bdb_checked);
+			pthread_mutex_init(&bdbs->bdb_checklock, NULL);
+			pthread_rwlock_init(&bdbs->bdb_rwlock, NULL);
+
+			/* no file lock; see dkimf_db_bdb_check() */
+			new->db_flags |= DKIMF_DB_FLAG_NOFDLOCK;
+			new->db_handle = newdb;
+			new->db_data = bdbs;
+
+			break;
+		}
+# endif /* DKIMF_DB_BDB_SHARED */
+
 # if DB_VERSION_CHECK(3,0,0)
 		status = db_create(&newdb, NULL, 0);
 		if (status == 0)
@@ -2524,7 +3327,8 @@ dkimf_db_open(DKIMF_DB *db, char *name, u_int flags, pthread_mutex_t *lock,
 		char *r;
 		char *eq;
 		char *tmp;
-		odbx_t *odbx;
+		struct handle_pool *pool;
+		char qbuf[DKIMF_DB_QUERYSZ];
 
 		dsn = (struct dkimf_db_dsn *) malloc(sizeof(struct dkimf_db_dsn));
 		if (dsn == NULL)
@@ -2536,6 +3340,8 @@ dkimf_db_open(DKIMF_DB *db, char *name, u_int flags, pthread_mutex_t *lock,
 		}
 
 		memset(dsn, '\0', sizeof *dsn);
+		dsn->dsn_poolmin = DKIMF_DB_POOLMIN;
+		dsn->dsn_poolmax = DKIMF_DB_POOLMAX;
 
 		/*
 		**  General format of a DSN:
@@ -2691,6 +3497,29 @@ dkimf_db_open(DKIMF_DB *db, char *name, u_int flags, pthread_mutex_t *lock,
 				strlcpy(dsn->dsn_datacol, eq + 1,
 				        sizeof dsn->dsn_datacol);
 			}
+			else if (strcasecmp(p, "poolmin") == 0 ||
+			         strcasecmp(p, "poolmax") == 0)
+			{
+				u_long n;
+				char *end;
+
+				n = strtoul(eq + 1, &end, 10);
+				if (*end != '\0' || n > DKIMF_DB_POOLLIMIT)
+				{
+					if (err != NULL)
+						*err = strerror(EINVAL);
+					free((void *) dsn->dsn_filter);
+					free(dsn);
+					free(tmp);
+					free(new);
+					return -1;
+				}
+
+				if (strcasecmp(p, "poolmin") == 0)
+					dsn->dsn_poolmin = n;
+				else
+					dsn->dsn_poolmax = n;
+			}
 			else if (strcasecmp(p, "filter") == 0)
 			{
 				size_t len;
@@ -2734,47 +3563,88 @@ dkimf_db_open(DKIMF_DB *db, char *name, u_int flags, pthread_mutex_t *lock,
 		/* error out if one of the required parameters was absent */
 		if (dsn->dsn_table[0] == '\0' ||
 		    dsn->dsn_keycol[0] == '\0' ||
-		    dsn->dsn_datacol[0] == '\0')
+		    dsn->dsn_datacol[0] == '\0' ||
+		    dsn->dsn_poolmax == 0 ||
+		    dsn->dsn_poolmin > dsn->dsn_poolmax)
 		{
 			if (err != NULL)
 				*err = strerror(EINVAL);
+			free((void *) dsn->dsn_filter);
+			free(dsn);
+			free(tmp);
+			free(new);
+			return -1;
+		}
+
+		/*
+		**  OpenDBX has no prepared statement interface, so assemble
+		**  the lookup statement once here; dkimf_db_get() then only
+		**  has to splice in the escaped key.
+		*/
+
+		dsn->dsn_qlen = snprintf(qbuf, sizeof qbuf,
+		                         "SELECT %s FROM %s WHERE %s = '",
+		                         dsn->dsn_datacol, dsn->dsn_table,
+		                         dsn->dsn_keycol);
+		dsn->dsn_query = strdup(qbuf);
+
+		dsn->dsn_qtlen = snprintf(qbuf, sizeof qbuf, "'%s%s",
+		                          dsn->dsn_filter == NULL ? "" : " AND ",
+		                          dsn->dsn_filter == NULL ? ""
+		                                                  : dsn->dsn_filter);
+		dsn->dsn_qtail = strdup(qbuf);
+
+		if (dsn->dsn_query == NULL || dsn->dsn_qtail == NULL ||
+		    dsn->dsn_qlen + dsn->dsn_qtlen >= DKIMF_DB_QUERYSZ - BUFRSZ)
+		{
+			if (err != NULL)
+			{
+				if (dsn->dsn_query == NULL ||
+				    dsn->dsn_qtail == NULL)
+					*err = strerror(errno);
+				else
+					*err = "SQL lookup statement too long";
+			}
+			free(dsn->dsn_query);
+			free(dsn->dsn_qtail);
+			free((void *) dsn->dsn_filter);
 			free(dsn);
 			free(tmp);
 			free(new);
 			return -1;
 		}
 
-# ifdef _FFR_DB_HANDLE_POOLS
-		new->db_handle = dkimf_db_hp_new(new->db_type,
-		                                 DEFPOOLMAX, dsn);
-		if (new == NULL)
+		pool = dkimf_db_hp_new(new->db_type, dsn->dsn_poolmin,
+		                       dsn->dsn_poolmax, dsn);
+		if (pool == NULL)
 		{
 			if (err != NULL)
 				*err = strerror(errno);
+			free(dsn->dsn_query);
+			free(dsn->dsn_qtail);
+			free((void *) dsn->dsn_filter);
 			free(dsn);
 			free(tmp);
 			free(new);
 			return -1;
 		}
-# else /* _FFR_DB_HANDLE_POOLS */
-		/* create odbx handle */
-		if (dkimf_db_open_sql(dsn, &odbx, err) < 0)
+
+		/* open the minimum set of connections now */
+		dberr = dkimf_db_hp_fill(pool, err);
+		if (dberr < 0 && (new->db_flags & DKIMF_DB_FLAG_SOFTSTART) == 0)
 		{
-			if ((new->db_flags & DKIMF_DB_FLAG_SOFTSTART) == 0)
-			{
-				free(dsn);
-				free(tmp);
-				free(new);
-				return -1;
-			}
-	
-			new->db_iflags |= DKIMF_DB_IFLAG_RECONNECT;
-			odbx = NULL;
+			dkimf_db_hp_free(pool);
+			free(dsn->dsn_query);
+			free(dsn->dsn_qtail);
+			free((void *) dsn->dsn_filter);
+			free(dsn);
+			free(tmp);
+			free(new);
+			return -1;
 		}
 
 		/* store handle */
-		new->db_handle = (void *) odbx;
-# endif /* _FFR_DB_HANDLE_POOLS */
+		new->db_handle = (void *) pool;
 
 		new->db_data = (void *) dsn;
 
@@ -4046,7 +4916,7 @@ dkimf_db_put(DKIMF_DB db, void *buf, size_t buflen,
 }
 
 /*
-**  DKIMF_DB_GET -- retrieve data from an open database
+**  DKIMF_DB_GET_INT -- retrieve data from an open database
 **
 **  Parameters:
 **  	db -- DB handle to use for searching
@@ -4086,9 +4956,9 @@ dkimf_db_put(DKIMF_DB db, void *buf, size_t buflen,
 **  	and all others will receive no data.
 */
 
-int
-dkimf_db_get(DKIMF_DB db, void *buf, size_t buflen,
-             DKIMF_DBDATA req, unsigned int reqnum, _Bool *exists)
+static int
+dkimf_db_get_int(DKIMF_DB db, void *buf, size_t buflen,
+                 DKIMF_DBDATA req, unsigned int reqnum, _Bool *exists)
 {
 	_Bool matched;
 
@@ -4240,6 +5110,14 @@ dkimf_db_get(DKIMF_DB db, void *buf, size_t buflen,
 		DBT q;
 		char databuf[BUFRSZ + 1];
 
+# ifdef DKIMF_DB_BDB_SHARED
+		if (db->db_data != NULL)
+		{
+			return dkimf_db_bdb_get(db, buf, buflen, req, reqnum,
+			                        exists);
+		}
+# endif /* DKIMF_DB_BDB_SHARED */
+
 		bdb = (DB *) db->db_handle;
 
 		memset(&d, 0, sizeof d);
@@ -4404,7 +5282,7 @@ dkimf_db_get(DKIMF_DB db, void *buf, size_t buflen,
 #ifdef USE_ODBX
 	  case DKIMF_DB_TYPE_DSN:
 	  {
-		_Bool reconnected = FALSE;
+		_Bool fresh = FALSE;
 		int err;
 		int fields;
 		int rescnt = 0;
@@ -4413,204 +5291,92 @@ dkimf_db_get(DKIMF_DB db, void *buf, size_t buflen,
 		odbx_result_t *result;
 		odbx_t *odbx = NULL;
 		struct dkimf_db_dsn *dsn;
-		char query[BUFRSZ];
-		char escaped[BUFRSZ];
+		struct handle_pool *pool;
+		char query[DKIMF_DB_QUERYSZ];
 
 		dsn = (struct dkimf_db_dsn *) db->db_data;
+		pool = (struct handle_pool *) db->db_handle;
 
-# ifdef _FFR_DB_HANDLE_POOLS
-		odbx = dkimf_db_hp_get((struct handle_pool *) db->db_handle,
-		                       &err);
+		odbx = dkimf_db_hp_get(pool, &err, &fresh);
 		if (odbx == NULL)
 		{
 			db->db_status = err;
 			return -1;
 		}
-# else /* _FFR_DB_HANDLE_POOLS */
-		if (db->db_lock != NULL)
-			(void) pthread_mutex_lock(db->db_lock);
-
-		/* see if we need to reopen */
-		if ((db->db_iflags & DKIMF_DB_IFLAG_RECONNECT) != 0)
-		{
-			err = dkimf_db_open_sql(dsn, (odbx_t **) &db->db_handle,
-			                        NULL);
-			if (err < 0)
-			{
-				db->db_status = err;
-				return -1;
-			}
-
-			reconnected = TRUE;
-			db->db_iflags &= ~DKIMF_DB_IFLAG_RECONNECT;
-		}
-
-		odbx = (odbx_t *) db->db_handle;
 
-# endif /* _FFR_DB_HANDLE_POOLS */
-
-		memset(escaped, '\0', sizeof escaped);
-		elen = sizeof escaped - 1;
+		/* splice the escaped key into the lookup statement */
+		memcpy(query, dsn->dsn_query, dsn->dsn_qlen);
+		elen = sizeof query - dsn->dsn_qlen - dsn->dsn_qtlen - 1;
 		err = odbx_escape(odbx, buf,
 		                  (buflen == 0 ? strlen(buf) : buflen),
-		                  escaped, &elen);
+		                  query + dsn->dsn_qlen, &elen);
 		if (err < 0)
 		{
-			db->db_status = err;
-			if (db->db_lock != NULL)
-				(void) pthread_mutex_unlock(db->db_lock);
-
-# ifdef _FFR_DB_HANDLE_POOLS
-			dkimf_db_hp_put((struct handle_pool *) db->db_handle,
-			                (void *) odbx);
-# endif /* _FFR_DB_HANDLE_POOLS */
-
+			dkimf_db_sql_error(db, odbx, err);
+			dkimf_db_hp_put(pool, (void *) odbx);
 			return err;
 		}
 
-		snprintf(query, sizeof query,
-		         "SELECT %s FROM %s WHERE %s = '%s'%s%s",
-		         dsn->dsn_datacol,
-		         dsn->dsn_table,
-		         dsn->dsn_keycol, escaped,
-		         dsn->dsn_filter == NULL ? "" : " AND ",
-		         dsn->dsn_filter == NULL ? "" : dsn->dsn_filter);
+		memcpy(query + dsn->dsn_qlen + elen, dsn->dsn_qtail,
+		       dsn->dsn_qtlen + 1);
 
-		err = odbx_query(odbx, query, 0);
+		err = odbx_query(odbx, query,
+		                 dsn->dsn_qlen + elen + dsn->dsn_qtlen);
 		if (err < 0)
 		{
-			int status;
-
-			db->db_status = err;
+			dkimf_db_sql_error(db, odbx, err);
 
-			if (reconnected)
+			if (dkimf_db_sql_errtype(odbx, err) >= 0)
 			{
-				if (db->db_lock != NULL)
-					(void) pthread_mutex_unlock(db->db_lock);
-# ifdef _FFR_DB_HANDLE_POOLS
-				dkimf_db_hp_put((struct handle_pool *) db->db_handle,
-				                (void *) odbx);
-# endif /* _FFR_DB_HANDLE_POOLS */
-
+				dkimf_db_hp_put(pool, (void *) odbx);
 				return err;
 			}
 
-			status = odbx_error_type(odbx, err);
-
-#ifdef _FFR_POSTGRESQL_RECONNECT_HACK
-			if (status >= 0)
-			{
-				const char *estr;
-
-				estr = odbx_error(odbx, db->db_status);
-
-				if (estr != NULL &&
-				    strncmp(estr, "FATAL:", 6) == 0)
-					status = -1;
-			}
-#endif /* _FFR_POSTGRESQL_RECONNECT_HACK */
-
-			if (status < 0)
-			{
-				(void) odbx_unbind(odbx);
-				(void) odbx_finish(odbx);
-
-# ifdef _FFR_DB_HANDLE_POOLS
-				dkimf_db_hp_dead((struct handle_pool *) db->db_handle);
-# else /* _FFR_DB_HANDLE_POOLS */
-				db->db_iflags |= DKIMF_DB_IFLAG_RECONNECT;
-# endif /* _FFR_DB_HANDLE_POOLS */
-
-				if (db->db_lock != NULL)
-					(void) pthread_mutex_unlock(db->db_lock);
+			/* connection lost; retry once on a new one */
+			dkimf_db_hp_dead(pool, (void *) odbx);
 
-				return dkimf_db_get(db, buf, buflen, req,
-				                    reqnum, exists);
-			}
-			else
-			{
-				if (db->db_lock != NULL)
-					(void) pthread_mutex_unlock(db->db_lock);
+			if (fresh)
 				return err;
-			}
+
+			return dkimf_db_get(db, buf, buflen, req, reqnum,
+			                    exists);
 		}
 
 		for (rescnt = 0; ; rescnt++)
 		{
+			result = NULL;
 			err = odbx_result(odbx, &result, NULL, 0);
 			if (err < 0)
 			{
 				int status;
-				db->db_status = err;
-
-				if (reconnected)
-				{
-					if (db->db_lock != NULL)
-						(void) pthread_mutex_unlock(db->db_lock);
-# ifdef _FFR_DB_HANDLE_POOLS
-					dkimf_db_hp_put((struct handle_pool *) db->db_handle,
-					                (void *) odbx);
-# endif /* _FFR_DB_HANDLE_POOLS */
-					return err;
-				}
-
-				status = odbx_error_type(odbx, err);
 
-#ifdef _FFR_POSTGRESQL_RECONNECT_HACK
-				if (status >= 0)
-				{
-					const char *estr;
-
-					estr = odbx_error(odbx, db->db_status);
+				dkimf_db_sql_error(db, odbx, err);
 
-					if (estr != NULL &&
-					    strncmp(estr, "FATAL:", 6) == 0)
-						status = -1;
-				}
-#endif /* _FFR_POSTGRESQL_RECONNECT_HACK */
+				status = dkimf_db_sql_errtype(odbx, err);
 
 				if (result != NULL)
 					(void) odbx_result_finish(result);
 
-				if (status < 0)
+				if (status >= 0)
 				{
-					(void) odbx_unbind(odbx);
-					(void) odbx_finish(odbx);
-
-# ifdef _FFR_DB_HANDLE_POOLS
-					dkimf_db_hp_dead((struct handle_pool *) db->db_handle);
-# else /* _FFR_DB_HANDLE_POOLS */
-					db->db_iflags |= DKIMF_DB_IFLAG_RECONNECT;
-# endif /* _FFR_DB_HANDLE_POOLS */
-
-					if (db->db_lock != NULL)
-						(void) pthread_mutex_unlock(db->db_lock);
-
-					return dkimf_db_get(db, buf, buflen,
-					                    req, reqnum,
-					                    exists);
+					dkimf_db_hp_put(pool, (void *) odbx);
+					return err;
 				}
 
-				if (db->db_lock != NULL)
-					(void) pthread_mutex_unlock(db->db_lock);
-# ifdef _FFR_DB_HANDLE_POOLS
-				dkimf_db_hp_put((struct handle_pool *) db->db_handle,
-				                (void *) odbx);
-# endif /* _FFR_DB_HANDLE_POOLS */
+				dkimf_db_hp_dead(pool, (void *) odbx);
 
-				return err;
+				if (fresh)
+					return err;
+
+				return dkimf_db_get(db, buf, buflen, req,
+				                    reqnum, exists);
 			}
 			else if (err == ODBX_RES_DONE)
 			{
 				if (exists != NULL && rescnt == 0)
 					*exists = FALSE;
 				err = odbx_result_finish(result);
-				if (db->db_lock != NULL)
-					(void) pthread_mutex_unlock(db->db_lock);
-# ifdef _FFR_DB_HANDLE_POOLS
-				dkimf_db_hp_put((struct handle_pool *) db->db_handle,
-				                (void *) odbx);
-# endif /* _FFR_DB_HANDLE_POOLS */
+				dkimf_db_hp_put(pool, (void *) odbx);
 
 				return 0;
 			}
@@ -4620,14 +5386,9 @@ dkimf_db_get(DKIMF_DB db, void *buf, size_t buflen,
 				err = odbx_row_fetch(result);
 				if (err < 0)
 				{
-					db->db_status = err;
+					dkimf_db_sql_error(db, odbx, err);
 					err = odbx_result_finish(result);
-					if (db->db_lock != NULL)
-						(void) pthread_mutex_unlock(db->db_lock);
-# ifdef _FFR_DB_HANDLE_POOLS
-					dkimf_db_hp_put((struct handle_pool *) db->db_handle,
-					                (void *) odbx);
-# endif /* _FFR_DB_HANDLE_POOLS */
+					dkimf_db_hp_put(pool, (void *) odbx);
 					return db->db_status;
 				}
 				else if (err == ODBX_RES_DONE)
@@ -4684,13 +5445,7 @@ dkimf_db_get(DKIMF_DB db, void *buf, size_t buflen,
 			err = odbx_result_finish(result);
 		}
 
-		if (db->db_lock != NULL)
-			(void) pthread_mutex_unlock(db->db_lock);
-
-# ifdef _FFR_DB_HANDLE_POOLS
-		dkimf_db_hp_put((struct handle_pool *) db->db_handle,
-		                (void *) odbx);
-# endif /* _FFR_DB_HANDLE_POOLS */
+		dkimf_db_hp_put(pool, (void *) odbx);
 
 		return 0;
 	  }
@@ -5464,19 +6219,154 @@ dkimf_db_get(DKIMF_DB db, void *buf, size_t buflen,
 		ei_x_free(&args);
 		ei_x_free(&resp);
 
-		if (ret == -1)
-			db->db_status = erl_errno;
+		if (ret == -1)
+			db->db_status = erl_errno;
+
+		return 0;
+	  }
+#endif /* USE_ERLANG */
+
+	  default:
+		assert(0);
+		return 0;		/* to silence the compiler */
+	}
+
+	/* NOTREACHED */
+}
+
+/*
+**  DKIMF_DB_GET -- retrieve data from an open database
+**
+**  Parameters:
+**  	db -- DB handle to use for searching
+**  	buf -- pointer to the key
+**  	buflen -- length of key (use strlen() if 0)
+**  	req -- list of data requests
+**  	reqnum -- number of data requests
+**  	exists -- pointer to a "_Bool" updated to be TRUE if the record
+**  	          was found, FALSE otherwise (may be NULL)
+**
+**  Return value:
+**  	As for dkimf_db_get_int().
+**
+**  Notes:
+**  	If the calling thread has an accumulator registered with
+**  	dkimf_db_trace(), the lookup is timed and charged to it.  It is
+**  	also reported to any function registered with dkimf_db_observe().
+*/
+
+int
+dkimf_db_get(DKIMF_DB db, void *buf, size_t buflen,
+             DKIMF_DBDATA req, unsigned int reqnum, _Bool *exists)
+{
+	int status;
+	uint64_t usec;
+	struct timespec start;
+	struct timespec end;
+	struct dkimf_db_timing *dbt = NULL;
+
+	if (trace_keyok)
+		dbt = pthread_getspecific(trace_key);
+
+	if (dbt == NULL && db_observer == NULL)
+		return dkimf_db_get_int(db, buf, buflen, req, reqnum, exists);
+
+	if (dbt != NULL)
+		(void) pthread_setspecific(trace_key, NULL);
+	(void) clock_gettime(CLOCK_MONOTONIC, &start);
+
+	status = dkimf_db_get_int(db, buf, buflen, req, reqnum, exists);
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &end);
+
+	usec = (end.tv_sec - start.tv_sec) * 1000000 +
+	       (end.tv_nsec - start.tv_nsec) / 1000;
+
+	if (dbt != NULL)
+	{
+		(void) pthread_setspecific(trace_key, dbt);
+
+		dbt->dbt_usec += usec;
+		dbt->dbt_count++;
+	}
+
+	if (db_observer != NULL)
+		db_observer(db->db_type, usec);
+
+	return status;
+}
+
+/*
+**  DKIMF_DB_PREFETCH -- warm a DB handle for a set of upcoming queries
+**
+**  Parameters:
+**  	db -- DB handle
+**  	keys -- keys that are about to be queried
+**  	nkeys -- number of keys at "keys"
+**
+**  Return value:
+**  	0 on success, -1 on failure.
+**
+**  Notes:
+**  	This is only a hint; data sets for which concurrent lookups
+**  	make no difference just ignore it.  The subsequent calls to
+**  	dkimf_db_get() are still required.
+*/
+
+int
+dkimf_db_prefetch(DKIMF_DB db, const char **keys, unsigned int nkeys)
+{
+	assert(db != NULL);
+	assert(keys != NULL);
 
+	switch (db->db_type)
+	{
+#ifdef _FFR_REPUTATION
+	  case DKIMF_DB_TYPE_REPUTE:
+		if (repute_prefetch((REPUTE) db->db_data, keys,
+		                    nkeys) != REPUTE_STAT_OK)
+			return -1;
 		return 0;
-	  }
-#endif /* USE_ERLANG */
+#endif /* _FFR_REPUTATION */
 
 	  default:
-		assert(0);
-		return 0;		/* to silence the compiler */
+		return 0;
 	}
+}
 
-	/* NOTREACHED */
+/*
+**  DKIMF_DB_CACHETTL -- set the reply cache lifetime of a remote data set
+**
+**  Parameters:
+**  	db -- DB handle
+**  	ttl -- cache lifetime, in seconds; 0 disables caching
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Replies that couldn't be parsed are kept for at most
+**  	REPUTE_NEGCACHE seconds.  Data sets without a reply cache
+**  	ignore this.
+*/
+
+void
+dkimf_db_cachettl(DKIMF_DB db, unsigned int ttl)
+{
+	assert(db != NULL);
+
+	switch (db->db_type)
+	{
+#ifdef _FFR_REPUTATION
+	  case DKIMF_DB_TYPE_REPUTE:
+		repute_set_cachettl((REPUTE) db->db_data, ttl,
+		                    MIN(ttl, REPUTE_NEGCACHE));
+		break;
+#endif /* _FFR_REPUTATION */
+
+	  default:
+		break;
+	}
 }
 
 /*
@@ -5540,15 +6430,37 @@ dkimf_db_close(DKIMF_DB db)
 	  {
 		int status;
 
+# ifdef DKIMF_DB_BDB_SHARED
+		if (db->db_data != NULL)
+			dkimf_db_bdb_walkend(db);
+# endif /* DKIMF_DB_BDB_SHARED */
 # if DB_VERSION_CHECK(2,0,0)
 		if (db->db_cursor != NULL)
 			((DBC *) (db->db_cursor))->c_close((DBC *) db->db_cursor);
 # endif /* DB_VERSION_CHECK(2,0,0) */
 		status = DKIMF_DBCLOSE((DB *) (db->db_handle));
 		if (status != 0)
+		{
 			db->db_status = status;
-		else
-			free(db);
+			return status;
+		}
+
+# ifdef DKIMF_DB_BDB_SHARED
+		if (db->db_data != NULL)
+		{
+			struct dkimf_db_bdb *bdbs;
+
+			bdbs = (struct dkimf_db_bdb *) db->db_data;
+
+			(void) bdbs->bdb_env->close(bdbs->bdb_env, 0);
+			pthread_mutex_destroy(&bdbs->bdb_checklock);
+			pthread_rwlock_destroy(&bdbs->bdb_rwlock);
+			free(bdbs->bdb_path);
+			free(bdbs);
+		}
+# endif /* DKIMF_DB_BDB_SHARED */
+
+		free(db);
 
 		return status;
 	  }
@@ -5556,14 +6468,26 @@ dkimf_db_close(DKIMF_DB db)
 
 #ifdef USE_ODBX
 	  case DKIMF_DB_TYPE_DSN:
-# ifdef _FFR_DB_HANDLE_POOLS
-		dkimf_db_hp_free((struct handle_pool *) db->db_handle);
-# else /* _FFR_DB_HANDLE_POOLS */
-		(void) odbx_finish((odbx_t *) db->db_handle);
-# endif /* _FFR_DB_HANDLE_POOLS */
-		free(db->db_data);
+	  {
+		struct dkimf_db_dsn *dsn;
+		struct handle_pool *pool;
+
+		dsn = (struct dkimf_db_dsn *) db->db_data;
+		pool = (struct handle_pool *) db->db_handle;
+
+		if (db->db_cursor != NULL)
+			(void) odbx_result_finish((odbx_result_t *) db->db_cursor);
+		if (dsn->dsn_walk != NULL)
+			dkimf_db_hp_disconnect(pool, dsn->dsn_walk);
+
+		dkimf_db_hp_free(pool);
+		free(dsn->dsn_query);
+		free(dsn->dsn_qtail);
+		free((void *) dsn->dsn_filter);
+		free(dsn);
 		free(db);
 		return 0;
+	  }
 #endif /* USE_ODBX */
 
 #ifdef USE_LDAP
@@ -5737,9 +6661,16 @@ dkimf_db_strerror(DKIMF_DB db, char *err, size_t errlen)
 	  case DKIMF_DB_TYPE_DSN:
 	  {
 		char *p;
+		struct handle_pool *pool;
+
+		pool = (struct handle_pool *) db->db_handle;
 
-		strlcpy(err, odbx_error((odbx_t *) db->db_handle,
-		                        db->db_status), errlen);
+		pthread_mutex_lock(&pool->hp_lock);
+		if (pool->hp_errstr[0] != '\0')
+			strlcpy(err, pool->hp_errstr, errlen);
+		else
+			strlcpy(err, odbx_error(NULL, db->db_status), errlen);
+		pthread_mutex_unlock(&pool->hp_lock);
 		for (p = err + strlen(err) - 1; p >= err; p--)
 		{
 			if (*p == '\n')
@@ -5883,6 +6814,28 @@ dkimf_db_walk(DKIMF_DB db, _Bool first, void *key, size_t *keylen,
 		DBC *dbc;
 # endif /* DB_VERSION_CHECK(2,0,0) */
 		char databuf[BUFRSZ + 1];
+# ifdef DKIMF_DB_BDB_SHARED
+		struct dkimf_db_bdb *bdbs;
+
+		/*
+		**  Hold the handle for the cursor's whole life; a new walk
+		**  replaces one that was abandoned part way.
+		*/
+
+		bdbs = (struct dkimf_db_bdb *) db->db_data;
+		if (bdbs != NULL)
+		{
+			if (first)
+				dkimf_db_bdb_walkend(db);
+
+			if (!bdbs->bdb_walking)
+			{
+				__atomic_store_n(&bdbs->bdb_walking, TRUE,
+				                 __ATOMIC_RELEASE);
+				pthread_rwlock_rdlock(&bdbs->bdb_rwlock);
+			}
+		}
+# endif /* DKIMF_DB_BDB_SHARED */
 
 		bdb = (DB *) db->db_handle;
 
@@ -5895,6 +6848,10 @@ dkimf_db_walk(DKIMF_DB db, _Bool first, void *key, size_t *keylen,
 			if (status != 0)
 			{
 				db->db_status = status;
+#  ifdef DKIMF_DB_BDB_SHARED
+				if (bdbs != NULL)
+					dkimf_db_bdb_walkend(db);
+#  endif /* DKIMF_DB_BDB_SHARED */
 				return -1;
 			}
 
@@ -5924,11 +6881,21 @@ dkimf_db_walk(DKIMF_DB db, _Bool first, void *key, size_t *keylen,
 # endif /* DB_VERSION_CHECK(2,0,0) */
 		if (status == DB_NOTFOUND)
 		{
+# ifdef DKIMF_DB_BDB_SHARED
+			/* let dkimf_db_bdb_check() replace the handle again */
+			if (bdbs != NULL)
+				dkimf_db_bdb_walkend(db);
+# endif /* DKIMF_DB_BDB_SHARED */
+
 			return 1;
 		}
 		else if (status != 0)
 		{
 			db->db_status = status;
+# ifdef DKIMF_DB_BDB_SHARED
+			if (bdbs != NULL)
+				dkimf_db_bdb_walkend(db);
+# endif /* DKIMF_DB_BDB_SHARED */
 			return -1;
 		}
 		else
@@ -5970,8 +6937,10 @@ dkimf_db_walk(DKIMF_DB db, _Bool first, void *key, size_t *keylen,
 		int fields;
 		odbx_result_t *result;
 		struct dkimf_db_dsn *dsn;
+		struct handle_pool *pool;
 
 		dsn = (struct dkimf_db_dsn *) db->db_data;
+		pool = (struct handle_pool *) db->db_handle;
 		result = (odbx_result_t *) db->db_cursor;
 
 		/* purge old results cursor if known */
@@ -5991,25 +6960,41 @@ dkimf_db_walk(DKIMF_DB db, _Bool first, void *key, size_t *keylen,
 		/* run a query and start results cursor if needed */
 		if (result == NULL)
 		{
+			_Bool fresh;
 			char query[BUFRSZ];
 
+			/* the walk keeps one pooled handle until it's done */
+			if (dsn->dsn_walk == NULL)
+			{
+				dsn->dsn_walk = dkimf_db_hp_get(pool, &err,
+				                                &fresh);
+				if (dsn->dsn_walk == NULL)
+				{
+					db->db_status = err;
+					return -1;
+				}
+			}
+
 			snprintf(query, sizeof query, "SELECT %s,%s FROM %s",
 			         dsn->dsn_keycol, dsn->dsn_datacol,
 			         dsn->dsn_table);
 
-			err = odbx_query((odbx_t *) db->db_handle, query, 0);
+			err = odbx_query(dsn->dsn_walk, query, 0);
 			if (err < 0)
 			{
-				db->db_status = err;
+				dkimf_db_sql_error(db, dsn->dsn_walk, err);
+				dkimf_db_hp_put(pool, dsn->dsn_walk);
+				dsn->dsn_walk = NULL;
 				return -1;
 			}
 
-			err = odbx_result((odbx_t *) db->db_handle,
-			                  &result, NULL, 0);
+			err = odbx_result(dsn->dsn_walk, &result, NULL, 0);
 			if (err < 0)
 			{
 				(void) odbx_result_finish(result);
-				db->db_status = err;
+				dkimf_db_sql_error(db, dsn->dsn_walk, err);
+				dkimf_db_hp_put(pool, dsn->dsn_walk);
+				dsn->dsn_walk = NULL;
 				return -1;
 			}
 
@@ -6021,7 +7006,9 @@ dkimf_db_walk(DKIMF_DB db, _Bool first, void *key, size_t *keylen,
 		{
 			(void) odbx_result_finish(result);
 			db->db_cursor = NULL;
-			db->db_status = err;
+			dkimf_db_sql_error(db, dsn->dsn_walk, err);
+			dkimf_db_hp_put(pool, dsn->dsn_walk);
+			dsn->dsn_walk = NULL;
 			return -1;
 		}
 
@@ -6030,13 +7017,15 @@ dkimf_db_walk(DKIMF_DB db, _Bool first, void *key, size_t *keylen,
 			(void) odbx_result_finish(result);
 			for (;;)
 			{
-				err = odbx_result((odbx_t *) db->db_handle,
+				err = odbx_result(dsn->dsn_walk,
 				                  &result, NULL, 0);
 				if (err == 0)
 					break;
 				(void) odbx_result_finish(result);
 			}
 			db->db_cursor = NULL;
+			dkimf_db_hp_put(pool, dsn->dsn_walk);
+			dsn->dsn_walk = NULL;
 			return 1;
 		}
 
@@ -6046,6 +7035,8 @@ dkimf_db_walk(DKIMF_DB db, _Bool first, void *key, size_t *keylen,
 			/* query returned no columns somehow */
 			(void) odbx_result_finish(result);
 			db->db_cursor = NULL;
+			dkimf_db_hp_put(pool, dsn->dsn_walk);
+			dsn->dsn_walk = NULL;
 			return -1;
 		}
 
@@ -6908,3 +7899,331 @@ dkimf_db_chown(DKIMF_DB db, uid_t uid)
 
 #endif /* USE_DB */
 }
+
+/*
+**  DKIMF_DB_BATCH_OPEN -- open one entry of a batch
+**
+**  Parameters:
+**  	dbe -- batch entry
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_db_batch_open(struct dkimf_db_batchent *dbe)
+{
+	struct timespec start;
+	struct timespec end;
+
+	assert(dbe != NULL);
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &start);
+
+	dbe->dbe_opened.dbo_status = dkimf_db_open(dbe->dbe_db,
+	                                           dbe->dbe_opened.dbo_name,
+	                                           dbe->dbe_flags,
+	                                           dbe->dbe_lock,
+	                                           &dbe->dbe_opened.dbo_err);
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &end);
+
+	dbe->dbe_opened.dbo_usec = (end.tv_sec - start.tv_sec) * 1000000 +
+	                           (end.tv_nsec - start.tv_nsec) / 1000;
+}
+
+/*
+**  DKIMF_DB_BATCH_DRAIN -- open queued entries until none are left
+**
+**  Parameters:
+**  	dbb -- batch
+**  	block -- wait for more work until the batch is closed
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_db_batch_drain(struct dkimf_db_batch *dbb, _Bool block)
+{
+	struct dkimf_db_batchent *dbe;
+
+	pthread_mutex_lock(&dbb->dbb_lock);
+
+	for (;;)
+	{
+		while (block && dbb->dbb_head == NULL && !dbb->dbb_closed)
+			pthread_cond_wait(&dbb->dbb_cond, &dbb->dbb_lock);
+
+		dbe = dbb->dbb_head;
+		if (dbe == NULL)
+			break;
+
+		dbb->dbb_head = dbe->dbe_next;
+		if (dbb->dbb_head == NULL)
+			dbb->dbb_tail = NULL;
+
+		pthread_mutex_unlock(&dbb->dbb_lock);
+
+		dkimf_db_batch_open(dbe);
+
+		pthread_mutex_lock(&dbb->dbb_lock);
+	}
+
+	pthread_mutex_unlock(&dbb->dbb_lock);
+}
+
+/*
+**  DKIMF_DB_BATCH_WORKER -- batch worker thread
+**
+**  Parameters:
+**  	arg -- batch
+**
+**  Return value:
+**  	NULL.
+*/
+
+static void *
+dkimf_db_batch_worker(void *arg)
+{
+	dkimf_db_batch_drain((struct dkimf_db_batch *) arg, TRUE);
+
+	return NULL;
+}
+
+/*
+**  DKIMF_DB_BATCH_NEW -- start a batch of data set opens
+**
+**  Parameters:
+**  	nthreads -- most threads to use for opening local files; 0 opens
+**  	            everything in the caller's thread as it is added
+**
+**  Return value:
+**  	A new batch handle, or NULL on failure.
+*/
+
+struct dkimf_db_batch *
+dkimf_db_batch_new(u_int nthreads)
+{
+	struct dkimf_db_batch *dbb;
+
+	dbb = (struct dkimf_db_batch *) malloc(sizeof *dbb);
+	if (dbb == NULL)
+		return NULL;
+
+	memset(dbb, '\0', sizeof *dbb);
+
+	if (nthreads > 0)
+	{
+		dbb->dbb_threads = (pthread_t *) malloc(sizeof(pthread_t) *
+		                                        nthreads);
+		if (dbb->dbb_threads == NULL)
+		{
+			free(dbb);
+			return NULL;
+		}
+	}
+
+	dbb->dbb_maxthreads = nthreads;
+	pthread_mutex_init(&dbb->dbb_lock, NULL);
+	pthread_cond_init(&dbb->dbb_cond, NULL);
+
+	return dbb;
+}
+
+/*
+**  DKIMF_DB_BATCH_ADD -- add a data set to a batch
+**
+**  Parameters:
+**  	dbb -- batch
+**  	label -- what the data set is for, used only in reporting
+**  	db -- where to store the handle once it is open
+**  	name -- name of the data set, as for dkimf_db_open()
+**  	flags -- as for dkimf_db_open()
+**  	lock -- as for dkimf_db_open()
+**
+**  Return value:
+**  	0 on success, -1 on failure (errno will be set).
+**
+**  Notes:
+**  	"*db" may be written at any time until dkimf_db_batch_wait()
+**  	returns, and "label" and "name" must remain valid until the batch
+**  	is freed.  Failures to open are reported by dkimf_db_batch_wait(),
+**  	not here.
+*/
+
+int
+dkimf_db_batch_add(struct dkimf_db_batch *dbb, char *label, DKIMF_DB *db,
+                   char *name, u_int flags, pthread_mutex_t *lock)
+{
+	int type;
+	struct dkimf_db_batchent *dbe;
+
+	assert(dbb != NULL);
+	assert(db != NULL);
+	assert(name != NULL);
+	assert(!dbb->dbb_closed);
+
+	if (dbb->dbb_nents == dbb->dbb_alloc)
+	{
+		u_int newalloc;
+		struct dkimf_db_batchent **newents;
+
+		newalloc = (dbb->dbb_alloc == 0 ? 16 : dbb->dbb_alloc * 2);
+		newents = realloc(dbb->dbb_ents, sizeof *newents * newalloc);
+		if (newents == NULL)
+			return -1;
+
+		dbb->dbb_ents = newents;
+		dbb->dbb_alloc = newalloc;
+	}
+
+	dbe = (struct dkimf_db_batchent *) malloc(sizeof *dbe);
+	if (dbe == NULL)
+		return -1;
+
+	memset(dbe, '\0', sizeof *dbe);
+	dbe->dbe_db = db;
+	dbe->dbe_flags = flags;
+	dbe->dbe_lock = lock;
+	dbe->dbe_opened.dbo_label = label;
+	dbe->dbe_opened.dbo_name = name;
+
+	dbb->dbb_ents[dbb->dbb_nents++] = dbe;
+
+	type = dkimf_db_nametype(name, NULL);
+
+	if (dbb->dbb_maxthreads == 0 ||
+	    (type != DKIMF_DB_TYPE_FILE &&
+	     type != DKIMF_DB_TYPE_REFILE &&
+	     type != DKIMF_DB_TYPE_CSL &&
+	     type != DKIMF_DB_TYPE_BDB &&
+	     type != DKIMF_DB_TYPE_MDB))
+	{
+		dkimf_db_batch_open(dbe);
+		return 0;
+	}
+
+	pthread_mutex_lock(&dbb->dbb_lock);
+
+	if (dbb->dbb_tail == NULL)
+		dbb->dbb_head = dbe;
+	else
+		dbb->dbb_tail->dbe_next = dbe;
+	dbb->dbb_tail = dbe;
+	dbb->dbb_nqueued++;
+
+	/* start another worker if all of them could be busy */
+	if (dbb->dbb_nthreads < dbb->dbb_maxthreads &&
+	    dbb->dbb_nthreads < dbb->dbb_nqueued &&
+	    pthread_create(&dbb->dbb_threads[dbb->dbb_nthreads], NULL,
+	                   dkimf_db_batch_worker, dbb) == 0)
+		dbb->dbb_nthreads++;
+
+	pthread_cond_signal(&dbb->dbb_cond);
+
+	pthread_mutex_unlock(&dbb->dbb_lock);
+
+	return 0;
+}
+
+/*
+**  DKIMF_DB_BATCH_WAIT -- wait for everything in a batch to be opened
+**
+**  Parameters:
+**  	dbb -- batch
+**
+**  Return value:
+**  	0 if everything opened, -1 if anything failed.
+**
+**  Notes:
+**  	The caller's thread helps with whatever is still queued.  Nothing
+**  	more may be added afterward.
+*/
+
+int
+dkimf_db_batch_wait(struct dkimf_db_batch *dbb)
+{
+	int status = 0;
+	u_int c;
+
+	assert(dbb != NULL);
+
+	if (!dbb->dbb_closed)
+	{
+		pthread_mutex_lock(&dbb->dbb_lock);
+		dbb->dbb_closed = TRUE;
+		pthread_cond_broadcast(&dbb->dbb_cond);
+		pthread_mutex_unlock(&dbb->dbb_lock);
+
+		dkimf_db_batch_drain(dbb, FALSE);
+
+		for (c = 0; c < dbb->dbb_nthreads; c++)
+			(void) pthread_join(dbb->dbb_threads[c], NULL);
+	}
+
+	for (c = 0; c < dbb->dbb_nents; c++)
+	{
+		if (dbb->dbb_ents[c]->dbe_opened.dbo_status != 0)
+			status = -1;
+	}
+
+	return status;
+}
+
+/*
+**  DKIMF_DB_BATCH_RESULT -- retrieve the outcome of one batch entry
+**
+**  Parameters:
+**  	dbb -- batch, already passed to dkimf_db_batch_wait()
+**  	n -- entry number, counting from 0 in the order they were added
+**
+**  Return value:
+**  	A pointer to the entry's outcome, or NULL if there is no entry "n".
+*/
+
+struct dkimf_db_opened *
+dkimf_db_batch_result(struct dkimf_db_batch *dbb, u_int n)
+{
+	assert(dbb != NULL);
+	assert(dbb->dbb_closed);
+
+	if (n >= dbb->dbb_nents)
+		return NULL;
+
+	return &dbb->dbb_ents[n]->dbe_opened;
+}
+
+/*
+**  DKIMF_DB_BATCH_FREE -- release a batch
+**
+**  Parameters:
+**  	dbb -- batch
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Waits for the batch first if that hasn't been done.  The data
+**  	sets themselves are not closed; they belong to the caller.
+*/
+
+void
+dkimf_db_batch_free(struct dkimf_db_batch *dbb)
+{
+	u_int c;
+
+	assert(dbb != NULL);
+
+	(void) dkimf_db_batch_wait(dbb);
+
+	for (c = 0; c < dbb->dbb_nents; c++)
+		free(dbb->dbb_ents[c]);
+
+	pthread_mutex_destroy(&dbb->dbb_lock);
+	pthread_cond_destroy(&dbb->dbb_cond);
+
+	free(dbb->dbb_ents);
+	free(dbb->dbb_threads);
+	free(dbb);
+}
@@ -11,6 +11,7 @@
 
 /* system includes */
 #include <sys/types.h>
+#include <inttypes.h>
 #include <pthread.h>
 
 /* macros */
@@ -65,10 +66,35 @@ struct dkimf_db_data
 };
 typedef struct dkimf_db_data * DKIMF_DBDATA;
 
+struct dkimf_db_timing
+{
+	uint64_t	dbt_usec;
+	unsigned int	dbt_count;
+};
+
+struct dkimf_db_opened
+{
+	int		dbo_status;		/* dkimf_db_open() result */
+	char *		dbo_label;		/* what it's for */
+	char *		dbo_name;		/* data set name */
+	char *		dbo_err;		/* error string, if any */
+	uint64_t	dbo_usec;		/* time taken to open */
+};
+
+struct dkimf_db_batch;
+
 #define	DKIMF_DB_DATA_BINARY	0x01		/* data is binary */
 #define	DKIMF_DB_DATA_OPTIONAL	0x02		/* data is optional */
 
 /* prototypes */
+extern int dkimf_db_batch_add(struct dkimf_db_batch *, char *, DKIMF_DB *,
+                              char *, u_int, pthread_mutex_t *);
+extern void dkimf_db_batch_free(struct dkimf_db_batch *);
+extern struct dkimf_db_batch *dkimf_db_batch_new(u_int);
+extern struct dkimf_db_opened *dkimf_db_batch_result(struct dkimf_db_batch *,
+                                                     u_int);
+extern int dkimf_db_batch_wait(struct dkimf_db_batch *);
+extern void dkimf_db_cachettl(DKIMF_DB, unsigned int);
 extern int dkimf_db_chown(DKIMF_DB, uid_t uid);
 extern int dkimf_db_close(DKIMF_DB);
 extern int dkimf_db_delete(DKIMF_DB, void *, size_t);
@@ -76,13 +102,16 @@ extern void dkimf_db_flags(unsigned int);
 extern int dkimf_db_get(DKIMF_DB, void *, size_t,
                              DKIMF_DBDATA, unsigned int, _Bool *);
 extern int dkimf_db_mkarray(DKIMF_DB, char ***, const char **);
+extern void dkimf_db_observe(void (*)(int, uint64_t));
 extern int dkimf_db_open(DKIMF_DB *, char *, u_int flags,
                               pthread_mutex_t *, char **);
+extern int dkimf_db_prefetch(DKIMF_DB, const char **, unsigned int);
 extern int dkimf_db_put(DKIMF_DB, void *, size_t, void *, size_t);
 extern int dkimf_db_rewalk(DKIMF_DB, char *, DKIMF_DBDATA, unsigned int,
                                 void **);
 extern void dkimf_db_set_ldap_param(int, char *);
 extern int dkimf_db_strerror(DKIMF_DB, char *, size_t);
+extern void dkimf_db_trace(struct dkimf_db_timing *);
 extern int dkimf_db_type(DKIMF_DB);
 extern int dkimf_db_walk(DKIMF_DB, _Bool, void *, size_t *,
                               DKIMF_DBDATA, unsigned int);
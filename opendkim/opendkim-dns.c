@@ -18,6 +18,11 @@
 #include <pthread.h>
 #include <resolv.h>
 #include <errno.h>
+#include <unistd.h>
+#ifdef USE_UNBOUND
+# include <fcntl.h>
+# include <poll.h>
+#endif /* USE_UNBOUND */
 
 /* libopendkim includes */
 #include <dkim.h>
@@ -66,20 +71,30 @@ struct dkimf_fquery
 };
 
 #ifdef USE_UNBOUND
+/*
+**  One resolver I/O thread per context calls ub_process() whenever
+**  libunbound has answers, and each answer's callback wakes only the thread
+**  waiting for that query, on the query's own condition variable.  The
+**  thread is started with the first query rather than at setup so that it
+**  is created in the process that will use it (i.e., after any fork()).
+*/
+
 /* struct dkimf_unbound -- unbound context */
 struct dkimf_unbound
 {
-	_Bool			ub_poller;
+	_Bool			ub_running;
+	pid_t			ub_pid;
+	int			ub_wake[2];
 	struct ub_ctx *		ub_ub;
+	pthread_t		ub_thread;
 	pthread_mutex_t		ub_lock;
 	pthread_mutex_t		ub_config_lock;
-	pthread_cond_t		ub_ready;
 };
 
 /* struct dkimf_unbound_cb_data -- libunbound callback data */
 struct dkimf_unbound_cb_data
 {
-	int			ubd_done;
+	_Bool			ubd_done;
 	int			ubd_rcode;
 	int			ubd_id;
 	int			ubd_type;
@@ -88,6 +103,8 @@ struct dkimf_unbound_cb_data
 	size_t			ubd_buflen;
 	u_char *		ubd_buf;
 	const char *		ubd_strerror;
+	pthread_mutex_t		ubd_lock;
+	pthread_cond_t		ubd_cond;
 };
 #endif /* USE_UNBOUND */
 
@@ -171,48 +188,146 @@ dkimf_unbound_cb(void *mydata, int err, struct ub_result *result)
 
 	ubdata = (struct dkimf_unbound_cb_data *) mydata;
 
+	pthread_mutex_lock(&ubdata->ubd_lock);
+
 	if (err != 0)
 	{
-		ubdata->ubd_done = TRUE;
 		ubdata->ubd_stat = DKIM_STAT_INTERNAL;
 		ubdata->ubd_strerror = ub_strerror(err);
-		return;
 	}
+	else
+	{
+		ubdata->ubd_stat = DKIM_STAT_NOKEY;
+		ubdata->ubd_rcode = result->rcode;
+		memcpy(ubdata->ubd_buf, result->answer_packet,
+		       MIN(ubdata->ubd_buflen, result->answer_len));
+		ubdata->ubd_buflen = result->answer_len;
 
-	ubdata->ubd_done = FALSE;
-	ubdata->ubd_stat = DKIM_STAT_NOKEY;
-	ubdata->ubd_rcode = result->rcode;
-	memcpy(ubdata->ubd_buf, result->answer_packet,
-	       MIN(ubdata->ubd_buflen, result->answer_len));
-	ubdata->ubd_buflen = result->answer_len;
+		/*
+		**  Check whether reply is either secure or insecure.  If
+		**  bogus, treat as if no key exists by returning no reply.
+		*/
 
-	/*
-	**  Check whether reply is either secure or insecure.  If bogus,
-	**  treat as if no key exists.
-	*/
+		if (result->secure)
+		{
+			ubdata->ubd_result = DKIM_DNSSEC_SECURE;
+		}
+		else if (result->bogus)
+		{
+			ubdata->ubd_result = DKIM_DNSSEC_BOGUS;
+			ubdata->ubd_buflen = 0;
+		}
+		else
+		{
+			ubdata->ubd_result = DKIM_DNSSEC_INSECURE;
+		}
+
+		if (!result->bogus && result->havedata &&
+		    !result->nxdomain && result->rcode == NOERROR)
+			ubdata->ubd_stat = DKIM_STAT_OK;
 
-	if (result->secure)
-	{
-		ubdata->ubd_result = DKIM_DNSSEC_SECURE;
-	}
-	else if (result->bogus)
-	{
-		/* result was bogus */
-		ubdata->ubd_result = DKIM_DNSSEC_BOGUS;
 		ub_resolve_free(result);
-		return;
 	}
-	else
-	{ 
-		ubdata->ubd_result = DKIM_DNSSEC_INSECURE;
+
+	/* wake the one thread waiting for this answer */
+	ubdata->ubd_done = TRUE;
+	pthread_cond_signal(&ubdata->ubd_cond);
+
+	pthread_mutex_unlock(&ubdata->ubd_lock);
+}
+
+/*
+**  DKIMF_UNBOUND_IO -- resolver I/O thread
+**
+**  Parameters:
+**  	arg -- unbound context
+**
+**  Return value:
+**  	Always NULL.
+**
+**  Notes:
+**  	Runs until a byte is written to the context's wakeup pipe.
+*/
+
+static void *
+dkimf_unbound_io(void *arg)
+{
+	int n;
+	struct dkimf_unbound *ub;
+	struct pollfd pfd[2];
+
+	ub = (struct dkimf_unbound *) arg;
+
+	pfd[0].fd = ub_fd(ub->ub_ub);
+	pfd[0].events = POLLIN;
+	pfd[1].fd = ub->ub_wake[0];
+	pfd[1].events = POLLIN;
+
+	for (;;)
+	{
+		pfd[0].revents = 0;
+		pfd[1].revents = 0;
+
+		n = poll(pfd, 2, -1);
+		if (n == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (pfd[1].revents != 0)
+			break;
+
+		/* run the callbacks for anything that has completed */
+		if (pfd[0].revents != 0)
+			(void) ub_process(ub->ub_ub);
 	}
 
-	if (result->havedata && !result->nxdomain && result->rcode == NOERROR)
-		ubdata->ubd_stat = DKIM_STAT_OK;
+	return NULL;
+}
 
-	ub_resolve_free(result);
+/*
+**  DKIMF_UNBOUND_START -- make sure the resolver I/O thread is running
+**
+**  Parameters:
+**  	ub -- unbound context
+**
+**  Return value:
+**  	0 -- success
+**  	-1 -- error
+*/
 
-	ubdata->ubd_done = TRUE;
+static int
+dkimf_unbound_start(struct dkimf_unbound *ub)
+{
+	int status = 0;
+	pid_t pid;
+
+	assert(ub != NULL);
+
+	pid = getpid();
+
+	pthread_mutex_lock(&ub->ub_lock);
+
+	/* a thread started before a fork() isn't in this process */
+	if (ub->ub_running && ub->ub_pid != pid)
+		ub->ub_running = FALSE;
+
+	if (!ub->ub_running)
+	{
+		status = pthread_create(&ub->ub_thread, NULL,
+		                        dkimf_unbound_io, ub);
+		if (status == 0)
+		{
+			ub->ub_running = TRUE;
+			ub->ub_pid = pid;
+		}
+	}
+
+	pthread_mutex_unlock(&ub->ub_lock);
+
+	return (status == 0 ? 0 : -1);
 }
 
 /*
@@ -234,6 +349,7 @@ dkimf_unbound_wait(struct dkimf_unbound *ub,
                    struct dkimf_unbound_cb_data *ubdata,
                    struct timeval *to)
 {
+	int ret;
 	struct timespec timeout;
 	struct timeval now;
 
@@ -247,101 +363,42 @@ dkimf_unbound_wait(struct dkimf_unbound *ub,
 		timeout.tv_sec = now.tv_sec + to->tv_sec;
 		timeout.tv_nsec = now.tv_usec * 1000;
 		timeout.tv_nsec += (1000 * to->tv_usec);
-		if (timeout.tv_nsec > 1000000000)
+		if (timeout.tv_nsec >= 1000000000)
 		{
 			timeout.tv_sec += (timeout.tv_nsec / 1000000000);
 			timeout.tv_nsec = timeout.tv_nsec % 1000000000;
 		}
 	}
 
-	pthread_mutex_lock(&ub->ub_lock);
+	pthread_mutex_lock(&ubdata->ubd_lock);
 
-	for (;;)
+	if (to != NULL)
 	{
-		/*
-		**  Wait for a signal unless/until:
-		**  	a) our request is done
-		**  	b) there's nobody polling libunbound for results
-		**  	c) we don't want to wait anymore (timeout)
-		*/
-
-		if (to != NULL)
-		{
-			while (!ubdata->ubd_done && ub->ub_poller &&
-			       !dkimf_timespec_past(&timeout))
-			{
-				(void) pthread_cond_timedwait(&ub->ub_ready,
-				                              &ub->ub_lock,
-				                              &timeout);
-			}
-		}
-		else
-		{
-			while (!ubdata->ubd_done && ub->ub_poller)
-			{
-				(void) pthread_cond_wait(&ub->ub_ready,
-				                         &ub->ub_lock);
-			}
-		}
-
-		if (ubdata->ubd_done)
-		{
-			/* our request completed */
-			pthread_mutex_unlock(&ub->ub_lock);
-			return 1;
-		}
-		else if (to != NULL && dkimf_timespec_past(&timeout))
-		{
-			/* our request timed out */
-			pthread_mutex_unlock(&ub->ub_lock);
-			return 0;
-		}
-		else
+		while (!ubdata->ubd_done &&
+		       pthread_cond_timedwait(&ubdata->ubd_cond,
+		                              &ubdata->ubd_lock,
+		                              &timeout) != ETIMEDOUT)
+			continue;
+	}
+	else
+	{
+		while (!ubdata->ubd_done)
 		{
-			int status;
-
-			/* nobody's waiting for results, so we will */
-			ub->ub_poller = TRUE;
-			pthread_mutex_unlock(&ub->ub_lock);
-
-			/* wait for I/O to be available */
-			status = dkimf_wait_fd(ub_fd(ub->ub_ub),
-			                       to == NULL ? NULL : &timeout);
-
-			if (status == 0)
-			{
-				/* no answer in time */
-				pthread_mutex_lock(&ub->ub_lock);
-				ub->ub_poller = FALSE;
-				pthread_cond_signal(&ub->ub_ready);
-				pthread_mutex_unlock(&ub->ub_lock);
-				return 0;
-			}
-
-			assert(status == 1);
-			
-			/* process anything pending */
-			status = ub_process(ub->ub_ub);
-			if (status != 0)
-			{
-				/* error during processing */
-				pthread_mutex_lock(&ub->ub_lock);
-				ub->ub_poller = FALSE;
-				pthread_cond_signal(&ub->ub_ready);
-				pthread_mutex_unlock(&ub->ub_lock);
-				return -1;
-			}
-
-			/* recover the lock so the loop can restart */
-			pthread_mutex_lock(&ub->ub_lock);
-
-			/* tell everyone to check for results */
-			pthread_cond_broadcast(&ub->ub_ready);
-
-			/* clear the "someone is polling" flag */
-			ub->ub_poller = FALSE;
+			(void) pthread_cond_wait(&ubdata->ubd_cond,
+			                         &ubdata->ubd_lock);
 		}
 	}
+
+	if (!ubdata->ubd_done)
+		ret = 0;
+	else if (ubdata->ubd_stat == DKIM_STAT_INTERNAL)
+		ret = -1;
+	else
+		ret = 1;
+
+	pthread_mutex_unlock(&ubdata->ubd_lock);
+
+	return ret;
 }
 
 /*
@@ -373,6 +430,9 @@ dkimf_unbound_queue(struct dkimf_unbound *ub, char *name, int type,
 	assert(buflen > 0);
 	assert(cbdata != NULL);
 
+	if (dkimf_unbound_start(ub) != 0)
+		return -1;
+
 	cbdata->ubd_done = FALSE;
 	cbdata->ubd_buf = buf;
 	cbdata->ubd_buflen = buflen;
@@ -472,7 +532,25 @@ dkimf_ub_cancel(void *srv, void *q)
 	ub = (struct dkimf_unbound *) srv;
 	ubdata = (struct dkimf_unbound_cb_data *) q;
 
-	(void) ub_cancel(ub->ub_ub, ubdata->ubd_id);
+	/*
+	**  If libunbound no longer knows the query, its callback has run or
+	**  is running in the I/O thread; let it finish before the callback
+	**  data and the caller's buffer go away.
+	*/
+
+	if (ub_cancel(ub->ub_ub, ubdata->ubd_id) == UB_NOID)
+	{
+		pthread_mutex_lock(&ubdata->ubd_lock);
+		while (!ubdata->ubd_done)
+		{
+			(void) pthread_cond_wait(&ubdata->ubd_cond,
+			                         &ubdata->ubd_lock);
+		}
+		pthread_mutex_unlock(&ubdata->ubd_lock);
+	}
+
+	pthread_mutex_destroy(&ubdata->ubd_lock);
+	pthread_cond_destroy(&ubdata->ubd_cond);
 
 	free(q);
 
@@ -509,10 +587,15 @@ dkimf_ub_query(void *srv, int type, unsigned char *query,
 		return DKIM_DNS_ERROR;
 	memset(ubdata, '\0', sizeof *ubdata);
 
+	pthread_mutex_init(&ubdata->ubd_lock, NULL);
+	pthread_cond_init(&ubdata->ubd_cond, NULL);
+
 	status = dkimf_unbound_queue(ub, (char *) query, type, buf, buflen,
 	                             ubdata);
 	if (status != 0)
 	{
+		pthread_mutex_destroy(&ubdata->ubd_lock);
+		pthread_cond_destroy(&ubdata->ubd_cond);
 		free(ubdata);
 		return DKIM_DNS_ERROR;
 	}
@@ -608,11 +691,21 @@ dkimf_ub_init(void **ub)
 	/* set for asynchronous operation */
 	ub_ctx_async(out->ub_ub, TRUE);
 
-	out->ub_poller = FALSE;
+	/* for stopping the I/O thread */
+	if (pipe(out->ub_wake) != 0)
+	{
+		ub_ctx_delete(out->ub_ub);
+		free(out);
+		return DKIM_DNS_ERROR;
+	}
+	(void) fcntl(out->ub_wake[0], F_SETFD, FD_CLOEXEC);
+	(void) fcntl(out->ub_wake[1], F_SETFD, FD_CLOEXEC);
+
+	out->ub_running = FALSE;
+	out->ub_pid = 0;
 
 	pthread_mutex_init(&out->ub_lock, NULL);
 	pthread_mutex_init(&out->ub_config_lock, NULL);
-	pthread_cond_init(&out->ub_ready, NULL);
 
 	*ub = out;
 
@@ -639,11 +732,19 @@ dkimf_ub_close(void *srv)
 
 	ub = srv;
 
+	if (ub->ub_running && ub->ub_pid == getpid())
+	{
+		(void) write(ub->ub_wake[1], "", 1);
+		(void) pthread_join(ub->ub_thread, NULL);
+	}
+
+	(void) close(ub->ub_wake[0]);
+	(void) close(ub->ub_wake[1]);
+
 	ub_ctx_delete(ub->ub_ub);
 
 	pthread_mutex_destroy(&ub->ub_lock);
 	pthread_mutex_destroy(&ub->ub_config_lock);
-	pthread_cond_destroy(&ub->ub_ready);
 
 	free(srv);
 }
@@ -914,7 +1015,9 @@ dkimf_filedns_waitreply(void *srv, void *qh, struct timeval *to, size_t *bytes,
 
 		memcpy(fq->fq_qbuf, &hdr, sizeof hdr);
 
-		*bytes = fq->fq_qlen;
+		/* the caller reads the reply buffer, not the query buffer */
+		*bytes = MIN(fq->fq_qlen, fq->fq_rbuflen);
+		memcpy(fq->fq_rbuf, fq->fq_qbuf, *bytes);
 	}
 	else
 	{			/* found, construct the reply */
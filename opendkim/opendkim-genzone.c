@@ -20,6 +20,9 @@
 #include <errno.h>
 #include <unistd.h>
 #include <pwd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <time.h>
 
 /* openssl includes */
 #ifdef USE_GNUTLS
@@ -34,6 +37,16 @@
 # include <openssl/bio.h>
 #endif /* USE_GNUTLS */
 
+/* libbsd if found */
+#ifdef USE_BSD_H
+# include <bsd/string.h>
+#endif /* USE_BSD_H */
+
+/* libstrl if needed */
+#ifdef USE_STRL_H
+# include <strl.h>
+#endif /* USE_STRL_H */
+
 #ifndef FALSE
 # define FALSE		0
 #endif /* ! FALSE */
@@ -54,17 +67,71 @@
 
 /* definitions */
 #define	BUFRSZ		1024
-#define	CMDLINEOPTS	"C:d:DE:Fo:N:r:R:sSt:T:uvx:"
+#define	CMDLINEOPTS	"c:C:d:DE:Fj:o:N:r:R:sSt:T:uvx:"
 #define	DEFCONFFILE	CONFIG_BASE "/opendkim.conf"
 #define	DEFEXPIRE	604800
 #define	DEFREFRESH	10800
 #define	DEFRETRY	1800
 #define	DEFTTL		86400
+#define	DIGESTLEN	32
 #define	DKIMZONE	"._domainkey"
+#define	GZ_HASHSZ	16384
 #define	HOSTMASTER	"hostmaster"
 #define	LARGEBUFRSZ	8192
 #define	MARGIN		75
 #define	MAXNS		16
+#define	STATEMAGIC	"# opendkim-genzone state 2"
+
+#ifdef HAVE_ST_MTIM
+# define STAT_NSEC(s,x)	((long long) (s).st_##x##tim.tv_sec * 1000000000LL + \
+			 (s).st_##x##tim.tv_nsec)
+#else /* HAVE_ST_MTIM */
+# define STAT_NSEC(s,x)	((long long) (s).st_##x##time * 1000000000LL)
+#endif /* HAVE_ST_MTIM */
+
+/* data types */
+struct gzkey
+{
+	_Bool		gk_used;		/* named by this run's KeyTable */
+	_Bool		gk_queued;		/* waiting for a worker */
+	_Bool		gk_done;		/* public key available */
+	_Bool		gk_inline;		/* gk_name is a digest, not a path */
+	_Bool		gk_derived;		/* derived (not reused) this run */
+	int		gk_status;		/* 0 on success */
+	unsigned long long gk_dev;		/* device */
+	unsigned long long gk_ino;		/* inode */
+	long long	gk_mtime;		/* modification time (ns) */
+	long long	gk_ctime;		/* status change time (ns) */
+	long long	gk_size;		/* size */
+	char *		gk_name;		/* path, or "=" and digest */
+	char *		gk_data;		/* inline key data, if any */
+	char *		gk_pubkey;		/* base64 public key */
+	struct gzkey *	gk_next;		/* hash chain */
+	char		gk_digest[DIGESTLEN * 2 + 1]; /* private key digest */
+	char		gk_err[BUFRSZ];		/* error, if any */
+};
+
+struct gzrec
+{
+	char *		gr_keyname;		/* KeyTable entry */
+	char *		gr_domain;		/* domain */
+	char *		gr_selector;		/* selector */
+	struct gzkey *	gr_key;			/* key */
+};
+
+struct gzjob
+{
+	_Bool		gj_abort;		/* stop working */
+	size_t		gj_nqueue;		/* keys in gj_queue */
+	size_t		gj_qalloc;		/* slots in gj_queue */
+	size_t		gj_next;		/* next key to derive */
+	unsigned long	gj_derived;		/* keys derived */
+	unsigned long	gj_reused;		/* keys reused from the state */
+	struct gzkey **	gj_queue;		/* keys to derive */
+	struct gzkey *	gj_keys[GZ_HASHSZ];	/* all keys */
+	pthread_mutex_t	gj_lock;		/* lock */
+	pthread_cond_t	gj_cond;		/* signalled on any change */
+};
 
 /* globals */
 char *progname;
@@ -104,13 +171,14 @@ strflen(char *str)
 **  Parameters:
 **  	buf -- key buffer
 **  	buflen -- pointer to key buffer's length (updated)
+**  	sb -- file status (returned), or NULL
 **
 **  Return value:
 **  	TRUE on successful load, false otherwise
 */
 
 int
-loadkey(char *buf, size_t *buflen)
+loadkey(char *buf, size_t *buflen, struct stat *sb)
 {
 	assert(buf != NULL);
 	assert(buflen != NULL);
@@ -140,6 +208,9 @@ loadkey(char *buf, size_t *buflen)
 
 		if (rlen < *buflen)
 			return FALSE;
+
+		if (sb != NULL)
+			memcpy(sb, &s, sizeof s);
 	}
 	else
 	{
@@ -177,264 +248,1165 @@ despace(char *str)
 			break;
 	}
 }
-	
+
 /*
-**  USAGE -- print usage message and exit
+**  KEYDIGEST -- compute the hex digest of private key data
 **
 **  Parameters:
-**  	None.
+**  	data -- key data
+**  	len -- bytes at "data"
+**  	out -- output buffer (at least DIGESTLEN * 2 + 1 bytes)
 **
 **  Return value:
-**  	EX_USAGE
+**  	0 on success, -1 on failure.
 */
 
 int
-usage(void)
+keydigest(const char *data, size_t len, char *out)
 {
-	fprintf(stderr, "%s: usage: %s [opts] [dataset]\n"
-	                "\t-C user@host\tcontact address to include in SOA\n"
-	                "\t-d domain   \twrite keys for named domain only\n"
-	                "\t-D          \tinclude '._domainkey' suffix\n"
-	                "\t-E secs     \tuse specified expiration time in SOA\n"
-	                "\t-F          \tinclude '._domainkey' suffix and domainname\n"
-	                "\t-o file     \toutput file\n"
-	                "\t-N ns[,...] \tlist NS records\n"
-	                "\t-r secs     \tuse specified refresh time in SOA\n"
-	                "\t-R secs     \tuse specified retry time in SOA\n"
-	                "\t-s          \twith -d, also match subdomains\n"
-	                "\t-S          \twrite an SOA record\n"
-	                "\t-t secs     \tuse specified per-record TTL\n"
-	                "\t-T secs     \tuse specified default TTL in SOA\n"
-	                "\t-u          \tproduce output suitable for use by \"nsupdate\"\n"
-	                "\t-v          \tverbose output\n"
-	                "\t-x file     \tconfiguration file\n",
-		progname, progname);
+	int c;
+	unsigned char md[DIGESTLEN];
+#ifndef USE_GNUTLS
+	unsigned int mdlen = sizeof md;
+#endif /* ! USE_GNUTLS */
 
-	return EX_USAGE;
+	assert(data != NULL);
+	assert(out != NULL);
+
+#ifdef USE_GNUTLS
+	if (gnutls_hash_fast(GNUTLS_DIG_SHA256, data, len, md) != 0)
+		return -1;
+#else /* USE_GNUTLS */
+	if (EVP_Digest(data, len, md, &mdlen, EVP_sha256(), NULL) != 1)
+		return -1;
+#endif /* USE_GNUTLS */
+
+	for (c = 0; c < DIGESTLEN; c++)
+		snprintf(out + c * 2, 3, "%02x", md[c]);
+
+	return 0;
 }
 
 /*
-**  MAIN -- program mainline
+**  DERIVEKEY -- derive the public half of a private key
 **
 **  Parameters:
-**  	argc, argv -- the usual
+**  	keydata -- private key, PEM or base64-encoded DER (may be modified)
+**  	keylen -- bytes at "keydata"
+**  	pub -- base64 public key (returned)
+**  	publen -- bytes available at "pub"
+**  	err -- error buffer
+**  	errlen -- bytes available at "err"
 **
 **  Return value:
-**  	Exit status.
+**  	0 on success, -1 on failure.
+**
+**  Notes:
+**  	Safe to call from several threads at once.
 */
 
 int
-main(int argc, char **argv)
+derivekey(char *keydata, size_t keylen, char *pub, size_t publen,
+          char *err, size_t errlen)
 {
-	_Bool seenlf;
-	_Bool nsupdate = FALSE;
-	_Bool suffix = FALSE;
-	_Bool fqdnsuffix = FALSE;
-	_Bool subdomains = FALSE;
-	_Bool writesoa = FALSE;
-	int c;
+	_Bool seenlf = FALSE;
 	int status;
-	int verbose = 0;
-	int olen;
-	int ttl = -1;
-	int defttl = DEFTTL;
-	int expire = DEFEXPIRE;
-	int refresh = DEFREFRESH;
-	int retry = DEFRETRY;
-	int nscount = 0;
 	long len;
-	time_t now;
-	size_t keylen;
-	size_t domain_len;
-	size_t onlydomain_len;
+	size_t olen = 0;
 	char *p;
-	char *dataset = NULL;
-	char *outfile = NULL;
-	char *onlydomain = NULL;
-	char *contact = NULL;
-	char *nameservers = NULL;
-	char *configfile = NULL;
-	char *err = NULL;
-	char *nslist[MAXNS];
-	FILE *out;
 #ifdef USE_GNUTLS
 	gnutls_x509_privkey_t xprivkey;
 	gnutls_privkey_t privkey;
 	gnutls_pubkey_t pubkey;
 	gnutls_datum_t key;
+	size_t pemlen;
+	char pem[LARGEBUFRSZ];
 #else /* USE_GNUTLS */
 	BIO *private;
-	BIO *outbio = NULL;
+	BIO *outbio;
 	EVP_PKEY *pkey;
-	RSA *rsa;
 #endif /* USE_GNUTLS */
-	DKIMF_DB db;
-	char keyname[BUFRSZ + 1];
-	char domain[BUFRSZ + 1];
-	char selector[BUFRSZ + 1];
-	char tmpbuf[BUFRSZ + 1];
-	char hostname[DKIM_MAXHOSTNAMELEN + 1];
-	char keydata[LARGEBUFRSZ];
-	char derdata[LARGEBUFRSZ];
-	struct dkimf_db_data dbd[3];
 
-	progname = (p = strrchr(argv[0], '/')) == NULL ? argv[0] : p + 1;
+	assert(keydata != NULL);
+	assert(pub != NULL);
+	assert(err != NULL);
 
-	while ((c = getopt(argc, argv, CMDLINEOPTS)) != -1)
+#ifdef USE_GNUTLS
+	if (gnutls_x509_privkey_init(&xprivkey) != GNUTLS_E_SUCCESS)
 	{
-		switch (c)
-		{
-		  case 'C':
-			contact = strdup(optarg);
-			break;
+		strlcpy(err, "gnutls_x509_privkey_init() failed", errlen);
+		return -1;
+	}
 
-		  case 'd':
-			onlydomain = optarg;
-			break;
+	key.data = keydata;
+	key.size = keylen;
 
-		  case 'D':
-			suffix = TRUE;
-			break;
+	status = gnutls_x509_privkey_import(xprivkey, &key,
+	                                    GNUTLS_X509_FMT_PEM);
+	if (status != GNUTLS_E_SUCCESS)
+	{
+		status = gnutls_x509_privkey_import(xprivkey, &key,
+		                                    GNUTLS_X509_FMT_DER);
+	}
 
-		  case 'E':
-			expire = strtol(optarg, &p, 10);
-			if (*p != '\0' || expire < 0)
-			{
-				fprintf(stderr, "%s: invalid expire value\n",
-				        progname);
-				return EX_USAGE;
-			}
-			break;
+	if (status != GNUTLS_E_SUCCESS)
+	{
+		strlcpy(err, "gnutls_x509_privkey_import() failed", errlen);
+		(void) gnutls_x509_privkey_deinit(xprivkey);
+		return -1;
+	}
 
-		  case 'F':
-			suffix = TRUE;
-			fqdnsuffix = TRUE;
-			break;
+	status = gnutls_privkey_init(&privkey);
+	if (status != GNUTLS_E_SUCCESS)
+	{
+		strlcpy(err, "gnutls_privkey_init() failed", errlen);
+		(void) gnutls_x509_privkey_deinit(xprivkey);
+		return -1;
+	}
 
-		  case 'N':
-			nameservers = strdup(optarg);
-			break;
+	status = gnutls_privkey_import_x509(privkey, xprivkey, 0);
+	if (status != GNUTLS_E_SUCCESS)
+	{
+		strlcpy(err, "gnutls_privkey_import_x509() failed", errlen);
+		(void) gnutls_x509_privkey_deinit(xprivkey);
+		(void) gnutls_privkey_deinit(privkey);
+		return -1;
+	}
 
-		  case 'o':
-			outfile = optarg;
-			break;
+	if (gnutls_pubkey_init(&pubkey) != GNUTLS_E_SUCCESS)
+	{
+		strlcpy(err, "gnutls_pubkey_init() failed", errlen);
+		(void) gnutls_x509_privkey_deinit(xprivkey);
+		(void) gnutls_privkey_deinit(privkey);
+		return -1;
+	}
 
-		  case 'r':
-			refresh = strtol(optarg, &p, 10);
-			if (*p != '\0' || refresh < 0)
-			{
-				fprintf(stderr, "%s: invalid refresh value\n",
-				        progname);
-				return EX_USAGE;
-			}
-			break;
+	if (gnutls_pubkey_import_privkey(pubkey, privkey,
+	                                 GNUTLS_KEY_DIGITAL_SIGNATURE,
+	                                 0) != GNUTLS_E_SUCCESS)
+	{
+		strlcpy(err, "gnutls_pubkey_import_privkey() failed", errlen);
+		(void) gnutls_x509_privkey_deinit(xprivkey);
+		(void) gnutls_privkey_deinit(privkey);
+		(void) gnutls_pubkey_deinit(pubkey);
+		return -1;
+	}
 
-		  case 'R':
-			retry = strtol(optarg, &p, 10);
-			if (*p != '\0' || retry < 0)
-			{
-				fprintf(stderr, "%s: invalid retry value\n",
-				        progname);
-				return EX_USAGE;
-			}
-			break;
+	pemlen = sizeof pem;
+	status = gnutls_pubkey_export(pubkey, GNUTLS_X509_FMT_PEM,
+	                              pem, &pemlen);
 
-		  case 's':
-			subdomains = TRUE;
-			break;
+	(void) gnutls_x509_privkey_deinit(xprivkey);
+	(void) gnutls_privkey_deinit(privkey);
+	(void) gnutls_pubkey_deinit(pubkey);
 
-		  case 'S':
-			writesoa = TRUE;
-			break;
+	if (status != GNUTLS_E_SUCCESS)
+	{
+		strlcpy(err, "gnutls_pubkey_export() failed", errlen);
+		return -1;
+	}
 
-		  case 't':
-			ttl = strtol(optarg, &p, 10);
-			if (*p != '\0' || ttl < 0)
-			{
-				fprintf(stderr, "%s: invalid TTL value\n",
-				        progname);
-				return EX_USAGE;
-			}
-			break;
+	len = pemlen;
+	p = pem;
+#else /* USE_GNUTLS */
+	/* create a BIO for the private key */
+	if (strncmp(keydata, "-----", 5) == 0)
+	{
+		private = BIO_new_mem_buf(keydata, keylen);
+		if (private == NULL)
+		{
+			strlcpy(err, "BIO_new_mem_buf() failed", errlen);
+			return -1;
+		}
 
-		  case 'T':
-			defttl = strtol(optarg, &p, 10);
-			if (*p != '\0' || defttl < 0)
-			{
-				fprintf(stderr,
-				        "%s: invalid default TTL value\n",
-				        progname);
-				return EX_USAGE;
-			}
-			break;
+		pkey = PEM_read_bio_PrivateKey(private, NULL, NULL, NULL);
+		if (pkey == NULL)
+		{
+			strlcpy(err, "PEM_read_bio_PrivateKey() failed",
+			        errlen);
+			(void) BIO_free(private);
+			return -1;
+		}
+	}
+	else
+	{
+		int inlen;
+		int outlen;
+		BIO *b64;
+		BIO *bio;
+		BIO *decode;
+		char buf[BUFRSZ];
+		char derdata[LARGEBUFRSZ];
 
-		  case 'u':
-			nsupdate = TRUE;
-			break;
+		despace(keydata);
 
-		  case 'v':
-			verbose++;
-			break;
+		b64 = BIO_new(BIO_f_base64());
+		BIO_set_flags(b64, BIO_FLAGS_BASE64_NO_NL);
+		bio = BIO_new_mem_buf(keydata, -1);
+		bio = BIO_push(b64, bio);
 
-		  case 'x':
-			configfile = optarg;
-			break;
+		decode = BIO_new(BIO_s_mem());
 
-		  default:
-			return usage();
+		for (;;)
+		{
+			inlen = BIO_read(bio, buf, sizeof buf);
+			if (inlen == 0)
+				break;
+			BIO_write(decode, buf, inlen);
 		}
-	}
-
-	/* sanity check */
-	if (subdomains && onlydomain == NULL) {
-		fprintf(stderr, "%s: subdomain matching requires a domain\n",
-		        progname);
-		return EX_USAGE;
-	}
 
-	if (optind != argc)
-		dataset = argv[optind];
+		BIO_flush(decode);
 
-	/* process config file */
-	if (configfile == NULL && access(DEFCONFFILE, R_OK) == 0)
-		configfile = DEFCONFFILE;
-	if (configfile != NULL)
-	{
-#ifdef USE_LDAP
-		_Bool ldap_usetls = FALSE;
-#endif /* USE_LDAP */
-		u_int line = 0;
-#ifdef USE_LDAP
-		char *ldap_authmech = NULL;
-# ifdef USE_SASL
-		char *ldap_authname = NULL;
-		char *ldap_authrealm = NULL;
-		char *ldap_authuser = NULL;
-# endif /* USE_SASL */
-		char *ldap_bindpw = NULL;
-		char *ldap_binduser = NULL;
-#endif /* USE_LDAP */
-		struct config *cfg;
-		char path[MAXPATHLEN + 1];
+		outlen = BIO_get_mem_data(decode, &p);
+		memcpy(derdata, p, MIN(sizeof derdata, outlen));
 
-		cfg = config_load(configfile, dkimf_config,
-		                  &line, path, sizeof path, NULL);
+		BIO_free_all(b64);
+		BIO_free(decode);
 
-		if (cfg == NULL)
+		private = BIO_new_mem_buf(derdata, outlen);
+		if (private == NULL)
 		{
-			fprintf(stderr,
-			        "%s: %s: configuration error at line %u\n",
-			        progname, path, line);
-			return EX_CONFIG;
+			strlcpy(err, "BIO_new_mem_buf() failed", errlen);
+			return -1;
 		}
 
-		if (dataset == NULL)
+		pkey = d2i_PrivateKey_bio(private, NULL);
+		if (pkey == NULL)
 		{
-			(void) config_get(cfg, "KeyTable",
-			                  &dataset, sizeof dataset);
+			strlcpy(err, "d2i_PrivateKey_bio() failed", errlen);
+			(void) BIO_free(private);
+			return -1;
 		}
+	}
 
-#ifdef USE_LDAP
+	(void) BIO_free(private);
+
+	outbio = BIO_new(BIO_s_mem());
+	if (outbio == NULL)
+	{
+		strlcpy(err, "BIO_new() failed", errlen);
+		(void) EVP_PKEY_free(pkey);
+		return -1;
+	}
+
+	/* Use generic PUBKEY functions for both RSA and Ed25519 keys */
+	status = PEM_write_bio_PUBKEY(outbio, pkey);
+	(void) EVP_PKEY_free(pkey);
+	if (status == 0)
+	{
+		strlcpy(err, "PEM_write_bio_PUBKEY() failed", errlen);
+		(void) BIO_free(outbio);
+		return -1;
+	}
+
+	len = BIO_get_mem_data(outbio, &p);
+#endif /* USE_GNUTLS */
+
+	/* keep the base64 between the PEM header and trailer */
+	for (; len > 0; len--, p++)
+	{
+		if (*p == '\n')
+		{
+			seenlf = TRUE;
+		}
+		else if (seenlf && *p == '-')
+		{
+			break;
+		}
+		else if (!seenlf)
+		{
+			continue;
+		}
+		else if (isascii(*p) && !isspace(*p))
+		{
+			if (olen + 1 >= publen)
+				break;
+			pub[olen++] = *p;
+		}
+	}
+
+	pub[olen] = '\0';
+
+#ifndef USE_GNUTLS
+	(void) BIO_free(outbio);
+#endif /* ! USE_GNUTLS */
+
+	if (olen + 1 >= publen)
+	{
+		strlcpy(err, "public key too large", errlen);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+**  GZ_FIND -- find or add a key
+**
+**  Parameters:
+**  	gj -- job
+**  	name -- key path, or "=" and digest for an inline key
+**  	add -- add it if not found
+**
+**  Return value:
+**  	The key, or NULL if not found or out of memory.
+*/
+
+struct gzkey *
+gz_find(struct gzjob *gj, const char *name, _Bool add)
+{
+	unsigned int h = 0;
+	const char *p;
+	struct gzkey *gk;
+
+	assert(gj != NULL);
+	assert(name != NULL);
+
+	for (p = name; *p != '\0'; p++)
+		h = h * 31 + (unsigned char) *p;
+	h %= GZ_HASHSZ;
+
+	for (gk = gj->gj_keys[h]; gk != NULL; gk = gk->gk_next)
+	{
+		if (strcmp(gk->gk_name, name) == 0)
+			return gk;
+	}
+
+	if (!add)
+		return NULL;
+
+	gk = malloc(sizeof *gk);
+	if (gk == NULL)
+		return NULL;
+
+	memset(gk, '\0', sizeof *gk);
+	gk->gk_name = strdup(name);
+	if (gk->gk_name == NULL)
+	{
+		free(gk);
+		return NULL;
+	}
+
+	gk->gk_inline = (name[0] == '=');
+	gk->gk_next = gj->gj_keys[h];
+	gj->gj_keys[h] = gk;
+
+	return gk;
+}
+
+/*
+**  GZ_LOADSTATE -- read a state file from a previous run
+**
+**  Parameters:
+**  	gj -- job
+**  	path -- state file
+**
+**  Return value:
+**  	0 on success (including a missing file), -1 on failure.
+**
+**  Notes:
+**  	Each line holds a key name, device, inode, modification and
+**  	status change times in nanoseconds, size, private key digest and
+**  	base64 public key, separated by tabs.  Lines that can't be parsed are ignored; the affected keys
+**  	are simply derived again.
+*/
+
+int
+gz_loadstate(struct gzjob *gj, const char *path)
+{
+	int n;
+	FILE *f;
+	char *p;
+	char *q;
+	struct gzkey *gk;
+	char *fields[8];
+	char line[LARGEBUFRSZ * 2];
+
+	assert(gj != NULL);
+	assert(path != NULL);
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		return (errno == ENOENT ? 0 : -1);
+
+	if (fgets(line, sizeof line, f) == NULL ||
+	    strncmp(line, STATEMAGIC, strlen(STATEMAGIC)) != 0)
+	{
+		/* unknown format; start over */
+		fclose(f);
+		return 0;
+	}
+
+	while (fgets(line, sizeof line, f) != NULL)
+	{
+		p = strchr(line, '\n');
+		if (p == NULL)
+			continue;
+		*p = '\0';
+
+		for (n = 0, p = line; n < 8 && p != NULL; n++)
+		{
+			fields[n] = p;
+			q = strchr(p, '\t');
+			if (q != NULL)
+				*q++ = '\0';
+			p = q;
+		}
+
+		if (n != 8 || p != NULL ||
+		    strlen(fields[6]) != DIGESTLEN * 2 || fields[7][0] == '\0')
+			continue;
+
+		gk = gz_find(gj, fields[0], TRUE);
+		if (gk == NULL)
+		{
+			fclose(f);
+			return -1;
+		}
+
+		gk->gk_dev = strtoull(fields[1], NULL, 10);
+		gk->gk_ino = strtoull(fields[2], NULL, 10);
+		gk->gk_mtime = strtoll(fields[3], NULL, 10);
+		gk->gk_ctime = strtoll(fields[4], NULL, 10);
+		gk->gk_size = strtoll(fields[5], NULL, 10);
+		strlcpy(gk->gk_digest, fields[6], sizeof gk->gk_digest);
+		free(gk->gk_pubkey);
+		gk->gk_pubkey = strdup(fields[7]);
+	}
+
+	fclose(f);
+
+	return 0;
+}
+
+/*
+**  GZ_OPENTMP -- open a temporary file to be renamed over another later
+**
+**  Parameters:
+**  	path -- final path
+**  	tmppath -- temporary path (returned)
+**  	tmplen -- bytes available at "tmppath"
+**
+**  Return value:
+**  	An open stream, or NULL on failure.
+**
+**  Notes:
+**  	The temporary file is in the same directory as "path" so that it
+**  	can be renamed into place, and is given the mode of any existing
+**  	file at "path" so that replacing it doesn't change permissions.
+*/
+
+FILE *
+gz_opentmp(const char *path, char *tmppath, size_t tmplen)
+{
+	int fd;
+	mode_t mask;
+	mode_t mode;
+	FILE *f;
+	struct stat s;
+
+	assert(path != NULL);
+	assert(tmppath != NULL);
+
+	snprintf(tmppath, tmplen, "%s.XXXXXX", path);
+
+	fd = mkstemp(tmppath);
+	if (fd < 0)
+		return NULL;
+
+	if (stat(path, &s) == 0)
+	{
+		mode = s.st_mode & 07777;
+	}
+	else
+	{
+		mask = umask(0);
+		(void) umask(mask);
+		mode = 0666 & ~mask;
+	}
+
+	(void) fchmod(fd, mode);
+
+	f = fdopen(fd, "w");
+	if (f == NULL)
+	{
+		close(fd);
+		unlink(tmppath);
+	}
+
+	return f;
+}
+
+/*
+**  GZ_COMMIT -- finish a file opened by gz_opentmp()
+**
+**  Parameters:
+**  	f -- stream
+**  	tmppath -- temporary path
+**  	path -- final path
+**  	keep -- if FALSE, discard the temporary file instead
+**
+**  Return value:
+**  	0 on success, -1 on failure (errno is set).
+*/
+
+int
+gz_commit(FILE *f, const char *tmppath, const char *path, _Bool keep)
+{
+	int status = 0;
+	int saveerrno;
+
+	assert(f != NULL);
+	assert(tmppath != NULL);
+	assert(path != NULL);
+
+	if (keep && (fflush(f) != 0 || fsync(fileno(f)) != 0))
+		status = -1;
+
+	if (fclose(f) != 0)
+		status = -1;
+
+	if (keep && status == 0 && rename(tmppath, path) != 0)
+		status = -1;
+
+	if (!keep || status != 0)
+	{
+		saveerrno = errno;
+		(void) unlink(tmppath);
+		errno = saveerrno;
+	}
+
+	return status;
+}
+
+/*
+**  GZ_SAVESTATE -- write the state file for the next run
+**
+**  Parameters:
+**  	gj -- job
+**  	path -- state file
+**
+**  Return value:
+**  	0 on success, -1 on failure.
+**
+**  Notes:
+**  	Only keys named by this run's KeyTable are written, so keys that
+**  	have been retired fall out of the state.
+*/
+
+int
+gz_savestate(struct gzjob *gj, const char *path)
+{
+	int c;
+	FILE *f;
+	struct gzkey *gk;
+	char tmppath[MAXPATHLEN + 1];
+
+	assert(gj != NULL);
+	assert(path != NULL);
+
+	f = gz_opentmp(path, tmppath, sizeof tmppath);
+	if (f == NULL)
+		return -1;
+
+	fprintf(f, "%s\n", STATEMAGIC);
+
+	for (c = 0; c < GZ_HASHSZ; c++)
+	{
+		for (gk = gj->gj_keys[c]; gk != NULL; gk = gk->gk_next)
+		{
+			if (!gk->gk_used || gk->gk_status != 0 ||
+			    gk->gk_pubkey == NULL ||
+			    strpbrk(gk->gk_name, "\t\n") != NULL)
+				continue;
+
+			fprintf(f, "%s\t%llu\t%llu\t%lld\t%lld\t%lld\t%s\t%s\n",
+			        gk->gk_name, gk->gk_dev, gk->gk_ino,
+			        gk->gk_mtime, gk->gk_ctime, gk->gk_size,
+			        gk->gk_digest, gk->gk_pubkey);
+		}
+	}
+
+	return gz_commit(f, tmppath, path, TRUE);
+}
+
+/*
+**  GZ_DERIVE -- produce the public key for one key
+**
+**  Parameters:
+**  	gk -- key
+**
+**  Return value:
+**  	TRUE iff the key had to be derived (rather than reused).
+**
+**  Notes:
+**  	Reads the key file, and then reuses the previous public key if
+**  	the file's content is unchanged (e.g. it was only touched or
+**  	copied) or derives a new one if not.  Sets gk_status on failure.
+*/
+
+_Bool
+gz_derive(struct gzkey *gk)
+{
+	size_t keylen;
+	struct stat s;
+	char digest[DIGESTLEN * 2 + 1];
+	char pub[LARGEBUFRSZ];
+	char keydata[LARGEBUFRSZ];
+
+	assert(gk != NULL);
+
+	memset(keydata, '\0', sizeof keydata);
+	memset(&s, '\0', sizeof s);
+
+	if (gk->gk_inline)
+	{
+		strlcpy(keydata, gk->gk_data, sizeof keydata);
+		keylen = strlen(keydata);
+	}
+	else
+	{
+		strlcpy(keydata, gk->gk_name, sizeof keydata);
+		keylen = sizeof keydata - 1;
+		errno = 0;
+		if (!loadkey(keydata, &keylen, &s))
+		{
+			snprintf(gk->gk_err, sizeof gk->gk_err,
+			         "%s: %s", gk->gk_name,
+			         errno == 0 ? "read failed" : strerror(errno));
+			gk->gk_status = -1;
+			return TRUE;
+		}
+
+		gk->gk_dev = s.st_dev;
+		gk->gk_ino = s.st_ino;
+		gk->gk_mtime = STAT_NSEC(s, m);
+		gk->gk_ctime = STAT_NSEC(s, c);
+		gk->gk_size = s.st_size;
+
+		/*
+		**  A file changed within the timestamp granularity of
+		**  now could change again without its times moving; don't
+		**  trust its identity next time, only its digest.
+		*/
+
+		if (s.st_ctime >= time(NULL) - 1)
+			gk->gk_ctime = 0;
+	}
+
+	if (keydigest(keydata, keylen, digest) != 0)
+	{
+		strlcpy(gk->gk_err, "digest failed", sizeof gk->gk_err);
+		gk->gk_status = -1;
+		memset(keydata, '\0', sizeof keydata);
+		return TRUE;
+	}
+
+	if (gk->gk_pubkey != NULL && strcmp(digest, gk->gk_digest) == 0)
+	{
+		memset(keydata, '\0', sizeof keydata);
+		return FALSE;
+	}
+
+	strlcpy(gk->gk_digest, digest, sizeof gk->gk_digest);
+	free(gk->gk_pubkey);
+	gk->gk_pubkey = NULL;
+
+	if (derivekey(keydata, keylen, pub, sizeof pub,
+	              gk->gk_err, sizeof gk->gk_err) != 0)
+		gk->gk_status = -1;
+	else if ((gk->gk_pubkey = strdup(pub)) == NULL)
+		gk->gk_status = -1;
+
+	memset(keydata, '\0', sizeof keydata);
+
+	return TRUE;
+}
+
+/*
+**  GZ_WORKER -- derive queued keys until told to stop
+**
+**  Parameters:
+**  	arg -- job (struct gzjob *)
+**
+**  Return value:
+**  	Always NULL.
+*/
+
+void *
+gz_worker(void *arg)
+{
+	_Bool derived;
+	struct gzjob *gj;
+	struct gzkey *gk;
+
+	gj = (struct gzjob *) arg;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&gj->gj_lock);
+		while (!gj->gj_abort && gj->gj_next == gj->gj_nqueue)
+			pthread_cond_wait(&gj->gj_cond, &gj->gj_lock);
+		if (gj->gj_abort)
+		{
+			pthread_mutex_unlock(&gj->gj_lock);
+			break;
+		}
+		gk = gj->gj_queue[gj->gj_next++];
+		pthread_mutex_unlock(&gj->gj_lock);
+
+		derived = gz_derive(gk);
+
+		pthread_mutex_lock(&gj->gj_lock);
+		gk->gk_done = TRUE;
+		gk->gk_derived = derived;
+		if (derived)
+			gj->gj_derived++;
+		else
+			gj->gj_reused++;
+		pthread_cond_broadcast(&gj->gj_cond);
+		pthread_mutex_unlock(&gj->gj_lock);
+	}
+
+	return NULL;
+}
+
+/*
+**  GZ_ENQUEUE -- hand a key to the workers
+**
+**  Parameters:
+**  	gj -- job
+**  	gk -- key
+**
+**  Return value:
+**  	0 on success, -1 on failure.
+*/
+
+int
+gz_enqueue(struct gzjob *gj, struct gzkey *gk)
+{
+	assert(gj != NULL);
+	assert(gk != NULL);
+
+	pthread_mutex_lock(&gj->gj_lock);
+
+	if (gj->gj_nqueue == gj->gj_qalloc)
+	{
+		size_t newalloc;
+		struct gzkey **new;
+
+		newalloc = (gj->gj_qalloc == 0 ? 1024 : gj->gj_qalloc * 2);
+		new = realloc(gj->gj_queue, newalloc * sizeof *new);
+		if (new == NULL)
+		{
+			pthread_mutex_unlock(&gj->gj_lock);
+			return -1;
+		}
+
+		gj->gj_queue = new;
+		gj->gj_qalloc = newalloc;
+	}
+
+	gk->gk_queued = TRUE;
+	gj->gj_queue[gj->gj_nqueue++] = gk;
+	pthread_cond_signal(&gj->gj_cond);
+
+	pthread_mutex_unlock(&gj->gj_lock);
+
+	return 0;
+}
+
+/*
+**  GZ_CLAIM -- arrange for a KeyTable key to be available
+**
+**  Parameters:
+**  	gj -- job
+**  	keydata -- key path or inline key data
+**
+**  Return value:
+**  	The key, or NULL on failure.
+**
+**  Notes:
+**  	A key file whose device, inode, modification time and size all
+**  	match the state from the previous run is not read at all.
+**  	Anything else is queued for a worker.
+*/
+
+struct gzkey *
+gz_claim(struct gzjob *gj, char *keydata)
+{
+	_Bool isfile;
+	struct gzkey *gk;
+	struct stat s;
+	char name[DIGESTLEN * 2 + 2];
+
+	assert(gj != NULL);
+	assert(keydata != NULL);
+
+	isfile = (keydata[0] == '/' ||
+	          strncmp(keydata, "./", 2) == 0 ||
+	          strncmp(keydata, "../", 3) == 0);
+
+	if (isfile)
+	{
+		gk = gz_find(gj, keydata, TRUE);
+	}
+	else
+	{
+		name[0] = '=';
+		if (keydigest(keydata, strlen(keydata), name + 1) != 0)
+			return NULL;
+		gk = gz_find(gj, name, TRUE);
+	}
+
+	if (gk == NULL || gk->gk_used)
+		return gk;
+
+	gk->gk_used = TRUE;
+
+	if (!isfile)
+	{
+		if (gk->gk_pubkey != NULL)
+		{
+			/* the name is the digest, so this is a match */
+			gk->gk_done = TRUE;
+			gj->gj_reused++;
+			return gk;
+		}
+
+		strlcpy(gk->gk_digest, name + 1, sizeof gk->gk_digest);
+		gk->gk_data = strdup(keydata);
+		if (gk->gk_data == NULL)
+			return NULL;
+	}
+	else if (gk->gk_pubkey != NULL && stat(keydata, &s) == 0 &&
+	         (unsigned long long) s.st_dev == gk->gk_dev &&
+	         (unsigned long long) s.st_ino == gk->gk_ino &&
+	         STAT_NSEC(s, m) == gk->gk_mtime &&
+	         STAT_NSEC(s, c) == gk->gk_ctime &&
+	         (long long) s.st_size == gk->gk_size)
+	{
+		gk->gk_done = TRUE;
+		gj->gj_reused++;
+		return gk;
+	}
+
+	if (gz_enqueue(gj, gk) != 0)
+		return NULL;
+
+	return gk;
+}
+
+/*
+**  GZ_FREE -- release a job's keys
+**
+**  Parameters:
+**  	gj -- job
+**
+**  Return value:
+**  	None.
+*/
+
+void
+gz_free(struct gzjob *gj)
+{
+	int c;
+	struct gzkey *gk;
+	struct gzkey *next;
+
+	assert(gj != NULL);
+
+	for (c = 0; c < GZ_HASHSZ; c++)
+	{
+		for (gk = gj->gj_keys[c]; gk != NULL; gk = next)
+		{
+			next = gk->gk_next;
+			if (gk->gk_data != NULL)
+			{
+				memset(gk->gk_data, '\0', strlen(gk->gk_data));
+				free(gk->gk_data);
+			}
+			free(gk->gk_name);
+			free(gk->gk_pubkey);
+			free(gk);
+		}
+	}
+
+	free(gj->gj_queue);
+}
+	
+/*
+**  USAGE -- print usage message and exit
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	EX_USAGE
+*/
+
+int
+usage(void)
+{
+	fprintf(stderr, "%s: usage: %s [opts] [dataset]\n"
+	                "\t-c file     \tstate file for incremental runs\n"
+	                "\t-C user@host\tcontact address to include in SOA\n"
+	                "\t-d domain   \twrite keys for named domain only\n"
+	                "\t-D          \tinclude '._domainkey' suffix\n"
+	                "\t-E secs     \tuse specified expiration time in SOA\n"
+	                "\t-F          \tinclude '._domainkey' suffix and domainname\n"
+	                "\t-j threads  \tderive keys using this many threads\n"
+	                "\t-o file     \toutput file\n"
+	                "\t-N ns[,...] \tlist NS records\n"
+	                "\t-r secs     \tuse specified refresh time in SOA\n"
+	                "\t-R secs     \tuse specified retry time in SOA\n"
+	                "\t-s          \twith -d, also match subdomains\n"
+	                "\t-S          \twrite an SOA record\n"
+	                "\t-t secs     \tuse specified per-record TTL\n"
+	                "\t-T secs     \tuse specified default TTL in SOA\n"
+	                "\t-u          \tproduce output suitable for use by \"nsupdate\"\n"
+	                "\t-v          \tverbose output\n"
+	                "\t-x file     \tconfiguration file\n",
+		progname, progname);
+
+	return EX_USAGE;
+}
+
+/*
+**  MAIN -- program mainline
+**
+**  Parameters:
+**  	argc, argv -- the usual
+**
+**  Return value:
+**  	Exit status.
+*/
+
+int
+main(int argc, char **argv)
+{
+	_Bool nsupdate = FALSE;
+	_Bool suffix = FALSE;
+	_Bool fqdnsuffix = FALSE;
+	_Bool subdomains = FALSE;
+	_Bool writesoa = FALSE;
+	int c;
+	int status;
+	int verbose = 0;
+	int olen;
+	int nthreads = 0;
+	int nstarted = 0;
+	int ttl = -1;
+	int defttl = DEFTTL;
+	int expire = DEFEXPIRE;
+	int refresh = DEFREFRESH;
+	int retry = DEFRETRY;
+	int nscount = 0;
+	time_t now;
+	size_t keylen;
+	size_t domain_len;
+	size_t onlydomain_len;
+	size_t nrecs = 0;
+	size_t ralloc = 0;
+	size_t r;
+	double elapsed;
+	char *p;
+	char *dataset = NULL;
+	char *outfile = NULL;
+	char *statefile = NULL;
+	char *onlydomain = NULL;
+	char *contact = NULL;
+	char *nameservers = NULL;
+	char *configfile = NULL;
+	char *err = NULL;
+	char *nslist[MAXNS];
+	FILE *out;
+	DKIMF_DB db;
+	pthread_t *tids = NULL;
+	struct gzrec *recs = NULL;
+	struct gzjob *gj;
+	struct timeval start;
+	struct timeval end;
+	char keyname[BUFRSZ + 1];
+	char domain[BUFRSZ + 1];
+	char selector[BUFRSZ + 1];
+	char tmpbuf[BUFRSZ + 1];
+	char hostname[DKIM_MAXHOSTNAMELEN + 1];
+	char keydata[LARGEBUFRSZ];
+	char tmppath[MAXPATHLEN + 1];
+	struct dkimf_db_data dbd[3];
+
+	progname = (p = strrchr(argv[0], '/')) == NULL ? argv[0] : p + 1;
+
+	while ((c = getopt(argc, argv, CMDLINEOPTS)) != -1)
+	{
+		switch (c)
+		{
+		  case 'c':
+			statefile = optarg;
+			break;
+
+		  case 'C':
+			contact = strdup(optarg);
+			break;
+
+		  case 'd':
+			onlydomain = optarg;
+			break;
+
+		  case 'D':
+			suffix = TRUE;
+			break;
+
+		  case 'E':
+			expire = strtol(optarg, &p, 10);
+			if (*p != '\0' || expire < 0)
+			{
+				fprintf(stderr, "%s: invalid expire value\n",
+				        progname);
+				return EX_USAGE;
+			}
+			break;
+
+		  case 'F':
+			suffix = TRUE;
+			fqdnsuffix = TRUE;
+			break;
+
+		  case 'j':
+			nthreads = strtol(optarg, &p, 10);
+			if (*p != '\0' || nthreads <= 0)
+			{
+				fprintf(stderr, "%s: invalid thread count\n",
+				        progname);
+				return EX_USAGE;
+			}
+			break;
+
+		  case 'N':
+			nameservers = strdup(optarg);
+			break;
+
+		  case 'o':
+			outfile = optarg;
+			break;
+
+		  case 'r':
+			refresh = strtol(optarg, &p, 10);
+			if (*p != '\0' || refresh < 0)
+			{
+				fprintf(stderr, "%s: invalid refresh value\n",
+				        progname);
+				return EX_USAGE;
+			}
+			break;
+
+		  case 'R':
+			retry = strtol(optarg, &p, 10);
+			if (*p != '\0' || retry < 0)
+			{
+				fprintf(stderr, "%s: invalid retry value\n",
+				        progname);
+				return EX_USAGE;
+			}
+			break;
+
+		  case 's':
+			subdomains = TRUE;
+			break;
+
+		  case 'S':
+			writesoa = TRUE;
+			break;
+
+		  case 't':
+			ttl = strtol(optarg, &p, 10);
+			if (*p != '\0' || ttl < 0)
+			{
+				fprintf(stderr, "%s: invalid TTL value\n",
+				        progname);
+				return EX_USAGE;
+			}
+			break;
+
+		  case 'T':
+			defttl = strtol(optarg, &p, 10);
+			if (*p != '\0' || defttl < 0)
+			{
+				fprintf(stderr,
+				        "%s: invalid default TTL value\n",
+				        progname);
+				return EX_USAGE;
+			}
+			break;
+
+		  case 'u':
+			nsupdate = TRUE;
+			break;
+
+		  case 'v':
+			verbose++;
+			break;
+
+		  case 'x':
+			configfile = optarg;
+			break;
+
+		  default:
+			return usage();
+		}
+	}
+
+	/* sanity check */
+	if (subdomains && onlydomain == NULL) {
+		fprintf(stderr, "%s: subdomain matching requires a domain\n",
+		        progname);
+		return EX_USAGE;
+	}
+
+	if (optind != argc)
+		dataset = argv[optind];
+
+	/* process config file */
+	if (configfile == NULL && access(DEFCONFFILE, R_OK) == 0)
+		configfile = DEFCONFFILE;
+	if (configfile != NULL)
+	{
+#ifdef USE_LDAP
+		_Bool ldap_usetls = FALSE;
+#endif /* USE_LDAP */
+		u_int line = 0;
+#ifdef USE_LDAP
+		char *ldap_authmech = NULL;
+# ifdef USE_SASL
+		char *ldap_authname = NULL;
+		char *ldap_authrealm = NULL;
+		char *ldap_authuser = NULL;
+# endif /* USE_SASL */
+		char *ldap_bindpw = NULL;
+		char *ldap_binduser = NULL;
+#endif /* USE_LDAP */
+		struct config *cfg;
+		char path[MAXPATHLEN + 1];
+
+		cfg = config_load(configfile, dkimf_config,
+		                  &line, path, sizeof path, NULL);
+
+		if (cfg == NULL)
+		{
+			fprintf(stderr,
+			        "%s: %s: configuration error at line %u\n",
+			        progname, path, line);
+			return EX_CONFIG;
+		}
+
+		if (dataset == NULL)
+		{
+			(void) config_get(cfg, "KeyTable",
+			                  &dataset, sizeof dataset);
+		}
+
+#ifdef USE_LDAP
 		(void) config_get(cfg, "LDAPUseTLS",
 		                  &ldap_usetls, sizeof ldap_usetls);
 
@@ -485,143 +1457,91 @@ main(int argc, char **argv)
 	if (dataset == NULL)
 		return usage();
 
-#ifndef USE_GNUTLS
-	outbio = BIO_new(BIO_s_mem());
-	if (outbio == NULL)
+	if (nthreads == 0)
 	{
-		fprintf(stderr, "%s: BIO_new() failed\n", progname);
-		return 1;
+		long ncpus;
+
+		ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = (ncpus > 0 ? (int) ncpus : 1);
 	}
-#endif /* ! USE_GNUTLS */
 
 #ifdef USE_GNUTLS
 	(void) gnutls_global_init();
-#endif /* USE_GNUTLS */
-
-	status = dkimf_db_open(&db, dataset, DKIMF_DB_FLAG_READONLY,
-	                       NULL, &err);
-	if (status != 0)
-	{
-		fprintf(stderr, "%s: dkimf_db_open(): %s\n", progname, err);
-#ifndef USE_GNUTLS
-		(void) BIO_free(outbio);
-#endif /* ! USE_GNUTLS */
-		return 1;
-	}
-
-	if (dkimf_db_type(db) == DKIMF_DB_TYPE_REFILE)
-	{
-		fprintf(stderr, "%s: invalid data set type\n", progname);
-#ifndef USE_GNUTLS
-		(void) BIO_free(outbio);
-#endif /* ! USE_GNUTLS */
-		(void) dkimf_db_close(db);
-		return 1;
-	}
-
-	if (verbose > 0)
-		fprintf(stderr, "%s: database opened\n", progname);
-
-	if (outfile != NULL)
-	{
-		out = fopen(outfile, "w");
-		if (out == NULL)
-		{
-			fprintf(stderr, "%s: %s: fopen(): %s\n",
-			        progname, outfile, strerror(errno));
-			(void) dkimf_db_close(db);
-#ifndef USE_GNUTLS
-			(void) BIO_free(outbio);
-#endif /* ! USE_GNUTLS */
-			return 1;
-		}
-	}
-	else
-	{
-		out = stdout;
-	}
-
-	if (nameservers != NULL)
-	{
-		for (p = strtok(nameservers, ",");
-		     p != NULL && nscount < MAXNS;
-		     p = strtok(NULL, ","))
-			nslist[nscount++] = p;
-	}
-
-	memset(hostname, '\0', sizeof hostname);
-	gethostname(hostname, sizeof hostname);
-
-	if (nscount == 0)
-		nslist[nscount++] = hostname;
-
-	(void) time(&now);
+#endif /* USE_GNUTLS */
 
-	if (!nsupdate)
+	gj = malloc(sizeof *gj);
+	if (gj == NULL)
 	{
-		fprintf(out, "; DKIM public key zone data\n");
-		if (onlydomain != NULL)
-			fprintf(out, "; for %s\n", onlydomain);
+		fprintf(stderr, "%s: malloc(): %s\n", progname,
+		        strerror(errno));
+		return 1;
 	}
+	memset(gj, '\0', sizeof *gj);
+	pthread_mutex_init(&gj->gj_lock, NULL);
+	pthread_cond_init(&gj->gj_cond, NULL);
 
-	if (writesoa && !nsupdate)
+	if (statefile != NULL && gz_loadstate(gj, statefile) != 0)
 	{
-		struct tm *tm;
+		fprintf(stderr, "%s: %s: %s\n", progname, statefile,
+		        strerror(errno));
+		gz_free(gj);
+		free(gj);
+		return 1;
+	}
 
-		fprintf(out, "@\tIN\tSOA\t%s\t", nslist[0]);
+	status = dkimf_db_open(&db, dataset, DKIMF_DB_FLAG_READONLY,
+	                       NULL, &err);
+	if (status != 0)
+	{
+		fprintf(stderr, "%s: dkimf_db_open(): %s\n", progname, err);
+		gz_free(gj);
+		free(gj);
+		return 1;
+	}
 
-		if (contact != NULL)
-		{
-			for (p = contact; *p != '\0'; p++)
-			{
-				if (*p == '@')
-					*p = '.';
-			}
+	if (dkimf_db_type(db) == DKIMF_DB_TYPE_REFILE)
+	{
+		fprintf(stderr, "%s: invalid data set type\n", progname);
+		(void) dkimf_db_close(db);
+		gz_free(gj);
+		free(gj);
+		return 1;
+	}
 
-			fprintf(out, "%s", contact);
-		}
-		else
-		{
-			struct passwd *pwd;
+	if (verbose > 0)
+		fprintf(stderr, "%s: database opened\n", progname);
 
-			pwd = getpwuid(getuid());
+	(void) gettimeofday(&start, NULL);
 
-			fprintf(out, "%s.%s",
-			        pwd == NULL ? HOSTMASTER : pwd->pw_name,
-			        hostname);
+	/* start the workers; they pick up keys as the walk queues them */
+	tids = malloc(sizeof(pthread_t) * nthreads);
+	if (tids != NULL)
+	{
+		for (c = 0; c < nthreads; c++)
+		{
+			if (pthread_create(&tids[c], NULL, gz_worker, gj) != 0)
+				break;
+			nstarted++;
 		}
-
-		tm = localtime(&now);
-
-		fprintf(out,
-		        "\t (\n"
-		        "\t%04d%02d%02d%02d   ; Serial (yyyymmddhh)\n"
-		        "\t%-10d   ; Refresh\n"
-		        "\t%-10d   ; Retry\n"
-		        "\t%-10d   ; Expire\n"
-		        "\t%-10d ) ; Default\n\n",
-		        tm->tm_year + 1900,
-		        tm->tm_mon + 1,
-		        tm->tm_mday,
-		        tm->tm_hour,
-		        refresh, retry, expire, defttl);
 	}
 
-	if (nameservers != NULL && !nsupdate)
+	if (nstarted == 0)
 	{
-		for (c = 0; c < nscount; c++)
-			fprintf(out, "\tIN\tNS\t%s\n", nslist[c]);
-
-		fprintf(out, "\n");
+		fprintf(stderr, "%s: unable to start worker threads\n",
+		        progname);
+		(void) dkimf_db_close(db);
+		free(tids);
+		gz_free(gj);
+		free(gj);
+		return 1;
 	}
 
-	if (nsupdate)
-		fprintf(out, "server %s\n", nslist[0]);
-
 	dbd[0].dbdata_buffer = domain;
 	dbd[1].dbdata_buffer = selector;
 	dbd[2].dbdata_buffer = keydata;
 
+	status = 0;
+
 	for (c = 0; ; c++)
 	{
 		memset(keyname, '\0', sizeof keyname);
@@ -643,14 +1563,11 @@ main(int argc, char **argv)
 			dkimf_db_strerror(db, err, sizeof err);
 			fprintf(stderr, "%s: dkimf_db_walk(%d) failed: %s\n",
 			        progname, c, err);
-			(void) dkimf_db_close(db);
-#ifndef USE_GNUTLS
-			(void) BIO_free(outbio);
-#endif /* ! USE_GNUTLS */
-			return 1;
+			break;
 		}
 		else if (status == 1)
 		{
+			status = 0;
 			break;
 		}
 
@@ -685,185 +1602,184 @@ main(int argc, char **argv)
 			        progname, c, keyname);
 		}
 
-		keylen = sizeof keydata;
-		if (!loadkey(keydata, &keylen))
+		if (nrecs == ralloc)
 		{
-			fprintf(stderr, "%s: key for '%s' load failed\n",
-			        progname, keyname);
-			(void) dkimf_db_close(db);
-#ifndef USE_GNUTLS
-			(void) BIO_free(outbio);
-#endif /* USE_GNUTLS */
-			return 1;
-		}
+			size_t newalloc;
+			struct gzrec *new;
 
-		if (verbose > 1)
-		{
-			fprintf(stderr, "%s: key for '%s' loaded\n",
-			        progname, keyname);
-		}
+			newalloc = (ralloc == 0 ? 1024 : ralloc * 2);
+			new = realloc(recs, newalloc * sizeof *new);
+			if (new == NULL)
+			{
+				fprintf(stderr, "%s: realloc(): %s\n",
+				        progname, strerror(errno));
+				status = -1;
+				break;
+			}
 
-#ifdef USE_GNUTLS
-		if (gnutls_x509_privkey_init(&xprivkey) != GNUTLS_E_SUCCESS)
-		{
-			fprintf(stderr,
-			        "%s: gnutls_x509_privkey_init() failed\n",
-			        progname);
-			(void) dkimf_db_close(db);
-			return 1;
+			recs = new;
+			ralloc = newalloc;
 		}
 
-		key.data = keydata;
-		key.size = keylen;
+		recs[nrecs].gr_keyname = strdup(keyname);
+		recs[nrecs].gr_domain = strdup(domain);
+		recs[nrecs].gr_selector = strdup(selector);
+		recs[nrecs].gr_key = gz_claim(gj, keydata);
+		nrecs++;
 
-		status = gnutls_x509_privkey_import(xprivkey, &key,
-		                                    GNUTLS_X509_FMT_PEM);
-		if (status != GNUTLS_E_SUCCESS)
-		{
-			status = gnutls_x509_privkey_import(xprivkey, &key,
-		                                            GNUTLS_X509_FMT_DER);
-		}
+		memset(keydata, '\0', sizeof keydata);
 
-		if (status != GNUTLS_E_SUCCESS)
+		if (recs[nrecs - 1].gr_keyname == NULL ||
+		    recs[nrecs - 1].gr_domain == NULL ||
+		    recs[nrecs - 1].gr_selector == NULL ||
+		    recs[nrecs - 1].gr_key == NULL)
 		{
-			fprintf(stderr,
-			        "%s: gnutls_x509_privkey_import() failed\n",
-			        progname);
-			(void) gnutls_x509_privkey_deinit(xprivkey);
-			return -1;
+			fprintf(stderr, "%s: key for '%s' load failed\n",
+			        progname, keyname);
+			status = -1;
+			break;
 		}
+	}
 
-		status = gnutls_privkey_init(&privkey);
-		if (status != GNUTLS_E_SUCCESS)
+	(void) dkimf_db_close(db);
+
+	out = NULL;
+	if (status == 0)
+	{
+		if (outfile != NULL)
 		{
-			fprintf(stderr,
-			        "%s: gnutls_privkey_init() failed\n",
-			        progname);
-			(void) gnutls_x509_privkey_deinit(xprivkey);
-			return -1;
+			out = gz_opentmp(outfile, tmppath, sizeof tmppath);
+			if (out == NULL)
+			{
+				fprintf(stderr, "%s: %s: %s\n",
+				        progname, outfile, strerror(errno));
+				status = -1;
+			}
 		}
-
-		status = gnutls_privkey_import_x509(privkey, xprivkey, 0);
-		if (status != GNUTLS_E_SUCCESS)
+		else
 		{
-			fprintf(stderr,
-			        "%s: gnutls_privkey_import_x509() failed\n",
-			        progname);
-			(void) gnutls_x509_privkey_deinit(xprivkey);
-			(void) gnutls_privkey_deinit(privkey);
-			return -1;
+			out = stdout;
 		}
-#else /* USE_GNUTLS */
-		/* create a BIO for the private key */
-		if (strncmp(keydata, "-----", 5) == 0)
+	}
+
+	if (status != 0)
+		goto done;
+
+	if (nameservers != NULL)
+	{
+		for (p = strtok(nameservers, ",");
+		     p != NULL && nscount < MAXNS;
+		     p = strtok(NULL, ","))
+			nslist[nscount++] = p;
+	}
+
+	memset(hostname, '\0', sizeof hostname);
+	gethostname(hostname, sizeof hostname);
+
+	if (nscount == 0)
+		nslist[nscount++] = hostname;
+
+	(void) time(&now);
+
+	if (!nsupdate)
+	{
+		fprintf(out, "; DKIM public key zone data\n");
+		if (onlydomain != NULL)
+			fprintf(out, "; for %s\n", onlydomain);
+	}
+
+	if (writesoa && !nsupdate)
+	{
+		struct tm *tm;
+
+		fprintf(out, "@\tIN\tSOA\t%s\t", nslist[0]);
+
+		if (contact != NULL)
 		{
-			private = BIO_new_mem_buf(keydata, keylen);
-			if (private == NULL)
+			for (p = contact; *p != '\0'; p++)
 			{
-				fprintf(stderr,
-				        "%s: BIO_new_mem_buf() failed\n",
-				        progname);
-				(void) dkimf_db_close(db);
-				(void) BIO_free(outbio);
-				return 1;
+				if (*p == '@')
+					*p = '.';
 			}
 
-			pkey = PEM_read_bio_PrivateKey(private, NULL,
-			                               NULL, NULL);
-			if (pkey == NULL)
-			{
-				fprintf(stderr,
-				        "%s: PEM_read_bio_PrivateKey() failed\n",
-				        progname);
-				(void) dkimf_db_close(db);
-				(void) BIO_free(private);
-				(void) BIO_free(outbio);
-				return 1;
-			}
+			fprintf(out, "%s", contact);
 		}
 		else
 		{
-			int inlen;
-			int outlen;
-			BIO *b64;
-			BIO *bio;
-			BIO *decode;
-			char buf[BUFRSZ];
+			struct passwd *pwd;
 
-			despace(keydata);
+			pwd = getpwuid(getuid());
 
-			b64 = BIO_new(BIO_f_base64());
-			BIO_set_flags(b64, BIO_FLAGS_BASE64_NO_NL);
-			bio = BIO_new_mem_buf(keydata, -1);
-			bio = BIO_push(b64, bio);
+			fprintf(out, "%s.%s",
+			        pwd == NULL ? HOSTMASTER : pwd->pw_name,
+			        hostname);
+		}
 
-			decode = BIO_new(BIO_s_mem());
+		tm = localtime(&now);
 
-			for (;;)
-			{
-				inlen = BIO_read(bio, buf, sizeof buf);
-				if (inlen == 0)
-					break;
-				BIO_write(decode, buf, inlen);
-			}
+		fprintf(out,
+		        "\t (\n"
+		        "\t%04d%02d%02d%02d   ; Serial (yyyymmddhh)\n"
+		        "\t%-10d   ; Refresh\n"
+		        "\t%-10d   ; Retry\n"
+		        "\t%-10d   ; Expire\n"
+		        "\t%-10d ) ; Default\n\n",
+		        tm->tm_year + 1900,
+		        tm->tm_mon + 1,
+		        tm->tm_mday,
+		        tm->tm_hour,
+		        refresh, retry, expire, defttl);
+	}
 
-			BIO_flush(decode);
+	if (nameservers != NULL && !nsupdate)
+	{
+		for (c = 0; c < nscount; c++)
+			fprintf(out, "\tIN\tNS\t%s\n", nslist[c]);
 
-			outlen = BIO_get_mem_data(decode, &p);
-			memcpy(derdata, p, MIN(sizeof derdata, outlen));
+		fprintf(out, "\n");
+	}
 
-			BIO_free_all(b64);
-			BIO_free(decode);
+	if (nsupdate)
+		fprintf(out, "server %s\n", nslist[0]);
 
-			private = BIO_new_mem_buf(derdata, outlen);
-			if (private == NULL)
-			{
-				fprintf(stderr,
-				        "%s: BIO_new_mem_buf() failed\n",
-				        progname);
-				(void) dkimf_db_close(db);
-				(void) BIO_free(outbio);
-				return 1;
-			}
+	/* write the records in order, as their keys become available */
+	for (r = 0; r < nrecs; r++)
+	{
+		struct gzkey *gk;
 
-			pkey = d2i_PrivateKey_bio(private, NULL);
-			if (pkey == NULL)
-			{
-				fprintf(stderr,
-				        "%s: d2i_PrivateKey_bio() failed\n",
-				        progname);
-				(void) dkimf_db_close(db);
-				(void) BIO_free(private);
-				(void) BIO_free(outbio);
-				return 1;
-			}
+		gk = recs[r].gr_key;
+
+		pthread_mutex_lock(&gj->gj_lock);
+		while (!gk->gk_done)
+			pthread_cond_wait(&gj->gj_cond, &gj->gj_lock);
+		pthread_mutex_unlock(&gj->gj_lock);
+
+		if (gk->gk_status != 0)
+		{
+			fprintf(stderr, "%s: key for '%s' load failed: %s\n",
+			        progname, recs[r].gr_keyname, gk->gk_err);
+			status = -1;
+			break;
 		}
 
-		/* Use generic PUBKEY functions for both RSA and Ed25519 keys */
-		status = PEM_write_bio_PUBKEY(outbio, pkey);
-		if (status == 0)
+		if (verbose > 1)
 		{
-			fprintf(stderr,
-					"%s: PEM_write_bio_PUBKEY() failed\n",
-					progname);
-			(void) dkimf_db_close(db);
-			(void) BIO_free(private);
-			(void) EVP_PKEY_free(pkey);
-			(void) BIO_free(outbio);
-			return 1;
+			fprintf(stderr, "%s: key for '%s' %s\n",
+			        progname, recs[r].gr_keyname,
+			        gk->gk_derived ? "loaded" : "reused");
 		}
-#endif /* USE_GNUTLS */
 
 		/* write the record */
 		if (nsupdate)
 		{
-			fprintf(out, "zone %s\n", domain);
+			fprintf(out, "zone %s\n", recs[r].gr_domain);
 
 			snprintf(tmpbuf, sizeof tmpbuf,
 			         "update add %s%s%s%s%s %d TXT \"",
-			         selector, suffix ? DKIMZONE : "",
+			         recs[r].gr_selector,
+			         suffix ? DKIMZONE : "",
 			         fqdnsuffix ? "." : "",
-			         fqdnsuffix ? domain : "",
+			         fqdnsuffix ? recs[r].gr_domain : "",
 			         fqdnsuffix ? "." : "",
 			         ttl == -1 ? defttl : ttl);
 		}
@@ -873,18 +1789,20 @@ main(int argc, char **argv)
 			{
 				snprintf(tmpbuf, sizeof tmpbuf,
 				         "%s%s%s%s%s\tIN\tTXT\t( \"v=DKIM1; k=rsa; p=",
-				         selector, suffix ? DKIMZONE : "",
+				         recs[r].gr_selector,
+				         suffix ? DKIMZONE : "",
 				         fqdnsuffix ? "." : "",
-				         fqdnsuffix ? domain : "",
+				         fqdnsuffix ? recs[r].gr_domain : "",
 				         fqdnsuffix ? "." : "");
 			}
 			else
 			{
 				snprintf(tmpbuf, sizeof tmpbuf,
 				         "%s%s%s%s%s\t%d\tIN\tTXT\t( \"v=DKIM1; k=rsa; p=",
-				         selector, suffix ? DKIMZONE : "",
+				         recs[r].gr_selector,
+				         suffix ? DKIMZONE : "",
 				         fqdnsuffix ? "." : "",
-				         fqdnsuffix ? domain : "",
+				         fqdnsuffix ? recs[r].gr_domain : "",
 				         fqdnsuffix ? "." : "",
 				         ttl);
 			}
@@ -897,110 +1815,96 @@ main(int argc, char **argv)
 		else
 			olen = strflen(tmpbuf);
 
-		seenlf = FALSE;
-
-#ifdef USE_GNUTLS
-		if (gnutls_pubkey_init(&pubkey) != GNUTLS_E_SUCCESS)
-		{
-			fprintf(stderr, "%s: gnutls_pubkey_init() failed\n",
-			        progname);
-			(void) dkimf_db_close(db);
-			(void) gnutls_x509_privkey_deinit(xprivkey);
-			return 1;
-		}
-
-		if (gnutls_pubkey_import_privkey(pubkey,
-		                                 privkey,
-		                                 GNUTLS_KEY_DIGITAL_SIGNATURE,
-		                                 0) != GNUTLS_E_SUCCESS)
+		for (p = gk->gk_pubkey; *p != '\0'; p++)
 		{
-			fprintf(stderr,
-			        "%s: gnutls_pubkey_import_privkey() failed\n",
-			        progname);
-			(void) dkimf_db_close(db);
-			(void) gnutls_x509_privkey_deinit(xprivkey);
-			(void) gnutls_pubkey_deinit(pubkey);
-			return 1;
-		}
-
-		keylen = sizeof keydata;
-		if (gnutls_pubkey_export(pubkey, GNUTLS_X509_FMT_PEM,
-		                         keydata, &keylen) != GNUTLS_E_SUCCESS)
-		{
-			fprintf(stderr, "%s: gnutls_pubkey_export() failed\n",
-			        progname);
-			(void) dkimf_db_close(db);
-			(void) gnutls_x509_privkey_deinit(xprivkey);
-			return 1;
-		}
-
-		for (len = keylen, p = keydata; len > 0; len--, p++)
-#else /* USE_GNUTLS */
-		for (len = BIO_get_mem_data(outbio, &p); len > 0; len--, p++)
-#endif /* USE_GNUTLS */
-		{
-			if (*p == '\n')
-			{
-				seenlf = TRUE;
-			}
-			else if (seenlf && *p == '-')
-			{
-				break;
-			}
-			else if (!seenlf)
+			if (olen >= MARGIN && !nsupdate)
 			{
-				continue;
+				fprintf(out, "\"\n\t\"");
+				olen = 9;
 			}
-			else if (isascii(*p) && !isspace(*p))
+			else if (olen >= 255 && nsupdate)
 			{
-				if (olen >= MARGIN && !nsupdate)
-				{
-					fprintf(out, "\"\n\t\"");
-					olen = 9;
-				}
-				else if (olen >= 255 && nsupdate)
-				{
-					fprintf(out, "\" \"");
-					olen = 0;
-				}
-
-				(void) fputc(*p, out);
-				olen++;
+				fprintf(out, "\" \"");
+				olen = 0;
 			}
+
+			(void) fputc(*p, out);
+			olen++;
 		}
 
 		if (nsupdate)
 			fprintf(out, "\"\n");
 		else
 			fprintf(out, "\" )\n");
-
-		/* prepare for the next one */
-#ifdef USE_GNUTLS
-		(void) gnutls_x509_privkey_deinit(xprivkey);
-		(void) gnutls_privkey_deinit(privkey);
-		(void) gnutls_pubkey_deinit(pubkey);
-#else /* USE_GNUTLS */
-		(void) BIO_reset(outbio);
-#endif /* USE_GNUTLS */
 	}
 
-#ifndef USE_GNUTLS
-	(void) BIO_flush(outbio);
-	(void) BIO_free(outbio);
-#endif /* ! USE_GNUTLS */
-	(void) dkimf_db_close(db);
-
-	if (nsupdate)
+	if (status == 0 && nsupdate)
 		fprintf(out, "send\nanswer\n");
 
-	if (out != stdout)
-		fclose(out);
+  done:
+	/* stop the workers */
+	pthread_mutex_lock(&gj->gj_lock);
+	gj->gj_abort = TRUE;
+	pthread_cond_broadcast(&gj->gj_cond);
+	pthread_mutex_unlock(&gj->gj_lock);
 
-	if (verbose > 0)
+	for (c = 0; c < nstarted; c++)
+		(void) pthread_join(tids[c], NULL);
+	free(tids);
+
+	(void) gettimeofday(&end, NULL);
+
+	/* replace the output only if it's complete */
+	if (out != NULL && out != stdout)
+	{
+		if (gz_commit(out, tmppath, outfile, status == 0) != 0 &&
+		    status == 0)
+		{
+			fprintf(stderr, "%s: %s: %s\n", progname, outfile,
+			        strerror(errno));
+			status = -1;
+		}
+	}
+	else if (out == stdout && fflush(out) != 0)
 	{
-		fprintf(stdout, "%s: %d record%s written\n",
-		        progname, c, c == 1 ? "" : "s");
+		status = -1;
 	}
 
-	return 0;
+	if (status == 0 && statefile != NULL &&
+	    gz_savestate(gj, statefile) != 0)
+	{
+		fprintf(stderr, "%s: %s: %s\n", progname, statefile,
+		        strerror(errno));
+		status = -1;
+	}
+
+	if (status == 0 && verbose > 0)
+	{
+		elapsed = (end.tv_sec - start.tv_sec) +
+		          (end.tv_usec - start.tv_usec) / 1000000.;
+
+		fprintf(stdout, "%s: %lu record%s written\n",
+		        progname, (unsigned long) nrecs,
+		        nrecs == 1 ? "" : "s");
+		fprintf(stderr,
+		        "%s: %lu key%s derived, %lu reused, in %.3fs using %d thread(s)\n",
+		        progname, gj->gj_derived,
+		        gj->gj_derived == 1 ? "" : "s",
+		        gj->gj_reused, elapsed, nstarted);
+	}
+
+	for (r = 0; r < nrecs; r++)
+	{
+		free(recs[r].gr_keyname);
+		free(recs[r].gr_domain);
+		free(recs[r].gr_selector);
+	}
+	free(recs);
+
+	pthread_mutex_destroy(&gj->gj_lock);
+	pthread_cond_destroy(&gj->gj_cond);
+	gz_free(gj);
+	free(gj);
+
+	return (status == 0 ? 0 : 1);
 }
@@ -13,8 +13,10 @@
 #endif /* _REENTRANT */
 
 /* system includes */
+#include <sys/param.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -23,6 +25,7 @@
 #include <sysexits.h>
 #include <unistd.h>
 #include <assert.h>
+#include <pthread.h>
 
 #ifdef USE_GNUTLS
 /* gcrypt includes */
@@ -54,15 +57,54 @@
 #include "opendkim-crypto.h"
 
 /* macros */
-#define	CMDLINEOPTS	"d:k:s:vx:"
+#define	CMDLINEOPTS	"d:j:k:s:T:vx:"
 #define	DEFCONFFILE	CONFIG_BASE "/opendkim.conf"
 #define	MAXBUFRSZ	65536
 #define	BUFRSZ		2048
+#define	KEYFILE_HASHSZ	1024
 
 #ifndef MIN
 # define MIN(x,y)	((x) < (y) ? (x) : (y))
 #endif /* !MIN */
 
+/* data types */
+struct keyfile
+{
+	size_t		kf_len;			/* length of key data */
+	char *		kf_path;		/* path, or NULL if inline */
+	char *		kf_data;		/* key data */
+	struct keyfile * kf_next;		/* next in cache */
+};
+
+struct testkey
+{
+	char *		tk_name;		/* KeyTable entry */
+	char *		tk_domain;		/* domain */
+	char *		tk_selector;		/* selector */
+	struct keyfile * tk_key;		/* private key */
+};
+
+struct testjob
+{
+	int		tj_verbose;		/* verbosity */
+	int		tj_pass;		/* keys that matched */
+	int		tj_fail;		/* keys that didn't */
+	int		tj_initfail;		/* workers that couldn't start */
+	size_t		tj_nkeys;		/* keys in tj_keys */
+	size_t		tj_alloc;		/* slots in tj_keys */
+	size_t		tj_next;		/* next key to test */
+	double		tj_min;			/* fastest test (ms) */
+	double		tj_max;			/* slowest test (ms) */
+	double		tj_total;		/* sum of test times (ms) */
+	const char *	tj_nslist;		/* nameserver list */
+	const char *	tj_trustanchor;		/* trust anchor file */
+	const char *	tj_nsconfig;		/* resolver configuration */
+	DKIMF_DB	tj_dnsdb;		/* DNS data set */
+	struct testkey * tj_keys;		/* keys to test */
+	struct keyfile * tj_files[KEYFILE_HASHSZ]; /* private key cache */
+	pthread_mutex_t	tj_lock;		/* lock */
+};
+
 /* prototypes */
 void dkimf_log_ssl_errors(void);
 int usage(void);
@@ -176,6 +218,442 @@ loadkey(char *buf, size_t *buflen)
 	return TRUE;
 }
 
+/*
+**  TESTKEY_LIBINIT -- create and configure a library handle
+**
+**  Parameters:
+**  	libp -- library handle (returned)
+**  	nslist -- nameserver list, or NULL
+**  	trustanchor -- trust anchor file, or NULL
+**  	nsconfig -- resolver configuration file, or NULL
+**  	dnsdb -- data set from which to read DNS replies, or NULL
+**
+**  Return value:
+**  	An EX_* constant.
+*/
+
+int
+testkey_libinit(DKIM_LIB **libp, const char *nslist, const char *trustanchor,
+                const char *nsconfig, DKIMF_DB dnsdb)
+{
+	int status;
+	DKIM_LIB *lib;
+
+	assert(libp != NULL);
+
+	lib = dkim_init(NULL, NULL);
+	if (lib == NULL)
+	{
+		fprintf(stderr, "%s: dkim_init() failed\n", progname);
+		return EX_OSERR;
+	}
+
+#ifdef USE_UNBOUND
+	(void) dkimf_unbound_setup(lib);
+#endif /* USE_UNBOUND */
+
+	if (dkim_dns_init(lib) != DKIM_STAT_OK)
+	{
+		fprintf(stderr, "%s: dkim_dns_init() failed\n", progname);
+		dkim_close(lib);
+		return EX_SOFTWARE;
+	}
+
+	if (nslist != NULL)
+		status = dkimf_dns_setnameservers(lib, nslist);
+
+	if (trustanchor != NULL)
+	{
+		status = dkimf_dns_trustanchor(lib, trustanchor);
+		if (status != DKIM_STAT_OK)
+		{
+			fprintf(stderr,
+			        "%s: failed to set trust anchor\n",
+			        progname);
+			dkim_close(lib);
+			return EX_OSERR;
+		}
+	}
+
+	if (nsconfig != NULL)
+	{
+		status = dkimf_dns_config(lib, nsconfig);
+		if (status != DKIM_STAT_OK)
+		{
+			fprintf(stderr,
+			        "%s: failed to set unbound configuration file\n",
+			        progname);
+			dkim_close(lib);
+			return EX_OSERR;
+		}
+	}
+
+	if (dnsdb != NULL)
+		(void) dkimf_filedns_setup(lib, dnsdb);
+
+	*libp = lib;
+
+	return EX_OK;
+}
+
+/*
+**  TESTKEY_ADD -- add a KeyTable entry to a test job
+**
+**  Parameters:
+**  	tj -- test job
+**  	name -- KeyTable entry name
+**  	domain -- signing domain
+**  	selector -- selector
+**  	keypath -- private key path or inline key
+**
+**  Return value:
+**  	0 on success, -1 on failure.
+**
+**  Notes:
+**  	Private keys named by path are read once and shared by every
+**  	entry that names the same file.
+*/
+
+int
+testkey_add(struct testjob *tj, const char *name, const char *domain,
+            const char *selector, const char *keypath)
+{
+	_Bool inline_key;
+	unsigned int bucket = 0;
+	size_t keylen;
+	struct keyfile *kf = NULL;
+	struct testkey *tk;
+	char *keybuf;
+	char *shrunk;
+
+	assert(tj != NULL);
+	assert(name != NULL);
+	assert(domain != NULL);
+	assert(selector != NULL);
+	assert(keypath != NULL);
+
+	inline_key = !(keypath[0] == '/' ||
+	               strncmp(keypath, "./", 2) == 0 ||
+	               strncmp(keypath, "../", 3) == 0);
+
+	if (!inline_key)
+	{
+		const char *p;
+
+		for (p = keypath; *p != '\0'; p++)
+			bucket = bucket * 31 + (unsigned char) *p;
+		bucket %= KEYFILE_HASHSZ;
+
+		for (kf = tj->tj_files[bucket]; kf != NULL; kf = kf->kf_next)
+		{
+			if (kf->kf_path != NULL &&
+			    strcmp(kf->kf_path, keypath) == 0)
+				break;
+		}
+	}
+
+	if (kf == NULL)
+	{
+		keybuf = malloc(MAXBUFRSZ + 1);
+		if (keybuf == NULL)
+		{
+			fprintf(stderr, "%s: malloc(): %s\n", progname,
+			        strerror(errno));
+			return -1;
+		}
+
+		strlcpy(keybuf, keypath, MAXBUFRSZ);
+		keylen = MAXBUFRSZ;
+		if (!loadkey(keybuf, &keylen))
+		{
+			fprintf(stderr, "%s: load of key '%s' failed\n",
+			        progname, name);
+			free(keybuf);
+			return -1;
+		}
+
+		/* don't hold on to the whole buffer */
+		keybuf[keylen] = '\0';
+		shrunk = realloc(keybuf, keylen + 1);
+		if (shrunk != NULL)
+			keybuf = shrunk;
+
+		kf = malloc(sizeof *kf);
+		if (kf == NULL)
+		{
+			fprintf(stderr, "%s: malloc(): %s\n", progname,
+			        strerror(errno));
+			free(keybuf);
+			return -1;
+		}
+
+		kf->kf_data = keybuf;
+		kf->kf_len = keylen;
+		kf->kf_path = (inline_key ? NULL : strdup(keypath));
+		kf->kf_next = tj->tj_files[bucket];
+		tj->tj_files[bucket] = kf;
+
+		if (tj->tj_verbose > 1 && !inline_key)
+		{
+			fprintf(stderr, "%s: key loaded from %s\n",
+			        progname, keypath);
+		}
+	}
+
+	if (tj->tj_nkeys == tj->tj_alloc)
+	{
+		size_t newalloc;
+		struct testkey *new;
+
+		newalloc = (tj->tj_alloc == 0 ? 64 : tj->tj_alloc * 2);
+		new = realloc(tj->tj_keys, newalloc * sizeof *new);
+		if (new == NULL)
+		{
+			fprintf(stderr, "%s: realloc(): %s\n", progname,
+			        strerror(errno));
+			return -1;
+		}
+
+		tj->tj_keys = new;
+		tj->tj_alloc = newalloc;
+	}
+
+	tk = &tj->tj_keys[tj->tj_nkeys];
+	tk->tk_name = strdup(name);
+	tk->tk_domain = strdup(domain);
+	tk->tk_selector = strdup(selector);
+	tk->tk_key = kf;
+	if (tk->tk_name == NULL || tk->tk_domain == NULL ||
+	    tk->tk_selector == NULL)
+	{
+		fprintf(stderr, "%s: strdup(): %s\n", progname,
+		        strerror(errno));
+		free(tk->tk_name);
+		free(tk->tk_domain);
+		free(tk->tk_selector);
+		return -1;
+	}
+
+	tj->tj_nkeys++;
+
+	return 0;
+}
+
+/*
+**  TESTKEY_FREE -- release a test job's keys and key cache
+**
+**  Parameters:
+**  	tj -- test job
+**
+**  Return value:
+**  	None.
+*/
+
+void
+testkey_free(struct testjob *tj)
+{
+	size_t c;
+	struct keyfile *kf;
+	struct keyfile *next;
+
+	assert(tj != NULL);
+
+	for (c = 0; c < tj->tj_nkeys; c++)
+	{
+		free(tj->tj_keys[c].tk_name);
+		free(tj->tj_keys[c].tk_domain);
+		free(tj->tj_keys[c].tk_selector);
+	}
+
+	free(tj->tj_keys);
+
+	for (c = 0; c < KEYFILE_HASHSZ; c++)
+	{
+		for (kf = tj->tj_files[c]; kf != NULL; kf = next)
+		{
+			next = kf->kf_next;
+			if (kf->kf_data != NULL)
+			{
+				memset(kf->kf_data, '\0', kf->kf_len);
+				free(kf->kf_data);
+			}
+			free(kf->kf_path);
+			free(kf);
+		}
+	}
+}
+
+/*
+**  TESTKEY_RUN -- test KeyTable entries until there are none left
+**
+**  Parameters:
+**  	tj -- test job
+**  	lib -- library handle to use
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Results are reported as they complete.
+*/
+
+void
+testkey_run(struct testjob *tj, DKIM_LIB *lib)
+{
+	int status;
+	int dnssec;
+	double ms;
+	struct testkey *tk;
+	struct timeval start;
+	struct timeval end;
+	char err[BUFRSZ];
+
+	assert(tj != NULL);
+	assert(lib != NULL);
+
+	for (;;)
+	{
+		pthread_mutex_lock(&tj->tj_lock);
+		if (tj->tj_next == tj->tj_nkeys)
+		{
+			pthread_mutex_unlock(&tj->tj_lock);
+			break;
+		}
+		tk = &tj->tj_keys[tj->tj_next++];
+		pthread_mutex_unlock(&tj->tj_lock);
+
+		if (tj->tj_verbose > 1)
+		{
+			fprintf(stderr, "%s: checking key '%s'\n",
+			        progname, tk->tk_name);
+		}
+
+		memset(err, '\0', sizeof err);
+		dnssec = DKIM_DNSSEC_UNKNOWN;
+
+		(void) gettimeofday(&start, NULL);
+
+		status = dkim_test_key(lib, tk->tk_selector,
+		                       tk->tk_domain, tk->tk_key->kf_data,
+		                       tk->tk_key->kf_len, &dnssec,
+		                       err, sizeof err);
+
+		(void) gettimeofday(&end, NULL);
+
+		ms = (end.tv_sec - start.tv_sec) * 1000. +
+		     (end.tv_usec - start.tv_usec) / 1000.;
+
+		pthread_mutex_lock(&tj->tj_lock);
+
+		if (tj->tj_pass + tj->tj_fail == 0 || ms < tj->tj_min)
+			tj->tj_min = ms;
+		if (ms > tj->tj_max)
+			tj->tj_max = ms;
+		tj->tj_total += ms;
+
+		switch (status)
+		{
+		  case -1:
+		  case 1:
+			fprintf(stderr, "%s: key %s: %s\n", progname,
+			        tk->tk_name, err);
+			tj->tj_fail++;
+			dkimf_log_ssl_errors();
+			break;
+
+		  case 0:
+			if (tj->tj_verbose > 2)
+			{
+				fprintf(stdout, "%s: key %s: OK\n",
+				        progname, tk->tk_name);
+			}
+			tj->tj_pass++;
+			break;
+
+		  default:
+			assert(0);
+		}
+
+		switch (dnssec)
+		{
+		  case DKIM_DNSSEC_INSECURE:
+			if (tj->tj_verbose > 0)
+			{
+				fprintf(stderr, "%s: key %s not secure\n",
+				        progname, tk->tk_name);
+			}
+			break;
+
+		  case DKIM_DNSSEC_SECURE:
+			if (tj->tj_verbose > 0)
+			{
+				fprintf(stderr, "%s: key %s secure\n",
+				        progname, tk->tk_name);
+			}
+			break;
+
+		  case DKIM_DNSSEC_BOGUS:
+			fprintf(stderr,
+			        "%s: key %s bogus (DNSSEC failed)\n",
+			        progname, tk->tk_name);
+			break;
+
+		  case DKIM_DNSSEC_UNKNOWN:
+		  default:
+			break;
+		}
+
+		pthread_mutex_unlock(&tj->tj_lock);
+	}
+}
+
+/*
+**  TESTKEY_WORKER -- worker thread for concurrent KeyTable tests
+**
+**  Parameters:
+**  	arg -- test job (struct testjob *)
+**
+**  Return value:
+**  	Always NULL.
+**
+**  Notes:
+**  	Each worker has its own library handle and therefore its own
+**  	resolver state; the stock resolver's state can't be shared between
+**  	threads.  Each worker has at most one key query outstanding, so
+**  	the number of workers bounds the number of queries in flight.
+**  	A worker that can't set up its library handle says so and exits;
+**  	its keys are left to the other workers, and the main thread tests
+**  	any that remain.
+*/
+
+void *
+testkey_worker(void *arg)
+{
+	DKIM_LIB *lib;
+	struct testjob *tj;
+
+	tj = (struct testjob *) arg;
+
+	if (testkey_libinit(&lib, tj->tj_nslist, tj->tj_trustanchor,
+	                    tj->tj_nsconfig, tj->tj_dnsdb) != EX_OK)
+	{
+		fprintf(stderr, "%s: worker thread initialization failed\n",
+		        progname);
+
+		pthread_mutex_lock(&tj->tj_lock);
+		tj->tj_initfail++;
+		pthread_mutex_unlock(&tj->tj_lock);
+
+		return NULL;
+	}
+
+	testkey_run(tj, lib);
+
+	(void) dkim_close(lib);
+
+	return NULL;
+}
+
 /*
 **  USAGE -- print a usage message
 **
@@ -192,8 +670,10 @@ usage(void)
 	fprintf(stderr,
 	        "%s: usage: %s [options]\n"
 	        "\t-d domain  \tdomain name\n"
+	        "\t-j threads \tKeyTable keys to test concurrently\n"
 	        "\t-k keypath \tpath to private key\n"
 	        "\t-s selector\tselector name\n"
+	        "\t-T dataset \tread DNS replies from this data set\n"
 	        "\t-v         \tincrease verbose output\n"
 	        "\t-x conffile\tconfiguration file\n",
 	        progname, progname);
@@ -219,6 +699,7 @@ main(int argc, char **argv)
 	int len;
 	int c;
 	int verbose = 0;
+	int nthreads = 1;
 	int argv_d = 0;
 	int argv_s = 0;
 	int argv_k = 0;
@@ -227,8 +708,10 @@ main(int argc, char **argv)
 	char *dataset = NULL;
 	char *nslist = NULL;
 	char *conffile = NULL;
+	char *dnsdata = NULL;
 	char *p;
 	DKIM_LIB *lib;
+	DKIMF_DB dnsdb = NULL;
 	char *trustanchor = NULL;
 	char *nsconfig = NULL;
 	struct stat s;
@@ -252,6 +735,12 @@ main(int argc, char **argv)
 			argv_d = 1;
 			break;
 
+		  case 'j':
+			nthreads = strtol(optarg, &p, 10);
+			if (*p != '\0' || nthreads <= 0)
+				return usage();
+			break;
+
 		  case 'k':
 			strlcpy(keypath, optarg, sizeof keypath);
 			argv_k = 1;
@@ -262,6 +751,10 @@ main(int argc, char **argv)
 			argv_s = 1;
 			break;
 
+		  case 'T':
+			dnsdata = optarg;
+			break;
+
 		  case 'v':
 			verbose++;
 			break;
@@ -399,55 +892,25 @@ main(int argc, char **argv)
 		                  &nslist, sizeof nslist);
 	}
 
-	lib = dkim_init(NULL, NULL);
-	if (lib == NULL)
-	{
-		fprintf(stderr, "%s: dkim_init() failed\n", progname);
-		(void) free(key);
-		return EX_OSERR;
-	}
-
-#ifdef USE_UNBOUND
-	(void) dkimf_unbound_setup(lib);
-#endif /* USE_UNBOUND */
-
-	if (dkim_dns_init(lib) != DKIM_STAT_OK)
+	if (dnsdata != NULL)
 	{
-		fprintf(stderr, "%s: dkim_dns_init() failed\n", progname);
-		(void) free(key);
-		return EX_SOFTWARE;
-	}
+		char *dberr = NULL;
 
-	if (nslist != NULL)
-		status = dkimf_dns_setnameservers(lib, nslist);
-
-	if (trustanchor != NULL)
-	{
-		status = dkimf_dns_trustanchor(lib, trustanchor);
-		if (status != DKIM_STAT_OK)
+		status = dkimf_db_open(&dnsdb, dnsdata,
+		                       DKIMF_DB_FLAG_ICASE | DKIMF_DB_FLAG_READONLY,
+		                       NULL, &dberr);
+		if (status != 0)
 		{
-			fprintf(stderr,
-			        "%s: failed to set trust anchor\n",
-			        progname);
-
-			(void) free(key);
-			return EX_OSERR;
+			fprintf(stderr, "%s: %s: dkimf_db_open(): %s\n",
+			        progname, dnsdata,
+			        dberr == NULL ? "(null)" : dberr);
+			return EX_CONFIG;
 		}
 	}
 
-	if (nsconfig != NULL)
-	{
-		status = dkimf_dns_config(lib, nsconfig);
-		if (status != DKIM_STAT_OK)
-		{
-			fprintf(stderr,
-			        "%s: failed to set unbound configuration file\n",
-			        progname);
-
-			(void) free(key);
-			return EX_OSERR;
-		}
-	}
+	status = testkey_libinit(&lib, nslist, trustanchor, nsconfig, dnsdb);
+	if (status != EX_OK)
+		return status;
 
 	memset(err, '\0', sizeof err);
 
@@ -459,14 +922,25 @@ main(int argc, char **argv)
 	if (dataset != NULL && argv_d == 0 && argv_k == 0 && argv_s == 0)
 	{
 		int c;
-		int pass = 0;
-		int fail = 0;
+		int nstarted = 0;
 		size_t keylen;
+		double elapsed;
 		DKIMF_DB db;
+		pthread_t *tids;
+		struct timeval start;
+		struct timeval end;
+		struct testjob tj;
 		char keyname[BUFRSZ + 1];
 		struct dkimf_db_data dbd[3];
 
 		memset(dbd, '\0', sizeof dbd);
+		memset(&tj, '\0', sizeof tj);
+		tj.tj_verbose = verbose;
+		tj.tj_nslist = nslist;
+		tj.tj_trustanchor = trustanchor;
+		tj.tj_nsconfig = nsconfig;
+		tj.tj_dnsdb = dnsdb;
+		pthread_mutex_init(&tj.tj_lock, NULL);
 
 		status = dkimf_db_open(&db, dataset, DKIMF_DB_FLAG_READONLY,
 		                       NULL, NULL);
@@ -485,6 +959,7 @@ main(int argc, char **argv)
 			return 1;
 		}
 
+		/* collect the keys, loading each key file once */
 		for (c = 0; ; c++)
 		{
 			memset(keyname, '\0', sizeof keyname);
@@ -556,92 +1031,85 @@ main(int argc, char **argv)
 				}
 			}
 
-			keylen = sizeof keypath;
-			if (!loadkey(keypath, &keylen))
+			if (testkey_add(&tj, keyname, domain, selector,
+			                keypath) != 0)
 			{
-				fprintf(stderr,
-				        "%s: load of key '%s' failed\n",
-				        progname, keyname);
 				(void) dkimf_db_close(db);
+				testkey_free(&tj);
 				return 1;
 			}
+		}
 
-			if (verbose > 1)
-			{
-				fprintf(stderr, "%s: checking key '%s'\n",
-				        progname, keyname);
-			}
+		if ((size_t) nthreads > tj.tj_nkeys)
+			nthreads = (tj.tj_nkeys == 0 ? 1 : tj.tj_nkeys);
 
-			dnssec = DKIM_DNSSEC_UNKNOWN;
+		tids = malloc(sizeof(pthread_t) * nthreads);
+		if (tids == NULL)
+		{
+			fprintf(stderr, "%s: malloc(): %s\n", progname,
+			        strerror(errno));
+			testkey_free(&tj);
+			return EX_OSERR;
+		}
 
-			status = dkim_test_key(lib, selector, domain,
-			                       keypath, keylen, &dnssec,
-			                       err, sizeof err);
+		(void) gettimeofday(&start, NULL);
 
-			switch (status)
+		if (nthreads > 1)
+		{
+			for (c = 0; c < nthreads; c++)
 			{
-			  case -1:
-			  case 1:
-				fprintf(stderr, "%s: key %s: %s\n", progname,
-				        keyname, err);
-				fail++;
-				dkimf_log_ssl_errors();
-				break;
-
-			  case 0:
-				if (verbose > 2)
-				{
-					fprintf(stdout, "%s: key %s: OK\n",
-					        progname, keyname);
-				}
-				pass++;
-				break;
-
-			  default:
-				assert(0);
+				if (pthread_create(&tids[c], NULL,
+				                   testkey_worker, &tj) != 0)
+					break;
+				nstarted++;
 			}
+		}
 
-			switch (dnssec)
-			{
-			  case DKIM_DNSSEC_INSECURE:
-				if (verbose > 0)
-				{
-					fprintf(stderr,
-					        "%s: key %s not secure\n",
-					        progname, keyname);
-				}
-				break;
+		if (nstarted == 0)
+			testkey_run(&tj, lib);
 
-			  case DKIM_DNSSEC_SECURE:
-				if (verbose > 0)
-				{
-					fprintf(stderr,
-					        "%s: key %s secure\n",
-					        progname, keyname);
-				}
-				break;
+		for (c = 0; c < nstarted; c++)
+			(void) pthread_join(tids[c], NULL);
 
-			  case DKIM_DNSSEC_BOGUS:
-				fprintf(stderr,
-				        "%s: key %s bogus (DNSSEC failed)\n",
-				        progname, keyname);
-				break;
+		/* finish anything left by workers that couldn't start */
+		if (tj.tj_initfail > 0)
+			testkey_run(&tj, lib);
 
-			  case DKIM_DNSSEC_UNKNOWN:
-			  default:
-				break;
-			}
-		}
+		(void) gettimeofday(&end, NULL);
+
+		free(tids);
 
 		if (verbose > 0)
 		{
+			c = tj.tj_nkeys;
+
 			fprintf(stdout,
 			        "%s: %d key%s checked; %d pass, %d fail\n",
-			        progname, c, c == 1 ? "" : "s", pass, fail);
+			        progname, c, c == 1 ? "" : "s",
+			        tj.tj_pass, tj.tj_fail);
+
+			elapsed = (end.tv_sec - start.tv_sec) +
+			          (end.tv_usec - start.tv_usec) / 1000000.;
+
+			if (c > 0)
+			{
+				fprintf(stdout,
+				        "%s: %.3fs elapsed using %d thread(s); per-key time min/avg/max %.1f/%.1f/%.1f ms\n",
+				        progname, elapsed,
+				        nstarted == 0 ? 1 : nstarted,
+				        tj.tj_min, tj.tj_total / c,
+				        tj.tj_max);
+			}
 		}
 
+		testkey_free(&tj);
+		pthread_mutex_destroy(&tj.tj_lock);
+
 		(void) dkim_close(lib);
 
+		if (dnsdb != NULL)
+			(void) dkimf_db_close(dnsdb);
+
 		return 0;
 	}
 
@@ -733,6 +1201,9 @@ main(int argc, char **argv)
 
 	(void) dkim_close(lib);
 
+	if (dnsdb != NULL)
+		(void) dkimf_db_close(dnsdb);
+
 	switch (dnssec)
 	{
 	  case DKIM_DNSSEC_INSECURE:
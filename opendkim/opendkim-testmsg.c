@@ -5,8 +5,11 @@
 #include "build-config.h"
 
 /* system includes */
+#include <sys/param.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -14,6 +17,8 @@
 #include <sysexits.h>
 #include <string.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
 
 #ifdef USE_GNUTLS
 # include <gnutls/gnutls.h>
@@ -22,6 +27,20 @@
 /* libopendkim includes */
 #include <dkim.h>
 
+/* libbsd if found */
+#ifdef USE_BSD_H
+# include <bsd/string.h>
+#endif /* USE_BSD_H */
+
+/* libstrl if needed */
+#ifdef USE_STRL_H
+# include <strl.h>
+#endif /* USE_STRL_H */
+
+/* opendkim includes */
+#include "opendkim-db.h"
+#include "opendkim-dns.h"
+
 /* macros */
 #ifndef FALSE
 # define FALSE		0
@@ -32,15 +51,49 @@
 
 #define	BUFRSZ		1024
 #define	DEFTMPDIR	"/tmp"
-#define	CMDLINEOPTS	"Cd:Kk:s:t:"
+#define	CMDLINEOPTS	"bCd:j:Kk:o:s:T:t:"
 #define STRORNULL(x)	((x) == NULL ? "(null)" : (x))
 #define	TMPTEMPLATE	"dkimXXXXXX"
 
+#define	OUTPUT_TSV	0
+#define	OUTPUT_JSON	1
+
+/* data types */
+struct bulkmsg
+{
+	unsigned long	bm_index;		/* message number in source */
+	size_t		bm_len;			/* length, or 0 for a file */
+	const char *	bm_start;		/* start, or NULL for a file */
+	const char *	bm_source;		/* file containing it */
+};
+
+struct bulkjob
+{
+	_Bool		bj_sign;		/* signing? */
+	int		bj_output;		/* OUTPUT_* */
+	size_t		bj_nmsgs;		/* messages in bj_msgs */
+	size_t		bj_alloc;		/* slots in bj_msgs */
+	size_t		bj_next;		/* next message to process */
+	unsigned long	bj_pass;		/* verified */
+	unsigned long	bj_fail;		/* failed verification/unsigned */
+	unsigned long	bj_error;		/* processing errors */
+	unsigned long long bj_bytes;		/* bytes processed */
+	const char *	bj_domain;		/* signing domain */
+	const char *	bj_selector;		/* signing selector */
+	char *		bj_keydata;		/* signing key */
+	DKIM_LIB *	bj_lib;			/* library handle */
+	struct bulkmsg * bj_msgs;		/* messages */
+	pthread_mutex_t	bj_lock;		/* lock */
+};
+
 /* prototypes */
 int usage(void);
 
 /* globals */
 char *progname;
+#ifdef USE_UNBOUND
+struct dkimf_unbound *unbound;			/* libunbound handle */
+#endif /* USE_UNBOUND */
 
 /*
 **  USAGE -- print a usage message
@@ -56,12 +109,17 @@ int
 usage(void)
 {
 	fprintf(stderr,
-	        "%s: usage: %s [options]\nValid options:\n"
+	        "%s: usage: %s [options] [-b mbox|maildir ...]\n"
+	        "Valid options:\n"
+	        "\t-b         \tbulk mode; process mailboxes named on the command line\n"
 	        "\t-C         \tpreserve CRLFs\n"
 	        "\t-d domain  \tset signing domain\n"
+	        "\t-j threads \tbulk mode worker threads\n"
 	        "\t-K         \tkeep temporary files\n"
 	        "\t-k keyfile \tprivate key file\n"
+	        "\t-o format  \tbulk mode output format (tsv or json)\n"
 	        "\t-s selector\tset signing selector\n"
+	        "\t-T dataset \tread DNS replies from this data set\n"
 	        "\t-t path    \tdirectory for temporary files\n",
 	        progname, progname);
 
@@ -97,6 +155,643 @@ decr(char *str)
 	*q = '\0';
 }
 
+/*
+**  BULK_ADD -- add a message to a bulk job
+**
+**  Parameters:
+**  	bj -- bulk job
+**  	source -- file containing the message
+**  	index -- message number within "source"
+**  	start -- start of the message, or NULL if it's all of "source"
+**  	len -- length of the message at "start"
+**
+**  Return value:
+**  	0 on success, -1 on failure.
+*/
+
+int
+bulk_add(struct bulkjob *bj, const char *source, unsigned long index,
+         const char *start, size_t len)
+{
+	if (bj->bj_nmsgs == bj->bj_alloc)
+	{
+		size_t newalloc;
+		struct bulkmsg *new;
+
+		newalloc = (bj->bj_alloc == 0 ? BUFRSZ : bj->bj_alloc * 2);
+		new = realloc(bj->bj_msgs, newalloc * sizeof *new);
+		if (new == NULL)
+		{
+			fprintf(stderr, "%s: realloc(): %s\n", progname,
+			        strerror(errno));
+			return -1;
+		}
+
+		bj->bj_msgs = new;
+		bj->bj_alloc = newalloc;
+	}
+
+	bj->bj_msgs[bj->bj_nmsgs].bm_source = source;
+	bj->bj_msgs[bj->bj_nmsgs].bm_index = index;
+	bj->bj_msgs[bj->bj_nmsgs].bm_start = start;
+	bj->bj_msgs[bj->bj_nmsgs].bm_len = len;
+	bj->bj_nmsgs++;
+
+	return 0;
+}
+
+/*
+**  BULK_MBOX -- split an mbox file into messages
+**
+**  Parameters:
+**  	bj -- bulk job
+**  	path -- mbox file
+**
+**  Return value:
+**  	0 on success, -1 on failure.
+**
+**  Notes:
+**  	The file is mapped and stays mapped until the program exits;
+**  	the messages refer directly into the mapping.  Separator lines
+**  	are dropped, but ">From " quoting is not undone.
+*/
+
+int
+bulk_mbox(struct bulkjob *bj, const char *path)
+{
+	int fd;
+	unsigned long index = 0;
+	size_t len;
+	const char *map;
+	const char *end;
+	const char *p;
+	const char *next;
+	struct stat s;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		fprintf(stderr, "%s: %s: open(): %s\n", progname, path,
+		        strerror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &s) != 0)
+	{
+		fprintf(stderr, "%s: %s: fstat(): %s\n", progname, path,
+		        strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	if (s.st_size == 0)
+	{
+		close(fd);
+		return 0;
+	}
+
+	map = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		fprintf(stderr, "%s: %s: mmap(): %s\n", progname, path,
+		        strerror(errno));
+		return -1;
+	}
+
+#ifdef MADV_SEQUENTIAL
+	(void) madvise((void *) map, s.st_size, MADV_SEQUENTIAL);
+#endif /* MADV_SEQUENTIAL */
+
+	end = map + s.st_size;
+
+	for (p = map; p < end; p = next)
+	{
+		/* skip the "From " separator line */
+		if (end - p >= 5 && strncmp(p, "From ", 5) == 0)
+		{
+			p = memchr(p, '\n', end - p);
+			if (p == NULL)
+				break;
+			p++;
+		}
+
+		/* find the next separator */
+		for (next = p; next < end; next++)
+		{
+			next = memchr(next, '\n', end - next);
+			if (next == NULL)
+			{
+				next = end;
+				break;
+			}
+
+			if (end - next > 5 && next > p && next[-1] == '\n' &&
+			    strncmp(next + 1, "From ", 5) == 0)
+			{
+				next++;
+				break;
+			}
+		}
+
+		len = next - p;
+
+		/* drop the blank line that precedes a separator */
+		if (next < end && len >= 2 && p[len - 1] == '\n' &&
+		    p[len - 2] == '\n')
+			len--;
+
+		if (len > 0 && bulk_add(bj, path, ++index, p, len) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+**  BULK_MAILDIR -- collect messages from a Maildir tree
+**
+**  Parameters:
+**  	bj -- bulk job
+**  	path -- directory to scan
+**  	inbox -- TRUE iff "path" is a "cur" or "new" directory
+**
+**  Return value:
+**  	0 on success, -1 on failure.
+*/
+
+int
+bulk_maildir(struct bulkjob *bj, const char *path, _Bool inbox)
+{
+	int status = 0;
+	DIR *dir;
+	struct dirent *de;
+	struct stat s;
+	char fn[MAXPATHLEN + 1];
+
+	dir = opendir(path);
+	if (dir == NULL)
+	{
+		fprintf(stderr, "%s: %s: opendir(): %s\n", progname, path,
+		        strerror(errno));
+		return -1;
+	}
+
+	while (status == 0 && (de = readdir(dir)) != NULL)
+	{
+		char *copy;
+
+		if (de->d_name[0] == '.')
+			continue;
+
+		snprintf(fn, sizeof fn, "%s/%s", path, de->d_name);
+
+		if (stat(fn, &s) != 0)
+			continue;
+
+		if (S_ISDIR(s.st_mode))
+		{
+			status = bulk_maildir(bj, fn,
+			                      strcmp(de->d_name, "cur") == 0 ||
+			                      strcmp(de->d_name, "new") == 0);
+		}
+		else if (S_ISREG(s.st_mode) && inbox)
+		{
+			copy = strdup(fn);
+			if (copy == NULL)
+			{
+				fprintf(stderr, "%s: strdup(): %s\n",
+				        progname, strerror(errno));
+				status = -1;
+			}
+			else
+			{
+				status = bulk_add(bj, copy, 1, NULL, 0);
+			}
+		}
+	}
+
+	closedir(dir);
+
+	return status;
+}
+
+/*
+**  BULK_PRINTSTR -- write a string as a JSON string or a TSV field
+**
+**  Parameters:
+**  	out -- output stream
+**  	str -- string to write
+**  	json -- JSON output?
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Line breaks and tabs are collapsed to a single space either way,
+**  	which also unfolds header fields.
+*/
+
+void
+bulk_printstr(FILE *out, const char *str, _Bool json)
+{
+	_Bool space = FALSE;
+	const char *p;
+
+	if (json)
+		fputc('"', out);
+
+	for (p = (str == NULL ? "" : str); *p != '\0'; p++)
+	{
+		if (*p == '\r' || *p == '\n' || *p == '\t')
+		{
+			space = TRUE;
+			continue;
+		}
+
+		if (space)
+		{
+			fputc(' ', out);
+			space = FALSE;
+		}
+
+		if (json && (*p == '"' || *p == '\\'))
+			fputc('\\', out);
+
+		if (json && (unsigned char) *p < 0x20)
+			fprintf(out, "\\u%04x", (unsigned char) *p);
+		else
+			fputc(*p, out);
+	}
+
+	if (json)
+		fputc('"', out);
+}
+
+/*
+**  BULK_REPORT -- output the result of one message
+**
+**  Parameters:
+**  	bj -- bulk job
+**  	bm -- message
+**  	dkim -- DKIM handle, or NULL if one couldn't be created
+**  	status -- final status
+**
+**  Return value:
+**  	None.
+*/
+
+void
+bulk_report(struct bulkjob *bj, struct bulkmsg *bm, DKIM *dkim,
+            DKIM_STAT status)
+{
+	_Bool json;
+	_Bool pass = FALSE;
+	int c;
+	int nsigs = 0;
+	DKIM_SIGINFO **sigs = NULL;
+	unsigned char *sighdr = NULL;
+	size_t siglen;
+
+	json = (bj->bj_output == OUTPUT_JSON);
+
+	if (dkim != NULL && status == DKIM_STAT_OK && bj->bj_sign)
+	{
+		status = dkim_getsighdr_d(dkim, strlen(DKIM_SIGNHEADER),
+		                          &sighdr, &siglen);
+	}
+
+	if (dkim != NULL && !bj->bj_sign &&
+	    dkim_getsiglist(dkim, &sigs, &nsigs) != DKIM_STAT_OK)
+		nsigs = 0;
+
+	pthread_mutex_lock(&bj->bj_lock);
+
+	if (json)
+	{
+		fputs("{\"source\":", stdout);
+		bulk_printstr(stdout, bm->bm_source, TRUE);
+		fprintf(stdout, ",\"message\":%lu,\"status\":", bm->bm_index);
+		bulk_printstr(stdout, dkim_getresultstr(status), TRUE);
+	}
+	else
+	{
+		bulk_printstr(stdout, bm->bm_source, FALSE);
+		fprintf(stdout, "\t%lu\t%s", bm->bm_index,
+		        dkim_getresultstr(status));
+	}
+
+	if (bj->bj_sign)
+	{
+		if (json)
+		{
+			fputs(",\"signature\":", stdout);
+			bulk_printstr(stdout, (char *) sighdr, TRUE);
+		}
+		else
+		{
+			fputc('\t', stdout);
+			bulk_printstr(stdout, (char *) sighdr, FALSE);
+		}
+
+		pass = (status == DKIM_STAT_OK);
+	}
+	else
+	{
+		if (json)
+			fputs(",\"signatures\":[", stdout);
+
+		for (c = 0; c < nsigs; c++)
+		{
+			_Bool ok;
+			const char *result;
+
+			ok = ((dkim_sig_getflags(sigs[c]) & DKIM_SIGFLAG_PASSED) != 0 &&
+			      dkim_sig_getbh(sigs[c]) == DKIM_SIGBH_MATCH);
+			if (ok)
+			{
+				pass = TRUE;
+				result = "pass";
+			}
+			else if ((dkim_sig_getflags(sigs[c]) & DKIM_SIGFLAG_PROCESSED) == 0)
+			{
+				result = "neutral";
+			}
+			else
+			{
+				result = "fail";
+			}
+
+			if (json)
+			{
+				fprintf(stdout, "%s{\"domain\":",
+				        c == 0 ? "" : ",");
+				bulk_printstr(stdout,
+				              (char *) dkim_sig_getdomain(sigs[c]),
+				              TRUE);
+				fputs(",\"selector\":", stdout);
+				bulk_printstr(stdout,
+				              (char *) dkim_sig_getselector(sigs[c]),
+				              TRUE);
+				fprintf(stdout, ",\"result\":\"%s\"", result);
+				if (!ok)
+				{
+					fputs(",\"error\":", stdout);
+					bulk_printstr(stdout,
+					              dkim_sig_geterrorstr(dkim_sig_geterror(sigs[c])),
+					              TRUE);
+				}
+				fputc('}', stdout);
+			}
+			else
+			{
+				fprintf(stdout, "\t%s/%s=%s",
+				        dkim_sig_getdomain(sigs[c]),
+				        dkim_sig_getselector(sigs[c]),
+				        result);
+			}
+		}
+
+		if (json)
+			fputc(']', stdout);
+	}
+
+	if (json)
+		fputc('}', stdout);
+	fputc('\n', stdout);
+
+	if (dkim == NULL || status == DKIM_STAT_INTERNAL ||
+	    status == DKIM_STAT_NORESOURCE ||
+	    (bj->bj_sign && status != DKIM_STAT_OK))
+		bj->bj_error++;
+	else if (pass)
+		bj->bj_pass++;
+	else
+		bj->bj_fail++;
+
+	pthread_mutex_unlock(&bj->bj_lock);
+}
+
+/*
+**  BULK_WORKER -- bulk mode worker thread
+**
+**  Parameters:
+**  	vp -- bulk job
+**
+**  Return value:
+**  	NULL.
+*/
+
+void *
+bulk_worker(void *vp)
+{
+	_Bool testkey;
+	int fd;
+	unsigned long long bytes = 0;
+	size_t len;
+	const char *msg;
+	void *map;
+	struct bulkjob *bj;
+	struct bulkmsg *bm;
+	DKIM_STAT status;
+	DKIM *dkim;
+	struct stat s;
+	char jobid[BUFRSZ];
+
+	bj = (struct bulkjob *) vp;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&bj->bj_lock);
+		if (bj->bj_next == bj->bj_nmsgs)
+		{
+			pthread_mutex_unlock(&bj->bj_lock);
+			break;
+		}
+		bm = &bj->bj_msgs[bj->bj_next++];
+		pthread_mutex_unlock(&bj->bj_lock);
+
+		map = NULL;
+		msg = bm->bm_start;
+		len = bm->bm_len;
+
+		if (msg == NULL)
+		{
+			fd = open(bm->bm_source, O_RDONLY);
+			if (fd < 0 || fstat(fd, &s) != 0)
+			{
+				if (fd >= 0)
+					close(fd);
+				bulk_report(bj, bm, NULL, DKIM_STAT_INTERNAL);
+				continue;
+			}
+
+			len = s.st_size;
+			if (len > 0)
+			{
+				map = mmap(NULL, len, PROT_READ, MAP_PRIVATE,
+				           fd, 0);
+			}
+			close(fd);
+
+			if (map == MAP_FAILED || map == NULL)
+			{
+				bulk_report(bj, bm, NULL, DKIM_STAT_INTERNAL);
+				continue;
+			}
+
+			msg = map;
+		}
+
+		snprintf(jobid, sizeof jobid, "%s:%lu", bm->bm_source,
+		         bm->bm_index);
+
+		if (bj->bj_sign)
+		{
+			dkim = dkim_sign(bj->bj_lib, (u_char *) jobid, NULL,
+			                 (dkim_sigkey_t) bj->bj_keydata,
+			                 (u_char *) bj->bj_selector,
+			                 (u_char *) bj->bj_domain,
+			                 DKIM_CANON_RELAXED, DKIM_CANON_SIMPLE,
+			                 DKIM_SIGN_RSASHA256, (ssize_t) -1,
+			                 &status);
+		}
+		else
+		{
+			dkim = dkim_verify(bj->bj_lib, (u_char *) jobid, NULL,
+			                   &status);
+		}
+
+		if (dkim != NULL)
+		{
+			status = dkim_chunk(dkim, (u_char *) msg, len);
+			if (status == DKIM_STAT_OK)
+				status = dkim_chunk(dkim, NULL, 0);
+			if (status == DKIM_STAT_OK)
+				status = dkim_eom(dkim, &testkey);
+		}
+
+		bulk_report(bj, bm, dkim, status);
+
+		if (dkim != NULL)
+			dkim_free(dkim);
+
+		if (map != NULL)
+			(void) munmap(map, len);
+
+		bytes += len;
+	}
+
+	pthread_mutex_lock(&bj->bj_lock);
+	bj->bj_bytes += bytes;
+	pthread_mutex_unlock(&bj->bj_lock);
+
+	return NULL;
+}
+
+/*
+**  BULK -- process mailboxes in bulk
+**
+**  Parameters:
+**  	bj -- bulk job (library and signing parameters set)
+**  	paths -- mbox files and Maildir trees
+**  	npaths -- number of entries at "paths"
+**  	nthreads -- worker threads to use
+**
+**  Return value:
+**  	Exit status.
+*/
+
+int
+bulk(struct bulkjob *bj, char **paths, int npaths, int nthreads)
+{
+	int c;
+	int nstarted = 0;
+	double elapsed;
+	pthread_t *tids;
+	struct stat s;
+	struct timeval start;
+	struct timeval end;
+
+	for (c = 0; c < npaths; c++)
+	{
+		if (stat(paths[c], &s) != 0)
+		{
+			fprintf(stderr, "%s: %s: stat(): %s\n", progname,
+			        paths[c], strerror(errno));
+			return EX_NOINPUT;
+		}
+
+		if (S_ISDIR(s.st_mode))
+		{
+			if (bulk_maildir(bj, paths[c], FALSE) != 0)
+				return EX_SOFTWARE;
+		}
+		else if (bulk_mbox(bj, paths[c]) != 0)
+		{
+			return EX_SOFTWARE;
+		}
+	}
+
+	if (nthreads > bj->bj_nmsgs)
+		nthreads = (bj->bj_nmsgs == 0 ? 1 : bj->bj_nmsgs);
+
+	tids = malloc(sizeof(pthread_t) * nthreads);
+	if (tids == NULL)
+	{
+		fprintf(stderr, "%s: malloc(): %s\n", progname,
+		        strerror(errno));
+		return EX_OSERR;
+	}
+
+	(void) gettimeofday(&start, NULL);
+
+	for (c = 0; c < nthreads; c++)
+	{
+		if (pthread_create(&tids[c], NULL, bulk_worker, bj) != 0)
+			break;
+		nstarted++;
+	}
+
+	if (nstarted == 0)
+		(void) bulk_worker(bj);
+
+	for (c = 0; c < nstarted; c++)
+		(void) pthread_join(tids[c], NULL);
+
+	(void) gettimeofday(&end, NULL);
+
+	free(tids);
+
+	fflush(stdout);
+
+	elapsed = (end.tv_sec - start.tv_sec) +
+	          (end.tv_usec - start.tv_usec) / 1000000.;
+	if (elapsed <= 0.)
+		elapsed = 0.000001;
+
+	fprintf(stderr,
+	        "%s: %lu message(s), %llu byte(s) in %.3fs using %d thread(s) (%.1f messages/sec, %.2f MB/sec)\n",
+	        progname, (unsigned long) bj->bj_nmsgs, bj->bj_bytes,
+	        elapsed, nstarted == 0 ? 1 : nstarted,
+	        bj->bj_nmsgs / elapsed,
+	        bj->bj_bytes / elapsed / 1048576.);
+
+	if (bj->bj_sign)
+	{
+		fprintf(stderr, "%s: %lu signed, %lu error(s)\n", progname,
+		        bj->bj_pass, bj->bj_error);
+	}
+	else
+	{
+		fprintf(stderr,
+		        "%s: %lu passed, %lu failed or unsigned, %lu error(s)\n",
+		        progname, bj->bj_pass, bj->bj_fail, bj->bj_error);
+	}
+
+	return (bj->bj_error == 0 && bj->bj_fail == 0 ? EX_OK : EX_DATAERR);
+}
+
 /*
 **  MAIN -- program mainline
 **
@@ -110,11 +805,14 @@ decr(char *str)
 int
 main(int argc, char **argv)
 {
+	_Bool bulkmode = FALSE;
 	_Bool keepcrlf = FALSE;
 	_Bool keepfiles = FALSE;
 	_Bool testkey = FALSE;
 	int c;
 	int n = 0;
+	int nthreads = 0;
+	int output = OUTPUT_TSV;
 	int tfd;
 	u_int flags;
 	DKIM_STAT status;
@@ -130,8 +828,10 @@ main(int argc, char **argv)
 	const char *domain = NULL;
 	const char *selector = NULL;
 	const char *keyfile = NULL;
+	char *dnsdata = NULL;
 	char *keydata = NULL;
 	char *tmpdir = DEFTMPDIR;
+	DKIMF_DB dnsdb = NULL;
 	char buf[BUFRSZ];
 	char fn[BUFRSZ];
 
@@ -141,6 +841,10 @@ main(int argc, char **argv)
 	{
 		switch (c)
 		{
+		  case 'b':
+			bulkmode = TRUE;
+			break;
+
 		  case 'C':
 			keepcrlf = TRUE;
 			break;
@@ -150,6 +854,12 @@ main(int argc, char **argv)
 			n++;
 			break;
 
+		  case 'j':
+			nthreads = strtoul(optarg, &p, 10);
+			if (*p != '\0' || nthreads <= 0)
+				return usage();
+			break;
+
 		  case 'K':
 			keepfiles = TRUE;
 			break;
@@ -159,11 +869,24 @@ main(int argc, char **argv)
 			n++;
 			break;
 
+		  case 'o':
+			if (strcasecmp(optarg, "tsv") == 0)
+				output = OUTPUT_TSV;
+			else if (strcasecmp(optarg, "json") == 0)
+				output = OUTPUT_JSON;
+			else
+				return usage();
+			break;
+
 		  case 's':
 			selector = optarg;
 			n++;
 			break;
 
+		  case 'T':
+			dnsdata = optarg;
+			break;
+
 		  case 't':
 			tmpdir = optarg;
 			break;
@@ -176,6 +899,9 @@ main(int argc, char **argv)
 	if (n != 0 && n != 3)
 		return usage();
 
+	if (bulkmode != (optind < argc))
+		return usage();
+
 	memset(fn, '\0', sizeof fn);
 	snprintf(fn, sizeof fn, "%s/%s", tmpdir, TMPTEMPLATE);
 
@@ -244,6 +970,63 @@ main(int argc, char **argv)
 		return EX_SOFTWARE;
 	}
 
+	if (dnsdata != NULL)
+	{
+		char *dberr = NULL;
+
+		if (dkimf_db_open(&dnsdb, dnsdata,
+		                  DKIMF_DB_FLAG_ICASE | DKIMF_DB_FLAG_READONLY,
+		                  NULL, &dberr) != 0)
+		{
+			fprintf(stderr, "%s: %s: dkimf_db_open(): %s\n",
+			        progname, dnsdata, STRORNULL(dberr));
+			dkim_close(lib);
+			return EX_CONFIG;
+		}
+
+		(void) dkimf_filedns_setup(lib, dnsdb);
+	}
+
+	if (bulkmode)
+	{
+		struct bulkjob bj;
+
+		/* share key records between workers if we can */
+		flags = DKIM_LIBFLAGS_FIXCRLF;
+		if (dkim_libfeature(lib, DKIM_FEATURE_QUERY_CACHE))
+			flags |= DKIM_LIBFLAGS_CACHE;
+		(void) dkim_options(lib, DKIM_OP_SETOPT, DKIM_OPTS_FLAGS,
+		                    &flags, sizeof flags);
+
+		if (nthreads == 0)
+		{
+			long ncpus;
+
+			ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+			nthreads = (ncpus > 0 ? (int) ncpus : 1);
+		}
+
+		memset(&bj, '\0', sizeof bj);
+		bj.bj_sign = (n == 3);
+		bj.bj_output = output;
+		bj.bj_domain = domain;
+		bj.bj_selector = selector;
+		bj.bj_keydata = keydata;
+		bj.bj_lib = lib;
+		pthread_mutex_init(&bj.bj_lock, NULL);
+
+		c = bulk(&bj, argv + optind, argc - optind, nthreads);
+
+		pthread_mutex_destroy(&bj.bj_lock);
+		dkim_close(lib);
+		if (dnsdb != NULL)
+			(void) dkimf_db_close(dnsdb);
+		if (keydata != NULL)
+			free(keydata);
+
+		return c;
+	}
+
 	if (n == 0)
 	{
 		dkim = dkim_verify(lib, progname, NULL, &status);
@@ -408,6 +1191,8 @@ main(int argc, char **argv)
 	dkim_free(dkim);
 	dkim_close(lib);
 	close(tfd);
+	if (dnsdb != NULL)
+		(void) dkimf_db_close(dnsdb);
 	if (keydata != NULL)
 		free(keydata);
 
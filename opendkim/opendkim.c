@@ -53,6 +53,7 @@
 #include <pthread.h>
 #include <netdb.h>
 #include <signal.h>
+#include <sched.h>
 #include <regex.h>
 
 #ifdef USE_GNUTLS
@@ -113,6 +114,21 @@
 #ifdef _FFR_RATE_LIMIT
 # include "flowrate.h"
 #endif /* _FFR_RATE_LIMIT */
+#ifdef _FFR_METRICS
+# include "metrics.h"
+#endif /* _FFR_METRICS */
+#ifdef _FFR_EVENT_ENGINE
+# include "engine.h"
+#endif /* _FFR_EVENT_ENGINE */
+#ifdef _FFR_REPORT_QUEUE
+# include "reportq.h"
+#endif /* _FFR_REPORT_QUEUE */
+#ifdef _FFR_ASYNC_LOG
+# include "asynclog.h"
+#endif /* _FFR_ASYNC_LOG */
+#ifdef _FFR_WORKERS
+# include "workers.h"
+#endif /* _FFR_WORKERS */
 #include "opendkim-db.h"
 #include "opendkim-config.h"
 #include "opendkim-crypto.h"
@@ -120,6 +136,7 @@
 #include "opendkim-ar.h"
 #include "opendkim-arf.h"
 #include "opendkim-dns.h"
+#include "jobs.h"
 #ifdef USE_LUA
 # include "opendkim-lua.h"
 #endif /* USE_LUA */
@@ -232,6 +249,12 @@ struct dkimf_config
 	_Bool		conf_remarall;		/* remove all matching ARs? */
 	_Bool		conf_keepar;		/* keep our ARs? */
 	_Bool		conf_dolog;		/* syslog interesting stuff? */
+#ifdef _FFR_ASYNC_LOG
+	unsigned int	conf_logbufsize;	/* per-thread log buffer */
+	unsigned int	conf_lograte;		/* log messages per second */
+	char *		conf_logoverflow;	/* log buffer overflow policy */
+	char *		conf_logfile;		/* log file instead of syslog */
+#endif /* _FFR_ASYNC_LOG */
 	_Bool		conf_dolog_success;	/* syslog successes too? */
 	_Bool		conf_milterv2;		/* using milter v2? */
 	_Bool		conf_fixcrlf;		/* fix bare CRs and LFs? */
@@ -263,6 +286,10 @@ struct dkimf_config
 	unsigned int	conf_maxhdrsz;		/* max header bytes */
 	unsigned int	conf_maxverify;		/* max sigs to verify */
 	unsigned int	conf_minkeybits;	/* min key size (bits) */
+	unsigned int	conf_bodycache;		/* body hash cache entries */
+	unsigned int	conf_bodycachemax;	/* largest body to cache */
+	unsigned int	conf_tablethreads;	/* table loading threads */
+	unsigned int	conf_lookupthreads;	/* EOM lookup threads */
 #ifdef _FFR_REPUTATION
 	unsigned int	conf_repfactor;		/* reputation factor */
 	unsigned int	conf_repminimum;	/* reputation minimum */
@@ -272,10 +299,12 @@ struct dkimf_config
 	unsigned int	conf_boguskey;		/* bogus key action */
 	unsigned int	conf_unprotectedkey;	/* unprotected key action */
 #ifdef _FFR_RATE_LIMIT
+	unsigned int	conf_flowcheckpoint;	/* flow data checkpoint interval */
 	unsigned int	conf_flowdatattl;	/* flow data TTL */
 	unsigned int	conf_flowfactor;	/* flow factor */
 #endif /* _FFR_RATE_LIMIT */
 	int		conf_clockdrift;	/* tolerable clock drift */
+	int		conf_tracethresh;	/* trace threshold (ms) */
 	int		conf_sigmintype;	/* signature minimum type */
 	size_t		conf_sigmin;		/* signature minimum */
 	size_t		conf_keylen;		/* size of secret key */
@@ -300,6 +329,10 @@ struct dkimf_config
 	char *		conf_keyfile;		/* key file for single key */
 	char *		conf_keytable;		/* key table */
 	char *		conf_signtable;		/* signing table */
+	char *		conf_macrolist;		/* macro list */
+#ifdef _FFR_RATE_LIMIT
+	char *		conf_flowdata;		/* flow data */
+#endif /* _FFR_RATE_LIMIT */
 	char *		conf_peerfile;		/* peer file */
 	char *		conf_internalfile;	/* internal hosts file */
 	char *		conf_externalfile;	/* external hosts file */
@@ -338,7 +371,15 @@ struct dkimf_config
 	char *		conf_reportprefix;	/* stats data prefix */
 #endif /* _FFR_STATS */
 	char *		conf_reportaddr;	/* report sender address */
+#ifdef _FFR_METRICS
+	char *		conf_metricssock;	/* metrics socket */
+#endif /* _FFR_METRICS */
 	char *		conf_reportaddrbcc;	/* report repcipient address as bcc */
+#ifdef _FFR_REPORT_QUEUE
+	unsigned int	conf_reportqsize;	/* report queue limit */
+	unsigned int	conf_reportqrate;	/* reports sent per minute */
+	unsigned int	conf_reportqbatch;	/* reports sent per batch */
+#endif /* _FFR_REPORT_QUEUE */
 	char *		conf_mtacommand;	/* MTA command (reports) */
 	char *		conf_redirect;		/* redirect failures to */
 #ifdef USE_LDAP
@@ -527,6 +568,52 @@ struct msgctx
 						/* DKIM Auth-Results content */
 };
 
+/*
+**  DKIMF_TRACE -- per-message stage timings
+*/
+
+#define	DKIMF_TRACE_CONNECT	0
+#define	DKIMF_TRACE_HELO	1
+#define	DKIMF_TRACE_ENVFROM	2
+#define	DKIMF_TRACE_ENVRCPT	3
+#define	DKIMF_TRACE_HEADER	4
+#define	DKIMF_TRACE_EOH		5
+#define	DKIMF_TRACE_BODY	6
+#define	DKIMF_TRACE_EOM		7
+#define	DKIMF_TRACE_DB		8
+#define	DKIMF_TRACE_LUA		9
+#define	DKIMF_TRACE_KEYQUERY	10
+#define	DKIMF_TRACE_CRYPTO	11
+#define	DKIMF_TRACE_MAX		12
+
+#define	DKIMF_TRACE_JOBIDLEN	64
+
+#define	DKIMF_TRACING(c)	((c)->conf_dolog && (c)->conf_tracethresh >= 0)
+#ifdef _FFR_METRICS
+# define DKIMF_TIMING(c)	(DKIMF_TRACING(c) || (c)->conf_metricssock != NULL)
+#else /* _FFR_METRICS */
+# define DKIMF_TIMING(c)	DKIMF_TRACING(c)
+#endif /* _FFR_METRICS */
+
+static char *dkimf_trace_names[DKIMF_TRACE_MAX] =
+{
+	"connect", "helo", "envfrom", "envrcpt", "header", "eoh",
+	"body", "eom", "db", "lua", "keyquery", "crypto"
+};
+
+struct dkimf_trace
+{
+	_Bool		tr_active;		/* message being traced */
+	uint64_t	tr_start;		/* MAIL FROM arrival */
+	uint64_t	tr_usec[DKIMF_TRACE_MAX];
+						/* time per stage */
+	u_int		tr_count[DKIMF_TRACE_MAX];
+						/* calls per stage */
+	struct dkimf_db_timing tr_db;		/* data set lookups */
+	char		tr_jobid[DKIMF_TRACE_JOBIDLEN + 1];
+						/* job ID */
+};
+
 /*
 **  CONNCTX -- connection context, containing thread-specific data
 */
@@ -541,6 +628,104 @@ struct connctx
 	struct sockaddr_storage	cctx_ip;	/* IP info */
 	struct dkimf_config * cctx_config;	/* configuration in use */
 	struct msgctx *	cctx_msg;		/* message context */
+	struct dkimf_trace cctx_trace;		/* stage timings */
+};
+
+/*
+**  EOMLOOKUPS -- external lookups started together at end-of-message
+*/
+
+#define	EOMSTAGE_ATPS		0
+#define	EOMSTAGE_VBR		1
+#define	EOMSTAGE_REPRRD		2
+#define	EOMSTAGE_REPUTATION	3
+#define	EOMSTAGE_MAX		4
+
+struct eomlookups;
+
+/*
+**  EOMJOB -- one lookup started at end-of-message
+*/
+
+struct eomjob
+{
+	int		ej_stage;		/* stage it belongs to */
+	long		ej_usec;		/* time taken */
+	void		(*ej_func) (struct eomjob *);
+						/* lookup */
+	struct eomlookups * ej_lookups;		/* lookup set */
+	struct dkimf_job ej_job;		/* pool job */
+};
+
+#ifdef _FFR_ATPS
+/*
+**  EOMATPS -- ATPS check of one third-party signature
+*/
+
+struct eomatps
+{
+	struct eomjob	ea_job;			/* job; must be first */
+	DKIM_STAT	ea_status;		/* dkim_atps_check() status */
+	dkim_atps_t	ea_atps;		/* ATPS result */
+	DKIM_SIGINFO *	ea_sig;			/* signature */
+};
+#endif /* _FFR_ATPS */
+
+#ifdef _FFR_VBR
+/*
+**  EOMVBR -- VBR query of one certifier
+*/
+
+struct eomvbr
+{
+	struct eomjob	ev_job;			/* job; must be first */
+	VBR_STAT	ev_status;		/* vbr_query() status */
+	char *		ev_result;		/* vbr_query() result */
+	VBR *		ev_vbr;			/* handle; NULL to make one */
+	u_char *	ev_trusted[2];		/* certifier, as a trusted list */
+	char		ev_cert[DKIM_MAXHOSTNAMELEN + 1];
+						/* certifier */
+	char		ev_error[BUFRSZ + 1];	/* error, if any */
+};
+#endif /* _FFR_VBR */
+
+struct eomlookups
+{
+	_Bool		el_authorsig;		/* author signature found */
+	_Bool		el_timing;		/* time the stages */
+	_Bool		el_run[EOMSTAGE_MAX];	/* stages that applied */
+	long		el_usec[EOMSTAGE_MAX];	/* stage times */
+#ifdef _FFR_ATPS
+	int		el_atps;		/* ATPS result */
+	int		el_natps;		/* ATPS checks */
+	struct eomatps * el_atpsjobs;		/* ATPS checks */
+#endif /* _FFR_ATPS */
+#ifdef _FFR_VBR
+	_Bool		el_vbrdone;		/* VBR result available */
+	VBR_STAT	el_vbrstatus;		/* VBR query status */
+	int		el_nvbr;		/* VBR queries */
+	char *		el_vbrresult;		/* VBR result */
+	char *		el_vbrcertifier;	/* VBR responding certifier */
+	char *		el_vbrtype;		/* VBR-Info mc= */
+	char *		el_vbrvouchers;		/* VBR-Info mv= */
+	struct eomvbr *	el_vbrjobs;		/* VBR queries */
+	char		el_vbrdomain[DKIM_MAXHOSTNAMELEN + 1];
+						/* VBR-Info md= */
+	char		el_vbrcert[DKIM_MAXHOSTNAMELEN + 1];
+						/* responding certifier */
+	char		el_vbrerror[BUFRSZ + 1];
+						/* VBR error */
+	char		el_vbrinfo[DKIM_MAXHEADER + 1];
+						/* VBR-Info, broken up */
+#endif /* _FFR_VBR */
+#ifdef _FFR_REPRRD
+	struct eomjob	el_reprrd;		/* RRD prediction load */
+#endif /* _FFR_REPRRD */
+#ifdef _FFR_REPUTATION
+	struct eomjob	el_reputation;		/* reputation prefetch */
+#endif /* _FFR_REPUTATION */
+	msgctx		el_msg;			/* message context */
+	struct dkimf_config * el_conf;		/* configuration in use */
 };
 
 /*
@@ -644,6 +829,15 @@ struct lookup dkimf_atpshash[] =
 	{ NULL,			-1 },
 };
 
+#ifdef _FFR_ASYNC_LOG
+struct lookup dkimf_logoverflow[] =
+{
+	{ "drop",		DKIMF_ALOG_DROP },
+	{ "block",		DKIMF_ALOG_BLOCK },
+	{ NULL,			-1 },
+};
+#endif /* _FFR_ASYNC_LOG */
+
 struct lookup log_facilities[] =
 {
 	{ "auth",		LOG_AUTH },
@@ -719,13 +913,13 @@ sfsistat mlfi_negotiate(SMFICTX *, unsigned long, unsigned long,
                                         unsigned long *, unsigned long *,
                                         unsigned long *, unsigned long *);
 
-static int dkimf_add_signrequest(struct msgctx *, DKIMF_DB,
-                                      char *, char *, ssize_t);
+static int dkimf_add_signrequest(struct msgctx *, struct dkimf_config *,
+                                 DKIMF_DB, char *, char *, ssize_t);
 sfsistat dkimf_addheader(SMFICTX *, char *, char *);
 sfsistat dkimf_addrcpt(SMFICTX *, char *);
-static int dkimf_apply_signtable(struct msgctx *, DKIMF_DB, DKIMF_DB,
-                                      unsigned char *, unsigned char *, char *,
-                                      size_t, _Bool);
+static int dkimf_apply_signtable(struct msgctx *, struct dkimf_config *,
+                                 DKIMF_DB, DKIMF_DB, unsigned char *,
+                                 unsigned char *, char *, size_t, _Bool);
 sfsistat dkimf_chgheader(SMFICTX *, char *, int, char *);
 static void dkimf_cleanup(SMFICTX *);
 static void dkimf_config_reload(void);
@@ -745,10 +939,17 @@ _Bool dolog;					/* logging? (exported) */
 _Bool reload;					/* reload requested */
 _Bool no_i_whine;				/* noted ${i} is undefined */
 _Bool testmode;					/* test mode */
+#ifdef _FFR_EVENT_ENGINE
+_Bool eventengine;				/* built-in milter engine */
+#endif /* _FFR_EVENT_ENGINE */
 _Bool allowdeprecated;				/* allow deprecated config values */
 #ifdef QUERY_CACHE
 _Bool querycache;				/* local query cache */
 #endif /* QUERY_CACHE */
+_Bool tracing;					/* current config traces */
+#if defined(_FFR_WORKERS) && defined(_FFR_RATE_LIMIT)
+_Bool multiworker;				/* several worker processes */
+#endif /* _FFR_WORKERS && _FFR_RATE_LIMIT */
 _Bool die;					/* global "die" flag */
 int diesig;					/* signal to distribute */
 #ifdef QUERY_CACHE
@@ -764,7 +965,7 @@ DKIMF_DB popdb;					/* POP auth DB */
 char reportcmd[BUFRSZ + 1];			/* reporting command */
 char reportaddr[MAXADDRESS + 1];		/* reporting address */
 char myhostname[DKIM_MAXHOSTNAMELEN + 1];	/* hostname */
-pthread_mutex_t conf_lock;			/* config lock */
+u_int conf_readers;				/* config refs being taken */
 pthread_mutex_t pwdb_lock;			/* passwd/group lock */
 
 /* Other useful definitions */
@@ -772,6 +973,10 @@ pthread_mutex_t pwdb_lock;			/* passwd/group lock */
 
 /* MACROS */
 #define	JOBID(x)	((x) == NULL ? JOBIDUNKNOWN : (char *) (x))
+#define	DKIMF_CONF_LOAD(x)	__atomic_load_n(&(x), __ATOMIC_SEQ_CST)
+#define	DKIMF_CONF_SWAP(x,v)	__atomic_exchange_n(&(x), (v), __ATOMIC_SEQ_CST)
+#define	DKIMF_CONF_ADD(x,n)	__atomic_add_fetch(&(x), (n), __ATOMIC_SEQ_CST)
+#define	DKIMF_CONF_SUB(x,n)	__atomic_sub_fetch(&(x), (n), __ATOMIC_ACQ_REL)
 #define	TRYFREE(x)	do { \
 				if ((x) != NULL) \
 				{ \
@@ -831,6 +1036,10 @@ dkimf_getpriv(SMFICTX *ctx)
 
 	if (testmode)
 		return dkimf_test_getpriv((void *) ctx);
+#ifdef _FFR_EVENT_ENGINE
+	else if (eventengine)
+		return dkimf_engine_getpriv(ctx);
+#endif /* _FFR_EVENT_ENGINE */
 	else
 		return smfi_getpriv(ctx);
 }
@@ -852,6 +1061,10 @@ dkimf_setpriv(SMFICTX *ctx, void *ptr)
 
 	if (testmode)
 		return dkimf_test_setpriv((void *) ctx, ptr);
+#ifdef _FFR_EVENT_ENGINE
+	else if (eventengine)
+		return dkimf_engine_setpriv(ctx, ptr);
+#endif /* _FFR_EVENT_ENGINE */
 	else
 		return smfi_setpriv(ctx, ptr);
 }
@@ -878,6 +1091,10 @@ dkimf_insheader(SMFICTX *ctx, int idx, char *hname, char *hvalue)
 
 	if (testmode)
 		return dkimf_test_insheader(ctx, idx, hname, hvalue);
+#ifdef _FFR_EVENT_ENGINE
+	else if (eventengine)
+		return dkimf_engine_insheader(ctx, idx, hname, hvalue);
+#endif /* _FFR_EVENT_ENGINE */
 	else
 #ifdef HAVE_SMFI_INSHEADER
 		return smfi_insheader(ctx, idx, hname, hvalue);
@@ -907,6 +1124,10 @@ dkimf_chgheader(SMFICTX *ctx, char *hname, int idx, char *hvalue)
 
 	if (testmode)
 		return dkimf_test_chgheader(ctx, hname, idx, hvalue);
+#ifdef _FFR_EVENT_ENGINE
+	else if (eventengine)
+		return dkimf_engine_chgheader(ctx, hname, idx, hvalue);
+#endif /* _FFR_EVENT_ENGINE */
 	else
 		return smfi_chgheader(ctx, hname, idx, hvalue);
 }
@@ -929,6 +1150,10 @@ dkimf_quarantine(SMFICTX *ctx, char *reason)
 
 	if (testmode)
 		return dkimf_test_quarantine(ctx, reason);
+#ifdef _FFR_EVENT_ENGINE
+	else if (eventengine)
+		return dkimf_engine_quarantine(ctx, reason);
+#endif /* _FFR_EVENT_ENGINE */
 #ifdef SMFIF_QUARANTINE
 	else
 		return smfi_quarantine(ctx, reason);
@@ -956,6 +1181,10 @@ dkimf_addheader(SMFICTX *ctx, char *hname, char *hvalue)
 
 	if (testmode)
 		return dkimf_test_addheader(ctx, hname, hvalue);
+#ifdef _FFR_EVENT_ENGINE
+	else if (eventengine)
+		return dkimf_engine_addheader(ctx, hname, hvalue);
+#endif /* _FFR_EVENT_ENGINE */
 	else
 		return smfi_addheader(ctx, hname, hvalue);
 }
@@ -979,6 +1208,10 @@ dkimf_addrcpt(SMFICTX *ctx, char *addr)
 
 	if (testmode)
 		return dkimf_test_addrcpt(ctx, addr);
+#ifdef _FFR_EVENT_ENGINE
+	else if (eventengine)
+		return dkimf_engine_addrcpt(ctx, addr);
+#endif /* _FFR_EVENT_ENGINE */
 	else
 		return smfi_addrcpt(ctx, addr);
 }
@@ -1002,6 +1235,10 @@ dkimf_delrcpt(SMFICTX *ctx, char *addr)
 
 	if (testmode)
 		return dkimf_test_delrcpt(ctx, addr);
+#ifdef _FFR_EVENT_ENGINE
+	else if (eventengine)
+		return dkimf_engine_delrcpt(ctx, addr);
+#endif /* _FFR_EVENT_ENGINE */
 	else
 		return smfi_delrcpt(ctx, addr);
 }
@@ -1026,6 +1263,10 @@ dkimf_setreply(SMFICTX *ctx, char *rcode, char *xcode, char *replytxt)
 
 	if (testmode)
 		return dkimf_test_setreply(ctx, rcode, xcode, replytxt);
+#ifdef _FFR_EVENT_ENGINE
+	else if (eventengine)
+		return dkimf_engine_setreply(ctx, rcode, xcode, replytxt);
+#endif /* _FFR_EVENT_ENGINE */
 	else
 		return smfi_setreply(ctx, rcode, xcode, replytxt);
 }
@@ -1049,6 +1290,10 @@ dkimf_getsymval(SMFICTX *ctx, char *sym)
 
 	if (testmode)
 		return dkimf_test_getsymval(ctx, sym);
+#ifdef _FFR_EVENT_ENGINE
+	else if (eventengine)
+		return dkimf_engine_getsymval(ctx, sym);
+#endif /* _FFR_EVENT_ENGINE */
 	else
 		return smfi_getsymval(ctx, sym);
 }
@@ -1224,7 +1469,7 @@ dkimf_xs_signfor(lua_State *l)
 		lua_error(l);
 	}
 
-	status = dkimf_apply_signtable(msg, conf->conf_keytabledb,
+	status = dkimf_apply_signtable(msg, conf, conf->conf_keytabledb,
 	                               conf->conf_signtabledb,
 	                               user, domain, errkey, sizeof errkey,
 	                               multi);
@@ -2031,7 +2276,7 @@ dkimf_xs_requestsig(lua_State *l)
 	/* try to get the key */
 	if (keyname != NULL)
 	{
-		switch (dkimf_add_signrequest(dfc, conf->conf_keytabledb,
+		switch (dkimf_add_signrequest(dfc, conf, conf->conf_keytabledb,
 		                              (char *) keyname,
 		                              (char *) ident,
 		                              signlen))
@@ -2071,7 +2316,7 @@ dkimf_xs_requestsig(lua_State *l)
 			return 1;
 		}
 	}
-	else if (dkimf_add_signrequest(dfc, NULL, NULL, (char *) ident,
+	else if (dkimf_add_signrequest(dfc, conf, NULL, NULL, (char *) ident,
 	                               (ssize_t) -1) != 0)
 	{
 		if (conf->conf_dolog)
@@ -4912,6 +5157,7 @@ dkimf_loadkey(char *buf, size_t *buflen, _Bool *insecure, char *error,
 **
 **  Parameters:
 **  	dfc -- message context
+**  	conf -- configuration handle
 **  	keytable -- table from which to get key
 **  	keyname -- name of private key to use
 **  	signer -- signer identity to use
@@ -4926,8 +5172,9 @@ dkimf_loadkey(char *buf, size_t *buflen, _Bool *insecure, char *error,
 */
 
 static int
-dkimf_add_signrequest(struct msgctx *dfc, DKIMF_DB keytable, char *keyname,
-                      char *signer, ssize_t signlen)
+dkimf_add_signrequest(struct msgctx *dfc, struct dkimf_config *conf,
+                      DKIMF_DB keytable, char *keyname, char *signer,
+                      ssize_t signlen)
 {
 	_Bool found = FALSE;
 	size_t keydatasz = 0;
@@ -4939,6 +5186,7 @@ dkimf_add_signrequest(struct msgctx *dfc, DKIMF_DB keytable, char *keyname,
 	char err[BUFRSZ + 1];
 
 	assert(dfc != NULL);
+	assert(conf != NULL);
 
 	/*
 	**  Error out if we want the default key but the key or selector were
@@ -4947,8 +5195,8 @@ dkimf_add_signrequest(struct msgctx *dfc, DKIMF_DB keytable, char *keyname,
 
 	if (keyname == NULL)
 	{
-		if (curconf->conf_seckey == NULL ||
-		    curconf->conf_selector == NULL)
+		if (conf->conf_seckey == NULL ||
+		    conf->conf_selector == NULL)
 			return 1;
 	}
 
@@ -5067,14 +5315,14 @@ dkimf_add_signrequest(struct msgctx *dfc, DKIMF_DB keytable, char *keyname,
 			{
 				int sev;
 
-				sev = (curconf->conf_safekeys ? LOG_ERR
+				sev = (conf->conf_safekeys ? LOG_ERR
 				                              : LOG_WARNING);
 
 				syslog(sev, "%s: key data is not secure: %s",
 				       keyname, err);
 			}
 
- 			if (curconf->conf_safekeys)
+ 			if (conf->conf_safekeys)
 				return 2;
 		}
 	}
@@ -5743,6 +5991,8 @@ dkimf_reloader(/* UNUSED */ void *vp)
 
 		if (conffile != NULL)
 			reload = TRUE;
+
+		dkimf_config_reload();
 	}
 
 	return NULL;
@@ -5770,6 +6020,279 @@ dkimf_killchild(pid_t pid, int sig, _Bool dolog)
 	}
 }
 
+#ifdef _FFR_WORKERS
+/*
+**  DKIMF_WORKER_START -- start one worker process
+**
+**  Parameters:
+**  	worker -- worker number
+**  	cpus -- CPUs to which to pin workers, in turn (or NULL)
+**  	ncpus -- number of entries at "cpus"
+**
+**  Return value:
+**  	As for fork().
+*/
+
+static pid_t
+dkimf_worker_start(int worker, int *cpus, int ncpus)
+{
+	pid_t pid;
+	sigset_t mask;
+	char errbuf[BUFRSZ + 1];
+
+	pid = fork();
+	if (pid == -1 && dolog)
+		syslog(LOG_ERR, "[parent] fork(): %s", strerror(errno));
+	if (pid != 0)
+		return pid;
+
+	/* only the supervisor waits for SIGCHLD */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	(void) pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+
+	if (cpus != NULL &&
+	    dkimf_workers_pin(cpus[worker % ncpus], errbuf,
+	                      sizeof errbuf) != 0 && dolog)
+		syslog(LOG_WARNING, "worker %d: %s", worker, errbuf);
+
+	return 0;
+}
+
+/*
+**  DKIMF_WORKERS -- start worker processes and supervise them
+**
+**  Parameters:
+**  	nworkers -- number of workers
+**  	cpus -- CPUs to which to pin workers, in turn (or NULL)
+**  	ncpus -- number of entries at "cpus"
+**  	restart -- replace workers that die
+**  	maxrestarts -- most replacements in all (0 == no limit)
+**  	maxrate_n -- most replacements within "maxrate_t" (0 == no limit)
+**  	maxrate_t -- period for "maxrate_n", in seconds
+**  	sockpath -- UNIX milter socket a departing worker may remove
+**  	            (or NULL)
+**  	worker -- worker number (returned)
+**
+**  Return value:
+**  	In a worker, EX_OK, with "worker" set to its number.  In the
+**  	supervisor, once the workers are all gone, the filter's exit
+**  	status, with "worker" set to -1.
+**
+**  Notes:
+**  	This is the multi-process counterpart of the AutoRestart loop in
+**  	main().  The milter socket is already open, so every worker
+**  	accepts on the same one.  SIGHUP, SIGINT and SIGTERM are passed on
+**  	to every worker and end the supervisor once they have exited;
+**  	SIGUSR1 is passed on so that each one reloads its configuration.
+**  	A worker that dies is replaced under the same number, so it's
+**  	pinned to the same CPU and carries on its predecessor's metrics.
+*/
+
+static int
+dkimf_workers(int nworkers, int *cpus, int ncpus, _Bool restart,
+              int maxrestarts, int maxrate_n, time_t maxrate_t,
+              char *sockpath, int *worker)
+{
+	_Bool stopping = FALSE;
+	int c;
+	int sig;
+	int status;
+	int live = 0;
+	int restarts = 0;
+	int ret = EX_OK;
+	pid_t pid;
+	pid_t *pids;
+	sigset_t mask;
+
+	assert(nworkers > 0);
+	assert(worker != NULL);
+
+	*worker = -1;
+
+	pids = (pid_t *) calloc(nworkers, sizeof(pid_t));
+	if (pids == NULL)
+	{
+		if (dolog)
+			syslog(LOG_ERR, "calloc(): %s", strerror(errno));
+		return EX_OSERR;
+	}
+
+	/* collect signals synchronously rather than from a handler */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR1);
+	(void) pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	if (maxrate_n > 0)
+		(void) dkimf_restart_check(maxrate_n, 0);
+
+	for (c = 0; c < nworkers; c++)
+	{
+		pid = dkimf_worker_start(c, cpus, ncpus);
+		if (pid == 0)
+		{
+			free(pids);
+			*worker = c;
+			return EX_OK;
+		}
+		else if (pid == -1)
+		{
+			ret = EX_OSERR;
+			stopping = TRUE;
+			break;
+		}
+
+		pids[c] = pid;
+		live++;
+	}
+
+	if (stopping)
+	{
+		for (c = 0; c < nworkers; c++)
+		{
+			if (pids[c] > 0)
+				dkimf_killchild(pids[c], SIGTERM, dolog);
+		}
+	}
+	else if (dolog)
+	{
+		syslog(LOG_INFO, "[parent] started %d worker processes",
+		       nworkers);
+	}
+
+	while (live > 0)
+	{
+		if (sigwait(&mask, &sig) != 0)
+			continue;
+
+		if (sig != SIGCHLD)
+		{
+			if (sig != SIGUSR1)
+				stopping = TRUE;
+
+			for (c = 0; c < nworkers; c++)
+			{
+				if (pids[c] > 0)
+					dkimf_killchild(pids[c], sig, dolog);
+			}
+
+			continue;
+		}
+
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+		{
+			for (c = 0; c < nworkers; c++)
+			{
+				if (pids[c] == pid)
+					break;
+			}
+
+			if (c == nworkers)
+				continue;
+
+			pids[c] = 0;
+			live--;
+
+			if (stopping)
+				continue;
+
+			if (dolog && WIFSIGNALED(status))
+			{
+				syslog(LOG_NOTICE,
+				       "[parent] worker %d (pid %ld) terminated with signal %d",
+				       c, (long) pid, WTERMSIG(status));
+			}
+			else if (dolog && WIFEXITED(status))
+			{
+				syslog(LOG_NOTICE,
+				       "[parent] worker %d (pid %ld) exited with status %d",
+				       c, (long) pid, WEXITSTATUS(status));
+			}
+
+			if (WIFEXITED(status) &&
+			    (WEXITSTATUS(status) == EX_CONFIG ||
+			     WEXITSTATUS(status) == EX_SOFTWARE))
+			{
+				ret = WEXITSTATUS(status);
+			}
+			else if (!restart)
+			{
+				ret = EX_UNAVAILABLE;
+			}
+			else if (sockpath != NULL && access(sockpath, F_OK) != 0)
+			{
+				if (dolog)
+				{
+					syslog(LOG_ERR,
+					       "[parent] %s: milter socket removed",
+					       sockpath);
+				}
+
+				ret = EX_UNAVAILABLE;
+			}
+			else if (maxrestarts > 0 && restarts >= maxrestarts)
+			{
+				if (dolog)
+				{
+					syslog(LOG_ERR,
+					       "maximum restart count exceeded");
+				}
+
+				ret = EX_UNAVAILABLE;
+			}
+			else if (maxrate_n > 0 && maxrate_t > 0 &&
+			         !dkimf_restart_check(0, maxrate_t))
+			{
+				if (dolog)
+				{
+					syslog(LOG_ERR,
+					       "maximum restart rate exceeded");
+				}
+
+				ret = EX_UNAVAILABLE;
+			}
+			else
+			{
+				pid = dkimf_worker_start(c, cpus, ncpus);
+				if (pid == 0)
+				{
+					free(pids);
+					*worker = c;
+					return EX_OK;
+				}
+				else if (pid != -1)
+				{
+					pids[c] = pid;
+					live++;
+					restarts++;
+					continue;
+				}
+
+				ret = EX_OSERR;
+			}
+
+			/* can't carry on with fewer; stop the rest */
+			stopping = TRUE;
+
+			for (c = 0; c < nworkers; c++)
+			{
+				if (pids[c] > 0)
+					dkimf_killchild(pids[c], SIGTERM,
+					                dolog);
+			}
+		}
+	}
+
+	free(pids);
+
+	return ret;
+}
+#endif /* _FFR_WORKERS */
+
 /*
 **  DKIMF_ZAPKEY -- clobber the copy of the private key
 **
@@ -5861,6 +6384,9 @@ dkimf_config_new(void)
 	new->conf_dnstimeout = DEFTIMEOUT;
 	new->conf_maxverify = DEFMAXVERIFY;
 	new->conf_maxhdrsz = DEFMAXHDRSZ;
+	new->conf_tablethreads = DEFTABLETHREADS;
+	new->conf_lookupthreads = DEFLOOKUPTHREADS;
+	new->conf_tracethresh = -1;
 	new->conf_signbytes = -1L;
 	new->conf_sigmintype = SIGMIN_BYTES;
 #ifdef _FFR_REPUTATION
@@ -5872,6 +6398,7 @@ dkimf_config_new(void)
 	new->conf_reporthost = myhostname;
 #endif /* _FFR_STATS */
 #ifdef _FFR_RATE_LIMIT
+	new->conf_flowcheckpoint = DEFFLOWCHECKPOINT;
 	new->conf_flowdatattl = DEFFLOWDATATTL;
 	new->conf_flowfactor = 1;
 #endif /* _FFR_RATE_LIMIT */
@@ -5879,6 +6406,9 @@ dkimf_config_new(void)
 #ifdef _FFR_ATPS
 	new->conf_atpshash = dkimf_atpshash[0].str;
 #endif /* _FFR_ATPS */
+#ifdef _FFR_ASYNC_LOG
+	new->conf_logoverflow = dkimf_logoverflow[0].str;
+#endif /* _FFR_ASYNC_LOG */
 	new->conf_selectcanonhdr = SELECTCANONHDR;
 
 	memcpy(&new->conf_handling, &defaults, sizeof new->conf_handling);
@@ -5999,6 +6529,7 @@ dkimf_config_free(struct dkimf_config *conf)
 #endif /* _FFR_CONDITIONAL */
 
 #ifdef _FFR_RATE_LIMIT
+	dkimf_rate_release(conf->conf_ratelimitdb, conf->conf_flowdatadb);
 	if (conf->conf_ratelimitdb != NULL)
 		dkimf_db_close(conf->conf_ratelimitdb);
 	if (conf->conf_flowdatadb != NULL)
@@ -6055,6 +6586,58 @@ dkimf_config_free(struct dkimf_config *conf)
 	free(conf);
 }
 
+/*
+**  DKIMF_CONFIG_ACQUIRE -- take a reference to the current configuration
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	The current configuration handle, which remains valid until it is
+**  	passed to dkimf_config_release().
+**
+**  Notes:
+**  	"curconf" holds a reference of its own, so it can't be freed while
+**  	it is current.  The conf_readers count covers the moment between
+**  	reading "curconf" and taking the reference; a reload waits for it
+**  	to drain before dropping the old configuration's reference.
+*/
+
+static struct dkimf_config *
+dkimf_config_acquire(void)
+{
+	struct dkimf_config *conf;
+
+	(void) DKIMF_CONF_ADD(conf_readers, 1);
+	conf = DKIMF_CONF_LOAD(curconf);
+	(void) DKIMF_CONF_ADD(conf->conf_refcnt, 1);
+	(void) DKIMF_CONF_SUB(conf_readers, 1);
+
+	return conf;
+}
+
+/*
+**  DKIMF_CONFIG_RELEASE -- drop a configuration reference
+**
+**  Parameters:
+**  	conf -- configuration handle
+**
+**  Return value:
+**  	None.
+**
+**  Side effects:
+**  	The handle is destroyed if that was its last reference.
+*/
+
+static void
+dkimf_config_release(struct dkimf_config *conf)
+{
+	assert(conf != NULL);
+
+	if (DKIMF_CONF_SUB(conf->conf_refcnt, 1) == 0)
+		dkimf_config_free(conf);
+}
+
 /*
 **  DKIMF_PARSEHANDLER -- parse a handler
 **
@@ -6151,7 +6734,7 @@ dkimf_parsehandler(struct config *cfg, char *name, struct handling *hndl,
 }
 
 /*
-**  DKIMF_CONFIG_LOAD -- load a configuration handle based on file content
+**  DKIMF_CONFIG_PARSE -- apply file content to a configuration handle
 **
 **  Paramters:
 **  	data -- configuration data loaded from config file
@@ -6159,6 +6742,7 @@ dkimf_parsehandler(struct config *cfg, char *name, struct handling *hndl,
 **  	err -- where to write errors
 **  	errlen -- bytes available at "err"
 **  	become -- pretend we're the named user (can be NULL)
+**  	dbb -- batch to which to add the data sets to be opened
 **
 **  Return value:
 **  	0 -- success
@@ -6166,11 +6750,16 @@ dkimf_parsehandler(struct config *cfg, char *name, struct handling *hndl,
 **
 **  Side effects:
 **  	openlog() may be called by this function
+**
+**  Notes:
+**  	Data sets may still be opening when this returns; nothing here
+**  	may depend on their handles.  See dkimf_config_tables().
 */
 
 static int
-dkimf_config_load(struct config *data, struct dkimf_config *conf,
-                  char *err, size_t errlen, char *become)
+dkimf_config_parse(struct config *data, struct dkimf_config *conf,
+                   char *err, size_t errlen, char *become,
+                   struct dkimf_db_batch *dbb)
 {
 #ifdef USE_LDAP
 	_Bool btmp;
@@ -6283,6 +6872,14 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 		                  &conf->conf_minkeybits,
 		                  sizeof conf->conf_minkeybits);
 
+		(void) config_get(data, "BodyHashCache",
+		                  &conf->conf_bodycache,
+		                  sizeof conf->conf_bodycache);
+
+		(void) config_get(data, "BodyHashCacheMaxSize",
+		                  &conf->conf_bodycachemax,
+		                  sizeof conf->conf_bodycachemax);
+
 		(void) config_get(data, "RequestReports",
 		                  &conf->conf_reqreports,
 		                  sizeof conf->conf_reqreports);
@@ -6420,6 +7017,20 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 		                  &conf->conf_reportaddrbcc,
 		                  sizeof conf->conf_reportaddrbcc);
 
+#ifdef _FFR_REPORT_QUEUE
+		(void) config_get(data, "ReportQueueSize",
+		                  &conf->conf_reportqsize,
+		                  sizeof conf->conf_reportqsize);
+
+		(void) config_get(data, "ReportQueueRate",
+		                  &conf->conf_reportqrate,
+		                  sizeof conf->conf_reportqrate);
+
+		(void) config_get(data, "ReportQueueBatch",
+		                  &conf->conf_reportqbatch,
+		                  sizeof conf->conf_reportqbatch);
+#endif /* _FFR_REPORT_QUEUE */
+
 		if (conf->conf_signalgstr == NULL)
 		{
 			(void) config_get(data, "SignatureAlgorithm",
@@ -6469,6 +7080,46 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 		(void) config_get(data, "LogResults", &conf->conf_logresults,
 		                  sizeof conf->conf_logresults);
 
+		(void) config_get(data, "LookupThreads",
+		                  &conf->conf_lookupthreads,
+		                  sizeof conf->conf_lookupthreads);
+
+#ifdef _FFR_ASYNC_LOG
+		(void) config_get(data, "LogBufferSize",
+		                  &conf->conf_logbufsize,
+		                  sizeof conf->conf_logbufsize);
+
+		(void) config_get(data, "LogBufferOverflow",
+		                  &conf->conf_logoverflow,
+		                  sizeof conf->conf_logoverflow);
+
+		(void) config_get(data, "LogRateLimit",
+		                  &conf->conf_lograte,
+		                  sizeof conf->conf_lograte);
+
+		(void) config_get(data, "LogFile", &conf->conf_logfile,
+		                  sizeof conf->conf_logfile);
+
+		if (dkimf_lookup_strtoint(conf->conf_logoverflow,
+		                          dkimf_logoverflow) == -1)
+		{
+			snprintf(err, errlen,
+			         "unknown LogBufferOverflow value \"%s\"",
+			         conf->conf_logoverflow);
+			return -1;
+		}
+#endif /* _FFR_ASYNC_LOG */
+
+		(void) config_get(data, "TraceThreshold",
+		                  &conf->conf_tracethresh,
+		                  sizeof conf->conf_tracethresh);
+
+#ifdef _FFR_METRICS
+		(void) config_get(data, "MetricsSocket",
+		                  &conf->conf_metricssock,
+		                  sizeof conf->conf_metricssock);
+#endif /* _FFR_METRICS */
+
 		(void) config_get(data, "MultipleSignatures",
 		                  &conf->conf_multisig,
 		                  sizeof conf->conf_multisig);
@@ -6988,37 +7639,31 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 	}
 	if (str != NULL && !testmode)
 	{
-		int status;
-		char *dberr = NULL;
-
-		status = dkimf_db_open(&conf->conf_peerdb, str,
+		if (dkimf_db_batch_add(dbb, "PeerList",
+		                       &conf->conf_peerdb, str,
 		                       (dbflags | 
 		                        DKIMF_DB_FLAG_ICASE |
 		                        DKIMF_DB_FLAG_READONLY),
-		                       NULL, &dberr);
-		if (status != 0)
+		                       NULL) != 0)
 		{
-			snprintf(err, errlen, "%s: dkimf_db_open(): %s",
-			         str, dberr);
+			snprintf(err, errlen, "%s: dkimf_db_batch_add(): %s",
+			         str, strerror(errno));
 			return -1;
 		}
 	}
 
 	if (conf->conf_testdnsdata != NULL)
 	{
-		int status;
-		char *dberr = NULL;
-
-		status = dkimf_db_open(&conf->conf_testdnsdb,
+		if (dkimf_db_batch_add(dbb, "TestDNSData",
+		                       &conf->conf_testdnsdb,
 		                       conf->conf_testdnsdata,
 		                       (dbflags | 
 		                        DKIMF_DB_FLAG_ICASE |
 		                        DKIMF_DB_FLAG_READONLY),
-		                       NULL, &dberr);
-		if (status != 0)
+		                       NULL) != 0)
 		{
-			snprintf(err, errlen, "%s: dkimf_db_open(): %s",
-			         str, dberr);
+			snprintf(err, errlen, "%s: dkimf_db_batch_add(): %s",
+			         conf->conf_testdnsdata, strerror(errno));
 			return -1;
 		}
 	}
@@ -7035,35 +7680,29 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 	}
 	if (str != NULL)
 	{
-		int status;
-		char *dberr = NULL;
-
-		status = dkimf_db_open(&conf->conf_internal, str,
+		if (dkimf_db_batch_add(dbb, "InternalHosts",
+		                       &conf->conf_internal, str,
 		                       (dbflags | 
 		                        DKIMF_DB_FLAG_ICASE |
 		                        DKIMF_DB_FLAG_READONLY),
-		                       NULL, &dberr);
-		if (status != 0)
+		                       NULL) != 0)
 		{
-			snprintf(err, errlen, "%s: dkimf_db_open(): %s",
-			         str, dberr);
+			snprintf(err, errlen, "%s: dkimf_db_batch_add(): %s",
+			         str, strerror(errno));
 			return -1;
 		}
 	}
 	else
 	{
-		int status;
-		char *dberr = NULL;
-
-		status = dkimf_db_open(&conf->conf_internal, DEFINTERNAL,
+		if (dkimf_db_batch_add(dbb, "InternalHosts",
+		                       &conf->conf_internal, DEFINTERNAL,
 		                       (dbflags | 
 		                        DKIMF_DB_FLAG_ICASE |
 		                        DKIMF_DB_FLAG_READONLY),
-		                       NULL, &dberr);
-		if (status != 0)
+		                       NULL) != 0)
 		{
-			snprintf(err, errlen, "%s: dkimf_db_open(): %s",
-			         DEFINTERNAL, dberr);
+			snprintf(err, errlen, "%s: dkimf_db_batch_add(): %s",
+			         DEFINTERNAL, strerror(errno));
 			return -1;
 		}
 	}
@@ -7081,18 +7720,15 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 	}
 	if (str != NULL && !testmode)
 	{
-		int status;
-		char *dberr = NULL;
-
-		status = dkimf_db_open(&conf->conf_exignore, str,
+		if (dkimf_db_batch_add(dbb, "ExternalIgnoreList",
+		                       &conf->conf_exignore, str,
 		                       (dbflags | 
 		                        DKIMF_DB_FLAG_ICASE |
 		                        DKIMF_DB_FLAG_READONLY),
-		                       NULL, &dberr);
-		if (status != 0)
+		                       NULL) != 0)
 		{
-			snprintf(err, errlen, "%s: dkimf_db_open(): %s",
-			         str, dberr);
+			snprintf(err, errlen, "%s: dkimf_db_batch_add(): %s",
+			         str, strerror(errno));
 			return -1;
 		}
 	}
@@ -7109,18 +7745,15 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 	}
 	if (str != NULL && !testmode)
 	{
-		int status;
-		char *dberr = NULL;
-
-		status = dkimf_db_open(&conf->conf_exemptdb, str,
+		if (dkimf_db_batch_add(dbb, "ExemptDomains",
+		                       &conf->conf_exemptdb, str,
 		                       (dbflags | 
 		                        DKIMF_DB_FLAG_ICASE |
 		                        DKIMF_DB_FLAG_READONLY),
-		                       NULL, &dberr);
-		if (status != 0)
+		                       NULL) != 0)
 		{
-			snprintf(err, errlen, "%s: dkimf_db_open(): %s",
-			         str, dberr);
+			snprintf(err, errlen, "%s: dkimf_db_batch_add(): %s",
+			         str, strerror(errno));
 			return -1;
 		}
 	}
@@ -7131,18 +7764,15 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 		(void) config_get(data, "BodyLengthDB", &str, sizeof str);
 	if (str != NULL)
 	{
-		int status;
-		char *dberr = NULL;
-
-		status = dkimf_db_open(&conf->conf_bldb, str,
+		if (dkimf_db_batch_add(dbb, "BodyLengthDB",
+		                       &conf->conf_bldb, str,
 		                       (dbflags | 
 		                        DKIMF_DB_FLAG_ICASE |
 		                        DKIMF_DB_FLAG_READONLY),
-		                       NULL, &dberr);
-		if (status != 0)
+		                       NULL) != 0)
 		{
-			snprintf(err, errlen, "%s: dkimf_db_open(): %s",
-			         str, dberr);
+			snprintf(err, errlen, "%s: dkimf_db_batch_add(): %s",
+			         str, strerror(errno));
 			return -1;
 		}
 	}
@@ -7152,18 +7782,15 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 		(void) config_get(data, "SignHeaders", &str, sizeof str);
 	if (str != NULL)
 	{
-		int status;
-		char *dberr = NULL;
-
-		status = dkimf_db_open(&conf->conf_signhdrsdb, str,
+		if (dkimf_db_batch_add(dbb, "SignHeaders",
+		                       &conf->conf_signhdrsdb, str,
 		                       (dbflags | 
 		                        DKIMF_DB_FLAG_ICASE |
 		                        DKIMF_DB_FLAG_READONLY),
-		                       NULL, &dberr);
-		if (status != 0)
+		                       NULL) != 0)
 		{
-			snprintf(err, errlen, "%s: dkimf_db_open(): %s",
-			         str, dberr);
+			snprintf(err, errlen, "%s: dkimf_db_batch_add(): %s",
+			         str, strerror(errno));
 			return -1;
 		}
 	}
@@ -7173,18 +7800,15 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 		(void) config_get(data, "RemoveARFrom", &str, sizeof str);
 	if (str != NULL)
 	{
-		int status;
-		char *dberr = NULL;
-
-		status = dkimf_db_open(&conf->conf_remardb, str,
+		if (dkimf_db_batch_add(dbb, "RemoveARFrom",
+		                       &conf->conf_remardb, str,
 		                       (dbflags | 
 		                        DKIMF_DB_FLAG_ICASE |
 		                        DKIMF_DB_FLAG_READONLY),
-		                       NULL, &dberr);
-		if (status != 0)
+		                       NULL) != 0)
 		{
-			snprintf(err, errlen, "%s: dkimf_db_open(): %s",
-			         str, dberr);
+			snprintf(err, errlen, "%s: dkimf_db_batch_add(): %s",
+			         str, strerror(errno));
 			return -1;
 		}
 	}
@@ -7208,18 +7832,15 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 
 	if (str != NULL)
 	{
-		int status;
-		char *dberr = NULL;
-
-		status = dkimf_db_open(&conf->conf_atpsdb, str,
+		if (dkimf_db_batch_add(dbb, "ATPSDomains",
+		                       &conf->conf_atpsdb, str,
 		                       (dbflags | 
 		                        DKIMF_DB_FLAG_ICASE |
 		                        DKIMF_DB_FLAG_READONLY),
-		                       NULL, &dberr);
-		if (status != 0)
+		                       NULL) != 0)
 		{
-			snprintf(err, errlen, "%s: dkimf_db_open(): %s",
-			         str, dberr);
+			snprintf(err, errlen, "%s: dkimf_db_batch_add(): %s",
+			         str, strerror(errno));
 			return -1;
 		}
 	}
@@ -7230,18 +7851,15 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 		(void) config_get(data, "DontSignMailTo", &str, sizeof str);
 	if (str != NULL)
 	{
-		int status;
-		char *dberr = NULL;
-
-		status = dkimf_db_open(&conf->conf_dontsigntodb, str,
+		if (dkimf_db_batch_add(dbb, "DontSignMailTo",
+		                       &conf->conf_dontsigntodb, str,
 		                       (dbflags | 
 		                        DKIMF_DB_FLAG_ICASE |
 		                        DKIMF_DB_FLAG_READONLY),
-		                       NULL, &dberr);
-		if (status != 0)
+		                       NULL) != 0)
 		{
-			snprintf(err, errlen, "%s: dkimf_db_open(): %s",
-			         str, dberr);
+			snprintf(err, errlen, "%s: dkimf_db_batch_add(): %s",
+			         str, strerror(errno));
 			return -1;
 		}
 	}
@@ -7251,18 +7869,15 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 		(void) config_get(data, "MustBeSigned", &str, sizeof str);
 	if (str != NULL)
 	{
-		int status;
-		char *dberr = NULL;
-
-		status = dkimf_db_open(&conf->conf_mbsdb, str,
+		if (dkimf_db_batch_add(dbb, "MustBeSigned",
+		                       &conf->conf_mbsdb, str,
 		                       (dbflags |
 		                        DKIMF_DB_FLAG_ICASE |
 		                        DKIMF_DB_FLAG_READONLY),
-		                       NULL, &dberr);
-		if (status != 0)
+		                       NULL) != 0)
 		{
-			snprintf(err, errlen, "%s: dkimf_db_open(): %s",
-			         str, dberr);
+			snprintf(err, errlen, "%s: dkimf_db_batch_add(): %s",
+			         str, strerror(errno));
 			return -1;
 		}
 	}
@@ -7278,18 +7893,15 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 	}
 	if (str != NULL)
 	{
-		int status;
-		char *dberr = NULL;
-
-		status = dkimf_db_open(&conf->conf_omithdrdb, str,
+		if (dkimf_db_batch_add(dbb, "OmitHeaders",
+		                       &conf->conf_omithdrdb, str,
 		                       (dbflags |
 		                        DKIMF_DB_FLAG_ICASE |
 		                        DKIMF_DB_FLAG_READONLY),
-		                       NULL, &dberr);
-		if (status != 0)
+		                       NULL) != 0)
 		{
-			snprintf(err, errlen, "%s: dkimf_db_open(): %s",
-			         str, dberr);
+			snprintf(err, errlen, "%s: dkimf_db_batch_add(): %s",
+			         str, strerror(errno));
 			return -1;
 		}
 	}
@@ -7301,23 +7913,15 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 	}
 	if (str != NULL)
 	{
-		int status;
-		char *dberr = NULL;
-
-		status = dkimf_db_open(&conf->conf_mtasdb, str,
+		if (dkimf_db_batch_add(dbb, "MTA",
+		                       &conf->conf_mtasdb, str,
 		                       (dbflags | DKIMF_DB_FLAG_READONLY),
-		                       NULL, &dberr);
-		if (status != 0)
+		                       NULL) != 0)
 		{
-			snprintf(err, errlen, "%s: dkimf_db_open(): %s",
-			         str, dberr);
+			snprintf(err, errlen, "%s: dkimf_db_batch_add(): %s",
+			         str, strerror(errno));
 			return -1;
 		}
-
-		status = dkimf_db_mkarray(conf->conf_mtasdb, &conf->conf_mtas,
-		                          NULL);
-		if (status == -1)
-			return -1;
 	}
 
 	str = NULL;
@@ -7325,18 +7929,15 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 		(void) config_get(data, "OverSignHeaders", &str, sizeof str);
 	if (str != NULL)
 	{
-		int status;
-		char *dberr = NULL;
-
-		status = dkimf_db_open(&conf->conf_oversigndb, str,
+		if (dkimf_db_batch_add(dbb, "OverSignHeaders",
+		                       &conf->conf_oversigndb, str,
 		                       (dbflags |
 		                        DKIMF_DB_FLAG_ICASE |
 		                        DKIMF_DB_FLAG_READONLY),
-		                       NULL, &dberr);
-		if (status != 0)
+		                       NULL) != 0)
 		{
-			snprintf(err, errlen, "%s: dkimf_db_open(): %s",
-			         str, dberr);
+			snprintf(err, errlen, "%s: dkimf_db_batch_add(): %s",
+			         str, strerror(errno));
 			return -1;
 		}
 	}
@@ -7346,26 +7947,17 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 		(void) config_get(data, "SenderHeaders", &str, sizeof str);
 	if (str != NULL)
 	{
-		int status;
-		char *dberr = NULL;
-
-		status = dkimf_db_open(&conf->conf_senderhdrsdb, str,
+		if (dkimf_db_batch_add(dbb, "SenderHeaders",
+		                       &conf->conf_senderhdrsdb, str,
 		                       (dbflags |
 		                        DKIMF_DB_FLAG_ICASE |
 		                        DKIMF_DB_FLAG_READONLY),
-		                       NULL, &dberr);
-		if (status != 0)
+		                       NULL) != 0)
 		{
-			snprintf(err, errlen, "%s: dkimf_db_open(): %s",
-			         str, dberr);
+			snprintf(err, errlen, "%s: dkimf_db_batch_add(): %s",
+			         str, strerror(errno));
 			return -1;
 		}
-
-		status = dkimf_db_mkarray(conf->conf_senderhdrsdb,
-		                          &conf->conf_senderhdrs,
-		                          NULL);
-		if (status == -1)
-			return -1;
 	}
 
 #ifdef _FFR_VBR
@@ -7386,24 +7978,17 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 	}
 	if (str != NULL)
 	{
-		char *dberr = NULL;
-		int status;
-
-		status = dkimf_db_open(&conf->conf_vbr_trusteddb, str,
+		if (dkimf_db_batch_add(dbb, "VBR-TrustedCertifiers",
+		                       &conf->conf_vbr_trusteddb, str,
 		                       (dbflags |
 		                        DKIMF_DB_FLAG_ICASE |
 		                        DKIMF_DB_FLAG_READONLY),
-		                       NULL, &dberr);
-		if (status != 0)
+		                       NULL) != 0)
 		{
-			snprintf(err, errlen, "%s: dkimf_db_open(): %s",
-			         str, dberr);
+			snprintf(err, errlen, "%s: dkimf_db_batch_add(): %s",
+			         str, strerror(errno));
 			return -1;
 		}
-
-		(void) dkimf_db_mkarray(conf->conf_vbr_trusteddb,
-		                        (char ***) &conf->conf_vbr_trusted,
-		                        NULL);
 	}
 
 	if (data != NULL)
@@ -7425,21 +8010,18 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 
 		if (conf->conf_signtable != NULL)
 		{
-			int status;
-			char *dberr = NULL;
-
-			status = dkimf_db_open(&conf->conf_signtabledb,
+			if (dkimf_db_batch_add(dbb, "SigningTable",
+			                       &conf->conf_signtabledb,
 			                       conf->conf_signtable,
 			                       (dbflags |
 			                        DKIMF_DB_FLAG_ICASE |
 			                        DKIMF_DB_FLAG_ASCIIONLY |
 			                        DKIMF_DB_FLAG_READONLY),
-			                       NULL, &dberr);
-			if (status != 0)
+			                       NULL) != 0)
 			{
 				snprintf(err, errlen,
-				         "%s: dkimf_db_open(): %s",
-				         conf->conf_signtable, dberr);
+				         "%s: dkimf_db_batch_add(): %s",
+				         conf->conf_signtable, strerror(errno));
 				return -1;
 			}
 		}
@@ -7457,19 +8039,16 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 		}
 		else
 		{
-			int status;
-			char *dberr = NULL;
-
-			status = dkimf_db_open(&conf->conf_keytabledb,
+			if (dkimf_db_batch_add(dbb, "KeyTable",
+			                       &conf->conf_keytabledb,
 			                       conf->conf_keytable,
 			                       (dbflags |
-			                        DKIMF_DB_FLAG_READONLY), NULL,
-			                       &dberr);
-			if (status != 0)
+			                        DKIMF_DB_FLAG_READONLY),
+			                       NULL) != 0)
 			{
 				snprintf(err, errlen,
-				         "%s: dkimf_db_open(): %s",
-				         conf->conf_keytable, dberr);
+				         "%s: dkimf_db_batch_add(): %s",
+				         conf->conf_keytable, strerror(errno));
 				return -1;
 			}
 
@@ -7477,7 +8056,7 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 		}
 	}
 
-	if (conf->conf_signtabledb != NULL && conf->conf_keytabledb == NULL)
+	if (conf->conf_signtable != NULL && conf->conf_keytable == NULL)
 	{
 		snprintf(err, errlen, "use of SigningTable requires KeyTable");
 		return -1;
@@ -7491,17 +8070,14 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 	}
 	if (str != NULL)
 	{
-		int status;
-		char *dberr = NULL;
-
-		status = dkimf_db_open(&conf->conf_thirdpartydb, str,
+		if (dkimf_db_batch_add(dbb, "TrustSignaturesFrom",
+		                       &conf->conf_thirdpartydb, str,
 		                       (dbflags | DKIMF_DB_FLAG_ICASE |
 		                        DKIMF_DB_FLAG_READONLY),
-		                       NULL, &dberr);
-		if (status != 0)
+		                       NULL) != 0)
 		{
-			snprintf(err, errlen, "%s: dkimf_db_open(): %s",
-			         str, dberr);
+			snprintf(err, errlen, "%s: dkimf_db_batch_add(): %s",
+			         str, strerror(errno));
 			return -1;
 		}
 	}
@@ -7518,17 +8094,14 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 	}
 	if (str != NULL)
 	{
-		int status;
-		char *dberr = NULL;
-
-		status = dkimf_db_open(&conf->conf_resigndb, str,
+		if (dkimf_db_batch_add(dbb, "ResignMailTo",
+		                       &conf->conf_resigndb, str,
 		                       (dbflags | DKIMF_DB_FLAG_ICASE |
 		                        DKIMF_DB_FLAG_READONLY),
-		                       NULL, &dberr);
-		if (status != 0)
+		                       NULL) != 0)
 		{
-			snprintf(err, errlen, "%s: dkimf_db_open(): %s",
-			         str, dberr);
+			snprintf(err, errlen, "%s: dkimf_db_batch_add(): %s",
+			         str, strerror(errno));
 			return -1;
 		}
 	}
@@ -7547,17 +8120,14 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 	}
 	if (str != NULL)
 	{
-		int status;
-		char *dberr = NULL;
-
-		status = dkimf_db_open(&conf->conf_conditionaldb, str,
+		if (dkimf_db_batch_add(dbb, "ConditionalSignatures",
+		                       &conf->conf_conditionaldb, str,
 		                       (dbflags | DKIMF_DB_FLAG_ICASE |
 		                        DKIMF_DB_FLAG_READONLY),
-		                       NULL, &dberr);
-		if (status != 0)
+		                       NULL) != 0)
 		{
-			snprintf(err, errlen, "%s: dkimf_db_open(): %s",
-			         str, dberr);
+			snprintf(err, errlen, "%s: dkimf_db_batch_add(): %s",
+			         str, strerror(errno));
 			return -1;
 		}
 	}
@@ -7571,17 +8141,14 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 	}
 	if (str != NULL)
 	{
-		int status;
-		char *dberr = NULL;
-
-		status = dkimf_db_open(&conf->conf_ratelimitdb, str,
+		if (dkimf_db_batch_add(dbb, "RateLimits",
+		                       &conf->conf_ratelimitdb, str,
 		                       (dbflags | DKIMF_DB_FLAG_ICASE |
 		                        DKIMF_DB_FLAG_READONLY),
-		                       NULL, &dberr);
-		if (status != 0)
+		                       NULL) != 0)
 		{
-			snprintf(err, errlen, "%s: dkimf_db_open(): %s",
-			         str, dberr);
+			snprintf(err, errlen, "%s: dkimf_db_batch_add(): %s",
+			         str, strerror(errno));
 			return -1;
 		}
 	}
@@ -7589,38 +8156,31 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 	str = NULL;
 	if (data != NULL)
 	{
-		(void) config_get(data, "FlowData", &str, sizeof str);
+		(void) config_get(data, "FlowData", &conf->conf_flowdata,
+		                  sizeof conf->conf_flowdata);
 
 		(void) config_get(data, "FlowDataTTL", &conf->conf_flowdatattl,
 		                  sizeof conf->conf_flowdatattl);
 
+		(void) config_get(data, "FlowDataCheckpoint",
+		                  &conf->conf_flowcheckpoint,
+		                  sizeof conf->conf_flowcheckpoint);
+
 		(void) config_get(data, "FlowDataFactor",
 		                  &conf->conf_flowfactor,
 		                  sizeof conf->conf_flowfactor);
 	}
-	if (str != NULL)
+	if (conf->conf_flowdata != NULL)
 	{
-		int dbtype;
-		int status;
-		char *dberr = NULL;
-
-		status = dkimf_db_open(&conf->conf_flowdatadb, str,
+		if (dkimf_db_batch_add(dbb, "FlowData",
+		                       &conf->conf_flowdatadb,
+		                       conf->conf_flowdata,
 		                       (dbflags | DKIMF_DB_FLAG_ICASE |
 		                        DKIMF_DB_FLAG_MAKELOCK),
-		                       NULL, &dberr);
-		if (status != 0)
-		{
-			snprintf(err, errlen, "%s: dkimf_db_open(): %s",
-			         str, dberr);
-			return -1;
-		}
-
-		dbtype = dkimf_db_type(conf->conf_flowdatadb);
-		if (dbtype != DKIMF_DB_TYPE_BDB)
+		                       NULL) != 0)
 		{
-			snprintf(err, errlen,
-			         "%s: invalid data set type for FlowData",
-			         str);
+			snprintf(err, errlen, "%s: dkimf_db_batch_add(): %s",
+			         conf->conf_flowdata, strerror(errno));
 			return -1;
 		}
 	}
@@ -7635,58 +8195,38 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 	{
 		(void) config_get(data, "Domain", &str, sizeof str);
 	}
-	if (str != NULL && conf->conf_keytabledb == NULL)
+	if (str != NULL && conf->conf_keytable == NULL)
 	{
-		int status;
-		char *dberr = NULL;
-
-		status = dkimf_db_open(&conf->conf_domainsdb, str,
+		if (dkimf_db_batch_add(dbb, "Domain",
+		                       &conf->conf_domainsdb, str,
 		                       (dbflags | DKIMF_DB_FLAG_READONLY |
 		                        DKIMF_DB_FLAG_ICASE),
-		                       NULL, &dberr);
-		if (status != 0)
+		                       NULL) != 0)
 		{
-			snprintf(err, errlen, "%s: dkimf_db_open(): %s",
-			         str, dberr);
+			snprintf(err, errlen, "%s: dkimf_db_batch_add(): %s",
+			         str, strerror(errno));
 			return -1;
 		}
 	}
 
-	str = NULL;
 	if (data != NULL)
 	{
-		(void) config_get(data, "MacroList", &str, sizeof str);
+		(void) config_get(data, "MacroList", &conf->conf_macrolist,
+		                  sizeof conf->conf_macrolist);
 	}
-	if (str != NULL)
+	if (conf->conf_macrolist != NULL)
 	{
-		int status;
-		int dbtype;
-		char *dberr = NULL;
-
-		status = dkimf_db_open(&conf->conf_macrosdb, str,
+		if (dkimf_db_batch_add(dbb, "MacroList",
+		                       &conf->conf_macrosdb,
+		                       conf->conf_macrolist,
 		                       (dbflags | DKIMF_DB_FLAG_READONLY |
 		                        DKIMF_DB_FLAG_VALLIST |
-		                        DKIMF_DB_FLAG_MATCHBOTH), NULL,
-		                       &dberr);
-		if (status != 0)
-		{
-			snprintf(err, errlen, "%s: dkimf_db_open(): %s",
-			         str, dberr);
-			return -1;
-		}
-
-		dbtype = dkimf_db_type(conf->conf_macrosdb);
-		if (dbtype != DKIMF_DB_TYPE_FILE &&
-		    dbtype != DKIMF_DB_TYPE_CSL)
+		                        DKIMF_DB_FLAG_MATCHBOTH), NULL) != 0)
 		{
-			snprintf(err, errlen,
-			         "%s: invalid data set type for MacroList",
-			         str);
+			snprintf(err, errlen, "%s: dkimf_db_batch_add(): %s",
+			         conf->conf_macrolist, strerror(errno));
 			return -1;
 		}
-
-		(void) dkimf_db_mkarray(conf->conf_macrosdb,
-		                        &conf->conf_macros, NULL);
 	}
 
 	if (conf->conf_signalgstr != NULL)
@@ -7858,17 +8398,13 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 	}
 	if (str != NULL)
 	{
-		int status;
-		char *dberr = NULL;
-
-		status = dkimf_db_open(&conf->conf_rephdrsdb, str,
+		if (dkimf_db_batch_add(dbb, "ReplaceHeaders",
+		                       &conf->conf_rephdrsdb, str,
 		                       (dbflags | DKIMF_DB_FLAG_READONLY |
-		                        DKIMF_DB_FLAG_ICASE), NULL,
-		                       &dberr);
-		if (status != 0)
+		                        DKIMF_DB_FLAG_ICASE), NULL) != 0)
 		{
-			snprintf(err, errlen, "%s: dkimf_db_open(): %s",
-			         str, dberr);
+			snprintf(err, errlen, "%s: dkimf_db_batch_add(): %s",
+			         str, strerror(errno));
 			return -1;
 		}
 	}
@@ -7984,81 +8520,61 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 
 	if (conf->conf_replowtime != NULL)
 	{
-		int status;
-		char *dberr = NULL;
-
-		status = dkimf_db_open(&conf->conf_replowtimedb,
+		if (dkimf_db_batch_add(dbb, "ReputationLowTime",
+		                       &conf->conf_replowtimedb,
 		                       conf->conf_replowtime,
 		                       (dbflags | DKIMF_DB_FLAG_READONLY),
-		                       NULL, &dberr);
-		if (status != 0)
+		                       NULL) != 0)
 		{
-			snprintf(err, errlen, "%s: dkimf_db_open(): %s",
-			         conf->conf_replowtime, dberr);
+			snprintf(err, errlen, "%s: dkimf_db_batch_add(): %s",
+			         conf->conf_replowtime, strerror(errno));
 			return -1;
 		}
 	}
 
 	if (conf->conf_repratios != NULL)
 	{
-		int status;
-		char *dberr = NULL;
-
 		if (conf->conf_replimits != NULL)
 		{
-			status = dkimf_db_open(&conf->conf_replimitsdb,
+			if (dkimf_db_batch_add(dbb, "ReputationLimits",
+			                       &conf->conf_replimitsdb,
 			                       conf->conf_replimits,
 			                       (dbflags |
-			                        DKIMF_DB_FLAG_READONLY), NULL,
-			                       &dberr);
-			if (status != 0)
+			                        DKIMF_DB_FLAG_READONLY),
+			                       NULL) != 0)
 			{
 				snprintf(err, errlen,
-				         "%s: dkimf_db_open(): %s",
-				         conf->conf_replimits, dberr);
+				         "%s: dkimf_db_batch_add(): %s",
+				         conf->conf_replimits, strerror(errno));
 				return -1;
 			}
 		}
 
 		if (conf->conf_replimitmods != NULL)
 		{
-			status = dkimf_db_open(&conf->conf_replimitmodsdb,
+			if (dkimf_db_batch_add(dbb, "ReputationLimitModifiers",
+			                       &conf->conf_replimitmodsdb,
 			                       conf->conf_replimitmods,
 			                       (dbflags |
-			                        DKIMF_DB_FLAG_READONLY), NULL,
-			                       &dberr);
-			if (status != 0)
+			                        DKIMF_DB_FLAG_READONLY),
+			                       NULL) != 0)
 			{
 				snprintf(err, errlen,
-				         "%s: dkimf_db_open(): %s",
-				         conf->conf_replimitmods, dberr);
+				         "%s: dkimf_db_batch_add(): %s",
+				         conf->conf_replimitmods,
+				         strerror(errno));
 				return -1;
 			}
 		}
 
-		status = dkimf_db_open(&conf->conf_repratiosdb,
+		if (dkimf_db_batch_add(dbb, "ReputationRatios",
+		                       &conf->conf_repratiosdb,
 		                       conf->conf_repratios,
 		                       (dbflags | DKIMF_DB_FLAG_READONLY),
-		                       NULL, &dberr);
-		if (status != 0)
-		{
-			snprintf(err, errlen, "%s: dkimf_db_open(): %s",
-			         conf->conf_repratios, dberr);
-			return -1;
-		}
-
-		if (dkimf_rep_init(&conf->conf_rep, conf->conf_repfactor,
-	                           conf->conf_repminimum,
-	                           conf->conf_repcachettl,
-	                           conf->conf_repcache,
-	                           conf->conf_repdups,
-	                           conf->conf_replimitsdb,
-	                           conf->conf_replimitmodsdb,
-	                           conf->conf_repratiosdb,
-		                   conf->conf_replowtimedb) != 0)
+		                       NULL) != 0)
 		{
-			snprintf(err, errlen,
-			         "can't initialize reputation subsystem");
+			snprintf(err, errlen, "%s: dkimf_db_batch_add(): %s",
+			         conf->conf_repratios, strerror(errno));
 			return -1;
 		}
 	}
@@ -8276,15 +8792,6 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 			return -1;
 		}
 
-		if (conf->conf_domainsdb != NULL &&
-		    (conf->conf_selector == NULL ||
-		     conf->conf_keyfile == NULL))
-		{
-			snprintf(err, errlen,
-			         "Domain requires KeyFile and Selector");
-			return -1;
-		}
-
 		if (conf->conf_signtable != NULL &&
 		    conf->conf_keytable == NULL)
 		{
@@ -8311,70 +8818,6 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 			return -1;
 		}
 #endif /* USE_LUA */
-
-		/*
-		**  Verify that the SingingTable doesn't reference any
-		**  missing KeyTable entries.
-		*/
-
-		if (conf->conf_signtabledb != NULL)
-		{
-			_Bool first = TRUE;
-			_Bool found;
-			struct dkimf_db_data dbd[3];
-			char keyname[BUFRSZ + 1];
-			char domain[BUFRSZ + 1];
-			char selector[BUFRSZ + 1];
-			char keydata[BUFRSZ + 1];
-			char signer[BUFRSZ + 1];
-
-			dbd[0].dbdata_flags = 0;
-			
-			memset(keyname, '\0', sizeof keyname);
-
-			dbd[0].dbdata_buffer = keyname;
-			dbd[0].dbdata_buflen = sizeof keyname - 1;
-			dbd[0].dbdata_flags = 0;
-			dbd[1].dbdata_buffer = signer;
-			dbd[1].dbdata_buflen = sizeof signer - 1;
-			dbd[1].dbdata_flags = 0;
-
-			while (dkimf_db_walk(conf->conf_signtabledb, first,
-			                     NULL, NULL, dbd, 2) == 0)
-			{
-				first = FALSE;
-				found = FALSE;
-				dbd[0].dbdata_buffer = domain;
-				dbd[0].dbdata_buflen = sizeof domain - 1;
-				dbd[0].dbdata_flags = 0;
-				dbd[1].dbdata_buffer = selector;
-				dbd[1].dbdata_buflen = sizeof selector - 1;
-				dbd[1].dbdata_flags = 0;
-				dbd[2].dbdata_buffer = keydata;
-				dbd[2].dbdata_buflen = sizeof keydata - 1;
-				dbd[2].dbdata_flags = DKIMF_DB_DATA_BINARY;
-
-				if (dkimf_db_get(conf->conf_keytabledb,	
-				                 keyname, strlen(keyname),
-				                 dbd, 3, &found) != 0 ||
-				    !found ||
-				    dbd[0].dbdata_buflen == 0 ||
-				    dbd[1].dbdata_buflen == 0 ||
-				    dbd[2].dbdata_buflen == 0)
-				{
-					snprintf(err, errlen,
-					         "could not find valid key record \"%s\" in KeyTable",
-					         keyname);
-					return -1;
-				}
-
-				memset(keyname, '\0', sizeof keyname);
-
-				dbd[0].dbdata_buffer = keyname;
-				dbd[0].dbdata_buflen = sizeof keyname - 1;
-				dbd[0].dbdata_flags = 0;
-			}
-		}
 	}
 
 	/* activate logging if requested */
@@ -8398,55 +8841,342 @@ dkimf_config_load(struct config *data, struct dkimf_config *conf,
 }
 
 /*
-**  DKIMF_DNS_INIT -- initialize and configure the DNS service in the
-**                    DKIM library
+**  DKIMF_CONFIG_TABLES -- finish configuration that needs open data sets
 **
 **  Parameters:
-**  	lib -- DKIM library
-**  	conf -- configuration handle
-**  	err -- error string (returned)
+**  	conf -- configuration handle, with its data sets open
+**  	err -- where to write errors
+**  	errlen -- bytes available at "err"
 **
 **  Return value:
-**  	TRUE on success, FALSE otherwise
+**  	0 -- success
+**  	!0 -- error
 */
 
-static _Bool
-dkimf_dns_init(DKIM_LIB *lib, struct dkimf_config *conf, char **err)
+static int
+dkimf_config_tables(struct dkimf_config *conf, char *err, size_t errlen)
 {
-	int status;
+	int dbtype;
 
-	assert(lib != NULL);
 	assert(conf != NULL);
-	assert(err != NULL);
 
-	status = dkim_dns_init(lib);
-	if (status == DKIM_DNS_INVALID)
-	{
-		return TRUE;
-	}
-	else if (status == DKIM_DNS_ERROR)
+	if (conf->conf_mtasdb != NULL &&
+	    dkimf_db_mkarray(conf->conf_mtasdb, &conf->conf_mtas,
+	                     NULL) == -1)
 	{
-		if (err != NULL)
-			*err = "failed to initialize resolver";
-
-		return FALSE;
+		snprintf(err, errlen, "can't load MTA list");
+		return -1;
 	}
 
-	if (conf->conf_nslist != NULL)
+	if (conf->conf_senderhdrsdb != NULL &&
+	    dkimf_db_mkarray(conf->conf_senderhdrsdb, &conf->conf_senderhdrs,
+	                     NULL) == -1)
 	{
-		status = dkimf_dns_setnameservers(lib,
-						  conf->conf_nslist);
-		if (status != DKIM_STAT_OK)
-		{
-			if (err != NULL)
-				*err = "failed to set nameserver list";
-			return FALSE;
-		}
+		snprintf(err, errlen, "can't load SenderHeaders list");
+		return -1;
 	}
 
-	if (conf->conf_trustanchorpath != NULL)
+#ifdef _FFR_VBR
+	if (conf->conf_vbr_trusteddb != NULL)
 	{
-		if (access(conf->conf_trustanchorpath, R_OK) != 0)
+		(void) dkimf_db_mkarray(conf->conf_vbr_trusteddb,
+		                        (char ***) &conf->conf_vbr_trusted,
+		                        NULL);
+	}
+#endif /* _FFR_VBR */
+
+#ifdef _FFR_RATE_LIMIT
+	if (conf->conf_flowdatadb != NULL)
+	{
+		dbtype = dkimf_db_type(conf->conf_flowdatadb);
+		if (dbtype != DKIMF_DB_TYPE_BDB)
+		{
+			snprintf(err, errlen,
+			         "%s: invalid data set type for FlowData",
+			         conf->conf_flowdata);
+			return -1;
+		}
+	}
+#endif /* _FFR_RATE_LIMIT */
+
+	if (conf->conf_macrosdb != NULL)
+	{
+		dbtype = dkimf_db_type(conf->conf_macrosdb);
+		if (dbtype != DKIMF_DB_TYPE_FILE &&
+		    dbtype != DKIMF_DB_TYPE_CSL)
+		{
+			snprintf(err, errlen,
+			         "%s: invalid data set type for MacroList",
+			         conf->conf_macrolist);
+			return -1;
+		}
+
+		(void) dkimf_db_mkarray(conf->conf_macrosdb,
+		                        &conf->conf_macros, NULL);
+	}
+
+#ifdef _FFR_REPUTATION
+	if (conf->conf_repratiosdb != NULL)
+	{
+		if (dkimf_rep_init(&conf->conf_rep, conf->conf_repfactor,
+	                           conf->conf_repminimum,
+	                           conf->conf_repcachettl,
+	                           conf->conf_repcache,
+	                           conf->conf_repdups,
+	                           conf->conf_replimitsdb,
+	                           conf->conf_replimitmodsdb,
+	                           conf->conf_repratiosdb,
+		                   conf->conf_replowtimedb) != 0)
+		{
+			snprintf(err, errlen,
+			         "can't initialize reputation subsystem");
+			return -1;
+		}
+	}
+#endif /* _FFR_REPUTATION */
+
+	if ((conf->conf_mode & DKIMF_MODE_SIGNER) != 0)
+	{
+		if (conf->conf_domainsdb != NULL &&
+		    (conf->conf_selector == NULL ||
+		     conf->conf_keyfile == NULL))
+		{
+			snprintf(err, errlen,
+			         "Domain requires KeyFile and Selector");
+			return -1;
+		}
+
+		/*
+		**  Verify that the SingingTable doesn't reference any
+		**  missing KeyTable entries.
+		*/
+
+		if (conf->conf_signtabledb != NULL)
+		{
+			_Bool first = TRUE;
+			_Bool found;
+			struct dkimf_db_data dbd[3];
+			char keyname[BUFRSZ + 1];
+			char domain[BUFRSZ + 1];
+			char selector[BUFRSZ + 1];
+			char keydata[BUFRSZ + 1];
+			char signer[BUFRSZ + 1];
+
+			dbd[0].dbdata_flags = 0;
+			
+			memset(keyname, '\0', sizeof keyname);
+
+			dbd[0].dbdata_buffer = keyname;
+			dbd[0].dbdata_buflen = sizeof keyname - 1;
+			dbd[0].dbdata_flags = 0;
+			dbd[1].dbdata_buffer = signer;
+			dbd[1].dbdata_buflen = sizeof signer - 1;
+			dbd[1].dbdata_flags = 0;
+
+			while (dkimf_db_walk(conf->conf_signtabledb, first,
+			                     NULL, NULL, dbd, 2) == 0)
+			{
+				first = FALSE;
+				found = FALSE;
+				dbd[0].dbdata_buffer = domain;
+				dbd[0].dbdata_buflen = sizeof domain - 1;
+				dbd[0].dbdata_flags = 0;
+				dbd[1].dbdata_buffer = selector;
+				dbd[1].dbdata_buflen = sizeof selector - 1;
+				dbd[1].dbdata_flags = 0;
+				dbd[2].dbdata_buffer = keydata;
+				dbd[2].dbdata_buflen = sizeof keydata - 1;
+				dbd[2].dbdata_flags = DKIMF_DB_DATA_BINARY;
+
+				if (dkimf_db_get(conf->conf_keytabledb,	
+				                 keyname, strlen(keyname),
+				                 dbd, 3, &found) != 0 ||
+				    !found ||
+				    dbd[0].dbdata_buflen == 0 ||
+				    dbd[1].dbdata_buflen == 0 ||
+				    dbd[2].dbdata_buflen == 0)
+				{
+					snprintf(err, errlen,
+					         "could not find valid key record \"%s\" in KeyTable",
+					         keyname);
+					return -1;
+				}
+
+				memset(keyname, '\0', sizeof keyname);
+
+				dbd[0].dbdata_buffer = keyname;
+				dbd[0].dbdata_buflen = sizeof keyname - 1;
+				dbd[0].dbdata_flags = 0;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+**  DKIMF_CONFIG_LOAD -- load a configuration handle based on file content
+**
+**  Paramters:
+**  	data -- configuration data loaded from config file
+**  	conf -- configuration structure to load
+**  	err -- where to write errors
+**  	errlen -- bytes available at "err"
+**  	become -- pretend we're the named user (can be NULL)
+**
+**  Return value:
+**  	0 -- success
+**  	!0 -- error
+**
+**  Side effects:
+**  	openlog() may be called by this function
+**
+**  Notes:
+**  	Data sets are opened as they are found, up to TableLoadThreads of
+**  	them at once when they are local files.  Errors are reported as
+**  	they would have been had everything been opened in order: the
+**  	first problem with the configuration itself, or else the first
+**  	data set, in configuration order, that failed to open.
+*/
+
+static int
+dkimf_config_load(struct config *data, struct dkimf_config *conf,
+                  char *err, size_t errlen, char *become)
+{
+	int status;
+	u_int c;
+	uint64_t usec;
+	struct timespec start;
+	struct timespec end;
+	struct dkimf_db_opened *dbo;
+	struct dkimf_db_batch *dbb;
+
+	assert(conf != NULL);
+	assert(err != NULL);
+
+	if (data != NULL)
+	{
+		(void) config_get(data, "TableLoadThreads",
+		                  &conf->conf_tablethreads,
+		                  sizeof conf->conf_tablethreads);
+	}
+
+	dbb = dkimf_db_batch_new(conf->conf_tablethreads);
+	if (dbb == NULL)
+	{
+		snprintf(err, errlen, "dkimf_db_batch_new(): %s",
+		         strerror(errno));
+		return -1;
+	}
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &start);
+
+	status = dkimf_config_parse(data, conf, err, errlen, become, dbb);
+
+	if (dkimf_db_batch_wait(dbb) != 0 && status == 0)
+	{
+		for (c = 0; (dbo = dkimf_db_batch_result(dbb, c)) != NULL; c++)
+		{
+			if (dbo->dbo_status != 0)
+			{
+				snprintf(err, errlen,
+				         "%s: dkimf_db_open(): %s",
+				         dbo->dbo_name, dbo->dbo_err);
+				status = -1;
+				break;
+			}
+		}
+	}
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (status == 0 && conf->conf_dolog)
+	{
+		for (c = 0; (dbo = dkimf_db_batch_result(dbb, c)) != NULL; c++)
+		{
+			syslog(LOG_INFO, "%s: data set opened in %lu.%03lus",
+			       dbo->dbo_label,
+			       (u_long) (dbo->dbo_usec / 1000000),
+			       (u_long) (dbo->dbo_usec % 1000000) / 1000);
+		}
+
+		usec = (end.tv_sec - start.tv_sec) * 1000000 +
+		       (end.tv_nsec - start.tv_nsec) / 1000;
+
+		if (c > 0 && conf->conf_tablethreads > 0)
+		{
+			syslog(LOG_INFO,
+			       "%u data set(s) opened in %lu.%03lus, up to %u at a time",
+			       c, (u_long) (usec / 1000000),
+			       (u_long) (usec % 1000000) / 1000,
+			       conf->conf_tablethreads);
+		}
+		else if (c > 0)
+		{
+			syslog(LOG_INFO, "%u data set(s) opened in %lu.%03lus",
+			       c, (u_long) (usec / 1000000),
+			       (u_long) (usec % 1000000) / 1000);
+		}
+	}
+
+	dkimf_db_batch_free(dbb);
+
+	if (status == 0)
+		status = dkimf_config_tables(conf, err, errlen);
+
+	return status;
+}
+
+/*
+**  DKIMF_DNS_INIT -- initialize and configure the DNS service in the
+**                    DKIM library
+**
+**  Parameters:
+**  	lib -- DKIM library
+**  	conf -- configuration handle
+**  	err -- error string (returned)
+**
+**  Return value:
+**  	TRUE on success, FALSE otherwise
+*/
+
+static _Bool
+dkimf_dns_init(DKIM_LIB *lib, struct dkimf_config *conf, char **err)
+{
+	int status;
+
+	assert(lib != NULL);
+	assert(conf != NULL);
+	assert(err != NULL);
+
+	status = dkim_dns_init(lib);
+	if (status == DKIM_DNS_INVALID)
+	{
+		return TRUE;
+	}
+	else if (status == DKIM_DNS_ERROR)
+	{
+		if (err != NULL)
+			*err = "failed to initialize resolver";
+
+		return FALSE;
+	}
+
+	if (conf->conf_nslist != NULL)
+	{
+		status = dkimf_dns_setnameservers(lib,
+						  conf->conf_nslist);
+		if (status != DKIM_STAT_OK)
+		{
+			if (err != NULL)
+				*err = "failed to set nameserver list";
+			return FALSE;
+		}
+	}
+
+	if (conf->conf_trustanchorpath != NULL)
+	{
+		if (access(conf->conf_trustanchorpath, R_OK) != 0)
 		{
 			if (err != NULL)
 				*err = "can't access unbound trust anchor";
@@ -8536,11 +9266,28 @@ dkimf_config_setlib(struct dkimf_config *conf, char **err)
 		                    sizeof conf->conf_minkeybits);
 	}
 
-	if (conf->conf_testdnsdb != NULL)
-	{
-		(void) dkimf_filedns_setup(lib, conf->conf_testdnsdb);
-	}
-	else
+	if (conf->conf_bodycache != 0)
+	{
+		(void) dkim_options(lib, DKIM_OP_SETOPT, DKIM_OPTS_BODYCACHE,
+		                    &conf->conf_bodycache,
+		                    sizeof conf->conf_bodycache);
+
+		if (conf->conf_bodycachemax != 0)
+		{
+			size_t max;
+
+			max = conf->conf_bodycachemax;
+			(void) dkim_options(lib, DKIM_OP_SETOPT,
+			                    DKIM_OPTS_BODYCACHEMAX,
+			                    &max, sizeof max);
+		}
+	}
+
+	if (conf->conf_testdnsdb != NULL)
+	{
+		(void) dkimf_filedns_setup(lib, conf->conf_testdnsdb);
+	}
+	else
 	{
 #ifdef USE_UNBOUND
 		(void) dkimf_unbound_setup(lib);
@@ -8590,7 +9337,7 @@ dkimf_config_setlib(struct dkimf_config *conf, char **err)
 
 	if (conf->conf_sendreports || conf->conf_keeptmpfiles ||
 	    conf->conf_stricthdrs || conf->conf_blen || conf->conf_ztags ||
-	    conf->conf_fixcrlf)
+	    conf->conf_fixcrlf || DKIMF_TIMING(conf))
 	{
 		u_int opts;
 
@@ -8618,6 +9365,8 @@ dkimf_config_setlib(struct dkimf_config *conf, char **err)
 			opts |= DKIM_LIBFLAGS_ACCEPTDK;
 		if (conf->conf_stricthdrs)
 			opts |= DKIM_LIBFLAGS_STRICTHDRS;
+		if (DKIMF_TIMING(conf))
+			opts |= DKIM_LIBFLAGS_TIMING;
 
 		status = dkim_options(conf->conf_libopendkim, DKIM_OP_SETOPT,
 		                      DKIM_OPTS_FLAGS, &opts, sizeof opts);
@@ -8789,37 +9538,40 @@ dkimf_config_setlib(struct dkimf_config *conf, char **err)
 **  Side effects:
 **  	If a reload was requested and is successful, "curconf" now points
 **  	to a new configuration handle.
+**
+**  Notes:
+**  	Called only from the reload thread.  The new configuration is built
+**  	and its tables opened without any lock that connections need, and
+**  	is then published with an atomic swap; connections that started
+**  	under the old one keep it until they close.
 */
 
 static void
 dkimf_config_reload(void)
 {
 	struct dkimf_config *new;
+	struct dkimf_config *old;
 	char errbuf[BUFRSZ + 1];
 
-	pthread_mutex_lock(&conf_lock);
-
 	if (!reload)
-	{
-		pthread_mutex_unlock(&conf_lock);
 		return;
-	}
+
+	old = curconf;
 
 	if (conffile == NULL)
 	{
-		if (curconf->conf_dolog)
+		if (old->conf_dolog)
 			syslog(LOG_ERR, "ignoring reload signal");
 
 		reload = FALSE;
 
-		pthread_mutex_unlock(&conf_lock);
 		return;
 	}
 
 	new = dkimf_config_new();
 	if (new == NULL)
 	{
-		if (curconf->conf_dolog)
+		if (old->conf_dolog)
 			syslog(LOG_ERR, "malloc(): %s", strerror(errno));
 	}
 	else
@@ -8839,7 +9591,7 @@ dkimf_config_reload(void)
 
 		if (cfg == NULL)
 		{
-			if (curconf->conf_dolog)
+			if (old->conf_dolog)
 			{
 				syslog(LOG_ERR,
 				       "%s: configuration error at line %u: %s",
@@ -8855,7 +9607,7 @@ dkimf_config_reload(void)
 			if (allowdeprecated)
 				action = "continuing";
 
-			if (curconf->conf_dolog)
+			if (old->conf_dolog)
 			{
 				syslog(LOG_WARNING,
 				       "%s: settings found for deprecated value(s): %s; %s",
@@ -8874,7 +9626,7 @@ dkimf_config_reload(void)
 			missing = config_check(cfg, dkimf_config);
 			if (missing != NULL)
 			{
-				if (curconf->conf_dolog)
+				if (old->conf_dolog)
 				{
 					syslog(LOG_ERR,
 					        "%s: required parameter \"%s\" missing",
@@ -8889,16 +9641,34 @@ dkimf_config_reload(void)
 		if (!err && dkimf_config_load(cfg, new, errbuf,
 		                              sizeof errbuf, NULL) != 0)
 		{
-			if (curconf->conf_dolog)
+			if (old->conf_dolog)
 				syslog(LOG_ERR, "%s: %s", conffile, errbuf);
 			config_free(cfg);
 			dkimf_config_free(new);
 			err = TRUE;
 		}
 
+#if defined(_FFR_WORKERS) && defined(_FFR_RATE_LIMIT)
+		/* flow counts are per process; see the check in main() */
+		if (!err && multiworker &&
+		    (new->conf_ratelimitdb != NULL ||
+		     new->conf_flowdatadb != NULL))
+		{
+			if (old->conf_dolog)
+			{
+				syslog(LOG_ERR,
+				       "%s: RateLimits and FlowData can't be used with more than one worker",
+				       conffile);
+			}
+			config_free(cfg);
+			dkimf_config_free(new);
+			err = TRUE;
+		}
+#endif /* _FFR_WORKERS && _FFR_RATE_LIMIT */
+
 		if (!err && !dkimf_config_setlib(new, &errstr))
 		{
-			if (curconf->conf_dolog)
+			if (old->conf_dolog)
 			{
 				syslog(LOG_WARNING,
 				       "can't configure DKIM library: %s; continuing",
@@ -8911,12 +9681,34 @@ dkimf_config_reload(void)
 
 		if (!err)
 		{
-			if (curconf->conf_refcnt == 0)
-				dkimf_config_free(curconf);
+			new->conf_data = cfg;
+			new->conf_refcnt = 1;
 
 			dolog = new->conf_dolog;
-			curconf = new;
-			new->conf_data = cfg;
+			tracing = DKIMF_TRACING(new);
+			(void) DKIMF_CONF_SWAP(curconf, new);
+
+			/* wait out anyone who may have just read the old one */
+			while (DKIMF_CONF_LOAD(conf_readers) != 0)
+				(void) sched_yield();
+
+			dkimf_config_release(old);
+
+#ifdef _FFR_RATE_LIMIT
+			/* FlowData may have just been turned on */
+			if (new->conf_flowdatadb != NULL)
+			{
+				int status;
+
+				status = dkimf_rate_init(new->conf_flowcheckpoint);
+				if (status != 0 && new->conf_dolog)
+				{
+					syslog(LOG_ERR,
+					       "can't start flow data checkpoint thread: %s",
+					       strerror(status));
+				}
+			}
+#endif /* _FFR_RATE_LIMIT */
 
 			if (new->conf_dolog)
 			{
@@ -8929,8 +9721,6 @@ dkimf_config_reload(void)
 
 	reload = FALSE;
 
-	pthread_mutex_unlock(&conf_lock);
-
 	return;
 }
 
@@ -9068,6 +9858,10 @@ dkimf_sendprogress(const void *ctx)
 		{
 			if (testmode)
 				(void) dkimf_test_progress((SMFICTX *) ctx);
+#ifdef _FFR_EVENT_ENGINE
+			else if (eventengine)
+				(void) dkimf_engine_progress((SMFICTX *) ctx);
+#endif /* _FFR_EVENT_ENGINE */
 #ifdef HAVE_SMFI_PROGRESS
 			else
 				(void) smfi_progress((SMFICTX *) ctx);
@@ -9198,1752 +9992,3067 @@ dkimf_log_ssl_errors(DKIM *dkim, DKIM_SIGINFO *sig, char *jobid)
 }
 
 /*
-**  DKIMF_CLEANUP -- release local resources related to a message
+**  DKIMF_TRACE_NOW -- read the monotonic clock for tracing
 **
 **  Parameters:
-**  	ctx -- milter context
+**  	None.
 **
 **  Return value:
-**  	None.
+**  	Microseconds since an arbitrary fixed point.
 */
 
-static void
-dkimf_cleanup(SMFICTX *ctx)
+static uint64_t
+dkimf_trace_now(void)
 {
-	msgctx dfc;
-	connctx cc;
-
-	assert(ctx != NULL);
-
-	cc = (connctx) dkimf_getpriv(ctx);
-
-	if (cc == NULL)
-		return;
-
-	dfc = cc->cctx_msg;
+	struct timespec ts;
 
-	/* release memory, reset state */
-	if (dfc != NULL)
-	{
-		if (dfc->mctx_hqhead != NULL)
-		{
-			Header hdr;
-			Header prev;
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
 
-			hdr = dfc->mctx_hqhead;
-			while (hdr != NULL)
-			{
-				TRYFREE(hdr->hdr_hdr);
-				TRYFREE(hdr->hdr_val);
-				prev = hdr;
-				hdr = hdr->hdr_next;
-				TRYFREE(prev);
-			}
-		}
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-		if (dfc->mctx_rcptlist != NULL)
-		{
-			struct addrlist *addr;
-			struct addrlist *next;
+#ifdef USE_LUA
+/*
+**  DKIMF_TRACE_START -- read the clock if a message is being traced
+**
+**  Parameters:
+**  	cc -- connection context
+**
+**  Return value:
+**  	As dkimf_trace_now() if the connection's current message is being
+**  	traced, else 0.
+*/
 
-			addr = dfc->mctx_rcptlist;
-			while (addr != NULL)
-			{
-				next = addr->a_next;
+static uint64_t
+dkimf_trace_start(connctx cc)
+{
+	if (cc == NULL || !cc->cctx_trace.tr_active)
+		return 0;
 
-				TRYFREE(addr->a_addr);
-				TRYFREE(addr);
+	return dkimf_trace_now();
+}
+#endif /* USE_LUA */
 
-				addr = next;
-			}
-		}
+/*
+**  DKIMF_TRACE_ADD -- charge time to a stage of the current message's trace
+**
+**  Parameters:
+**  	cc -- connection context
+**  	stage -- DKIMF_TRACE_* constant
+**  	start -- when the stage started, from dkimf_trace_now()
+**
+**  Return value:
+**  	None.
+*/
 
-		if (dfc->mctx_srhead != NULL)
-		{
-			struct signreq *sr;
-			struct signreq *next;
+static void
+dkimf_trace_add(connctx cc, int stage, uint64_t start)
+{
+	assert(stage >= 0 && stage < DKIMF_TRACE_MAX);
 
-			sr = dfc->mctx_srhead;
-			while (sr != NULL)
-			{
-				next = sr->srq_next;
+	if (cc == NULL || !cc->cctx_trace.tr_active)
+		return;
 
-				if (sr->srq_dkim != NULL)
-					dkim_free(sr->srq_dkim);
-				TRYFREE(sr->srq_keydata);
-				TRYFREE(sr->srq_domain);
-				TRYFREE(sr->srq_selector);
-				TRYFREE(sr->srq_signer);
-				TRYFREE(sr);
+	cc->cctx_trace.tr_usec[stage] += dkimf_trace_now() - start;
+	cc->cctx_trace.tr_count[stage]++;
+}
 
-				sr = next;
-			}
-		}
+/*
+**  DKIMF_TRACE_LIB -- collect library timings from a message's DKIM handles
+**
+**  Parameters:
+**  	cc -- connection context
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Must be called once per message, before the handles are freed.
+*/
 
-		if (dfc->mctx_dkimv != NULL)
-			dkim_free(dfc->mctx_dkimv);
+static void
+dkimf_trace_lib(connctx cc)
+{
+	int c;
+	u_int count;
+	uint64_t usec;
+	msgctx dfc;
+	struct signreq *sr;
+	struct dkimf_trace *tr;
+	static int stages[] =
+	{
+		DKIMF_TRACE_KEYQUERY,	DKIM_TIMING_KEYQUERY,
+		DKIMF_TRACE_CRYPTO,	DKIM_TIMING_CRYPTO
+	};
 
-#ifdef _FFR_VBR
-		if (dfc->mctx_vbr != NULL)
-			vbr_close(dfc->mctx_vbr);
+	assert(cc != NULL);
 
-		TRYFREE(dfc->mctx_vbrinfo);
-#endif /* _FFR_VBR */
+	tr = &cc->cctx_trace;
+	dfc = cc->cctx_msg;
 
-		if (dfc->mctx_tmpstr != NULL)
-			dkimf_dstring_free(dfc->mctx_tmpstr);
-#ifdef _FFR_REPUTATION
-# ifndef USE_GNUTLS
-	if (ctx->mctx_hash != NULL)
-		EVP_MD_CTX_free(ctx->mctx_hash);
-# endif /* USE_GNUTLS */
-#endif /* _FFR_REPUTATION */
+	if (!tr->tr_active || dfc == NULL)
+		return;
 
-#ifdef _FFR_STATSEXT
-		if (dfc->mctx_statsext != NULL)
+	for (c = 0; c < sizeof stages / sizeof stages[0]; c += 2)
+	{
+		if (dfc->mctx_dkimv != NULL &&
+		    dkim_gettiming(dfc->mctx_dkimv, stages[c + 1],
+		                   &usec, &count) == DKIM_STAT_OK)
 		{
-			struct statsext *cur;
-			struct statsext *next;
-
-			cur = dfc->mctx_statsext;
-			while (cur != NULL)
-			{
-				next = cur->se_next;
-	
-				free(cur);
-
-				cur = next;
-			}
+			tr->tr_usec[stages[c]] += usec;
+			tr->tr_count[stages[c]] += count;
 		}
-#endif /* _FFR_STATSEXT */
 
-#ifdef USE_LUA
-		if (dfc->mctx_luaglobalh != NULL)
+		for (sr = dfc->mctx_srhead; sr != NULL; sr = sr->srq_next)
 		{
-			struct lua_global *cur;
-			struct lua_global *next;
-
-			cur = dfc->mctx_luaglobalh;
-			while (cur != NULL)
+			if (sr->srq_dkim != NULL &&
+			    dkim_gettiming(sr->srq_dkim, stages[c + 1],
+			                   &usec, &count) == DKIM_STAT_OK)
 			{
-				next = cur->lg_next;
-
-				if (cur->lg_type == LUA_TNUMBER ||
-				    cur->lg_type == LUA_TSTRING)
-					free(cur->lg_value);
-
-				free(cur);
-
-				cur = next;
+				tr->tr_usec[stages[c]] += usec;
+				tr->tr_count[stages[c]] += count;
 			}
 		}
-#endif /* USE_LUA */
-
-		free(dfc);
-		cc->cctx_msg = NULL;
 	}
 }
 
+#ifdef _FFR_METRICS
 /*
-**  DKIMF_MILTERCODE -- apply an internal result code to libmilter
+**  DKIMF_METRICS_HANDLE -- feed one library handle's timings to the metrics
 **
 **  Parameters:
-**  	ctx -- milter context
-**  	dmc -- DKIMF_MILTER_* code
-**  	str -- quarantine string (optional)
+**  	dkim -- DKIM handle
+**  	crypto -- DKIMF_MET_H_* histogram for its crypto time
 **
 **  Return value:
-**  	An SMFIS_* constant.
+**  	None.
 */
 
-sfsistat
-dkimf_miltercode(SMFICTX *ctx, int dmc, char *str)
+static void
+dkimf_metrics_handle(DKIM *dkim, int crypto)
 {
-	assert(ctx != NULL);
-
-	switch (dmc)
-	{
-	  case DKIMF_MILTER_ACCEPT:
-		return SMFIS_ACCEPT;
+	u_int count;
+	ssize_t canonlen;
+	uint64_t usec;
+	DKIM_SIGINFO *sig;
 
-	  case DKIMF_MILTER_DISCARD:
-		return SMFIS_DISCARD;
+	if (dkim == NULL)
+		return;
 
-	  case DKIMF_MILTER_QUARANTINE:
-		(void) dkimf_quarantine(ctx, str == NULL ? progname : str);
-		return SMFIS_ACCEPT;
+	if (dkim_gettiming(dkim, DKIM_TIMING_KEYQUERY,
+	                   &usec, &count) == DKIM_STAT_OK && count > 0)
+	{
+		dkimf_metrics_count(DKIMF_MET_KEYQUERIES, count);
+		dkimf_metrics_observe(DKIMF_MET_H_KEYQUERY, usec);
+	}
 
-	  case DKIMF_MILTER_REJECT:
-		return SMFIS_REJECT;
+	if (dkim_gettiming(dkim, DKIM_TIMING_KEYTIMEOUT,
+	                   &usec, &count) == DKIM_STAT_OK && count > 0)
+		dkimf_metrics_count(DKIMF_MET_KEYTIMEOUTS, count);
 
-	  case DKIMF_MILTER_TEMPFAIL:
-		return SMFIS_TEMPFAIL;
-	}
+	if (dkim_gettiming(dkim, DKIM_TIMING_CRYPTO,
+	                   &usec, &count) == DKIM_STAT_OK && count > 0)
+		dkimf_metrics_observe(crypto, usec);
 
-	/* NOTREACHED */
-	return SMFIS_ACCEPT;
+	sig = dkim_getsignature(dkim);
+	if (sig != NULL &&
+	    dkim_sig_getcanonlen(dkim, sig, NULL, &canonlen,
+	                         NULL) == DKIM_STAT_OK && canonlen > 0)
+		dkimf_metrics_count(DKIMF_MET_BODYBYTES, canonlen);
 }
 
 /*
-**  DKIMF_LIBSTATUS -- process a final status returned from libopendkim
+**  DKIMF_METRICS_MSG -- feed a finished message to the metrics
 **
 **  Parameters:
-**  	ctx -- milter context
-**  	dkim -- DKIM handle producing the status
-**  	where -- what function reported the error
-**  	status -- status returned by a libdk call (DKIM_STAT_*)
+**  	cc -- connection context
 **
 **  Return value:
-**   	An smfistat value to be returned to libmilter.
+**  	None.
+**
+**  Notes:
+**  	Messages are counted by result only if they reached end-of-message;
+**  	library timings are collected either way.
 */
 
-static sfsistat
-dkimf_libstatus(SMFICTX *ctx, DKIM *dkim, char *where, int status)
+static void
+dkimf_metrics_msg(connctx cc)
 {
-	int retcode = SMFIS_CONTINUE;
+	int result;
 	msgctx dfc;
-	connctx cc;
-	DKIM_SIGINFO *sig;
-	char *rcode = NULL;
-	char *xcode = NULL;
-	char *replytxt = NULL;
-	struct dkimf_config *conf;
-	u_char smtpprefix[BUFRSZ];
+	struct signreq *sr;
 
-	assert(ctx != NULL);
-
-	cc = dkimf_getpriv(ctx);
 	assert(cc != NULL);
+
 	dfc = cc->cctx_msg;
-	assert(dfc != NULL);
-	conf = cc->cctx_config;
+	if (dfc == NULL || !dkimf_metrics_enabled())
+		return;
 
-	memset(smtpprefix, '\0', sizeof smtpprefix);
+	dkimf_metrics_handle(dfc->mctx_dkimv, DKIMF_MET_H_VERIFY);
+	for (sr = dfc->mctx_srhead; sr != NULL; sr = sr->srq_next)
+		dkimf_metrics_handle(sr->srq_dkim, DKIMF_MET_H_SIGN);
 
-	switch (status)
-	{
-	  case DKIM_STAT_OK:
-		retcode = SMFIS_CONTINUE;
-		break;
+	if (!dfc->mctx_eom)
+		return;
 
-	  case DKIM_STAT_INTERNAL:
-		retcode = dkimf_miltercode(ctx,
-		                           conf->conf_handling.hndl_internal,
-		                           NULL);
-		if (conf->conf_capture)
-			dfc->mctx_capture = TRUE;
-		if (conf->conf_dolog)
+	if (dfc->mctx_srhead != NULL)
+		dkimf_metrics_count(DKIMF_MET_SIGNED, 1);
+
+	if (dfc->mctx_dkimv != NULL)
+	{
+		switch (dfc->mctx_status)
 		{
-			const char *err = NULL;
-			const char *sslerr = NULL;
+		  case DKIMF_STATUS_GOOD:
+			result = DKIMF_MET_PASS;
+			break;
 
-			if (dkim != NULL)
-				err = dkim_geterror(dkim);
-			if (err == NULL)
-				err = strerror(errno);
-			sslerr = dkim_getsslbuf(dkim);
+		  case DKIMF_STATUS_BAD:
+			result = DKIMF_MET_FAIL;
+			break;
 
-			syslog(LOG_ERR,
-			       "%s: %s%sinternal error from libopendkim: %s%s%s",
-			       JOBID(dfc->mctx_jobid),
-			       where == NULL ? "" : where,
-			       where == NULL ? "" : ": ", err,
-			       sslerr == NULL ? "" : " ",
-			       sslerr == NULL ? "" : sslerr);
+		  case DKIMF_STATUS_NOKEY:
+			result = DKIMF_MET_NOKEY;
+			break;
+
+		  case DKIMF_STATUS_REVOKED:
+			result = DKIMF_MET_REVOKED;
+			break;
+
+		  case DKIMF_STATUS_NOSIGNATURE:
+			result = DKIMF_MET_NOSIG;
+			break;
+
+		  case DKIMF_STATUS_BADFORMAT:
+			result = DKIMF_MET_BADFORMAT;
+			break;
+
+		  default:
+			result = DKIMF_MET_OTHER;
+			break;
 		}
-		replytxt = "internal DKIM error";
-		break;
 
-	  case DKIM_STAT_BADSIG:
-		assert(dkim != NULL);
-		retcode = dkimf_miltercode(ctx,
-		                           conf->conf_handling.hndl_badsig,
-		                           NULL);
-		if (conf->conf_dolog)
+		dkimf_metrics_count(result, 1);
+	}
+}
+
+/*
+**  DKIMF_METRICS_EXTRA -- add filter-wide metrics to a scrape
+**
+**  Parameters:
+**  	out -- string to which to write
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_metrics_extra(struct dkimf_dstring *out)
+{
+	u_int b_lookups = 0;
+	u_int b_hits = 0;
+	u_int b_entries = 0;
+	DKIM_STAT bstatus = DKIM_STAT_INVALID;
+	struct dkimf_config *conf;
+# ifdef QUERY_CACHE
+	u_int c_hits = 0;
+	u_int c_queries = 0;
+	u_int c_expired = 0;
+	u_int c_keys = 0;
+# endif /* QUERY_CACHE */
+
+	conf = NULL;
+	if (DKIMF_CONF_LOAD(curconf) != NULL)
+		conf = dkimf_config_acquire();
+
+	if (conf != NULL && conf->conf_libopendkim != NULL)
+	{
+# ifdef QUERY_CACHE
+		if (querycache)
 		{
-			syslog(LOG_NOTICE, "%s: bad signature data",
-			       JOBID(dfc->mctx_jobid));
+			(void) dkim_getcachestats(conf->conf_libopendkim,
+			                          &c_queries, &c_hits,
+			                          &c_expired, &c_keys, FALSE);
 		}
-		replytxt = "bad DKIM signature data";
+# endif /* QUERY_CACHE */
 
-		memset(smtpprefix, '\0', sizeof smtpprefix);
-		sig = dkim_getsignature(dkim);
-		(void) dkim_sig_getreportinfo(dkim, sig,
-		                              NULL, 0,
-		                              NULL, 0,
-		                              NULL, 0,
-		                              smtpprefix, sizeof smtpprefix,
-		                              NULL);
+		bstatus = dkim_getbodycachestats(conf->conf_libopendkim,
+		                                 &b_lookups, &b_hits,
+		                                 &b_entries, FALSE);
+	}
 
-		break;
+	if (conf != NULL)
+		dkimf_config_release(conf);
 
-	  case DKIM_STAT_NOSIG:
-		retcode = dkimf_miltercode(ctx,
-		                           conf->conf_handling.hndl_nosig,
-		                           NULL);
-		if (conf->conf_dolog)
+	if (bstatus == DKIM_STAT_OK)
+	{
+		dkimf_dstring_printf(out,
+		                     "# HELP opendkim_body_cache_lookups_total Body hash cache lookups.\n"
+		                     "# TYPE opendkim_body_cache_lookups_total counter\n"
+		                     "opendkim_body_cache_lookups_total %u\n"
+		                     "# HELP opendkim_body_cache_hits_total Body hash cache hits.\n"
+		                     "# TYPE opendkim_body_cache_hits_total counter\n"
+		                     "opendkim_body_cache_hits_total %u\n"
+		                     "# HELP opendkim_body_cache_entries Body hashes currently cached.\n"
+		                     "# TYPE opendkim_body_cache_entries gauge\n"
+		                     "opendkim_body_cache_entries %u\n",
+		                     b_lookups, b_hits, b_entries);
+	}
+
+# ifdef QUERY_CACHE
+	if (!querycache)
+		return;
+
+	dkimf_dstring_printf(out,
+	                     "# HELP opendkim_key_cache_queries_total Key cache lookups.\n"
+	                     "# TYPE opendkim_key_cache_queries_total counter\n"
+	                     "opendkim_key_cache_queries_total %u\n"
+	                     "# HELP opendkim_key_cache_hits_total Key cache hits.\n"
+	                     "# TYPE opendkim_key_cache_hits_total counter\n"
+	                     "opendkim_key_cache_hits_total %u\n"
+	                     "# HELP opendkim_key_cache_expired_total Key cache entries expired.\n"
+	                     "# TYPE opendkim_key_cache_expired_total counter\n"
+	                     "opendkim_key_cache_expired_total %u\n"
+	                     "# HELP opendkim_key_cache_keys Keys currently cached.\n"
+	                     "# TYPE opendkim_key_cache_keys gauge\n"
+	                     "opendkim_key_cache_keys %u\n",
+	                     c_queries, c_hits, c_expired, c_keys);
+# endif /* QUERY_CACHE */
+}
+#endif /* _FFR_METRICS */
+
+/*
+**  DKIMF_TRACE_LOG -- finish a message's trace, logging it if it was slow
+**
+**  Parameters:
+**  	cc -- connection context
+**  	how -- where the message ended (a stage name, or "abort")
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	The threshold is compared to the time spent inside the filter's
+**  	callbacks; "elapsed" also counts time spent waiting for the MTA.
+**  	Connection and HELO time is reported with the first message on
+**  	a connection only.
+*/
+
+static void
+dkimf_trace_log(connctx cc, const char *how)
+{
+	int c;
+	uint64_t filter = 0;
+	uint64_t elapsed;
+	struct dkimf_trace *tr;
+	struct dkimf_config *conf;
+	char timings[BUFRSZ + 1];
+	char tmp[BUFRSZ + 1];
+
+	assert(cc != NULL);
+	assert(how != NULL);
+
+	tr = &cc->cctx_trace;
+	conf = cc->cctx_config;
+
+	if (!tr->tr_active)
+		return;
+
+	dkimf_trace_lib(cc);
+
+	tr->tr_active = FALSE;
+	tr->tr_usec[DKIMF_TRACE_DB] = tr->tr_db.dbt_usec;
+	tr->tr_count[DKIMF_TRACE_DB] = tr->tr_db.dbt_count;
+
+	for (c = DKIMF_TRACE_CONNECT; c <= DKIMF_TRACE_EOM; c++)
+		filter += tr->tr_usec[c];
+
+	elapsed = dkimf_trace_now() - tr->tr_start;
+
+	if (DKIMF_TRACING(conf) &&
+	    filter >= (uint64_t) conf->conf_tracethresh * 1000)
+	{
+		timings[0] = '\0';
+		for (c = 0; c < DKIMF_TRACE_MAX; c++)
 		{
-			if (conf->conf_logwhy || retcode != SMFIS_ACCEPT)
+			if (tr->tr_count[c] == 0)
+				continue;
+
+			snprintf(tmp, sizeof tmp, " %s=%lu.%03lums",
+			         dkimf_trace_names[c],
+			         (u_long) (tr->tr_usec[c] / 1000),
+			         (u_long) (tr->tr_usec[c] % 1000));
+			strlcat(timings, tmp, sizeof timings);
+
+			if (tr->tr_count[c] > 1)
 			{
-				syslog(retcode == SMFIS_ACCEPT ? LOG_DEBUG
-				                               : LOG_NOTICE,
-				       "%s: no signature data",
-				       JOBID(dfc->mctx_jobid));
+				snprintf(tmp, sizeof tmp, "/%u",
+				         tr->tr_count[c]);
+				strlcat(timings, tmp, sizeof timings);
 			}
 		}
-		replytxt = "no DKIM signature data";
-		break;
 
-	  case DKIM_STAT_NORESOURCE:
-		retcode = dkimf_miltercode(ctx,
-		                           conf->conf_handling.hndl_internal,
-		                           NULL);
-		if (conf->conf_capture)
-			dfc->mctx_capture = TRUE;
-		if (conf->conf_dolog)
-		{
-			const char *err = NULL;
+		syslog(LOG_INFO,
+		       "%s: trace (%s): filter=%lu.%03lums elapsed=%lu.%03lums:%s",
+		       tr->tr_jobid[0] == '\0' ? JOBIDUNKNOWN : tr->tr_jobid,
+		       how, (u_long) (filter / 1000), (u_long) (filter % 1000),
+		       (u_long) (elapsed / 1000), (u_long) (elapsed % 1000),
+		       timings);
+	}
 
-			if (dkim != NULL)
-				err = dkim_geterror(dkim);
-			if (err == NULL)
-				err = strerror(errno);
+	tr->tr_usec[DKIMF_TRACE_CONNECT] = 0;
+	tr->tr_count[DKIMF_TRACE_CONNECT] = 0;
+	tr->tr_usec[DKIMF_TRACE_HELO] = 0;
+	tr->tr_count[DKIMF_TRACE_HELO] = 0;
+}
 
-			syslog(LOG_ERR, "%s: %s%sresource unavailable: %s",
-			       JOBID(dfc->mctx_jobid),
-			       where == NULL ? "" : where,
-			       where == NULL ? "" : ": ", err);
-		}
-		replytxt = "resource unavailable";
-		break;
+/*
+**  DKIMF_CLEANUP -- release local resources related to a message
+**
+**  Parameters:
+**  	ctx -- milter context
+**
+**  Return value:
+**  	None.
+*/
 
-	  case DKIM_STAT_CANTVRFY:
-		retcode = dkimf_miltercode(ctx,
-		                           conf->conf_handling.hndl_badsig,
-		                           NULL);
-		if (conf->conf_dolog && dkim != NULL)
-		{
-			const char *err = NULL;
-			err = dkim_geterror(dkim);
-			if (err == NULL)
-				err = "unknown cause";
+static void
+dkimf_cleanup(SMFICTX *ctx)
+{
+	msgctx dfc;
+	connctx cc;
 
-			syslog(LOG_ERR, "%s: signature processing failed: %s",
-				JOBID(dfc->mctx_jobid), err);
-		}
-		replytxt = "DKIM signature processing failed";
-		break;
+	assert(ctx != NULL);
 
-	  case DKIM_STAT_REVOKED:
-		retcode = dkimf_miltercode(ctx,
-		                           conf->conf_handling.hndl_badsig,
-		                           NULL);
-		if (conf->conf_dolog)
+	cc = (connctx) dkimf_getpriv(ctx);
+
+	if (cc == NULL)
+		return;
+
+	dfc = cc->cctx_msg;
+
+	/* the library timings go away with the handles */
+	dkimf_trace_lib(cc);
+#ifdef _FFR_METRICS
+	dkimf_metrics_msg(cc);
+#endif /* _FFR_METRICS */
+
+	/* release memory, reset state */
+	if (dfc != NULL)
+	{
+		if (dfc->mctx_hqhead != NULL)
 		{
-			u_char *selector = NULL;
-			u_char *domain = NULL;
-			u_char *algorithm = NULL;
-			DKIM_SIGINFO *sig;
+			Header hdr;
+			Header prev;
 
-			sig = dkim_getsignature(dkim);
-			if (sig != NULL)
+			hdr = dfc->mctx_hqhead;
+			while (hdr != NULL)
 			{
-				selector = dkim_sig_getselector(sig);
-				domain = dkim_sig_getdomain(sig);
-				algorithm = dkim_sig_getalgorithm(sig);
+				TRYFREE(hdr->hdr_hdr);
+				TRYFREE(hdr->hdr_val);
+				prev = hdr;
+				hdr = hdr->hdr_next;
+				TRYFREE(prev);
 			}
+		}
 
-			if (selector != NULL && domain != NULL)
+		if (dfc->mctx_rcptlist != NULL)
+		{
+			struct addrlist *addr;
+			struct addrlist *next;
+
+			addr = dfc->mctx_rcptlist;
+			while (addr != NULL)
 			{
-				syslog(LOG_NOTICE,
-				       "%s: key revoked (s=%s, d=%s, a=%s)",
-				       JOBID(dfc->mctx_jobid), selector,
-				       domain, algorithm);
+				next = addr->a_next;
+
+				TRYFREE(addr->a_addr);
+				TRYFREE(addr);
+
+				addr = next;
 			}
 		}
-		break;
 
-	  case DKIM_STAT_KEYFAIL:
-	  case DKIM_STAT_NOKEY:
-		if (status == DKIM_STAT_KEYFAIL)
-		{
-			retcode = dkimf_miltercode(ctx,
-			                           conf->conf_handling.hndl_dnserr,
-			                           NULL);
-		}
-		else
-		{
-			retcode = dkimf_miltercode(ctx,
-			                           conf->conf_handling.hndl_nokey,
-			                           NULL);
-		}
-
-		if (conf->conf_dolog)
+		if (dfc->mctx_srhead != NULL)
 		{
-			const char *err = NULL;
-			u_char *selector = NULL;
-			u_char *domain = NULL;
-			DKIM_SIGINFO *sig;
-
-			err = dkim_geterror(dkim);
+			struct signreq *sr;
+			struct signreq *next;
 
-			sig = dkim_getsignature(dkim);
-			if (sig != NULL)
+			sr = dfc->mctx_srhead;
+			while (sr != NULL)
 			{
-				selector = dkim_sig_getselector(sig);
-				domain = dkim_sig_getdomain(sig);
-			}
+				next = sr->srq_next;
 
-			if (selector != NULL && domain != NULL)
-			{
-				syslog(LOG_ERR,
-				       "%s: key retrieval failed (s=%s, d=%s)%s%s",
-				       JOBID(dfc->mctx_jobid), selector,
-				       domain,
-				       err == NULL ? "" : ": ",
-				       err == NULL ? "" : err);
-			}
-			else
-			{
-				syslog(LOG_ERR, "%s: key retrieval failed%s%s",
-				       JOBID(dfc->mctx_jobid),
-				       err == NULL ? "" : ": ",
-				       err == NULL ? "" : err);
+				if (sr->srq_dkim != NULL)
+					dkim_free(sr->srq_dkim);
+				TRYFREE(sr->srq_keydata);
+				TRYFREE(sr->srq_domain);
+				TRYFREE(sr->srq_selector);
+				TRYFREE(sr->srq_signer);
+				TRYFREE(sr);
+
+				sr = next;
 			}
 		}
-		replytxt = "DKIM key retrieval failed";
-		break;
 
-	  case DKIM_STAT_SYNTAX:
-		retcode = dkimf_miltercode(ctx,
-		                           conf->conf_handling.hndl_badsig,
-		                           NULL);
-		if (conf->conf_dolog)
-		{
-			const char *err = NULL;
+		if (dfc->mctx_dkimv != NULL)
+			dkim_free(dfc->mctx_dkimv);
 
-			if (dkim != NULL)
-				err = dkim_geterror(dkim);
-			if (err == NULL)
-				err = "unspecified";
+#ifdef _FFR_VBR
+		if (dfc->mctx_vbr != NULL)
+			vbr_close(dfc->mctx_vbr);
 
-			syslog(LOG_ERR, "%s: syntax error: %s",
-			       JOBID(dfc->mctx_jobid), err);
-		}
-		replytxt = "DKIM signature syntax error";
-		break;
+		TRYFREE(dfc->mctx_vbrinfo);
+#endif /* _FFR_VBR */
 
-	  case DKIM_STAT_SIGGEN:
-		retcode = dkimf_miltercode(ctx,
-		                           conf->conf_handling.hndl_siggen,
-		                           NULL);
+		if (dfc->mctx_tmpstr != NULL)
+			dkimf_dstring_free(dfc->mctx_tmpstr);
+#ifdef _FFR_REPUTATION
+# ifndef USE_GNUTLS
+	if (ctx->mctx_hash != NULL)
+		EVP_MD_CTX_free(ctx->mctx_hash);
+# endif /* USE_GNUTLS */
+#endif /* _FFR_REPUTATION */
 
-		if (conf->conf_dolog)
+#ifdef _FFR_STATSEXT
+		if (dfc->mctx_statsext != NULL)
 		{
-			const char *err = NULL;
+			struct statsext *cur;
+			struct statsext *next;
 
-			if (dkim != NULL)
-				err = dkim_geterror(dkim);
-			if (err == NULL)
-				err = "unspecified";
+			cur = dfc->mctx_statsext;
+			while (cur != NULL)
+			{
+				next = cur->se_next;
+	
+				free(cur);
 
-			syslog(LOG_ERR, "%s: signature generation error: %s",
-			       JOBID(dfc->mctx_jobid), err);
+				cur = next;
+			}
 		}
+#endif /* _FFR_STATSEXT */
 
-		replytxt = "DKIM signing error";
-		break;
-	}
-
-	switch (retcode)
-	{
-	  case SMFIS_REJECT:
-		rcode = "550";
-		xcode = "5.7.0";
-		break;
+#ifdef USE_LUA
+		if (dfc->mctx_luaglobalh != NULL)
+		{
+			struct lua_global *cur;
+			struct lua_global *next;
 
-	  case SMFIS_TEMPFAIL:
-		rcode = "451";
-		if (status == DKIM_STAT_KEYFAIL || status == DKIM_STAT_NOKEY)
-			xcode = "4.7.5";
-		else
-			xcode = "4.7.0";
-		break;
+			cur = dfc->mctx_luaglobalh;
+			while (cur != NULL)
+			{
+				next = cur->lg_next;
 
-	  default:
-		break;
-	}
+				if (cur->lg_type == LUA_TNUMBER ||
+				    cur->lg_type == LUA_TSTRING)
+					free(cur->lg_value);
 
-	if (rcode != NULL && xcode != NULL && replytxt != NULL)
-	{
-		char replybuf[BUFRSZ];
+				free(cur);
 
-		if (smtpprefix[0] == '\0')
-		{
-			strlcpy(replybuf, replytxt, sizeof replybuf);
-		}
-		else
-		{
-			snprintf(replybuf, sizeof replybuf, "%s: %s",
-			         smtpprefix, replytxt);
+				cur = next;
+			}
 		}
+#endif /* USE_LUA */
 
-		(void) dkimf_setreply(ctx, rcode, xcode, replybuf);
+		free(dfc);
+		cc->cctx_msg = NULL;
 	}
-
-	return retcode;
 }
 
 /*
-**  DKIMF_FINDHEADER -- find a header
+**  DKIMF_MILTERCODE -- apply an internal result code to libmilter
 **
 **  Parameters:
-**  	dfc -- filter context
-**  	hname -- name of the header of interest
-**  	instance -- which instance is wanted (0 = first)
+**  	ctx -- milter context
+**  	dmc -- DKIMF_MILTER_* code
+**  	str -- quarantine string (optional)
 **
 **  Return value:
-**  	Header handle, or NULL if not found.
-**
-**  Notes:
-**  	Negative values of "instance" search backwards from the end.
+**  	An SMFIS_* constant.
 */
 
-static Header
-dkimf_findheader(msgctx dfc, char *hname, int instance)
+sfsistat
+dkimf_miltercode(SMFICTX *ctx, int dmc, char *str)
 {
-	Header hdr;
+	assert(ctx != NULL);
 
-	assert(dfc != NULL);
-	assert(hname != NULL);
+	switch (dmc)
+	{
+	  case DKIMF_MILTER_ACCEPT:
+		return SMFIS_ACCEPT;
 
-	if (instance < 0)
-		hdr = dfc->mctx_hqtail;
-	else
-		hdr = dfc->mctx_hqhead;
+	  case DKIMF_MILTER_DISCARD:
+		return SMFIS_DISCARD;
 
-	while (hdr != NULL)
-	{
-		if (strcasecmp(hdr->hdr_hdr, hname) == 0)
-		{
-			if (instance == 0 || instance == -1)
-				return hdr;
-			else if (instance > 0)
-				instance--;
-			else
-				instance++;
-		}
+	  case DKIMF_MILTER_QUARANTINE:
+		(void) dkimf_quarantine(ctx, str == NULL ? progname : str);
+		return SMFIS_ACCEPT;
 
-		if (instance < 0)
-			hdr = hdr->hdr_prev;
-		else
-			hdr = hdr->hdr_next;
+	  case DKIMF_MILTER_REJECT:
+		return SMFIS_REJECT;
+
+	  case DKIMF_MILTER_TEMPFAIL:
+		return SMFIS_TEMPFAIL;
 	}
 
-	return NULL;
+	/* NOTREACHED */
+	return SMFIS_ACCEPT;
 }
 
 /*
-**  DKIMF_APPLY_SIGNTABLE -- apply the signing table to a message
+**  DKIMF_LIBSTATUS -- process a final status returned from libopendkim
 **
 **  Parameters:
-**  	dfc -- message context
-**  	keydb -- database handle for key table
-**  	signdb -- database handle for signing table
-**  	user -- userid (local-part)
-**  	domain -- domain
-**  	errkey -- where to write the name of a key that failed
-**  	errlen -- bytes available at "errkey"
-**  	multisig -- apply multiple signature logic
+**  	ctx -- milter context
+**  	dkim -- DKIM handle producing the status
+**  	where -- what function reported the error
+**  	status -- status returned by a libdk call (DKIM_STAT_*)
 **
 **  Return value:
-**  	>= 0 -- number of signatures added
-** 	-1 -- signing table read error
-**  	-2 -- unknown key
-**  	-3 -- key load error
+**   	An smfistat value to be returned to libmilter.
 */
 
-static int
-dkimf_apply_signtable(struct msgctx *dfc, DKIMF_DB keydb, DKIMF_DB signdb,
-                      unsigned char *user, unsigned char *domain, char *errkey,
-                      size_t errlen, _Bool multisig)
+static sfsistat
+dkimf_libstatus(SMFICTX *ctx, DKIM *dkim, char *where, int status)
 {
-	_Bool found;
-	int nfound = 0;
-	char keyname[BUFRSZ + 1];
-	u_char tmp[BUFRSZ + 1];
-
-	assert(dfc != NULL);
-	assert(keydb != NULL);
-	assert(signdb != NULL);
-	assert(user != NULL);
-	assert(domain != NULL);
-
-	if (dkimf_db_type(signdb) == DKIMF_DB_TYPE_REFILE)
-	{
-		int status;
-		void *ctx = NULL;
-		struct dkimf_db_data dbd[2];
-		char addr[MAXADDRESS + 1];
-		u_char signer[MAXADDRESS + 1];
-
-		snprintf(addr, sizeof addr, "%s@%s", user, domain);
-
-		memset(&dbd, '\0', sizeof dbd);
-		dbd[0].dbdata_buffer = keyname;
-		dbd[1].dbdata_buffer = (char *) signer;
-		dbd[1].dbdata_flags = DKIMF_DB_DATA_OPTIONAL;
-
-		/* walk RE set, find match(es), make request(s) */
-		for (;;)
-		{
-			memset(keyname, '\0', sizeof keyname);
-			dbd[0].dbdata_buflen = sizeof keyname - 1;
-			memset(signer, '\0', sizeof signer);
-			dbd[1].dbdata_buflen = sizeof signer - 1;
-
-			status = dkimf_db_rewalk(signdb, addr, dbd, 2, &ctx);
-			if (status == -1)
-				return -1;
-			else if (status == 1)
-				break;
+	int retcode = SMFIS_CONTINUE;
+	msgctx dfc;
+	connctx cc;
+	DKIM_SIGINFO *sig;
+	char *rcode = NULL;
+	char *xcode = NULL;
+	char *replytxt = NULL;
+	struct dkimf_config *conf;
+	u_char smtpprefix[BUFRSZ];
 
-			if (keyname[0] == '%' && keyname[1] == '\0')
-				strlcpy(keyname, domain, sizeof keyname);
+	assert(ctx != NULL);
 
-			dkimf_reptoken(tmp, sizeof tmp, signer, domain);
-			status = dkimf_add_signrequest(dfc, keydb, keyname,
-			                               (char *) tmp,
-			                               (ssize_t) -1);
-			if (status != 0 && errkey != NULL)
-				strlcpy(errkey, keyname, errlen);
-			if (status == 1)
-				return -2;
-			else if (status == 2 || status == 3 || status == -1)
-				return -3;
+	cc = dkimf_getpriv(ctx);
+	assert(cc != NULL);
+	dfc = cc->cctx_msg;
+	assert(dfc != NULL);
+	conf = cc->cctx_config;
 
-			nfound++;
+	memset(smtpprefix, '\0', sizeof smtpprefix);
 
-			if (!multisig)
-				return nfound;
-		}
-	}
-	else
+	switch (status)
 	{
-		int status;
-		char *p;
-		char tmpaddr[MAXADDRESS + 1];
-		u_char signer[MAXADDRESS + 1];
-		struct dkimf_db_data req[2];
+	  case DKIM_STAT_OK:
+		retcode = SMFIS_CONTINUE;
+		break;
 
-		memset(&req, '\0', sizeof req);
+	  case DKIM_STAT_INTERNAL:
+		retcode = dkimf_miltercode(ctx,
+		                           conf->conf_handling.hndl_internal,
+		                           NULL);
+		if (conf->conf_capture)
+			dfc->mctx_capture = TRUE;
+		if (conf->conf_dolog)
+		{
+			const char *err = NULL;
+			const char *sslerr = NULL;
 
-		memset(keyname, '\0', sizeof keyname);
-		memset(signer, '\0', sizeof signer);
-		req[0].dbdata_buffer = keyname;
-		req[0].dbdata_buflen = sizeof keyname - 1;
-		req[1].dbdata_buffer = (char *) signer;
-		req[1].dbdata_buflen = sizeof signer - 1;
-		req[1].dbdata_flags = DKIMF_DB_DATA_OPTIONAL;
+			if (dkim != NULL)
+				err = dkim_geterror(dkim);
+			if (err == NULL)
+				err = strerror(errno);
+			sslerr = dkim_getsslbuf(dkim);
 
-		/* first try full "user@host" */
-		snprintf(tmpaddr, sizeof tmpaddr, "%s@%s", user, domain);
+			syslog(LOG_ERR,
+			       "%s: %s%sinternal error from libopendkim: %s%s%s",
+			       JOBID(dfc->mctx_jobid),
+			       where == NULL ? "" : where,
+			       where == NULL ? "" : ": ", err,
+			       sslerr == NULL ? "" : " ",
+			       sslerr == NULL ? "" : sslerr);
+		}
+		replytxt = "internal DKIM error";
+		break;
 
-		found = FALSE;
-		status = dkimf_db_get(signdb, tmpaddr, strlen(tmpaddr),
-		                      req, 2, &found);
-		if (status != 0 ||
-		    (found && (req[0].dbdata_buflen == 0 ||
-		               req[0].dbdata_buflen == (size_t) -1)))
+	  case DKIM_STAT_BADSIG:
+		assert(dkim != NULL);
+		retcode = dkimf_miltercode(ctx,
+		                           conf->conf_handling.hndl_badsig,
+		                           NULL);
+		if (conf->conf_dolog)
 		{
-			if (status != 0 && dolog)
-				dkimf_db_error(signdb, tmpaddr);
-			return -1;
+			syslog(LOG_NOTICE, "%s: bad signature data",
+			       JOBID(dfc->mctx_jobid));
 		}
-		else if (found)
-		{
-			if (keyname[0] == '%' && keyname[1] == '\0')
-				strlcpy(keyname, domain, sizeof keyname);
-
-			dkimf_reptoken(tmp, sizeof tmp, signer, domain);
-
-			status = dkimf_add_signrequest(dfc, keydb, keyname,
-			                               (char *) tmp,
-			                               (ssize_t) -1);
-			if (status != 0 && errkey != NULL)
-				strlcpy(errkey, keyname, errlen);
-			if (status == 1)
-				return -2;
-			else if (status == 2 || status == 3 || status == -1)
-				return -3;
+		replytxt = "bad DKIM signature data";
 
-			nfound++;
+		memset(smtpprefix, '\0', sizeof smtpprefix);
+		sig = dkim_getsignature(dkim);
+		(void) dkim_sig_getreportinfo(dkim, sig,
+		                              NULL, 0,
+		                              NULL, 0,
+		                              NULL, 0,
+		                              smtpprefix, sizeof smtpprefix,
+		                              NULL);
 
-			if (!multisig)
-				return nfound;
-		}
+		break;
 
-		/* now just "host" */
-		found = FALSE;
-		req[0].dbdata_buflen = sizeof keyname - 1;
-		req[1].dbdata_buflen = sizeof signer - 1;
-		memset(keyname, '\0', sizeof keyname);
-		memset(signer, '\0', sizeof signer);
-		status = dkimf_db_get(signdb, domain, strlen((char *) domain),
-		                      req, 2, &found);
-		if (status != 0 ||
-		    (found && (req[0].dbdata_buflen == 0 ||
-		               req[0].dbdata_buflen == (size_t) -1)))
+	  case DKIM_STAT_NOSIG:
+		retcode = dkimf_miltercode(ctx,
+		                           conf->conf_handling.hndl_nosig,
+		                           NULL);
+		if (conf->conf_dolog)
 		{
-			if (status != 0 && dolog)
-				dkimf_db_error(signdb, (char *) domain);
-			return -1;
+			if (conf->conf_logwhy || retcode != SMFIS_ACCEPT)
+			{
+				syslog(retcode == SMFIS_ACCEPT ? LOG_DEBUG
+				                               : LOG_NOTICE,
+				       "%s: no signature data",
+				       JOBID(dfc->mctx_jobid));
+			}
 		}
-		else if (found)
+		replytxt = "no DKIM signature data";
+		break;
+
+	  case DKIM_STAT_NORESOURCE:
+		retcode = dkimf_miltercode(ctx,
+		                           conf->conf_handling.hndl_internal,
+		                           NULL);
+		if (conf->conf_capture)
+			dfc->mctx_capture = TRUE;
+		if (conf->conf_dolog)
 		{
-			if (keyname[0] == '%' && keyname[1] == '\0')
-				strlcpy(keyname, domain, sizeof keyname);
+			const char *err = NULL;
 
-			dkimf_reptoken(tmp, sizeof tmp, signer, domain);
+			if (dkim != NULL)
+				err = dkim_geterror(dkim);
+			if (err == NULL)
+				err = strerror(errno);
 
-			status = dkimf_add_signrequest(dfc, keydb, keyname,
-			                               (char *) tmp,
-			                               (ssize_t) -1);
-			if (status != 0 && errkey != NULL)
-				strlcpy(errkey, keyname, errlen);
-			if (status == 1)
-				return -2;
-			else if (status == 2 || status == 3 || status == -1)
-				return -3;
+			syslog(LOG_ERR, "%s: %s%sresource unavailable: %s",
+			       JOBID(dfc->mctx_jobid),
+			       where == NULL ? "" : where,
+			       where == NULL ? "" : ": ", err);
+		}
+		replytxt = "resource unavailable";
+		break;
 
-			nfound++;
+	  case DKIM_STAT_CANTVRFY:
+		retcode = dkimf_miltercode(ctx,
+		                           conf->conf_handling.hndl_badsig,
+		                           NULL);
+		if (conf->conf_dolog && dkim != NULL)
+		{
+			const char *err = NULL;
+			err = dkim_geterror(dkim);
+			if (err == NULL)
+				err = "unknown cause";
 
-			if (!multisig)
-				return nfound;
+			syslog(LOG_ERR, "%s: signature processing failed: %s",
+				JOBID(dfc->mctx_jobid), err);
 		}
+		replytxt = "DKIM signature processing failed";
+		break;
 
-		/* next "user@.domain" and ".domain", degrading */
-		for (p = strchr((char *) domain, '.');
-		     p != NULL;
-		     p = strchr(p + 1, '.'))
+	  case DKIM_STAT_REVOKED:
+		retcode = dkimf_miltercode(ctx,
+		                           conf->conf_handling.hndl_badsig,
+		                           NULL);
+		if (conf->conf_dolog)
 		{
-			snprintf(tmpaddr, sizeof tmpaddr, "%s@%s",
-			         user, p);
+			u_char *selector = NULL;
+			u_char *domain = NULL;
+			u_char *algorithm = NULL;
+			DKIM_SIGINFO *sig;
 
-			found = FALSE;
-			req[0].dbdata_buflen = sizeof keyname - 1;
-			req[1].dbdata_buflen = sizeof signer - 1;
-			memset(keyname, '\0', sizeof keyname);
-			memset(signer, '\0', sizeof signer);
-			status = dkimf_db_get(signdb, tmpaddr, strlen(tmpaddr),
-			                      req, 2, &found);
-			if (status != 0 ||
-			    (found && (req[0].dbdata_buflen == 0 ||
-			               req[0].dbdata_buflen == (size_t) -1)))
+			sig = dkim_getsignature(dkim);
+			if (sig != NULL)
 			{
-				if (status != 0 && dolog)
-					dkimf_db_error(signdb, tmpaddr);
-				return -1;
+				selector = dkim_sig_getselector(sig);
+				domain = dkim_sig_getdomain(sig);
+				algorithm = dkim_sig_getalgorithm(sig);
 			}
-			else if (found)
+
+			if (selector != NULL && domain != NULL)
 			{
-				if (keyname[0] == '%' && keyname[1] == '\0')
-				{
-					strlcpy(keyname, domain,
-					        sizeof keyname);
-				}
+				syslog(LOG_NOTICE,
+				       "%s: key revoked (s=%s, d=%s, a=%s)",
+				       JOBID(dfc->mctx_jobid), selector,
+				       domain, algorithm);
+			}
+		}
+		break;
 
-				dkimf_reptoken(tmp, sizeof tmp, signer,
-				               domain);
+	  case DKIM_STAT_KEYFAIL:
+	  case DKIM_STAT_NOKEY:
+		if (status == DKIM_STAT_KEYFAIL)
+		{
+			retcode = dkimf_miltercode(ctx,
+			                           conf->conf_handling.hndl_dnserr,
+			                           NULL);
+		}
+		else
+		{
+			retcode = dkimf_miltercode(ctx,
+			                           conf->conf_handling.hndl_nokey,
+			                           NULL);
+		}
 
-				status = dkimf_add_signrequest(dfc, keydb,
-				                               keyname,
-				                               (char *) tmp,
-				                               (ssize_t) -1);
-				if (status != 0 && errkey != NULL)
-					strlcpy(errkey, keyname, errlen);
-				if (status == 1)
-					return -2;
-				else if (status == 2 || status == 3 ||
-				         status == -1)
-					return -3;
+		if (conf->conf_dolog)
+		{
+			const char *err = NULL;
+			u_char *selector = NULL;
+			u_char *domain = NULL;
+			DKIM_SIGINFO *sig;
 
-				nfound++;
+			err = dkim_geterror(dkim);
 
-				if (!multisig)
-					return nfound;
+			sig = dkim_getsignature(dkim);
+			if (sig != NULL)
+			{
+				selector = dkim_sig_getselector(sig);
+				domain = dkim_sig_getdomain(sig);
 			}
 
-			found = FALSE;
-			req[0].dbdata_buflen = sizeof keyname - 1;
-			req[1].dbdata_buflen = sizeof signer - 1;
-			memset(keyname, '\0', sizeof keyname);
-			memset(signer, '\0', sizeof signer);
-			status = dkimf_db_get(signdb, p, strlen(p),
-			                      req, 2, &found);
-			if (status != 0 ||
-			    (found && (req[0].dbdata_buflen == 0 ||
-			               req[0].dbdata_buflen == (size_t) -1)))
+			if (selector != NULL && domain != NULL)
 			{
-				if (status != 0 && dolog)
-					dkimf_db_error(signdb, p);
-				return -1;
+				syslog(LOG_ERR,
+				       "%s: key retrieval failed (s=%s, d=%s)%s%s",
+				       JOBID(dfc->mctx_jobid), selector,
+				       domain,
+				       err == NULL ? "" : ": ",
+				       err == NULL ? "" : err);
 			}
-			else if (found)
+			else
 			{
-				if (keyname[0] == '%' && keyname[1] == '\0')
-				{
-					strlcpy(keyname, domain,
-					        sizeof keyname);
-				}
-
-				dkimf_reptoken(tmp, sizeof tmp, signer,
-				               domain);
+				syslog(LOG_ERR, "%s: key retrieval failed%s%s",
+				       JOBID(dfc->mctx_jobid),
+				       err == NULL ? "" : ": ",
+				       err == NULL ? "" : err);
+			}
+		}
+		replytxt = "DKIM key retrieval failed";
+		break;
 
-				status = dkimf_add_signrequest(dfc, keydb,
-				                               keyname,
-				                               (char *) tmp,
-				                               (ssize_t) -1);
-				if (status != 0 && errkey != NULL)
-					strlcpy(errkey, keyname, errlen);
-				if (status == 1)
-					return -2;
-				else if (status == 2 || status == 3 ||
-				         status == -1)
-					return -3;
+	  case DKIM_STAT_SYNTAX:
+		retcode = dkimf_miltercode(ctx,
+		                           conf->conf_handling.hndl_badsig,
+		                           NULL);
+		if (conf->conf_dolog)
+		{
+			const char *err = NULL;
 
-				nfound++;
+			if (dkim != NULL)
+				err = dkim_geterror(dkim);
+			if (err == NULL)
+				err = "unspecified";
 
-				if (!multisig)
-					return nfound;
-			}
+			syslog(LOG_ERR, "%s: syntax error: %s",
+			       JOBID(dfc->mctx_jobid), err);
 		}
+		replytxt = "DKIM signature syntax error";
+		break;
 
-		/* now "user@*" */
-		snprintf(tmpaddr, sizeof tmpaddr, "%s@*", user);
+	  case DKIM_STAT_SIGGEN:
+		retcode = dkimf_miltercode(ctx,
+		                           conf->conf_handling.hndl_siggen,
+		                           NULL);
 
-		found = FALSE;
-		req[0].dbdata_buflen = sizeof keyname - 1;
-		req[1].dbdata_buflen = sizeof signer - 1;
-		memset(keyname, '\0', sizeof keyname);
-		memset(signer, '\0', sizeof signer);
-		status = dkimf_db_get(signdb, tmpaddr, strlen(tmpaddr),
-		                      req, 2, &found);
-		if (status != 0 ||
-		    (found && (req[0].dbdata_buflen == 0 ||
-		               req[0].dbdata_buflen == (size_t) -1)))
+		if (conf->conf_dolog)
 		{
-			if (status != 0 && dolog)
-				dkimf_db_error(signdb, tmpaddr);
-			return -1;
+			const char *err = NULL;
+
+			if (dkim != NULL)
+				err = dkim_geterror(dkim);
+			if (err == NULL)
+				err = "unspecified";
+
+			syslog(LOG_ERR, "%s: signature generation error: %s",
+			       JOBID(dfc->mctx_jobid), err);
 		}
-		else if (found)
-		{
-			if (keyname[0] == '%' && keyname[1] == '\0')
-				strlcpy(keyname, domain, sizeof keyname);
 
-			dkimf_reptoken(tmp, sizeof tmp, signer, domain);
+		replytxt = "DKIM signing error";
+		break;
+	}
 
-			status = dkimf_add_signrequest(dfc, keydb, keyname,
-			                               (char *) tmp,
-			                               (ssize_t) -1);
-			if (status != 0 && errkey != NULL)
-				strlcpy(errkey, keyname, errlen);
-			if (status == 1)
-				return -2;
-			else if (status == 2 || status == 3 || status == -1)
-				return -3;
+	switch (retcode)
+	{
+	  case SMFIS_REJECT:
+		rcode = "550";
+		xcode = "5.7.0";
+		break;
 
-			nfound++;
+	  case SMFIS_TEMPFAIL:
+		rcode = "451";
+		if (status == DKIM_STAT_KEYFAIL || status == DKIM_STAT_NOKEY)
+			xcode = "4.7.5";
+		else
+			xcode = "4.7.0";
+		break;
 
-			if (!multisig)
-				return nfound;
-		}
+	  default:
+		break;
+	}
 
-		/* finally just "*" */
-		found = FALSE;
-		req[0].dbdata_buflen = sizeof keyname - 1;
-		req[1].dbdata_buflen = sizeof signer - 1;
-		memset(keyname, '\0', sizeof keyname);
-		memset(signer, '\0', sizeof signer);
-		status = dkimf_db_get(signdb, "*", 1, req, 2, &found);
-		if (status != 0 ||
-		    (found && (req[0].dbdata_buflen == 0 ||
-		               req[0].dbdata_buflen == (size_t) -1)))
+	if (rcode != NULL && xcode != NULL && replytxt != NULL)
+	{
+		char replybuf[BUFRSZ];
+
+		if (smtpprefix[0] == '\0')
 		{
-			if (status != 0 && dolog)
-				dkimf_db_error(signdb, "*");
-			return -1;
+			strlcpy(replybuf, replytxt, sizeof replybuf);
 		}
-		else if (found)
+		else
 		{
-			if (keyname[0] == '%' && keyname[1] == '\0')
-				strlcpy(keyname, domain, sizeof keyname);
+			snprintf(replybuf, sizeof replybuf, "%s: %s",
+			         smtpprefix, replytxt);
+		}
+
+		(void) dkimf_setreply(ctx, rcode, xcode, replybuf);
+	}
+
+	return retcode;
+}
+
+/*
+**  DKIMF_FINDHEADER -- find a header
+**
+**  Parameters:
+**  	dfc -- filter context
+**  	hname -- name of the header of interest
+**  	instance -- which instance is wanted (0 = first)
+**
+**  Return value:
+**  	Header handle, or NULL if not found.
+**
+**  Notes:
+**  	Negative values of "instance" search backwards from the end.
+*/
+
+static Header
+dkimf_findheader(msgctx dfc, char *hname, int instance)
+{
+	Header hdr;
+
+	assert(dfc != NULL);
+	assert(hname != NULL);
+
+	if (instance < 0)
+		hdr = dfc->mctx_hqtail;
+	else
+		hdr = dfc->mctx_hqhead;
+
+	while (hdr != NULL)
+	{
+		if (strcasecmp(hdr->hdr_hdr, hname) == 0)
+		{
+			if (instance == 0 || instance == -1)
+				return hdr;
+			else if (instance > 0)
+				instance--;
+			else
+				instance++;
+		}
+
+		if (instance < 0)
+			hdr = hdr->hdr_prev;
+		else
+			hdr = hdr->hdr_next;
+	}
+
+	return NULL;
+}
+
+/*
+**  DKIMF_APPLY_SIGNTABLE -- apply the signing table to a message
+**
+**  Parameters:
+**  	dfc -- message context
+**  	conf -- configuration handle
+**  	keydb -- database handle for key table
+**  	signdb -- database handle for signing table
+**  	user -- userid (local-part)
+**  	domain -- domain
+**  	errkey -- where to write the name of a key that failed
+**  	errlen -- bytes available at "errkey"
+**  	multisig -- apply multiple signature logic
+**
+**  Return value:
+**  	>= 0 -- number of signatures added
+** 	-1 -- signing table read error
+**  	-2 -- unknown key
+**  	-3 -- key load error
+*/
+
+static int
+dkimf_apply_signtable(struct msgctx *dfc, struct dkimf_config *conf,
+                      DKIMF_DB keydb, DKIMF_DB signdb, unsigned char *user,
+                      unsigned char *domain, char *errkey, size_t errlen,
+                      _Bool multisig)
+{
+	_Bool found;
+	int nfound = 0;
+	char keyname[BUFRSZ + 1];
+	u_char tmp[BUFRSZ + 1];
+
+	assert(dfc != NULL);
+	assert(keydb != NULL);
+	assert(signdb != NULL);
+	assert(user != NULL);
+	assert(domain != NULL);
+
+	if (dkimf_db_type(signdb) == DKIMF_DB_TYPE_REFILE)
+	{
+		int status;
+		void *ctx = NULL;
+		struct dkimf_db_data dbd[2];
+		char addr[MAXADDRESS + 1];
+		u_char signer[MAXADDRESS + 1];
+
+		snprintf(addr, sizeof addr, "%s@%s", user, domain);
+
+		memset(&dbd, '\0', sizeof dbd);
+		dbd[0].dbdata_buffer = keyname;
+		dbd[1].dbdata_buffer = (char *) signer;
+		dbd[1].dbdata_flags = DKIMF_DB_DATA_OPTIONAL;
+
+		/* walk RE set, find match(es), make request(s) */
+		for (;;)
+		{
+			memset(keyname, '\0', sizeof keyname);
+			dbd[0].dbdata_buflen = sizeof keyname - 1;
+			memset(signer, '\0', sizeof signer);
+			dbd[1].dbdata_buflen = sizeof signer - 1;
+
+			status = dkimf_db_rewalk(signdb, addr, dbd, 2, &ctx);
+			if (status == -1)
+				return -1;
+			else if (status == 1)
+				break;
+
+			if (keyname[0] == '%' && keyname[1] == '\0')
+				strlcpy(keyname, domain, sizeof keyname);
+
+			dkimf_reptoken(tmp, sizeof tmp, signer, domain);
+			status = dkimf_add_signrequest(dfc, conf, keydb, keyname,
+			                               (char *) tmp,
+			                               (ssize_t) -1);
+			if (status != 0 && errkey != NULL)
+				strlcpy(errkey, keyname, errlen);
+			if (status == 1)
+				return -2;
+			else if (status == 2 || status == 3 || status == -1)
+				return -3;
+
+			nfound++;
+
+			if (!multisig)
+				return nfound;
+		}
+	}
+	else
+	{
+		int status;
+		char *p;
+		char tmpaddr[MAXADDRESS + 1];
+		u_char signer[MAXADDRESS + 1];
+		struct dkimf_db_data req[2];
+
+		memset(&req, '\0', sizeof req);
+
+		memset(keyname, '\0', sizeof keyname);
+		memset(signer, '\0', sizeof signer);
+		req[0].dbdata_buffer = keyname;
+		req[0].dbdata_buflen = sizeof keyname - 1;
+		req[1].dbdata_buffer = (char *) signer;
+		req[1].dbdata_buflen = sizeof signer - 1;
+		req[1].dbdata_flags = DKIMF_DB_DATA_OPTIONAL;
+
+		/* first try full "user@host" */
+		snprintf(tmpaddr, sizeof tmpaddr, "%s@%s", user, domain);
+
+		found = FALSE;
+		status = dkimf_db_get(signdb, tmpaddr, strlen(tmpaddr),
+		                      req, 2, &found);
+		if (status != 0 ||
+		    (found && (req[0].dbdata_buflen == 0 ||
+		               req[0].dbdata_buflen == (size_t) -1)))
+		{
+			if (status != 0 && dolog)
+				dkimf_db_error(signdb, tmpaddr);
+			return -1;
+		}
+		else if (found)
+		{
+			if (keyname[0] == '%' && keyname[1] == '\0')
+				strlcpy(keyname, domain, sizeof keyname);
+
+			dkimf_reptoken(tmp, sizeof tmp, signer, domain);
+
+			status = dkimf_add_signrequest(dfc, conf, keydb, keyname,
+			                               (char *) tmp,
+			                               (ssize_t) -1);
+			if (status != 0 && errkey != NULL)
+				strlcpy(errkey, keyname, errlen);
+			if (status == 1)
+				return -2;
+			else if (status == 2 || status == 3 || status == -1)
+				return -3;
+
+			nfound++;
+
+			if (!multisig)
+				return nfound;
+		}
+
+		/* now just "host" */
+		found = FALSE;
+		req[0].dbdata_buflen = sizeof keyname - 1;
+		req[1].dbdata_buflen = sizeof signer - 1;
+		memset(keyname, '\0', sizeof keyname);
+		memset(signer, '\0', sizeof signer);
+		status = dkimf_db_get(signdb, domain, strlen((char *) domain),
+		                      req, 2, &found);
+		if (status != 0 ||
+		    (found && (req[0].dbdata_buflen == 0 ||
+		               req[0].dbdata_buflen == (size_t) -1)))
+		{
+			if (status != 0 && dolog)
+				dkimf_db_error(signdb, (char *) domain);
+			return -1;
+		}
+		else if (found)
+		{
+			if (keyname[0] == '%' && keyname[1] == '\0')
+				strlcpy(keyname, domain, sizeof keyname);
+
+			dkimf_reptoken(tmp, sizeof tmp, signer, domain);
+
+			status = dkimf_add_signrequest(dfc, conf, keydb, keyname,
+			                               (char *) tmp,
+			                               (ssize_t) -1);
+			if (status != 0 && errkey != NULL)
+				strlcpy(errkey, keyname, errlen);
+			if (status == 1)
+				return -2;
+			else if (status == 2 || status == 3 || status == -1)
+				return -3;
+
+			nfound++;
+
+			if (!multisig)
+				return nfound;
+		}
+
+		/* next "user@.domain" and ".domain", degrading */
+		for (p = strchr((char *) domain, '.');
+		     p != NULL;
+		     p = strchr(p + 1, '.'))
+		{
+			snprintf(tmpaddr, sizeof tmpaddr, "%s@%s",
+			         user, p);
+
+			found = FALSE;
+			req[0].dbdata_buflen = sizeof keyname - 1;
+			req[1].dbdata_buflen = sizeof signer - 1;
+			memset(keyname, '\0', sizeof keyname);
+			memset(signer, '\0', sizeof signer);
+			status = dkimf_db_get(signdb, tmpaddr, strlen(tmpaddr),
+			                      req, 2, &found);
+			if (status != 0 ||
+			    (found && (req[0].dbdata_buflen == 0 ||
+			               req[0].dbdata_buflen == (size_t) -1)))
+			{
+				if (status != 0 && dolog)
+					dkimf_db_error(signdb, tmpaddr);
+				return -1;
+			}
+			else if (found)
+			{
+				if (keyname[0] == '%' && keyname[1] == '\0')
+				{
+					strlcpy(keyname, domain,
+					        sizeof keyname);
+				}
+
+				dkimf_reptoken(tmp, sizeof tmp, signer,
+				               domain);
+
+				status = dkimf_add_signrequest(dfc, conf, keydb,
+				                               keyname,
+				                               (char *) tmp,
+				                               (ssize_t) -1);
+				if (status != 0 && errkey != NULL)
+					strlcpy(errkey, keyname, errlen);
+				if (status == 1)
+					return -2;
+				else if (status == 2 || status == 3 ||
+				         status == -1)
+					return -3;
+
+				nfound++;
+
+				if (!multisig)
+					return nfound;
+			}
+
+			found = FALSE;
+			req[0].dbdata_buflen = sizeof keyname - 1;
+			req[1].dbdata_buflen = sizeof signer - 1;
+			memset(keyname, '\0', sizeof keyname);
+			memset(signer, '\0', sizeof signer);
+			status = dkimf_db_get(signdb, p, strlen(p),
+			                      req, 2, &found);
+			if (status != 0 ||
+			    (found && (req[0].dbdata_buflen == 0 ||
+			               req[0].dbdata_buflen == (size_t) -1)))
+			{
+				if (status != 0 && dolog)
+					dkimf_db_error(signdb, p);
+				return -1;
+			}
+			else if (found)
+			{
+				if (keyname[0] == '%' && keyname[1] == '\0')
+				{
+					strlcpy(keyname, domain,
+					        sizeof keyname);
+				}
+
+				dkimf_reptoken(tmp, sizeof tmp, signer,
+				               domain);
+
+				status = dkimf_add_signrequest(dfc, conf, keydb,
+				                               keyname,
+				                               (char *) tmp,
+				                               (ssize_t) -1);
+				if (status != 0 && errkey != NULL)
+					strlcpy(errkey, keyname, errlen);
+				if (status == 1)
+					return -2;
+				else if (status == 2 || status == 3 ||
+				         status == -1)
+					return -3;
+
+				nfound++;
+
+				if (!multisig)
+					return nfound;
+			}
+		}
+
+		/* now "user@*" */
+		snprintf(tmpaddr, sizeof tmpaddr, "%s@*", user);
+
+		found = FALSE;
+		req[0].dbdata_buflen = sizeof keyname - 1;
+		req[1].dbdata_buflen = sizeof signer - 1;
+		memset(keyname, '\0', sizeof keyname);
+		memset(signer, '\0', sizeof signer);
+		status = dkimf_db_get(signdb, tmpaddr, strlen(tmpaddr),
+		                      req, 2, &found);
+		if (status != 0 ||
+		    (found && (req[0].dbdata_buflen == 0 ||
+		               req[0].dbdata_buflen == (size_t) -1)))
+		{
+			if (status != 0 && dolog)
+				dkimf_db_error(signdb, tmpaddr);
+			return -1;
+		}
+		else if (found)
+		{
+			if (keyname[0] == '%' && keyname[1] == '\0')
+				strlcpy(keyname, domain, sizeof keyname);
+
+			dkimf_reptoken(tmp, sizeof tmp, signer, domain);
+
+			status = dkimf_add_signrequest(dfc, conf, keydb, keyname,
+			                               (char *) tmp,
+			                               (ssize_t) -1);
+			if (status != 0 && errkey != NULL)
+				strlcpy(errkey, keyname, errlen);
+			if (status == 1)
+				return -2;
+			else if (status == 2 || status == 3 || status == -1)
+				return -3;
+
+			nfound++;
+
+			if (!multisig)
+				return nfound;
+		}
+
+		/* finally just "*" */
+		found = FALSE;
+		req[0].dbdata_buflen = sizeof keyname - 1;
+		req[1].dbdata_buflen = sizeof signer - 1;
+		memset(keyname, '\0', sizeof keyname);
+		memset(signer, '\0', sizeof signer);
+		status = dkimf_db_get(signdb, "*", 1, req, 2, &found);
+		if (status != 0 ||
+		    (found && (req[0].dbdata_buflen == 0 ||
+		               req[0].dbdata_buflen == (size_t) -1)))
+		{
+			if (status != 0 && dolog)
+				dkimf_db_error(signdb, "*");
+			return -1;
+		}
+		else if (found)
+		{
+			if (keyname[0] == '%' && keyname[1] == '\0')
+				strlcpy(keyname, domain, sizeof keyname);
+
+			dkimf_reptoken(tmp, sizeof tmp, signer, domain);
+
+			status = dkimf_add_signrequest(dfc, conf, keydb, keyname,
+			                               (char *) tmp,
+			                               (ssize_t) -1);
+			if (status != 0 && errkey != NULL)
+				strlcpy(errkey, keyname, errlen);
+			if (status == 1)
+				return -2;
+			else if (status == 2 || status == 3 || status == -1)
+				return -3;
+
+			nfound++;
+
+			if (!multisig)
+				return nfound;
+		}
+	}
+
+	return nfound;
+}
+
+/*
+**  DKIMF_SIGREPORT -- generate a report on signature failure (if possible)
+**
+**  Parameters:
+**   	cc -- connection context
+**  	conf -- current configuration object
+**  	hostname -- hostname to use for reporting MTA
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_sigreport(connctx cc, struct dkimf_config *conf, char *hostname)
+{
+	_Bool sendreport = FALSE;
+	_Bool spool = FALSE;
+#ifdef _FFR_REPORT_QUEUE
+	_Bool queued = FALSE;
+#endif /* _FFR_REPORT_QUEUE */
+	int bfd = -1;
+	int hfd = -1;
+	int status;
+	int arftype = ARF_TYPE_UNKNOWN;
+	int arfdkim = ARF_DKIMF_UNKNOWN;
+	u_int pct = 100;
+	u_int rn;
+	time_t now;
+	DKIM_STAT repstatus;
+	char *p;
+	char *last;
+	FILE *out;
+	msgctx dfc;
+	DKIM_SIGINFO *sig;
+	struct Header *hdr;
+	struct tm tm;
+	char ipstr[DKIM_MAXHOSTNAMELEN + 1];
+	char opts[BUFRSZ];
+	char fmt[BUFRSZ];
+	char dest[MAXADDRESS + 1];
+	u_char addr[MAXADDRESS + 1];
+
+	assert(cc != NULL);
+
+	dfc = cc->cctx_msg;
+
+	assert(dfc->mctx_dkimv != NULL);
+	assert(conf != NULL);
+	assert(hostname != NULL);
+
+	memset(addr, '\0', sizeof addr);
+	memset(opts, '\0', sizeof opts);
+
+	sig = dkim_getsignature(dfc->mctx_dkimv);
+
+	/* if no report is possible, just skip it */
+	repstatus = dkim_sig_getreportinfo(dfc->mctx_dkimv, sig,
+	                                   &hfd, &bfd,
+	                                   (u_char *) addr, sizeof addr,
+	                                   (u_char *) opts, sizeof opts,
+	                                   NULL, 0, &pct);
+	if (repstatus != DKIM_STAT_OK || addr[0] == '\0')
+		return;
+
+	if (pct < 100)
+	{
+		rn = random() % 100;
+		if (rn > pct)
+			return;
+	}
+
+	/* ignore any domain name in "r=" */
+	p = strchr((char *) addr, '@');
+	if (p != NULL)
+		*p = '\0';
+
+	/* ensure the event being reported was requested */
+	if (opts[0] == '\0')
+	{
+		sendreport = TRUE;
+	}
+	else
+	{
+		for (p = strtok_r(opts, ":", &last);
+		     p != NULL;
+		     p = strtok_r(NULL, ":", &last))
+		{
+			if (strcasecmp(p, ARF_OPTIONS_DKIM_ALL) == 0)
+			{
+				sendreport = TRUE;
+				break;
+			}
+			else if (strcasecmp(p, ARF_OPTIONS_DKIM_SYNTAX) == 0)
+			{
+				int err;
+
+				err = dkim_sig_geterror(sig);
+
+				if (err == DKIM_SIGERROR_TIMESTAMPS ||
+				    err == DKIM_SIGERROR_INVALID_HC ||
+				    err == DKIM_SIGERROR_INVALID_BC ||
+				    err == DKIM_SIGERROR_MISSING_A ||
+				    err == DKIM_SIGERROR_INVALID_A ||
+				    err == DKIM_SIGERROR_MISSING_H ||
+				    err == DKIM_SIGERROR_INVALID_L ||
+				    err == DKIM_SIGERROR_INVALID_Q ||
+				    err == DKIM_SIGERROR_INVALID_QO ||
+				    err == DKIM_SIGERROR_MISSING_D ||
+				    err == DKIM_SIGERROR_EMPTY_D ||
+				    err == DKIM_SIGERROR_MISSING_S ||
+				    err == DKIM_SIGERROR_EMPTY_S ||
+				    err == DKIM_SIGERROR_MISSING_B ||
+				    err == DKIM_SIGERROR_EMPTY_B ||
+				    err == DKIM_SIGERROR_CORRUPT_B ||
+				    err == DKIM_SIGERROR_MISSING_BH ||
+				    err == DKIM_SIGERROR_EMPTY_BH ||
+				    err == DKIM_SIGERROR_CORRUPT_BH ||
+				    err == DKIM_SIGERROR_EMPTY_H ||
+				    err == DKIM_SIGERROR_INVALID_H ||
+				    err == DKIM_SIGERROR_TOOLARGE_L ||
+				    err == DKIM_SIGERROR_MISSING_V ||
+				    err == DKIM_SIGERROR_EMPTY_V)
+				{
+					sendreport = TRUE;
+					break;
+				}
+			}
+			else if (strcasecmp(p, ARF_OPTIONS_DKIM_EXPIRED) == 0)
+			{
+				if (dkim_sig_geterror(sig) == DKIM_SIGERROR_EXPIRED)
+				{
+					sendreport = TRUE;
+					break;
+				}
+			}
+			else if (strcasecmp(p, ARF_OPTIONS_DKIM_VERIFY) == 0)
+			{
+				if (dkim_sig_geterror(sig) == DKIM_SIGERROR_BADSIG ||
+				    dkim_sig_getbh(sig) == DKIM_SIGBH_MISMATCH)
+				{
+					sendreport = TRUE;
+					break;
+				}
+			}
+			else if (strcasecmp(p, ARF_OPTIONS_DKIM_DNS) == 0)
+			{
+				int err;
+
+				err = dkim_sig_geterror(sig);
+
+				if (err == DKIM_SIGERROR_NOKEY ||
+				    err == DKIM_SIGERROR_DNSSYNTAX ||
+				    err == DKIM_SIGERROR_KEYFAIL ||
+				    err == DKIM_SIGERROR_KEYDECODE ||
+				    err == DKIM_SIGERROR_MULTIREPLY)
+				{
+					sendreport = TRUE;
+					break;
+				}
+			}
+			else if (strcasecmp(p, ARF_OPTIONS_DKIM_POLICY) == 0)
+			{
+				int err;
+
+				err = dkim_sig_geterror(sig);
+
+				if (err == DKIM_SIGERROR_MBSFAILED)
+				{
+					sendreport = TRUE;
+					break;
+				}
+			}
+			else if (strcasecmp(p, ARF_OPTIONS_DKIM_OTHER) == 0)
+			{
+				int err;
+
+				err = dkim_sig_geterror(sig);
+
+				if (err == DKIM_SIGERROR_SUBDOMAIN ||
+				    err == DKIM_SIGERROR_KEYVERSION ||
+				    err == DKIM_SIGERROR_KEYUNKNOWNHASH ||
+				    err == DKIM_SIGERROR_KEYHASHMISMATCH ||
+				    err == DKIM_SIGERROR_NOTEMAILKEY ||
+				    err == DKIM_SIGERROR_KEYTYPEMISSING ||
+				    err == DKIM_SIGERROR_KEYTYPEUNKNOWN ||
+				    err == DKIM_SIGERROR_KEYREVOKED)
+				{
+					sendreport = TRUE;
+					break;
+				}
+			}
+		}
+	}
+
+	if (!sendreport)
+		return;
+
+	snprintf(dest, sizeof dest, "%s@%s", addr, dkim_sig_getdomain(sig));
+
+#ifdef _FFR_REPORT_QUEUE
+	queued = dkimf_reportq_enabled();
+	spool = queued;
+#endif /* _FFR_REPORT_QUEUE */
+#ifdef HAVE_CURL_EASY_STRERROR
+	if (conf->conf_smtpuri != NULL)
+		spool = TRUE;
+#endif /* HAVE_CURL_EASY_STRERROR */
+
+	if (spool)
+	{
+		int fd;
+		char path[MAXPATHLEN + 1];
+
+		snprintf(path, sizeof path, "%s/%s.XXXXXX", conf->conf_tmpdir,
+		         progname);
+
+		fd = mkstemp(path);
+		if (fd < 0)
+		{
+			if (conf->conf_dolog)
+			{
+				syslog(LOG_ERR, "%s: mkstemp(): %s",
+				       dfc->mctx_jobid, strerror(errno));
+			}
+
+			return;
+		}
+
+		unlink(path);
+
+		out = fdopen(fd, "w+");
+		if (out == NULL)
+		{
+			if (conf->conf_dolog)
+			{
+				syslog(LOG_ERR, "%s: fdopen(): %s",
+				       dfc->mctx_jobid, strerror(errno));
+			}
+	
+			close(fd);
+			return;
+		}
+	}
+	else
+	{
+		out = popen(reportcmd, "w");
+		if (out == NULL)
+		{
+			if (conf->conf_dolog)
+			{
+				syslog(LOG_ERR, "%s: popen(): %s",
+				       dfc->mctx_jobid, strerror(errno));
+			}
+	
+			return;
+		}
+	}
+
+	/* determine the type of ARF failure and, if needed, a DKIM fail code */
+	arftype = dkimf_arftype(dfc);
+	if (arftype == ARF_TYPE_AUTHFAIL)
+		arfdkim = dkimf_arfdkim(dfc);
+
+	/* From: */
+	fprintf(out, "From: %s\n", reportaddr);
+
+	/* To: */
+	fprintf(out, "To: %s\n", dest);
+
+	/* Bcc: */
+	if (conf->conf_reportaddrbcc != NULL)
+		fprintf(out, "Bcc: %s\n", conf->conf_reportaddrbcc);
+
+	/* Date: */
+	memset(fmt, '\0', sizeof fmt);
+	(void) time(&now);
+	(void) localtime_r(&now, &tm);
+	(void) strftime(fmt, sizeof fmt, "%a, %e %b %Y %H:%M:%S %z (%Z)", &tm);
+	fprintf(out, "Date: %s\n", fmt);
+
+	/* Subject: */
+	fprintf(out, "Subject: DKIM failure report for %s\n",
+	        dfc->mctx_jobid);
+
+	/* MIME stuff */
+	fprintf(out, "MIME-Version: 1.0\n");
+	fprintf(out,
+	        "Content-Type: multipart/report; report-type=feedback-report;\n\tboundary=\"dkimreport/%s/%s\"",
+	        hostname, dfc->mctx_jobid);
+
+	/* ok, now then... */
+	fprintf(out, "\n");
+
+	/* first part: a text blob explaining what this is */
+	fprintf(out, "--dkimreport/%s/%s\n", hostname, dfc->mctx_jobid);
+	fprintf(out, "Content-Type: text/plain\n");
+	fprintf(out, "\n");
+	fprintf(out, "DKIM failure report for job %s on %s\n\n",
+	        dfc->mctx_jobid, hostname);
+	fprintf(out,
+	        "The canonicalized form of the failed message's header and body are\nattached.\n");
+	fprintf(out, "\n");
+
+	/* second part: formatted gunk */
+	memset(ipstr, '\0', sizeof ipstr);
+
+	switch (cc->cctx_ip.ss_family)
+	{
+	  case AF_INET:
+	  {
+		struct sockaddr_in sin4;
+
+		memcpy(&sin4, &cc->cctx_ip, sizeof sin4);
+
+		(void) inet_ntop(AF_INET, &sin4.sin_addr, ipstr, sizeof ipstr);
+
+		break;
+	  }
+
+#ifdef AF_INET6
+	  case AF_INET6:
+	  {
+		struct sockaddr_in6 sin6;
+
+		memcpy(&sin6, &cc->cctx_ip, sizeof sin6);
+
+		(void) inet_ntop(AF_INET6, &sin6.sin6_addr, ipstr, sizeof ipstr);
+
+		break;
+	  }
+#endif /* AF_INET6 */
+	}
+
+	hdr = dkimf_findheader(dfc, (char *) "Message-ID", 0);
+
+	fprintf(out, "--dkimreport/%s/%s\n", hostname, dfc->mctx_jobid);
+	fprintf(out, "Content-Type: message/feedback-report\n");
+	fprintf(out, "\n");
+	fprintf(out, "User-Agent: %s/%s\n", DKIMF_PRODUCTNS, VERSION);
+	fprintf(out, "Version: %s\n", ARF_VERSION);
+	fprintf(out, "Original-Envelope-Id: %s\n", dfc->mctx_jobid);
+	fprintf(out, "Original-Mail-From: %s\n", dfc->mctx_envfrom);
+	fprintf(out, "Reporting-MTA: %s\n", hostname);
+	fprintf(out, "Source-IP: %s\n", ipstr);
+	fprintf(out, "Message-ID:%s%s\n",
+	        cc->cctx_noleadspc ? "" : " ",
+	        hdr == NULL ? "(none)" : hdr->hdr_val);
+	fprintf(out, "Arrival-Date: %s\n", fmt);
+	fprintf(out, "Reported-Domain: %s\n", dkim_sig_getdomain(sig));
+	fprintf(out, "Delivery-Result: other\n");
+	fprintf(out, "Feedback-Type: %s\n", arf_type_string(arftype));
+	if (arftype == ARF_TYPE_AUTHFAIL)
+	{
+		fprintf(out, "Auth-Failure: ");
+		if (dkim_sig_getbh(sig) == DKIM_SIGBH_MISMATCH)
+		{
+			fprintf(out, "bodyhash\n");
+		}
+		else
+		{
+			const char *tmperror;
+
+			switch (dkim_sig_geterror(sig))
+			{
+			  case DKIM_SIGERROR_KEYREVOKED:
+				fprintf(out, "revoked\n");
+				break;
+
+			  default:
+				tmperror = dkim_sig_geterrorstr(dkim_sig_geterror(sig));
+				fprintf(out, "signature");
+				if (tmperror != NULL)
+					fprintf(out, " (%s)", tmperror);
+				fprintf(out, "\n");
+				break;
+			}
+		}
+
+		memset(addr, '\0', sizeof addr);
+		dkim_sig_getidentity(dfc->mctx_dkimv, sig, addr,
+		                     sizeof addr - 1);
+
+		/* fprintf(out, "Authentication-Results: %s\n", ...); */
+		fprintf(out, "DKIM-Failure: %s\n",
+		        arf_dkim_failure_string(arfdkim));
+		fprintf(out, "DKIM-Domain: %s\n", dkim_sig_getdomain(sig));
+		fprintf(out, "DKIM-Selector: %s\n", dkim_sig_getselector(sig));
+		fprintf(out, "DKIM-Identity: %s\n", addr);
+		if (hfd != -1)
+		{
+			fprintf(out, "DKIM-Canonicalized-Header: ");
+			(void) dkimf_base64_encode_file(hfd, out, 4, 75, 27);
+			fprintf(out, "\n");
+		}
+		if (bfd != -1)
+		{
+			fprintf(out, "DKIM-Canonicalized-Body: ");
+			(void) dkimf_base64_encode_file(bfd, out, 4, 75, 25);
+			fprintf(out, "\n");
+		}
+	}
+
+	fprintf(out, "\n");
+
+	/* third part: header block */
+	fprintf(out, "--dkimreport/%s/%s\n", hostname, dfc->mctx_jobid);
+	fprintf(out, "Content-Type: text/rfc822-headers\n");
+	fprintf(out, "\n");
+
+	for (hdr = dfc->mctx_hqhead; hdr != NULL; hdr = hdr->hdr_next)
+	{
+		fprintf(out, "%s:%s%s\n", hdr->hdr_hdr,
+		        cc->cctx_noleadspc ? "" : " ", hdr->hdr_val);
+	}
+
+	/* end */
+	fprintf(out, "\n--dkimreport/%s/%s--\n", hostname, dfc->mctx_jobid);
+
+#ifdef _FFR_REPORT_QUEUE
+	/* leave the sending to the report queue */
+	if (queued)
+	{
+		char *uri = NULL;
+
+# ifdef HAVE_CURL_EASY_STRERROR
+		uri = conf->conf_smtpuri;
+# endif /* HAVE_CURL_EASY_STRERROR */
+
+		if (dkimf_reportq_add(out, dfc->mctx_jobid, reportaddr, dest,
+		                      reportcmd, uri) != 0)
+		{
+			if (conf->conf_dolog)
+			{
+				syslog(LOG_WARNING,
+				       "%s: report queue full, report to %s dropped",
+				       dfc->mctx_jobid, dest);
+			}
+		}
+
+		(void) fclose(out);
+
+		return;
+	}
+#endif /* _FFR_REPORT_QUEUE */
+
+	/* send it */
+#ifdef HAVE_CURL_EASY_SETOPT
+	if (conf->conf_smtpuri != NULL)
+	{
+		CURLcode cc;
+		CURL *curl;
+		struct curl_slist *rcpts = NULL;
+
+		(void) fseek(out, SEEK_SET, 0);
+
+		curl = curl_easy_init();
+		if (curl == NULL)
+		{
+			if (conf->conf_dolog)
+			{
+				syslog(LOG_ERR, "%s: curl_easy_init() failed",
+				       dfc->mctx_jobid);
+			}
+		}
+		else
+		{
+			cc = curl_easy_setopt(curl, CURLOPT_URL,
+			                      conf->conf_smtpuri);
+
+			if (cc == CURLE_OK)
+			{
+				cc = curl_easy_setopt(curl, CURLOPT_READDATA,
+				                      out);
+			}
+
+			if (cc == CURLE_OK)
+			{
+				cc = curl_easy_setopt(curl, CURLOPT_MAIL_FROM,
+				                      reportaddr);
+			}
+
+			if (cc == CURLE_OK)
+			{
+				rcpts = curl_slist_append(rcpts, dest);
+				cc = curl_easy_setopt(curl, CURLOPT_MAIL_RCPT,
+				                      rcpts);
+			}
+
+			if (cc != CURLE_OK)
+			{
+				if (conf->conf_dolog)
+				{
+					syslog(LOG_ERR,
+					       "%s: curl_easy_setopt() failed",
+					       dfc->mctx_jobid);
+				}
+			}
+			else
+			{
+				cc = curl_easy_perform(curl);
+				if (cc != CURLE_OK && conf->conf_dolog)
+				{
+					syslog(LOG_ERR,
+					       "%s: curl_easy_perform() to %s failed: %s",
+					       dfc->mctx_jobid, dest,
+					       curl_easy_strerror(cc));
+				}
+			}
+
+			curl_slist_free_all(rcpts);
+
+			curl_easy_cleanup(curl);
+		}
+	}
+	else
+	{
+		status = pclose(out);
+		if (status != 0 && conf->conf_dolog)
+		{
+			syslog(LOG_ERR, "%s: pclose(): returned status %d",
+			       dfc->mctx_jobid, status);
+		}
+	}
+#else /* HAVE_CURL_EASY_SETOPT */
+	status = pclose(out);
+	if (status != 0 && conf->conf_dolog)
+	{
+		syslog(LOG_ERR, "%s: pclose(): returned status %d",
+		       dfc->mctx_jobid, status);
+	}
+#endif /* HAVE_CURL_EASY_SETOPT */
+}
+
+/*
+**  DKIMF_AR_ALL_SIGS -- append Authentication-Results items for all signatures
+**
+**  Parameters:
+**  	hdr -- header buffer
+** 	hdrlen -- size of header buffer
+**  	tmpstr -- a dstring to construct the result
+**  	dkim -- DKIM verification handle
+**  	conf -- config object
+**  	status -- message context status (may be updated)
+**
+**  Return value:
+**  	FALSE iff the filter should reject the message based on results.
+*/
+
+void
+dkimf_ar_all_sigs(char *hdr, size_t hdrlen, struct dkimf_dstring *tmpstr,
+                  DKIM *dkim, struct dkimf_config *conf, int *status)
+{
+	int nsigs;
+	DKIM_STAT dstatus;
+	DKIM_SIGINFO **sigs;
+
+	assert(hdr != NULL);
+	assert(tmpstr != NULL);
+	assert(dkim != NULL);
+	assert(conf != NULL);
+	assert(status != NULL);
+
+	dstatus = dkim_getsiglist(dkim, &sigs, &nsigs);
+	if (dstatus == DKIM_STAT_OK)
+	{
+		int c;
+		int sigerror;
+		DKIM_STAT ts;
+		u_int keybits;
+		size_t ssl;
+		char *result;
+		char *dnssec;
+		char *domain;
+		char *selector;
+		char *algorithm;
+		char ss[BUFRSZ + 1];
+		char tmp[BUFRSZ + 1];
+		char val[MAXADDRESS + 1];
+		char comment[BUFRSZ + 1];
+
+		for (c = 0; c < nsigs; c++)
+		{
+			dnssec = NULL;
+
+			memset(comment, '\0', sizeof comment);
+
+			sigerror = dkim_sig_geterror(sigs[c]);
+
+			if (dkim_sig_getkeysize(sigs[c],
+			                        &keybits) != DKIM_STAT_OK)
+				keybits = 0;
+
+			if (conf->conf_noheaderb)
+			{
+				ts = -1;
+			}
+			else
+			{
+				ssl = sizeof ss - 1;
+				ts = dkim_get_sigsubstring(dkim, sigs[c], ss,
+				                           &ssl);
+			}
+
+			if ((dkim_sig_getflags(sigs[c]) & DKIM_SIGFLAG_PASSED) != 0 &&
+			    dkim_sig_getbh(sigs[c]) == DKIM_SIGBH_MATCH)
+			{
+				result = "pass";
+			}
+			else if (sigerror == DKIM_SIGERROR_MULTIREPLY ||
+			         sigerror == DKIM_SIGERROR_KEYFAIL ||
+			         sigerror == DKIM_SIGERROR_DNSSYNTAX)
+			{
+				result = "temperror";
+			}
+			else if (sigerror == DKIM_SIGERROR_KEYTOOSMALL)
+			{
+				const char *err;
+
+				result = "policy";
+
+				err = dkim_sig_geterrorstr(dkim_sig_geterror(sigs[c]));
+				if (err != NULL)
+				{
+					snprintf(comment, sizeof comment,
+					         " reason=\"%s\"", err);
+				}
+			}
+			else if ((dkim_sig_getflags(sigs[c]) & DKIM_SIGFLAG_PROCESSED) != 0 &&
+			         ((dkim_sig_getflags(sigs[c]) & DKIM_SIGFLAG_PASSED) == 0 ||
+			          dkim_sig_getbh(sigs[c]) != DKIM_SIGBH_MATCH))
+			{
+				const char *err;
+
+				result = "fail";
+
+				err = dkim_sig_geterrorstr(dkim_sig_geterror(sigs[c]));
+				if (err != NULL)
+				{
+					snprintf(comment, sizeof comment,
+					         " reason=\"%s\"", err);
+				}
+			}
+			else if (sigerror != DKIM_SIGERROR_UNKNOWN &&
+			         sigerror != DKIM_SIGERROR_OK)
+			{
+				result = "permerror";
+			}
+			else
+			{
+				result = "neutral";
+			}
+
+			dnssec = NULL;
+
+			switch (dkim_sig_getdnssec(sigs[c]))
+			{
+			  case DKIM_DNSSEC_UNKNOWN:
+				break;
+
+			  case DKIM_DNSSEC_INSECURE:
+				dnssec = "unprotected";
+				if (conf->conf_unprotectedkey == DKIMF_KEYACTIONS_FAIL)
+				{
+					*status = DKIMF_STATUS_BAD;
+					result = "policy";
+				}
+				else if (conf->conf_unprotectedkey == DKIMF_KEYACTIONS_NEUTRAL)
+				{
+					*status = DKIMF_STATUS_VERIFYERR;
+					result = "neutral";
+				}
+				break;
+
+			  case DKIM_DNSSEC_BOGUS:
+				dnssec = "bogus";
+				if (conf->conf_boguskey == DKIMF_KEYACTIONS_FAIL)
+				{
+					*status = DKIMF_STATUS_BAD;
+				}
+				else if (conf->conf_boguskey == DKIMF_KEYACTIONS_NEUTRAL)			{
+					*status = DKIMF_STATUS_VERIFYERR;
+					result = "neutral";
+				}
+				break;
 
-			dkimf_reptoken(tmp, sizeof tmp, signer, domain);
+			  case DKIM_DNSSEC_SECURE:
+				dnssec = "secure";
+				break;
+			}
 
-			status = dkimf_add_signrequest(dfc, keydb, keyname,
-			                               (char *) tmp,
-			                               (ssize_t) -1);
-			if (status != 0 && errkey != NULL)
-				strlcpy(errkey, keyname, errlen);
-			if (status == 1)
-				return -2;
-			else if (status == 2 || status == 3 || status == -1)
-				return -3;
+			memset(val, '\0', sizeof val);
 
-			nfound++;
+			(void) dkim_sig_getidentity(dkim, sigs[c],
+			                            val, sizeof val - 1);
 
-			if (!multisig)
-				return nfound;
-		}
-	}
+			domain = dkim_sig_getdomain(sigs[c]);
+			selector = dkim_sig_getselector(sigs[c]);
+			algorithm = dkim_sig_getalgorithm(sigs[c]);
 
-	return nfound;
+ 			dkimf_dstring_blank(tmpstr);
+ 			dkimf_dstring_printf(tmpstr, "%s%s",
+ 			                     c == 0 ? "" : ";", DELIMITER);
+ 			dkimf_dstring_printf(tmpstr, "dkim=%s", result);
+ 			dkimf_dstring_printf(tmpstr, comment);
+ 			if (keybits > 0)
+ 			{
+ 				dkimf_dstring_printf(tmpstr,
+ 				                     " (%u-bit key%s%s)",
+ 				                     keybits,
+ 				                     dnssec == NULL ? ""
+ 				                                    : ", ",
+ 				                     dnssec == NULL ? ""
+ 				                                    : dnssec);
+ 			}
+ 			dkimf_dstring_printf(tmpstr,
+ 			                     " header.d=%s header.i=%s header.a=%s header.s=%s",
+ 			                     domain, val, algorithm, selector);
+ 			if (ts == DKIM_STAT_OK)
+ 			{
+ 				dkimf_dstring_printf(tmpstr, " header.b=%s",
+ 				                     ss);
+ 			}
+ 
+ 			strlcat(hdr, dkimf_dstring_get(tmpstr), hdrlen);
+ 		}
+	}
 }
 
+#ifdef _FFR_CONDITIONAL
 /*
-**  DKIMF_SIGREPORT -- generate a report on signature failure (if possible)
+**  DKIMF_CHECK_CONDITIONAL -- apply any conditional signature needed
 **
 **  Parameters:
-**   	cc -- connection context
-**  	conf -- current configuration object
-**  	hostname -- hostname to use for reporting MTA
+**  	dfc -- message context
+**  	conf -- configuration
+**  	sr -- a signing request
 **
 **  Return value:
-**  	None.
+**  	Status from dkim_conditional, if any.
 */
 
-static void
-dkimf_sigreport(connctx cc, struct dkimf_config *conf, char *hostname)
+static DKIM_STAT
+dkimf_check_conditional(struct msgctx *dfc, struct dkimf_config *conf,
+                        struct signreq *sr)
 {
-	_Bool sendreport = FALSE;
-	int bfd = -1;
-	int hfd = -1;
-	int status;
-	int arftype = ARF_TYPE_UNKNOWN;
-	int arfdkim = ARF_DKIMF_UNKNOWN;
-	u_int pct = 100;
-	u_int rn;
-	time_t now;
-	DKIM_STAT repstatus;
-	char *p;
-	char *last;
-	FILE *out;
-	msgctx dfc;
-	DKIM_SIGINFO *sig;
-	struct Header *hdr;
-	struct tm tm;
-	char ipstr[DKIM_MAXHOSTNAMELEN + 1];
-	char opts[BUFRSZ];
-	char fmt[BUFRSZ];
-	u_char addr[MAXADDRESS + 1];
-
-	assert(cc != NULL);
+	_Bool found;
+	size_t len;
+	DKIM_STAT status;
+	struct dkimf_dstring *dstr = NULL;
+	struct addrlist *a;
+	struct signreq *newsr_head = NULL;
+	struct signreq *newsr_tail = NULL;
+	char *at;
 
-	dfc = cc->cctx_msg;
+	dstr = dkimf_dstring_new(BUFRSZ, 0);
+	dkimf_dstring_cat(dstr, dfc->mctx_domain);
+	dkimf_dstring_cat1(dstr, ':');
+	len = dkimf_dstring_len(dstr);
 
-	assert(dfc->mctx_dkimv != NULL);
-	assert(conf != NULL);
-	assert(hostname != NULL);
+	for (a = dfc->mctx_rcptlist; a != NULL; a = a->a_next)
+	{
+		dkimf_dstring_chop(dstr, len);
 
-	memset(addr, '\0', sizeof addr);
-	memset(opts, '\0', sizeof opts);
+		at = strchr(a->a_addr, '@');
+		if (at == NULL)
+			continue;
 
-	sig = dkim_getsignature(dfc->mctx_dkimv);
+		dkimf_dstring_cat(dstr, at + 1);
 
-	/* if no report is possible, just skip it */
-	repstatus = dkim_sig_getreportinfo(dfc->mctx_dkimv, sig,
-	                                   &hfd, &bfd,
-	                                   (u_char *) addr, sizeof addr,
-	                                   (u_char *) opts, sizeof opts,
-	                                   NULL, 0, &pct);
-	if (repstatus != DKIM_STAT_OK || addr[0] == '\0')
-		return;
+		/*
+		**  Look for from/to pair in conditional DB; if found,
+		**  request a conditional signature with d= from-domain
+		**  and !cd= recipient domain, for now with l=0
+		*/
 
-	if (pct < 100)
-	{
-		rn = random() % 100;
-		if (rn > pct)
-			return;
-	}
+		found = FALSE;
+		if (dkimf_db_get(conf->conf_conditionaldb,
+		                 dkimf_dstring_get(dstr),
+		                 0, NULL, 0, &found) != 0)
+		{
+			if (conf->conf_dolog)
+				syslog(LOG_ERR, "dkimf_db_get() failed");
 
-	/* ignore any domain name in "r=" */
-	p = strchr((char *) addr, '@');
-	if (p != NULL)
-		*p = '\0';
+			return DKIM_STAT_INTERNAL;
+		}
 
-	/* ensure the event being reported was requested */
-	if (opts[0] == '\0')
-	{
-		sendreport = TRUE;
-	}
-	else
-	{
-		for (p = strtok_r(opts, ":", &last);
-		     p != NULL;
-		     p = strtok_r(NULL, ":", &last))
+		if (found)
 		{
-			if (strcasecmp(p, ARF_OPTIONS_DKIM_ALL) == 0)
+			int status;
+			struct signreq *newsr;
+			void *keydata;
+			unsigned char *sdomain;
+			unsigned char *selector;
+
+			newsr = (struct signreq *) malloc(sizeof(struct signreq));
+			if (newsr == NULL)
 			{
-				sendreport = TRUE;
-				break;
+				if (conf->conf_dolog)
+					syslog(LOG_ERR, "malloc() failed");
+
+				return DKIM_STAT_NORESOURCE;
 			}
-			else if (strcasecmp(p, ARF_OPTIONS_DKIM_SYNTAX) == 0)
+
+			memset(newsr, '\0', sizeof(*newsr));
+
+			if (sr->srq_keydata == NULL)
 			{
-				int err;
+				keydata = (dkim_sigkey_t) conf->conf_seckey;
+				sdomain = dfc->mctx_domain;
+				selector = conf->conf_selector;
+			}
+			else
+			{
+				keydata = sr->srq_keydata;
+				sdomain = sr->srq_domain;
+				selector = sr->srq_selector;
+			}
 
-				err = dkim_sig_geterror(sig);
+			newsr->srq_dkim = dkim_sign(conf->conf_libopendkim,
+			                            dfc->mctx_jobid,
+			                            NULL,
+			                            keydata,
+			                            selector,
+			                            sdomain,
+			                            dfc->mctx_hdrcanon,
+			                            dfc->mctx_bodycanon,
+			                            dfc->mctx_signalg,
+			                            0, &status);
+			if (status != DKIM_STAT_OK)
+			{
+				if (conf->conf_dolog)
+					syslog(LOG_ERR, "dkim_sign() failed");
 
-				if (err == DKIM_SIGERROR_TIMESTAMPS ||
-				    err == DKIM_SIGERROR_INVALID_HC ||
-				    err == DKIM_SIGERROR_INVALID_BC ||
-				    err == DKIM_SIGERROR_MISSING_A ||
-				    err == DKIM_SIGERROR_INVALID_A ||
-				    err == DKIM_SIGERROR_MISSING_H ||
-				    err == DKIM_SIGERROR_INVALID_L ||
-				    err == DKIM_SIGERROR_INVALID_Q ||
-				    err == DKIM_SIGERROR_INVALID_QO ||
-				    err == DKIM_SIGERROR_MISSING_D ||
-				    err == DKIM_SIGERROR_EMPTY_D ||
-				    err == DKIM_SIGERROR_MISSING_S ||
-				    err == DKIM_SIGERROR_EMPTY_S ||
-				    err == DKIM_SIGERROR_MISSING_B ||
-				    err == DKIM_SIGERROR_EMPTY_B ||
-				    err == DKIM_SIGERROR_CORRUPT_B ||
-				    err == DKIM_SIGERROR_MISSING_BH ||
-				    err == DKIM_SIGERROR_EMPTY_BH ||
-				    err == DKIM_SIGERROR_CORRUPT_BH ||
-				    err == DKIM_SIGERROR_EMPTY_H ||
-				    err == DKIM_SIGERROR_INVALID_H ||
-				    err == DKIM_SIGERROR_TOOLARGE_L ||
-				    err == DKIM_SIGERROR_MISSING_V ||
-				    err == DKIM_SIGERROR_EMPTY_V)
-				{
-					sendreport = TRUE;
-					break;
-				}
+				free(newsr);
+				return DKIM_STAT_INTERNAL;
 			}
-			else if (strcasecmp(p, ARF_OPTIONS_DKIM_EXPIRED) == 0)
+
+			status = dkim_conditional(newsr->srq_dkim, at + 1);
+			if (status != DKIM_STAT_OK)
 			{
-				if (dkim_sig_geterror(sig) == DKIM_SIGERROR_EXPIRED)
-				{
-					sendreport = TRUE;
-					break;
-				}
+				free(newsr);
+				return status;
 			}
-			else if (strcasecmp(p, ARF_OPTIONS_DKIM_VERIFY) == 0)
+
+			if (newsr_head == NULL)
 			{
-				if (dkim_sig_geterror(sig) == DKIM_SIGERROR_BADSIG ||
-				    dkim_sig_getbh(sig) == DKIM_SIGBH_MISMATCH)
-				{
-					sendreport = TRUE;
-					break;
-				}
+				newsr_head = newsr;
+				newsr_tail = newsr;
 			}
-			else if (strcasecmp(p, ARF_OPTIONS_DKIM_DNS) == 0)
+			else
 			{
-				int err;
+				newsr_tail->srq_next = newsr;
+				newsr_tail = newsr;
+			}
+		}
+	}
 
-				err = dkim_sig_geterror(sig);
+	if (dfc->mctx_srtail != NULL && newsr_head != NULL)
+	{
+		dfc->mctx_srtail->srq_next = newsr_head;
+		dfc->mctx_srtail = newsr_tail;
+	}
 
-				if (err == DKIM_SIGERROR_NOKEY ||
-				    err == DKIM_SIGERROR_DNSSYNTAX ||
-				    err == DKIM_SIGERROR_KEYFAIL ||
-				    err == DKIM_SIGERROR_KEYDECODE ||
-				    err == DKIM_SIGERROR_MULTIREPLY)
-				{
-					sendreport = TRUE;
-					break;
-				}
-			}
-			else if (strcasecmp(p, ARF_OPTIONS_DKIM_POLICY) == 0)
-			{
-				int err;
+	dkimf_dstring_free(dstr);
 
-				err = dkim_sig_geterror(sig);
+	return DKIM_STAT_OK;
+}
+#endif /* _FFR_CONDITIONAL */
 
-				if (err == DKIM_SIGERROR_MBSFAILED)
-				{
-					sendreport = TRUE;
-					break;
-				}
-			}
-			else if (strcasecmp(p, ARF_OPTIONS_DKIM_OTHER) == 0)
-			{
-				int err;
+#ifdef _FFR_VBR
+/*
+**  DKIMF_VBR_NEW -- create a VBR handle set up from the configuration
+**
+**  Parameters:
+**  	conf -- configuration in use
+**  	jobid -- job ID, for logging
+**
+**  Return value:
+**  	A new VBR handle, or NULL on failure (which has been logged).
+*/
 
-				err = dkim_sig_geterror(sig);
+static VBR *
+dkimf_vbr_new(struct dkimf_config *conf, char *jobid)
+{
+	int status;
+	VBR *vbr;
 
-				if (err == DKIM_SIGERROR_SUBDOMAIN ||
-				    err == DKIM_SIGERROR_KEYVERSION ||
-				    err == DKIM_SIGERROR_KEYUNKNOWNHASH ||
-				    err == DKIM_SIGERROR_KEYHASHMISMATCH ||
-				    err == DKIM_SIGERROR_NOTEMAILKEY ||
-				    err == DKIM_SIGERROR_KEYTYPEMISSING ||
-				    err == DKIM_SIGERROR_KEYTYPEUNKNOWN ||
-				    err == DKIM_SIGERROR_KEYREVOKED)
-				{
-					sendreport = TRUE;
-					break;
-				}
-			}
+	vbr = vbr_init(NULL, NULL, NULL);
+	if (vbr == NULL)
+	{
+		if (conf->conf_dolog)
+		{
+			syslog(LOG_ERR, "%s: can't create VBR context",
+			       jobid);
 		}
+		return NULL;
 	}
 
-	if (!sendreport)
-		return;
+# ifdef USE_UNBOUND
+	dkimf_vbr_unbound_setup(vbr);
+# endif /* USE_UNBOUND */
 
-#ifdef HAVE_CURL_EASY_STRERROR
-	if (conf->conf_smtpuri != NULL)
-	{
-		int fd;
-		char path[MAXPATHLEN + 1];
+	if (conf->conf_vbr_trustedonly)
+		vbr_options(vbr, VBR_OPT_TRUSTEDONLY);
 
-		snprintf(path, sizeof path, "%s/%s.XXXXXX", conf->conf_tmpdir,
-		         progname);
+	/* store the trusted certifiers */
+	if (conf->conf_vbr_trusted != NULL)
+		vbr_trustedcerts(vbr, conf->conf_vbr_trusted);
 
-		fd = mkstemp(path);
-		if (fd < 0)
+	if (vbr_dns_init(vbr) != 0)
+	{
+		if (conf->conf_dolog)
+		{
+			syslog(LOG_ERR, "%s: can't initialize VBR resolver",
+			       jobid);
+		}
+		vbr_close(vbr);
+		return NULL;
+	}
+
+	if (conf->conf_nslist != NULL)
+	{
+		status = vbr_dns_nslist(vbr, conf->conf_nslist);
+		if (status != VBR_STAT_OK)
 		{
 			if (conf->conf_dolog)
 			{
-				syslog(LOG_ERR, "%s: mkstemp(): %s",
-				       dfc->mctx_jobid, strerror(errno));
+				syslog(LOG_ERR,
+				       "%s: can't set VBR resolver list",
+				       jobid);
 			}
-
-			return;
+			vbr_close(vbr);
+			return NULL;
 		}
+	}
 
-		unlink(path);
-
-		out = fdopen(fd, "w");
-		if (out == NULL)
+	if (conf->conf_trustanchorpath != NULL)
+	{
+		if (access(conf->conf_trustanchorpath, R_OK) != 0)
 		{
 			if (conf->conf_dolog)
 			{
-				syslog(LOG_ERR, "%s: fdopen(): %s",
-				       dfc->mctx_jobid, strerror(errno));
+				syslog(LOG_ERR,
+				       "%s: %s: access(): %s",
+				       jobid,
+				       conf->conf_trustanchorpath,
+				       strerror(errno));
 			}
-	
-			close(fd);
-			return;
+			vbr_close(vbr);
+			return NULL;
 		}
-	}
-	else
-	{
-		out = popen(reportcmd, "w");
-		if (out == NULL)
+
+		status = vbr_dns_trustanchor(vbr,
+		                             conf->conf_trustanchorpath);
+		if (status != DKIM_STAT_OK)
 		{
 			if (conf->conf_dolog)
 			{
-				syslog(LOG_ERR, "%s: popen(): %s",
-				       dfc->mctx_jobid, strerror(errno));
+				syslog(LOG_ERR,
+				       "%s: can't set VBR trust anchor from %s",
+				       jobid,
+				       conf->conf_trustanchorpath);
 			}
-	
-			return;
+			vbr_close(vbr);
+			return NULL;
 		}
 	}
-#else /* HAVE_CURL_EASY_STRERROR */
-	out = popen(reportcmd, "w");
-	if (out == NULL)
+
+	if (conf->conf_resolverconfig != NULL)
 	{
-		if (conf->conf_dolog)
+		status = vbr_dns_config(vbr, conf->conf_resolverconfig);
+		if (status != DKIM_STAT_OK)
 		{
-			syslog(LOG_ERR, "%s: popen(): %s",
-			       dfc->mctx_jobid, strerror(errno));
+			if (conf->conf_dolog)
+			{
+				syslog(LOG_ERR,
+				       "%s: can't set VBR resolver configuration",
+				       jobid);
+			}
+			vbr_close(vbr);
+			return NULL;
 		}
+	}
+
+	return vbr;
+}
+#endif /* _FFR_VBR */
+
+/*
+**  DKIMF_EOM_JOB -- run one EOM lookup, timing it if asked
+**
+**  Parameters:
+**  	vp -- lookup (a struct eomjob)
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_eom_job(void *vp)
+{
+	struct eomjob *ej;
+	struct timeval start;
+	struct timeval end;
+
+	ej = (struct eomjob *) vp;
 
+	if (!ej->ej_lookups->el_timing)
+	{
+		ej->ej_func(ej);
 		return;
 	}
-#endif /* HAVE_CURL_EASY_STRERROR */
 
-	/* determine the type of ARF failure and, if needed, a DKIM fail code */
-	arftype = dkimf_arftype(dfc);
-	if (arftype == ARF_TYPE_AUTHFAIL)
-		arfdkim = dkimf_arfdkim(dfc);
+	(void) gettimeofday(&start, NULL);
 
-	/* From: */
-	fprintf(out, "From: %s\n", reportaddr);
+	ej->ej_func(ej);
 
-	/* To: */
-	fprintf(out, "To: %s@%s\n", addr, dkim_sig_getdomain(sig));
+	(void) gettimeofday(&end, NULL);
+
+	ej->ej_usec = (end.tv_sec - start.tv_sec) * 1000000L +
+	              (end.tv_usec - start.tv_usec);
+}
+
+/*
+**  DKIMF_EOM_ADD -- start an EOM lookup
+**
+**  Parameters:
+**  	el -- EOM lookup set
+**  	set -- job set the lookup joins
+**  	ej -- lookup
+**  	stage -- stage it belongs to
+**  	func -- lookup body
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_eom_add(struct eomlookups *el, struct dkimf_jobset *set,
+              struct eomjob *ej, int stage, void (*func)(struct eomjob *))
+{
+	ej->ej_stage = stage;
+	ej->ej_usec = 0;
+	ej->ej_func = func;
+	ej->ej_lookups = el;
+
+	el->el_run[stage] = TRUE;
+
+	dkimf_jobs_add(set, &ej->ej_job, dkimf_eom_job, ej);
+}
+
+/*
+**  DKIMF_EOM_DONE -- account for the time an EOM lookup took
+**
+**  Parameters:
+**  	el -- EOM lookup set
+**  	ej -- finished lookup
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	The lookups in a stage overlap, so the stage took as long as the
+**  	slowest of them.
+*/
+
+static void
+dkimf_eom_done(struct eomlookups *el, struct eomjob *ej)
+{
+	if (ej->ej_usec > el->el_usec[ej->ej_stage])
+		el->el_usec[ej->ej_stage] = ej->ej_usec;
+}
+
+#ifdef _FFR_ATPS
+/*
+**  DKIMF_EOM_ATPS -- EOM lookup: check ATPS for one signature
+**
+**  Parameters:
+**  	ej -- lookup (a struct eomatps)
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_eom_atps(struct eomjob *ej)
+{
+	struct eomatps *ea;
+
+	ea = (struct eomatps *) ej;
+
+	ea->ea_status = dkim_atps_check(ej->ej_lookups->el_msg->mctx_dkimv,
+	                                ea->ea_sig, NULL, &ea->ea_atps);
+}
+
+/*
+**  DKIMF_EOM_ATPS_START -- start ATPS checks of third-party signatures
+**
+**  Parameters:
+**  	el -- EOM lookup set
+**  	set -- job set the checks join
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_eom_atps_start(struct eomlookups *el, struct dkimf_jobset *set)
+{
+	int c;
+	int nsigs;
+	struct eomatps *ea;
+	DKIM_SIGINFO **sigs;
+	msgctx dfc;
+
+	dfc = el->el_msg;
+
+	el->el_run[EOMSTAGE_ATPS] = TRUE;
+
+	if (dkim_getsiglist(dfc->mctx_dkimv, &sigs, &nsigs) != DKIM_STAT_OK ||
+	    nsigs == 0)
+		return;
+
+	el->el_atpsjobs = (struct eomatps *) malloc(sizeof(struct eomatps) *
+	                                            nsigs);
+	if (el->el_atpsjobs == NULL)
+		return;
+
+	for (c = 0; c < nsigs; c++)
+	{
+		if ((dkim_sig_getflags(sigs[c]) & DKIM_SIGFLAG_PASSED) == 0 ||
+		    dkim_sig_getbh(sigs[c]) != DKIM_SIGBH_MATCH ||
+		    strcasecmp(dkim_sig_getdomain(sigs[c]),
+		               dfc->mctx_domain) == 0)
+			continue;
+
+		ea = &el->el_atpsjobs[el->el_natps++];
+		ea->ea_status = DKIM_STAT_OK;
+		ea->ea_atps = DKIM_ATPS_UNKNOWN;
+		ea->ea_sig = sigs[c];
+
+		dkimf_eom_add(el, set, &ea->ea_job, EOMSTAGE_ATPS,
+		              dkimf_eom_atps);
+	}
+}
+
+/*
+**  DKIMF_EOM_ATPS_FINISH -- combine the ATPS check results
+**
+**  Parameters:
+**  	el -- EOM lookup set
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	The outcome is the one the checks would have had run one after
+**  	another in signature order: the first that finds an ATPS record
+**  	or fails decides it, otherwise the last one does.
+*/
+
+static void
+dkimf_eom_atps_finish(struct eomlookups *el)
+{
+	int c;
+	struct eomatps *ea;
 
-	/* Bcc: */
-	if (conf->conf_reportaddrbcc != NULL)
-		fprintf(out, "Bcc: %s\n", conf->conf_reportaddrbcc);
+	for (c = 0; c < el->el_natps; c++)
+		dkimf_eom_done(el, &el->el_atpsjobs[c].ea_job);
 
-	/* Date: */
-	memset(fmt, '\0', sizeof fmt);
-	(void) time(&now);
-	(void) localtime_r(&now, &tm);
-	(void) strftime(fmt, sizeof fmt, "%a, %e %b %Y %H:%M:%S %z (%Z)", &tm);
-	fprintf(out, "Date: %s\n", fmt);
+	for (c = 0; c < el->el_natps; c++)
+	{
+		ea = &el->el_atpsjobs[c];
 
-	/* Subject: */
-	fprintf(out, "Subject: DKIM failure report for %s\n",
-	        dfc->mctx_jobid);
+		el->el_atps = ea->ea_atps;
+		if (ea->ea_status != DKIM_STAT_OK ||
+		    ea->ea_atps == DKIM_ATPS_FOUND)
+			break;
+	}
 
-	/* MIME stuff */
-	fprintf(out, "MIME-Version: 1.0\n");
-	fprintf(out,
-	        "Content-Type: multipart/report; report-type=feedback-report;\n\tboundary=\"dkimreport/%s/%s\"",
-	        hostname, dfc->mctx_jobid);
+	free(el->el_atpsjobs);
+	el->el_atpsjobs = NULL;
+}
+#endif /* _FFR_ATPS */
 
-	/* ok, now then... */
-	fprintf(out, "\n");
+#ifdef _FFR_VBR
+/*
+**  DKIMF_EOM_VBR -- EOM lookup: query one VBR certifier
+**
+**  Parameters:
+**  	ej -- lookup (a struct eomvbr)
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	A lookup with no handle of its own asks only its certifier, using
+**  	a handle made for it here; VBR handles can't be shared between
+**  	threads.
+*/
 
-	/* first part: a text blob explaining what this is */
-	fprintf(out, "--dkimreport/%s/%s\n", hostname, dfc->mctx_jobid);
-	fprintf(out, "Content-Type: text/plain\n");
-	fprintf(out, "\n");
-	fprintf(out, "DKIM failure report for job %s on %s\n\n",
-	        dfc->mctx_jobid, hostname);
-	fprintf(out,
-	        "The canonicalized form of the failed message's header and body are\nattached.\n");
-	fprintf(out, "\n");
+static void
+dkimf_eom_vbr(struct eomjob *ej)
+{
+	const u_char *err;
+	u_char *cert = NULL;
+	struct eomvbr *ev;
+	struct eomlookups *el;
+	VBR *vbr;
 
-	/* second part: formatted gunk */
-	memset(ipstr, '\0', sizeof ipstr);
+	ev = (struct eomvbr *) ej;
+	el = ej->ej_lookups;
 
-	switch (cc->cctx_ip.ss_family)
+	vbr = ev->ev_vbr;
+	if (vbr == NULL)
 	{
-	  case AF_INET:
-	  {
-		struct sockaddr_in sin4;
-
-		memcpy(&sin4, &cc->cctx_ip, sizeof sin4);
+		vbr = dkimf_vbr_new(el->el_conf,
+		                    (char *) el->el_msg->mctx_jobid);
+		if (vbr == NULL)
+		{
+			ev->ev_status = VBR_STAT_NORESOURCE;
+			strlcpy(ev->ev_error, "can't create VBR context",
+			        sizeof ev->ev_error);
+			return;
+		}
 
-		(void) inet_ntop(AF_INET, &sin4.sin_addr, ipstr, sizeof ipstr);
+		ev->ev_trusted[0] = (u_char *) ev->ev_cert;
+		ev->ev_trusted[1] = NULL;
+		vbr_trustedcerts(vbr, ev->ev_trusted);
+		vbr_setcert(vbr, (u_char *) ev->ev_cert);
+		vbr_settype(vbr, (u_char *) el->el_vbrtype);
+		vbr_setdomain(vbr, (u_char *) el->el_vbrdomain);
+	}
 
-		break;
-	  }
+	ev->ev_status = vbr_query(vbr, (u_char **) &ev->ev_result, &cert);
+	if (ev->ev_status == VBR_STAT_OK && cert != NULL)
+		strlcpy(ev->ev_cert, (char *) cert, sizeof ev->ev_cert);
 
-#ifdef AF_INET6
-	  case AF_INET6:
-	  {
-		struct sockaddr_in6 sin6;
+	err = vbr_geterror(vbr);
+	if (err != NULL)
+		strlcpy(ev->ev_error, (char *) err, sizeof ev->ev_error);
 
-		memcpy(&sin6, &cc->cctx_ip, sizeof sin6);
+	if (vbr != ev->ev_vbr)
+		vbr_close(vbr);
+}
 
-		(void) inet_ntop(AF_INET6, &sin6.sin6_addr, ipstr, sizeof ipstr);
+/*
+**  DKIMF_EOM_VBR_START -- start the queries of the certifiers named in
+**                         VBR-Info
+**
+**  Parameters:
+**  	el -- EOM lookup set
+**  	set -- job set the queries join
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Only the first VBR-Info field is evaluated.  When more than one
+**  	trusted certifier is named, each gets its own query so the round
+**  	trips overlap; otherwise the message's own handle is used, as
+**  	vbr_query() would be.
+*/
 
-		break;
-	  }
-#endif /* AF_INET6 */
-	}
+static void
+dkimf_eom_vbr_start(struct eomlookups *el, struct dkimf_jobset *set)
+{
+	_Bool vbr_validsig = FALSE;
+	int c;
+	int n;
+	int nsigs;
+	char *vbr_domain = NULL;
+	char *p;
+	char *sctx;
+	char *eq;
+	u_char *param;
+	u_char *value;
+	u_char **trusted;
+	struct eomvbr *ev;
+	DKIM_SIGINFO **sigs;
+	Header vbr_header;
+	msgctx dfc;
+	struct dkimf_config *conf;
+	char certs[DKIM_MAXHEADER + 1];
 
-	hdr = dkimf_findheader(dfc, (char *) "Message-ID", 0);
+	dfc = el->el_msg;
+	conf = el->el_conf;
 
-	fprintf(out, "--dkimreport/%s/%s\n", hostname, dfc->mctx_jobid);
-	fprintf(out, "Content-Type: message/feedback-report\n");
-	fprintf(out, "\n");
-	fprintf(out, "User-Agent: %s/%s\n", DKIMF_PRODUCTNS, VERSION);
-	fprintf(out, "Version: %s\n", ARF_VERSION);
-	fprintf(out, "Original-Envelope-Id: %s\n", dfc->mctx_jobid);
-	fprintf(out, "Original-Mail-From: %s\n", dfc->mctx_envfrom);
-	fprintf(out, "Reporting-MTA: %s\n", hostname);
-	fprintf(out, "Source-IP: %s\n", ipstr);
-	fprintf(out, "Message-ID:%s%s\n",
-	        cc->cctx_noleadspc ? "" : " ",
-	        hdr == NULL ? "(none)" : hdr->hdr_val);
-	fprintf(out, "Arrival-Date: %s\n", fmt);
-	fprintf(out, "Reported-Domain: %s\n", dkim_sig_getdomain(sig));
-	fprintf(out, "Delivery-Result: other\n");
-	fprintf(out, "Feedback-Type: %s\n", arf_type_string(arftype));
-	if (arftype == ARF_TYPE_AUTHFAIL)
-	{
-		fprintf(out, "Auth-Failure: ");
-		if (dkim_sig_getbh(sig) == DKIM_SIGBH_MISMATCH)
-		{
-			fprintf(out, "bodyhash\n");
-		}
-		else
-		{
-			const char *tmperror;
+	el->el_run[EOMSTAGE_VBR] = TRUE;
 
-			switch (dkim_sig_geterror(sig))
-			{
-			  case DKIM_SIGERROR_KEYREVOKED:
-				fprintf(out, "revoked\n");
-				break;
+	vbr_header = dkimf_findheader(dfc, VBR_INFOHEADER, 0);
+	if (vbr_header == NULL)
+		return;
 
-			  default:
-				tmperror = dkim_sig_geterrorstr(dkim_sig_geterror(sig));
-				fprintf(out, "signature");
-				if (tmperror != NULL)
-					fprintf(out, " (%s)", tmperror);
-				fprintf(out, "\n");
-				break;
-			}
-		}
+	el->el_vbrstatus = VBR_STAT_OK;
+	el->el_vbrresult = "none";
+	el->el_vbrcertifier = NULL;
+	el->el_vbrdone = TRUE;
 
-		memset(addr, '\0', sizeof addr);
-		dkim_sig_getidentity(dfc->mctx_dkimv, sig, addr,
-		                     sizeof addr - 1);
+	/* break out the VBR-Info header contents */
+	strlcpy(el->el_vbrinfo, vbr_header->hdr_val, sizeof el->el_vbrinfo);
+	for (p = strtok_r(el->el_vbrinfo, ";", &sctx);
+	     p != NULL;
+	     p = strtok_r(NULL, ";", &sctx))
+	{
+		eq = strchr(p, '=');
+		if (eq == NULL)
+			continue;
+		*eq = '\0';
 
-		/* fprintf(out, "Authentication-Results: %s\n", ...); */
-		fprintf(out, "DKIM-Failure: %s\n",
-		        arf_dkim_failure_string(arfdkim));
-		fprintf(out, "DKIM-Domain: %s\n", dkim_sig_getdomain(sig));
-		fprintf(out, "DKIM-Selector: %s\n", dkim_sig_getselector(sig));
-		fprintf(out, "DKIM-Identity: %s\n", addr);
-		if (hfd != -1)
+		for (param = (u_char *) p; *param != '\0'; param++)
 		{
-			fprintf(out, "DKIM-Canonicalized-Header: ");
-			(void) dkimf_base64_encode_file(hfd, out, 4, 75, 27);
-			fprintf(out, "\n");
+			if (!(isascii(*param) && isspace(*param)))
+				break;
 		}
-		if (bfd != -1)
+		dkimf_trimspaces(param);
+
+		for (value = (u_char *) eq + 1; *value != '\0'; value++)
 		{
-			fprintf(out, "DKIM-Canonicalized-Body: ");
-			(void) dkimf_base64_encode_file(bfd, out, 4, 75, 25);
-			fprintf(out, "\n");
+			if (!(isascii(*value) && isspace(*value)))
+				break;
 		}
+		dkimf_trimspaces(value);
+
+		if (strcasecmp((char *) param, "md") == 0)
+			vbr_domain = (char *) value;
+		else if (strcasecmp((char *) param, "mc") == 0)
+			el->el_vbrtype = (char *) value;
+		else if (strcasecmp((char *) param, "mv") == 0)
+			el->el_vbrvouchers = (char *) value;
 	}
 
-	fprintf(out, "\n");
+	if (vbr_domain == NULL)
+		return;
 
-	/* third part: header block */
-	fprintf(out, "--dkimreport/%s/%s\n", hostname, dfc->mctx_jobid);
-	fprintf(out, "Content-Type: text/rfc822-headers\n");
-	fprintf(out, "\n");
+	strlcpy(el->el_vbrdomain, vbr_domain, sizeof el->el_vbrdomain);
 
-	for (hdr = dfc->mctx_hqhead; hdr != NULL; hdr = hdr->hdr_next)
+	/* confirm a valid signature was there */
+	if (dfc->mctx_dkimv != NULL &&
+	    dkim_getsiglist(dfc->mctx_dkimv, &sigs, &nsigs) == DKIM_STAT_OK)
 	{
-		fprintf(out, "%s:%s%s\n", hdr->hdr_hdr,
-		        cc->cctx_noleadspc ? "" : " ", hdr->hdr_val);
+		u_char *d;
+
+		for (c = 0; c < nsigs; c++)
+		{
+			d = dkim_sig_getdomain(sigs[c]);
+			if (strcasecmp((char *) d, vbr_domain) == 0 &&
+			    (dkim_sig_getflags(sigs[c]) & DKIM_SIGFLAG_PASSED) != 0 &&
+			    dkim_sig_getbh(sigs[c]) == DKIM_SIGBH_MATCH)
+			{
+				vbr_validsig = TRUE;
+				break;
+			}
+		}
 	}
 
-	/* end */
-	fprintf(out, "\n--dkimreport/%s/%s--\n", hostname, dfc->mctx_jobid);
+	if (!vbr_validsig)
+		return;
 
-	/* send it */
-#ifdef HAVE_CURL_EASY_SETOPT
-	if (conf->conf_smtpuri != NULL)
+	/* count the certifiers vbr_query() would ask */
+	n = 0;
+	trusted = conf->conf_vbr_trusted;
+	if (trusted != NULL && el->el_vbrtype != NULL &&
+	    el->el_vbrvouchers != NULL)
 	{
-		CURLcode cc;
-		CURL *curl;
-		struct curl_slist *rcpts = NULL;
-		char dest[MAXADDRESS + 1];
-
-		(void) fseek(out, SEEK_SET, 0);
-
-		curl = curl_easy_init();
-		if (curl == NULL)
+		if (conf->conf_vbr_trustedonly)
 		{
-			if (conf->conf_dolog)
-			{
-				syslog(LOG_ERR, "%s: curl_easy_init() failed",
-				       dfc->mctx_jobid);
-			}
+			for (n = 0; trusted[n] != NULL; n++)
+				continue;
 		}
 		else
 		{
-			cc = curl_easy_setopt(curl, CURLOPT_URL,
-			                      conf->conf_smtpuri);
-
-			if (cc == CURLE_OK)
+			strlcpy(certs, el->el_vbrvouchers, sizeof certs);
+			for (p = strtok_r(certs, ":", &sctx);
+			     p != NULL;
+			     p = strtok_r(NULL, ":", &sctx))
 			{
-				cc = curl_easy_setopt(curl, CURLOPT_READDATA,
-				                      out);
+				for (c = 0; trusted[c] != NULL; c++)
+				{
+					if (strcasecmp(p,
+					               (char *) trusted[c]) == 0)
+					{
+						n++;
+						break;
+					}
+				}
 			}
+		}
+	}
 
-			if (cc == CURLE_OK)
-			{
-				cc = curl_easy_setopt(curl, CURLOPT_MAIL_FROM,
-				                      reportaddr);
-			}
+	el->el_vbrjobs = (struct eomvbr *) malloc(sizeof(struct eomvbr) *
+	                                          (n > 1 ? n : 1));
+	if (el->el_vbrjobs == NULL)
+	{
+		el->el_vbrstatus = VBR_STAT_NORESOURCE;
+		return;
+	}
 
-			if (cc == CURLE_OK)
-			{
-				snprintf(dest, sizeof dest, "%s@%s", addr,
-				         dkim_sig_getdomain(sig));
-				rcpts = curl_slist_append(rcpts, dest);
-				cc = curl_easy_setopt(curl, CURLOPT_MAIL_RCPT,
-				                      rcpts);
-			}
+	if (n <= 1)
+	{
+		/* one query (or none, or an error to report) */
+		ev = &el->el_vbrjobs[el->el_nvbr++];
+		memset(ev, '\0', sizeof *ev);
+		ev->ev_vbr = dfc->mctx_vbr;
 
-			if (cc != CURLE_OK)
-			{
-				if (conf->conf_dolog)
-				{
-					syslog(LOG_ERR,
-					       "%s: curl_easy_setopt() failed",
-					       dfc->mctx_jobid);
-				}
-			}
-			else
-			{
-				cc = curl_easy_perform(curl);
-				if (cc != CURLE_OK && conf->conf_dolog)
-				{
-					syslog(LOG_ERR,
-					       "%s: curl_easy_perform() to %s failed: %s",
-					       dfc->mctx_jobid, dest,
-					       curl_easy_strerror(cc));
-				}
-			}
+		if (el->el_vbrvouchers != NULL)
+			vbr_setcert(dfc->mctx_vbr, (u_char *) el->el_vbrvouchers);
+		if (el->el_vbrtype != NULL)
+			vbr_settype(dfc->mctx_vbr, (u_char *) el->el_vbrtype);
+		vbr_setdomain(dfc->mctx_vbr, (u_char *) el->el_vbrdomain);
 
-			curl_slist_free_all(rcpts);
+		dkimf_eom_add(el, set, &ev->ev_job, EOMSTAGE_VBR,
+		              dkimf_eom_vbr);
+		return;
+	}
 
-			curl_easy_cleanup(curl);
+	if (conf->conf_vbr_trustedonly)
+	{
+		for (c = 0; c < n; c++)
+		{
+			ev = &el->el_vbrjobs[el->el_nvbr++];
+			memset(ev, '\0', sizeof *ev);
+			strlcpy(ev->ev_cert, (char *) trusted[c],
+			        sizeof ev->ev_cert);
 		}
 	}
 	else
 	{
-		status = pclose(out);
-		if (status != 0 && conf->conf_dolog)
+		strlcpy(certs, el->el_vbrvouchers, sizeof certs);
+		for (p = strtok_r(certs, ":", &sctx);
+		     p != NULL;
+		     p = strtok_r(NULL, ":", &sctx))
 		{
-			syslog(LOG_ERR, "%s: pclose(): returned status %d",
-			       dfc->mctx_jobid, status);
+			for (c = 0; trusted[c] != NULL; c++)
+			{
+				if (strcasecmp(p, (char *) trusted[c]) == 0)
+					break;
+			}
+
+			if (trusted[c] == NULL)
+				continue;
+
+			ev = &el->el_vbrjobs[el->el_nvbr++];
+			memset(ev, '\0', sizeof *ev);
+			strlcpy(ev->ev_cert, p, sizeof ev->ev_cert);
 		}
 	}
-#else /* HAVE_CURL_EASY_SETOPT */
-	status = pclose(out);
-	if (status != 0 && conf->conf_dolog)
+
+	for (c = 0; c < el->el_nvbr; c++)
 	{
-		syslog(LOG_ERR, "%s: pclose(): returned status %d",
-		       dfc->mctx_jobid, status);
+		dkimf_eom_add(el, set, &el->el_vbrjobs[c].ev_job,
+		              EOMSTAGE_VBR, dkimf_eom_vbr);
 	}
-#endif /* HAVE_CURL_EASY_SETOPT */
 }
 
 /*
-**  DKIMF_AR_ALL_SIGS -- append Authentication-Results items for all signatures
+**  DKIMF_EOM_VBR_FINISH -- combine the VBR query results
 **
 **  Parameters:
-**  	hdr -- header buffer
-** 	hdrlen -- size of header buffer
-**  	tmpstr -- a dstring to construct the result
-**  	dkim -- DKIM verification handle
-**  	conf -- config object
-**  	status -- message context status (may be updated)
+**  	el -- EOM lookup set
 **
 **  Return value:
-**  	FALSE iff the filter should reject the message based on results.
+**  	None.
+**
+**  Notes:
+**  	As with vbr_query(), certifiers are taken in order: the first
+**  	that vouches or fails decides the outcome, and "fail" means none
+**  	of them vouched.
 */
 
-void
-dkimf_ar_all_sigs(char *hdr, size_t hdrlen, struct dkimf_dstring *tmpstr,
-                  DKIM *dkim, struct dkimf_config *conf, int *status)
+static void
+dkimf_eom_vbr_finish(struct eomlookups *el)
 {
-	int nsigs;
-	DKIM_STAT dstatus;
-	DKIM_SIGINFO **sigs;
+	int c;
+	struct eomvbr *ev;
 
-	assert(hdr != NULL);
-	assert(tmpstr != NULL);
-	assert(dkim != NULL);
-	assert(conf != NULL);
-	assert(status != NULL);
+	for (c = 0; c < el->el_nvbr; c++)
+		dkimf_eom_done(el, &el->el_vbrjobs[c].ev_job);
 
-	dstatus = dkim_getsiglist(dkim, &sigs, &nsigs);
-	if (dstatus == DKIM_STAT_OK)
+	for (c = 0; c < el->el_nvbr; c++)
 	{
-		int c;
-		int sigerror;
-		DKIM_STAT ts;
-		u_int keybits;
-		size_t ssl;
-		char *result;
-		char *dnssec;
-		char *domain;
-		char *selector;
-		char *algorithm;
-		char ss[BUFRSZ + 1];
-		char tmp[BUFRSZ + 1];
-		char val[MAXADDRESS + 1];
-		char comment[BUFRSZ + 1];
+		ev = &el->el_vbrjobs[c];
 
-		for (c = 0; c < nsigs; c++)
+		if (ev->ev_status != VBR_STAT_OK)
 		{
-			dnssec = NULL;
+			el->el_vbrstatus = ev->ev_status;
+			strlcpy(el->el_vbrerror, ev->ev_error,
+			        sizeof el->el_vbrerror);
+			break;
+		}
 
-			memset(comment, '\0', sizeof comment);
+		el->el_vbrresult = ev->ev_result;
 
-			sigerror = dkim_sig_geterror(sigs[c]);
+		if (ev->ev_result != NULL &&
+		    strcasecmp(ev->ev_result, "pass") == 0)
+		{
+			strlcpy(el->el_vbrcert, ev->ev_cert,
+			        sizeof el->el_vbrcert);
+			el->el_vbrcertifier = el->el_vbrcert;
+			break;
+		}
+	}
 
-			if (dkim_sig_getkeysize(sigs[c],
-			                        &keybits) != DKIM_STAT_OK)
-				keybits = 0;
+	free(el->el_vbrjobs);
+	el->el_vbrjobs = NULL;
+}
+#endif /* _FFR_VBR */
 
-			if (conf->conf_noheaderb)
-			{
-				ts = -1;
-			}
-			else
-			{
-				ssl = sizeof ss - 1;
-				ts = dkim_get_sigsubstring(dkim, sigs[c], ss,
-				                           &ssl);
-			}
+#ifdef _FFR_REPRRD
+/*
+**  DKIMF_EOM_REPRRD -- EOM lookup: load RRD predictions for the signers
+**
+**  Parameters:
+**  	ej -- lookup
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Results are discarded here; this just fills the reprrd cache so
+**  	the policy checks in mlfi_eom() don't wait on the RRD files.
+*/
 
-			if ((dkim_sig_getflags(sigs[c]) & DKIM_SIGFLAG_PASSED) != 0 &&
-			    dkim_sig_getbh(sigs[c]) == DKIM_SIGBH_MATCH)
-			{
-				result = "pass";
-			}
-			else if (sigerror == DKIM_SIGERROR_MULTIREPLY ||
-			         sigerror == DKIM_SIGERROR_KEYFAIL ||
-			         sigerror == DKIM_SIGERROR_DNSSYNTAX)
-			{
-				result = "temperror";
-			}
-			else if (sigerror == DKIM_SIGERROR_KEYTOOSMALL)
-			{
-				const char *err;
+static void
+dkimf_eom_reprrd(struct eomjob *ej)
+{
+	int c;
+	int nsigs;
+	int ret;
+	DKIM_SIGINFO **sigs;
+	struct eomlookups *el;
+	msgctx dfc;
 
-				result = "policy";
+	el = ej->ej_lookups;
+	dfc = el->el_msg;
 
-				err = dkim_sig_geterrorstr(dkim_sig_geterror(sigs[c]));
-				if (err != NULL)
-				{
-					snprintf(comment, sizeof comment,
-					         " reason=\"%s\"", err);
-				}
-			}
-			else if ((dkim_sig_getflags(sigs[c]) & DKIM_SIGFLAG_PROCESSED) != 0 &&
-			         ((dkim_sig_getflags(sigs[c]) & DKIM_SIGFLAG_PASSED) == 0 ||
-			          dkim_sig_getbh(sigs[c]) != DKIM_SIGBH_MATCH))
-			{
-				const char *err;
+	if (dkim_getsiglist(dfc->mctx_dkimv, &sigs, &nsigs) != DKIM_STAT_OK)
+		return;
 
-				result = "fail";
+	for (c = 0; c < nsigs; c++)
+	{
+		const char *cd;
 
-				err = dkim_sig_geterrorstr(dkim_sig_geterror(sigs[c]));
-				if (err != NULL)
-				{
-					snprintf(comment, sizeof comment,
-					         " reason=\"%s\"", err);
-				}
-			}
-			else if (sigerror != DKIM_SIGERROR_UNKNOWN &&
-			         sigerror != DKIM_SIGERROR_OK)
-			{
-				result = "permerror";
-			}
-			else
-			{
-				result = "neutral";
-			}
+		if ((dkim_sig_getflags(sigs[c]) & DKIM_SIGFLAG_PASSED) == 0 ||
+		    (dkim_sig_getflags(sigs[c]) & DKIM_SIGFLAG_TESTKEY) != 0 ||
+		    dkim_sig_getbh(sigs[c]) != DKIM_SIGBH_MATCH)
+			continue;
 
-			dnssec = NULL;
+		cd = (const char *) dkim_sig_getdomain(sigs[c]);
 
-			switch (dkim_sig_getdnssec(sigs[c]))
-			{
-			  case DKIM_DNSSEC_UNKNOWN:
-				break;
+		ret = 0;
+		(void) reprrd_query(el->el_conf->conf_reprrd, cd,
+		                    REPRRD_TYPE_MESSAGES, &ret, NULL, 0);
+		(void) reprrd_query(el->el_conf->conf_reprrd, cd,
+		                    REPRRD_TYPE_SPAM, &ret, NULL, 0);
+		(void) reprrd_query(el->el_conf->conf_reprrd, cd,
+		                    REPRRD_TYPE_LIMIT, &ret, NULL, 0);
+	}
+}
+#endif /* _FFR_REPRRD */
 
-			  case DKIM_DNSSEC_INSECURE:
-				dnssec = "unprotected";
-				if (conf->conf_unprotectedkey == DKIMF_KEYACTIONS_FAIL)
-				{
-					*status = DKIMF_STATUS_BAD;
-					result = "policy";
-				}
-				else if (conf->conf_unprotectedkey == DKIMF_KEYACTIONS_NEUTRAL)
-				{
-					*status = DKIMF_STATUS_VERIFYERR;
-					result = "neutral";
-				}
-				break;
+#ifdef _FFR_REPUTATION
+/*
+**  DKIMF_EOM_REPUTATION -- EOM lookup: start reputation queries
+**
+**  Parameters:
+**  	ej -- lookup
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	dkimf_rep_prefetch() already runs the queries for all of the
+**  	signers at once.
+*/
 
-			  case DKIM_DNSSEC_BOGUS:
-				dnssec = "bogus";
-				if (conf->conf_boguskey == DKIMF_KEYACTIONS_FAIL)
-				{
-					*status = DKIMF_STATUS_BAD;
-				}
-				else if (conf->conf_boguskey == DKIMF_KEYACTIONS_NEUTRAL)			{
-					*status = DKIMF_STATUS_VERIFYERR;
-					result = "neutral";
-				}
-				break;
+static void
+dkimf_eom_reputation(struct eomjob *ej)
+{
+	int c;
+	int nsigs;
+	unsigned int n = 0;
+	DKIM_SIGINFO **sigs;
+	const char **signers;
+	struct eomlookups *el;
+	msgctx dfc;
 
-			  case DKIM_DNSSEC_SECURE:
-				dnssec = "secure";
-				break;
-			}
+	el = ej->ej_lookups;
+	dfc = el->el_msg;
 
-			memset(val, '\0', sizeof val);
+	if (dkim_getsiglist(dfc->mctx_dkimv, &sigs, &nsigs) != DKIM_STAT_OK ||
+	    nsigs == 0)
+		return;
 
-			(void) dkim_sig_getidentity(dkim, sigs[c],
-			                            val, sizeof val - 1);
+	signers = (const char **) malloc(sizeof(char *) * nsigs);
+	if (signers == NULL)
+		return;
 
-			domain = dkim_sig_getdomain(sigs[c]);
-			selector = dkim_sig_getselector(sigs[c]);
-			algorithm = dkim_sig_getalgorithm(sigs[c]);
+	for (c = 0; c < nsigs; c++)
+	{
+		if ((dkim_sig_getflags(sigs[c]) & DKIM_SIGFLAG_PASSED) == 0 ||
+		    (dkim_sig_getflags(sigs[c]) & DKIM_SIGFLAG_TESTKEY) != 0 ||
+		    dkim_sig_getbh(sigs[c]) != DKIM_SIGBH_MATCH)
+			continue;
 
- 			dkimf_dstring_blank(tmpstr);
- 			dkimf_dstring_printf(tmpstr, "%s%s",
- 			                     c == 0 ? "" : ";", DELIMITER);
- 			dkimf_dstring_printf(tmpstr, "dkim=%s", result);
- 			dkimf_dstring_printf(tmpstr, comment);
- 			if (keybits > 0)
- 			{
- 				dkimf_dstring_printf(tmpstr,
- 				                     " (%u-bit key%s%s)",
- 				                     keybits,
- 				                     dnssec == NULL ? ""
- 				                                    : ", ",
- 				                     dnssec == NULL ? ""
- 				                                    : dnssec);
- 			}
- 			dkimf_dstring_printf(tmpstr,
- 			                     " header.d=%s header.i=%s header.a=%s header.s=%s",
- 			                     domain, val, algorithm, selector);
- 			if (ts == DKIM_STAT_OK)
- 			{
- 				dkimf_dstring_printf(tmpstr, " header.b=%s",
- 				                     ss);
- 			}
- 
- 			strlcat(hdr, dkimf_dstring_get(tmpstr), hdrlen);
- 		}
+		signers[n++] = (const char *) dkim_sig_getdomain(sigs[c]);
 	}
+
+	dkimf_rep_prefetch(el->el_conf->conf_rep, signers, n);
+
+	free(signers);
 }
+#endif /* _FFR_REPUTATION */
 
-#ifdef _FFR_CONDITIONAL
 /*
-**  DKIMF_CHECK_CONDITIONAL -- apply any conditional signature needed
+**  DKIMF_EOM_LOOKUPS -- run the external lookups for a verified message
 **
 **  Parameters:
-**  	dfc -- message context
-**  	conf -- configuration
-**  	sr -- a signing request
+**  	el -- EOM lookup set
 **
 **  Return value:
-**  	Status from dkim_conditional, if any.
-*/
-
-static DKIM_STAT
-dkimf_check_conditional(struct msgctx *dfc, struct dkimf_config *conf,
-                        struct signreq *sr)
-{
-	_Bool found;
-	size_t len;
-	DKIM_STAT status;
-	struct dkimf_dstring *dstr = NULL;
-	struct addrlist *a;
-	struct signreq *newsr_head = NULL;
-	struct signreq *newsr_tail = NULL;
-	char *at;
-
-	dstr = dkimf_dstring_new(BUFRSZ, 0);
-	dkimf_dstring_cat(dstr, dfc->mctx_domain);
-	dkimf_dstring_cat1(dstr, ':');
-	len = dkimf_dstring_len(dstr);
+**  	None.
+**
+**  Notes:
+**  	Every lookup that applies -- one per third-party signature for
+**  	ATPS, one per trusted certifier for VBR, and the RRD and
+**  	reputation loads -- is handed to the shared lookup pool at once
+**  	and then waited for together, so the round trips overlap rather
+**  	than add up.  The pool is a fixed size (LookupThreads); whatever
+**  	it hasn't picked up by then is run here.  The lookups only gather
+**  	data; acting on it (header changes, logging of policy results)
+**  	stays in mlfi_eom().
+*/
 
-	for (a = dfc->mctx_rcptlist; a != NULL; a = a->a_next)
-	{
-		dkimf_dstring_chop(dstr, len);
+static void
+dkimf_eom_lookups(struct eomlookups *el)
+{
+	int c;
+	msgctx dfc;
+	struct dkimf_config *conf;
+	struct dkimf_jobset set;
+	struct timeval start;
+	struct timeval end;
 
-		at = strchr(a->a_addr, '@');
-		if (at == NULL)
-			continue;
+	assert(el != NULL);
 
-		dkimf_dstring_cat(dstr, at + 1);
+	dfc = el->el_msg;
+	conf = el->el_conf;
 
-		/*
-		**  Look for from/to pair in conditional DB; if found,
-		**  request a conditional signature with d= from-domain
-		**  and !cd= recipient domain, for now with l=0
-		*/
+	el->el_timing = (conf->conf_dolog && conf->conf_logresults);
 
-		found = FALSE;
-		if (dkimf_db_get(conf->conf_conditionaldb,
-		                 dkimf_dstring_get(dstr),
-		                 0, NULL, 0, &found) != 0)
-		{
-			if (conf->conf_dolog)
-				syslog(LOG_ERR, "dkimf_db_get() failed");
+	if (el->el_timing)
+		(void) gettimeofday(&start, NULL);
 
-			return DKIM_STAT_INTERNAL;
-		}
+	dkimf_jobs_newset(&set);
 
-		if (found)
-		{
-			int status;
-			struct signreq *newsr;
-			void *keydata;
-			unsigned char *sdomain;
-			unsigned char *selector;
+#ifdef _FFR_ATPS
+	el->el_atps = DKIM_ATPS_UNKNOWN;
+	if (dfc->mctx_status != DKIMF_STATUS_UNKNOWN && !el->el_authorsig)
+		dkimf_eom_atps_start(el, &set);
+#endif /* _FFR_ATPS */
+#ifdef _FFR_VBR
+	if (dkimf_valid_vbr(dfc))
+		dkimf_eom_vbr_start(el, &set);
+#endif /* _FFR_VBR */
+#ifdef _FFR_REPRRD
+	if (conf->conf_reprrd != NULL)
+	{
+		dkimf_eom_add(el, &set, &el->el_reprrd, EOMSTAGE_REPRRD,
+		              dkimf_eom_reprrd);
+	}
+#endif /* _FFR_REPRRD */
+#ifdef _FFR_REPUTATION
+	if (conf->conf_rep != NULL && !dfc->mctx_internal)
+	{
+		dkimf_eom_add(el, &set, &el->el_reputation,
+		              EOMSTAGE_REPUTATION, dkimf_eom_reputation);
+	}
+#endif /* _FFR_REPUTATION */
 
-			newsr = (struct signreq *) malloc(sizeof(struct signreq));
-			if (newsr == NULL)
-			{
-				if (conf->conf_dolog)
-					syslog(LOG_ERR, "malloc() failed");
+	dkimf_jobs_wait(&set);
 
-				return DKIM_STAT_NORESOURCE;
-			}
+#ifdef _FFR_ATPS
+	dkimf_eom_atps_finish(el);
+#endif /* _FFR_ATPS */
+#ifdef _FFR_VBR
+	dkimf_eom_vbr_finish(el);
+#endif /* _FFR_VBR */
+#ifdef _FFR_REPRRD
+	if (el->el_run[EOMSTAGE_REPRRD])
+		dkimf_eom_done(el, &el->el_reprrd);
+#endif /* _FFR_REPRRD */
+#ifdef _FFR_REPUTATION
+	if (el->el_run[EOMSTAGE_REPUTATION])
+		dkimf_eom_done(el, &el->el_reputation);
+#endif /* _FFR_REPUTATION */
 
-			memset(newsr, '\0', sizeof(*newsr));
+	if (el->el_timing)
+	{
+		static char *names[EOMSTAGE_MAX] =
+		{
+			"atps", "vbr", "reprrd", "reputation"
+		};
+		_Bool any = FALSE;
+		long total;
+		char timings[BUFRSZ + 1];
+		char tmp[BUFRSZ + 1];
 
-			if (sr->srq_keydata == NULL)
-			{
-				keydata = (dkim_sigkey_t) conf->conf_seckey;
-				sdomain = dfc->mctx_domain;
-				selector = conf->conf_selector;
-			}
-			else
-			{
-				keydata = sr->srq_keydata;
-				sdomain = sr->srq_domain;
-				selector = sr->srq_selector;
-			}
+		(void) gettimeofday(&end, NULL);
 
-			newsr->srq_dkim = dkim_sign(conf->conf_libopendkim,
-			                            dfc->mctx_jobid,
-			                            NULL,
-			                            keydata,
-			                            selector,
-			                            sdomain,
-			                            dfc->mctx_hdrcanon,
-			                            dfc->mctx_bodycanon,
-			                            dfc->mctx_signalg,
-			                            0, &status);
-			if (status != DKIM_STAT_OK)
-			{
-				if (conf->conf_dolog)
-					syslog(LOG_ERR, "dkim_sign() failed");
+		total = (end.tv_sec - start.tv_sec) * 1000000L +
+		        (end.tv_usec - start.tv_usec);
 
-				free(newsr);
-				return DKIM_STAT_INTERNAL;
-			}
+		timings[0] = '\0';
+		for (c = 0; c < EOMSTAGE_MAX; c++)
+		{
+			if (!el->el_run[c])
+				continue;
 
-			status = dkim_conditional(newsr->srq_dkim, at + 1);
-			if (status != DKIM_STAT_OK)
-			{
-				free(newsr);
-				return status;
-			}
+			any = TRUE;
 
-			if (newsr_head == NULL)
-			{
-				newsr_head = newsr;
-				newsr_tail = newsr;
-			}
-			else
-			{
-				newsr_tail->srq_next = newsr;
-				newsr_tail = newsr;
-			}
+			snprintf(tmp, sizeof tmp, " %s=%ld.%03ldms",
+			         names[c], el->el_usec[c] / 1000,
+			         el->el_usec[c] % 1000);
+			strlcat(timings, tmp, sizeof timings);
 		}
-	}
 
-	if (dfc->mctx_srtail != NULL && newsr_head != NULL)
-	{
-		dfc->mctx_srtail->srq_next = newsr_head;
-		dfc->mctx_srtail = newsr_tail;
+		if (any)
+		{
+			syslog(LOG_INFO, "%s: lookups done in %ld.%03ldms:%s",
+			       dfc->mctx_jobid, total / 1000, total % 1000,
+			       timings);
+		}
 	}
-
-	dkimf_dstring_free(dstr);
-
-	return DKIM_STAT_OK;
 }
-#endif /* _FFR_CONDITIONAL */
 
 /*
 **  END private section
@@ -10991,13 +13100,11 @@ mlfi_negotiate(SMFICTX *ctx,
 	connctx cc;
 	struct dkimf_config *conf;
 
-	dkimf_config_reload();
-
 	/* initialize connection context */
 	cc = malloc(sizeof(struct connctx));
 	if (cc == NULL)
 	{
-		if (curconf->conf_dolog)
+		if (dolog)
 		{
 			syslog(LOG_ERR, "mlfi_negotiate(): malloc(): %s",
 			       strerror(errno));
@@ -11008,13 +13115,8 @@ mlfi_negotiate(SMFICTX *ctx,
 
 	memset(cc, '\0', sizeof(struct connctx));
 
-	pthread_mutex_lock(&conf_lock);
-
-	cc->cctx_config = curconf;
-	curconf->conf_refcnt++;
-	conf = curconf;
-
-	pthread_mutex_unlock(&conf_lock);
+	conf = dkimf_config_acquire();
+	cc->cctx_config = conf;
 
 	/* verify the actions we need are available */
 	if (conf->conf_remarall ||
@@ -11048,9 +13150,7 @@ mlfi_negotiate(SMFICTX *ctx,
 			       f0, reqactions);
 		}
 
-		pthread_mutex_lock(&conf_lock);
-		conf->conf_refcnt--;
-		pthread_mutex_unlock(&conf_lock);
+		dkimf_config_release(conf);
 
 		free(cc);
 
@@ -11086,6 +13186,7 @@ mlfi_negotiate(SMFICTX *ctx,
 	if (conf->conf_macros != NULL && (wantactions & SMFIF_SETSYMLIST) != 0)
 	{
 		int c;
+		int status;
 		char macrolist[BUFRSZ];
 
 		memset(macrolist, '\0', sizeof macrolist);
@@ -11106,9 +13207,7 @@ mlfi_negotiate(SMFICTX *ctx,
 					       "mlfi_negotiate(): macro list overflow");
 				}
 
-				pthread_mutex_lock(&conf_lock);
-				conf->conf_refcnt--;
-				pthread_mutex_unlock(&conf_lock);
+				dkimf_config_release(conf);
 
 				free(cc);
 
@@ -11116,14 +13215,20 @@ mlfi_negotiate(SMFICTX *ctx,
 			}
 		}
 
-		if (smfi_setsymlist(ctx, SMFIM_EOH, macrolist) != MI_SUCCESS)
+#ifdef _FFR_EVENT_ENGINE
+		if (eventengine)
+			status = dkimf_engine_setsymlist(ctx, SMFIM_EOH,
+			                                 macrolist);
+		else
+#endif /* _FFR_EVENT_ENGINE */
+			status = smfi_setsymlist(ctx, SMFIM_EOH, macrolist);
+
+		if (status != MI_SUCCESS)
 		{
 			if (conf->conf_dolog)
 				syslog(LOG_ERR, "smfi_setsymlist() failed");
 
-			pthread_mutex_lock(&conf_lock);
-			conf->conf_refcnt--;
-			pthread_mutex_unlock(&conf_lock);
+			dkimf_config_release(conf);
 
 			free(cc);
 
@@ -11161,16 +13266,6 @@ mlfi_connect(SMFICTX *ctx, char *host, _SOCK_ADDR *ip)
 	connctx cc;
 	struct dkimf_config *conf;
 
-	dkimf_config_reload();
-
-	if (!dkimf_dns_init(curconf->conf_libopendkim, curconf, &err))
-	{
-		if (curconf->conf_dolog)
-			syslog(LOG_ERR, "can't initialize resolver: %s", err);
-
-		return SMFIS_TEMPFAIL;
-	}
-
 	/* copy hostname and IP information to a connection context */
 	cc = dkimf_getpriv(ctx);
 	if (cc == NULL)
@@ -11178,30 +13273,20 @@ mlfi_connect(SMFICTX *ctx, char *host, _SOCK_ADDR *ip)
 		cc = malloc(sizeof(struct connctx));
 		if (cc == NULL)
 		{
-			pthread_mutex_lock(&conf_lock);
-
-			if (curconf->conf_dolog)
+			if (dolog)
 			{
 				syslog(LOG_ERR, "%s malloc(): %s", host,
 				       strerror(errno));
 			}
 
-			pthread_mutex_unlock(&conf_lock);
-
 			/* XXX result should depend on On-InternalError */
 			return SMFIS_TEMPFAIL;
 		}
 
 		memset(cc, '\0', sizeof(struct connctx));
 
-		pthread_mutex_lock(&conf_lock);
-
-		cc->cctx_config = curconf;
-		curconf->conf_refcnt++;
-
-		conf = curconf;
-
-		pthread_mutex_unlock(&conf_lock);
+		conf = dkimf_config_acquire();
+		cc->cctx_config = conf;
 
 		dkimf_setpriv(ctx, cc);
 	}
@@ -11210,6 +13295,14 @@ mlfi_connect(SMFICTX *ctx, char *host, _SOCK_ADDR *ip)
 		conf = cc->cctx_config;
 	}
 
+	if (!dkimf_dns_init(conf->conf_libopendkim, conf, &err))
+	{
+		if (conf->conf_dolog)
+			syslog(LOG_ERR, "can't initialize resolver: %s", err);
+
+		return SMFIS_TEMPFAIL;
+	}
+
 	/* if the client is on an ignored host, then ignore it */
 	if (conf->conf_peerdb != NULL)
 	{
@@ -12094,7 +14187,7 @@ mlfi_eoh(SMFICTX *ctx)
 			if (conf->conf_keytabledb == NULL ||
 			    resignkey[0] == '\0')
 			{
-				status = dkimf_add_signrequest(dfc, NULL, NULL,
+				status = dkimf_add_signrequest(dfc, conf, NULL, NULL,
 				                               NULL,
 				                               (ssize_t) -1);
 
@@ -12113,7 +14206,7 @@ mlfi_eoh(SMFICTX *ctx)
 			}
 			else
 			{
-				status = dkimf_add_signrequest(dfc,
+				status = dkimf_add_signrequest(dfc, conf,
 				                               conf->conf_keytabledb,
 				                               resignkey,
 				                               NULL,
@@ -12371,7 +14464,7 @@ mlfi_eoh(SMFICTX *ctx)
 		char errkey[BUFRSZ + 1];
 
 		memset(errkey, '\0', sizeof errkey);
-		found = dkimf_apply_signtable(dfc, conf->conf_keytabledb,
+		found = dkimf_apply_signtable(dfc, conf, conf->conf_keytabledb,
 		                              conf->conf_signtabledb,
 		                              user, dfc->mctx_domain,
 		                              errkey, sizeof errkey,
@@ -12441,15 +14534,18 @@ mlfi_eoh(SMFICTX *ctx)
 	{
 		_Bool dofree = TRUE;
 		struct dkimf_lua_script_result lres;
+		uint64_t luastart;
 
 		memset(&lres, '\0', sizeof lres);
 
 		dfc->mctx_mresult = SMFIS_CONTINUE;
 
+		luastart = dkimf_trace_start(cc);
 		status = dkimf_lua_setup_hook(ctx, conf->conf_setupfunc,
 		                              conf->conf_setupfuncsz,
 		                              "setup script", &lres,
 		                              NULL, NULL);
+		dkimf_trace_add(cc, DKIMF_TRACE_LUA, luastart);
 
 		if (status != 0)
 		{
@@ -12498,7 +14594,7 @@ mlfi_eoh(SMFICTX *ctx)
 	/* create a default signing request if there was a domain match */
 	if (domainok && originok && dfc->mctx_srhead == NULL)
 	{
-		status = dkimf_add_signrequest(dfc, NULL, NULL, NULL,
+		status = dkimf_add_signrequest(dfc, conf, NULL, NULL, NULL,
 		                               (ssize_t) -1);
 
 		if (status != 0)
@@ -12910,105 +15006,13 @@ mlfi_eoh(SMFICTX *ctx)
 
 #ifdef _FFR_VBR
 	/* establish a VBR handle */
-	dfc->mctx_vbr = vbr_init(NULL, NULL, NULL);
+	dfc->mctx_vbr = dkimf_vbr_new(conf, (char *) dfc->mctx_jobid);
 	if (dfc->mctx_vbr == NULL)
 	{
-		if (conf->conf_dolog)
-		{
-			syslog(LOG_ERR, "%s: can't create VBR context",
-			       dfc->mctx_jobid);
-		}
-		dkimf_cleanup(ctx);
-		return SMFIS_TEMPFAIL;
-	}
-
-# ifdef USE_UNBOUND
-	dkimf_vbr_unbound_setup(dfc->mctx_vbr);
-# endif /* USE_UNBOUND */
-
-	if (conf->conf_vbr_trustedonly)
-		vbr_options(dfc->mctx_vbr, VBR_OPT_TRUSTEDONLY);
-
-	/* store the trusted certifiers */
-	if (conf->conf_vbr_trusted != NULL)
-		vbr_trustedcerts(dfc->mctx_vbr, conf->conf_vbr_trusted);
-
-	if (vbr_dns_init(dfc->mctx_vbr) != 0)
-	{
-		if (conf->conf_dolog)
-		{
-			syslog(LOG_ERR, "%s: can't initialize VBR resolver",
-			       dfc->mctx_jobid);
-		}
 		dkimf_cleanup(ctx);
 		return SMFIS_TEMPFAIL;
 	}
 
-	if (conf->conf_nslist != NULL)
-	{
-		status = vbr_dns_nslist(dfc->mctx_vbr, conf->conf_nslist);
-		if (status != VBR_STAT_OK)
-		{
-			if (conf->conf_dolog)
-			{
-				syslog(LOG_ERR,
-				       "%s: can't set VBR resolver list",
-				       dfc->mctx_jobid);
-			}
-			dkimf_cleanup(ctx);
-			return SMFIS_TEMPFAIL;
-		}
-	}
-
-	if (conf->conf_trustanchorpath != NULL)
-	{
-		if (access(conf->conf_trustanchorpath, R_OK) != 0)
-		{
-			if (conf->conf_dolog)
-			{
-				syslog(LOG_ERR,
-				       "%s: %s: access(): %s",
-				       dfc->mctx_jobid,
-				       conf->conf_trustanchorpath,
-				       strerror(errno));
-			}
-			dkimf_cleanup(ctx);
-			return SMFIS_TEMPFAIL;
-		}
-
-		status = vbr_dns_trustanchor(dfc->mctx_vbr,
-		                             conf->conf_trustanchorpath);
-		if (status != DKIM_STAT_OK)
-		{
-			if (conf->conf_dolog)
-			{
-				syslog(LOG_ERR,
-				       "%s: can't set VBR trust anchor from %s",
-				       dfc->mctx_jobid,
-				       conf->conf_trustanchorpath);
-			}
-			dkimf_cleanup(ctx);
-			return SMFIS_TEMPFAIL;
-		}
-	}
-
-	if (conf->conf_resolverconfig != NULL)
-	{
-		status = vbr_dns_config(dfc->mctx_vbr,
-		                        conf->conf_resolverconfig);
-		if (status != DKIM_STAT_OK)
-		{
-			if (conf->conf_dolog)
-			{
-				syslog(LOG_ERR,
-				       "%s: can't set VBR resolver configuration",
-				       dfc->mctx_jobid);
-			}
-			dkimf_cleanup(ctx);
-			return SMFIS_TEMPFAIL;
-		}
-	}
-
 	if (dfc->mctx_srhead != NULL)
 	{
 		Header newhdr;
@@ -13247,13 +15251,16 @@ mlfi_eoh(SMFICTX *ctx)
 	{
 		_Bool dofree = TRUE;
 		struct dkimf_lua_script_result lres;
+		uint64_t luastart;
 
 		memset(&lres, '\0', sizeof lres);
 
+		luastart = dkimf_trace_start(cc);
 		status = dkimf_lua_screen_hook(ctx, conf->conf_screenfunc,
 		                               conf->conf_screenfuncsz,
 		                               "screen script", &lres,
 		                               NULL, NULL);
+		dkimf_trace_add(cc, DKIMF_TRACE_LUA, luastart);
 
 		if (status != 0)
 		{
@@ -13460,6 +15467,7 @@ mlfi_eom(SMFICTX *ctx)
 	struct dkimf_config *conf;
 	DKIM_SIGINFO *sig = NULL;
 	Header hdr;
+	struct eomlookups eom;
 	unsigned char header[DKIM_MAXHEADER + 1];
 
 	assert(ctx != NULL);
@@ -14090,38 +16098,16 @@ mlfi_eom(SMFICTX *ctx)
 			dfc->mctx_dnssec_key = dkim_sig_getdnssec(sig);
 #endif /* USE_UNBOUND */
 
-#ifdef _FFR_ATPS
-		if (dfc->mctx_status != DKIMF_STATUS_UNKNOWN && !authorsig)
-		{
-			int nsigs;
-			dkim_atps_t atps = DKIM_ATPS_UNKNOWN;
-			DKIM_SIGINFO **sigs;
-
-			status = dkim_getsiglist(dfc->mctx_dkimv, &sigs, &nsigs);
-			if (status == DKIM_STAT_OK)
-			{
-				for (c = 0;
-				     c < nsigs && atps != DKIM_ATPS_FOUND;
-				     c++)
-				{
-					if ((dkim_sig_getflags(sigs[c]) & DKIM_SIGFLAG_PASSED) != 0 &&
-					    dkim_sig_getbh(sigs[c]) == DKIM_SIGBH_MATCH &&
-					    strcasecmp(dkim_sig_getdomain(sigs[c]),
-					               dfc->mctx_domain) != 0)
-					{
-						status = dkim_atps_check(dfc->mctx_dkimv,
-						                         sigs[c],
-						                         NULL,
-						                         &atps);
-
-						if (status != DKIM_STAT_OK)
-							break;
-					}
-				}
-
-				dfc->mctx_atps = atps;
-			}
-		}
+		/* start all of the external lookups at once */
+		memset(&eom, '\0', sizeof eom);
+		eom.el_msg = dfc;
+		eom.el_conf = conf;
+		eom.el_authorsig = authorsig;
+		dkimf_eom_lookups(&eom);
+
+#ifdef _FFR_ATPS
+		if (eom.el_run[EOMSTAGE_ATPS])
+			dfc->mctx_atps = eom.el_atps;
 #endif /* _FFR_ATPS */
 
 #ifdef _FFR_STATS
@@ -14133,15 +16119,18 @@ mlfi_eom(SMFICTX *ctx)
 			{
 				_Bool dofree = TRUE;
 				struct dkimf_lua_script_result lres;
+				uint64_t luastart;
 
 				memset(&lres, '\0', sizeof lres);
 
+				luastart = dkimf_trace_start(cc);
 				status = dkimf_lua_stats_hook(ctx,
 				                              conf->conf_statsfunc,
 				                              conf->conf_statsfuncsz,
 				                              "stats script",
 				                              &lres,
 				                              NULL, NULL);
+				dkimf_trace_add(cc, DKIMF_TRACE_LUA, luastart);
 
 				if (status != 0)
 				{
@@ -14436,7 +16425,7 @@ mlfi_eom(SMFICTX *ctx)
 					cd = dkim_sig_getdomain(sigs[c]);
 
 					status = dkimf_rep_check(conf->conf_rep,
-					                         sigs[c],
+					                         cd,
 					                         dfc->mctx_spam,
 					                         digest,
 					                         digest_len,  // Use the actual length
@@ -14811,218 +16800,105 @@ mlfi_eom(SMFICTX *ctx)
 			dkimf_sigreport(cc, conf, hostname);
 
 #ifdef _FFR_VBR
-	    	if (dkimf_valid_vbr(dfc))
+		if (eom.el_vbrdone)
 		{
 			_Bool add_vbr_header = FALSE;
-			_Bool vbr_validsig = FALSE;
-			VBR_STAT vbr_status = VBR_STAT_OK;
-			int c;
-			int nsigs;
 			char *vbr_result;
-			char *vbr_domain;
-			char *vbr_certifier;
-			char *vbr_vouchers;
-			char *vbr_type;
-			char *p;
-			char *sctx;
-			char *eq;
-			u_char *param;
-			u_char *value;
-			DKIM_SIGINFO **sigs;
-			Header vbr_header;
-			char tmp[DKIM_MAXHEADER + 1];
 
-			for (c = 0; ; c++)
-			{
-				vbr_header = dkimf_findheader(dfc,
-				                              VBR_INFOHEADER,
-				                              c);
-				if (vbr_header == NULL)
-					break;
+			vbr_result = eom.el_vbrresult;
 
-				vbr_result = "none";
-				vbr_domain = NULL;
-				vbr_certifier = NULL;
-				vbr_vouchers = NULL;
-				vbr_type = NULL;
-	
-				/* break out the VBR-Info header contents */
-				strlcpy(tmp, vbr_header->hdr_val, sizeof tmp);
-				for (p = strtok_r(tmp, ";", &sctx);
-				     p != NULL;
-				     p = strtok_r(NULL, ";", &sctx))
+			switch (eom.el_vbrstatus)
+			{
+			  case VBR_STAT_DNSERROR:
+				if (conf->conf_dolog)
 				{
-					eq = strchr(p, '=');
-					if (eq == NULL)
-						continue;
-					*eq = '\0';
-
-					for (param = (u_char *) p;
-					     *param != '\0';
-					     param++)
-					{
-						if (!(isascii(*param) &&
-						      isspace(*param)))
-							break;
-					}
-					dkimf_trimspaces(param);
+					const char *err;
 
-					for (value = (u_char *) eq + 1;
-					     *value != '\0';
-					     value++)
-					{
-						if (!(isascii(*value) &&
-						      isspace(*value)))
-							break;
-					}
-					dkimf_trimspaces(value);
+					err = eom.el_vbrerror;
+					if (*err == '\0')
+						err = NULL;
 
-					if (strcasecmp((char *) param,
-					               "md") == 0)
-					{
-						vbr_domain = (char *) value;
-					}
-					else if (strcasecmp((char *) param,
-					                    "mc") == 0)
-					{
-						vbr_type = (char *) value;
-					}
-					else if (strcasecmp((char *) param,
-					                    "mv") == 0)
-					{
-						vbr_vouchers = (char *) value;
-					}
+					syslog(LOG_NOTICE,
+					       "%s: can't verify VBR information%s%s",
+					       dfc->mctx_jobid,
+					       err == NULL ? "" : ": ",
+					       err == NULL ? "" : err);
 				}
-			
-				/* confirm a valid signature was there */
-				if (dfc->mctx_dkimv != NULL &&
-				    dkim_getsiglist(dfc->mctx_dkimv,
-				                    &sigs,
-				                    &nsigs) == DKIM_STAT_OK)
-				{
-					u_char *d;
 
-					for (c = 0; c < nsigs; c++)
-					{
-						d = dkim_sig_getdomain(sigs[c]);
-						if (strcasecmp((char *) d,
-						               vbr_domain) == 0 &&
-						    (dkim_sig_getflags(sigs[c]) & DKIM_SIGFLAG_PASSED) != 0 &&
-						    dkim_sig_getbh(sigs[c]) == DKIM_SIGBH_MATCH)
-						{
-							vbr_validsig = TRUE;
-							break;
-						}
-					}
-				}
-				
-				if (vbr_validsig)
-				{
-					/* use accessors to set parsed values */
-					vbr_setcert(dfc->mctx_vbr,
-					            (u_char *) vbr_vouchers);
-					vbr_settype(dfc->mctx_vbr,
-					            (u_char *) vbr_type);
-					vbr_setdomain(dfc->mctx_vbr,
-					              (u_char *) vbr_domain);
-		
-					/* attempt the query */
-					vbr_status = vbr_query(dfc->mctx_vbr,
-					                       (u_char **) &vbr_result,
-					                       (u_char **) &vbr_certifier);
-				}
+				add_vbr_header = TRUE;
+
+				vbr_result = "temperror";
+				break;
 
-				switch (vbr_status)
+			  case VBR_STAT_INVALID:
+			  case VBR_STAT_NORESOURCE:
+				if (conf->conf_dolog)
 				{
-				  case VBR_STAT_DNSERROR:
-					if (conf->conf_dolog)
-					{
-						const char *err;
+					const char *err;
 
-						err = (const char *) vbr_geterror(dfc->mctx_vbr);
+					err = eom.el_vbrerror;
+					if (*err == '\0')
+						err = NULL;
 
-						syslog(LOG_NOTICE,
-						       "%s: can't verify VBR information%s%s",
-						       dfc->mctx_jobid,
-						       err == NULL ? "" : ": ",
-						       err == NULL ? "" : err);
-					}
+					syslog(LOG_NOTICE,
+					       "%s: error handling VBR information%s%s",
+					       dfc->mctx_jobid,
+					       err == NULL ? "" : ": ",
+					       err == NULL ? "" : err);
+				}
 
-					add_vbr_header = TRUE;
+				add_vbr_header = TRUE;
 
+				if (eom.el_vbrstatus == VBR_STAT_INVALID)
 					vbr_result = "temperror";
-					break;
-
-				  case VBR_STAT_INVALID:
-				  case VBR_STAT_NORESOURCE:
-					if (conf->conf_dolog)
-					{
-						const char *err;
-
-						err = (const char *) vbr_geterror(dfc->mctx_vbr);
-
-						syslog(LOG_NOTICE,
-						       "%s: error handling VBR information%s%s",
-						       dfc->mctx_jobid,
-						       err == NULL ? "" : ": ",
-						       err == NULL ? "" : err);
-					}
+				else
+					vbr_result = "permerror";
 
-					add_vbr_header = TRUE;
+				break;
 
-					if (vbr_status == VBR_STAT_INVALID)
-						vbr_result = "temperror";
-					else
-						vbr_result = "permerror";
+			  case VBR_STAT_OK:
+				add_vbr_header = TRUE;
+				break;
 
-					break;
+			  default:
+				assert(0);
+			}
 
-				  case VBR_STAT_OK:
-					add_vbr_header = TRUE;
-					break;
+			if (add_vbr_header)
+			{
+				snprintf((char *) header,
+				         sizeof header,
+				         "%s%s%s%s vbr=%s header.md=%s",
+				         cc->cctx_noleadspc ? " " : "",
+				         authservid,
+				         conf->conf_authservidwithjobid ? "/"
+				                                        : "",
+				         conf->conf_authservidwithjobid ? (char *) dfc->mctx_jobid
+				                                        : "",
+				         vbr_result,
+				         eom.el_vbrdomain);
 
-				  default:
-					assert(0);
+				if (eom.el_vbrcertifier != NULL)
+				{
+					strlcat(header,
+					        " header.mv=",
+					        sizeof header);
+					strlcat(header,
+					        eom.el_vbrcertifier,
+					        sizeof header);
 				}
 
-				if (add_vbr_header)
+				if (dkimf_insheader(ctx, 1,
+				                    AUTHRESULTSHDR,
+				                    (char *) header) == MI_FAILURE)
 				{
-					snprintf((char *) header,
-					         sizeof header,
-					         "%s%s%s%s vbr=%s header.md=%s",
-					         cc->cctx_noleadspc ? " " : "",
-					         authservid,
-					         conf->conf_authservidwithjobid ? "/"
-					                                        : "",
-					         conf->conf_authservidwithjobid ? (char *) dfc->mctx_jobid
-					                                        : "",
-					         vbr_result,
-					         vbr_domain);
-
-					if (vbr_certifier != NULL)
-					{
-						strlcat(header,
-						        " header.mv=",
-						        sizeof header);
-						strlcat(header,
-						        vbr_certifier,
-						        sizeof header);
-					}
-		
-					if (dkimf_insheader(ctx, 1,
-					                    AUTHRESULTSHDR,
-					                    (char *) header) == MI_FAILURE)
+					if (conf->conf_dolog)
 					{
-						if (conf->conf_dolog)
-						{
-							syslog(LOG_ERR,
-							       "%s: %s header add failed",
-							       dfc->mctx_jobid,
-							       AUTHRESULTSHDR);
-						}
+						syslog(LOG_ERR,
+						       "%s: %s header add failed",
+						       dfc->mctx_jobid,
+						       AUTHRESULTSHDR);
 					}
-
-					break;
 				}
 			}
 		}
@@ -15088,15 +16964,18 @@ mlfi_eom(SMFICTX *ctx)
 	{
 		_Bool dofree = TRUE;
 		struct dkimf_lua_script_result lres;
+		uint64_t luastart;
 
 		memset(&lres, '\0', sizeof lres);
 
 		dfc->mctx_mresult = SMFIS_CONTINUE;
 
+		luastart = dkimf_trace_start(cc);
 		status = dkimf_lua_final_hook(ctx, conf->conf_finalfunc,
 		                              conf->conf_finalfuncsz,
 		                              "final script", &lres,
 		                              NULL, NULL);
+		dkimf_trace_add(cc, DKIMF_TRACE_LUA, luastart);
 
 		if (status != 0)
 		{
@@ -15407,56 +17286,304 @@ mlfi_close(SMFICTX *ctx)
 	cc = (connctx) dkimf_getpriv(ctx);
 	if (cc != NULL)
 	{
-		pthread_mutex_lock(&conf_lock);
+		dkimf_config_release(cc->cctx_config);
+
+		free(cc);
+		dkimf_setpriv(ctx, NULL);
+	}
+
+#ifdef QUERY_CACHE
+	if (querycache)
+	{
+		time_t now;
+
+		(void) time(&now);
+		if (cache_lastlog + CACHESTATSINT < now)
+		{
+			u_int c_hits;
+			u_int c_queries;
+			u_int c_expired;
+			u_int c_pct;
+			u_int c_keys;
 
-		cc->cctx_config->conf_refcnt--;
+			dkim_getcachestats(cc->cctx_config->conf_libopendkim,
+			                   &c_queries, &c_hits, &c_expired,
+			                   &c_keys, FALSE);
+
+			cache_lastlog = now;
+
+			if (c_queries == 0)
+				c_pct = 0;
+			else
+				c_pct = (c_hits * 100) / c_queries;
 
-		if (cc->cctx_config->conf_refcnt == 0 &&
-		    cc->cctx_config != curconf)
-			dkimf_config_free(cc->cctx_config);
+			syslog(LOG_INFO,
+			       "cache: %u quer%s, %u hit%s (%d%%), %u expired, %u key%s",
+			       c_queries, c_queries == 1 ? "y" : "ies",
+			       c_hits, c_hits == 1 ? "" : "s",
+			       c_pct, c_expired,
+			       c_keys, c_keys == 1 ? "" : "s");
+		}
+	}
+#endif /* QUERY_CACHE */
 
-		pthread_mutex_unlock(&conf_lock);
+	return SMFIS_CONTINUE;
+}
 
-		free(cc);
-		dkimf_setpriv(ctx, NULL);
+/*
+**  DKIMF_TRACE_BEGIN -- start timing a milter callback
+**
+**  Parameters:
+**  	ctx -- milter context
+**  	start -- callback start time (returned)
+**
+**  Return value:
+**  	The connection context if the callback is to be timed, else NULL.
+*/
+
+static connctx
+dkimf_trace_begin(SMFICTX *ctx, uint64_t *start)
+{
+	connctx cc;
+
+	cc = (connctx) dkimf_getpriv(ctx);
+	if (cc == NULL || !DKIMF_TRACING(cc->cctx_config))
+		return NULL;
+
+	*start = dkimf_trace_now();
+	dkimf_db_trace(&cc->cctx_trace.tr_db);
+
+	return cc;
+}
+
+/*
+**  DKIMF_TRACE_END -- finish timing a milter callback
+**
+**  Parameters:
+**  	cc -- connection context returned by dkimf_trace_begin()
+**  	stage -- DKIMF_TRACE_* constant
+**  	start -- callback start time
+**  	ret -- what the callback returned
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	The trace is logged at end-of-message, or earlier if the callback's
+**  	reply finished the transaction.  A rejected recipient does not.
+*/
+
+static void
+dkimf_trace_end(connctx cc, int stage, uint64_t start, sfsistat ret)
+{
+	if (cc == NULL)
+		return;
+
+	dkimf_db_trace(NULL);
+	dkimf_trace_add(cc, stage, start);
+
+	if (cc->cctx_trace.tr_jobid[0] == '\0' && cc->cctx_msg != NULL &&
+	    cc->cctx_msg->mctx_jobid != NULL)
+	{
+		strlcpy(cc->cctx_trace.tr_jobid,
+		        (char *) cc->cctx_msg->mctx_jobid,
+		        sizeof cc->cctx_trace.tr_jobid);
+	}
+
+	if (stage == DKIMF_TRACE_EOM ||
+	    (stage != DKIMF_TRACE_ENVRCPT && ret != SMFIS_CONTINUE
+#ifdef SMFIS_SKIP
+	     && ret != SMFIS_SKIP
+#endif /* SMFIS_SKIP */
+	     ))
+		dkimf_trace_log(cc, dkimf_trace_names[stage]);
+}
+
+/*
+**  DKIMF_TRACE_* -- milter callbacks wrapped to collect stage timings;
+**                   see the corresponding mlfi_*() functions
+*/
+
+static sfsistat
+dkimf_trace_connect(SMFICTX *ctx, char *host, _SOCK_ADDR *ip)
+{
+	uint64_t start;
+	sfsistat ret;
+	connctx cc;
+
+	/* there's no connection context yet */
+	if (!tracing)
+		return mlfi_connect(ctx, host, ip);
+
+	start = dkimf_trace_now();
+
+	ret = mlfi_connect(ctx, host, ip);
+
+	cc = (connctx) dkimf_getpriv(ctx);
+	if (cc != NULL && DKIMF_TRACING(cc->cctx_config))
+	{
+		cc->cctx_trace.tr_usec[DKIMF_TRACE_CONNECT] += dkimf_trace_now() -
+		                                               start;
+		cc->cctx_trace.tr_count[DKIMF_TRACE_CONNECT]++;
+	}
+
+	return ret;
+}
+
+#if SMFI_VERSION == 2
+static sfsistat
+dkimf_trace_helo(SMFICTX *ctx, char *helo)
+{
+	uint64_t start;
+	sfsistat ret;
+	connctx cc;
+
+	cc = (connctx) dkimf_getpriv(ctx);
+	if (cc == NULL || !DKIMF_TRACING(cc->cctx_config))
+		return mlfi_helo(ctx, helo);
+
+	start = dkimf_trace_now();
+
+	ret = mlfi_helo(ctx, helo);
+
+	cc->cctx_trace.tr_usec[DKIMF_TRACE_HELO] += dkimf_trace_now() - start;
+	cc->cctx_trace.tr_count[DKIMF_TRACE_HELO]++;
+
+	return ret;
+}
+#endif /* SMFI_VERSION == 2 */
+
+static sfsistat
+dkimf_trace_envfrom(SMFICTX *ctx, char **envfrom)
+{
+	int c;
+	uint64_t start;
+	sfsistat ret;
+	connctx cc;
+	struct dkimf_trace *tr;
+
+	cc = dkimf_trace_begin(ctx, &start);
+
+	/* an unfinished previous message is not reported */
+	if (cc != NULL)
+		cc->cctx_trace.tr_active = FALSE;
+
+	ret = mlfi_envfrom(ctx, envfrom);
+
+	if (cc != NULL)
+	{
+		tr = &cc->cctx_trace;
+
+		for (c = DKIMF_TRACE_ENVFROM; c < DKIMF_TRACE_MAX; c++)
+		{
+			tr->tr_usec[c] = 0;
+			tr->tr_count[c] = 0;
+		}
+		memset(&tr->tr_db, '\0', sizeof tr->tr_db);
+		tr->tr_jobid[0] = '\0';
+		tr->tr_start = start;
+		tr->tr_active = TRUE;
+
+		dkimf_trace_end(cc, DKIMF_TRACE_ENVFROM, start, ret);
 	}
 
-#ifdef QUERY_CACHE
-	if (querycache)
+	return ret;
+}
+
+static sfsistat
+dkimf_trace_envrcpt(SMFICTX *ctx, char **envrcpt)
+{
+	uint64_t start;
+	sfsistat ret;
+	connctx cc;
+
+	cc = dkimf_trace_begin(ctx, &start);
+	ret = mlfi_envrcpt(ctx, envrcpt);
+	dkimf_trace_end(cc, DKIMF_TRACE_ENVRCPT, start, ret);
+
+	return ret;
+}
+
+static sfsistat
+dkimf_trace_header(SMFICTX *ctx, char *headerf, char *headerv)
+{
+	uint64_t start;
+	sfsistat ret;
+	connctx cc;
+
+	cc = dkimf_trace_begin(ctx, &start);
+	ret = mlfi_header(ctx, headerf, headerv);
+	dkimf_trace_end(cc, DKIMF_TRACE_HEADER, start, ret);
+
+	return ret;
+}
+
+static sfsistat
+dkimf_trace_eoh(SMFICTX *ctx)
+{
+	uint64_t start;
+	sfsistat ret;
+	connctx cc;
+
+	cc = dkimf_trace_begin(ctx, &start);
+	ret = mlfi_eoh(ctx);
+	dkimf_trace_end(cc, DKIMF_TRACE_EOH, start, ret);
+
+	return ret;
+}
+
+static sfsistat
+dkimf_trace_body(SMFICTX *ctx, u_char *bodyp, size_t bodylen)
+{
+	uint64_t start;
+	sfsistat ret;
+	connctx cc;
+
+	cc = dkimf_trace_begin(ctx, &start);
+	ret = mlfi_body(ctx, bodyp, bodylen);
+	dkimf_trace_end(cc, DKIMF_TRACE_BODY, start, ret);
+
+	return ret;
+}
+
+static sfsistat
+dkimf_trace_eom(SMFICTX *ctx)
+{
+	uint64_t start;
+	sfsistat ret;
+	connctx cc;
+
+	cc = dkimf_trace_begin(ctx, &start);
+#ifdef _FFR_METRICS
+	if (cc == NULL && dkimf_metrics_enabled())
+		start = dkimf_trace_now();
+#endif /* _FFR_METRICS */
+	ret = mlfi_eom(ctx);
+#ifdef _FFR_METRICS
+	if (dkimf_metrics_enabled())
 	{
-		time_t now;
-
-		(void) time(&now);
-		if (cache_lastlog + CACHESTATSINT < now)
-		{
-			u_int c_hits;
-			u_int c_queries;
-			u_int c_expired;
-			u_int c_pct;
-			u_int c_keys;
+		dkimf_metrics_observe(DKIMF_MET_H_EOM,
+		                      dkimf_trace_now() - start);
+	}
+#endif /* _FFR_METRICS */
+	dkimf_trace_end(cc, DKIMF_TRACE_EOM, start, ret);
 
-			dkim_getcachestats(cc->cctx_config->conf_libopendkim,
-			                   &c_queries, &c_hits, &c_expired,
-			                   &c_keys, FALSE);
+	return ret;
+}
 
-			cache_lastlog = now;
+static sfsistat
+dkimf_trace_abort(SMFICTX *ctx)
+{
+	sfsistat ret;
+	connctx cc;
 
-			if (c_queries == 0)
-				c_pct = 0;
-			else
-				c_pct = (c_hits * 100) / c_queries;
+	ret = mlfi_abort(ctx);
 
-			syslog(LOG_INFO,
-			       "cache: %u quer%s, %u hit%s (%d%%), %u expired, %u key%s",
-			       c_queries, c_queries == 1 ? "y" : "ies",
-			       c_hits, c_hits == 1 ? "" : "s",
-			       c_pct, c_expired,
-			       c_keys, c_keys == 1 ? "" : "s");
-		}
-	}
-#endif /* QUERY_CACHE */
+	cc = (connctx) dkimf_getpriv(ctx);
+	if (cc != NULL)
+		dkimf_trace_log(cc, "abort");
 
-	return SMFIS_CONTINUE;
+	return ret;
 }
 
 /*
@@ -15468,19 +17595,19 @@ struct smfiDesc smfilter =
 	DKIMF_PRODUCT,	/* filter name */
 	SMFI_VERSION,	/* version code -- do not change */
 	0,		/* flags; updated in main() */
-	mlfi_connect,	/* connection info filter */
+	dkimf_trace_connect,	/* connection info filter */
 #if SMFI_VERSION == 2
-	mlfi_helo,	/* SMTP HELO command filter */
+	dkimf_trace_helo,	/* SMTP HELO command filter */
 #else /* SMFI_VERSION == 2 */
 	NULL,		/* SMTP HELO command filter */
 #endif /* SMFI_VERSION == 2 */
-	mlfi_envfrom,	/* envelope sender filter */
-	mlfi_envrcpt,	/* envelope recipient filter */
-	mlfi_header,	/* header filter */
-	mlfi_eoh,	/* end of header */
-	mlfi_body,	/* body block filter */
-	mlfi_eom,	/* end of message */
-	mlfi_abort,	/* message aborted */
+	dkimf_trace_envfrom,	/* envelope sender filter */
+	dkimf_trace_envrcpt,	/* envelope recipient filter */
+	dkimf_trace_header,	/* header filter */
+	dkimf_trace_eoh,	/* end of header */
+	dkimf_trace_body,	/* body block filter */
+	dkimf_trace_eom,	/* end of message */
+	dkimf_trace_abort,	/* message aborted */
 	mlfi_close,	/* shutdown */
 #if SMFI_VERSION > 2
 	NULL,		/* unrecognised command */
@@ -15560,6 +17687,18 @@ main(int argc, char **argv)
 	int maxrestartrate_n = 0;
 	int filemask = -1;
 	int mdebug = 0;
+#ifdef _FFR_EVENT_ENGINE
+	int engworkers = 0;
+#endif /* _FFR_EVENT_ENGINE */
+#ifdef _FFR_WORKERS
+	_Bool wrestart = FALSE;
+	int nworkers = 0;
+	int ncpus = 0;
+	int wlfd = -1;
+	int *cpus = NULL;
+	char *workercpus = NULL;
+	char wpath[MAXPATHLEN + 1];
+#endif /* _FFR_WORKERS */
 #ifdef HAVE_SMFI_VERSION
 	u_int mvmajor;
 	u_int mvminor;
@@ -15947,6 +18086,8 @@ main(int argc, char **argv)
 		return EX_CONFIG;
 	}
 
+	tracing = DKIMF_TRACING(curconf);
+
 	if (configonly)
 	{
 		config_free(cfg);
@@ -16294,6 +18435,20 @@ main(int argc, char **argv)
 
 		(void) config_get(cfg, "MilterDebug", &mdebug, sizeof mdebug);
 
+#ifdef _FFR_EVENT_ENGINE
+		(void) config_get(cfg, "EventEngine", &eventengine,
+		                  sizeof eventengine);
+		(void) config_get(cfg, "EventEngineWorkers", &engworkers,
+		                  sizeof engworkers);
+#endif /* _FFR_EVENT_ENGINE */
+
+#ifdef _FFR_WORKERS
+		(void) config_get(cfg, "Workers", &nworkers,
+		                  sizeof nworkers);
+		(void) config_get(cfg, "WorkerCPUs", &workercpus,
+		                  sizeof workercpus);
+#endif /* _FFR_WORKERS */
+
 		if (!gotp)
 		{
 			(void) config_get(cfg, "Socket", &sock, sizeof sock);
@@ -16353,6 +18508,65 @@ main(int argc, char **argv)
 		return EX_CONFIG;
 	}
 
+#ifdef _FFR_WORKERS
+	if (nworkers < 0 || nworkers > DKIMF_WORKERS_MAX)
+	{
+		fprintf(stderr, "%s: Workers must be between 0 and %d\n",
+		        progname, DKIMF_WORKERS_MAX);
+		return EX_CONFIG;
+	}
+
+# ifdef _FFR_RATE_LIMIT
+	/*
+	**  Each worker keeps its own flow table and checkpoints absolute
+	**  counts, so N workers would allow N times the configured rate
+	**  and overwrite each other's FlowData.
+	*/
+
+	if (nworkers > 1 &&
+	    (curconf->conf_ratelimitdb != NULL ||
+	     curconf->conf_flowdatadb != NULL))
+	{
+		fprintf(stderr,
+		        "%s: RateLimits and FlowData can't be used with more than one worker\n",
+		        progname);
+		return EX_CONFIG;
+	}
+
+	multiworker = (nworkers > 1);
+# endif /* _FFR_RATE_LIMIT */
+
+	if (workercpus != NULL)
+	{
+		char errbuf[BUFRSZ + 1];
+
+		if (dkimf_workers_cpus(workercpus, &cpus, &ncpus, errbuf,
+		                       sizeof errbuf) != 0)
+		{
+			fprintf(stderr, "%s: WorkerCPUs: %s\n", progname,
+			        errbuf);
+			return EX_CONFIG;
+		}
+	}
+
+# ifndef HAVE_SMFI_OPENSOCKET
+	/* the socket has to be open before the workers start */
+	if (nworkers > 1
+#  ifdef _FFR_EVENT_ENGINE
+	    && !eventengine
+#  endif /* _FFR_EVENT_ENGINE */
+	    )
+	{
+		fprintf(stderr,
+		        "%s: Workers requires smfi_opensocket() or EventEngine\n",
+		        progname);
+		return EX_CONFIG;
+	}
+# endif /* ! HAVE_SMFI_OPENSOCKET */
+
+	wpath[0] = '\0';
+#endif /* _FFR_WORKERS */
+
 	/* suppress a bunch of things if we're in test mode */
 	if (testmode)
 	{
@@ -16363,6 +18577,9 @@ main(int argc, char **argv)
 		become = NULL;
 		pidfile = NULL;
 		chrootdir = NULL;
+#ifdef _FFR_WORKERS
+		nworkers = 0;
+#endif /* _FFR_WORKERS */
 	}
 
 	dkimf_setmaxfd();
@@ -16533,6 +18750,15 @@ main(int argc, char **argv)
 
 	die = FALSE;
 
+#ifdef _FFR_WORKERS
+	/* with several workers, replacing them is the supervisor's job */
+	if (nworkers > 1)
+	{
+		wrestart = autorestart;
+		autorestart = FALSE;
+	}
+#endif /* _FFR_WORKERS */
+
 	if (autorestart)
 	{
 		_Bool quitloop = FALSE;
@@ -16988,9 +19214,73 @@ main(int argc, char **argv)
 			return EX_UNAVAILABLE;
 		}
 
+#ifdef _FFR_EVENT_ENGINE
+		/* or listen on it ourselves */
+		if (eventengine)
+		{
+			char errbuf[BUFRSZ + 1];
+
+# ifdef _FFR_WORKERS
+			/*
+			**  Workers start their own engines.  Each binds its
+			**  own "inet" socket with SO_REUSEPORT, so the kernel
+			**  spreads connections across them; a UNIX socket
+			**  can't be shared that way, so it's opened here and
+			**  inherited.
+			*/
+
+			status = MI_SUCCESS;
+			if (nworkers > 1)
+			{
+				if (dkimf_socket_local(sock) != NULL)
+				{
+					wlfd = dkimf_socket_listen(sock,
+					                           DKIMF_ENG_BACKLOG,
+					                           FALSE, FALSE,
+					                           wpath,
+					                           sizeof wpath,
+					                           errbuf,
+					                           sizeof errbuf);
+					if (wlfd == -1)
+						status = MI_FAILURE;
+				}
+			}
+			else
+# endif /* _FFR_WORKERS */
+			status = dkimf_engine_init(&smfilter, sock, engworkers,
+			                           DKIMF_ENG_DEFTIMEOUT, errbuf,
+			                           sizeof errbuf);
+
+			if (status != MI_SUCCESS)
+			{
+				if (curconf->conf_dolog)
+				{
+					syslog(LOG_ERR,
+					       "can't start event engine: %s",
+					       errbuf);
+				}
+
+				fprintf(stderr,
+				        "%s: can't start event engine: %s\n",
+				        progname, errbuf);
+
+				dkimf_zapkey(curconf);
+
+				if (!autorestart && pidfile != NULL)
+					(void) unlink(pidfile);
+
+				return EX_UNAVAILABLE;
+			}
+		}
+#endif /* _FFR_EVENT_ENGINE */
+
 #ifdef HAVE_SMFI_OPENSOCKET
 		/* try to establish the milter socket */
-		if (smfi_opensocket(FALSE) == MI_FAILURE)
+		if (
+# ifdef _FFR_EVENT_ENGINE
+		    !eventengine &&
+# endif /* _FFR_EVENT_ENGINE */
+		    smfi_opensocket(FALSE) == MI_FAILURE)
 		{
 			if (curconf->conf_dolog)
 				syslog(LOG_ERR, "smfi_opensocket() failed");
@@ -17049,9 +19339,11 @@ main(int argc, char **argv)
 		                    testpubkeys, strlen(testpubkeys));
 	}
 
-	pthread_mutex_init(&conf_lock, NULL);
 	pthread_mutex_init(&pwdb_lock, NULL);
 
+	/* "curconf" holds a reference to the configuration it points to */
+	curconf->conf_refcnt = 1;
+
 	/* perform test mode */
 	if (testfile != NULL)
 	{
@@ -17061,6 +19353,133 @@ main(int argc, char **argv)
 		return status;
 	}
 
+#ifdef _FFR_WORKERS
+	if (nworkers > 1)
+	{
+		int worker;
+		char *sockpath = NULL;
+
+# ifdef _FFR_METRICS
+		if (curconf->conf_metricssock != NULL)
+		{
+			char errbuf[BUFRSZ + 1];
+
+			if (dkimf_metrics_share(nworkers, errbuf,
+			                        sizeof errbuf) != 0)
+			{
+				if (curconf->conf_dolog)
+				{
+					syslog(LOG_ERR,
+					       "can't start metrics exporter: %s",
+					       errbuf);
+				}
+
+				if (pidfile != NULL)
+					(void) unlink(pidfile);
+
+				return EX_OSERR;
+			}
+		}
+# endif /* _FFR_METRICS */
+
+		/* libmilter removes a UNIX socket when smfi_main() returns */
+# ifdef _FFR_EVENT_ENGINE
+		if (!eventengine)
+# endif /* _FFR_EVENT_ENGINE */
+		sockpath = dkimf_socket_local(sock);
+
+		status = dkimf_workers(nworkers, cpus, ncpus, wrestart,
+		                       maxrestarts, maxrestartrate_n,
+		                       maxrestartrate_t, sockpath, &worker);
+		if (worker == -1)
+		{
+			if (wpath[0] != '\0')
+				(void) unlink(wpath);
+
+			dkimf_zapkey(curconf);
+
+			if (pidfile != NULL)
+				(void) unlink(pidfile);
+
+			if (curconf->conf_dolog)
+			{
+				syslog(LOG_INFO,
+				       "%s v%s supervisor terminating with status %d",
+				       DKIMF_PRODUCT, VERSION, status);
+			}
+
+			return status;
+		}
+
+		/* these belong to the supervisor */
+		pidfile = NULL;
+		wpath[0] = '\0';
+
+		/*
+		**  Open data sets and other handles of our own rather than
+		**  share the supervisor's descriptors with the other workers.
+		**  The inherited configuration is kept, unused, since strings
+		**  in main() point into it and closing its handles could
+		**  disturb connections the others still hold.
+		*/
+
+		if (conffile != NULL)
+		{
+			(void) dkimf_config_acquire();
+			reload = TRUE;
+			dkimf_config_reload();
+		}
+
+# ifdef _FFR_METRICS
+		if (curconf->conf_metricssock != NULL)
+			dkimf_metrics_worker(worker);
+# endif /* _FFR_METRICS */
+
+# ifdef _FFR_EVENT_ENGINE
+		if (eventengine)
+		{
+			_Bool shared;
+			char errbuf[BUFRSZ + 1];
+
+			shared = (wlfd != -1);
+			if (!shared)
+			{
+				wlfd = dkimf_socket_listen(sock,
+				                           DKIMF_ENG_BACKLOG,
+				                           FALSE, TRUE, wpath,
+				                           sizeof wpath, errbuf,
+				                           sizeof errbuf);
+			}
+
+			status = MI_FAILURE;
+			if (wlfd != -1)
+			{
+				dkimf_engine_setlistener(wlfd, shared);
+				status = dkimf_engine_init(&smfilter, sock,
+				                           engworkers,
+				                           DKIMF_ENG_DEFTIMEOUT,
+				                           errbuf,
+				                           sizeof errbuf);
+			}
+
+			if (status != MI_SUCCESS)
+			{
+				if (curconf->conf_dolog)
+				{
+					syslog(LOG_ERR,
+					       "worker %d: can't start event engine: %s",
+					       worker, errbuf);
+				}
+
+				dkimf_zapkey(curconf);
+
+				return EX_UNAVAILABLE;
+			}
+		}
+# endif /* _FFR_EVENT_ENGINE */
+	}
+#endif /* _FFR_WORKERS */
+
 	memset(argstr, '\0', sizeof argstr);
 	end = &argstr[sizeof argstr - 1];
 	n = sizeof argstr;
@@ -17125,6 +19544,97 @@ main(int argc, char **argv)
 	dkimf_stats_init();
 #endif /* _FFR_STATS */
 
+#ifdef _FFR_RATE_LIMIT
+	if (curconf->conf_flowdatadb != NULL)
+	{
+		status = dkimf_rate_init(curconf->conf_flowcheckpoint);
+		if (status != 0)
+		{
+			if (curconf->conf_dolog)
+			{
+				syslog(LOG_ERR,
+				       "can't start flow data checkpoint thread: %s",
+				       strerror(status));
+			}
+
+			if (!autorestart && pidfile != NULL)
+				(void) unlink(pidfile);
+
+			return EX_OSERR;
+		}
+	}
+#endif /* _FFR_RATE_LIMIT */
+
+#ifdef _FFR_METRICS
+	if (curconf->conf_metricssock != NULL)
+	{
+		char errbuf[BUFRSZ + 1];
+
+		if (dkimf_metrics_init(curconf->conf_metricssock,
+		                       dkimf_metrics_extra,
+		                       errbuf, sizeof errbuf) != 0)
+		{
+			if (curconf->conf_dolog)
+			{
+				syslog(LOG_ERR,
+				       "can't start metrics exporter: %s",
+				       errbuf);
+			}
+
+			if (!autorestart && pidfile != NULL)
+				(void) unlink(pidfile);
+
+			return EX_OSERR;
+		}
+
+		dkimf_db_observe(dkimf_metrics_db);
+	}
+#endif /* _FFR_METRICS */
+
+	{
+		char errbuf[BUFRSZ + 1];
+
+		if (dkimf_jobs_init(curconf->conf_lookupthreads,
+		                    errbuf, sizeof errbuf) != 0)
+		{
+			if (curconf->conf_dolog)
+			{
+				syslog(LOG_ERR,
+				       "can't start lookup threads: %s",
+				       errbuf);
+			}
+
+			if (!autorestart && pidfile != NULL)
+				(void) unlink(pidfile);
+
+			return EX_OSERR;
+		}
+	}
+
+#ifdef _FFR_REPORT_QUEUE
+	if (curconf->conf_reportqsize > 0)
+	{
+		status = dkimf_reportq_init(curconf->conf_reportqsize,
+		                            curconf->conf_reportqrate,
+		                            curconf->conf_reportqbatch,
+		                            curconf->conf_dolog);
+		if (status != 0)
+		{
+			if (curconf->conf_dolog)
+			{
+				syslog(LOG_ERR,
+				       "can't start report sender thread: %s",
+				       strerror(status));
+			}
+
+			if (!autorestart && pidfile != NULL)
+				(void) unlink(pidfile);
+
+			return EX_OSERR;
+		}
+	}
+#endif /* _FFR_REPORT_QUEUE */
+
 	if (curconf->conf_dolog)
 	{
 		_Bool noargs = strlen(argstr) == 0;
@@ -17152,8 +19662,43 @@ main(int argc, char **argv)
 		return EX_OSERR;
 	}
 
+#ifdef _FFR_ASYNC_LOG
+	if (curconf->conf_dolog && curconf->conf_logbufsize > 0)
+	{
+		char *log_name = NULL;
+		char errbuf[BUFRSZ + 1];
+
+		if (curconf->conf_data != NULL)
+		{
+			(void) config_get(curconf->conf_data, "SyslogName",
+			                  &log_name, sizeof log_name);
+		}
+
+		if (dkimf_asynclog_init(log_name != NULL ? log_name : progname,
+		                        curconf->conf_logbufsize,
+		                        dkimf_lookup_strtoint(curconf->conf_logoverflow,
+		                                              dkimf_logoverflow),
+		                        curconf->conf_lograte,
+		                        curconf->conf_logfile,
+		                        errbuf, sizeof errbuf) != 0)
+		{
+			syslog(LOG_ERR, "can't start log writer: %s", errbuf);
+
+			if (!autorestart && pidfile != NULL)
+				(void) unlink(pidfile);
+
+			return EX_OSERR;
+		}
+	}
+#endif /* _FFR_ASYNC_LOG */
+
 	/* call the milter mainline */
 	errno = 0;
+#ifdef _FFR_EVENT_ENGINE
+	if (eventengine)
+		status = dkimf_engine_main();
+	else
+#endif /* _FFR_EVENT_ENGINE */
 	status = smfi_main();
 
 	if (curconf->conf_dolog)
@@ -17174,12 +19719,31 @@ main(int argc, char **argv)
 	die = TRUE;
 	(void) raise(SIGUSR1);
 
+#ifdef _FFR_RATE_LIMIT
+	dkimf_rate_shutdown();
+#endif /* _FFR_RATE_LIMIT */
+
+	dkimf_jobs_shutdown();
+
+#ifdef _FFR_REPORT_QUEUE
+	dkimf_reportq_shutdown();
+#endif /* _FFR_REPORT_QUEUE */
+
+#ifdef _FFR_METRICS
+	dkimf_db_observe(NULL);
+	dkimf_metrics_shutdown();
+#endif /* _FFR_METRICS */
+
+#ifdef _FFR_ASYNC_LOG
+	dkimf_asynclog_shutdown();
+#endif /* _FFR_ASYNC_LOG */
+
 	if (!autorestart && pidfile != NULL)
 		(void) unlink(pidfile);
 
 	dkimf_crypto_free();
 
-	dkimf_config_free(curconf);
+	dkimf_config_release(curconf);
 
 	return status;
 }
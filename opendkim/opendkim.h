@@ -47,10 +47,13 @@
 #define	CACHESTATSINT	300
 #define	CBINTERVAL	3
 #define	DEFCONFFILE	CONFIG_BASE "/opendkim.conf"
+#define	DEFFLOWCHECKPOINT 10
 #define	DEFFLOWDATATTL	86400
 #define	DEFINTERNAL	"csl:127.0.0.1,::1"
+#define	DEFLOOKUPTHREADS 8
 #define	DEFMAXHDRSZ	65536
 #define	DEFMAXVERIFY	3
+#define	DEFTABLETHREADS	4
 #define	DEFTIMEOUT	5
 #define	HOSTUNKNOWN	"unknown-host"
 #define	JOBIDUNKNOWN	"(unknown-jobid)"
@@ -0,0 +1,658 @@
+/*
+**  Copyright 2025 OpenDKIM contributors.
+*/
+
+#include "build-config.h"
+
+#ifdef _FFR_REPORT_QUEUE
+
+/* system includes */
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <errno.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#ifdef HAVE_CURL_EASY_SETOPT
+# include <curl/curl.h>
+#endif /* HAVE_CURL_EASY_SETOPT */
+
+/* opendkim includes */
+#include "reportq.h"
+#include "opendkim.h"
+#ifdef _FFR_ASYNC_LOG
+# include "asynclog.h"
+#endif /* _FFR_ASYNC_LOG */
+
+/* DATA TYPES */
+/*
+**  RQITEM -- one queued report
+**
+**  The report is copied into memory when it is queued, so nothing holds
+**  a descriptor while it waits; "rqi_out" is open only while a batch is
+**  being handed to the MTA.
+*/
+
+struct rqitem
+{
+	char *		rqi_data;		/* report */
+	size_t		rqi_len;		/* bytes at rqi_data */
+	size_t		rqi_off;		/* bytes already sent */
+	FILE *		rqi_out;		/* MTA command, while sending */
+	char *		rqi_jobid;		/* originating job ID */
+	char *		rqi_from;		/* envelope sender */
+	char *		rqi_rcpt;		/* envelope recipient */
+	char *		rqi_cmd;		/* MTA command */
+	char *		rqi_uri;		/* SMTP URI, or NULL */
+	struct rqitem *	rqi_next;
+};
+
+/* GLOBALS */
+static _Bool rq_die;				/* sender shutdown */
+static _Bool rq_done;				/* sender has exited */
+static _Bool rq_dolog;				/* log failures */
+static _Bool rq_running;			/* queue accepting */
+static unsigned int rq_count;			/* reports queued */
+static unsigned int rq_max;			/* queue limit */
+static unsigned int rq_batch;			/* reports per batch */
+static unsigned int rq_rate;			/* reports per minute */
+static struct timeval rq_deadline;		/* end of shutdown drain */
+static struct rqitem *rq_head;			/* queue head */
+static struct rqitem *rq_tail;			/* queue tail */
+static pthread_t rq_thread;			/* sender thread */
+static pthread_mutex_t rq_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rq_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+**  DKIMF_REPORTQ_FREE -- release a queued report
+**
+**  Parameters:
+**  	rqi -- report to release
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_reportq_free(struct rqitem *rqi)
+{
+	assert(rqi != NULL);
+
+	free(rqi->rqi_data);
+	free(rqi->rqi_jobid);
+	free(rqi->rqi_from);
+	free(rqi->rqi_rcpt);
+	free(rqi->rqi_cmd);
+	free(rqi->rqi_uri);
+	free(rqi);
+}
+
+/*
+**  DKIMF_REPORTQ_PACE -- wait for the next sending slot
+**
+**  Parameters:
+**  	next -- time at which the next report may be sent; updated
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Returns early if the sender is told to shut down, so that anything
+**  	still queued goes out without further delay.
+*/
+
+static void
+dkimf_reportq_pace(struct timeval *next)
+{
+	struct timeval now;
+	struct timespec until;
+
+	assert(next != NULL);
+
+	if (rq_rate == 0)
+		return;
+
+	until.tv_sec = next->tv_sec;
+	until.tv_nsec = next->tv_usec * 1000;
+
+	pthread_mutex_lock(&rq_lock);
+
+	(void) gettimeofday(&now, NULL);
+
+	while (!rq_die && timercmp(&now, next, <))
+	{
+		(void) pthread_cond_timedwait(&rq_cond, &rq_lock, &until);
+		(void) gettimeofday(&now, NULL);
+	}
+
+	pthread_mutex_unlock(&rq_lock);
+
+	if (timercmp(&now, next, >))
+		*next = now;
+
+	next->tv_usec += 60000000 / rq_rate;
+	next->tv_sec += next->tv_usec / 1000000;
+	next->tv_usec %= 1000000;
+}
+
+/*
+**  DKIMF_REPORTQ_PIPE -- hand one report to a new MTA command
+**
+**  Parameters:
+**  	rqi -- report to send
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	The command is left running with "rqi_out" set; the report has
+**  	normally fit in the pipe by the time this returns, so the commands
+**  	of a whole batch are started before dkimf_reportq_reap() waits for
+**  	any of them, and they deliver in parallel.
+*/
+
+static void
+dkimf_reportq_pipe(struct rqitem *rqi)
+{
+	assert(rqi != NULL);
+
+	rqi->rqi_out = popen(rqi->rqi_cmd, "w");
+	if (rqi->rqi_out == NULL)
+	{
+		if (rq_dolog)
+		{
+			syslog(LOG_ERR, "%s: popen(): %s", rqi->rqi_jobid,
+			       strerror(errno));
+		}
+
+		return;
+	}
+
+	(void) fwrite(rqi->rqi_data, 1, rqi->rqi_len, rqi->rqi_out);
+	(void) fflush(rqi->rqi_out);
+}
+
+/*
+**  DKIMF_REPORTQ_REAP -- wait for the MTA command started for a report
+**
+**  Parameters:
+**  	rqi -- report that was sent
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_reportq_reap(struct rqitem *rqi)
+{
+	int status;
+
+	assert(rqi != NULL);
+
+	if (rqi->rqi_out == NULL)
+		return;
+
+	status = pclose(rqi->rqi_out);
+	rqi->rqi_out = NULL;
+	if (status != 0 && rq_dolog)
+	{
+		syslog(LOG_ERR, "%s: pclose(): returned status %d",
+		       rqi->rqi_jobid, status);
+	}
+}
+
+#ifdef HAVE_CURL_EASY_SETOPT
+/*
+**  DKIMF_REPORTQ_READ -- feed a queued report to libcurl
+**
+**  Parameters:
+**  	buf -- buffer to fill
+**  	size, nmemb -- its size
+**  	arg -- report being sent
+**
+**  Return value:
+**  	Bytes copied to "buf"; 0 at the end of the report.
+*/
+
+static size_t
+dkimf_reportq_read(char *buf, size_t size, size_t nmemb, void *arg)
+{
+	size_t n;
+	struct rqitem *rqi;
+
+	rqi = (struct rqitem *) arg;
+
+	n = MIN(size * nmemb, rqi->rqi_len - rqi->rqi_off);
+	memcpy(buf, rqi->rqi_data + rqi->rqi_off, n);
+	rqi->rqi_off += n;
+
+	return n;
+}
+
+/*
+**  DKIMF_REPORTQ_SMTP -- submit one report via SMTP
+**
+**  Parameters:
+**  	curl -- handle, kept across a batch so the connection is reused
+**  	rqi -- report to send
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_reportq_smtp(CURL *curl, struct rqitem *rqi)
+{
+	CURLcode cc;
+	struct curl_slist *rcpts = NULL;
+
+	assert(curl != NULL);
+	assert(rqi != NULL);
+
+	rcpts = curl_slist_append(rcpts, rqi->rqi_rcpt);
+
+	rqi->rqi_off = 0;
+
+	cc = curl_easy_setopt(curl, CURLOPT_URL, rqi->rqi_uri);
+	if (cc == CURLE_OK)
+	{
+		cc = curl_easy_setopt(curl, CURLOPT_READFUNCTION,
+		                      dkimf_reportq_read);
+	}
+	if (cc == CURLE_OK)
+		cc = curl_easy_setopt(curl, CURLOPT_READDATA, rqi);
+	if (cc == CURLE_OK)
+		cc = curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
+	if (cc == CURLE_OK)
+		cc = curl_easy_setopt(curl, CURLOPT_MAIL_FROM, rqi->rqi_from);
+	if (cc == CURLE_OK)
+		cc = curl_easy_setopt(curl, CURLOPT_MAIL_RCPT, rcpts);
+
+	if (cc != CURLE_OK)
+	{
+		if (rq_dolog)
+		{
+			syslog(LOG_ERR, "%s: curl_easy_setopt() failed",
+			       rqi->rqi_jobid);
+		}
+	}
+	else
+	{
+		cc = curl_easy_perform(curl);
+		if (cc != CURLE_OK && rq_dolog)
+		{
+			syslog(LOG_ERR,
+			       "%s: curl_easy_perform() to %s failed: %s",
+			       rqi->rqi_jobid, rqi->rqi_rcpt,
+			       curl_easy_strerror(cc));
+		}
+	}
+
+	(void) curl_easy_setopt(curl, CURLOPT_MAIL_RCPT, NULL);
+	curl_slist_free_all(rcpts);
+}
+#endif /* HAVE_CURL_EASY_SETOPT */
+
+/*
+**  DKIMF_REPORTQ_SENDER -- sender thread
+**
+**  Parameters:
+**  	arg -- unused
+**
+**  Return value:
+**  	Always NULL.
+**
+**  Notes:
+**  	Takes up to rq_batch reports off the queue at a time and sends
+**  	them outside the lock, spacing them out if a rate was set.  On
+**  	shutdown whatever is left is sent until rq_deadline passes; what
+**  	remains after that is dropped.
+*/
+
+static void *
+dkimf_reportq_sender(void *arg)
+{
+	struct rqitem *batch;
+	struct rqitem *rqi;
+	unsigned int n;
+	struct timeval now;
+	struct timeval next;
+#ifdef HAVE_CURL_EASY_SETOPT
+	CURL *curl = NULL;
+#endif /* HAVE_CURL_EASY_SETOPT */
+
+	(void) gettimeofday(&next, NULL);
+
+	for (;;)
+	{
+		pthread_mutex_lock(&rq_lock);
+
+		while (rq_head == NULL && !rq_die)
+			pthread_cond_wait(&rq_cond, &rq_lock);
+
+		if (rq_head == NULL)
+		{
+			pthread_mutex_unlock(&rq_lock);
+			break;
+		}
+
+		(void) gettimeofday(&now, NULL);
+		if (rq_die && timercmp(&now, &rq_deadline, >=))
+		{
+			batch = rq_head;
+			n = rq_count;
+			rq_head = NULL;
+			rq_tail = NULL;
+			rq_count = 0;
+
+			pthread_mutex_unlock(&rq_lock);
+
+			if (rq_dolog)
+			{
+				syslog(LOG_WARNING,
+				       "report queue not drained in time, %u report(s) dropped",
+				       n);
+			}
+
+			while (batch != NULL)
+			{
+				rqi = batch;
+				batch = rqi->rqi_next;
+				dkimf_reportq_free(rqi);
+			}
+
+			break;
+		}
+
+		batch = rq_head;
+		rqi = rq_head;
+		for (n = 1; n < rq_batch && rqi->rqi_next != NULL; n++)
+			rqi = rqi->rqi_next;
+
+		rq_head = rqi->rqi_next;
+		if (rq_head == NULL)
+			rq_tail = NULL;
+		rqi->rqi_next = NULL;
+		rq_count -= n;
+
+		pthread_mutex_unlock(&rq_lock);
+
+		for (rqi = batch; rqi != NULL; rqi = rqi->rqi_next)
+		{
+			dkimf_reportq_pace(&next);
+
+#ifdef HAVE_CURL_EASY_SETOPT
+			if (rqi->rqi_uri != NULL)
+			{
+				if (curl == NULL)
+					curl = curl_easy_init();
+
+				if (curl != NULL)
+				{
+					dkimf_reportq_smtp(curl, rqi);
+				}
+				else if (rq_dolog)
+				{
+					syslog(LOG_ERR,
+					       "%s: curl_easy_init() failed",
+					       rqi->rqi_jobid);
+				}
+			}
+			else
+#endif /* HAVE_CURL_EASY_SETOPT */
+			dkimf_reportq_pipe(rqi);
+		}
+
+		/* now wait for the MTA commands started above */
+		while (batch != NULL)
+		{
+			rqi = batch;
+			batch = rqi->rqi_next;
+
+			dkimf_reportq_reap(rqi);
+			dkimf_reportq_free(rqi);
+		}
+
+#ifdef HAVE_CURL_EASY_SETOPT
+		/* drop the connection between batches */
+		if (curl != NULL)
+		{
+			curl_easy_cleanup(curl);
+			curl = NULL;
+		}
+#endif /* HAVE_CURL_EASY_SETOPT */
+	}
+
+	pthread_mutex_lock(&rq_lock);
+	rq_done = TRUE;
+	pthread_cond_broadcast(&rq_cond);
+	pthread_mutex_unlock(&rq_lock);
+
+	return NULL;
+}
+
+/*
+**  DKIMF_REPORTQ_ADD -- queue a report for sending
+**
+**  Parameters:
+**  	data -- stream containing the report; must be readable and
+**  	        seekable
+**  	jobid -- job ID of the message being reported, for logging
+**  	from -- envelope sender
+**  	rcpt -- envelope recipient (for SMTP)
+**  	cmd -- MTA command to pipe the report to
+**  	uri -- SMTP URI to submit the report to instead, or NULL
+**
+**  Return value:
+**  	0 -- report queued
+**  	-1 -- queue full or not running, out of memory, or "data"
+**  	      couldn't be read
+**
+**  Notes:
+**  	The report is copied; the caller closes "data" either way.
+*/
+
+int
+dkimf_reportq_add(FILE *data, const char *jobid, const char *from,
+                  const char *rcpt, const char *cmd, const char *uri)
+{
+	long len;
+	struct rqitem *rqi;
+
+	assert(data != NULL);
+	assert(jobid != NULL);
+	assert(from != NULL);
+	assert(rcpt != NULL);
+	assert(cmd != NULL);
+
+	if (!rq_running)
+		return -1;
+
+	if (fflush(data) != 0 || fseek(data, 0, SEEK_END) != 0)
+		return -1;
+	len = ftell(data);
+	if (len < 0)
+		return -1;
+	rewind(data);
+
+	rqi = (struct rqitem *) malloc(sizeof *rqi);
+	if (rqi == NULL)
+		return -1;
+
+	memset(rqi, '\0', sizeof *rqi);
+
+	rqi->rqi_len = (size_t) len;
+	rqi->rqi_data = malloc(MAX(rqi->rqi_len, 1));
+	if (rqi->rqi_data == NULL ||
+	    fread(rqi->rqi_data, 1, rqi->rqi_len, data) != rqi->rqi_len)
+	{
+		dkimf_reportq_free(rqi);
+		return -1;
+	}
+
+	rqi->rqi_jobid = strdup(jobid);
+	rqi->rqi_from = strdup(from);
+	rqi->rqi_rcpt = strdup(rcpt);
+	rqi->rqi_cmd = strdup(cmd);
+	if (uri != NULL)
+		rqi->rqi_uri = strdup(uri);
+
+	if (rqi->rqi_jobid == NULL || rqi->rqi_from == NULL ||
+	    rqi->rqi_rcpt == NULL || rqi->rqi_cmd == NULL ||
+	    (uri != NULL && rqi->rqi_uri == NULL))
+	{
+		dkimf_reportq_free(rqi);
+		return -1;
+	}
+
+	pthread_mutex_lock(&rq_lock);
+
+	if (!rq_running || rq_count >= rq_max)
+	{
+		pthread_mutex_unlock(&rq_lock);
+		dkimf_reportq_free(rqi);
+		return -1;
+	}
+
+	if (rq_tail == NULL)
+		rq_head = rqi;
+	else
+		rq_tail->rqi_next = rqi;
+	rq_tail = rqi;
+	rq_count++;
+
+	pthread_cond_signal(&rq_cond);
+
+	pthread_mutex_unlock(&rq_lock);
+
+	return 0;
+}
+
+/*
+**  DKIMF_REPORTQ_ENABLED -- report whether reports are being queued
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	TRUE iff dkimf_reportq_init() has started the sender.
+*/
+
+_Bool
+dkimf_reportq_enabled(void)
+{
+	return rq_running;
+}
+
+/*
+**  DKIMF_REPORTQ_INIT -- start the report sender
+**
+**  Parameters:
+**  	max -- most reports to hold at once
+**  	rate -- most reports to send per minute (0 == no limit)
+**  	batch -- most reports to take off the queue at a time
+**  	dolog -- log send failures
+**
+**  Return value:
+**  	0 on success, an error code otherwise.
+*/
+
+int
+dkimf_reportq_init(unsigned int max, unsigned int rate, unsigned int batch,
+                   _Bool dolog)
+{
+	int status;
+
+	assert(max > 0);
+
+	if (rq_running)
+		return 0;
+
+	rq_max = max;
+	rq_rate = rate;
+	rq_batch = (batch == 0 ? DKIMF_RQ_DEFBATCH : batch);
+	rq_dolog = dolog;
+	rq_die = FALSE;
+	rq_done = FALSE;
+
+	status = pthread_create(&rq_thread, NULL, dkimf_reportq_sender, NULL);
+	if (status != 0)
+		return status;
+
+	rq_running = TRUE;
+
+	return 0;
+}
+
+/*
+**  DKIMF_REPORTQ_SHUTDOWN -- stop the report sender
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Reports already queued are sent, without rate limiting, for up to
+**  	DKIMF_RQ_DRAINTIME seconds; the rest are dropped.  If a report
+**  	being sent at that point still hasn't finished a second later,
+**  	the sender is abandoned so that it can't hold up exit.
+*/
+
+void
+dkimf_reportq_shutdown(void)
+{
+	struct timespec until;
+
+	pthread_mutex_lock(&rq_lock);
+
+	if (!rq_running)
+	{
+		pthread_mutex_unlock(&rq_lock);
+		return;
+	}
+
+	(void) gettimeofday(&rq_deadline, NULL);
+	rq_deadline.tv_sec += DKIMF_RQ_DRAINTIME;
+
+	until.tv_sec = rq_deadline.tv_sec + 1;
+	until.tv_nsec = rq_deadline.tv_usec * 1000;
+
+	rq_running = FALSE;
+	rq_die = TRUE;
+	pthread_cond_broadcast(&rq_cond);
+
+	while (!rq_done)
+	{
+		if (pthread_cond_timedwait(&rq_cond, &rq_lock,
+		                           &until) == ETIMEDOUT)
+			break;
+	}
+
+	if (!rq_done)
+	{
+		pthread_mutex_unlock(&rq_lock);
+
+		if (rq_dolog)
+		{
+			syslog(LOG_WARNING,
+			       "report sender still busy at shutdown; abandoned");
+		}
+
+		(void) pthread_detach(rq_thread);
+		return;
+	}
+
+	pthread_mutex_unlock(&rq_lock);
+
+	(void) pthread_join(rq_thread, NULL);
+}
+
+#endif /* _FFR_REPORT_QUEUE */
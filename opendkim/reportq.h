@@ -0,0 +1,26 @@
+/*
+**  Copyright 2025 OpenDKIM contributors.
+*/
+
+#ifndef _REPORTQ_H_
+#define _REPORTQ_H_
+
+#include "build-config.h"
+
+/* system includes */
+#include <sys/types.h>
+#include <stdio.h>
+
+/* macros */
+#define	DKIMF_RQ_DEFBATCH	16		/* default reports per batch */
+#define	DKIMF_RQ_DRAINTIME	10		/* seconds to drain at exit */
+
+/* prototypes */
+extern int dkimf_reportq_add(FILE *, const char *, const char *,
+                             const char *, const char *, const char *);
+extern _Bool dkimf_reportq_enabled(void);
+extern int dkimf_reportq_init(unsigned int, unsigned int, unsigned int,
+                              _Bool);
+extern void dkimf_reportq_shutdown(void);
+
+#endif /* _REPORTQ_H_ */
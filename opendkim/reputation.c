@@ -17,6 +17,10 @@
 #include <stdio.h>
 #include <math.h>
 #include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
 
 /* libopendkim includes */
 #include <dkim.h>
@@ -37,37 +41,484 @@
 #include "opendkim-db.h"
 
 /* macros */
-#define DKIMF_REP_DEFCACHE	"db:"
 #define	DKIMF_REP_MAXHASHES	64
 #define	DKIMF_REP_NULLDOMAIN	"UNSIGNED"
 #define	DKIMF_REP_LOWTIME	"LOW-TIME"
+#define	DKIMF_REP_SHARDS	64
+#define	DKIMF_REP_BUCKETS	128
+#define	DKIMF_REP_GENERATIONS	4
 
 /* data types */
+struct reps
+{
+	time_t		reps_retrieved;
+	unsigned long	reps_count;
+	unsigned long	reps_limit;
+	unsigned long	reps_spam;
+	float		reps_ratio;
+};
+
+/*
+**  REPENTRY -- one cached domain (or one recorded duplicate)
+*/
+
+struct repentry
+{
+	_Bool			re_dirty;	/* not yet in backing store */
+	size_t			re_keylen;	/* length of key */
+	time_t			re_stamp;	/* expiry reference time */
+	struct reps		re_reps;	/* cached data (domains) */
+	struct repentry *	re_next;	/* bucket chain */
+	unsigned char *		re_key;		/* domain or message hash */
+};
+
+/*
+**  REPSHARD -- one lock stripe of a cache table
+*/
+
+struct repshard
+{
+	pthread_mutex_t		rs_lock;
+	struct repentry *	rs_buckets[DKIMF_REP_BUCKETS];
+};
+
+/*
+**  REPTABLE -- a sharded cache table, optionally backed by a data set
+*/
+
+struct reptable
+{
+	_Bool			rt_dups;	/* duplicates table? */
+	DKIMF_DB		rt_db;		/* backing data set */
+	struct repshard		rt_shards[DKIMF_REP_SHARDS];
+};
+
 struct reputation
 {
+	_Bool		rep_die;
+	_Bool		rep_running;
 	time_t		rep_ttl;
-	time_t		rep_lastflush;
 	unsigned int	rep_factor;
 	unsigned int	rep_minimum;
-	DKIMF_DB	rep_reps;
-	DKIMF_DB	rep_dups;
+	unsigned int	rep_generation;
 	DKIMF_DB	rep_limits;
 	DKIMF_DB	rep_limitmods;
 	DKIMF_DB	rep_ratios;
-	DKIMF_DB	rep_counts;
-	DKIMF_DB	rep_spam;
 	DKIMF_DB	rep_lowtime;
+	pthread_t	rep_expirer;
 	pthread_mutex_t	rep_lock;
+	pthread_cond_t	rep_cond;
+	struct reptable	rep_reps;
+	struct reptable	rep_dups;
 };
 
-struct reps
+/*
+**  DKIMF_REP_HASH -- compute a hash over a cache key
+**
+**  Parameters:
+**  	key -- key to hash
+**  	keylen -- bytes in key
+**
+**  Return value:
+**  	Hash value.
+*/
+
+static unsigned int
+dkimf_rep_hash(const unsigned char *key, size_t keylen)
 {
-	time_t		reps_retrieved;
-	unsigned long	reps_count;
-	unsigned long	reps_limit;
-	unsigned long	reps_spam;
-	float		reps_ratio;
-};
+	size_t c;
+	unsigned int h = 2166136261U;
+
+	for (c = 0; c < keylen; c++)
+	{
+		h ^= key[c];
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+/*
+**  DKIMF_REP_SHARD -- find the shard and bucket for a key
+**
+**  Parameters:
+**  	rt -- table of interest
+**  	key -- key to locate
+**  	keylen -- bytes in key
+**  	bucket -- bucket index (returned)
+**
+**  Return value:
+**  	Pointer to the shard responsible for "key".
+*/
+
+static struct repshard *
+dkimf_rep_shard(struct reptable *rt, const unsigned char *key, size_t keylen,
+                unsigned int *bucket)
+{
+	unsigned int h;
+
+	h = dkimf_rep_hash(key, keylen);
+
+	*bucket = (h / DKIMF_REP_SHARDS) % DKIMF_REP_BUCKETS;
+
+	return &rt->rt_shards[h % DKIMF_REP_SHARDS];
+}
+
+/*
+**  DKIMF_REP_FIND -- find an entry in a shard
+**
+**  Parameters:
+**  	rs -- shard to search (locked)
+**  	bucket -- bucket index
+**  	key -- key to find
+**  	keylen -- bytes in key
+**
+**  Return value:
+**  	Pointer to the entry, or NULL if not found.
+*/
+
+static struct repentry *
+dkimf_rep_find(struct repshard *rs, unsigned int bucket,
+               const unsigned char *key, size_t keylen)
+{
+	struct repentry *re;
+
+	for (re = rs->rs_buckets[bucket]; re != NULL; re = re->re_next)
+	{
+		if (re->re_keylen == keylen &&
+		    memcmp(re->re_key, key, keylen) == 0)
+			return re;
+	}
+
+	return NULL;
+}
+
+/*
+**  DKIMF_REP_ADD -- add an entry to a shard
+**
+**  Parameters:
+**  	rs -- shard to update (locked)
+**  	bucket -- bucket index
+**  	key -- key to add
+**  	keylen -- bytes in key
+**
+**  Return value:
+**  	Pointer to the new entry, or NULL on allocation failure.
+*/
+
+static struct repentry *
+dkimf_rep_add(struct repshard *rs, unsigned int bucket,
+              const unsigned char *key, size_t keylen)
+{
+	struct repentry *re;
+
+	re = malloc(sizeof *re + keylen);
+	if (re == NULL)
+		return NULL;
+
+	memset(re, '\0', sizeof *re);
+	re->re_key = (unsigned char *) (re + 1);
+	memcpy(re->re_key, key, keylen);
+	re->re_keylen = keylen;
+
+	re->re_next = rs->rs_buckets[bucket];
+	rs->rs_buckets[bucket] = re;
+
+	return re;
+}
+
+/*
+**  DKIMF_REP_TABLE_INIT -- set up a cache table
+**
+**  Parameters:
+**  	rt -- table to initialize
+**  	spec -- backing data set, or NULL for memory only
+**  	dups -- TRUE iff this is the duplicates table
+**  	ttl -- entry lifetime
+**
+**  Return value:
+**  	0 on success, -1 on error.
+**
+**  Notes:
+**  	Unexpired entries found in the backing data set are loaded.
+*/
+
+static int
+dkimf_rep_table_init(struct reptable *rt, char *spec, _Bool dups, time_t ttl)
+{
+	_Bool first;
+	int c;
+	unsigned int bucket;
+	size_t klen;
+	time_t now;
+	struct repentry *re;
+	struct repshard *rs;
+	struct dkimf_db_data req;
+	struct reps reps;
+	unsigned char key[DKIM_MAXHOSTNAMELEN + DKIMF_REP_MAXHASHES + 1];
+
+	memset(rt, '\0', sizeof *rt);
+	rt->rt_dups = dups;
+
+	for (c = 0; c < DKIMF_REP_SHARDS; c++)
+	{
+		if (pthread_mutex_init(&rt->rt_shards[c].rs_lock, NULL) != 0)
+			return -1;
+	}
+
+	if (spec == NULL)
+		return 0;
+
+	if (dkimf_db_open(&rt->rt_db, spec, 0, NULL, NULL) != 0)
+		return -1;
+
+	(void) time(&now);
+
+	memset(&reps, '\0', sizeof reps);
+
+	for (first = TRUE; ; first = FALSE)
+	{
+		if (dups)
+		{
+			req.dbdata_buffer = (void *) &reps.reps_retrieved;
+			req.dbdata_buflen = sizeof reps.reps_retrieved;
+		}
+		else
+		{
+			req.dbdata_buffer = (void *) &reps;
+			req.dbdata_buflen = sizeof reps;
+		}
+		req.dbdata_flags = DKIMF_DB_DATA_BINARY;
+
+		klen = sizeof key;
+		if (dkimf_db_walk(rt->rt_db, first, key, &klen, &req, 1) != 0)
+			break;
+
+		if (reps.reps_retrieved + ttl < now)
+			continue;
+
+		rs = dkimf_rep_shard(rt, key, klen, &bucket);
+		re = dkimf_rep_find(rs, bucket, key, klen);
+		if (re == NULL)
+			re = dkimf_rep_add(rs, bucket, key, klen);
+		if (re == NULL)
+			return -1;
+
+		re->re_stamp = reps.reps_retrieved;
+		if (!dups)
+			memcpy(&re->re_reps, &reps, sizeof reps);
+	}
+
+	return 0;
+}
+
+/*
+**  DKIMF_REP_TABLE_FREE -- release a cache table
+**
+**  Parameters:
+**  	rt -- table to release
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+dkimf_rep_table_free(struct reptable *rt)
+{
+	int c;
+	int b;
+	struct repentry *re;
+	struct repentry *next;
+
+	for (c = 0; c < DKIMF_REP_SHARDS; c++)
+	{
+		for (b = 0; b < DKIMF_REP_BUCKETS; b++)
+		{
+			for (re = rt->rt_shards[c].rs_buckets[b];
+			     re != NULL;
+			     re = next)
+			{
+				next = re->re_next;
+				free(re);
+			}
+		}
+
+		(void) pthread_mutex_destroy(&rt->rt_shards[c].rs_lock);
+	}
+
+	if (rt->rt_db != NULL)
+		(void) dkimf_db_close(rt->rt_db);
+}
+
+/*
+**  DKIMF_REP_SWEEP -- expire one shard, and sync it to the backing store
+**
+**  Parameters:
+**  	rt -- table to sweep
+**  	shard -- shard index
+**  	ttl -- entry lifetime
+**  	now -- current time
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	The shard lock is held only while entries are unlinked or copied;
+**  	backing store updates are done after it is released.
+*/
+
+static void
+dkimf_rep_sweep(struct reptable *rt, int shard, time_t ttl, time_t now)
+{
+	int b;
+	struct repentry *re;
+	struct repentry *next;
+	struct repentry *copy;
+	struct repentry *dead = NULL;
+	struct repentry *dirty = NULL;
+	struct repentry **prev;
+	struct repshard *rs;
+
+	rs = &rt->rt_shards[shard];
+
+	pthread_mutex_lock(&rs->rs_lock);
+
+	for (b = 0; b < DKIMF_REP_BUCKETS; b++)
+	{
+		prev = &rs->rs_buckets[b];
+
+		for (re = *prev; re != NULL; re = next)
+		{
+			next = re->re_next;
+
+			if (re->re_stamp + ttl < now)
+			{
+				*prev = next;
+				re->re_next = dead;
+				dead = re;
+				continue;
+			}
+
+			prev = &re->re_next;
+
+			if (re->re_dirty && rt->rt_db != NULL)
+			{
+				copy = malloc(sizeof *copy + re->re_keylen);
+				if (copy == NULL)
+					continue;
+
+				memcpy(copy, re, sizeof *copy);
+				copy->re_key = (unsigned char *) (copy + 1);
+				memcpy(copy->re_key, re->re_key,
+				       re->re_keylen);
+				copy->re_next = dirty;
+				dirty = copy;
+
+				re->re_dirty = FALSE;
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&rs->rs_lock);
+
+	for (re = dead; re != NULL; re = next)
+	{
+		next = re->re_next;
+
+		if (rt->rt_db != NULL)
+			(void) dkimf_db_delete(rt->rt_db, re->re_key,
+			                       re->re_keylen);
+
+		free(re);
+	}
+
+	for (re = dirty; re != NULL; re = next)
+	{
+		next = re->re_next;
+
+		if (rt->rt_dups)
+		{
+			(void) dkimf_db_put(rt->rt_db, re->re_key,
+			                    re->re_keylen, &re->re_stamp,
+			                    sizeof re->re_stamp);
+		}
+		else
+		{
+			(void) dkimf_db_put(rt->rt_db, re->re_key,
+			                    re->re_keylen, &re->re_reps,
+			                    sizeof re->re_reps);
+		}
+
+		free(re);
+	}
+}
+
+/*
+**  DKIMF_REP_EXPIRER -- cache expiry thread
+**
+**  Parameters:
+**  	vp -- reputation handle
+**
+**  Return value:
+**  	NULL.
+**
+**  Notes:
+**  	The shards are divided into DKIMF_REP_GENERATIONS groups, one of
+**  	which is swept every 1/DKIMF_REP_GENERATIONS of the TTL, so the
+**  	cost of expiry is spread out and never paid by a message.
+*/
+
+static void *
+dkimf_rep_expirer(void *vp)
+{
+	int c;
+	time_t now;
+	time_t tick;
+	struct timespec until;
+	DKIMF_REP rep;
+
+	rep = (DKIMF_REP) vp;
+
+	tick = rep->rep_ttl / DKIMF_REP_GENERATIONS;
+	if (tick < 1)
+		tick = 1;
+
+	pthread_mutex_lock(&rep->rep_lock);
+
+	while (!rep->rep_die)
+	{
+		(void) clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += tick;
+
+		while (!rep->rep_die &&
+		       pthread_cond_timedwait(&rep->rep_cond, &rep->rep_lock,
+		                              &until) != ETIMEDOUT)
+			continue;
+
+		if (rep->rep_die)
+			break;
+
+		rep->rep_generation = (rep->rep_generation + 1) % DKIMF_REP_GENERATIONS;
+
+		pthread_mutex_unlock(&rep->rep_lock);
+
+		(void) time(&now);
+
+		for (c = rep->rep_generation;
+		     c < DKIMF_REP_SHARDS;
+		     c += DKIMF_REP_GENERATIONS)
+		{
+			dkimf_rep_sweep(&rep->rep_dups, c, rep->rep_ttl, now);
+			dkimf_rep_sweep(&rep->rep_reps, c, rep->rep_ttl, now);
+		}
+
+		pthread_mutex_lock(&rep->rep_lock);
+	}
+
+	pthread_mutex_unlock(&rep->rep_lock);
+
+	return NULL;
+}
 
 /*
 **  DKIMF_REP_INIT -- initialize reputation
@@ -77,8 +528,8 @@ struct reps
 **  	factor -- number of slices in a reputation limit
 **  	minimum -- always accept at least this many messages
 **  	cachettl -- TTL for cache entries
-**  	cache -- data set to which to cache
-**  	dups -- data set to which to record duplicates
+**  	cache -- data set to which to cache (or NULL for memory only)
+**  	dups -- data set to which to record duplicates (or NULL)
 **  	limits -- DB from which to get per-domain limits
 **  	limitmods -- DB from which to get per-domain limit modifiers
 **  	ratios -- DB from which to get per-domain ratios
@@ -93,7 +544,6 @@ dkimf_rep_init(DKIMF_REP *rep, time_t factor, unsigned int minimum,
                unsigned int cachettl, char *cache, char *dups, DKIMF_DB limits,
                DKIMF_DB limitmods, DKIMF_DB ratios, DKIMF_DB lowtime)
 {
-	int status;
 	DKIMF_REP new;
 
 	assert(rep != NULL);
@@ -104,19 +554,19 @@ dkimf_rep_init(DKIMF_REP *rep, time_t factor, unsigned int minimum,
 	if (new == NULL)
 		return -1;
 
-#ifdef USE_MDB
-	if (cache == NULL || dups == NULL)
-		return -1;
-#else /* USE_MDB */
-	if (cache == NULL)
-		cache = DKIMF_REP_DEFCACHE;
-	if (dups == NULL)
-		dups = DKIMF_REP_DEFCACHE;
-#endif /* USE_MDB */
-
-	new->rep_lastflush = time(NULL);
+	memset(new, '\0', sizeof *new);
+
 	new->rep_ttl = cachettl;
 	new->rep_factor = factor;
+
+	/* remote data sets keep their replies as long as we keep ours */
+	if (limits != NULL)
+		dkimf_db_cachettl(limits, cachettl);
+	if (limitmods != NULL)
+		dkimf_db_cachettl(limitmods, cachettl);
+	dkimf_db_cachettl(ratios, cachettl);
+	if (lowtime != NULL)
+		dkimf_db_cachettl(lowtime, cachettl);
 	new->rep_limits = limits;
 	new->rep_limitmods = limitmods;
 	new->rep_ratios = ratios;
@@ -129,17 +579,30 @@ dkimf_rep_init(DKIMF_REP *rep, time_t factor, unsigned int minimum,
 		return -1;
 	}
 
-	status = dkimf_db_open(&new->rep_reps, cache, 0, NULL, NULL);
-	if (status != 0)
+	if (pthread_cond_init(&new->rep_cond, NULL) != 0)
 	{
+		(void) pthread_mutex_destroy(&new->rep_lock);
 		free(new);
 		return -1;
 	}
 
-	status = dkimf_db_open(&new->rep_dups, dups, 0, NULL, NULL);
-	if (status != 0)
+	if (dkimf_rep_table_init(&new->rep_reps, cache, FALSE,
+	                         new->rep_ttl) != 0)
 	{
-		dkimf_db_close(new->rep_reps);
+		dkimf_rep_table_free(&new->rep_reps);
+		(void) pthread_cond_destroy(&new->rep_cond);
+		(void) pthread_mutex_destroy(&new->rep_lock);
+		free(new);
+		return -1;
+	}
+
+	if (dkimf_rep_table_init(&new->rep_dups, dups, TRUE,
+	                         new->rep_ttl) != 0)
+	{
+		dkimf_rep_table_free(&new->rep_dups);
+		dkimf_rep_table_free(&new->rep_reps);
+		(void) pthread_cond_destroy(&new->rep_cond);
+		(void) pthread_mutex_destroy(&new->rep_lock);
 		free(new);
 		return -1;
 	}
@@ -162,427 +625,477 @@ dkimf_rep_init(DKIMF_REP *rep, time_t factor, unsigned int minimum,
 void
 dkimf_rep_close(DKIMF_REP rephandle)
 {
+	int c;
+	time_t now;
+
 	assert(rephandle != NULL);
 
-	(void) dkimf_db_close(rephandle->rep_reps);
-	(void) dkimf_db_close(rephandle->rep_dups);
+	pthread_mutex_lock(&rephandle->rep_lock);
+	rephandle->rep_die = TRUE;
+	pthread_cond_signal(&rephandle->rep_cond);
+	pthread_mutex_unlock(&rephandle->rep_lock);
+
+	if (rephandle->rep_running)
+		(void) pthread_join(rephandle->rep_expirer, NULL);
 
+	/* final sync to the backing stores */
+	(void) time(&now);
+	for (c = 0; c < DKIMF_REP_SHARDS; c++)
+	{
+		dkimf_rep_sweep(&rephandle->rep_dups, c, rephandle->rep_ttl,
+		                now);
+		dkimf_rep_sweep(&rephandle->rep_reps, c, rephandle->rep_ttl,
+		                now);
+	}
+
+	dkimf_rep_table_free(&rephandle->rep_reps);
+	dkimf_rep_table_free(&rephandle->rep_dups);
+
+	(void) pthread_cond_destroy(&rephandle->rep_cond);
 	(void) pthread_mutex_destroy(&rephandle->rep_lock);
+
+	free(rephandle);
 }
 
 /*
-**  DKIMF_REP_CHECK -- check reputation
+**  DKIMF_REP_START -- start the expiry thread if it isn't running
+**
+**  Parameters:
+**  	rep -- reputation handle
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	This is deferred to the first check because the handle is created
+**  	while loading configuration, which may precede a fork().
+*/
+
+static void
+dkimf_rep_start(DKIMF_REP rep)
+{
+	pthread_mutex_lock(&rep->rep_lock);
+
+	if (!rep->rep_running && !rep->rep_die &&
+	    pthread_create(&rep->rep_expirer, NULL, dkimf_rep_expirer,
+	                   rep) == 0)
+		rep->rep_running = TRUE;
+
+	pthread_mutex_unlock(&rep->rep_lock);
+}
+
+/*
+**  DKIMF_REP_FETCH -- build a new cache entry from the reputation data sets
 **
 **  Parameters:
 **  	rep -- reputation service handle
-**  	sig -- a valid signature on this message
-**  	spam -- spammy or not spammy?  That is the question.
-**  	hash -- hash of the message, for counting dups
-**  	hashlen -- number of bytes in the hash
-**  	limit -- limit for this signer (returned)
-**  	ratio -- spam ratio for this signer (returned)
-**  	count -- message count for this signer (returned)
-**  	spamcnt -- spam count for this signer (returned)
+**  	signer -- TRUE iff this is for a signing domain
+**  	domain -- domain being queried (may be rewritten)
+**  	domlen -- bytes available at "domain"
+**  	reps -- cache entry to fill in
 **  	errbuf -- buffer to receive errors
 **  	errlen -- bytes available at errbuf
 **
 **  Return value:
 **  	2 -- no data found for this domain
-**  	1 -- deny the request
-**  	0 -- allow the request
+**  	0 -- success
 **  	-1 -- error
-**
-**  Notes:
-**  	If "sig" is NULL, the null domain record is queried.
 */
 
-int
-dkimf_rep_check(DKIMF_REP rep, DKIM_SIGINFO *sig, _Bool spam,
-                void *hash, size_t hashlen, unsigned long *limit,
-                float *ratio, unsigned long *count, unsigned long *spamcnt,
-                char *errbuf, size_t errlen)
+static int
+dkimf_rep_fetch(DKIMF_REP rep, _Bool signer, char *domain,
+                size_t domlen, struct reps *reps, char *errbuf,
+                size_t errlen)
 {
 	_Bool f;
+	_Bool lowtime = FALSE;
 	size_t dlen;
-	size_t hlen;
-	time_t when;
-	time_t now;
+	char *p = NULL;
 	struct dkimf_db_data req[5];
-	struct reps reps;
 	char buf[BUFRSZ + 1];
-	char domain[DKIM_MAXHOSTNAMELEN + 1];
-	unsigned char hashbuf[DKIMF_REP_MAXHASHES];
-
-	assert(rep != NULL);
-
-	(void) time(&now);
 
-	pthread_mutex_lock(&rep->rep_lock);
+	dlen = strlen(domain);
 
-	/* flush the caches if needed */
-	if (rep->rep_lastflush + rep->rep_ttl < now)
-	{
-		f = TRUE;
-		
-		req[0].dbdata_buffer = (void *) &when;
-		req[0].dbdata_buflen = sizeof when;
-		req[0].dbdata_flags = DKIMF_DB_DATA_BINARY;
-
-		hlen = sizeof hashbuf;
-		while (dkimf_db_walk(rep->rep_dups, f, hashbuf, &hlen,
-		                     req, 1) == 0)
-		{
-			if (when + rep->rep_ttl < now)
-			{
-				(void) dkimf_db_delete(rep->rep_dups, hashbuf,
-				                       hlen);
-			}
+	reps->reps_count = 0;
+	reps->reps_limit = ULONG_MAX;
+	reps->reps_spam = 0;
+	reps->reps_retrieved = time(NULL);
 
-			req[0].dbdata_buffer = (void *) &when;
-			req[0].dbdata_buflen = sizeof when;
-			req[0].dbdata_flags = DKIMF_DB_DATA_BINARY;
+	memset(buf, '\0', sizeof buf);
 
-			f = FALSE;
-			hlen = sizeof hashbuf;
-		}
+	req[0].dbdata_buffer = buf;
+	req[0].dbdata_buflen = sizeof buf;
+	req[0].dbdata_flags = 0;
 
-		req[0].dbdata_buffer = (void *) &reps;
-		req[0].dbdata_buflen = sizeof reps;
-		req[0].dbdata_flags = DKIMF_DB_DATA_BINARY;
+	f = FALSE;
 
-		f = TRUE;
-		hlen = sizeof domain;
-		memset(domain, '\0', sizeof domain);
-		while (dkimf_db_walk(rep->rep_reps, f, domain, &hlen,
-		                     req, 1) == 0)
+	if (rep->rep_lowtime != NULL)
+	{
+		/* see if it's a low-time domain */
+		if (dkimf_db_get(rep->rep_lowtime, domain, dlen, req,
+		                 1, &f) != 0)
 		{
-			if (reps.reps_retrieved + rep->rep_ttl < now)
+			if (errbuf != NULL)
 			{
-				(void) dkimf_db_delete(rep->rep_reps, domain,
-				                       hlen);
+				dkimf_db_strerror(rep->rep_lowtime,
+				                  errbuf, errlen);
 			}
-
-			req[0].dbdata_buffer = (void *) &reps;
-			req[0].dbdata_buflen = sizeof reps;
-			req[0].dbdata_flags = DKIMF_DB_DATA_BINARY;
-
-			f = FALSE;
-			hlen = sizeof domain;
-			memset(domain, '\0', sizeof domain);
+			return -1;
 		}
 
-		rep->rep_lastflush = now;
-	}
-
-	/* get the ratio and limit for this domain */
-	req[0].dbdata_buffer = (void *) &reps;
-	req[0].dbdata_buflen = sizeof reps;
-	req[0].dbdata_flags = DKIMF_DB_DATA_BINARY;
+		if (f)
+			lowtime = (atoi(buf) != 0);
 
-	if (sig == NULL)
-		strlcpy(domain, DKIMF_REP_NULLDOMAIN, sizeof domain);
-	else
-		strlcpy(domain, dkim_sig_getdomain(sig), sizeof domain);
+		memset(buf, '\0', sizeof buf);
 
-	dlen = strlen(domain);
+		req[0].dbdata_buffer = buf;
+		req[0].dbdata_buflen = sizeof buf;
+		req[0].dbdata_flags = 0;
+	}
 
-	/* check cache first */
-	f = FALSE;
-	if (dkimf_db_get(rep->rep_reps, domain, dlen, req, 1, &f) != 0)
+	if (lowtime)
 	{
-		if (errbuf != NULL)
-			dkimf_db_strerror(rep->rep_reps, errbuf, errlen);
-		pthread_mutex_unlock(&rep->rep_lock);
-		return -1;
+		strlcpy(domain, DKIMF_REP_LOWTIME, domlen);
+		dlen = strlen(domain);
 	}
 
-	if (!f)
+	f = FALSE;
+
+	/* get the total message limit */
+	if (rep->rep_limits != NULL)
 	{
-		_Bool lowtime = FALSE;
-		char *p = NULL;
+		int fields = 1;
 
-		/* cache miss; build a new cache entry */
-		reps.reps_count = 0;
-		reps.reps_limit = ULONG_MAX;
-		reps.reps_spam = 0;
-		reps.reps_retrieved = time(NULL);
+		if (dkimf_db_type(rep->rep_limits) == DKIMF_DB_TYPE_REPUTE)
+			fields = 5;
 
-		req[0].dbdata_buffer = buf;
-		req[0].dbdata_buflen = sizeof buf;
-		req[0].dbdata_flags = 0;
+		memset(req, '\0', sizeof req);
+
+		req[fields - 1].dbdata_buffer = buf;
+		req[fields - 1].dbdata_buflen = sizeof buf;
+		req[fields - 1].dbdata_flags = 0;
+
+		if (dkimf_db_get(rep->rep_limits, domain, dlen, req,
+		                 fields, &f) != 0)
+		{
+			if (errbuf != NULL)
+			{
+				dkimf_db_strerror(rep->rep_limits,
+				                  errbuf, errlen);
+			}
+			return -1;
+		}
 
-		if (rep->rep_lowtime != NULL)
+		if (!f && !lowtime && signer)
 		{
-			/* see if it's a low-time domain */
-			if (dkimf_db_get(rep->rep_lowtime, domain, dlen, req,
-			                 1, &f) != 0)
+			if (dkimf_db_get(rep->rep_limits,
+			                 DKIMF_REP_LOWTIME,
+			                 strlen(DKIMF_REP_LOWTIME),
+			                 req, fields, &f) != 0)
 			{
 				if (errbuf != NULL)
 				{
-					dkimf_db_strerror(rep->rep_reps,
+					dkimf_db_strerror(rep->rep_limits,
 					                  errbuf, errlen);
 				}
-				pthread_mutex_unlock(&rep->rep_lock);
 				return -1;
 			}
-
-			if (f)
-				lowtime = (atoi(buf) != 0);
-
-			memset(buf, '\0', sizeof buf);
-
-			req[0].dbdata_buffer = buf;
-			req[0].dbdata_buflen = sizeof buf;
-			req[0].dbdata_flags = 0;
 		}
 
-		if (lowtime)
-		{
-			strlcpy(domain, DKIMF_REP_LOWTIME, sizeof domain);
-			dlen = strlen(domain);
-		}
-		
-		f = FALSE;
-
-		/* get the total message limit */
-		if (rep->rep_limits != NULL)
+		if (!f)
 		{
-			int fields = 1;
-
-			if (dkimf_db_type(rep->rep_limits) == DKIMF_DB_TYPE_REPUTE)
-				fields = 5;
-
-			memset(req, '\0', sizeof req);
-
-			req[fields - 1].dbdata_buffer = buf;
-			req[fields - 1].dbdata_buflen = sizeof buf;
-			req[fields - 1].dbdata_flags = 0;
-
-			if (dkimf_db_get(rep->rep_limits, domain, dlen, req,
+			if (dkimf_db_get(rep->rep_limits, "*", 1, req,
 			                 fields, &f) != 0)
 			{
 				if (errbuf != NULL)
 				{
-					dkimf_db_strerror(rep->rep_reps,
+					dkimf_db_strerror(rep->rep_limits,
 					                  errbuf, errlen);
 				}
-				pthread_mutex_unlock(&rep->rep_lock);
 				return -1;
 			}
+		}
 
-			if (!f && !lowtime && sig != NULL)
-			{
-				if (dkimf_db_get(rep->rep_limits,
-				                 DKIMF_REP_LOWTIME,
-				                 strlen(DKIMF_REP_LOWTIME),
-				                 req, fields, &f) != 0)
-				{
-					if (errbuf != NULL)
-					{
-						dkimf_db_strerror(rep->rep_reps,
-						                  errbuf,
-						                  errlen);
-					}
-					pthread_mutex_unlock(&rep->rep_lock);
-					return -1;
-				}
-			}
+		if (!f || req[fields - 1].dbdata_buflen >= sizeof buf)
+			return 2;
 
-			if (!f)
-			{
-				if (dkimf_db_get(rep->rep_limits, "*", 1, req,
-				                 fields, &f) != 0)
-				{
-					if (errbuf != NULL)
-					{
-						dkimf_db_strerror(rep->rep_reps,
-						                  errbuf,
-						                  errlen);
-					}
-					pthread_mutex_unlock(&rep->rep_lock);
-					return -1;
-				}
-			}
+		buf[req[fields - 1].dbdata_buflen] = '\0';
 
-			if (!f || req[fields - 1].dbdata_buflen >= sizeof buf)
+		reps->reps_limit = (unsigned long) (ceil((double) strtoul(buf, &p, 10) / (double) rep->rep_factor) + 1.);
+		if (p != NULL && *p != '\0')
+		{
+			if (errbuf != NULL)
 			{
-				pthread_mutex_unlock(&rep->rep_lock);
-				return 2;
+				snprintf(errbuf, errlen,
+				         "failed to parse limit reply");
 			}
+			return -1;
+		}
+
+		if (rep->rep_limitmods != NULL)
+		{
+			f = FALSE;
 
-			buf[req[fields - 1].dbdata_buflen] = '\0';
+			req[0].dbdata_buffer = buf;
+			req[0].dbdata_buflen = sizeof buf;
+			req[0].dbdata_flags = 0;
 
-			reps.reps_limit = (unsigned long) (ceil((double) strtoul(buf, &p, 10) / (double) rep->rep_factor) + 1.);
-			if (p != NULL && *p != '\0')
+			if (dkimf_db_get(rep->rep_limitmods, domain, dlen,
+			                 req, 1, &f) != 0)
 			{
 				if (errbuf != NULL)
 				{
-					snprintf(errbuf, errlen,
-					         "failed to parse limit reply");
+					dkimf_db_strerror(rep->rep_limitmods,
+					                  errbuf, errlen);
 				}
-				pthread_mutex_unlock(&rep->rep_lock);
 				return -1;
 			}
 
-			if (rep->rep_limitmods != NULL)
+			if (f && req[0].dbdata_buflen < sizeof buf)
 			{
-				f = FALSE;
-
-				req[0].dbdata_buffer = buf;
-				req[0].dbdata_buflen = sizeof buf;
-				req[0].dbdata_flags = 0;
+				unsigned int mod = 0;
 
-				if (dkimf_db_get(rep->rep_limitmods,
-				                 domain, dlen,
-				                 req, 1, &f) != 0)
-				{
-					if (errbuf != NULL)
-					{
-						dkimf_db_strerror(rep->rep_reps,
-						                  errbuf,
-						                  errlen);
-					}
-					pthread_mutex_unlock(&rep->rep_lock);
-					return -1;
-				}
+				buf[req[0].dbdata_buflen] = '\0';
+				mod = strtoul(&buf[1], &p, 10);
+				if (*p != '\0')
+					buf[0] = '\0';
 
-				if (f && req[0].dbdata_buflen < sizeof buf)
+				switch (buf[0])
 				{
-					unsigned int mod = 0;
-
-					buf[req[0].dbdata_buflen] = '\0';
-					mod = strtoul(&buf[1], &p, 10);
-					if (*p != '\0')
-						buf[0] = '\0';
-
-					switch (buf[0])
-					{
-					  case '+':
-						reps.reps_limit += mod;
-						break;
-
-					  case '*':
-						reps.reps_limit *= mod;
-						break;
-
-					  case '-':
-						reps.reps_limit -= mod;
-						break;
-
-					  case '/':
-						if (mod != 0)
-							reps.reps_limit /= mod;
-						break;
-
-					  case '=':
-						reps.reps_limit = mod;
-						break;
-					}
+				  case '+':
+					reps->reps_limit += mod;
+					break;
+
+				  case '*':
+					reps->reps_limit *= mod;
+					break;
+
+				  case '-':
+					reps->reps_limit -= mod;
+					break;
+
+				  case '/':
+					if (mod != 0)
+						reps->reps_limit /= mod;
+					break;
+
+				  case '=':
+					reps->reps_limit = mod;
+					break;
 				}
 			}
 		}
+	}
 
-		/* get the spam ratio */
-		req[0].dbdata_buffer = buf;
-		req[0].dbdata_buflen = sizeof buf;
-		req[0].dbdata_flags = 0;
+	/* get the spam ratio */
+	req[0].dbdata_buffer = buf;
+	req[0].dbdata_buflen = sizeof buf;
+	req[0].dbdata_flags = 0;
 
-		f = FALSE;
+	f = FALSE;
 
-		if (dkimf_db_get(rep->rep_ratios, domain, dlen, req,
-		                 1, &f) != 0)
+	if (dkimf_db_get(rep->rep_ratios, domain, dlen, req, 1, &f) != 0)
+	{
+		if (errbuf != NULL)
+			dkimf_db_strerror(rep->rep_ratios, errbuf, errlen);
+		return -1;
+	}
+
+	if (!f && !lowtime && signer)
+	{
+		if (dkimf_db_get(rep->rep_ratios,
+		                 DKIMF_REP_LOWTIME,
+		                 strlen(DKIMF_REP_LOWTIME),
+		                 req, 1, &f) != 0)
 		{
 			if (errbuf != NULL)
 			{
-				dkimf_db_strerror(rep->rep_reps,
+				dkimf_db_strerror(rep->rep_ratios,
 				                  errbuf, errlen);
 			}
-			pthread_mutex_unlock(&rep->rep_lock);
 			return -1;
 		}
+	}
 
-		if (!f && !lowtime && sig != NULL)
+	if (!f)
+	{
+		if (dkimf_db_get(rep->rep_ratios, "*", 1, req, 1, &f) != 0)
 		{
-			if (dkimf_db_get(rep->rep_ratios,
-			                 DKIMF_REP_LOWTIME,
-			                 strlen(DKIMF_REP_LOWTIME),
-			                 req, 1, &f) != 0)
+			if (errbuf != NULL)
 			{
-				if (errbuf != NULL)
-				{
-					dkimf_db_strerror(rep->rep_reps,
-					                  errbuf, errlen);
-				}
-				pthread_mutex_unlock(&rep->rep_lock);
-				return -1;
+				dkimf_db_strerror(rep->rep_ratios,
+				                  errbuf, errlen);
 			}
+			return -1;
 		}
+	}
 
-		if (!f)
+	if (!f || req[0].dbdata_buflen >= sizeof buf)
+		return 2;
+
+	buf[req[0].dbdata_buflen] = '\0';
+	p = NULL;
+	reps->reps_ratio = strtof(buf, &p);
+	if (p != NULL && *p != '\0')
+	{
+		if (errbuf != NULL)
+		{
+			snprintf(errbuf, errlen,
+			         "failed to parse ratio reply");
+		}
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+**  DKIMF_REP_CHECK -- check reputation
+**
+**  Parameters:
+**  	rep -- reputation service handle
+**  	signer -- domain of a valid signature on this message
+**  	spam -- spammy or not spammy?  That is the question.
+**  	hash -- hash of the message, for counting dups
+**  	hashlen -- number of bytes in the hash
+**  	limit -- limit for this signer (returned)
+**  	ratio -- spam ratio for this signer (returned)
+**  	count -- message count for this signer (returned)
+**  	spamcnt -- spam count for this signer (returned)
+**  	errbuf -- buffer to receive errors
+**  	errlen -- bytes available at errbuf
+**
+**  Return value:
+**  	2 -- no data found for this domain
+**  	1 -- deny the request
+**  	0 -- allow the request
+**  	-1 -- error
+**
+**  Notes:
+**  	If "signer" is NULL, the null domain record is queried.
+**
+**  	Only the cache shards holding this domain and this message hash
+**  	are locked, and only briefly; reputation data set queries on a
+**  	cache miss are made with no lock held.
+*/
+
+int
+dkimf_rep_check(DKIMF_REP rep, const char *signer, _Bool spam,
+                void *hash, size_t hashlen, unsigned long *limit,
+                float *ratio, unsigned long *count, unsigned long *spamcnt,
+                char *errbuf, size_t errlen)
+{
+	_Bool f;
+	int status;
+	unsigned int rb;
+	unsigned int db;
+	size_t dlen;
+	time_t now;
+	struct repentry *re;
+	struct repshard *rrs;
+	struct repshard *drs;
+	struct reps reps;
+	char domain[DKIM_MAXHOSTNAMELEN + 1];
+
+	assert(rep != NULL);
+
+	if (!rep->rep_running)
+		dkimf_rep_start(rep);
+
+	(void) time(&now);
+
+	if (signer == NULL)
+		strlcpy(domain, DKIMF_REP_NULLDOMAIN, sizeof domain);
+	else
+		strlcpy(domain, signer, sizeof domain);
+
+	dlen = strlen(domain);
+
+	if (hashlen > DKIMF_REP_MAXHASHES)
+		hashlen = DKIMF_REP_MAXHASHES;
+
+	/* check cache first */
+	rrs = dkimf_rep_shard(&rep->rep_reps, (u_char *) domain, dlen, &rb);
+
+	pthread_mutex_lock(&rrs->rs_lock);
+	re = dkimf_rep_find(rrs, rb, (u_char *) domain, dlen);
+	if (re != NULL)
+		memcpy(&reps, &re->re_reps, sizeof reps);
+	pthread_mutex_unlock(&rrs->rs_lock);
+
+	if (re == NULL)
+	{
+		/* cache miss; build a new cache entry */
+		status = dkimf_rep_fetch(rep, signer != NULL, domain,
+		                         sizeof domain, &reps, errbuf, errlen);
+		if (status != 0)
+			return status;
+
+		/* the domain may have been rewritten */
+		dlen = strlen(domain);
+		rrs = dkimf_rep_shard(&rep->rep_reps, (u_char *) domain, dlen,
+		                      &rb);
+
+		pthread_mutex_lock(&rrs->rs_lock);
+		re = dkimf_rep_find(rrs, rb, (u_char *) domain, dlen);
+		if (re == NULL)
 		{
-			if (dkimf_db_get(rep->rep_ratios, "*", 1, req,
-			                 1, &f) != 0)
+			re = dkimf_rep_add(rrs, rb, (u_char *) domain, dlen);
+			if (re == NULL)
 			{
+				pthread_mutex_unlock(&rrs->rs_lock);
 				if (errbuf != NULL)
-				{
-					dkimf_db_strerror(rep->rep_reps,
-					                  errbuf, errlen);
-				}
-				pthread_mutex_unlock(&rep->rep_lock);
+					strlcpy(errbuf, strerror(errno), errlen);
 				return -1;
 			}
-		}
 
-		if (!f || req[0].dbdata_buflen >= sizeof buf)
-		{
-			pthread_mutex_unlock(&rep->rep_lock);
-			return 2;
+			memcpy(&re->re_reps, &reps, sizeof reps);
+			re->re_stamp = reps.reps_retrieved;
+			re->re_dirty = TRUE;
 		}
-
-		buf[req[0].dbdata_buflen] = '\0';
-		p = NULL;
-		reps.reps_ratio = strtof(buf, &p);
-		if (p != NULL && *p != '\0')
+		else
 		{
-			if (errbuf != NULL)
-			{
-				snprintf(errbuf, errlen,
-				         "failed to parse ratio reply");
-			}
-			pthread_mutex_unlock(&rep->rep_lock);
-			return -1;
+			memcpy(&reps, &re->re_reps, sizeof reps);
 		}
+		pthread_mutex_unlock(&rrs->rs_lock);
 	}
 
-	req[0].dbdata_buffer = (void *) &when;
-	req[0].dbdata_buflen = sizeof when;
-	req[0].dbdata_flags = DKIMF_DB_DATA_BINARY;
-
-	f = FALSE;
+	/* see if we've seen this message before */
+	drs = dkimf_rep_shard(&rep->rep_dups, hash, hashlen, &db);
 
-	if (dkimf_db_get(rep->rep_dups, hash, hashlen, req, 1, &f) != 0)
-	{
-		if (errbuf != NULL)
-			dkimf_db_strerror(rep->rep_reps, errbuf, errlen);
-		pthread_mutex_unlock(&rep->rep_lock);
-		return -1;
-	}
+	pthread_mutex_lock(&drs->rs_lock);
+	re = dkimf_rep_find(drs, db, hash, hashlen);
+	f = (re != NULL && re->re_stamp != 0);
+	pthread_mutex_unlock(&drs->rs_lock);
 
 	/* up the counts if this is new */
 	if (!f)
 	{
-		reps.reps_count++;
-		if (spam)
-			reps.reps_spam++;
-
-		/* write it to the cache */
-		if (dkimf_db_put(rep->rep_reps, domain, dlen,
-		                 &reps, sizeof reps) != 0)
+		pthread_mutex_lock(&rrs->rs_lock);
+		re = dkimf_rep_find(rrs, rb, (u_char *) domain, dlen);
+		if (re == NULL)
 		{
-			dkimf_db_strerror(rep->rep_reps, errbuf, errlen);
-			pthread_mutex_unlock(&rep->rep_lock);
-			return -1;
+			/* expired underneath us; put it back */
+			re = dkimf_rep_add(rrs, rb, (u_char *) domain, dlen);
+			if (re == NULL)
+			{
+				pthread_mutex_unlock(&rrs->rs_lock);
+				if (errbuf != NULL)
+					strlcpy(errbuf, strerror(errno), errlen);
+				return -1;
+			}
+
+			memcpy(&re->re_reps, &reps, sizeof reps);
+			re->re_stamp = reps.reps_retrieved;
 		}
+
+		re->re_reps.reps_count++;
+		if (spam)
+			re->re_reps.reps_spam++;
+		re->re_dirty = TRUE;
+
+		memcpy(&reps, &re->re_reps, sizeof reps);
+		pthread_mutex_unlock(&rrs->rs_lock);
 	}
 
 	/* export requested stats */
@@ -595,28 +1108,107 @@ dkimf_rep_check(DKIMF_REP rep, DKIM_SIGINFO *sig, _Bool spam,
 	if (spamcnt != NULL)
 		*spamcnt = reps.reps_spam;
 
+	pthread_mutex_lock(&drs->rs_lock);
+	re = dkimf_rep_find(drs, db, hash, hashlen);
+
 	/* if accepting it now would be within limits */
 	if (reps.reps_count <= rep->rep_minimum ||
 	    (reps.reps_count <= reps.reps_limit &&
 	     (float) reps.reps_spam / (float) reps.reps_count <= reps.reps_ratio))
 	{
-		/* remove from rep_dups if found there */
-		(void) dkimf_db_delete(rep->rep_dups, hash, hashlen);
+		/* remove from the duplicates if found there */
+		if (re != NULL)
+		{
+			/* expire it; the next sweep drops it */
+			re->re_stamp = 0;
+			re->re_dirty = FALSE;
+		}
 
-		pthread_mutex_unlock(&rep->rep_lock);
+		pthread_mutex_unlock(&drs->rs_lock);
 		return 0;
 	}
 	else
 	{
 		/* record the dup */
-		(void) dkimf_db_put(rep->rep_dups, hash, hashlen,
-		                    &now, sizeof now);
+		if (re == NULL)
+			re = dkimf_rep_add(drs, db, hash, hashlen);
+		if (re != NULL)
+		{
+			re->re_stamp = now;
+			re->re_dirty = TRUE;
+		}
 
-		pthread_mutex_unlock(&rep->rep_lock);
+		pthread_mutex_unlock(&drs->rs_lock);
 		return 1;
 	}
 }
 
+/*
+**  DKIMF_REP_PREFETCH -- start reputation queries for several signers
+**
+**  Parameters:
+**  	rep -- reputation service handle
+**  	signers -- signing domains about to be checked
+**  	nsigners -- number of entries at "signers"
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Domains not already cached are handed to the limit and ratio
+**  	data sets so that remote ones can look them all up at once
+**  	rather than one per dkimf_rep_check() call.  Failures are
+**  	ignored here; dkimf_rep_check() will report them.
+*/
+
+void
+dkimf_rep_prefetch(DKIMF_REP rep, const char **signers,
+                   unsigned int nsigners)
+{
+	unsigned int c;
+	unsigned int n = 0;
+	unsigned int b;
+	size_t dlen;
+	struct repentry *re;
+	struct repshard *rs;
+	const char **miss;
+
+	assert(rep != NULL);
+	assert(signers != NULL);
+
+	if (nsigners == 0 ||
+	    (rep->rep_limits == NULL && rep->rep_ratios == NULL))
+		return;
+
+	miss = (const char **) malloc(sizeof(char *) * nsigners);
+	if (miss == NULL)
+		return;
+
+	for (c = 0; c < nsigners; c++)
+	{
+		dlen = strlen(signers[c]);
+		rs = dkimf_rep_shard(&rep->rep_reps, (u_char *) signers[c],
+		                     dlen, &b);
+
+		pthread_mutex_lock(&rs->rs_lock);
+		re = dkimf_rep_find(rs, b, (u_char *) signers[c], dlen);
+		pthread_mutex_unlock(&rs->rs_lock);
+
+		if (re == NULL)
+			miss[n++] = signers[c];
+	}
+
+	if (n > 0)
+	{
+		if (rep->rep_limits != NULL)
+			(void) dkimf_db_prefetch(rep->rep_limits, miss, n);
+		if (rep->rep_ratios != NULL)
+			(void) dkimf_db_prefetch(rep->rep_ratios, miss, n);
+	}
+
+	free(miss);
+}
+
 /*
 **  DKIMF_REP_CHOWN_CACHE -- set the owner of a cache file
 **
@@ -635,7 +1227,8 @@ dkimf_rep_chown_cache(DKIMF_REP rep, uid_t uid)
 	assert(rep != NULL);
 	assert(uid >= 0);
 
-	if (dkimf_db_chown(rep->rep_reps, uid) == 1)
+	if (rep->rep_reps.rt_db == NULL ||
+	    dkimf_db_chown(rep->rep_reps.rt_db, uid) == 1)
 		return 0;
 	else
 		return -1;
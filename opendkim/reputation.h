@@ -29,11 +29,12 @@ typedef struct reputation * DKIMF_REP;
 extern int dkimf_rep_init(DKIMF_REP *, time_t, unsigned int, unsigned int,
                                char *, char *, DKIMF_DB, DKIMF_DB, DKIMF_DB,
                                DKIMF_DB);
-extern int dkimf_rep_check(DKIMF_REP, DKIM_SIGINFO *, _Bool,
+extern int dkimf_rep_check(DKIMF_REP, const char *, _Bool,
                                 void *, size_t, unsigned long *, float *,
                                 unsigned long *, unsigned long *,
                                 char *, size_t);
 extern int dkimf_rep_chown_cache(DKIMF_REP, uid_t);
 extern void dkimf_rep_close(DKIMF_REP);
+extern void dkimf_rep_prefetch(DKIMF_REP, const char **, unsigned int);
 
 #endif /* _REPUTATION_H_ */
@@ -13,6 +13,7 @@
 #include <sys/param.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/file.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <string.h>
@@ -55,6 +56,9 @@
 #include "util.h"
 #include "opendkim.h"
 #include "opendkim-db.h"
+#ifdef _FFR_ASYNC_LOG
+# include "asynclog.h"
+#endif /* _FFR_ASYNC_LOG */
 
 /* globals */
 static pthread_mutex_t stats_lock;
@@ -135,6 +139,22 @@ dkimf_stats_record(char *path, u_char *jobid, char *name, char *prefix,
 		return -1;
 	}
 
+	/* worker processes append to the same file */
+#ifdef LOCK_EX
+	(void) flock(fileno(out), LOCK_EX);
+#else /* LOCK_EX */
+	{
+		struct flock l;
+
+		l.l_start = 0;
+		l.l_len = 0;
+		l.l_type = F_WRLCK;
+		l.l_whence = SEEK_SET;
+
+		(void) fcntl(fileno(out), F_SETLKW, &l);
+	}
+#endif /* LOCK_EX */
+
 	/* write version if file is new */
 	if (ftell(out) == 0)
 		fprintf(out, "V%d\n", DKIMS_VERSION);
@@ -0,0 +1,156 @@
+/*
+**  Copyright 2025 OpenDKIM contributors.
+*/
+
+#include "build-config.h"
+
+/* system includes */
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sysexits.h>
+
+/* opendkim includes */
+#include "../opendkim-db.h"
+#include "../opendkim.h"
+#include "t-perf.h"
+
+/*
+**  USAGE -- print usage message
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	EX_USAGE
+*/
+
+int
+usage(void)
+{
+	fprintf(stderr, "%s: usage: %s [options]\n"
+	        "\t-k keys     \tnumber of keys in the test database\n"
+	        PERF_USAGE, progname, progname);
+
+	return EX_USAGE;
+}
+
+/*
+**  MAIN -- program mainline
+**
+**  Parameters:
+**  	The usual.
+**
+**  Return value:
+**  	Exit status.
+*/
+
+int
+main(int argc, char **argv)
+{
+	int c;
+	int fd;
+	int mode;
+	char *p;
+	char *err = NULL;
+	pthread_mutex_t lock;
+	char key[BUFRSZ];
+	char value[BUFRSZ];
+	char path[BUFRSZ];
+	char name[BUFRSZ];
+	char title[BUFRSZ];
+
+	progname = (p = strrchr(argv[0], '/')) == NULL ? argv[0] : p + 1;
+
+	while ((c = getopt(argc, argv, "k:" PERF_OPTS)) != -1)
+	{
+		switch (c)
+		{
+		  case 'k':
+			perf_nkeys = strtoul(optarg, &p, 10);
+			if (*p != '\0' || perf_nkeys <= 0)
+				return usage();
+			break;
+
+		  default:
+			if (perf_option(c, optarg) != 1)
+				return usage();
+			break;
+		}
+	}
+
+	snprintf(path, sizeof path, "/tmp/%s.XXXXXX", progname);
+	fd = mkstemp(path);
+	if (fd == -1)
+	{
+		perror("mkstemp");
+		return 1;
+	}
+	close(fd);
+	unlink(path);
+
+	snprintf(name, sizeof name, "db:%s", path);
+
+	if (dkimf_db_open(&perf_db, name, 0, NULL, &err) != 0)
+	{
+		fprintf(stderr, "%s: dkimf_db_open(): %s\n", progname, err);
+		return 1;
+	}
+
+	for (c = 0; c < perf_nkeys; c++)
+	{
+		perf_key(c, key, sizeof key);
+		perf_value(c, value, sizeof value);
+
+		if (dkimf_db_put(perf_db, key, strlen(key), value,
+		                 strlen(value)) != 0)
+		{
+			fprintf(stderr, "%s: dkimf_db_put() failed\n",
+			        progname);
+			unlink(path);
+			return 1;
+		}
+	}
+
+	dkimf_db_close(perf_db);
+
+	/*
+	**  A writable handle with a mutex takes the mutex and the file lock
+	**  on every lookup; a read-only one is shared by all threads.
+	*/
+
+	pthread_mutex_init(&lock, NULL);
+
+	for (mode = 0; mode <= 1; mode++)
+	{
+		if (dkimf_db_open(&perf_db, name,
+		                  mode == 0 ? 0 : DKIMF_DB_FLAG_READONLY,
+		                  mode == 0 ? &lock : NULL, &err) != 0)
+		{
+			fprintf(stderr, "%s: dkimf_db_open(): %s\n",
+			        progname, err);
+			unlink(path);
+			return 1;
+		}
+
+		snprintf(title, sizeof title,
+		         "DB LOOKUP SPEED TEST: %s handle, %d keys",
+		         mode == 0 ? "locked" : "shared", perf_nkeys);
+
+		if (perf_run(title, "lookups", perf_lookup) != 0)
+		{
+			dkimf_db_close(perf_db);
+			unlink(path);
+			return 1;
+		}
+
+		dkimf_db_close(perf_db);
+	}
+
+	unlink(path);
+
+	return 0;
+}
@@ -0,0 +1,285 @@
+/*
+**  Copyright 2025 OpenDKIM contributors.
+*/
+
+#include "build-config.h"
+
+/* system includes */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sysexits.h>
+
+/* libodbx includes */
+#include <odbx.h>
+
+/* opendkim includes */
+#include "../opendkim-db.h"
+#include "../opendkim.h"
+#include "t-perf.h"
+
+#define	DEFBACKEND	"sqlite3"
+#define	TESTDB		"t-dsn-perf.db"
+
+/*
+**  SQLRUN -- run a statement directly, discarding any results
+**
+**  Parameters:
+**  	odbx -- ODBX handle
+**  	query -- statement to run
+**
+**  Return value:
+**  	0 on success, -1 on failure.
+*/
+
+int
+sqlrun(odbx_t *odbx, const char *query)
+{
+	int err;
+	odbx_result_t *result;
+
+	err = odbx_query(odbx, query, 0);
+	if (err < 0)
+	{
+		fprintf(stderr, "%s: %s: %s\n", progname, query,
+		        odbx_error(odbx, err));
+		return -1;
+	}
+
+	for (;;)
+	{
+		result = NULL;
+		err = odbx_result(odbx, &result, NULL, 0);
+		if (err < 0)
+		{
+			fprintf(stderr, "%s: %s: %s\n", progname, query,
+			        odbx_error(odbx, err));
+			if (result != NULL)
+				(void) odbx_result_finish(result);
+			return -1;
+		}
+		else if (err == ODBX_RES_DONE)
+		{
+			(void) odbx_result_finish(result);
+			return 0;
+		}
+
+		while (odbx_row_fetch(result) > 0)
+			continue;
+
+		(void) odbx_result_finish(result);
+	}
+}
+
+/*
+**  CLEANUP -- remove the scratch directory
+**
+**  Parameters:
+**  	dir -- directory to remove
+**
+**  Return value:
+**  	None.
+*/
+
+void
+cleanup(const char *dir)
+{
+	DIR *d;
+	struct dirent *de;
+	char path[BUFRSZ];
+
+	d = opendir(dir);
+	if (d != NULL)
+	{
+		while ((de = readdir(d)) != NULL)
+		{
+			if (strcmp(de->d_name, ".") == 0 ||
+			    strcmp(de->d_name, "..") == 0)
+				continue;
+
+			snprintf(path, sizeof path, "%s/%s", dir, de->d_name);
+			(void) unlink(path);
+		}
+
+		closedir(d);
+	}
+
+	(void) rmdir(dir);
+}
+
+/*
+**  USAGE -- print usage message
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	EX_USAGE
+*/
+
+int
+usage(void)
+{
+	fprintf(stderr, "%s: usage: %s [options]\n"
+	        "\t-b backend  \tOpenDBX backend to use (default \"%s\")\n"
+	        "\t-k keys     \tnumber of keys in the test database\n"
+	        PERF_USAGE, progname, progname, DEFBACKEND);
+
+	return EX_USAGE;
+}
+
+/*
+**  MAIN -- program mainline
+**
+**  Parameters:
+**  	The usual.
+**
+**  Return value:
+**  	Exit status.
+*/
+
+int
+main(int argc, char **argv)
+{
+	int c;
+	int err;
+	int pass;
+	unsigned int poolmax;
+	char *p;
+	char *backend = DEFBACKEND;
+	char *dberr = NULL;
+	odbx_t *odbx;
+	char dir[BUFRSZ];
+	char key[BUFRSZ];
+	char value[BUFRSZ];
+	char query[BUFRSZ];
+	char name[BUFRSZ];
+	char title[BUFRSZ];
+
+	progname = (p = strrchr(argv[0], '/')) == NULL ? argv[0] : p + 1;
+
+	while ((c = getopt(argc, argv, "b:k:" PERF_OPTS)) != -1)
+	{
+		switch (c)
+		{
+		  case 'b':
+			backend = optarg;
+			break;
+
+		  case 'k':
+			perf_nkeys = strtoul(optarg, &p, 10);
+			if (*p != '\0' || perf_nkeys <= 0)
+				return usage();
+			break;
+
+		  default:
+			if (perf_option(c, optarg) != 1)
+				return usage();
+			break;
+		}
+	}
+
+	/*
+	**  A DSN host can't contain "/", so work in a scratch directory
+	**  and give the file backends "." as the host.
+	*/
+
+	snprintf(dir, sizeof dir, "/tmp/%s.XXXXXX", progname);
+	if (mkdtemp(dir) == NULL)
+	{
+		perror("mkdtemp");
+		return 1;
+	}
+
+	if (chdir(dir) != 0)
+	{
+		perror(dir);
+		cleanup(dir);
+		return 1;
+	}
+
+	err = odbx_init(&odbx, backend, ".", "");
+	if (err >= 0)
+		err = odbx_bind(odbx, TESTDB, "", "", ODBX_BIND_SIMPLE);
+	if (err < 0)
+	{
+		fprintf(stderr, "%s: %s: %s\n", progname, backend,
+		        odbx_error(NULL, err));
+		cleanup(dir);
+		return 1;
+	}
+
+	if (sqlrun(odbx, "CREATE TABLE keys (name VARCHAR(255) PRIMARY KEY, value VARCHAR(255))") != 0 ||
+	    sqlrun(odbx, "BEGIN") != 0)
+	{
+		cleanup(dir);
+		return 1;
+	}
+
+	for (c = 0; c < perf_nkeys; c++)
+	{
+		perf_key(c, key, sizeof key);
+		perf_value(c, value, sizeof value);
+		snprintf(query, sizeof query,
+		         "INSERT INTO keys VALUES ('%s', '%s')", key, value);
+
+		if (sqlrun(odbx, query) != 0)
+		{
+			cleanup(dir);
+			return 1;
+		}
+	}
+
+	if (sqlrun(odbx, "COMMIT") != 0)
+	{
+		cleanup(dir);
+		return 1;
+	}
+
+	(void) odbx_unbind(odbx);
+	(void) odbx_finish(odbx);
+
+	/*
+	**  A pool of one connection behaves like the old single shared
+	**  handle; the second pass lets each thread have its own.
+	*/
+
+	for (pass = 0; pass <= 1; pass++)
+	{
+		poolmax = (pass == 0 ? 1 : perf_maxthreads);
+
+		snprintf(name, sizeof name,
+		         "dsn:%s://./%s/table=keys?keycol=name?datacol=value?poolmax=%u",
+		         backend, TESTDB, poolmax);
+
+		if (dkimf_db_open(&perf_db, name, DKIMF_DB_FLAG_READONLY, NULL,
+		                  &dberr) != 0)
+		{
+			fprintf(stderr, "%s: dkimf_db_open(): %s\n",
+			        progname, dberr);
+			cleanup(dir);
+			return 1;
+		}
+
+		snprintf(title, sizeof title,
+		         "DSN LOOKUP SPEED TEST: %s, pool of %u, %d keys",
+		         backend, poolmax, perf_nkeys);
+
+		if (perf_run(title, "lookups", perf_lookup) != 0)
+		{
+			dkimf_db_close(perf_db);
+			cleanup(dir);
+			return 1;
+		}
+
+		dkimf_db_close(perf_db);
+	}
+
+	cleanup(dir);
+
+	return 0;
+}
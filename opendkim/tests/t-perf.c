@@ -0,0 +1,238 @@
+/*
+**  Copyright 2025 OpenDKIM contributors.
+*/
+
+#include "build-config.h"
+
+/* system includes */
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* opendkim includes */
+#include "../opendkim.h"
+#include "t-perf.h"
+
+#define	DEFKEYS		10000
+#define	DEFTESTINT	2
+#define	DEFTHREADS	8
+
+/* data types */
+struct perfthread
+{
+	unsigned int	pt_seed;		/* random seed */
+	unsigned long	pt_ops;			/* operations completed */
+	perf_op_t	pt_op;			/* operation */
+};
+
+/* globals */
+char *progname;
+int perf_maxthreads = DEFTHREADS;
+time_t perf_testint = DEFTESTINT;
+int perf_nkeys = DEFKEYS;
+DKIMF_DB perf_db;
+
+static volatile _Bool perf_done;
+
+/*
+**  PERF_OPTION -- process a command line option common to the benchmarks
+**
+**  Parameters:
+**  	c -- option character
+**  	arg -- option argument
+**
+**  Return value:
+**  	1 if the option was handled, 0 if it isn't a common one, -1 if its
+**  	argument is invalid.
+*/
+
+int
+perf_option(int c, char *arg)
+{
+	char *p;
+
+	switch (c)
+	{
+	  case 'n':
+		perf_maxthreads = strtoul(arg, &p, 10);
+		if (*p != '\0' || perf_maxthreads <= 0 ||
+		    perf_maxthreads > BUFRSZ)
+			return -1;
+		return 1;
+
+	  case 't':
+		perf_testint = strtoul(arg, &p, 10);
+		if (*p != '\0')
+			return -1;
+		return 1;
+
+	  default:
+		return 0;
+	}
+}
+
+/*
+**  PERF_THREAD -- benchmark thread
+**
+**  Parameters:
+**  	vp -- thread state (struct perfthread *)
+**
+**  Return value:
+**  	NULL.
+*/
+
+static void *
+perf_thread(void *vp)
+{
+	struct perfthread *pt;
+
+	pt = (struct perfthread *) vp;
+
+	while (!perf_done)
+	{
+		pt->pt_op(&pt->pt_seed);
+		pt->pt_ops++;
+	}
+
+	return NULL;
+}
+
+/*
+**  PERF_RUN -- time an operation at increasing thread counts
+**
+**  Parameters:
+**  	title -- description of the test
+**  	unit -- name of the operation, for the results
+**  	op -- operation
+**
+**  Return value:
+**  	0 on success, -1 on failure.
+**
+**  Notes:
+**  	Runs 1, 2, 4... threads up to perf_maxthreads, each for
+**  	perf_testint seconds.
+*/
+
+int
+perf_run(const char *title, const char *unit, perf_op_t op)
+{
+	int c;
+	int n;
+	unsigned long total;
+	pthread_t tids[BUFRSZ];
+	struct perfthread threads[BUFRSZ];
+
+	for (n = 1; n <= perf_maxthreads; n *= 2)
+	{
+		fprintf(stdout, "*** %s: %d thread(s) for %lds\n",
+		        title, n, (long) perf_testint);
+
+		perf_done = FALSE;
+
+		for (c = 0; c < n; c++)
+		{
+			threads[c].pt_seed = c + 1;
+			threads[c].pt_ops = 0;
+			threads[c].pt_op = op;
+
+			if (pthread_create(&tids[c], NULL, perf_thread,
+			                   &threads[c]) != 0)
+			{
+				fprintf(stderr, "%s: pthread_create() failed\n",
+				        progname);
+				perf_done = TRUE;
+				while (--c >= 0)
+					(void) pthread_join(tids[c], NULL);
+				return -1;
+			}
+		}
+
+		sleep(perf_testint);
+		perf_done = TRUE;
+
+		total = 0;
+		for (c = 0; c < n; c++)
+		{
+			(void) pthread_join(tids[c], NULL);
+			total += threads[c].pt_ops;
+		}
+
+		fprintf(stdout, "*** %lu %s (%lu %s/sec)\n", total, unit,
+		        total / (perf_testint == 0 ? 1 : perf_testint), unit);
+	}
+
+	return 0;
+}
+
+/*
+**  PERF_KEY -- generate the name of a test key
+**
+**  Parameters:
+**  	n -- key number
+**  	buf -- buffer
+**  	buflen -- bytes available at "buf"
+**
+**  Return value:
+**  	None.
+*/
+
+void
+perf_key(int n, char *buf, size_t buflen)
+{
+	snprintf(buf, buflen, "selector._domainkey.domain%d.example", n);
+}
+
+/*
+**  PERF_VALUE -- generate the value of a test key
+**
+**  Parameters:
+**  	n -- key number
+**  	buf -- buffer
+**  	buflen -- bytes available at "buf"
+**
+**  Return value:
+**  	None.
+*/
+
+void
+perf_value(int n, char *buf, size_t buflen)
+{
+	snprintf(buf, buflen, "domain%d.example:selector:/var/db/dkim/%d.key",
+	         n, n);
+}
+
+/*
+**  PERF_LOOKUP -- look up a random test key in perf_db
+**
+**  Parameters:
+**  	seed -- calling thread's random seed
+**
+**  Return value:
+**  	None.  Exits if the key isn't found.
+*/
+
+void
+perf_lookup(unsigned int *seed)
+{
+	_Bool exists;
+	char key[BUFRSZ];
+	char value[BUFRSZ];
+	struct dkimf_db_data dbd;
+
+	perf_key(rand_r(seed) % perf_nkeys, key, sizeof key);
+
+	memset(&dbd, '\0', sizeof dbd);
+	dbd.dbdata_buffer = value;
+	dbd.dbdata_buflen = sizeof value;
+
+	exists = FALSE;
+	if (dkimf_db_get(perf_db, key, 0, &dbd, 1, &exists) != 0 || !exists)
+	{
+		fprintf(stderr, "%s: dkimf_db_get(%s) failed\n", progname, key);
+		exit(1);
+	}
+}
@@ -0,0 +1,39 @@
+/*
+**  Copyright 2025 OpenDKIM contributors.
+*/
+
+#ifndef _T_PERF_H_
+#define _T_PERF_H_
+
+#include "build-config.h"
+
+/* system includes */
+#include <sys/types.h>
+#include <time.h>
+
+/* opendkim includes */
+#include "../opendkim-db.h"
+
+/* macros */
+#define	PERF_OPTS	"n:t:"
+#define	PERF_USAGE	"\t-n threads  \tmaximum number of concurrent threads\n" \
+			"\t-t seconds  \ttest time in seconds per thread count\n"
+
+/* one operation of a benchmark, given the calling thread's random seed */
+typedef void (*perf_op_t)(unsigned int *);
+
+/* globals */
+extern char *progname;
+extern int perf_maxthreads;
+extern time_t perf_testint;
+extern int perf_nkeys;
+extern DKIMF_DB perf_db;
+
+/* prototypes */
+extern void perf_key(int, char *, size_t);
+extern void perf_lookup(unsigned int *);
+extern int perf_option(int, char *);
+extern int perf_run(const char *, const char *, perf_op_t);
+extern void perf_value(int, char *, size_t);
+
+#endif /* ! _T_PERF_H_ */
@@ -0,0 +1,145 @@
+/*
+**  Copyright 2025 OpenDKIM contributors.
+*/
+
+#include "build-config.h"
+
+/* system includes */
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sysexits.h>
+
+/* opendkim includes */
+#include "../opendkim-db.h"
+#include "../opendkim.h"
+#include "../reputation.h"
+#include "t-perf.h"
+
+#define	DEFDOMAINS	1000
+#define	HASHLEN		32
+
+int ndomains = DEFDOMAINS;
+DKIMF_REP rep;
+
+/*
+**  CHECK -- make one reputation check
+**
+**  Parameters:
+**  	seed -- calling thread's random seed
+**
+**  Return value:
+**  	None.  Exits if the check fails.
+*/
+
+void
+check(unsigned int *seed)
+{
+	int c;
+	unsigned char hash[HASHLEN];
+	char domain[BUFRSZ];
+
+	snprintf(domain, sizeof domain, "domain%d.example.com",
+	         rand_r(seed) % ndomains);
+
+	for (c = 0; c < HASHLEN; c++)
+		hash[c] = rand_r(seed) & 0xff;
+
+	if (dkimf_rep_check(rep, domain, (rand_r(seed) % 10) == 0,
+	                    hash, sizeof hash, NULL, NULL, NULL, NULL,
+	                    NULL, 0) == -1)
+	{
+		fprintf(stderr, "%s: dkimf_rep_check() failed\n", progname);
+		exit(1);
+	}
+}
+
+/*
+**  USAGE -- print usage message
+**
+**  Parameters:
+**  	None.
+**
+**  Return value:
+**  	EX_USAGE
+*/
+
+int
+usage(void)
+{
+	fprintf(stderr, "%s: usage: %s [options]\n"
+	        "\t-d domains  \tnumber of distinct signing domains\n"
+	        PERF_USAGE, progname, progname);
+
+	return EX_USAGE;
+}
+
+/*
+**  MAIN -- program mainline
+**
+**  Parameters:
+**  	The usual.
+**
+**  Return value:
+**  	Exit status.
+*/
+
+int
+main(int argc, char **argv)
+{
+	int c;
+	int status;
+	char *p;
+	char *err = NULL;
+	DKIMF_DB limits;
+	DKIMF_DB ratios;
+	char title[BUFRSZ];
+
+	progname = (p = strrchr(argv[0], '/')) == NULL ? argv[0] : p + 1;
+
+	while ((c = getopt(argc, argv, "d:" PERF_OPTS)) != -1)
+	{
+		switch (c)
+		{
+		  case 'd':
+			ndomains = strtoul(optarg, &p, 10);
+			if (*p != '\0' || ndomains <= 0)
+				return usage();
+			break;
+
+		  default:
+			if (perf_option(c, optarg) != 1)
+				return usage();
+			break;
+		}
+	}
+
+	if (dkimf_db_open(&limits, "csl:*=100000", DKIMF_DB_FLAG_READONLY,
+	                  NULL, &err) != 0 ||
+	    dkimf_db_open(&ratios, "csl:*=0.5", DKIMF_DB_FLAG_READONLY,
+	                  NULL, &err) != 0)
+	{
+		fprintf(stderr, "%s: dkimf_db_open(): %s\n", progname, err);
+		return 1;
+	}
+
+	if (dkimf_rep_init(&rep, 1, 0, 3600, NULL, NULL, limits, NULL,
+	                   ratios, NULL) != 0)
+	{
+		fprintf(stderr, "%s: dkimf_rep_init() failed\n", progname);
+		return 1;
+	}
+
+	snprintf(title, sizeof title, "REPUTATION CHECK SPEED TEST: %d domains",
+	         ndomains);
+
+	status = perf_run(title, "checks", check);
+
+	dkimf_rep_close(rep);
+	dkimf_db_close(limits);
+	dkimf_db_close(ratios);
+
+	return (status == 0 ? 0 : 1);
+}
@@ -0,0 +1,299 @@
+/*
+**  Copyright 2025 OpenDKIM contributors.
+*/
+
+#include "build-config.h"
+
+/* system includes */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* librepute includes */
+#include <repute.h>
+
+#define	MAXSUBJECTS	16
+#define	BUFRSZ		2048
+
+#define	TEMPLATE	"http://{+service}/q{?subject}"
+#define	REPLY		"{\"application\": \"email-id\", \"reputons\": " \
+			"[{\"rater\": \"t-repute-cache\", " \
+			"\"assertion\": \"spam\", \"identity\": \"dkim\", " \
+			"\"rated\": \"example.com\", \"rating\": 0.5, " \
+			"\"confidence\": 1.0, \"sample-size\": 10, " \
+			"\"generated\": 1}]}"
+
+struct subject
+{
+	unsigned int	s_hits;
+	char		s_name[BUFRSZ];
+};
+
+int listener;
+unsigned int nsubjects;
+struct subject subjects[MAXSUBJECTS];
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+**  HITS -- number of queries the server has seen for a subject
+**
+**  Parameters:
+**  	name -- subject
+**
+**  Return value:
+**  	Number of queries seen.
+*/
+
+unsigned int
+hits(const char *name)
+{
+	unsigned int c;
+	unsigned int n = 0;
+
+	pthread_mutex_lock(&lock);
+
+	for (c = 0; c < nsubjects; c++)
+	{
+		if (strcmp(subjects[c].s_name, name) == 0)
+		{
+			n = subjects[c].s_hits;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return n;
+}
+
+/*
+**  HIT -- count a query for a subject
+**
+**  Parameters:
+**  	name -- subject
+**
+**  Return value:
+**  	None.
+*/
+
+void
+hit(const char *name)
+{
+	unsigned int c;
+
+	pthread_mutex_lock(&lock);
+
+	for (c = 0; c < nsubjects; c++)
+	{
+		if (strcmp(subjects[c].s_name, name) == 0)
+			break;
+	}
+
+	if (c == nsubjects)
+	{
+		assert(nsubjects < MAXSUBJECTS);
+		strncpy(subjects[c].s_name, name,
+		        sizeof subjects[c].s_name - 1);
+		nsubjects++;
+	}
+
+	subjects[c].s_hits++;
+
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+**  SERVER -- REPUTE server stand-in
+**
+**  Parameters:
+**  	arg -- unused
+**
+**  Return value:
+**  	NULL.
+**
+**  Notes:
+**  	Serves the URI template, a reputon for any subject, and an
+**  	empty (unparseable) reply for subjects starting with "bad".
+*/
+
+void *
+server(void *arg)
+{
+	int fd;
+	size_t len;
+	ssize_t n;
+	char *p;
+	char *body;
+	char req[BUFRSZ];
+	char reply[BUFRSZ];
+
+	for (;;)
+	{
+		fd = accept(listener, NULL, NULL);
+		if (fd < 0)
+			continue;
+
+		memset(req, '\0', sizeof req);
+		len = 0;
+		while (len < sizeof req - 1 && strstr(req, "\r\n\r\n") == NULL)
+		{
+			n = read(fd, req + len, sizeof req - 1 - len);
+			if (n <= 0)
+				break;
+			len += n;
+		}
+
+		body = REPLY;
+		if (strncmp(req, "GET /.well-known/repute-template ", 33) == 0)
+		{
+			body = TEMPLATE;
+		}
+		else if (strncmp(req, "GET /q?subject=", 15) == 0)
+		{
+			p = strchr(req + 15, ' ');
+			if (p != NULL)
+				*p = '\0';
+			hit(req + 15);
+			if (strncmp(req + 15, "bad", 3) == 0)
+				body = "";
+		}
+
+		snprintf(reply, sizeof reply,
+		         "HTTP/1.1 200 OK\r\n"
+		         "Content-Type: application/json\r\n"
+		         "Content-Length: %lu\r\n"
+		         "Connection: close\r\n"
+		         "\r\n%s",
+		         (unsigned long) strlen(body), body);
+
+		(void) write(fd, reply, strlen(reply));
+		close(fd);
+	}
+
+	return NULL;
+}
+
+/*
+**  QUERY -- make one query
+**
+**  Parameters:
+**  	rep -- REPUTE handle
+**  	domain -- domain to query
+**
+**  Return value:
+**  	A REPUTE_STAT_* constant.
+*/
+
+REPUTE_STAT
+query(REPUTE rep, const char *domain)
+{
+	float rating;
+
+	return repute_query(rep, domain, &rating, NULL, NULL, NULL, NULL);
+}
+
+/*
+**  MAIN -- program mainline
+**
+**  Parameters:
+**  	argc, argv -- the usual
+**
+**  Return value:
+**  	Exit status.
+*/
+
+int
+main(int argc, char **argv)
+{
+	socklen_t slen;
+	pthread_t tid;
+	REPUTE rep;
+	REPUTE rep2;
+	struct sockaddr_in sin;
+	const char *batch[] = { "a.example", "b.example", "bad.example" };
+	const char *later[] = { "d.example" };
+	char service[BUFRSZ];
+
+	printf("*** REPUTE reply cache against a local server\n");
+
+	/* keep any configured proxy out of it */
+	setenv("no_proxy", "*", 1);
+
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	assert(listener >= 0);
+
+	memset(&sin, '\0', sizeof sin);
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = 0;
+	assert(bind(listener, (struct sockaddr *) &sin, sizeof sin) == 0);
+	assert(listen(listener, 16) == 0);
+
+	slen = sizeof sin;
+	assert(getsockname(listener, (struct sockaddr *) &sin, &slen) == 0);
+	snprintf(service, sizeof service, "127.0.0.1:%u",
+	         ntohs(sin.sin_port));
+
+	assert(pthread_create(&tid, NULL, server, NULL) == 0);
+	(void) pthread_detach(tid);
+
+	repute_init();
+
+	rep = repute_new(service, 0);
+	assert(rep != NULL);
+
+	/* a prefetch makes one query per domain; replies are then reused */
+	assert(repute_prefetch(rep, batch, 3) == REPUTE_STAT_OK);
+	assert(hits("a.example") == 1);
+	assert(hits("b.example") == 1);
+	assert(hits("bad.example") == 1);
+	assert(query(rep, "a.example") == REPUTE_STAT_OK);
+	assert(query(rep, "b.example") == REPUTE_STAT_OK);
+	assert(hits("a.example") == 1);
+	assert(hits("b.example") == 1);
+
+	/* an unparseable reply is kept only for the (shorter) negative TTL */
+	assert(query(rep, "bad.example") == REPUTE_STAT_PARSE);
+	assert(hits("bad.example") == 1);
+	repute_set_cachettl(rep, 3600, 0);
+	assert(query(rep, "bad2.example") == REPUTE_STAT_PARSE);
+	assert(query(rep, "bad2.example") == REPUTE_STAT_PARSE);
+	assert(hits("bad2.example") == 2);
+	assert(query(rep, "c.example") == REPUTE_STAT_OK);
+	assert(query(rep, "c.example") == REPUTE_STAT_OK);
+	assert(hits("c.example") == 1);
+	repute_set_cachettl(rep, 3600, 1);
+	assert(query(rep, "bad3.example") == REPUTE_STAT_PARSE);
+	assert(query(rep, "bad3.example") == REPUTE_STAT_PARSE);
+	assert(hits("bad3.example") == 1);
+	sleep(2);
+	assert(query(rep, "bad3.example") == REPUTE_STAT_PARSE);
+	assert(hits("bad3.example") == 2);
+
+	/* with no cache, a prefetch has nowhere to put anything */
+	repute_set_cachettl(rep, 0, 0);
+	assert(repute_prefetch(rep, later, 1) == REPUTE_STAT_OK);
+	assert(hits("d.example") == 0);
+	assert(query(rep, "d.example") == REPUTE_STAT_OK);
+	assert(query(rep, "d.example") == REPUTE_STAT_OK);
+	assert(hits("d.example") == 2);
+
+	/* the TTL belongs to the handle */
+	rep2 = repute_new(service, 0);
+	assert(rep2 != NULL);
+	assert(query(rep2, "d.example") == REPUTE_STAT_OK);
+	assert(query(rep2, "d.example") == REPUTE_STAT_OK);
+	assert(hits("d.example") == 3);
+
+	repute_close(rep2);
+	repute_close(rep);
+
+	return 0;
+}
@@ -0,0 +1,132 @@
+-- Copyright 2025 OpenDKIM contributors.
+
+-- simple/simple signing test using the built-in milter engine
+--
+-- Opens more connections than the engine has workers and interleaves
+-- them, then confirms that a correct signature is added to each message.
+
+mt.echo("*** simple/simple signing test using the built-in milter engine")
+
+-- setup
+if TESTSOCKET ~= nil then
+	sock = TESTSOCKET
+else
+	sock = "unix:" .. mt.getcwd() .. "/t-sign-ss-engine.sock"
+end
+
+binpath = mt.getcwd() .. "/.."
+if os.getenv("srcdir") ~= nil then
+	mt.chdir(os.getenv("srcdir"))
+end
+
+-- try to start the filter
+mt.startfilter(binpath .. "/opendkim", "-x", "t-sign-ss-engine.conf",
+               "-p", sock)
+
+-- send a header and check the reply
+function header(conn, name, value)
+	if mt.header(conn, name, value) ~= nil then
+		error("mt.header(" .. name .. ") failed")
+	end
+	if mt.getreply(conn) ~= SMFIR_CONTINUE then
+		error("mt.header(" .. name .. ") unexpected reply")
+	end
+end
+
+-- open all connections before any message is finished; there are more
+-- of them than there are workers
+conns = {}
+for n = 1, 3 do
+	conns[n] = mt.connect(sock, 40, 0.25)
+	if conns[n] == nil then
+		error("mt.connect() failed")
+	end
+
+	-- send connection information
+	-- mt.negotiate() is called implicitly
+	if mt.conninfo(conns[n], "localhost", "127.0.0.1") ~= nil then
+		error("mt.conninfo() failed")
+	end
+	if mt.getreply(conns[n]) ~= SMFIR_CONTINUE then
+		error("mt.conninfo() unexpected reply")
+	end
+end
+
+-- send envelope macros and sender data on each connection in turn
+-- mt.helo() is called implicitly
+for n = 1, 3 do
+	mt.macro(conns[n], SMFIC_MAIL, "i", "t-sign-ss-engine-" .. n)
+	if mt.mailfrom(conns[n], "user@example.com") ~= nil then
+		error("mt.mailfrom() failed")
+	end
+	if mt.getreply(conns[n]) ~= SMFIR_CONTINUE then
+		error("mt.mailfrom() unexpected reply")
+	end
+end
+
+-- send headers, interleaved across connections
+-- mt.rcptto() is called implicitly
+for n = 1, 3 do
+	header(conns[n], "From", "user@example.com")
+end
+for n = 1, 3 do
+	header(conns[n], "Date", "Tue, 22 Dec 2009 13:04:12 -0800")
+end
+for n = 1, 3 do
+	header(conns[n], "Subject", "Signing test")
+end
+
+-- send EOH and body
+for n = 1, 3 do
+	if mt.eoh(conns[n]) ~= nil then
+		error("mt.eoh() failed")
+	end
+	if mt.getreply(conns[n]) ~= SMFIR_CONTINUE then
+		error("mt.eoh() unexpected reply")
+	end
+
+	if mt.bodystring(conns[n], "This is a test!\r\n") ~= nil then
+		error("mt.bodystring() failed")
+	end
+	if mt.getreply(conns[n]) ~= SMFIR_CONTINUE then
+		error("mt.bodystring() unexpected reply")
+	end
+end
+
+-- end of message, last connection first; let the filter react
+for n = 3, 1, -1 do
+	if mt.eom(conns[n]) ~= nil then
+		error("mt.eom() failed")
+	end
+	if mt.getreply(conns[n]) ~= SMFIR_ACCEPT then
+		error("mt.eom() unexpected reply")
+	end
+
+	-- verify that a signature got added
+	if not mt.eom_check(conns[n], MT_HDRINSERT, "DKIM-Signature") and
+	   not mt.eom_check(conns[n], MT_HDRADD, "DKIM-Signature") then
+		error("no signature added")
+	end
+
+	-- confirm properties
+	sig = mt.getheader(conns[n], "DKIM-Signature", 0)
+	if string.find(sig, "c=simple/simple", 1, true) == nil then
+		error("signature has wrong c= value")
+	end
+	if string.find(sig, "d=example.com", 1, true) == nil then
+		error("signature has wrong d= value")
+	end
+	if string.find(sig, "s=test", 1, true) == nil then
+		error("signature has wrong s= value")
+	end
+	if string.find(sig, "bh=3VWGQGY+cSNYd1MGM+X6hRXU0stl8JCaQtl4mbX/j2I=", 1, true) == nil then
+		error("signature has wrong bh= value")
+	end
+	if string.find(sig, "h=From:Date:Subject", 1, true) == nil then
+		error("signature has wrong h= value")
+	end
+end
+
+for n = 1, 3 do
+	mt.disconnect(conns[n])
+end
@@ -1589,6 +1589,211 @@ dkimf_socket_cleanup(char *sockspec)
 	return EADDRINUSE;
 }
 
+/*
+**  DKIMF_SOCKET_LOCAL -- find the path of a UNIX socket
+**
+**  Parameters:
+**  	sockspec -- socket specification
+**
+**  Return value:
+**  	Pointer to the path within "sockspec" if it names a UNIX socket,
+**  	or NULL if it names some other kind.
+*/
+
+char *
+dkimf_socket_local(char *sockspec)
+{
+	char *colon;
+
+	assert(sockspec != NULL);
+
+	colon = strchr(sockspec, ':');
+	if (colon == NULL)
+		return sockspec;
+
+	if (strncasecmp(sockspec, "local:", 6) != 0 &&
+	    strncasecmp(sockspec, "unix:", 5) != 0)
+		return NULL;
+
+	return colon + 1;
+}
+
+/*
+**  DKIMF_SOCKET_LISTEN -- open a listening socket
+**
+**  Parameters:
+**  	sockspec -- socket specification
+**  	backlog -- listen() backlog
+**  	loopback -- if TRUE, "inet" and "inet6" sockets with no host listen
+**  	            on the loopback address rather than all addresses
+**  	reuseport -- if TRUE, let other processes bind "inet" and "inet6"
+**  	             sockets to the same address (SO_REUSEPORT)
+**  	path -- path of a UNIX socket (returned; empty for others)
+**  	pathlen -- bytes available at "path"
+**  	err -- error buffer
+**  	errlen -- bytes available at "err"
+**
+**  Return value:
+**  	A listening socket, or -1 on error (with "err" updated).
+**
+**  Notes:
+**  	"sockspec" uses the same syntax as libmilter: "inet:port[@host]",
+**  	"inet6:port[@host]", or "local:path" ("unix:path" or just "path").
+**  	The host can be a name or an address, optionally in brackets.
+**  	A stale UNIX socket is removed first.
+*/
+
+int
+dkimf_socket_listen(char *sockspec, int backlog, _Bool loopback,
+                    _Bool reuseport, char *path, size_t pathlen,
+                    char *err, size_t errlen)
+{
+	int fd;
+	int on = 1;
+	int status;
+	int family = AF_UNSPEC;
+	char *colon;
+
+	assert(sockspec != NULL);
+	assert(path != NULL);
+	assert(err != NULL);
+
+	path[0] = '\0';
+
+	colon = strchr(sockspec, ':');
+
+	if (colon != NULL && strncasecmp(sockspec, "inet:", 5) == 0)
+		family = AF_INET;
+	else if (colon != NULL && strncasecmp(sockspec, "inet6:", 6) == 0)
+		family = AF_INET6;
+
+	if (family != AF_UNSPEC)
+	{
+		char *at;
+		char *host = NULL;
+		struct addrinfo hints;
+		struct addrinfo *ai;
+		char port[BUFRSZ + 1];
+
+		strlcpy(port, colon + 1, sizeof port);
+		at = strchr(port, '@');
+		if (at != NULL)
+		{
+			*at = '\0';
+			host = at + 1;
+
+			if (*host == '[')
+			{
+				host++;
+				host[strcspn(host, "]")] = '\0';
+			}
+		}
+		else if (loopback)
+		{
+			host = (family == AF_INET ? "127.0.0.1" : "::1");
+		}
+
+		memset(&hints, '\0', sizeof hints);
+		hints.ai_family = family;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE;
+
+		status = getaddrinfo(host, port, &hints, &ai);
+		if (status != 0)
+		{
+			snprintf(err, errlen, "%s: %s", sockspec,
+			         gai_strerror(status));
+			return -1;
+		}
+
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd == -1)
+		{
+			snprintf(err, errlen, "socket(): %s", strerror(errno));
+			freeaddrinfo(ai);
+			return -1;
+		}
+
+		(void) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on,
+		                  sizeof on);
+
+		if (reuseport)
+		{
+#ifdef SO_REUSEPORT
+			status = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on,
+			                    sizeof on);
+#else /* SO_REUSEPORT */
+			errno = ENOPROTOOPT;
+			status = -1;
+#endif /* SO_REUSEPORT */
+
+			if (status != 0)
+			{
+				snprintf(err, errlen, "SO_REUSEPORT: %s",
+				         strerror(errno));
+				(void) close(fd);
+				freeaddrinfo(ai);
+				return -1;
+			}
+		}
+
+		status = bind(fd, ai->ai_addr, ai->ai_addrlen);
+		freeaddrinfo(ai);
+	}
+	else
+	{
+		struct sockaddr_un sun;
+		char local[MAXPATHLEN + 7];
+
+		if (colon != NULL &&
+		    strncasecmp(sockspec, "local:", 6) != 0 &&
+		    strncasecmp(sockspec, "unix:", 5) != 0)
+		{
+			snprintf(err, errlen, "%s: unknown socket type",
+			         sockspec);
+			return -1;
+		}
+
+		memset(&sun, '\0', sizeof sun);
+#ifdef BSD
+		sun.sun_len = sizeof sun;
+#endif /* BSD */
+		sun.sun_family = AF_UNIX;
+		if (strlcpy(sun.sun_path, colon == NULL ? sockspec : colon + 1,
+		            sizeof sun.sun_path) >= sizeof sun.sun_path)
+		{
+			snprintf(err, errlen, "%s: path too long", sockspec);
+			return -1;
+		}
+
+		snprintf(local, sizeof local, "local:%s", sun.sun_path);
+		(void) dkimf_socket_cleanup(local);
+
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd == -1)
+		{
+			snprintf(err, errlen, "socket(): %s", strerror(errno));
+			return -1;
+		}
+
+		status = bind(fd, (struct sockaddr *) &sun, sizeof sun);
+		if (status == 0)
+			strlcpy(path, sun.sun_path, pathlen);
+	}
+
+	if (status != 0 || listen(fd, backlog) != 0)
+	{
+		snprintf(err, errlen, "%s: %s", sockspec, strerror(errno));
+		(void) close(fd);
+		if (path[0] != '\0')
+			(void) unlink(path);
+		path[0] = '\0';
+		return -1;
+	}
+
+	return fd;
+}
+
 /*
 **  DKIMF_MKREGEXP -- make a regexp string from a glob string
 **
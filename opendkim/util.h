@@ -61,6 +61,9 @@ extern _Bool dkimf_mkregexp(char *, char *, size_t);
 extern void dkimf_optlist(FILE *);
 extern void dkimf_setmaxfd(void);
 extern int dkimf_socket_cleanup(char *);
+extern int dkimf_socket_listen(char *, int, _Bool, _Bool, char *, size_t,
+                               char *, size_t);
+extern char *dkimf_socket_local(char *);
 extern void dkimf_stripbrackets(char *);
 extern void dkimf_stripcr(char *);
 extern _Bool dkimf_subdomain(char *d1, char *d2);
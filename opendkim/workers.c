@@ -0,0 +1,168 @@
+/*
+**  Copyright 2025 OpenDKIM contributors.
+*/
+
+/* sched_setaffinity() and the CPU_* macros are GNU extensions */
+#ifdef __linux__
+# define _GNU_SOURCE
+#endif /* __linux__ */
+
+#include "build-config.h"
+
+#ifdef _FFR_WORKERS
+
+/* system includes */
+#include <sys/types.h>
+#include <errno.h>
+#include <assert.h>
+#include <ctype.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#ifdef HAVE_SCHED_SETAFFINITY
+# include <sched.h>
+#endif /* HAVE_SCHED_SETAFFINITY */
+
+/* opendkim includes */
+#include "workers.h"
+#include "opendkim.h"
+
+/* macros */
+#define	DKIMF_WORKERS_MAXCPU	4096		/* highest CPU number + 1 */
+
+/*
+**  DKIMF_WORKERS_CPUS -- parse a list of CPUs
+**
+**  Parameters:
+**  	spec -- comma-separated CPU numbers and ranges, e.g. "0,2,4-7"
+**  	cpus -- array of CPU numbers (returned; release with free())
+**  	ncpus -- entries at "cpus" (returned)
+**  	err -- error buffer
+**  	errlen -- bytes available at "err"
+**
+**  Return value:
+**  	0 on success, -1 on failure (with "err" updated).
+*/
+
+int
+dkimf_workers_cpus(char *spec, int **cpus, int *ncpus, char *err,
+                   size_t errlen)
+{
+	int n = 0;
+	int *list;
+	long lo;
+	long hi;
+	char *p;
+	char *q;
+
+	assert(spec != NULL);
+	assert(cpus != NULL);
+	assert(ncpus != NULL);
+	assert(err != NULL);
+
+	list = (int *) malloc(DKIMF_WORKERS_MAXCPU * sizeof(int));
+	if (list == NULL)
+	{
+		snprintf(err, errlen, "malloc(): %s", strerror(errno));
+		return -1;
+	}
+
+	p = spec;
+	for (;;)
+	{
+		while (isascii(*p) && isspace(*p))
+			p++;
+
+		if (!isascii(*p) || !isdigit(*p))
+			break;
+
+		lo = strtol(p, &q, 10);
+		hi = lo;
+		if (*q == '-')
+		{
+			p = q + 1;
+			if (!isascii(*p) || !isdigit(*p))
+				break;
+			hi = strtol(p, &q, 10);
+		}
+
+		if (lo > hi || hi >= DKIMF_WORKERS_MAXCPU ||
+		    n + (hi - lo) >= DKIMF_WORKERS_MAXCPU)
+			break;
+
+		for (; lo <= hi; lo++)
+			list[n++] = (int) lo;
+
+		p = q;
+		while (isascii(*p) && isspace(*p))
+			p++;
+
+		if (*p == '\0')
+		{
+			*cpus = list;
+			*ncpus = n;
+			return 0;
+		}
+		else if (*p != ',')
+		{
+			break;
+		}
+
+		p++;
+	}
+
+	snprintf(err, errlen, "%s: invalid CPU list", spec);
+	free(list);
+	return -1;
+}
+
+/*
+**  DKIMF_WORKERS_PIN -- restrict the calling process to one CPU
+**
+**  Parameters:
+**  	cpu -- CPU number
+**  	err -- error buffer
+**  	errlen -- bytes available at "err"
+**
+**  Return value:
+**  	0 on success, -1 on failure (with "err" updated).
+**
+**  Notes:
+**  	Threads started afterward inherit the restriction, so this is
+**  	called in a new worker before it starts any.
+*/
+
+int
+dkimf_workers_pin(int cpu, char *err, size_t errlen)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+	cpu_set_t set;
+
+	assert(err != NULL);
+
+	if (cpu < 0 || cpu >= CPU_SETSIZE)
+	{
+		snprintf(err, errlen, "CPU %d out of range", cpu);
+		return -1;
+	}
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	if (sched_setaffinity(0, sizeof set, &set) != 0)
+	{
+		snprintf(err, errlen, "sched_setaffinity(%d): %s", cpu,
+		         strerror(errno));
+		return -1;
+	}
+
+	return 0;
+#else /* HAVE_SCHED_SETAFFINITY */
+	assert(err != NULL);
+
+	snprintf(err, errlen, "CPU pinning not supported on this system");
+	return -1;
+#endif /* HAVE_SCHED_SETAFFINITY */
+}
+
+#endif /* _FFR_WORKERS */
@@ -0,0 +1,20 @@
+/*
+**  Copyright 2025 OpenDKIM contributors.
+*/
+
+#ifndef _WORKERS_H_
+#define _WORKERS_H_
+
+#include "build-config.h"
+
+/* system includes */
+#include <sys/types.h>
+
+/* macros */
+#define	DKIMF_WORKERS_MAX	256		/* most worker processes */
+
+/* prototypes */
+extern int dkimf_workers_cpus(char *, int **, int *, char *, size_t);
+extern int dkimf_workers_pin(int, char *, size_t);
+
+#endif /* _WORKERS_H_ */
@@ -14,6 +14,7 @@
 #include <limits.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <math.h>
 
 /* librrd includes */
@@ -32,11 +33,38 @@
 # include <bsd/string.h>
 #endif /* USE_BSD_H */
 
+/* macros */
+#define	REPRRD_BUCKETS		1024
+#define	REPRRD_NTYPES		3
+#define	REPRRD_REFRESH		300
+
 /* data types */
+
+/*
+**  REPRRD_PRED -- cached predictions for one domain
+*/
+
+struct reprrd_pred
+{
+	unsigned int		rp_hash;
+	int			rp_status[REPRRD_NTYPES];
+	int			rp_value[REPRRD_NTYPES];
+	time_t			rp_when[REPRRD_NTYPES];
+	time_t			rp_used;
+	struct reprrd_pred *	rp_next;
+	char *			rp_domain;
+};
+
 struct reprrd_handle
 {
+	_Bool			rep_die;
+	_Bool			rep_running;
 	int			rep_hashdepth;
 	const char *		rep_root;
+	pthread_t		rep_refresher;
+	pthread_mutex_t		rep_lock;
+	pthread_cond_t		rep_cond;
+	struct reprrd_pred *	rep_cache[REPRRD_BUCKETS];
 };
 
 /*
@@ -86,13 +114,30 @@ reprrd_init(const char *root, int hashdepth)
 	new = (REPRRD) malloc(sizeof(struct reprrd_handle));
 	if (new != NULL)
 	{
+		memset(new, '\0', sizeof(struct reprrd_handle));
+
 		new->rep_hashdepth = hashdepth;
 
 		new->rep_root = strdup(root);
 		if (new->rep_root == NULL)
 		{
 			free(new);
-			new = NULL;
+			return NULL;
+		}
+
+		if (pthread_mutex_init(&new->rep_lock, NULL) != 0)
+		{
+			free((void *) new->rep_root);
+			free(new);
+			return NULL;
+		}
+
+		if (pthread_cond_init(&new->rep_cond, NULL) != 0)
+		{
+			(void) pthread_mutex_destroy(&new->rep_lock);
+			free((void *) new->rep_root);
+			free(new);
+			return NULL;
 		}
 	}
 
@@ -112,8 +157,33 @@ reprrd_init(const char *root, int hashdepth)
 void
 reprrd_close(REPRRD r)
 {
+	int c;
+	struct reprrd_pred *rp;
+	struct reprrd_pred *next;
+
 	assert(r != NULL);
 
+	pthread_mutex_lock(&r->rep_lock);
+	r->rep_die = TRUE;
+	pthread_cond_signal(&r->rep_cond);
+	pthread_mutex_unlock(&r->rep_lock);
+
+	if (r->rep_running)
+		(void) pthread_join(r->rep_refresher, NULL);
+
+	for (c = 0; c < REPRRD_BUCKETS; c++)
+	{
+		for (rp = r->rep_cache[c]; rp != NULL; rp = next)
+		{
+			next = rp->rp_next;
+			free(rp->rp_domain);
+			free(rp);
+		}
+	}
+
+	(void) pthread_cond_destroy(&r->rep_cond);
+	(void) pthread_mutex_destroy(&r->rep_lock);
+
 	free((void *) r->rep_root);
 	free(r);
 }
@@ -164,23 +234,22 @@ reprrd_mkpath(char *path, size_t pathlen, REPRRD r, const char *domain,
 }
 
 /*
-**  REPRRD_QUERY -- query a reputaton parameter for a domain
+**  REPRRD_COMPUTE -- compute a reputation parameter from a domain's RRDs
 **
 **  Parameters:
 **  	r -- REPRRD handle (query context)
 **  	domain -- domain of interest
 **  	type -- type of query (a REPRRD_TYPE_* constant)
 ** 	value -- current value (returned)
-**  	err -- error buffer
-**  	errlen -- bytes available at "err"
+**  	now -- reference time
 **
 **  Return value:
 **  	A REPRRD_STAT_* constant.
 */
 
-REPRRD_STAT
-reprrd_query(REPRRD r, const char *domain, int type, int *value,
-             char *err, size_t errlen)
+static REPRRD_STAT
+reprrd_compute(REPRRD r, const char *domain, int type, int *value,
+               time_t now)
 {
 	int c;
 	int di;
@@ -189,7 +258,6 @@ reprrd_query(REPRRD r, const char *domain, int type, int *value,
 	time_t end;
 	unsigned long step;
 	time_t ti;
-	time_t now;
 	u_long ds_cnt;
 	char **ds_names;
 	char **cdata;
@@ -210,8 +278,6 @@ reprrd_query(REPRRD r, const char *domain, int type, int *value,
 	assert(type == REPRRD_TYPE_MESSAGES || type == REPRRD_TYPE_SPAM ||
 	       type == REPRRD_TYPE_LIMIT);
 
-	(void) time(&now);
-
 	if (type == REPRRD_TYPE_LIMIT)
 	{
 		time_t last_update;
@@ -441,3 +507,317 @@ reprrd_query(REPRRD r, const char *domain, int type, int *value,
 
 	return REPRRD_STAT_OK;
 }
+
+/*
+**  REPRRD_HASH -- hash a domain name
+**
+**  Parameters:
+**  	domain -- domain to hash
+**
+**  Return value:
+**  	Hash value.
+*/
+
+static unsigned int
+reprrd_hash(const char *domain)
+{
+	unsigned int h = 2166136261U;
+	const unsigned char *p;
+
+	for (p = (const unsigned char *) domain; *p != '\0'; p++)
+	{
+		h ^= *p;
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+/*
+**  REPRRD_FIND -- find a domain's cached predictions
+**
+**  Parameters:
+**  	r -- REPRRD handle (locked)
+**  	domain -- domain of interest
+**  	hash -- hash of "domain"
+**
+**  Return value:
+**  	Pointer to the cache entry, or NULL if not cached.
+*/
+
+static struct reprrd_pred *
+reprrd_find(REPRRD r, const char *domain, unsigned int hash)
+{
+	struct reprrd_pred *rp;
+
+	for (rp = r->rep_cache[hash % REPRRD_BUCKETS];
+	     rp != NULL;
+	     rp = rp->rp_next)
+	{
+		if (rp->rp_hash == hash && strcmp(rp->rp_domain, domain) == 0)
+			return rp;
+	}
+
+	return NULL;
+}
+
+/*
+**  REPRRD_STORE -- record a computed prediction
+**
+**  Parameters:
+**  	r -- REPRRD handle (locked)
+**  	domain -- domain of interest
+**  	hash -- hash of "domain"
+**  	type -- type of query (a REPRRD_TYPE_* constant)
+**  	status -- result of the computation
+**  	value -- computed value
+**  	now -- time of computation
+**
+**  Return value:
+**  	None.  An allocation failure just means the result isn't cached.
+*/
+
+static void
+reprrd_store(REPRRD r, const char *domain, unsigned int hash, int type,
+             REPRRD_STAT status, int value, time_t now)
+{
+	struct reprrd_pred *rp;
+
+	rp = reprrd_find(r, domain, hash);
+	if (rp == NULL)
+	{
+		rp = (struct reprrd_pred *) malloc(sizeof *rp);
+		if (rp == NULL)
+			return;
+
+		memset(rp, '\0', sizeof *rp);
+		rp->rp_domain = strdup(domain);
+		if (rp->rp_domain == NULL)
+		{
+			free(rp);
+			return;
+		}
+
+		rp->rp_hash = hash;
+		rp->rp_used = now;
+		rp->rp_next = r->rep_cache[hash % REPRRD_BUCKETS];
+		r->rep_cache[hash % REPRRD_BUCKETS] = rp;
+	}
+
+	rp->rp_status[type] = status;
+	rp->rp_value[type] = value;
+	rp->rp_when[type] = now;
+}
+
+/*
+**  REPRRD_REFRESH -- recompute all cached predictions
+**
+**  Parameters:
+**  	r -- REPRRD handle (locked on entry and return)
+**  	now -- reference time
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Domains not queried during the last step are dropped.  The RRD
+**  	reads are done with the handle unlocked, one domain at a time.
+*/
+
+static void
+reprrd_refresh(REPRRD r, time_t now)
+{
+	int b;
+	int type;
+	int value;
+	unsigned int hash;
+	REPRRD_STAT status;
+	struct reprrd_pred *rp;
+	struct reprrd_pred **prev;
+	char *domain;
+	time_t when[REPRRD_NTYPES];
+
+	for (b = 0; b < REPRRD_BUCKETS; b++)
+	{
+		prev = &r->rep_cache[b];
+
+		while ((rp = *prev) != NULL)
+		{
+			if (rp->rp_used + REPRRD_STEP < now)
+			{
+				*prev = rp->rp_next;
+				free(rp->rp_domain);
+				free(rp);
+				continue;
+			}
+
+			domain = strdup(rp->rp_domain);
+			if (domain == NULL)
+			{
+				prev = &rp->rp_next;
+				continue;
+			}
+
+			hash = rp->rp_hash;
+			memcpy(when, rp->rp_when, sizeof when);
+
+			pthread_mutex_unlock(&r->rep_lock);
+
+			for (type = 0; type < REPRRD_NTYPES && !r->rep_die; type++)
+			{
+				if (when[type] == 0)
+					continue;
+
+				value = 0;
+				status = reprrd_compute(r, domain, type,
+				                        &value, now);
+
+				pthread_mutex_lock(&r->rep_lock);
+				reprrd_store(r, domain, hash, type, status,
+				             value, now);
+				pthread_mutex_unlock(&r->rep_lock);
+			}
+
+			pthread_mutex_lock(&r->rep_lock);
+
+			/* the chain may have changed while unlocked */
+			rp = reprrd_find(r, domain, hash);
+			free(domain);
+			if (rp == NULL || r->rep_die)
+				break;
+			prev = &rp->rp_next;
+		}
+
+		if (r->rep_die)
+			break;
+	}
+}
+
+/*
+**  REPRRD_REFRESHER -- prediction refresh thread
+**
+**  Parameters:
+**  	vp -- REPRRD handle
+**
+**  Return value:
+**  	NULL.
+**
+**  Notes:
+**  	Wakes at every RRD step boundary, and every REPRRD_REFRESH
+**  	seconds in between to pick up late imports.
+*/
+
+static void *
+reprrd_refresher(void *vp)
+{
+	time_t now;
+	time_t next;
+	struct timespec until;
+	REPRRD r;
+
+	r = (REPRRD) vp;
+
+	pthread_mutex_lock(&r->rep_lock);
+
+	while (!r->rep_die)
+	{
+		(void) time(&now);
+
+		next = now + REPRRD_REFRESH;
+		if ((now / REPRRD_STEP) != (next / REPRRD_STEP))
+			next = (next / REPRRD_STEP) * REPRRD_STEP;
+
+		until.tv_sec = next;
+		until.tv_nsec = 0;
+
+		while (!r->rep_die &&
+		       pthread_cond_timedwait(&r->rep_cond, &r->rep_lock,
+		                              &until) != ETIMEDOUT)
+			continue;
+
+		if (r->rep_die)
+			break;
+
+		reprrd_refresh(r, time(NULL));
+	}
+
+	pthread_mutex_unlock(&r->rep_lock);
+
+	return NULL;
+}
+
+/*
+**  REPRRD_QUERY -- query a reputaton parameter for a domain
+**
+**  Parameters:
+**  	r -- REPRRD handle (query context)
+**  	domain -- domain of interest
+**  	type -- type of query (a REPRRD_TYPE_* constant)
+** 	value -- current value (returned)
+**  	err -- error buffer
+**  	errlen -- bytes available at "err"
+**
+**  Return value:
+**  	A REPRRD_STAT_* constant.
+**
+**  Notes:
+**  	Results are cached per domain and kept current by a refresh
+**  	thread, so only the first query for a domain (or one whose
+**  	cached result has gone stale) reads the RRD files.
+*/
+
+REPRRD_STAT
+reprrd_query(REPRRD r, const char *domain, int type, int *value,
+             char *err, size_t errlen)
+{
+	int v = 0;
+	unsigned int hash;
+	time_t now;
+	REPRRD_STAT status;
+	struct reprrd_pred *rp;
+
+	assert(r != NULL);
+	assert(domain != NULL);
+	assert(value != NULL);
+	assert(type == REPRRD_TYPE_MESSAGES || type == REPRRD_TYPE_SPAM ||
+	       type == REPRRD_TYPE_LIMIT);
+
+	(void) time(&now);
+
+	hash = reprrd_hash(domain);
+
+	pthread_mutex_lock(&r->rep_lock);
+
+	/* start the refresher; deferred in case the caller forks */
+	if (!r->rep_running && !r->rep_die &&
+	    pthread_create(&r->rep_refresher, NULL, reprrd_refresher,
+	                   r) == 0)
+		r->rep_running = TRUE;
+
+	rp = reprrd_find(r, domain, hash);
+	if (rp != NULL && rp->rp_when[type] != 0 &&
+	    rp->rp_when[type] + 2 * REPRRD_REFRESH > now &&
+	    rp->rp_when[type] / REPRRD_STEP == now / REPRRD_STEP)
+	{
+		rp->rp_used = now;
+		status = rp->rp_status[type];
+		v = rp->rp_value[type];
+
+		pthread_mutex_unlock(&r->rep_lock);
+	}
+	else
+	{
+		pthread_mutex_unlock(&r->rep_lock);
+
+		status = reprrd_compute(r, domain, type, &v, now);
+
+		pthread_mutex_lock(&r->rep_lock);
+		reprrd_store(r, domain, hash, type, status, v, now);
+		pthread_mutex_unlock(&r->rep_lock);
+	}
+
+	if (status == REPRRD_STAT_OK && (type == REPRRD_TYPE_LIMIT || v != 0))
+		*value = v;
+
+	return status;
+}
@@ -14,6 +14,9 @@
 #include <limits.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/select.h>
 
 #ifdef USE_JANSSON
 /* libjansson includes */
@@ -33,8 +36,30 @@
 #define	REPUTE_BUFBASE	1024
 #define	REPUTE_URL	1024
 #define	REPUTE_TIMEOUT	10
+#define	REPUTE_BUCKETS	1024
+#define	REPUTE_POLL	1000
+
+/* reply cache entry states */
+#define	REPUTE_ENTRY_PENDING	0
+#define	REPUTE_ENTRY_DONE	1
 
 /* data types */
+struct repute_entry
+{
+	int			re_state;
+	unsigned int		re_hash;
+	unsigned int		re_waiters;
+	REPUTE_STAT		re_status;
+	float			re_rep;
+	float			re_conf;
+	unsigned long		re_samples;
+	unsigned long		re_limit;
+	time_t			re_when;
+	time_t			re_expire;
+	struct repute_entry *	re_next;
+	char *			re_domain;
+};
+
 struct repute_io
 {
 	CURLcode		repute_errcode;
@@ -42,15 +67,27 @@ struct repute_io
 	size_t			repute_alloc;
 	size_t			repute_offset;
 	char *			repute_buf;
+	struct repute_entry *	repute_entry;
 	struct repute_io *	repute_next;
 	CURL *			repute_curl;
 };
 
+struct repute_multi
+{
+	CURLM *			rm_multi;
+	struct repute_multi *	rm_next;
+};
+
 struct repute_handle
 {
 	unsigned int		rep_reporter;
+	unsigned int		rep_cachettl;
+	unsigned int		rep_negttl;
 	pthread_mutex_t		rep_lock;
+	pthread_cond_t		rep_cond;
 	struct repute_io *	rep_ios;
+	struct repute_multi *	rep_multis;
+	struct repute_entry *	rep_cache[REPUTE_BUCKETS];
 	const char *		rep_server;
 	const char *		rep_useragent;
 	const char *		rep_curlversion;
@@ -288,6 +325,7 @@ repute_get_io(REPUTE rep)
 			rio->repute_alloc = 0;
 			rio->repute_offset = 0;
 			rio->repute_buf = NULL;
+			rio->repute_entry = NULL;
 			rio->repute_next = NULL;
 
 			rio->repute_curl = curl_easy_init();
@@ -325,6 +363,13 @@ repute_get_io(REPUTE rep)
 				(void) curl_easy_setopt(rio->repute_curl,
 				                        CURLOPT_TIMEOUT,
 				                        timeout);
+
+#if LIBCURL_VERSION_NUM >= 0x071900
+				longtmp = 1;
+				(void) curl_easy_setopt(rio->repute_curl,
+				                        CURLOPT_TCP_KEEPALIVE,
+				                        longtmp);
+#endif /* LIBCURL_VERSION_NUM >= 0x071900 */
 			}
 		}
 	}
@@ -359,57 +404,6 @@ repute_put_io(REPUTE rep, struct repute_io *rio)
 	pthread_mutex_unlock(&rep->rep_lock);
 }
 
-/*
-**  REPUTE_DOQUERY -- execute a query
-**
-**  Parameters:
-**
-**  Return value:
-**  	A REPUTE_STAT_* constant.
-*/
-
-static REPUTE_STAT
-repute_doquery(struct repute_io *rio, const char *url)
-{
-	CURLcode cstatus;
-	long rcode;
-
-	assert(rio != NULL);
-	assert(url != NULL);
-
-	cstatus = curl_easy_setopt(rio->repute_curl, CURLOPT_WRITEDATA, rio);
-	if (cstatus != CURLE_OK)
-	{
-		rio->repute_errcode = cstatus;
-		return REPUTE_STAT_INTERNAL;
-	}
-
-	cstatus = curl_easy_setopt(rio->repute_curl, CURLOPT_URL, url);
-	if (cstatus != CURLE_OK)
-	{
-		rio->repute_errcode = cstatus;
-		return REPUTE_STAT_INTERNAL;
-	}
-
-	rio->repute_errcode = 0;
-	rio->repute_rcode = 0;
-	memset(rio->repute_buf, '\0', rio->repute_alloc);
-
-	cstatus = curl_easy_perform(rio->repute_curl);
-	if (cstatus != CURLE_OK)
-	{
-		rio->repute_errcode = cstatus;
-		return REPUTE_STAT_QUERY;
-	}
-
-	cstatus = curl_easy_getinfo(rio->repute_curl, CURLINFO_RESPONSE_CODE,
-	                            &rcode);
-	if (rcode != 200)
-		return REPUTE_STAT_QUERY;
-
-	return REPUTE_STAT_OK;
-}
-
 /*
 **  REPUTE_GET_ERROR -- retrieve an error string
 **
@@ -553,6 +547,527 @@ repute_get_template(REPUTE rep)
 	return REPUTE_STAT_OK;
 }
 
+/*
+**  REPUTE_GET_MULTI -- get or create a transfer engine
+**
+**  Parameters:
+**  	rep -- REPUTE handle
+**
+**  Return value:
+**  	A multi handle, or NULL on failure.
+**
+**  Notes:
+**  	Multi handles are recycled so that the connections in their
+**  	caches stay open between queries.
+*/
+
+static struct repute_multi *
+repute_get_multi(REPUTE rep)
+{
+	struct repute_multi *rm = NULL;
+
+	assert(rep != NULL);
+
+	pthread_mutex_lock(&rep->rep_lock);
+
+	if (rep->rep_multis != NULL)
+	{
+		rm = rep->rep_multis;
+		rep->rep_multis = rm->rm_next;
+	}
+
+	pthread_mutex_unlock(&rep->rep_lock);
+
+	if (rm == NULL)
+	{
+		rm = malloc(sizeof *rm);
+		if (rm == NULL)
+			return NULL;
+
+		rm->rm_next = NULL;
+		rm->rm_multi = curl_multi_init();
+		if (rm->rm_multi == NULL)
+		{
+			free(rm);
+			return NULL;
+		}
+	}
+
+	return rm;
+}
+
+/*
+**  REPUTE_PUT_MULTI -- recycle a transfer engine
+**
+**  Parameters:
+**  	rep -- REPUTE handle
+**  	rm -- multi handle to be recycled
+**
+**  Return value:
+**  	None.
+*/
+
+static void
+repute_put_multi(REPUTE rep, struct repute_multi *rm)
+{
+	assert(rep != NULL);
+	assert(rm != NULL);
+
+	pthread_mutex_lock(&rep->rep_lock);
+
+	rm->rm_next = rep->rep_multis;
+	rep->rep_multis = rm;
+
+	pthread_mutex_unlock(&rep->rep_lock);
+}
+
+/*
+**  REPUTE_HASH -- hash a domain name
+**
+**  Parameters:
+**  	domain -- domain to hash
+**
+**  Return value:
+**  	Hash value.
+*/
+
+static unsigned int
+repute_hash(const char *domain)
+{
+	unsigned int h = 2166136261U;
+	const unsigned char *p;
+
+	for (p = (const unsigned char *) domain; *p != '\0'; p++)
+	{
+		h ^= *p;
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+/*
+**  REPUTE_RESERVE -- find or claim a reply cache entry
+**
+**  Parameters:
+**  	rep -- REPUTE handle (locked)
+**  	domain -- domain of interest
+**  	now -- current time
+**  	mine -- set to TRUE if the caller must fetch this entry
+**
+**  Return value:
+**  	The cache entry for "domain", or NULL on allocation failure.
+**
+**  Notes:
+**  	An entry that is pending or still fresh is shared; one that is
+**  	missing or expired is (re)claimed for the caller, who must
+**  	complete it with repute_run().  Expired entries nobody is
+**  	waiting on are pruned from the chain along the way.
+*/
+
+static struct repute_entry *
+repute_reserve(REPUTE rep, const char *domain, time_t now, _Bool *mine)
+{
+	unsigned int hash;
+	struct repute_entry *re;
+	struct repute_entry **prev;
+
+	hash = repute_hash(domain);
+
+	prev = &rep->rep_cache[hash % REPUTE_BUCKETS];
+	while ((re = *prev) != NULL)
+	{
+		if (re->re_hash == hash && strcmp(re->re_domain, domain) == 0)
+			break;
+
+		if (re->re_state == REPUTE_ENTRY_DONE &&
+		    re->re_expire <= now && re->re_waiters == 0)
+		{
+			*prev = re->re_next;
+			free(re->re_domain);
+			free(re);
+			continue;
+		}
+
+		prev = &re->re_next;
+	}
+
+	if (re != NULL)
+	{
+		if (re->re_state == REPUTE_ENTRY_PENDING || re->re_expire > now)
+		{
+			*mine = FALSE;
+		}
+		else
+		{
+			re->re_state = REPUTE_ENTRY_PENDING;
+			*mine = TRUE;
+		}
+
+		return re;
+	}
+
+	re = malloc(sizeof *re);
+	if (re == NULL)
+		return NULL;
+
+	memset(re, '\0', sizeof *re);
+
+	re->re_domain = strdup(domain);
+	if (re->re_domain == NULL)
+	{
+		free(re);
+		return NULL;
+	}
+
+	re->re_hash = hash;
+	re->re_state = REPUTE_ENTRY_PENDING;
+	re->re_next = rep->rep_cache[hash % REPUTE_BUCKETS];
+	rep->rep_cache[hash % REPUTE_BUCKETS] = re;
+
+	*mine = TRUE;
+
+	return re;
+}
+
+/*
+**  REPUTE_GENURL -- generate the query URL for a domain
+**
+**  Parameters:
+**  	rep -- REPUTE handle
+**  	domain -- domain of interest
+**  	buf -- output buffer
+**  	buflen -- bytes available at "buf"
+**
+**  Return value:
+**  	A REPUTE_STAT_* constant.
+*/
+
+static REPUTE_STAT
+repute_genurl(REPUTE rep, const char *domain, char *buf, size_t buflen)
+{
+	URITEMP ut;
+
+	ut = ut_init();
+	if (ut == NULL)
+		return REPUTE_STAT_INTERNAL;
+
+	if (rep->rep_reporter != 0)
+	{
+		snprintf(buf, buflen, "%u", rep->rep_reporter);
+		if (ut_keyvalue(ut, UT_KEYTYPE_STRING,
+		                "reporter", buf) != 0)
+		{
+			ut_destroy(ut);
+			return REPUTE_STAT_INTERNAL;
+		}
+	}
+
+	if (ut_keyvalue(ut, UT_KEYTYPE_STRING,
+	                "subject", (void *) domain) != 0 ||
+#ifdef USE_JANSSON
+	    ut_keyvalue(ut, UT_KEYTYPE_STRING, "format", "json") != 0 ||
+#endif /* USE_JANSSON */
+	    ut_keyvalue(ut, UT_KEYTYPE_STRING,
+	                "scheme", REPUTE_URI_SCHEME) != 0 ||
+	    ut_keyvalue(ut, UT_KEYTYPE_STRING,
+	                "service", (void *) rep->rep_server) != 0 ||
+	    ut_keyvalue(ut, UT_KEYTYPE_STRING,
+	                "application", REPUTE_URI_APPLICATION) != 0 ||
+	    ut_keyvalue(ut, UT_KEYTYPE_STRING,
+	                "assertion", REPUTE_ASSERT_SPAM) != 0)
+	{
+		ut_destroy(ut);
+		return REPUTE_STAT_INTERNAL;
+	}
+
+	if (ut_generate(ut, rep->rep_uritemp, buf, buflen) <= 0)
+	{
+		ut_destroy(ut);
+		return REPUTE_STAT_INTERNAL;
+	}
+
+	ut_destroy(ut);
+
+	return REPUTE_STAT_OK;
+}
+
+/*
+**  REPUTE_COMPLETE -- record the result of a query and wake waiters
+**
+**  Parameters:
+**  	rep -- REPUTE handle (locked)
+**  	re -- cache entry
+**  	rio -- I/O handle that ran the query, or NULL
+**  	status -- a REPUTE_STAT_* constant
+**  	now -- current time
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Successful replies are cached for the handle's cache TTL, and
+**  	replies that can't be parsed (or have no data) for its shorter
+**  	negative TTL; other failures are handed to current waiters and
+**  	then retried.
+*/
+
+static void
+repute_complete(REPUTE rep, struct repute_entry *re, struct repute_io *rio,
+                REPUTE_STAT status, time_t now)
+{
+	re->re_rep = 0.;
+	re->re_conf = 0.;
+	re->re_samples = 0;
+	re->re_limit = 0;
+	re->re_when = 0;
+
+	if (status == REPUTE_STAT_OK)
+	{
+		status = repute_parse(rio->repute_buf, rio->repute_offset,
+		                      &re->re_rep, &re->re_conf,
+		                      &re->re_samples, &re->re_limit,
+		                      &re->re_when);
+		if (status != REPUTE_STAT_OK)
+		{
+			snprintf(rep->rep_error, sizeof rep->rep_error,
+			         "error parsing reply");
+		}
+	}
+	else if (rio != NULL)
+	{
+		repute_get_error(rio, rep->rep_error, sizeof rep->rep_error);
+	}
+
+	re->re_status = status;
+	re->re_state = REPUTE_ENTRY_DONE;
+
+	if (status == REPUTE_STAT_OK)
+		re->re_expire = now + rep->rep_cachettl;
+	else if (status == REPUTE_STAT_PARSE)
+		re->re_expire = now + rep->rep_negttl;
+	else
+		re->re_expire = now;
+
+	pthread_cond_broadcast(&rep->rep_cond);
+}
+
+/*
+**  REPUTE_RUN -- run a batch of queries concurrently
+**
+**  Parameters:
+**  	rep -- REPUTE handle
+**  	entries -- cache entries claimed by the caller
+**  	nentries -- number of entries at "entries"
+**
+**  Return value:
+**  	None.  Every entry is completed on return.
+*/
+
+static void
+repute_run(REPUTE rep, struct repute_entry **entries, unsigned int nentries)
+{
+	int running;
+	int nmsgs;
+	unsigned int c;
+	unsigned int nios = 0;
+	long rcode;
+	time_t now;
+	REPUTE_STAT status;
+	CURLMsg *msg;
+	struct repute_multi *rm = NULL;
+	struct repute_io *rio;
+	struct repute_io **ios;
+	char url[REPUTE_URL];
+
+	assert(rep != NULL);
+	assert(entries != NULL);
+
+	ios = malloc(sizeof(struct repute_io *) * nentries);
+
+	if (ios != NULL && rep->rep_uritemp[0] == '\0')
+	{
+		if (repute_get_template(rep) != REPUTE_STAT_OK)
+		{
+			free(ios);
+			ios = NULL;
+		}
+	}
+
+	if (ios != NULL)
+		rm = repute_get_multi(rep);
+
+	if (rm == NULL)
+	{
+		now = time(NULL);
+
+		pthread_mutex_lock(&rep->rep_lock);
+		for (c = 0; c < nentries; c++)
+		{
+			repute_complete(rep, entries[c], NULL,
+			                REPUTE_STAT_QUERY, now);
+		}
+		pthread_mutex_unlock(&rep->rep_lock);
+
+		if (ios != NULL)
+			free(ios);
+
+		return;
+	}
+
+	/* set up one transfer per entry */
+	for (c = 0; c < nentries; c++)
+	{
+		rio = NULL;
+
+		if (repute_genurl(rep, entries[c]->re_domain,
+		                  url, sizeof url) == REPUTE_STAT_OK)
+			rio = repute_get_io(rep);
+
+		if (rio != NULL)
+		{
+			rio->repute_entry = entries[c];
+			rio->repute_errcode = 0;
+			rio->repute_rcode = 0;
+			rio->repute_offset = 0;
+			if (rio->repute_buf != NULL)
+				memset(rio->repute_buf, '\0', rio->repute_alloc);
+
+			if (curl_easy_setopt(rio->repute_curl,
+			                     CURLOPT_WRITEDATA,
+			                     rio) != CURLE_OK ||
+			    curl_easy_setopt(rio->repute_curl,
+			                     CURLOPT_PRIVATE,
+			                     rio) != CURLE_OK ||
+			    curl_easy_setopt(rio->repute_curl,
+			                     CURLOPT_URL, url) != CURLE_OK ||
+			    curl_multi_add_handle(rm->rm_multi,
+			                          rio->repute_curl) != CURLM_OK)
+			{
+				repute_put_io(rep, rio);
+				rio = NULL;
+			}
+		}
+
+		if (rio == NULL)
+		{
+			pthread_mutex_lock(&rep->rep_lock);
+			repute_complete(rep, entries[c], NULL,
+			                REPUTE_STAT_INTERNAL, time(NULL));
+			pthread_mutex_unlock(&rep->rep_lock);
+			continue;
+		}
+
+		ios[nios++] = rio;
+	}
+
+	/* drive all of them until done */
+	running = nios;
+	while (running > 0)
+	{
+		if (curl_multi_perform(rm->rm_multi, &running) != CURLM_OK)
+			break;
+
+		if (running == 0)
+			break;
+
+#if LIBCURL_VERSION_NUM >= 0x071c00
+		(void) curl_multi_wait(rm->rm_multi, NULL, 0, REPUTE_POLL,
+		                       NULL);
+#else /* LIBCURL_VERSION_NUM >= 0x071c00 */
+		{
+			int maxfd = -1;
+			fd_set rfds;
+			fd_set wfds;
+			fd_set efds;
+			struct timeval tv;
+
+			FD_ZERO(&rfds);
+			FD_ZERO(&wfds);
+			FD_ZERO(&efds);
+
+			tv.tv_sec = REPUTE_POLL / 1000;
+			tv.tv_usec = (REPUTE_POLL % 1000) * 1000;
+
+			(void) curl_multi_fdset(rm->rm_multi, &rfds, &wfds,
+			                        &efds, &maxfd);
+			(void) select(maxfd + 1, &rfds, &wfds, &efds, &tv);
+		}
+#endif /* LIBCURL_VERSION_NUM >= 0x071c00 */
+	}
+
+	/* collect results */
+	while ((msg = curl_multi_info_read(rm->rm_multi, &nmsgs)) != NULL)
+	{
+		char *priv = NULL;
+
+		if (msg->msg != CURLMSG_DONE)
+			continue;
+
+		(void) curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE,
+		                         &priv);
+		rio = (struct repute_io *) priv;
+		if (rio == NULL || rio->repute_entry == NULL)
+			continue;
+
+		status = REPUTE_STAT_OK;
+		rcode = 0;
+
+		if (msg->data.result != CURLE_OK)
+		{
+			rio->repute_errcode = msg->data.result;
+			status = REPUTE_STAT_QUERY;
+		}
+		else
+		{
+			(void) curl_easy_getinfo(rio->repute_curl,
+			                         CURLINFO_RESPONSE_CODE,
+			                         &rcode);
+			if (rcode != 200)
+			{
+				rio->repute_rcode = (unsigned int) rcode;
+				status = REPUTE_STAT_QUERY;
+			}
+			else if (rio->repute_offset == 0)
+			{
+				status = REPUTE_STAT_PARSE;
+			}
+		}
+
+		pthread_mutex_lock(&rep->rep_lock);
+		repute_complete(rep, rio->repute_entry, rio, status,
+		                time(NULL));
+		pthread_mutex_unlock(&rep->rep_lock);
+
+		rio->repute_entry = NULL;
+	}
+
+	/* anything not reported above failed in the engine itself */
+	now = time(NULL);
+	for (c = 0; c < nios; c++)
+	{
+		rio = ios[c];
+
+		(void) curl_multi_remove_handle(rm->rm_multi, rio->repute_curl);
+
+		if (rio->repute_entry != NULL)
+		{
+			pthread_mutex_lock(&rep->rep_lock);
+			repute_complete(rep, rio->repute_entry, NULL,
+			                REPUTE_STAT_QUERY, now);
+			pthread_mutex_unlock(&rep->rep_lock);
+
+			rio->repute_entry = NULL;
+		}
+
+		repute_put_io(rep, rio);
+	}
+
+	repute_put_multi(rep, rm);
+
+	free(ios);
+}
+
 /*
 **  REPUTE_INIT -- initialize REPUTE subsystem
 **
@@ -595,6 +1110,8 @@ repute_new(const char *server, unsigned int reporter)
 	memset(new, '\0', sizeof *new);
 
 	new->rep_reporter = reporter;
+	new->rep_cachettl = REPUTE_CACHE;
+	new->rep_negttl = REPUTE_NEGCACHE;
 	new->rep_server = strdup(server);
 	if (new->rep_server == NULL)
 	{
@@ -607,6 +1124,7 @@ repute_new(const char *server, unsigned int reporter)
 		new->rep_curlversion = strdup(vinfo->version);
 
 	pthread_mutex_init(&new->rep_lock, NULL);
+	pthread_cond_init(&new->rep_cond, NULL);
 
 	return new;
 }
@@ -624,11 +1142,33 @@ repute_new(const char *server, unsigned int reporter)
 void
 repute_close(REPUTE rep)
 {
+	int c;
 	struct repute_io *rio;
 	struct repute_io *next;
+	struct repute_multi *rm;
+	struct repute_multi *nextrm;
+	struct repute_entry *re;
+	struct repute_entry *nextre;
 
 	assert(rep != NULL);
 
+	for (rm = rep->rep_multis; rm != NULL; rm = nextrm)
+	{
+		nextrm = rm->rm_next;
+		curl_multi_cleanup(rm->rm_multi);
+		free(rm);
+	}
+
+	for (c = 0; c < REPUTE_BUCKETS; c++)
+	{
+		for (re = rep->rep_cache[c]; re != NULL; re = nextre)
+		{
+			nextre = re->re_next;
+			free(re->re_domain);
+			free(re);
+		}
+	}
+
 	rio = rep->rep_ios;
 	while (rio != NULL)
 	{
@@ -643,6 +1183,7 @@ repute_close(REPUTE rep)
 		rio = next;
 	}
 
+	pthread_cond_destroy(&rep->rep_cond);
 	pthread_mutex_destroy(&rep->rep_lock);
 
 	free((void *) rep->rep_server);
@@ -709,100 +1250,120 @@ repute_query(REPUTE rep, const char *domain, float *repout,
              float *confout, unsigned long *sampout, unsigned long *limitout,
              time_t *whenout)
 {
+	_Bool mine;
 	REPUTE_STAT status;
-	float conf;
-	float reputation;
-	unsigned long samples;
-	unsigned long limit;
-	time_t when;
-	struct repute_io *rio;
-	URITEMP ut;
-	char genurl[REPUTE_URL];
+	struct repute_entry *re;
 
 	assert(rep != NULL);
 	assert(domain != NULL);
 	assert(repout != NULL);
 
-	if (rep->rep_uritemp[0] == '\0')
+	pthread_mutex_lock(&rep->rep_lock);
+
+	re = repute_reserve(rep, domain, time(NULL), &mine);
+	if (re == NULL)
 	{
-		if (repute_get_template(rep) != REPUTE_STAT_OK)
-			return REPUTE_STAT_QUERY;
+		pthread_mutex_unlock(&rep->rep_lock);
+		return REPUTE_STAT_INTERNAL;
 	}
 
-	ut = ut_init();
-	if (ut == NULL)
-		return REPUTE_STAT_INTERNAL;
+	re->re_waiters++;
 
-	if (rep->rep_reporter != 0)
+	if (mine)
 	{
-		snprintf(genurl, sizeof genurl, "%u", rep->rep_reporter);
-		if (ut_keyvalue(ut, UT_KEYTYPE_STRING,
-		                "reporter", genurl) != 0)
-		{
-			ut_destroy(ut);
-			return REPUTE_STAT_INTERNAL;
-		}
+		pthread_mutex_unlock(&rep->rep_lock);
+		repute_run(rep, &re, 1);
+		pthread_mutex_lock(&rep->rep_lock);
 	}
 
-	if (ut_keyvalue(ut, UT_KEYTYPE_STRING,
-	                "subject", (void *) domain) != 0 ||
-#ifdef USE_JANSSON
-	    ut_keyvalue(ut, UT_KEYTYPE_STRING, "format", "json") != 0 ||
-#endif /* USE_JANSSON */
-	    ut_keyvalue(ut, UT_KEYTYPE_STRING,
-	                "scheme", REPUTE_URI_SCHEME) != 0 ||
-	    ut_keyvalue(ut, UT_KEYTYPE_STRING,
-	                "service", (void *) rep->rep_server) != 0 ||
-	    ut_keyvalue(ut, UT_KEYTYPE_STRING,
-	                "application", REPUTE_URI_APPLICATION) != 0 ||
-	    ut_keyvalue(ut, UT_KEYTYPE_STRING,
-	                "assertion", REPUTE_ASSERT_SPAM) != 0)
-	{
-		ut_destroy(ut);
-		return REPUTE_STAT_INTERNAL;
-	}
+	/* somebody else's query for the same domain may be in flight */
+	while (re->re_state == REPUTE_ENTRY_PENDING)
+		pthread_cond_wait(&rep->rep_cond, &rep->rep_lock);
 
-	if (ut_generate(ut, rep->rep_uritemp, genurl, sizeof genurl) <= 0)
+	status = re->re_status;
+	if (status == REPUTE_STAT_OK)
 	{
-		ut_destroy(ut);
-		return REPUTE_STAT_INTERNAL;
+		*repout = re->re_rep;
+		if (confout != NULL)
+			*confout = re->re_conf;
+		if (sampout != NULL)
+			*sampout = re->re_samples;
+		if (whenout != NULL)
+			*whenout = re->re_when;
+		if (limitout != NULL)
+			*limitout = re->re_limit;
 	}
 
-	ut_destroy(ut);
+	re->re_waiters--;
 
-	rio = repute_get_io(rep);
-	if (rio == NULL)
+	pthread_mutex_unlock(&rep->rep_lock);
+
+	return status;
+}
+
+/*
+**  REPUTE_PREFETCH -- query a REPUTE server for several domains at once
+**
+**  Parameters:
+**  	rep -- REPUTE handle
+**  	domains -- domains of interest
+**  	ndomains -- number of domains at "domains"
+**
+**  Return value:
+**  	A REPUTE_STAT_* constant.
+**
+**  Notes:
+**  	All queries not already cached or in flight are issued
+**  	concurrently; their replies are cached so that subsequent
+**  	repute_query() calls for these domains return without any I/O.
+**  	With a cache TTL of 0 nothing would be kept for those calls,
+**  	so this does nothing.
+*/
+
+REPUTE_STAT
+repute_prefetch(REPUTE rep, const char **domains, unsigned int ndomains)
+{
+	_Bool mine;
+	unsigned int c;
+	unsigned int n = 0;
+	time_t now;
+	struct repute_entry *re;
+	struct repute_entry **entries;
+
+	assert(rep != NULL);
+	assert(domains != NULL);
+
+	if (ndomains == 0)
+		return REPUTE_STAT_OK;
+
+	entries = malloc(sizeof(struct repute_entry *) * ndomains);
+	if (entries == NULL)
 		return REPUTE_STAT_INTERNAL;
 
-	status = repute_doquery(rio, genurl);
-	if (status != REPUTE_STAT_OK)
+	(void) time(&now);
+
+	pthread_mutex_lock(&rep->rep_lock);
+
+	if (rep->rep_cachettl == 0)
 	{
-		repute_get_error(rio, rep->rep_error, sizeof rep->rep_error);
-		repute_put_io(rep, rio);
-		return status;
+		pthread_mutex_unlock(&rep->rep_lock);
+		free(entries);
+		return REPUTE_STAT_OK;
 	}
 
-	status = repute_parse(rio->repute_buf, rio->repute_offset,
-	                      &reputation, &conf, &samples, &limit, &when);
-	if (status != REPUTE_STAT_OK)
+	for (c = 0; c < ndomains; c++)
 	{
-		snprintf(rep->rep_error, sizeof rep->rep_error,
-		         "error parsing reply");
-		repute_put_io(rep, rio);
-		return status;
+		re = repute_reserve(rep, domains[c], now, &mine);
+		if (re != NULL && mine)
+			entries[n++] = re;
 	}
 
-	*repout = reputation;
-	if (confout != NULL)
-		*confout = conf;
-	if (sampout != NULL)
-		*sampout = samples;
-	if (whenout != NULL)
-		*whenout = when;
-	if (limitout != NULL)
-		*limitout = limit;
+	pthread_mutex_unlock(&rep->rep_lock);
 
-	repute_put_io(rep, rio);
+	if (n > 0)
+		repute_run(rep, entries, n);
+
+	free(entries);
 
 	return REPUTE_STAT_OK;
 }
@@ -840,3 +1401,29 @@ repute_set_timeout(long t)
 {
 	timeout = t;
 }
+
+/*
+**  REPUTE_SET_CACHETTL -- set a REPUTE handle's reply cache lifetimes
+**
+**  Parameters:
+**  	rep -- REPUTE handle
+**  	ttl -- lifetime of cached replies, in seconds; 0 disables caching
+**  	negttl -- lifetime of cached replies that couldn't be parsed
+**
+**  Return value:
+**  	None.
+**
+**  Notes:
+**  	Applies to replies received after the call.
+*/
+
+void
+repute_set_cachettl(REPUTE rep, unsigned int ttl, unsigned int negttl)
+{
+	assert(rep != NULL);
+
+	pthread_mutex_lock(&rep->rep_lock);
+	rep->rep_cachettl = ttl;
+	rep->rep_negttl = negttl;
+	pthread_mutex_unlock(&rep->rep_lock);
+}
@@ -24,7 +24,8 @@
 #define	REPUTE_STAT_PARSE	2	/* parse failure */
 #define	REPUTE_STAT_QUERY	3	/* query failure */
 
-#define	REPUTE_CACHE		86400	/* XXX -- make this configurable */
+#define	REPUTE_CACHE		86400	/* default reply cache TTL */
+#define	REPUTE_NEGCACHE		60	/* default TTL for unparseable replies */
 
 typedef int REPUTE_STAT;
 
@@ -34,7 +35,7 @@ typedef int REPUTE_STAT;
 
 #define	REPUTE_URI_APPLICATION	"email-id"
 #define	REPUTE_URI_SCHEME	"http"
-#define	REPUTE_URI_TEMPLATE	"{scheme}://{service}/.well-known/repute-template"
+#define	REPUTE_URI_TEMPLATE	"{scheme}://{+service}/.well-known/repute-template"
 
 #define	REPUTE_APPLICATION	"application"
 #define	REPUTE_REPUTONS		"reputons"
@@ -62,9 +63,11 @@ extern const char * repute_curlversion(REPUTE);
 extern const char *repute_error(REPUTE);
 extern void repute_init(void);
 extern REPUTE repute_new(const char *, unsigned int);
+extern REPUTE_STAT repute_prefetch(REPUTE, const char **, unsigned int);
 extern REPUTE_STAT repute_query(REPUTE, const char *, float *,
                                 float *, unsigned long *, unsigned long *,
                                 time_t *);
+extern void repute_set_cachettl(REPUTE, unsigned int, unsigned int);
 extern void repute_set_timeout(long);
 extern void repute_useragent(REPUTE, const char *);
 